@@ -65,7 +65,12 @@ typedef enum {
     STRINGPREP_MALLOC_ERROR = 201
 } Stringprep_rc;
 
-enum Stringprep_profile_flags { STRINGPREP_NO_NFKC = 1, STRINGPREP_NO_BIDI = 2, STRINGPREP_NO_UNASSIGNED = 4 };
+enum Stringprep_profile_flags {
+    STRINGPREP_NO_NFKC       = 1,
+    STRINGPREP_NO_BIDI       = 2,
+    STRINGPREP_NO_UNASSIGNED = 4,
+    STRINGPREP_NO_ASCII_PATH = 8 /* always run the generic code, e.g. to compare with the ASCII fast path */
+};
 
 /* Steps in a stringprep profile. */
 typedef enum {
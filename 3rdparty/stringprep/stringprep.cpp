@@ -271,6 +271,128 @@ int stringprep_4i(QString &input, Stringprep_profile_flags flags, const Stringpr
     return STRINGPREP_OK;
 }
 
+/* ASCII fast path.
+ *
+ * Nearly everything we prepare (JIDs, SASL user names) is plain ASCII. NFKC and the bidi rules are
+ * no-ops for ASCII, so the whole profile boils down to a 128 entry table, telling for every char what
+ * it maps to or that it's prohibited. The tables are computed from the profile itself on first use,
+ * so they can't get out of sync with the generic code.
+ */
+enum { ASCII_REMOVED = 0x100, ASCII_PROHIBITED = 0x101, ASCII_SLOW = 0x102 };
+
+struct Stringprep_ascii_table {
+    explicit Stringprep_ascii_table(const Stringprep_profile *profile)
+    {
+        for (uint32_t c = 0; c < 128; c++)
+            map[c] = prepare(c, profile);
+    }
+
+    static ushort prepare(uint32_t c, const Stringprep_profile *profile)
+    {
+        bool removed = false;
+        for (size_t i = 0; profile[i].operation; i++) {
+            const Stringprep_profile &step = profile[i];
+            switch (step.operation) {
+            case STRINGPREP_MAP_TABLE: {
+                if (removed || UNAPPLICAPLEFLAGS(0, step.flags))
+                    break;
+                std::ptrdiff_t pos = stringprep_find_character_in_table(c, step.table, step.table_size);
+                if (pos == -1)
+                    break;
+                const uint32_t *m = step.table[pos].map;
+                if (m[0] == 0)
+                    removed = true;
+                else if (m[0] < 128 && m[1] == 0)
+                    c = m[0];
+                else
+                    return ASCII_SLOW;
+                break;
+            }
+            case STRINGPREP_PROHIBIT_TABLE:
+                if (!removed && stringprep_find_character_in_table(c, step.table, step.table_size) != -1)
+                    return ASCII_PROHIBITED;
+                break;
+            case STRINGPREP_BIDI_PROHIBIT_TABLE:
+            case STRINGPREP_BIDI_RAL_TABLE:
+                // bidi errors have their own codes, let the generic code report them
+                if (!removed && stringprep_find_character_in_table(c, step.table, step.table_size) != -1)
+                    return ASCII_SLOW;
+                break;
+            case STRINGPREP_NFKC:
+            case STRINGPREP_BIDI:
+            case STRINGPREP_BIDI_L_TABLE:
+            case STRINGPREP_UNASSIGNED_TABLE: /* only checked with STRINGPREP_NO_UNASSIGNED */
+                break;
+            default:
+                return ASCII_SLOW;
+            }
+        }
+        return removed ? ushort(ASCII_REMOVED) : ushort(c);
+    }
+
+    ushort map[128];
+};
+
+static const Stringprep_ascii_table *stringprep_ascii_table(Stringprep_profile_flags flags,
+                                                            const Stringprep_profile *profile)
+{
+    if (flags != 0)
+        return nullptr;
+    if (profile == stringprep_nameprep) {
+        static const Stringprep_ascii_table table(stringprep_nameprep);
+        return &table;
+    }
+    if (profile == stringprep_xmpp_nodeprep) {
+        static const Stringprep_ascii_table table(stringprep_xmpp_nodeprep);
+        return &table;
+    }
+    if (profile == stringprep_xmpp_resourceprep) {
+        static const Stringprep_ascii_table table(stringprep_xmpp_resourceprep);
+        return &table;
+    }
+    if (profile == stringprep_saslprep) {
+        static const Stringprep_ascii_table table(stringprep_saslprep);
+        return &table;
+    }
+    return nullptr;
+}
+
+/* Returns -1 if the generic code has to do the job */
+static int stringprep_ascii(QString &input, const Stringprep_ascii_table &table)
+{
+    const ushort *s   = input.utf16();
+    const int     len = int(input.size());
+
+    // an OR over the whole string is cheap and vectorizable, so check for non-ASCII chars upfront
+    ushort bits = 0;
+    for (int i = 0; i < len; i++)
+        bits |= s[i];
+    if (bits & 0xff80)
+        return -1;
+
+    bool changed = false;
+    for (int i = 0; i < len; i++) {
+        ushort m = table.map[s[i]];
+        if (m == ASCII_PROHIBITED)
+            return STRINGPREP_CONTAINS_PROHIBITED;
+        if (m == ASCII_SLOW)
+            return -1;
+        changed |= (m != s[i]);
+    }
+    if (!changed)
+        return STRINGPREP_OK;
+
+    QString out;
+    out.reserve(len);
+    for (int i = 0; i < len; i++) {
+        ushort m = table.map[s[i]];
+        if (m != ASCII_REMOVED)
+            out += QChar(m);
+    }
+    input = out;
+    return STRINGPREP_OK;
+}
+
 /**
  * stringprep:
  * @in: input/ouput array with string to prepare.
@@ -300,7 +422,14 @@ int stringprep_4i(QString &input, Stringprep_profile_flags flags, const Stringpr
  **/
 int stringprep(QString &input, Stringprep_profile_flags flags, const Stringprep_profile *profile)
 {
-    int rc = stringprep_4i(input, flags, profile);
+    const Stringprep_ascii_table *table = stringprep_ascii_table(flags, profile);
+    if (table) {
+        int rc = stringprep_ascii(input, *table);
+        if (rc != -1)
+            return rc;
+    }
+
+    int rc = stringprep_4i(input, Stringprep_profile_flags(flags & ~STRINGPREP_NO_ASCII_PATH), profile);
     if (rc != STRINGPREP_OK) {
         return rc;
     }
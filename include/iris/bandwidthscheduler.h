@@ -0,0 +1 @@
+#include "irisnet/corelib/bandwidthscheduler.h"
@@ -0,0 +1 @@
+#include "irisnet/noncore/cutestuff/bosh.h"
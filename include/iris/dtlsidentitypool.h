@@ -0,0 +1 @@
+#include "irisnet/noncore/dtlsidentitypool.h"
@@ -0,0 +1 @@
+#include "xmpp/xmpp-im/filesink.h"
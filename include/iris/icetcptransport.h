@@ -0,0 +1 @@
+#include "irisnet/noncore/icetcptransport.h"
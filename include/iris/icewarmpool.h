@@ -0,0 +1 @@
+#include "irisnet/noncore/icewarmpool.h"
@@ -0,0 +1 @@
+#include "irisnet/corelib/metrics.h"
@@ -0,0 +1 @@
+#include "irisnet/noncore/natbehavior.h"
@@ -0,0 +1 @@
+#include "irisnet/noncore/cutestuff/socksrelay.h"
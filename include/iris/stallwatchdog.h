@@ -0,0 +1 @@
+#include "irisnet/corelib/stallwatchdog.h"
@@ -0,0 +1 @@
+#include "xmpp/xmpp-core/streamrecorder.h"
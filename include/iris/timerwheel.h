@@ -0,0 +1 @@
+#include "xmpp/xmpp-core/timerwheel.h"
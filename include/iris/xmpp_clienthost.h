@@ -0,0 +1 @@
+#include "xmpp/xmpp-im/xmpp_clienthost.h"
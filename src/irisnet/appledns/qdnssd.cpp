@@ -28,6 +28,12 @@
 #include <netinet/in.h>
 #endif
 
+// how long a resolved instance is served from the cache, unless its browse says it went away earlier
+#define RESOLVE_CACHE_TIME 60000
+
+// resolved instances kept at most
+#define RESOLVE_CACHE_SIZE 256
+
 namespace {
 // safeobj stuff, from qca
 void releaseAndDeleteLater(QObject *owner, QObject *obj)
@@ -202,14 +208,17 @@ public:
         int                 _type;
         int                 _id;
         ServiceRef         *_sdref;
+        bool                _shared; // a subordinate of the shared connection, no socket of its own
         int                 _sockfd;
         SafeSocketNotifier *_sn_read;
         SafeTimer          *_errorTrigger;
+        SafeTimer          *_cachedTrigger; // a resolve answered from the cache
 
         bool                       _doSignal;
         LowLevelError              _lowLevelError;
         QList<QDnsSd::Record>      _queryRecords;
         QList<QDnsSd::BrowseEntry> _browseEntries;
+        QByteArray                 _resolveKey; // the instance, for the cache
         QByteArray                 _resolveFullName;
         QByteArray                 _resolveHost;
         int                        _resolvePort;
@@ -220,7 +229,8 @@ public:
         QList<SubRecord *> _subRecords;
 
         Request(Private *self) :
-            _self(self), _id(-1), _sdref(0), _sockfd(-1), _sn_read(0), _errorTrigger(0), _doSignal(false)
+            _self(self), _id(-1), _sdref(0), _shared(false), _sockfd(-1), _sn_read(0), _errorTrigger(0),
+            _cachedTrigger(0), _doSignal(false)
         {
         }
 
@@ -228,6 +238,7 @@ public:
         {
             qDeleteAll(_subRecords);
 
+            delete _cachedTrigger;
             delete _errorTrigger;
             delete _sn_read;
             delete _sdref;
@@ -244,14 +255,122 @@ public:
         }
     };
 
+    class CachedResolve {
+    public:
+        QDnsSd::ResolveResult result;
+        QElapsedTimer         age;
+    };
+
     QHash<int, Request *>                  _requestsById;
     QHash<SafeSocketNotifier *, Request *> _requestsBySocket;
     QHash<SafeTimer *, Request *>          _requestsByTimer;
     QHash<int, Request *>                  _requestsByRecId;
+    QList<int>                             _signalled; // shared requests the last callbacks had something for
+    QHash<QByteArray, CachedResolve>       _resolveCache;
+
+    // kDNSServiceFlagsShareConnection. the queries, browses and resolves all go over one daemon socket with one
+    //   notifier, instead of a socket each
+    ServiceRef         *_conn;
+    SafeSocketNotifier *_conn_sn;
+    bool                _connUnsupported; // e.g. the avahi compat library, every request connects on its own
+
+    Private(QDnsSd *_q) : QObject(_q), q(_q), _conn(0), _conn_sn(0), _connUnsupported(false) { }
+
+    ~Private()
+    {
+        // the subordinate refs go before the connection
+        qDeleteAll(_requestsById);
+        dropConnection();
+    }
+
+    ServiceRef *connection()
+    {
+        if (_conn || _connUnsupported)
+            return _conn;
 
-    Private(QDnsSd *_q) : QObject(_q), q(_q) { }
+        ServiceRef         *conn = new ServiceRef;
+        DNSServiceErrorType err  = DNSServiceCreateConnection(conn->data());
+        if (err != kDNSServiceErr_NoError) {
+            delete conn;
+            if (err == kDNSServiceErr_Unsupported)
+                _connUnsupported = true;
+            return 0;
+        }
+        conn->setInitialized();
+
+        int sockfd = DNSServiceRefSockFD(*(conn->data()));
+        if (sockfd == -1) {
+            delete conn;
+            return 0;
+        }
+
+        _conn    = conn;
+        _conn_sn = new SafeSocketNotifier(sockfd, QSocketNotifier::Read, this);
+        connect(_conn_sn, SIGNAL(activated(int)), SLOT(conn_activated()));
+        return _conn;
+    }
+
+    void dropConnection()
+    {
+        delete _conn_sn;
+        _conn_sn = 0;
+        delete _conn;
+        _conn = 0;
+    }
 
-    ~Private() { qDeleteAll(_requestsById); }
+    // points the request to the shared connection if there is one. returns the flag its call needs then
+    DNSServiceFlags shareConnection(Request *req)
+    {
+        ServiceRef *conn = connection();
+        if (!conn)
+            return 0;
+
+        *(req->_sdref->data()) = *(conn->data());
+        req->_shared           = true;
+        return kDNSServiceFlagsShareConnection;
+    }
+
+    // nothing to open for a shared request, the connection's notifier serves it
+    void startShared(Request *req)
+    {
+        req->_sdref->setInitialized();
+        _requestsById.insert(req->_id, req);
+    }
+
+    void markSignalled(Request *req)
+    {
+        if (req->_shared && !_signalled.contains(req->_id))
+            _signalled += req->_id;
+    }
+
+    // DNS names are case-insensitive, so is the key
+    static QByteArray instanceKey(const QByteArray &serviceName, const QByteArray &serviceType,
+                                  const QByteArray &domain)
+    {
+        char buf[kDNSServiceMaxDomainName];
+        if (DNSServiceConstructFullName(buf, serviceName.constData(), serviceType.constData(), domain.constData())
+            != 0)
+            return QByteArray();
+        return QByteArray(buf).toLower();
+    }
+
+    void cacheResolve(const QByteArray &key, const QDnsSd::ResolveResult &r)
+    {
+        if (_resolveCache.size() >= RESOLVE_CACHE_SIZE) {
+            for (auto it = _resolveCache.begin(); it != _resolveCache.end();) {
+                if (it->age.hasExpired(RESOLVE_CACHE_TIME))
+                    it = _resolveCache.erase(it);
+                else
+                    ++it;
+            }
+            if (_resolveCache.size() >= RESOLVE_CACHE_SIZE)
+                _resolveCache.erase(_resolveCache.begin());
+        }
+
+        CachedResolve &c = _resolveCache[key];
+        c.result         = r;
+        c.age.start();
+    }
 
     void setDelayedError(Request *req, const LowLevelError &lowLevelError)
     {
@@ -275,6 +394,9 @@ public:
             _requestsByRecId.remove(srec->_id);
         if (req->_errorTrigger)
             _requestsByTimer.remove(req->_errorTrigger);
+        if (req->_cachedTrigger)
+            _requestsByTimer.remove(req->_cachedTrigger);
+        _signalled.removeOne(req->_id);
         if (req->_sn_read)
             _requestsBySocket.remove(req->_sn_read);
         _requestsById.remove(req->_id);
@@ -298,14 +420,19 @@ public:
         req->_id     = id;
         req->_sdref  = new ServiceRef;
 
-        DNSServiceErrorType err
-            = DNSServiceQueryRecord(req->_sdref->data(), kDNSServiceFlagsLongLivedQuery, 0, name.constData(), qType,
-                                    kDNSServiceClass_IN, cb_queryRecordReply, req);
+        DNSServiceFlags     flags = kDNSServiceFlagsLongLivedQuery | shareConnection(req);
+        DNSServiceErrorType err   = DNSServiceQueryRecord(req->_sdref->data(), flags, 0, name.constData(), qType,
+                                                          kDNSServiceClass_IN, cb_queryRecordReply, req);
         if (err != kDNSServiceErr_NoError) {
             setDelayedError(req, LowLevelError("DNSServiceQueryRecord", err));
             return id;
         }
 
+        if (req->_shared) {
+            startShared(req);
+            return id;
+        }
+
         req->_sdref->setInitialized();
 
         int sockfd = DNSServiceRefSockFD(*(req->_sdref->data()));
@@ -332,13 +459,19 @@ public:
         req->_id     = id;
         req->_sdref  = new ServiceRef;
 
-        DNSServiceErrorType err = DNSServiceBrowse(req->_sdref->data(), 0, 0, serviceType.constData(),
-                                                   !domain.isEmpty() ? domain.constData() : NULL, cb_browseReply, req);
+        DNSServiceErrorType err
+            = DNSServiceBrowse(req->_sdref->data(), shareConnection(req), 0, serviceType.constData(),
+                               !domain.isEmpty() ? domain.constData() : NULL, cb_browseReply, req);
         if (err != kDNSServiceErr_NoError) {
             setDelayedError(req, LowLevelError("DNSServiceBrowse", err));
             return id;
         }
 
+        if (req->_shared) {
+            startShared(req);
+            return id;
+        }
+
         req->_sdref->setInitialized();
 
         int sockfd = DNSServiceRefSockFD(*(req->_sdref->data()));
@@ -363,16 +496,45 @@ public:
         Request *req = new Request(this);
         req->_type   = Request::Resolve;
         req->_id     = id;
-        req->_sdref  = new ServiceRef;
+
+        // a known instance needs no daemon round trip. the answer still comes later, like the daemon's would
+        req->_resolveKey = instanceKey(serviceName, serviceType, domain);
+        auto it          = _resolveCache.find(req->_resolveKey);
+        if (it != _resolveCache.end() && it->age.hasExpired(RESOLVE_CACHE_TIME)) {
+            _resolveCache.erase(it);
+            it = _resolveCache.end();
+        }
+        if (it != _resolveCache.end()) {
+            req->_resolveFullName  = it->result.fullName;
+            req->_resolveHost      = it->result.hostTarget;
+            req->_resolvePort      = it->result.port;
+            req->_resolveTxtRecord = it->result.txtRecord;
+
+            req->_cachedTrigger = new SafeTimer(this);
+            connect(req->_cachedTrigger, SIGNAL(timeout()), SLOT(doCachedResolve()));
+            req->_cachedTrigger->setSingleShot(true);
+            _requestsByTimer.insert(req->_cachedTrigger, req);
+            _requestsById.insert(id, req);
+            req->_cachedTrigger->start();
+            return id;
+        }
+
+        req->_sdref = new ServiceRef;
 
         DNSServiceErrorType err
-            = DNSServiceResolve(req->_sdref->data(), 0, 0, serviceName.constData(), serviceType.constData(),
-                                domain.constData(), (DNSServiceResolveReply)cb_resolveReply, req);
+            = DNSServiceResolve(req->_sdref->data(), shareConnection(req), 0, serviceName.constData(),
+                                serviceType.constData(), domain.constData(), (DNSServiceResolveReply)cb_resolveReply,
+                                req);
         if (err != kDNSServiceErr_NoError) {
             setDelayedError(req, LowLevelError("DNSServiceResolve", err));
             return id;
         }
 
+        if (req->_shared) {
+            startShared(req);
+            return id;
+        }
+
         req->_sdref->setInitialized();
 
         int sockfd = DNSServiceRefSockFD(*(req->_sdref->data()));
@@ -526,9 +688,70 @@ private slots:
         if (!req)
             return;
 
-        int id = req->_id;
-
         DNSServiceErrorType err = DNSServiceProcessResult(*(req->_sdref->data()));
+        report(req, err);
+    }
+
+    void conn_activated()
+    {
+        QPointer<QObject> self = this;
+
+        DNSServiceErrorType err = DNSServiceProcessResult(*(_conn->data()));
+        if (err != kDNSServiceErr_NoError) {
+            // the daemon connection is broken, and every request on it with it. a new one is made for the
+            //   next requests
+            QList<Request *> shared;
+            for (Request *req : std::as_const(_requestsById)) {
+                if (req->_shared)
+                    shared += req;
+            }
+            QList<int> ids;
+            for (Request *req : std::as_const(shared)) {
+                ids += req->_id;
+                // their refs can't outlive the connection, but the reports need the requests
+                delete req->_sdref;
+                req->_sdref = 0;
+            }
+            dropConnection();
+            for (int id : std::as_const(ids)) {
+                Request *req = _requestsById.value(id);
+                if (!req)
+                    continue;
+                report(req, err);
+                if (!self)
+                    return;
+            }
+            return;
+        }
+
+        // one reply may have been for any of the requests on the connection
+        while (!_signalled.isEmpty()) {
+            Request *req = _requestsById.value(_signalled.takeFirst());
+            if (!req)
+                continue;
+            report(req, kDNSServiceErr_NoError);
+            if (!self)
+                return;
+        }
+    }
+
+    void doCachedResolve()
+    {
+        SafeTimer *t   = static_cast<SafeTimer *>(sender());
+        Request   *req = _requestsByTimer.value(t);
+        if (!req)
+            return;
+
+        req->_doSignal = true;
+        report(req, kDNSServiceErr_NoError);
+    }
+
+private:
+    // emits what the request has to report after err or the callbacks. it might be deleted then
+    void report(Request *req, DNSServiceErrorType err)
+    {
+        int id   = req->_id;
+        int type = req->_type;
 
         // do error if the above function returns an error, or if we
         //   collected an error during a callback
@@ -546,17 +769,17 @@ private slots:
 
             removeRequest(req);
 
-            if (req->_type == Request::Query) {
+            if (type == Request::Query) {
                 QDnsSd::QueryResult r;
                 r.success       = false;
                 r.lowLevelError = lowLevelError;
                 emit q->queryResult(id, r);
-            } else if (req->_type == Request::Browse) {
+            } else if (type == Request::Browse) {
                 QDnsSd::BrowseResult r;
                 r.success       = false;
                 r.lowLevelError = lowLevelError;
                 emit q->browseResult(id, r);
-            } else if (req->_type == Request::Resolve) {
+            } else if (type == Request::Resolve) {
                 QDnsSd::ResolveResult r;
                 r.success       = false;
                 r.lowLevelError = lowLevelError;
@@ -606,6 +829,9 @@ private slots:
                 r.txtRecord    = req->_resolveTxtRecord;
                 req->_doSignal = false;
 
+                if (!req->_cachedTrigger && !req->_resolveKey.isEmpty())
+                    cacheResolve(req->_resolveKey, r);
+
                 // there is only one response
                 removeRequest(req);
 
@@ -624,6 +850,7 @@ private slots:
         }
     }
 
+private slots:
     void doError()
     {
         SafeTimer *t   = static_cast<SafeTimer *>(sender());
@@ -712,6 +939,7 @@ private:
         if (errorCode != kDNSServiceErr_NoError) {
             req->_doSignal      = true;
             req->_lowLevelError = LowLevelError("DNSServiceQueryRecordReply", errorCode);
+            markSignalled(req);
             return;
         }
 
@@ -723,8 +951,10 @@ private:
         rec.ttl    = ttl;
         req->_queryRecords += rec;
 
-        if (!(flags & kDNSServiceFlagsMoreComing))
+        if (!(flags & kDNSServiceFlagsMoreComing)) {
             req->_doSignal = true;
+            markSignalled(req);
+        }
     }
 
     void handle_browseReply(Request *req, DNSServiceFlags flags, DNSServiceErrorType errorCode, const char *serviceName,
@@ -733,6 +963,7 @@ private:
         if (errorCode != kDNSServiceErr_NoError) {
             req->_doSignal      = true;
             req->_lowLevelError = LowLevelError("DNSServiceBrowseReply", errorCode);
+            markSignalled(req);
             return;
         }
 
@@ -743,8 +974,14 @@ private:
         e.replyDomain = QByteArray(replyDomain);
         req->_browseEntries += e;
 
-        if (!(flags & kDNSServiceFlagsMoreComing))
+        // whatever was resolved of it is stale now
+        if (!e.added)
+            _resolveCache.remove(instanceKey(e.serviceName, e.serviceType, e.replyDomain));
+
+        if (!(flags & kDNSServiceFlagsMoreComing)) {
             req->_doSignal = true;
+            markSignalled(req);
+        }
     }
 
     void handle_resolveReply(Request *req, DNSServiceErrorType errorCode, const char *fullname, const char *hosttarget,
@@ -753,6 +990,7 @@ private:
         if (errorCode != kDNSServiceErr_NoError) {
             req->_doSignal      = true;
             req->_lowLevelError = LowLevelError("DNSServiceResolveReply", errorCode);
+            markSignalled(req);
             return;
         }
 
@@ -762,6 +1000,7 @@ private:
         req->_resolveTxtRecord = QByteArray((const char *)txtRecord, txtLen);
 
         req->_doSignal = true;
+        markSignalled(req);
     }
 
     void handle_regReply(Request *req, DNSServiceErrorType errorCode, const char *name, const char *regtype,
@@ -20,6 +20,7 @@
 
 #include "netnames.h"
 #include "objectsession.h"
+#include "sharedtimer.h"
 
 namespace XMPP {
 class AddressResolver::Private : public QObject {
@@ -37,7 +38,7 @@ public:
     bool                done4;
     QList<QHostAddress> addrs6;
     QList<QHostAddress> addrs4;
-    QTimer             *opTimer;
+    SharedTimer        *opTimer;
 
     Private(AddressResolver *_q) : QObject(_q), q(_q), sess(this), req6(this), req4(this)
     {
@@ -47,7 +48,7 @@ public:
         connect(&req4, SIGNAL(resultsReady(QList<XMPP::NameRecord>)), SLOT(req4_resultsReady(QList<XMPP::NameRecord>)));
         connect(&req4, SIGNAL(error(XMPP::NameResolver::Error)), SLOT(req4_error(XMPP::NameResolver::Error)));
 
-        opTimer = new QTimer(this);
+        opTimer = new SharedTimer(this);
         connect(opTimer, SIGNAL(timeout()), SLOT(op_timeout()));
         opTimer->setSingleShot(true);
     }
@@ -0,0 +1,161 @@
+/*
+ * bandwidthscheduler.cpp - one upload rate shared by all the transfers
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "bandwidthscheduler.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QList>
+#include <QPointer>
+#include <QThread>
+#include <QTimer>
+
+#include <limits>
+
+namespace XMPP {
+
+namespace {
+    QPointer<BandwidthScheduler> scheduler;
+}
+
+class BandwidthScheduler::Private {
+public:
+    qint64                 rate     = 0;
+    int                    reserved = BANDWIDTH_RESERVED;
+    QList<BandwidthFlow *> flows;
+    QTimer                 timer;
+    QElapsedTimer          sinceTick;
+
+    void arm()
+    {
+        if (timer.isActive())
+            return;
+        sinceTick.start();
+        timer.start();
+    }
+
+    // the flows which ran out get the budget of the tick, by weight
+    void tick()
+    {
+        qint64 budget = rate * (100 - reserved) / 100 * qMax(qint64(1), sinceTick.restart()) / 1000;
+
+        QList<QPointer<BandwidthFlow>> due;
+        qint64                         weights = 0;
+        for (auto f : std::as_const(flows)) {
+            if (f->waiting) {
+                due.append(f);
+                weights += f->w;
+            }
+        }
+        if (due.isEmpty()) {
+            timer.stop();
+            return;
+        }
+        for (auto const &f : std::as_const(due)) {
+            qint64 share = budget * f->w / weights;
+            f->tokens    = qMin(f->tokens + share, 2 * share); // no savings beyond the next tick
+            f->waiting   = false;
+        }
+        release(due);
+    }
+
+    void release(const QList<QPointer<BandwidthFlow>> &due)
+    {
+        for (auto const &f : due) {
+            if (f)
+                emit f->ready(); // may send, consume and even delete flows
+        }
+    }
+};
+
+BandwidthScheduler::BandwidthScheduler() : d(new Private)
+{
+    d->timer.setInterval(BANDWIDTH_TICK);
+    d->timer.setTimerType(Qt::PreciseTimer);
+    connect(&d->timer, &QTimer::timeout, this, [this]() { d->tick(); });
+}
+
+BandwidthScheduler::~BandwidthScheduler() { delete d; }
+
+BandwidthScheduler *BandwidthScheduler::instance()
+{
+    if (!scheduler) {
+        scheduler = new BandwidthScheduler;
+        auto app  = QCoreApplication::instance();
+        if (app && app->thread() == QThread::currentThread())
+            scheduler->setParent(app);
+    }
+    return scheduler;
+}
+
+void BandwidthScheduler::setRate(qint64 bytesPerSecond)
+{
+    d->rate = qMax(qint64(0), bytesPerSecond);
+    if (d->rate)
+        return;
+    d->timer.stop();
+    QList<QPointer<BandwidthFlow>> due;
+    for (auto f : std::as_const(d->flows)) {
+        if (f->waiting) {
+            f->waiting = false;
+            due.append(f);
+        }
+    }
+    d->release(due);
+}
+
+qint64 BandwidthScheduler::rate() const { return d->rate; }
+
+void BandwidthScheduler::setReservedShare(int percent) { d->reserved = qBound(0, percent, 90); }
+
+int BandwidthScheduler::reservedShare() const { return d->reserved; }
+
+BandwidthFlow::BandwidthFlow(int weight, QObject *parent) : QObject(parent), w(qMax(1, weight))
+{
+    BandwidthScheduler::instance()->d->flows.append(this);
+}
+
+BandwidthFlow::~BandwidthFlow()
+{
+    if (scheduler)
+        scheduler->d->flows.removeOne(this);
+}
+
+void BandwidthFlow::setWeight(int weight) { w = qMax(1, weight); }
+
+int BandwidthFlow::weight() const { return w; }
+
+qint64 BandwidthFlow::available()
+{
+    if (!scheduler || !scheduler->d->rate)
+        return std::numeric_limits<qint64>::max();
+    if (tokens > 0)
+        return tokens;
+    waiting = true;
+    scheduler->d->arm();
+    return 0;
+}
+
+void BandwidthFlow::consume(qint64 bytes)
+{
+    if (scheduler && scheduler->d->rate)
+        tokens -= bytes;
+}
+
+} // namespace XMPP
@@ -0,0 +1,84 @@
+/*
+ * bandwidthscheduler.h - one upload rate shared by all the transfers
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IRIS_BANDWIDTHSCHEDULER_H
+#define IRIS_BANDWIDTHSCHEDULER_H
+
+#include <QObject>
+
+// msecs between two refills of the budget
+#define BANDWIDTH_TICK 50
+// percent of the rate kept off the transfers by default, for the stanzas of the streams
+#define BANDWIDTH_RESERVED 10
+
+namespace XMPP {
+class BandwidthFlow;
+
+/*
+ * A token bucket for everything the transfers of the process send. Each transfer asks its BandwidthFlow
+ * how much it may send now. Every tick the budget of the last tick is split between the flows which ran
+ * out, by their weights, so a flow which has nothing to send leaves its share to the others. Without a
+ * rate, which is the default, the flows are never held back.
+ * The scheduler lives in the thread which first asks for it and so do the flows.
+ */
+class BandwidthScheduler : public QObject {
+    Q_OBJECT
+public:
+    static BandwidthScheduler *instance();
+
+    void   setRate(qint64 bytesPerSecond); // 0 for unlimited
+    qint64 rate() const;
+    // what the transfers leave to the xmpp streams, in percent of the rate
+    void setReservedShare(int percent);
+    int  reservedShare() const;
+
+private:
+    friend class BandwidthFlow;
+    BandwidthScheduler();
+    ~BandwidthScheduler();
+
+    class Private;
+    Private *d;
+};
+
+class BandwidthFlow : public QObject {
+    Q_OBJECT
+public:
+    BandwidthFlow(int weight = 1, QObject *parent = nullptr);
+    ~BandwidthFlow();
+
+    void setWeight(int weight);
+    int  weight() const;
+
+    // what may be sent now. when it's 0, ready() comes with the next budget
+    qint64 available();
+    void   consume(qint64 bytes);
+
+signals:
+    void ready();
+
+private:
+    friend class BandwidthScheduler;
+    qint64 tokens  = 0;
+    int    w       = 1;
+    bool   waiting = false;
+};
+} // namespace XMPP
+
+#endif // IRIS_BANDWIDTHSCHEDULER_H
@@ -19,6 +19,9 @@
 #include "corelib/irisnetglobal_p.h"
 #include "irisnetplugin.h"
 
+#include <algorithm>
+#include <functional>
+
 namespace XMPP {
 // built-in providers
 #ifdef HAVE_QTNET
@@ -116,22 +119,71 @@ public:
     }
 };
 
+// the provider plugins declare what they can do in their metadata, e.g. {"capabilities": ["names"]}.
+//   without it they are taken for all of it
+static int capabilitiesFromMetaData(const QJsonObject &md)
+{
+    static const QList<QPair<QString, int>> names = { { QStringLiteral("interfaces"), IrisNetInterfaces },
+                                                      { QStringLiteral("gateways"), IrisNetGateways },
+                                                      { QStringLiteral("availability"), IrisNetAvailability },
+                                                      { QStringLiteral("names"), IrisNetNamesInternet },
+                                                      { QStringLiteral("localnames"), IrisNetNamesLocal },
+                                                      { QStringLiteral("services"), IrisNetServices } };
+
+    QJsonValue v = md.value(QLatin1String("MetaData")).toObject().value(QLatin1String("capabilities"));
+    if (!v.isArray())
+        return IrisNetAll;
+    int        caps = 0;
+    const auto list = v.toArray();
+    for (const auto &c : list) {
+        for (const auto &n : names) {
+            if (c.toString() == n.first)
+                caps |= n.second;
+        }
+    }
+    return caps;
+}
+
+static bool isProviderPlugin(const QJsonObject &md)
+{
+    return md.value(QLatin1String("IID")).toString() == QLatin1String(qobject_interface_iid<IrisNetProvider *>());
+}
+
+// knows which providers there are and creates each one when something it can do is asked for the first time.
+//   plugin files are only looked into until then, not loaded
 class PluginManager {
 public:
-    bool                     builtin_done;
-    QStringList              paths;
-    QList<PluginInstance *>  plugins;
-    QList<IrisNetProvider *> providers;
-
-    PluginManager() { builtin_done = false; }
+    class Entry {
+    public:
+        int                                caps = IrisNetAll;
+        std::function<IrisNetProvider *()> create;   // built-in
+        QStaticPlugin                      plugin;   // linked in
+        QString                            fileName; // otherwise
+        bool                               tried    = false;
+        IrisNetProvider                   *provider = nullptr;
+    };
+
+    bool                    builtin_done = false;
+    bool                    static_done  = false;
+    bool                    paths_done   = false;
+    QStringList             paths;
+    QList<Entry>            files;   // the later found first, as they are preferred
+    QList<Entry>            statics; // the same
+    QList<Entry>            builtin;
+    QList<PluginInstance *> plugins; // in order of creation
 
     ~PluginManager() { unload(); }
 
-    bool tryAdd(PluginInstance *i, bool lowPriority = false)
+    void setPaths(const QStringList &list)
+    {
+        paths      = list;
+        paths_done = false;
+    }
+
+    bool tryAdd(PluginInstance *i)
     {
         // is it the right kind of plugin?
-        IrisNetProvider *p = qobject_cast<IrisNetProvider *>(i->instance());
-        if (!p)
+        if (!qobject_cast<IrisNetProvider *>(i->instance()))
             return false;
 
         // make sure we don't have it already
@@ -142,62 +194,106 @@ public:
 
         i->claim();
         plugins += i;
-        if (lowPriority)
-            providers.append(p);
-        else
-            providers.prepend(p);
         return true;
     }
 
-    void addBuiltIn(IrisNetProvider *p)
+    void create(Entry &e)
     {
-        PluginInstance *i = PluginInstance::fromInstance(p);
-        if (!tryAdd(i, true))
+        e.tried           = true;
+        PluginInstance *i = nullptr;
+        if (e.create)
+            i = PluginInstance::fromInstance(e.create());
+        else if (!e.fileName.isEmpty())
+            i = PluginInstance::fromFile(e.fileName);
+        else
+            i = PluginInstance::fromStatic(e.plugin.instance());
+        if (!i)
+            return;
+
+        if (tryAdd(i))
+            e.provider = qobject_cast<IrisNetProvider *>(i->instance());
+        else
             delete i;
     }
 
+    void addBuiltIn(int caps, IrisNetProvider *(*create)())
+    {
+        Entry e;
+        e.caps   = caps;
+        e.create = create;
+        builtin.append(e);
+    }
+
     void scan()
     {
         if (!builtin_done) {
 #ifdef HAVE_QTNET
-            addBuiltIn(irisnet_createQtNetProvider()); // interfaces. crossplatform. no need to reimplement
+            addBuiltIn(IrisNetInterfaces, irisnet_createQtNetProvider); // crossplatform. no need to reimplement
 #endif
 #ifdef Q_OS_UNIX
-            addBuiltIn(irisnet_createUnixNetProvider()); // gateways
+            addBuiltIn(IrisNetGateways, irisnet_createUnixNetProvider);
 #endif
 #ifdef NEED_JDNS
-            addBuiltIn(irisnet_createJDnsProvider());
+            addBuiltIn(IrisNetNamesInternet | IrisNetNamesLocal | IrisNetServices, irisnet_createJDnsProvider);
 #else
-            addBuiltIn(irisnet_createQtNameProvider()); // works with Qt5+ only
+            addBuiltIn(IrisNetNamesInternet, irisnet_createQtNameProvider); // works with Qt5+ only
 #endif
             builtin_done = true;
         }
 
-        QObjectList list = QPluginLoader::staticInstances();
-        for (int n = 0; n < list.count(); ++n) {
-            PluginInstance *i = PluginInstance::fromStatic(list[n]);
-            if (!tryAdd(i))
-                delete i;
+        if (!static_done) {
+            const auto list = QPluginLoader::staticPlugins();
+            for (const QStaticPlugin &p : list) {
+                Entry e;
+                e.plugin = p;
+                e.caps   = capabilitiesFromMetaData(p.metaData());
+                if (isProviderPlugin(p.metaData()))
+                    statics.prepend(e);
+            }
+            static_done = true;
         }
+
+        if (paths_done)
+            return;
+        paths_done = true;
         for (int n = 0; n < paths.count(); ++n) {
             QDir dir(paths[n]);
             if (!dir.exists())
                 continue;
 
-            QStringList entries = dir.entryList();
+            QStringList entries = dir.entryList(QDir::Files);
             for (int k = 0; k < entries.count(); ++k) {
-                QFileInfo fi(dir.filePath(entries[k]));
-                if (!fi.exists())
+                QString fname = dir.filePath(entries[k]);
+                if (std::any_of(files.begin(), files.end(), [&](const Entry &e) { return e.fileName == fname; }))
                     continue;
-                QString         fname = fi.filePath();
-                PluginInstance *i     = PluginInstance::fromFile(fname);
-                if (!i)
+
+                // reads the metadata without loading the library
+                QJsonObject md = QPluginLoader(fname).metaData();
+                if (!isProviderPlugin(md))
                     continue;
+                Entry e;
+                e.fileName = fname;
+                e.caps     = capabilitiesFromMetaData(md);
+                files.prepend(e);
+            }
+        }
+    }
 
-                if (!tryAdd(i))
-                    delete i;
+    QList<IrisNetProvider *> providers(int caps)
+    {
+        scan();
+        QList<IrisNetProvider *> out;
+        for (auto list : { &files, &statics, &builtin }) {
+            for (Entry &e : *list) {
+                if (!(e.caps & caps))
+                    continue;
+                if (!e.tried)
+                    create(e);
+                if (e.provider)
+                    out += e.provider;
             }
         }
+        return out;
     }
 
     void unload()
@@ -209,7 +305,12 @@ public:
         qDeleteAll(revlist);
 
         plugins.clear();
-        providers.clear();
+        for (auto list : { &files, &statics, &builtin }) {
+            for (Entry &e : *list) {
+                e.tried    = false;
+                e.provider = nullptr;
+            }
+        }
     }
 };
 
@@ -218,6 +319,7 @@ public:
     QMutex                        m;
     PluginManager                 pluginManager;
     QList<IrisNetCleanUpFunction> cleanupList;
+    QThread                      *worker = nullptr;
 };
 
 Q_GLOBAL_STATIC(QMutex, global_mutex)
@@ -244,6 +346,12 @@ void deinit()
     while (!global->cleanupList.isEmpty())
         (global->cleanupList.takeFirst())();
 
+    if (global->worker) {
+        global->worker->quit();
+        global->worker->wait();
+        delete global->worker;
+    }
+
     delete global;
     global = nullptr;
 }
@@ -256,7 +364,7 @@ void irisNetSetPluginPaths(const QStringList &paths)
     init();
 
     QMutexLocker locker(&global->m);
-    global->pluginManager.paths = paths;
+    global->pluginManager.setPaths(paths);
 }
 
 void irisNetCleanup()
@@ -273,13 +381,25 @@ void irisNetAddPostRoutine(IrisNetCleanUpFunction func)
     global->cleanupList.prepend(func);
 }
 
-QList<IrisNetProvider *> irisNetProviders()
+QList<IrisNetProvider *> irisNetProviders(int capabilities)
 {
     init();
 
     QMutexLocker locker(&global->m);
-    global->pluginManager.scan();
-    return global->pluginManager.providers;
+    return global->pluginManager.providers(capabilities);
+}
+
+QThread *irisNetWorkerThread()
+{
+    init();
+
+    QMutexLocker locker(&global->m);
+    if (!global->worker) {
+        global->worker = new QThread;
+        global->worker->setObjectName(QStringLiteral("irisnet"));
+        global->worker->start();
+    }
+    return global->worker;
 }
 
 } // namespace XMPP
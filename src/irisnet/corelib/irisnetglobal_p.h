@@ -26,7 +26,21 @@ namespace XMPP {
 typedef void (*IrisNetCleanUpFunction)();
 
 IRISNET_EXPORT void irisNetAddPostRoutine(IrisNetCleanUpFunction func);
-IRISNET_EXPORT QList<IrisNetProvider *> irisNetProviders();
+// what the providers are asked for. only the ones which may have it are created for it
+enum IrisNetCapability {
+    IrisNetInterfaces    = 0x01, // createNetInterfaceProvider()
+    IrisNetGateways      = 0x02, // createNetGatewayProvider()
+    IrisNetAvailability  = 0x04, // createNetAvailabilityProvider()
+    IrisNetNamesInternet = 0x08, // createNameProviderInternet()
+    IrisNetNamesLocal    = 0x10, // createNameProviderLocal()
+    IrisNetServices      = 0x20, // createServiceProvider()
+    IrisNetAll           = 0x3f
+};
+
+IRISNET_EXPORT QList<IrisNetProvider *> irisNetProviders(int capabilities = IrisNetAll);
+// shared by the backends which shouldn't run on the threads of their users. started on first use,
+// stopped after the post routines
+IRISNET_EXPORT QThread *irisNetWorkerThread();
 } // namespace XMPP
 
 #endif // IRISNETGLOBAL_P_H
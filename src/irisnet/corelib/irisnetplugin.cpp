@@ -47,6 +47,12 @@ bool NameProvider::supportsRecordType(int type) const
     return false;
 }
 
+void NameProvider::resolve_setBackground(int id, bool background)
+{
+    Q_UNUSED(id);
+    Q_UNUSED(background);
+}
+
 void NameProvider::resolve_localResultsReady(int id, const QList<XMPP::NameRecord> &results)
 {
     Q_UNUSED(id);
@@ -114,6 +114,9 @@ public:
     virtual int  resolve_start(const QByteArray &name, int qType, bool longLived) = 0;
     virtual void resolve_stop(int id)                                             = 0;
 
+    // nobody waits for the lookup, the others may go first. it's a hint only
+    virtual void resolve_setBackground(int id, bool background);
+
     // transfer from local back to internet
     virtual void resolve_localResultsReady(int id, const QList<XMPP::NameRecord> &results);
     virtual void resolve_localError(int id, XMPP::NameResolver::Error e);
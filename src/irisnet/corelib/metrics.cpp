@@ -0,0 +1,147 @@
+/*
+ * metrics.cpp - process-wide counters and histograms of the hot paths
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "metrics.h"
+
+#include <QtAlgorithms>
+
+#include <atomic>
+
+namespace XMPP {
+
+namespace {
+    struct HistogramSlots {
+        std::atomic<quint64> buckets[METRICS_HISTOGRAM_BUCKETS];
+        std::atomic<quint64> count;
+        std::atomic<quint64> sum;
+    };
+
+    // zeroed before any dynamic initialization, so recording works from static constructors too
+    std::atomic<quint64> counters[Metrics::CounterCount];
+    HistogramSlots       histograms[Metrics::HistogramCount];
+
+    const char *const counterNames[Metrics::CounterCount] = {
+        "stanzas_parsed_total",       "stanzas_serialized_total",
+        "tasks_created_total",        "tasks_destroyed_total",
+        "stream_bytes_in_total",      "stream_bytes_out_total",
+        "tls_bytes_in_total",         "tls_bytes_out_total",
+        "sasl_bytes_in_total",        "sasl_bytes_out_total",
+        "compression_bytes_in_total", "compression_bytes_out_total",
+        "jingle_transfers_total",     "timer_wakeups_total",
+        "timer_timeouts_total",       "event_loop_stalls_total",
+        "stream_stalls_total",        "distribute_stalls_total",
+        "task_stalls_total",          "ice_stalls_total",
+        "file_transfer_stalls_total",
+    };
+
+    const char *const histogramNames[Metrics::HistogramCount] = {
+        "stanza_parse_usecs",      "stanza_serialize_usecs",  "task_lifetime_msecs",
+        "sm_queue_depth",          "sm_ack_rtt_msecs",        "ice_check_rtt_msecs",
+        "jingle_transfer_kibps",   "tls_write_usecs",         "tls_read_usecs",
+        "tls_delay_usecs",         "sasl_write_usecs",        "sasl_read_usecs",
+        "sasl_delay_usecs",        "compression_write_usecs", "compression_read_usecs",
+        "compression_delay_usecs", "event_loop_lag_msecs",    "stall_msecs",
+    };
+
+    int bucketOf(quint64 value)
+    {
+        if (value <= 1)
+            return 0;
+        // the smallest i with value <= 2^i
+        return qMin(64 - int(qCountLeadingZeroBits(value - 1)), METRICS_HISTOGRAM_BUCKETS - 1);
+    }
+}
+
+bool Metrics::isEnabled()
+{
+#ifdef IRIS_METRICS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Metrics::add(Counter counter, quint64 n) { counters[counter].fetch_add(n, std::memory_order_relaxed); }
+
+void Metrics::record(Histogram histogram, quint64 value)
+{
+    auto &h = histograms[histogram];
+    h.buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+quint64 Metrics::counter(Counter counter) { return counters[counter].load(std::memory_order_relaxed); }
+
+Metrics::HistogramData Metrics::histogram(Histogram histogram)
+{
+    // the fields are read one by one, so a snapshot taken while recording may be off by the values in flight
+    HistogramData ret;
+    auto const   &h = histograms[histogram];
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i)
+        ret.buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+    ret.count = h.count.load(std::memory_order_relaxed);
+    ret.sum   = h.sum.load(std::memory_order_relaxed);
+    return ret;
+}
+
+const char *Metrics::name(Counter counter) { return counterNames[counter]; }
+
+const char *Metrics::name(Histogram histogram) { return histogramNames[histogram]; }
+
+void Metrics::reset()
+{
+    for (auto &c : counters)
+        c.store(0, std::memory_order_relaxed);
+    for (auto &h : histograms) {
+        for (auto &b : h.buckets)
+            b.store(0, std::memory_order_relaxed);
+        h.count.store(0, std::memory_order_relaxed);
+        h.sum.store(0, std::memory_order_relaxed);
+    }
+}
+
+QByteArray Metrics::toPrometheus()
+{
+    QByteArray out;
+    out.reserve(4096);
+    for (int i = 0; i < CounterCount; ++i) {
+        QByteArray n = QByteArray("iris_") + counterNames[i];
+        out += "# TYPE " + n + " counter\n";
+        out += n + ' ' + QByteArray::number(counter(Counter(i))) + '\n';
+    }
+    for (int i = 0; i < HistogramCount; ++i) {
+        QByteArray n    = QByteArray("iris_") + histogramNames[i];
+        auto       data = histogram(Histogram(i));
+        out += "# TYPE " + n + " histogram\n";
+        quint64 cumulative = 0;
+        for (int b = 0; b < METRICS_HISTOGRAM_BUCKETS - 1; ++b) {
+            cumulative += data.buckets[b];
+            out += n + "_bucket{le=\"" + QByteArray::number(quint64(1) << b) + "\"} " + QByteArray::number(cumulative)
+                + '\n';
+        }
+        cumulative += data.buckets[METRICS_HISTOGRAM_BUCKETS - 1];
+        out += n + "_bucket{le=\"+Inf\"} " + QByteArray::number(cumulative) + '\n';
+        out += n + "_sum " + QByteArray::number(data.sum) + '\n';
+        out += n + "_count " + QByteArray::number(data.count) + '\n';
+    }
+    return out;
+}
+
+} // namespace XMPP
@@ -0,0 +1,130 @@
+/*
+ * metrics.h - process-wide counters and histograms of the hot paths
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IRIS_METRICS_H
+#define IRIS_METRICS_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+
+// a histogram bucket i counts the values up to 2^i, the last one everything above
+#define METRICS_HISTOGRAM_BUCKETS 32
+
+namespace XMPP {
+/*
+ * What the library spends its time on, summed over all the clients of the process. Recording is a relaxed
+ * atomic add and goes through the IRIS_METRIC_* macros below, which compile to nothing unless the library
+ * is built with IRIS_ENABLE_METRICS. The reading side is always there, it just reports zeroes then.
+ */
+class Metrics {
+public:
+    enum Counter {
+        StanzasParsed,
+        StanzasSerialized,
+        TasksCreated,
+        TasksDestroyed,
+        StreamBytesIn, // SecureStream, the socket side
+        StreamBytesOut,
+        TlsBytesIn, // the network side of a security layer
+        TlsBytesOut,
+        SaslBytesIn,
+        SaslBytesOut,
+        CompressionBytesIn,
+        CompressionBytesOut,
+        JingleTransfers, // finished successfully
+        TimerWakeups,    // of the SharedTimer queues
+        TimerTimeouts,   // delivered by them
+        // StallWatchdog reports, one per component in its order
+        EventLoopStalls,
+        StreamStalls,
+        DistributeStalls,
+        TaskStalls,
+        IceStalls,
+        FileTransferStalls,
+        CounterCount
+    };
+
+    enum Histogram {
+        StanzaParseUsecs,
+        StanzaSerializeUsecs,
+        TaskLifetimeMsecs,
+        SmQueueDepth, // unacknowledged stanzas, sampled on every send
+        SmAckRttMsecs,
+        IceCheckRttMsecs, // from the first request to the success response
+        JingleTransferKiBps,
+        // SecureStream layers: the time spent in a layer itself and how long plain data waits in it to come
+        // out encoded. three per layer, in this order
+        TlsWriteUsecs,
+        TlsReadUsecs,
+        TlsDelayUsecs,
+        SaslWriteUsecs,
+        SaslReadUsecs,
+        SaslDelayUsecs,
+        CompressionWriteUsecs,
+        CompressionReadUsecs,
+        CompressionDelayUsecs,
+        EventLoopLagMsecs, // sampled by StallWatchdog while it's on
+        StallMsecs,        // the handler calls reported by it
+        HistogramCount
+    };
+
+    struct HistogramData {
+        quint64 buckets[METRICS_HISTOGRAM_BUCKETS] = {}; // not cumulative
+        quint64 count                              = 0;
+        quint64 sum                                = 0;
+    };
+
+    // records the usecs it lives
+    class ScopedTimer {
+    public:
+        inline ScopedTimer(Histogram histogram) : target(histogram) { timer.start(); }
+        inline ~ScopedTimer() { record(target, quint64(timer.nsecsElapsed() / 1000)); }
+
+    private:
+        QElapsedTimer timer;
+        Histogram     target;
+    };
+
+    static bool isEnabled(); // built with IRIS_ENABLE_METRICS
+
+    static void add(Counter counter, quint64 n = 1);
+    static void record(Histogram histogram, quint64 value);
+
+    static quint64       counter(Counter counter);
+    static HistogramData histogram(Histogram histogram);
+    static const char   *name(Counter counter);
+    static const char   *name(Histogram histogram);
+    static void          reset();
+
+    // everything in the Prometheus text exposition format, the names prefixed with "iris_"
+    static QByteArray toPrometheus();
+};
+} // namespace XMPP
+
+#ifdef IRIS_METRICS
+#define IRIS_METRIC_ADD(counter, n) XMPP::Metrics::add(XMPP::Metrics::counter, quint64(n))
+#define IRIS_METRIC_RECORD(histogram, value) XMPP::Metrics::record(XMPP::Metrics::histogram, quint64(value))
+#define IRIS_METRIC_SCOPE(histogram) XMPP::Metrics::ScopedTimer irisMetricScope(XMPP::Metrics::histogram)
+#else
+#define IRIS_METRIC_ADD(counter, n)
+#define IRIS_METRIC_RECORD(histogram, value)
+#define IRIS_METRIC_SCOPE(histogram)
+#endif
+
+#endif // IRIS_METRICS_H
@@ -18,26 +18,177 @@
 
 #include "netavailability.h"
 
+#include "corelib/irisnetglobal_p.h"
+#include "irisnetplugin.h"
+#include "netinterface.h"
+
+#include <QRandomGenerator>
+#include <QTimer>
+
+// how long the interfaces have to be quiet before a change is reported, in milliseconds
+#define SETTLE_INTERVAL 1000
+
+#define RECONNECT_MIN_INTERVAL 1000
+#define RECONNECT_MAX_INTERVAL (5 * 60 * 1000)
+
 namespace XMPP {
 class NetAvailability::Private : public QObject {
     Q_OBJECT
 
 public:
-    NetAvailability *q;
+    NetAvailability         *q;
+    NetAvailabilityProvider *c   = nullptr;
+    NetInterfaceManager     *man = nullptr;
+    QList<NetInterface *>    ifaces;
+    QTimer                   settle;
+    bool                     available = true;
+
+    Private(NetAvailability *_q) : QObject(_q), q(_q)
+    {
+        const QList<IrisNetProvider *> list = irisNetProviders(IrisNetAvailability);
+        for (IrisNetProvider *p : list) {
+            c = p->createNetAvailabilityProvider();
+            if (c)
+                break;
+        }
+
+        settle.setSingleShot(true);
+        settle.setInterval(SETTLE_INTERVAL);
+        connect(&settle, &QTimer::timeout, this, &Private::update);
+
+        if (c) {
+            c->setParent(this);
+            connect(c, &NetAvailabilityProvider::updated, &settle, qOverload<>(&QTimer::start));
+            c->start();
+            available = c->isAvailable();
+            return;
+        }
+
+        // no provider, so anything which is up will do
+        man = new NetInterfaceManager(this);
+        connect(man, &NetInterfaceManager::interfaceAvailable, &settle, qOverload<>(&QTimer::start));
+        available = watch();
+    }
 
-    Private(NetAvailability *_q) : QObject(_q), q(_q) { }
+    // returns whether there's an interface at all
+    bool watch()
+    {
+        qDeleteAll(ifaces);
+        ifaces.clear();
+        const QStringList ids = man->interfaces();
+        for (const QString &id : ids) {
+            auto iface = new NetInterface(id, man);
+            connect(iface, &NetInterface::unavailable, &settle, qOverload<>(&QTimer::start));
+            ifaces += iface;
+        }
+        return !ifaces.isEmpty();
+    }
+
+    void update()
+    {
+        bool now = c ? c->isAvailable() : watch();
+        if (now == available)
+            return;
+        available = now;
+        emit q->changed(available);
+    }
 };
 
 NetAvailability::NetAvailability(QObject *parent) : QObject(parent) { d = new Private(this); }
 
 NetAvailability::~NetAvailability() { delete d; }
 
-bool NetAvailability::isAvailable() const
+bool NetAvailability::isAvailable() const { return d->available; }
+
+//----------------------------------------------------------------------------
+// ReconnectScheduler
+//----------------------------------------------------------------------------
+class ReconnectScheduler::Private : public QObject {
+    Q_OBJECT
+
+public:
+    ReconnectScheduler *q;
+    NetAvailability    *net;
+    QTimer              timer;
+    int                 min       = RECONNECT_MIN_INTERVAL;
+    int                 max       = RECONNECT_MAX_INTERVAL;
+    int                 failures  = 0;
+    bool                scheduled = false;
+
+    Private(ReconnectScheduler *_q) : QObject(_q), q(_q)
+    {
+        net = new NetAvailability(this);
+        connect(net, &NetAvailability::changed, this, &Private::net_changed);
+        timer.setSingleShot(true);
+        connect(&timer, &QTimer::timeout, this, &Private::timer_timeout);
+    }
+
+    void arm()
+    {
+        if (!net->isAvailable()) {
+            timer.stop(); // net_changed() will arm it
+            return;
+        }
+        qint64 interval = min;
+        for (int n = 1; n < failures && interval < max; ++n)
+            interval *= 2;
+        int half = int(qMin(interval, qint64(max)) / 2);
+        timer.start(half + QRandomGenerator::global()->bounded(half + 1));
+    }
+
+    void net_changed(bool available)
+    {
+        if (!scheduled)
+            return;
+        if (available) {
+            // the failures were most likely because of the outage, start over
+            failures = 1;
+            arm();
+        } else {
+            timer.stop();
+        }
+    }
+
+    void timer_timeout()
+    {
+        scheduled = false;
+        emit q->reconnect();
+    }
+};
+
+ReconnectScheduler::ReconnectScheduler(QObject *parent) : QObject(parent) { d = new Private(this); }
+
+ReconnectScheduler::~ReconnectScheduler() { delete d; }
+
+void ReconnectScheduler::setIntervals(int min, int max)
+{
+    d->min = qMax(1, min);
+    d->max = qMax(d->min, max);
+}
+
+void ReconnectScheduler::schedule()
 {
-    // TODO
-    return true;
+    d->scheduled = true;
+    ++d->failures;
+    d->arm();
 }
 
+void ReconnectScheduler::reset()
+{
+    stop();
+    d->failures = 0;
+}
+
+void ReconnectScheduler::stop()
+{
+    d->scheduled = false;
+    d->timer.stop();
+}
+
+bool ReconnectScheduler::isScheduled() const { return d->scheduled; }
+
+int ReconnectScheduler::failures() const { return d->failures; }
+
 } // namespace XMPP
 
 #include "netavailability.moc"
@@ -22,7 +22,12 @@
 #include "irisnetglobal.h"
 
 namespace XMPP {
-class NetAvailability : public QObject {
+/*
+ Tells whether the network can be used at all: an interface other than loopback is up and has an address, or
+ whatever the availability provider of a plugin says. The interface tracking behind it is shared by the whole
+ process. changed() comes once per transition, after the interfaces have settled for a moment.
+*/
+class IRISNET_EXPORT NetAvailability : public QObject {
     Q_OBJECT
 
 public:
@@ -34,6 +39,40 @@ public:
 signals:
     void changed(bool available);
 
+private:
+    class Private;
+    friend class Private;
+    Private *d;
+};
+
+/*
+ When to try a connection again. Every failure doubles the wait up to the maximum, and the actual delay is
+ picked at random from the upper half of it, so that the clients of a process (or of many processes) which
+ lost their connections together don't come back all at the same moment. Nothing is tried while the network
+ is down. Once it's back, the attempt comes within the minimum interval.
+*/
+class IRISNET_EXPORT ReconnectScheduler : public QObject {
+    Q_OBJECT
+
+public:
+    ReconnectScheduler(QObject *parent = nullptr);
+    ~ReconnectScheduler();
+
+    // milliseconds. 1 second and 5 minutes by default
+    void setIntervals(int min, int max);
+
+    // the connection failed or was lost, reconnect() will come
+    void schedule();
+    // the connection is fine, start from the minimum after the next failure
+    void reset();
+    void stop();
+
+    bool isScheduled() const;
+    int  failures() const;
+
+signals:
+    void reconnect();
+
 private:
     class Private;
     friend class Private;
@@ -22,7 +22,9 @@
 #include "irisnetplugin.h"
 
 #include <QDebug>
+#include <QHash>
 #include <QPointer>
+#include <QSharedPointer>
 #include <QWaitCondition>
 
 namespace XMPP {
@@ -32,16 +34,25 @@ namespace XMPP {
 class NetTracker : public QObject {
     Q_OBJECT
 public:
-    QList<NetInterfaceProvider::Info> getInterfaces()
+    // what the interfaces were at some point. a new one is made on every change, never modified afterwards
+    class Snapshot {
+    public:
+        int                               version = 0;
+        QList<NetInterfaceProvider::Info> info;
+        QHash<QHostAddress, QString>      byAddress; // the first interface having it
+    };
+    using SnapshotPtr = QSharedPointer<const Snapshot>;
+
+    SnapshotPtr snapshot()
     {
         QMutexLocker locker(&m);
 
-        return info;
+        return snap;
     }
 
     NetTracker()
     {
-        QList<IrisNetProvider *> list = irisNetProviders();
+        QList<IrisNetProvider *> list = irisNetProviders(IrisNetInterfaces);
 
         c = nullptr;
         for (IrisNetProvider *p : list) {
@@ -53,7 +64,7 @@ public:
         connect(c, SIGNAL(updated()), SLOT(c_updated()));
 
         c->start();
-        info = filterList(c->interfaces());
+        snap = makeSnapshot(filterList(c->interfaces()), 1);
     }
 
     ~NetTracker()
@@ -76,21 +87,36 @@ private:
         return out;
     }
 
+    static SnapshotPtr makeSnapshot(const QList<NetInterfaceProvider::Info> &info, int version)
+    {
+        auto s     = QSharedPointer<Snapshot>::create();
+        s->version = version;
+        s->info    = info;
+        for (auto const &i : info) {
+            for (auto const &addr : i.addresses) {
+                if (!s->byAddress.contains(addr))
+                    s->byAddress.insert(addr, i.id);
+            }
+        }
+        return s;
+    }
+
 private slots:
     void c_updated()
     {
+        auto info = filterList(c->interfaces());
         {
             QMutexLocker locker(&m);
-            info = filterList(c->interfaces());
+            snap = makeSnapshot(info, snap->version + 1);
         }
         emit updated();
     }
 
 private:
     // this are all protected by m
-    NetInterfaceProvider             *c;
-    QMutex                            m;
-    QList<NetInterfaceProvider::Info> info;
+    NetInterfaceProvider *c;
+    QMutex                m;
+    SnapshotPtr           snap;
 };
 
 // Global because static getRef needs this too.
@@ -129,7 +155,7 @@ public:
         }
     }
 
-    QList<NetInterfaceProvider::Info> getInterfaces() { return nettracker->getInterfaces(); }
+    NetTracker::SnapshotPtr snapshot() { return nettracker->snapshot(); }
 
     ~NetTrackerThread()
     {
@@ -248,15 +274,16 @@ class NetInterfaceManagerPrivate : public QObject {
 public:
     NetInterfaceManager *q;
 
-    QList<NetInterfaceProvider::Info> info;
-    QList<NetInterface *>             listeners;
-    NetTrackerThread                 *tracker;
+    NetTracker::SnapshotPtr snap;
+    QList<NetInterface *>   listeners;
+    NetTrackerThread       *tracker;
 
     bool pending;
 
     NetInterfaceManagerPrivate(NetInterfaceManager *_q) : QObject(_q), q(_q)
     {
         tracker = NetTrackerThread::getRef();
+        snap    = QSharedPointer<NetTracker::Snapshot>::create();
         pending = false;
         connect(tracker, SIGNAL(updated()), SLOT(tracker_updated()));
     }
@@ -285,7 +312,10 @@ public:
     void do_update()
     {
         // grab the latest info
-        QList<NetInterfaceProvider::Info> newinfo = tracker->getInterfaces();
+        auto                                     old     = snap;
+        auto                                     latest  = tracker->snapshot();
+        const QList<NetInterfaceProvider::Info> &info    = old->info;
+        const QList<NetInterfaceProvider::Info> &newinfo = latest->info;
 
         QStringList here_ids, gone_ids;
 
@@ -310,7 +340,7 @@ public:
             if (i == -1)
                 here_ids += newinfo[n].id;
         }
-        info = newinfo;
+        snap = latest;
 
         // announce gone
         for (int n = 0; n < gone_ids.count(); ++n) {
@@ -357,35 +387,39 @@ NetInterfaceManager::~NetInterfaceManager() { delete d; }
 
 QStringList NetInterfaceManager::interfaces() const
 {
-    d->info = d->tracker->getInterfaces();
+    d->snap = d->tracker->snapshot();
     QStringList out;
-    for (int n = 0; n < d->info.count(); ++n) {
-        out += d->info[n].id;
-    }
+    for (auto const &i : d->snap->info)
+        out += i.id;
     return out;
 }
 
 QString NetInterfaceManager::interfaceForAddress(const QHostAddress &a)
 {
-    NetInterfaceManager netman;
-    QStringList         list = netman.interfaces();
-    for (int n = 0; n < list.count(); ++n) {
-        NetInterface iface(list[n], &netman);
-        if (iface.addresses().contains(a))
-            return list[n];
-    }
-    return QString();
+    // the tracker keeps the table up to date already, unless nobody else uses it
+    NetTrackerThread *tracker = NetTrackerThread::getRef();
+    QString           id      = tracker->snapshot()->byAddress.value(a);
+    tracker->releaseRef();
+    return id;
 }
 
 void *NetInterfaceManager::reg(const QString &id, NetInterface *i)
 {
-    for (int n = 0; n < d->info.count(); ++n) {
-        if (d->info[n].id == id) {
-            d->listeners += i;
-            return new NetInterfaceProvider::Info(d->info[n]);
+    int n = NetInterfaceManagerPrivate::lookup(d->snap->info, id);
+
+    // the id may come from interfaceForAddress(), which looks at the latest snapshot
+    if (n == -1) {
+        auto latest = d->tracker->snapshot();
+        if (latest->version != d->snap->version) {
+            d->snap = latest;
+            n       = NetInterfaceManagerPrivate::lookup(d->snap->info, id);
         }
     }
-    return nullptr;
+    if (n == -1)
+        return nullptr;
+
+    d->listeners += i;
+    return new NetInterfaceProvider::Info(d->snap->info[n]);
 }
 
 void NetInterfaceManager::unreg(NetInterface *i) { d->listeners.removeAll(i); }
@@ -176,6 +176,9 @@ public:
        This function looks for an interface that has the address \a a.  If there is no such interface, a null string is
 returned.
 
+       The answer comes from a table the interface tracker keeps up to date, so this is cheap as long as some
+NetInterfaceManager exists.  Otherwise the interfaces are read for the call.
+
        This is useful for determing the network interface associated with an outgoing QTcpSocket:
 
        \code
@@ -22,12 +22,22 @@
 
 #if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
 #ifdef Q_OS_LINUX
+#include <QtEndian>
+
 #include <asm/types.h>
+#include <errno.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <net/if.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#define IRISNET_NETLINK_DELTAS
+
+/*
+Reports what rtnetlink tells, as it happens. The deltas of one burst of messages are followed by applied(),
+changed() is only emitted when the kernel dropped messages and the whole state has to be read again.
+*/
 class InterfaceMonitor : public QObject {
     Q_OBJECT
 public:
@@ -39,7 +49,7 @@ public:
         sa.nl_family = AF_NETLINK;
         sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
 
-        netlinkFd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+        netlinkFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
         if (netlinkFd == -1) {
             return;
         }
@@ -51,7 +61,7 @@ public:
         notifier = new QSocketNotifier(netlinkFd, QSocketNotifier::Read, this);
 
         connect(notifier, &QSocketNotifier::activated, this,
-                [this](QSocketDescriptor, QSocketNotifier::Type) { emit changed(); });
+                [this](QSocketDescriptor, QSocketNotifier::Type) { readMessages(); });
     }
 
     ~InterfaceMonitor()
@@ -63,11 +73,86 @@ public:
     }
 
 signals:
+    void linkChanged(int index, const QString &name, bool isLoopback);
+    void linkRemoved(int index);
+    void addressAdded(int index, const QHostAddress &address);
+    void addressRemoved(int index, const QHostAddress &address);
+    void applied();
     void changed();
 
 private:
     QSocketNotifier *notifier  = nullptr;
     int              netlinkFd = -1;
+
+    // everything there is, the notifier would fire again right away otherwise
+    void readMessages()
+    {
+        bool any     = false;
+        bool overrun = false;
+        char buf[16384];
+        for (;;) {
+            ssize_t len = recv(netlinkFd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (len < 0 && errno == ENOBUFS) {
+                overrun = true;
+                continue;
+            }
+            if (len <= 0)
+                break;
+            for (auto nh = reinterpret_cast<struct nlmsghdr *>(buf); NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+                any |= processMessage(nh);
+        }
+
+        if (overrun)
+            emit changed();
+        else if (any)
+            emit applied();
+    }
+
+    bool processMessage(struct nlmsghdr *nh)
+    {
+        switch (nh->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK: {
+            auto ifi = static_cast<struct ifinfomsg *>(NLMSG_DATA(nh));
+            if (nh->nlmsg_type == RTM_DELLINK) {
+                emit linkRemoved(ifi->ifi_index);
+                return true;
+            }
+            int len = int(IFLA_PAYLOAD(nh));
+            for (auto rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+                if (rta->rta_type == IFLA_IFNAME) {
+                    emit linkChanged(ifi->ifi_index, QString::fromLocal8Bit(static_cast<const char *>(RTA_DATA(rta))),
+                                     ifi->ifi_flags & IFF_LOOPBACK);
+                    return true;
+                }
+            }
+            return false;
+        }
+        case RTM_NEWADDR:
+        case RTM_DELADDR: {
+            auto         ifa = static_cast<struct ifaddrmsg *>(NLMSG_DATA(nh));
+            QHostAddress addr;
+            int          len = int(IFA_PAYLOAD(nh));
+            for (auto rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+                // IFA_ADDRESS is the peer on point-to-point links, IFA_LOCAL is always ours if there
+                if (ifa->ifa_family == AF_INET) {
+                    if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && addr.isNull()))
+                        addr.setAddress(qFromBigEndian<quint32>(RTA_DATA(rta)));
+                } else if (ifa->ifa_family == AF_INET6 && rta->rta_type == IFA_ADDRESS)
+                    addr.setAddress(static_cast<const quint8 *>(RTA_DATA(rta)));
+            }
+            if (addr.isNull())
+                return false;
+            if (nh->nlmsg_type == RTM_NEWADDR)
+                emit addressAdded(int(ifa->ifa_index), addr);
+            else
+                emit addressRemoved(int(ifa->ifa_index), addr);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
 };
 
 #else
@@ -106,9 +191,39 @@ class IrisQtNet : public NetInterfaceProvider {
     Q_INTERFACES(XMPP::NetInterfaceProvider)
 public:
     QList<Info>      info;
+    QMap<int, Info>  byIndex;
     InterfaceMonitor monitor;
 
-    IrisQtNet() { connect(&monitor, &InterfaceMonitor::changed, this, &IrisQtNet::check); }
+    IrisQtNet()
+    {
+        connect(&monitor, &InterfaceMonitor::changed, this, &IrisQtNet::check);
+#ifdef IRISNET_NETLINK_DELTAS
+        connect(&monitor, &InterfaceMonitor::linkChanged, this, [this](int index, const QString &name, bool lo) {
+            Info &i      = byIndex[index];
+            i.id         = name;
+            i.name       = name;
+            i.isLoopback = lo;
+        });
+        connect(&monitor, &InterfaceMonitor::linkRemoved, this, [this](int index) { byIndex.remove(index); });
+        connect(&monitor, &InterfaceMonitor::addressAdded, this, [this](int index, const QHostAddress &addr) {
+            auto it = byIndex.find(index);
+            if (it == byIndex.end())
+                return;
+            QHostAddress a = scoped(*it, addr);
+            if (!it->addresses.contains(a))
+                it->addresses.append(a);
+        });
+        connect(&monitor, &InterfaceMonitor::addressRemoved, this, [this](int index, const QHostAddress &addr) {
+            auto it = byIndex.find(index);
+            if (it != byIndex.end())
+                it->addresses.removeAll(scoped(*it, addr));
+        });
+        connect(&monitor, &InterfaceMonitor::applied, this, [this]() {
+            info = byIndex.values();
+            emit updated();
+        });
+#endif
+    }
 
     void start() { poll(); }
 
@@ -116,7 +231,7 @@ public:
 
     void poll()
     {
-        QList<Info> ifaces;
+        byIndex.clear();
 
         auto const interfaces = QNetworkInterface::allInterfaces();
         for (auto &iface : interfaces) {
@@ -127,11 +242,21 @@ public:
             for (auto &ae : iface.addressEntries()) {
                 i.addresses.append(ae.ip());
             }
-            ifaces << i;
+            byIndex.insert(iface.index(), i);
         }
 
-        info = ifaces;
+        info = byIndex.values();
+    }
+
+#ifdef IRISNET_NETLINK_DELTAS
+    // link local addresses from QNetworkInterface come with the interface as scope
+    static QHostAddress scoped(const Info &i, QHostAddress addr)
+    {
+        if (addr.protocol() == QAbstractSocket::IPv6Protocol && addr.isLinkLocal())
+            addr.setScopeId(i.id);
+        return addr;
     }
+#endif
 
 public slots:
     void check()
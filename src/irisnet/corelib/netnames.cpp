@@ -26,9 +26,17 @@
 #if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
 #include <QRandomGenerator>
 #endif
+#include <functional>
 #include <limits>
+#include <memory>
 #include <optional>
 
+// how long a name known not to exist is answered without asking again, in seconds
+#define NEGATIVE_CACHE_TTL 60
+#define NEGATIVE_CACHE_MAX 256
+// lookups a NamePrefetcher runs at the same time
+#define PREFETCH_MAX_ACTIVE 4
+
 #define NNDEBUG (qDebug() << this << "#" << __FUNCTION__ << ":")
 static std::optional<bool> enable_logs;
 #define NNLOG(msg)                                                                                                     \
@@ -412,37 +420,76 @@ class NameManager;
 Q_GLOBAL_STATIC(QMutex, nman_mutex)
 static NameManager *g_nman = nullptr;
 
-class NameResolver::Private {
+/*
+What the resolver thread keeps of a front end object. The object lives on its own thread and may go away
+any moment, so the resolver thread never touches it, just posts calls to it while it's attached.
+*/
+template <typename T> class Remote {
 public:
-    NameResolver *q;
+    using Ptr = std::shared_ptr<Remote<T>>;
+
+    int id = -1; // of the provider. the resolver thread only
+
+    explicit Remote(T *q) : q(q) { }
+    static Ptr create(T *q) { return std::make_shared<Remote<T>>(q); }
+
+    // on the thread of the object, when it's not interested anymore
+    void detach()
+    {
+        QMutexLocker locker(&m);
+        q = nullptr;
+    }
+
+    // f(q) is called on the thread of the object if it's still attached by then
+    static void post(const Ptr &self, std::function<void(T *)> &&f)
+    {
+        if (!self)
+            return;
+        QMutexLocker locker(&self->m); // the object can't be deleted while we post
+        if (!self->q)
+            return;
+        QMetaObject::invokeMethod(
+            self->q,
+            [self, f = std::move(f)]() {
+                T *q;
+                {
+                    QMutexLocker locker(&self->m);
+                    q = self->q;
+                }
+                if (q)
+                    f(q);
+            },
+            Qt::QueuedConnection);
+    }
 
-    int  type;
-    bool longLived;
-    int  id;
+private:
+    QMutex m;
+    T     *q;
+};
 
-    Private(NameResolver *_q) : q(_q) { }
+class NameResolver::Private {
+public:
+    Remote<NameResolver>::Ptr remote;
 };
 
 class ServiceBrowser::Private {
 public:
-    ServiceBrowser *q;
+    Remote<ServiceBrowser>::Ptr remote;
 
-    int id;
-
-    Private(ServiceBrowser *_q) : q(_q) { }
+    Private(ServiceBrowser *_q) : remote(Remote<ServiceBrowser>::create(_q)) { }
 };
 
 class ServiceResolver::Private : public QObject {
     Q_OBJECT
 public:
     Private(ServiceResolver *parent) :
-        q(parent), dns_sd_resolve_id(0), requestedProtocol(IPv6_IPv4), port(0), protocol(QAbstractSocket::IPv6Protocol)
+        q(parent), requestedProtocol(IPv6_IPv4), port(0), protocol(QAbstractSocket::IPv6Protocol)
     {
     }
 
     /* DNS-SD interaction with NameManager */
-    ServiceResolver *q;                 //!< Pointing upwards, so NameManager can call its signals
-    int              dns_sd_resolve_id; //!< DNS-SD lookup id, set by NameManager
+    ServiceResolver            *q;     //!< Pointing upwards
+    Remote<ServiceResolver>::Ptr dnsSd; //!< DNS-SD lookup, as NameManager sees it
 
     /* configuration */
     Protocol requestedProtocol; //!< IP protocol requested by user
@@ -650,30 +697,42 @@ QDebug operator<<(QDebug dbg, const XMPP::WeightedNameRecordList &list)
 
 class ServiceLocalPublisher::Private {
 public:
-    ServiceLocalPublisher *q;
-
-    int id;
+    Remote<ServiceLocalPublisher>::Ptr remote;
 
-    Private(ServiceLocalPublisher *_q) : q(_q) { }
+    Private(ServiceLocalPublisher *_q) : remote(Remote<ServiceLocalPublisher>::create(_q)) { }
 };
 
 class NameManager : public QObject {
     Q_OBJECT
 public:
-    NameProvider                       *p_net, *p_local;
-    ServiceProvider                    *p_serv;
-    QHash<int, NameResolver::Private *> res_instances;
-    QHash<int, int>                     res_sub_instances;
+    using Query = QPair<QByteArray, int>; // lowercased name, type
+
+    // one provider request, shared by all the single shot resolvers which asked the same while it was going
+    struct Resolve {
+        QList<Remote<NameResolver>::Ptr> remotes;
+        Query                            query;
+        bool                             longLived;
+        bool                             background;
+    };
+
+    NameProvider          *p_net, *p_local;
+    ServiceProvider       *p_serv;
+    QHash<int, Resolve>    res_instances;
+    QHash<int, int>        res_sub_instances;
+    QHash<Query, int>      res_pending;  // the single shot requests, by query
+    QHash<Query, qint64>   res_negative; // names which don't exist, until when
+    QElapsedTimer          clock;
 
-    QHash<int, ServiceBrowser::Private *>        br_instances;
-    QHash<int, ServiceResolver::Private *>       sres_instances;
-    QHash<int, ServiceLocalPublisher::Private *> slp_instances;
+    QHash<int, Remote<ServiceBrowser>::Ptr>        br_instances;
+    QHash<int, Remote<ServiceResolver>::Ptr>       sres_instances;
+    QHash<int, Remote<ServiceLocalPublisher>::Ptr> slp_instances;
 
     NameManager(QObject *parent = nullptr) : QObject(parent)
     {
         p_net   = nullptr;
         p_local = nullptr;
         p_serv  = 0;
+        clock.start();
     }
 
     ~NameManager()
@@ -683,11 +742,20 @@ public:
         delete p_serv;
     }
 
+    // f runs on the resolver thread, after whatever was asked before from the same thread
+    static void run(std::function<void(NameManager *)> &&f)
+    {
+        NameManager *m = instance();
+        QMetaObject::invokeMethod(m, [m, f = std::move(f)]() { f(m); }, Qt::QueuedConnection);
+    }
+
     static NameManager *instance()
     {
         QMutexLocker locker(nman_mutex());
         if (!g_nman) {
+            // one backend for all the threads, on a thread of its own
             g_nman = new NameManager;
+            g_nman->moveToThread(irisNetWorkerThread());
             irisNetAddPostRoutine(NetNames::cleanup);
         }
         return g_nman;
@@ -695,19 +763,26 @@ public:
 
     static void cleanup()
     {
-        delete g_nman;
-        g_nman = nullptr;
+        NameManager *m;
+        {
+            QMutexLocker locker(nman_mutex());
+            m      = g_nman;
+            g_nman = nullptr;
+        }
+        if (!m)
+            return;
+        if (m->thread() == QThread::currentThread())
+            delete m;
+        else
+            QMetaObject::invokeMethod(m, [m]() { delete m; }, Qt::BlockingQueuedConnection);
     }
 
-    void resolve_start(NameResolver::Private *np, const QByteArray &name, int qType, bool longLived)
+    void resolve_start(const Remote<NameResolver>::Ptr &remote, const QByteArray &name, int qType, bool longLived,
+                       bool background)
     {
-        QMutexLocker locker(nman_mutex());
-
-        np->type      = qType;
-        np->longLived = longLived;
         if (!p_net) {
             NameProvider            *c    = 0;
-            QList<IrisNetProvider *> list = irisNetProviders();
+            QList<IrisNetProvider *> list = irisNetProviders(IrisNetNamesInternet);
             for (int n = 0; n < list.count(); ++n) {
                 IrisNetProvider *p = list[n];
                 c                  = p->createNameProviderInternet();
@@ -722,31 +797,88 @@ public:
             qRegisterMetaType<XMPP::NameResolver::Error>("XMPP::NameResolver::Error");
             connect(p_net, &NameProvider::resolve_resultsReady, this,
                     [this](int id, const QList<XMPP::NameRecord> &results) {
-                        NameResolver::Private *np = res_instances.value(id);
-                        NameResolver          *q  = np->q; // resolve_cleanup deletes np
-                        if (!np->longLived)
-                            resolve_cleanup(np);
-                        emit q->resultsReady(results);
+                        auto it = res_instances.constFind(id);
+                        if (it == res_instances.constEnd())
+                            return;
+                        auto remotes   = it->remotes;
+                        bool longLived = it->longLived;
+                        if (!longLived)
+                            resolve_cleanup(id);
+                        for (const auto &remote : std::as_const(remotes)) {
+                            Remote<NameResolver>::post(remote, [results, longLived](NameResolver *q) {
+                                if (!longLived)
+                                    q->finish();
+                                emit q->resultsReady(results);
+                            });
+                        }
                     });
             connect(p_net, SIGNAL(resolve_error(int, XMPP::NameResolver::Error)),
                     SLOT(provider_resolve_error(int, XMPP::NameResolver::Error)));
             connect(p_net, SIGNAL(resolve_useLocal(int, QByteArray)), SLOT(provider_resolve_useLocal(int, QByteArray)));
         }
 
-        np->id = p_net->resolve_start(name, qType, longLived);
+        Query query { name.toLower(), qType };
+        if (!longLived) {
+            auto neg = res_negative.constFind(query);
+            if (neg != res_negative.constEnd() && *neg > clock.elapsed()) {
+                Remote<NameResolver>::post(remote, [](NameResolver *q) {
+                    q->finish();
+                    emit q->error(NameResolver::ErrorNoName);
+                });
+                return;
+            }
+
+            // the same is on its way already, wait for it too
+            auto pending = res_pending.constFind(query);
+            if (pending != res_pending.constEnd()) {
+                remote->id = *pending;
+                auto &res  = res_instances[remote->id];
+                res.remotes += remote;
+                if (res.background && !background) {
+                    res.background = false;
+                    p_net->resolve_setBackground(remote->id, false);
+                }
+                return;
+            }
+        }
+
+        remote->id = p_net->resolve_start(name, qType, longLived);
+        if (background)
+            p_net->resolve_setBackground(remote->id, true);
 
         // printf("assigning %d to %p\n", req_id, np);
-        res_instances.insert(np->id, np);
+        res_instances.insert(remote->id, { { remote }, query, longLived, background });
+        if (!longLived)
+            res_pending.insert(query, remote->id);
     }
 
-    void resolve_stop(NameResolver::Private *np)
+    void resolve_stop(const Remote<NameResolver>::Ptr &remote)
     {
+        // finished already, maybe the id is somebody else's by now
+        auto it = res_instances.find(remote->id);
+        if (it == res_instances.end() || !it->remotes.removeOne(remote))
+            return;
+        if (!it->remotes.isEmpty())
+            return; // the others still want it
+
         // FIXME: stop sub instances?
-        p_net->resolve_stop(np->id);
-        resolve_cleanup(np);
+        p_net->resolve_stop(remote->id);
+        resolve_cleanup(remote->id);
     }
 
-    void resolve_cleanup(NameResolver::Private *np)
+    void remember_no_name(const Query &query)
+    {
+        qint64 now = clock.elapsed();
+        if (res_negative.size() >= NEGATIVE_CACHE_MAX) {
+            for (auto it = res_negative.begin(); it != res_negative.end();)
+                it = *it <= now ? res_negative.erase(it) : std::next(it);
+            if (res_negative.size() >= NEGATIVE_CACHE_MAX)
+                res_negative.clear();
+        }
+        res_negative.insert(query, now + NEGATIVE_CACHE_TTL * 1000);
+    }
+
+    void resolve_cleanup(int id)
     {
         // clean up any sub instances
 
@@ -754,7 +886,7 @@ public:
         QHashIterator<int, int> it(res_sub_instances);
         while (it.hasNext()) {
             it.next();
-            if (it.value() == np->id)
+            if (it.value() == id)
                 sub_instances_to_remove += it.key();
         }
 
@@ -765,133 +897,139 @@ public:
 
         // clean up primary instance
 
-        res_instances.remove(np->id);
-        NameResolver *q = np->q;
-        delete q->d;
-        q->d = nullptr;
+        auto it = res_instances.constFind(id);
+        if (it == res_instances.constEnd())
+            return;
+        if (!it->longLived)
+            res_pending.remove(it->query);
+        res_instances.erase(it);
     }
 
-    void browse_start(ServiceBrowser::Private *np, const QString &type, const QString &domain)
+    void ensure_p_serv()
     {
-        QMutexLocker locker(nman_mutex());
-
-        if (!p_serv) {
-            ServiceProvider         *c    = nullptr;
-            QList<IrisNetProvider *> list = irisNetProviders();
-            for (int n = 0; n < list.count(); ++n) {
-                IrisNetProvider *p = list[n];
-                c                  = p->createServiceProvider();
-                if (c)
-                    break;
-            }
-            Q_ASSERT(c); // we have built-in support, so this should never fail
-            p_serv = c;
-
-            // use queued connections
-            qRegisterMetaType<XMPP::ServiceInstance>("XMPP::ServiceInstance");
-            qRegisterMetaType<XMPP::ServiceBrowser::Error>("XMPP::ServiceBrowser::Error");
-
-            connect(p_serv, SIGNAL(browse_instanceAvailable(int, XMPP::ServiceInstance)),
-                    SLOT(provider_browse_instanceAvailable(int, XMPP::ServiceInstance)), Qt::QueuedConnection);
-            connect(p_serv, SIGNAL(browse_instanceUnavailable(int, XMPP::ServiceInstance)),
-                    SLOT(provider_browse_instanceUnavailable(int, XMPP::ServiceInstance)), Qt::QueuedConnection);
-            connect(p_serv, SIGNAL(browse_error(int, XMPP::ServiceBrowser::Error)),
-                    SLOT(provider_browse_error(int, XMPP::ServiceBrowser::Error)), Qt::QueuedConnection);
+        if (p_serv)
+            return;
+
+        ServiceProvider         *c    = nullptr;
+        QList<IrisNetProvider *> list = irisNetProviders(IrisNetServices);
+        for (int n = 0; n < list.count(); ++n) {
+            IrisNetProvider *p = list[n];
+            c                  = p->createServiceProvider();
+            if (c)
+                break;
         }
+        Q_ASSERT(c); // we have built-in support, so this should never fail
+        p_serv = c;
+
+        // use queued connections
+        qRegisterMetaType<XMPP::ServiceInstance>("XMPP::ServiceInstance");
+        qRegisterMetaType<XMPP::ServiceBrowser::Error>("XMPP::ServiceBrowser::Error");
+        qRegisterMetaType<QList<XMPP::ServiceProvider::ResolveResult>>("QList<XMPP::ServiceProvider::ResolveResult>");
+        qRegisterMetaType<XMPP::ServiceLocalPublisher::Error>("XMPP::ServiceLocalPublisher::Error");
+
+        connect(p_serv, SIGNAL(browse_instanceAvailable(int, XMPP::ServiceInstance)),
+                SLOT(provider_browse_instanceAvailable(int, XMPP::ServiceInstance)), Qt::QueuedConnection);
+        connect(p_serv, SIGNAL(browse_instanceUnavailable(int, XMPP::ServiceInstance)),
+                SLOT(provider_browse_instanceUnavailable(int, XMPP::ServiceInstance)), Qt::QueuedConnection);
+        connect(p_serv, SIGNAL(browse_error(int, XMPP::ServiceBrowser::Error)),
+                SLOT(provider_browse_error(int, XMPP::ServiceBrowser::Error)), Qt::QueuedConnection);
+        connect(
+            p_serv, &ServiceProvider::resolve_resultsReady, this,
+            [this](int id, const QList<XMPP::ServiceProvider::ResolveResult> &results) {
+                auto remote = sres_instances.value(id);
+                if (!remote)
+                    return;
+                auto r = results[0];
+                Remote<ServiceResolver>::post(remote, [r](ServiceResolver *q) {
+                    emit q->resultReady(r.address, quint16(r.port), r.hostName, {});
+                });
+            },
+            Qt::QueuedConnection);
+        connect(p_serv, SIGNAL(publish_published(int)), SLOT(provider_publish_published(int)), Qt::QueuedConnection);
+        connect(p_serv, SIGNAL(publish_extra_published(int)), SLOT(provider_publish_extra_published(int)),
+                Qt::QueuedConnection);
+    }
+
+    void browse_start(const Remote<ServiceBrowser>::Ptr &remote, const QString &type, const QString &domain)
+    {
+        ensure_p_serv();
 
         /*np->id = */
 
-        np->id = p_serv->browse_start(type, domain);
+        remote->id = p_serv->browse_start(type, domain);
 
-        br_instances.insert(np->id, np);
+        br_instances.insert(remote->id, remote);
     }
 
-    void resolve_instance_start(ServiceResolver::Private *np, const QByteArray &name)
+    void browse_stop(const Remote<ServiceBrowser>::Ptr &remote)
     {
-        QMutexLocker locker(nman_mutex());
-
-        if (!p_serv) {
-            ServiceProvider         *c    = nullptr;
-            QList<IrisNetProvider *> list = irisNetProviders();
-            for (int n = 0; n < list.count(); ++n) {
-                IrisNetProvider *p = list[n];
-                c                  = p->createServiceProvider();
-                if (c)
-                    break;
-            }
-            Q_ASSERT(c); // we have built-in support, so this should never fail
-            p_serv = c;
+        if (br_instances.value(remote->id) != remote)
+            return;
+        p_serv->browse_stop(remote->id);
+        br_instances.remove(remote->id);
+    }
 
-            // use queued connections
-            qRegisterMetaType<QList<XMPP::ServiceProvider::ResolveResult>>(
-                "QList<XMPP::ServiceProvider::ResolveResult>");
-            connect(
-                p_serv, &ServiceProvider::resolve_resultsReady, this,
-                [this](int id, const QList<XMPP::ServiceProvider::ResolveResult> &results) {
-                    ServiceResolver::Private *np = sres_instances.value(id);
-                    emit np->q->resultReady(results[0].address, quint16(results[0].port), results[0].hostName, {});
-                },
-                Qt::QueuedConnection);
-        }
+    void resolve_instance_start(const Remote<ServiceResolver>::Ptr &remote, const QByteArray &name)
+    {
+        ensure_p_serv();
 
         /* store the id so we can stop it later */
-        np->dns_sd_resolve_id = p_serv->resolve_start(name);
+        remote->id = p_serv->resolve_start(name);
 
-        sres_instances.insert(np->dns_sd_resolve_id, np);
+        sres_instances.insert(remote->id, remote);
     }
 
-    void publish_start(ServiceLocalPublisher::Private *np, const QString &instance, const QString &type, int port,
-                       const QMap<QString, QByteArray> &attribs)
+    void resolve_instance_stop(const Remote<ServiceResolver>::Ptr &remote)
     {
-        QMutexLocker locker(nman_mutex());
-
-        if (!p_serv) {
-            ServiceProvider         *c    = nullptr;
-            QList<IrisNetProvider *> list = irisNetProviders();
-            for (int n = 0; n < list.count(); ++n) {
-                IrisNetProvider *p = list[n];
-                c                  = p->createServiceProvider();
-                if (c)
-                    break;
-            }
-            Q_ASSERT(c); // we have built-in support, so this should never fail
-            p_serv = c;
+        if (sres_instances.value(remote->id) != remote)
+            return;
+        p_serv->resolve_stop(remote->id);
+        sres_instances.remove(remote->id);
+    }
 
-            // use queued connections
-            qRegisterMetaType<XMPP::ServiceLocalPublisher::Error>("XMPP::ServiceLocalPublisher::Error");
-            connect(p_serv, SIGNAL(publish_published(int)), SLOT(provider_publish_published(int)),
-                    Qt::QueuedConnection);
-            connect(p_serv, SIGNAL(publish_extra_published(int)), SLOT(provider_publish_extra_published(int)),
-                    Qt::QueuedConnection);
-        }
+    void publish_start(const Remote<ServiceLocalPublisher>::Ptr &remote, const QString &instance, const QString &type,
+                       int port, const QMap<QString, QByteArray> &attribs)
+    {
+        ensure_p_serv();
 
         /*np->id = */
 
-        np->id = p_serv->publish_start(instance, type, port, attribs);
+        remote->id = p_serv->publish_start(instance, type, port, attribs);
 
-        slp_instances.insert(np->id, np);
+        slp_instances.insert(remote->id, remote);
     }
 
-    void publish_extra_start(ServiceLocalPublisher::Private *np, const NameRecord &rec)
+    void publish_extra_start(const Remote<ServiceLocalPublisher>::Ptr &remote, const NameRecord &rec)
     {
-        np->id = p_serv->publish_extra_start(np->id, rec);
+        remote->id = p_serv->publish_extra_start(remote->id, rec);
     }
 
 private slots:
 
     void provider_resolve_error(int id, XMPP::NameResolver::Error e)
     {
-        NameResolver::Private *np = res_instances.value(id);
-        NameResolver          *q  = np->q; // resolve_cleanup deletes np
-        resolve_cleanup(np);
-        emit q->error(e);
+        auto it = res_instances.constFind(id);
+        if (it == res_instances.constEnd())
+            return;
+        auto remotes = it->remotes;
+        if (e == NameResolver::ErrorNoName && !it->longLived)
+            remember_no_name(it->query);
+        resolve_cleanup(id);
+        for (const auto &remote : std::as_const(remotes)) {
+            Remote<NameResolver>::post(remote, [e](NameResolver *q) {
+                q->finish();
+                emit q->error(e);
+            });
+        }
     }
 
     void provider_local_resolve_resultsReady(int id, const QList<XMPP::NameRecord> &results)
     {
-        int                    par_id = res_sub_instances.value(id);
-        NameResolver::Private *np     = res_instances.value(par_id);
-        if (!np->longLived)
+        int  par_id = res_sub_instances.value(id);
+        auto it     = res_instances.constFind(par_id);
+        if (it == res_instances.constEnd())
+            return;
+        if (!it->longLived)
             res_sub_instances.remove(id);
         p_net->resolve_localResultsReady(par_id, results);
     }
@@ -908,7 +1046,7 @@ private slots:
         // transfer to local
         if (!p_local) {
             NameProvider            *c    = nullptr;
-            QList<IrisNetProvider *> list = irisNetProviders();
+            QList<IrisNetProvider *> list = irisNetProviders(IrisNetNamesLocal);
             for (int n = 0; n < list.count(); ++n) {
                 IrisNetProvider *p = list[n];
                 c                  = p->createNameProviderLocal();
@@ -928,7 +1066,9 @@ private slots:
                     SLOT(provider_local_resolve_error(int, XMPP::NameResolver::Error)), Qt::QueuedConnection);
         }
 
-        NameResolver::Private *np = res_instances.value(id);
+        auto it = res_instances.constFind(id);
+        if (it == res_instances.constEnd())
+            return;
 
         /*// transfer to local only
         if(np->longLived)
@@ -946,34 +1086,33 @@ private slots:
             res_sub_instances.insert(req_id, np->id);
         }*/
 
-        int req_id = p_local->resolve_start(name, np->type, np->longLived);
-        res_sub_instances.insert(req_id, np->id);
+        int req_id = p_local->resolve_start(name, it->query.second, it->longLived);
+        res_sub_instances.insert(req_id, id);
     }
 
     void provider_browse_instanceAvailable(int id, const XMPP::ServiceInstance &i)
     {
-        ServiceBrowser::Private *np = br_instances.value(id);
-        emit                     np->q->instanceAvailable(i);
+        Remote<ServiceBrowser>::post(br_instances.value(id),
+                                     [i](ServiceBrowser *q) { emit q->instanceAvailable(i); });
     }
 
     void provider_browse_instanceUnavailable(int id, const XMPP::ServiceInstance &i)
     {
-        ServiceBrowser::Private *np = br_instances.value(id);
-        emit                     np->q->instanceUnavailable(i);
+        Remote<ServiceBrowser>::post(br_instances.value(id),
+                                     [i](ServiceBrowser *q) { emit q->instanceUnavailable(i); });
     }
 
     void provider_browse_error(int id, XMPP::ServiceBrowser::Error e)
     {
         Q_UNUSED(e);
-        ServiceBrowser::Private *np = br_instances.value(id);
         // TODO
-        emit np->q->error();
+        Remote<ServiceBrowser>::post(br_instances.value(id), [](ServiceBrowser *q) { emit q->error(); });
     }
 
     void provider_publish_published(int id)
     {
-        ServiceLocalPublisher::Private *np = slp_instances.value(id);
-        emit                            np->q->published();
+        Remote<ServiceLocalPublisher>::post(slp_instances.value(id),
+                                            [](ServiceLocalPublisher *q) { emit q->published(); });
     }
 
     void provider_publish_extra_published(int id)
@@ -1036,22 +1175,34 @@ NameResolver::~NameResolver() { stop(); }
 void NameResolver::start(const QByteArray &name, NameRecord::Type type, Mode mode)
 {
     stop();
-    d         = new Private(this);
+    d         = new Private;
+    d->remote = Remote<NameResolver>::create(this);
     int qType = recordType2Rtype(type);
     if (qType == -1)
         qType = JDNS_RTYPE_A;
-    NameManager::instance()->resolve_start(d, name, qType, mode == NameResolver::LongLived);
+    bool longLived  = mode == NameResolver::LongLived;
+    bool background = mode == NameResolver::Background;
+    NameManager::run([remote = d->remote, name, qType, longLived, background](NameManager *m) {
+        m->resolve_start(remote, name, qType, longLived, background);
+    });
 }
 
 void NameResolver::stop()
 {
     if (d) {
-        NameManager::instance()->resolve_stop(d);
-        delete d;
-        d = nullptr;
+        auto remote = d->remote;
+        finish();
+        NameManager::run([remote](NameManager *m) { m->resolve_stop(remote); });
     }
 }
 
+void NameResolver::finish()
+{
+    d->remote->detach();
+    delete d;
+    d = nullptr;
+}
+
 QDebug operator<<(QDebug dbg, XMPP::NameResolver::Error e)
 {
     dbg.nospace() << "XMPP::NameResolver::";
@@ -1077,16 +1228,113 @@ QDebug operator<<(QDebug dbg, XMPP::NameResolver::Error e)
     return dbg;
 }
 
+//----------------------------------------------------------------------------
+// NamePrefetcher
+//----------------------------------------------------------------------------
+class NamePrefetcher::Private {
+public:
+    using Query = QPair<QByteArray, NameRecord::Type>;
+
+    NamePrefetcher       *q;
+    QList<Query>          pending;
+    QSet<Query>           seen;
+    QList<NameResolver *> active;
+
+    Private(NamePrefetcher *q) : q(q) { }
+
+    void add(const QByteArray &name, NameRecord::Type type)
+    {
+        Query query(name, type);
+        if (name.isEmpty() || seen.contains(query))
+            return;
+        seen += query;
+        pending += query;
+        next();
+    }
+
+    // without the trailing dot, that's how the hosts are asked for later (and how QHostInfo caches them)
+    void addHost(QByteArray host)
+    {
+        if (host.endsWith('.'))
+            host.chop(1);
+        add(host, NameRecord::A);
+        add(host, NameRecord::Aaaa);
+    }
+
+    void next()
+    {
+        while (active.size() < PREFETCH_MAX_ACTIVE && !pending.isEmpty()) {
+            Query query = pending.takeFirst();
+            auto  dns   = new NameResolver(q);
+            QObject::connect(dns, &NameResolver::resultsReady, q, [this, dns](const QList<NameRecord> &results) {
+                for (const NameRecord &r : results) {
+                    if (r.type() == NameRecord::Srv)
+                        addHost(r.name());
+                }
+                done(dns);
+            });
+            QObject::connect(dns, &NameResolver::error, q, [this, dns](NameResolver::Error) { done(dns); });
+            active += dns;
+            dns->start(query.first, query.second, NameResolver::Background);
+        }
+    }
+
+    void done(NameResolver *dns)
+    {
+        active.removeOne(dns);
+        dns->deleteLater();
+        next();
+    }
+
+    void clear()
+    {
+        pending.clear();
+        seen.clear();
+        qDeleteAll(active);
+        active.clear();
+    }
+};
+
+NamePrefetcher::NamePrefetcher(QObject *parent) : QObject(parent) { d = new Private(this); }
+
+NamePrefetcher::~NamePrefetcher()
+{
+    d->clear();
+    delete d;
+}
+
+void NamePrefetcher::prefetchHost(const QString &host)
+{
+    // nothing to look up for literal addresses
+    if (!QHostAddress(host).isNull())
+        return;
+    d->addHost(host.toLatin1());
+}
+
+void NamePrefetcher::prefetchService(const QString &service, const QString &transport, const QString &domain)
+{
+    // same as ServiceResolver asks for it
+    QString srv_request("_" + service + "._" + transport + "." + domain + ".");
+    d->add(srv_request.toLocal8Bit(), NameRecord::Srv);
+}
+
+void NamePrefetcher::clear() { d->clear(); }
+
 //----------------------------------------------------------------------------
 // ServiceBrowser
 //----------------------------------------------------------------------------
 ServiceBrowser::ServiceBrowser(QObject *parent) : QObject(parent) { d = new Private(this); }
 
-ServiceBrowser::~ServiceBrowser() { delete d; }
+ServiceBrowser::~ServiceBrowser()
+{
+    d->remote->detach();
+    NameManager::run([remote = d->remote](NameManager *m) { m->browse_stop(remote); });
+    delete d;
+}
 
 void ServiceBrowser::start(const QString &type, const QString &domain)
 {
-    NameManager::instance()->browse_start(d, type, domain);
+    NameManager::run([remote = d->remote, type, domain](NameManager *m) { m->browse_start(remote, type, domain); });
 }
 
 void ServiceBrowser::stop() { }
@@ -1101,7 +1349,20 @@ ServiceResolver::ServiceResolver(QObject *parent) : QObject(parent)
     d = new Private(this);
 }
 
-ServiceResolver::~ServiceResolver() { delete d; }
+ServiceResolver::~ServiceResolver()
+{
+    stop_dns_sd();
+    delete d;
+}
+
+void ServiceResolver::stop_dns_sd()
+{
+    if (!d->dnsSd)
+        return;
+    d->dnsSd->detach();
+    NameManager::run([remote = std::move(d->dnsSd)](NameManager *m) { m->resolve_instance_stop(remote); });
+    d->dnsSd.reset();
+}
 
 void ServiceResolver::clear_resolvers()
 {
@@ -1136,7 +1397,12 @@ ServiceResolver::Protocol ServiceResolver::protocol() const { return d->requeste
 void ServiceResolver::setProtocol(ServiceResolver::Protocol p) { d->requestedProtocol = p; }
 
 /* DNS-SD lookup */
-void ServiceResolver::start(const QByteArray &name) { NameManager::instance()->resolve_instance_start(d, name); }
+void ServiceResolver::start(const QByteArray &name)
+{
+    stop_dns_sd();
+    d->dnsSd = Remote<ServiceResolver>::create(this);
+    NameManager::run([remote = d->dnsSd, name](NameManager *m) { m->resolve_instance_start(remote, name); });
+}
 
 /* normal host lookup */
 void ServiceResolver::start(const QString &host, quint16 port, const QString &service)
@@ -1358,7 +1624,11 @@ void ServiceResolver::tryNext()
     }
 }
 
-void ServiceResolver::stop() { clear_resolvers(); }
+void ServiceResolver::stop()
+{
+    stop_dns_sd();
+    clear_resolvers();
+}
 
 bool ServiceResolver::hasPendingSrv() const { return !d->srvList.isEmpty(); }
 
@@ -1383,22 +1653,42 @@ ServiceResolver::ProtoSplit ServiceResolver::happySplit()
     return s;
 }
 
+ServiceResolver *ServiceResolver::splitPending()
+{
+    ServiceResolver *r = new ServiceResolver(this);
+    r->setProtocol(d->requestedProtocol);
+    r->d->srvList = d->srvList;
+    r->d->domain  = d->domain;
+    r->d->port    = d->port;
+    d->srvList.clear();
+    return r;
+}
+
 //----------------------------------------------------------------------------
 // ServiceLocalPublisher
 //----------------------------------------------------------------------------
 ServiceLocalPublisher::ServiceLocalPublisher(QObject *parent) : QObject(parent) { d = new Private(this); }
 
-ServiceLocalPublisher::~ServiceLocalPublisher() { delete d; }
+ServiceLocalPublisher::~ServiceLocalPublisher()
+{
+    d->remote->detach();
+    delete d;
+}
 
 void ServiceLocalPublisher::publish(const QString &instance, const QString &type, int port,
                                     const QMap<QString, QByteArray> &attributes)
 {
-    NameManager::instance()->publish_start(d, instance, type, port, attributes);
+    NameManager::run([remote = d->remote, instance, type, port, attributes](NameManager *m) {
+        m->publish_start(remote, instance, type, port, attributes);
+    });
 }
 
 void ServiceLocalPublisher::updateAttributes(const QMap<QString, QByteArray> &attributes) { Q_UNUSED(attributes); }
 
-void ServiceLocalPublisher::addRecord(const NameRecord &rec) { NameManager::instance()->publish_extra_start(d, rec); }
+void ServiceLocalPublisher::addRecord(const NameRecord &rec)
+{
+    NameManager::run([remote = d->remote, rec](NameManager *m) { m->publish_extra_start(remote, rec); });
+}
 
 void ServiceLocalPublisher::cancel() { }
 
@@ -1407,6 +1697,21 @@ void ServiceLocalPublisher::cancel() { }
 //----------------------------------------------------------------------------
 void NetNames::cleanup() { NameManager::cleanup(); }
 
+Q_GLOBAL_STATIC(QMutex, tls_name_servers_mutex)
+Q_GLOBAL_STATIC(QList<NetNames::TlsNameServer>, tls_name_servers)
+
+void NetNames::setTlsNameServers(const QList<TlsNameServer> &servers)
+{
+    QMutexLocker locker(tls_name_servers_mutex());
+    *tls_name_servers() = servers;
+}
+
+QList<NetNames::TlsNameServer> NetNames::tlsNameServers()
+{
+    QMutexLocker locker(tls_name_servers_mutex());
+    return *tls_name_servers();
+}
+
 QString NetNames::diagnosticText()
 {
     // TODO
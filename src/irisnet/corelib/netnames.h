@@ -37,6 +37,13 @@ class NameManager;
 
 class IRISNET_EXPORT NetNames {
 public:
+    // a name server to be reached over DNS over TLS (RFC 7858)
+    struct TlsNameServer {
+        QHostAddress address;
+        QString      name; // the certificate has to be valid for it. any certificate is fine without one
+        quint16      port = 853;
+    };
+
     // free any shared data, shutdown internal dns sessions if necessary.
     static void cleanup();
 
@@ -47,6 +54,12 @@ public:
     static QByteArray idnaFromString(const QString &in);
     static QString    idnaToString(const QByteArray &in);
 
+    // internet lookups go to these instead of the system name servers, over TLS with one connection per
+    // server reused for all the queries. a server is asked over plain udp when its TLS port fails.
+    // empty (the default) for the system name servers. thread safe
+    static void                 setTlsNameServers(const QList<TlsNameServer> &servers);
+    static QList<TlsNameServer> tlsNameServers();
+
     // dns escaping
     static QByteArray escapeDomain(const QByteArray &in);
     static QByteArray unescapeDomain(const QByteArray &in);
@@ -420,8 +433,9 @@ public:
        \brief Resolve mode
     */
     enum Mode {
-        Single,   ///< A normal DNS query with a single result set.
-        LongLived ///< An endless query, with multiple result sets allowed.
+        Single,    ///< A normal DNS query with a single result set.
+        LongLived, ///< An endless query, with multiple result sets allowed.
+        Background ///< Like Single, but nobody waits for it.  It yields to the other queries when the resolver is busy.
     };
 
     /**
@@ -496,11 +510,48 @@ private:
     friend class Private;
     Private *d;
 
+    void finish();
+
     friend class NameManager;
 };
 
 IRISNET_EXPORT QDebug operator<<(QDebug, XMPP::NameResolver::Error);
 
+/**
+   \brief Looks up hosts in advance
+
+   Hosts which are about to be contacted can be given to a NamePrefetcher, it looks up their records in the background
+   and drops the results.  What matters is that they end up in the caches of the resolver backends (jdns, QHostInfo),
+   so the connections which follow don't have to wait for DNS.
+
+   Every name is looked up once during the lifetime of the object (or until clear()), and only a few of them at a time.
+*/
+class IRISNET_EXPORT NamePrefetcher : public QObject {
+    Q_OBJECT
+public:
+    NamePrefetcher(QObject *parent = nullptr);
+    ~NamePrefetcher();
+
+    /**
+       \brief Queues the A and AAAA lookups for \a host
+    */
+    void prefetchHost(const QString &host);
+
+    /**
+       \brief Queues the SRV lookup for \a service of \a domain, then the address lookups for the targets
+    */
+    void prefetchService(const QString &service, const QString &transport, const QString &domain);
+
+    /**
+       \brief Stops all lookups and forgets which names were looked up already
+    */
+    void clear();
+
+private:
+    class Private;
+    Private *d;
+};
+
 struct ServiceBoundRecord {
     QString    service;
     NameRecord record;
@@ -654,6 +705,11 @@ public:
      * Returned resolvers are owned by current resolver
      */
     ProtoSplit happySplit();
+    /*!
+     * Move the SRV records not tried yet to a new resolver, so they can be tried in parallel to the
+     * current one. Call tryNext() on the returned resolver to start it. It's owned by current resolver
+     */
+    ServiceResolver *splitPending();
 
 signals:
     /*!
@@ -681,6 +737,7 @@ private:
     bool lookup_host_fallback();
     bool try_next_host();
     void try_next_srv();
+    void stop_dns_sd();
 
     class Private;
     friend class Private;
@@ -20,6 +20,7 @@
 #include "netinterface.h"
 #include "objectsession.h"
 #include "qjdnsshared.h"
+#include "sharedtimer.h"
 
 // #define JDNS_DEBUG
 
@@ -239,7 +240,7 @@ public:
     QJDnsSharedDebug      db;
     QJDnsShared          *uni_net, *uni_local, *mul;
     QHostAddress          mul_addr4, mul_addr6;
-    NetInterfaceManager   netman;
+    NetInterfaceManager  *netman = nullptr; // for multicast only, it starts watching the interfaces
     QList<NetInterface *> ifaces;
     QTimer               *updateTimer;
 
@@ -300,6 +301,20 @@ public:
         return uni_net;
     }
 
+    // the configured ones are picked up with the next query
+    void apply_name_servers()
+    {
+        QList<QJDns::NameServer> list;
+        for (const NetNames::TlsNameServer &s : NetNames::tlsNameServers()) {
+            QJDns::NameServer ns;
+            ns.address = s.address;
+            ns.tlsPort = s.port;
+            ns.tlsName = s.name;
+            list += ns;
+        }
+        uni_net->setNameServers(list);
+    }
+
     QJDnsShared *ensure_uni_local()
     {
         if (!uni_local) {
@@ -321,14 +336,15 @@ public:
             mul = new QJDnsShared(QJDnsShared::Multicast, this);
             mul->setDebug(&db, "M");
 
-            connect(&netman, SIGNAL(interfaceAvailable(QString)), SLOT(iface_available(QString)));
+            netman = new NetInterfaceManager(this);
+            connect(netman, SIGNAL(interfaceAvailable(QString)), SLOT(iface_available(QString)));
 
             // get the current network interfaces.  this initial
             //   fetching should not trigger any calls to
             //   updateMulticastInterfaces().  only future
             //   activity should do that.
-            for (const QString &id : netman.interfaces()) {
-                NetInterface *iface = new NetInterface(id, &netman);
+            for (const QString &id : netman->interfaces()) {
+                NetInterface *iface = new NetInterface(id, netman);
                 connect(iface, SIGNAL(unavailable()), SLOT(iface_unavailable()));
                 ifaces += iface;
             }
@@ -359,7 +375,7 @@ private slots:
 
     void iface_available(const QString &id)
     {
-        NetInterface *iface = new NetInterface(id, &netman);
+        NetInterface *iface = new NetInterface(id, netman);
         connect(iface, SIGNAL(unavailable()), SLOT(iface_unavailable()));
         ifaces += iface;
 
@@ -573,6 +589,7 @@ public:
             if (isLocalName)
                 i->useLocal = true;
             items += i;
+            global->apply_name_servers();
             i->req->query(name, qType);
             // if query ends in .local, simultaneously do local resolve
             if (isLocalName)
@@ -613,6 +630,13 @@ public:
         releaseItem(i);
     }
 
+    virtual void resolve_setBackground(int id, bool background)
+    {
+        Item *i = getItemById(id);
+        if (i && i->req)
+            i->req->setPriority(background ? QJDnsSharedRequest::Background : QJDnsSharedRequest::Interactive);
+    }
+
     virtual void resolve_localResultsReady(int id, const QList<XMPP::NameRecord> &results)
     {
         Item *i = getItemById(id);
@@ -834,7 +858,7 @@ public:
     QJDnsSharedRequest req6;   // for AAAA
     bool               haveTxt;
     SrvState           srvState;
-    QTimer            *opTimer;
+    SharedTimer       *opTimer;
 
     // out
     QList<QByteArray> attribs;
@@ -850,7 +874,7 @@ public:
         connect(&req, SIGNAL(resultsReady()), SLOT(req_ready()));
         connect(&req6, SIGNAL(resultsReady()), SLOT(req6_ready()));
 
-        opTimer = new QTimer(this);
+        opTimer = new SharedTimer(this);
         connect(opTimer, SIGNAL(timeout()), SLOT(op_timeout()));
         opTimer->setSingleShot(true);
     }
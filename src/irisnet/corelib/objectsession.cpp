@@ -23,6 +23,7 @@
 #include <QMetaObject>
 #include <QMetaType>
 #include <QTimer>
+#include <deque>
 #include <stdlib.h>
 
 namespace XMPP {
@@ -98,9 +99,29 @@ public:
 
             return true;
         }
+
+        void invoke()
+        {
+            Q_ASSERT(args.count() <= 10);
+
+            QGenericArgument arg[10];
+            for (int n = 0; n < args.count(); ++n)
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+                arg[n] = QGenericArgument(QMetaType::typeName(args[n].type), args[n].data);
+#else
+                arg[n] = QGenericArgument(QMetaType(args[n].type).name(), args[n].data);
+#endif
+
+            bool ok;
+            ok = QMetaObject::invokeMethod(obj, method.data(), Qt::DirectConnection, arg[0], arg[1], arg[2], arg[3],
+                                           arg[4], arg[5], arg[6], arg[7], arg[8], arg[9]);
+            Q_ASSERT(ok);
+            if (!ok)
+                abort();
+        }
     };
 
-    QList<MethodCall *>                  pendingCalls;
+    std::deque<ObjectSession::Call>      pendingCalls;
     QTimer                              *callTrigger;
     bool                                 paused;
     QList<ObjectSessionWatcherPrivate *> watchers;
@@ -119,26 +140,42 @@ public:
         callTrigger->disconnect(this);
         callTrigger->setParent(nullptr);
         callTrigger->deleteLater();
-        qDeleteAll(pendingCalls);
         pendingCalls.clear();
     }
 
-    void addPendingCall(MethodCall *call)
+    void addPendingCall(ObjectSession::Call &&call)
     {
-        pendingCalls += call;
+        pendingCalls.push_back(std::move(call));
         if (!paused && !callTrigger->isActive())
             callTrigger->start();
     }
 
-    bool havePendingCall(QObject *obj, const char *method) const
+    void addPendingCall(MethodCall *call)
     {
-        for (const MethodCall *call : pendingCalls) {
-            if (call->obj == obj && qstrcmp(call->method.data(), method) == 0)
+        const char         *name = call->method.constData();
+        ObjectSession::Call c([mc = std::unique_ptr<MethodCall>(call)]() { mc->invoke(); });
+        c.obj  = call->obj;
+        c.name = name;
+        addPendingCall(std::move(c));
+    }
+
+    bool havePendingCall(const ObjectSession::Call &key) const
+    {
+        for (const auto &call : pendingCalls) {
+            if (call.matches(key))
                 return true;
         }
         return false;
     }
 
+    bool havePendingCall(QObject *obj, const char *method) const
+    {
+        ObjectSession::Call key([]() {});
+        key.obj  = obj;
+        key.name = method;
+        return havePendingCall(key);
+    }
+
     void invalidateWatchers()
     {
         for (int n = 0; n < watchers.count(); ++n)
@@ -147,30 +184,20 @@ public:
     }
 
 private slots:
+    // runs the calls deferred so far in one go. what they defer in turn waits for the next event
     void doCall()
     {
-        MethodCall *call = pendingCalls.takeFirst();
-        if (!pendingCalls.isEmpty())
+        ObjectSessionWatcher watch(q);
+        size_t               count = pendingCalls.size();
+        while (count-- && !paused && !pendingCalls.empty()) {
+            ObjectSession::Call call(std::move(pendingCalls.front()));
+            pendingCalls.pop_front();
+            call();
+            if (!watch.isValid())
+                return; // reset or deleted, the trigger is taken care of
+        }
+        if (!paused && !pendingCalls.empty())
             callTrigger->start();
-
-        Q_ASSERT(call->args.count() <= 10);
-
-        QGenericArgument arg[10];
-        for (int n = 0; n < call->args.count(); ++n)
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-            arg[n] = QGenericArgument(QMetaType::typeName(call->args[n].type), call->args[n].data);
-#else
-            arg[n] = QGenericArgument(QMetaType(call->args[n].type).name(), call->args[n].data);
-#endif
-
-        bool ok;
-        ok = QMetaObject::invokeMethod(call->obj, call->method.data(), Qt::DirectConnection, arg[0], arg[1], arg[2],
-                                       arg[3], arg[4], arg[5], arg[6], arg[7], arg[8], arg[9]);
-        Q_ASSERT(ok);
-        if (!ok)
-            abort();
-
-        delete call;
     }
 };
 
@@ -200,12 +227,20 @@ void ObjectSession::reset()
     d->invalidateWatchers();
     if (d->callTrigger->isActive())
         d->callTrigger->stop();
-    qDeleteAll(d->pendingCalls);
     d->pendingCalls.clear();
 }
 
 bool ObjectSession::isDeferred(QObject *obj, const char *method) { return d->havePendingCall(obj, method); }
 
+void ObjectSession::enqueue(Call &&call, bool exclusive)
+{
+    if (exclusive && d->havePendingCall(call))
+        return;
+    d->addPendingCall(std::move(call));
+}
+
+bool ObjectSession::hasPending(const Call &key) const { return d->havePendingCall(key); }
+
 void ObjectSession::defer(QObject *obj, const char *method, QGenericArgument val0, QGenericArgument val1,
                           QGenericArgument val2, QGenericArgument val3, QGenericArgument val4, QGenericArgument val5,
                           QGenericArgument val6, QGenericArgument val7, QGenericArgument val8, QGenericArgument val9)
@@ -21,6 +21,18 @@
 
 #include <QObject>
 
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// deferred callables up to this size are stored in the queue itself, bigger ones are boxed
+#define OBJECTSESSION_INLINE_CALL 48
+// what a pointer to member function may take, 16 bytes on the Itanium ABI and up to 24 with MSVC
+#define OBJECTSESSION_MEMBER_KEY 24
+
 namespace XMPP {
 class ObjectSessionPrivate;
 class ObjectSessionWatcherPrivate;
@@ -49,11 +61,116 @@ public:
                         QGenericArgument val7 = QGenericArgument(), QGenericArgument val8 = QGenericArgument(),
                         QGenericArgument val9 = QGenericArgument());
 
+    // the typed variants: no lookup by method name and no boxing of the arguments, which are stored by value
+    // and passed as lvalues. all the calls are run in the order they were deferred, but isDeferred() by name
+    // doesn't see the typed calls and the other way around
+    template <typename T, typename M, typename... Args>
+    std::enable_if_t<std::is_member_function_pointer_v<M>> defer(T *obj, M method, Args &&...args)
+    {
+        enqueue(typedCall(obj, method, std::forward<Args>(args)...), false);
+    }
+    template <typename T, typename M, typename... Args>
+    std::enable_if_t<std::is_member_function_pointer_v<M>> deferExclusive(T *obj, M method, Args &&...args)
+    {
+        enqueue(typedCall(obj, method, std::forward<Args>(args)...), true);
+    }
+    template <typename M>
+    std::enable_if_t<std::is_member_function_pointer_v<M>, bool> isDeferred(const void *obj, M method)
+    {
+        Call key([]() {});
+        key.setMember(obj, method);
+        return hasPending(key);
+    }
+    // any callable. it is run and dropped like the other calls
+    template <typename F> std::enable_if_t<std::is_invocable_v<std::decay_t<F> &>> defer(F &&f)
+    {
+        enqueue(Call(std::forward<F>(f)), false);
+    }
+
     void pause();
     void resume();
 
 private:
     friend class ObjectSessionWatcher;
+    friend class ObjectSessionPrivate;
+
+    // a type-erased deferred call, kept in place if small enough
+    class Call {
+    public:
+        const void   *obj                              = nullptr;
+        const char   *name                             = nullptr; // the method of a call by name
+        unsigned char member[OBJECTSESSION_MEMBER_KEY] = {};      // the method of a typed call
+
+        template <typename F> explicit Call(F &&f)
+        {
+            using D = std::decay_t<F>;
+            if constexpr (sizeof(D) <= OBJECTSESSION_INLINE_CALL && alignof(D) <= alignof(std::max_align_t)
+                          && std::is_nothrow_move_constructible_v<D>) {
+                new (storage) D(std::forward<F>(f));
+                ops = &opsFor<D>;
+            } else {
+                auto boxed = [p = std::make_unique<D>(std::forward<F>(f))]() { (*p)(); };
+                new (storage) decltype(boxed)(std::move(boxed));
+                ops = &opsFor<decltype(boxed)>;
+            }
+        }
+        Call(Call &&other) noexcept : obj(other.obj), name(other.name), ops(other.ops)
+        {
+            std::memcpy(member, other.member, sizeof(member));
+            ops->relocate(other.storage, storage);
+            other.ops = nullptr;
+        }
+        Call &operator=(Call &&) = delete;
+        ~Call()
+        {
+            if (ops)
+                ops->destroy(storage);
+        }
+
+        void operator()() { ops->invoke(storage); }
+
+        template <typename M> void setMember(const void *o, M method)
+        {
+            static_assert(sizeof(M) <= OBJECTSESSION_MEMBER_KEY, "pointer to member too big");
+            obj = o;
+            std::memcpy(member, &method, sizeof(M));
+        }
+
+        bool matches(const Call &key) const
+        {
+            if (obj != key.obj || !name != !key.name)
+                return false;
+            return name ? qstrcmp(name, key.name) == 0 : std::memcmp(member, key.member, sizeof(member)) == 0;
+        }
+
+    private:
+        struct Ops {
+            void (*invoke)(void *);
+            void (*relocate)(void *from, void *to); // move constructs and destroys the source
+            void (*destroy)(void *);
+        };
+        template <typename D>
+        static constexpr Ops opsFor = { [](void *p) { (*static_cast<D *>(p))(); },
+                                        [](void *from, void *to) {
+                                            new (to) D(std::move(*static_cast<D *>(from)));
+                                            static_cast<D *>(from)->~D();
+                                        },
+                                        [](void *p) { static_cast<D *>(p)->~D(); } };
+
+        alignas(std::max_align_t) unsigned char storage[OBJECTSESSION_INLINE_CALL];
+        const Ops *ops = nullptr;
+    };
+
+    template <typename T, typename M, typename... Args> static Call typedCall(T *obj, M method, Args &&...args)
+    {
+        Call call([obj, method, ...args = std::forward<Args>(args)]() mutable { (obj->*method)(args...); });
+        call.setMember(obj, method);
+        return call;
+    }
+
+    void enqueue(Call &&call, bool exclusive);
+    bool hasPending(const Call &key) const;
+
     ObjectSessionPrivate *d;
 };
 
@@ -0,0 +1,202 @@
+/*
+ * sharedtimer.cpp - timers of a thread on one QTimer, coalesced within their slack
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "sharedtimer.h"
+
+#include "metrics.h"
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMap>
+#include <QThreadStorage>
+#include <QTimer>
+
+namespace XMPP {
+
+class SharedTimerQueue;
+
+class SharedTimer::Private {
+public:
+    int               interval   = 0;
+    int               slack      = SHAREDTIMER_SLACK;
+    bool              singleShot = false;
+    qint64            due        = -1; // the slot it's queued in, -1 if inactive
+    SharedTimerQueue *queue      = nullptr;
+};
+
+// the timers of one thread, in slots by the time they are due. joining a slot is what coalesces them
+class SharedTimerQueue {
+public:
+    QElapsedTimer                      clock;
+    QTimer                             timer;
+    QMap<qint64, QList<SharedTimer *>> slotsByDue;
+    QList<SharedTimer *>               firing; // taken from the due slots, stopped ones are nulled
+    qint64                             armedFor = -1;
+    quint64                            wakeups  = 0;
+    quint64                            timeouts = 0;
+
+    SharedTimerQueue()
+    {
+        clock.start();
+        timer.setSingleShot(true);
+        timer.setTimerType(Qt::PreciseTimer); // the slack is applied here already
+        QObject::connect(&timer, &QTimer::timeout, [this]() { fire(); });
+    }
+
+    static SharedTimerQueue *instance()
+    {
+        static QThreadStorage<SharedTimerQueue *> queues;
+        if (!queues.hasLocalData())
+            queues.setLocalData(new SharedTimerQueue);
+        return queues.localData();
+    }
+
+    void schedule(SharedTimer *t)
+    {
+        auto  *d        = t->d;
+        qint64 earliest = clock.elapsed() + qMax(0, d->interval);
+        qint64 latest   = earliest + qint64(d->interval) * d->slack / 100;
+
+        auto it = slotsByDue.lowerBound(earliest);
+        if (it != slotsByDue.end() && it.key() <= latest) {
+            d->due = it.key();
+        } else if (latest > earliest) {
+            // the biggest power of two within the slack, so the timers of the same scale meet on its multiples
+            qint64 granule = qint64(1) << (63 - qCountLeadingZeroBits(quint64(latest - earliest)));
+            d->due         = (earliest + granule - 1) / granule * granule;
+        } else {
+            d->due = earliest;
+        }
+        slotsByDue[d->due].append(t);
+        if (armedFor < 0 || d->due < armedFor)
+            arm();
+    }
+
+    void remove(SharedTimer *t)
+    {
+        auto it = slotsByDue.find(t->d->due);
+        if (it != slotsByDue.end()) {
+            it->removeOne(t);
+            if (it->isEmpty()) {
+                slotsByDue.erase(it);
+                if (t->d->due == armedFor)
+                    arm();
+            }
+        }
+        int i = firing.indexOf(t);
+        if (i >= 0)
+            firing[i] = nullptr;
+        t->d->due = -1;
+    }
+
+    void arm()
+    {
+        if (slotsByDue.isEmpty()) {
+            armedFor = -1;
+            timer.stop();
+            return;
+        }
+        armedFor = slotsByDue.firstKey();
+        timer.start(int(qMax(qint64(0), armedFor - clock.elapsed())));
+    }
+
+    void fire()
+    {
+        ++wakeups;
+        IRIS_METRIC_ADD(TimerWakeups, 1);
+        qint64 now = clock.elapsed();
+        while (!slotsByDue.isEmpty() && slotsByDue.firstKey() <= now) {
+            firing += slotsByDue.first();
+            slotsByDue.erase(slotsByDue.begin());
+        }
+        armedFor = -1;
+        while (!firing.isEmpty()) {
+            SharedTimer *t = firing.takeFirst();
+            if (!t)
+                continue;
+            t->d->due = -1;
+            if (!t->d->singleShot)
+                schedule(t);
+            ++timeouts;
+            IRIS_METRIC_ADD(TimerTimeouts, 1);
+            emit t->timeout(); // may stop, restart or delete any of the timers
+        }
+        if (armedFor < 0)
+            arm();
+    }
+};
+
+SharedTimer::SharedTimer(QObject *parent) : QObject(parent), d(new Private) { }
+
+SharedTimer::~SharedTimer()
+{
+    stop();
+    delete d;
+}
+
+void SharedTimer::setSingleShot(bool singleShot) { d->singleShot = singleShot; }
+
+bool SharedTimer::isSingleShot() const { return d->singleShot; }
+
+void SharedTimer::setInterval(int msecs)
+{
+    d->interval = msecs;
+    if (isActive())
+        start();
+}
+
+int SharedTimer::interval() const { return d->interval; }
+
+void SharedTimer::setSlack(int percent) { d->slack = qBound(0, percent, 100); }
+
+int SharedTimer::slack() const { return d->slack; }
+
+bool SharedTimer::isActive() const { return d->due >= 0; }
+
+int SharedTimer::remainingTime() const
+{
+    if (!isActive())
+        return -1;
+    return int(qMax(qint64(0), d->due - d->queue->clock.elapsed()));
+}
+
+quint64 SharedTimer::wakeups() { return SharedTimerQueue::instance()->wakeups; }
+
+quint64 SharedTimer::timeouts() { return SharedTimerQueue::instance()->timeouts; }
+
+void SharedTimer::start(int msecs)
+{
+    d->interval = msecs;
+    start();
+}
+
+void SharedTimer::start()
+{
+    stop();
+    d->queue = SharedTimerQueue::instance();
+    d->queue->schedule(this);
+}
+
+void SharedTimer::stop()
+{
+    if (isActive())
+        d->queue->remove(this);
+}
+
+} // namespace XMPP
@@ -0,0 +1,72 @@
+/*
+ * sharedtimer.h - timers of a thread on one QTimer, coalesced within their slack
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IRIS_SHAREDTIMER_H
+#define IRIS_SHAREDTIMER_H
+
+#include <QObject>
+
+// how late a timeout may come by default, in percent of the interval
+#define SHAREDTIMER_SLACK 10
+
+namespace XMPP {
+/*
+ * A drop-in for the QTimers of components which exist many times over (resolvers, nomination and idle
+ * timeouts, keepalives). All the SharedTimers of a thread are run by one QTimer of that thread. A timeout
+ * may be delayed by its slack, and the deadlines are rounded within it to a power of two milliseconds, so
+ * that timers started at about the same time with about the same interval go off together and with many
+ * sessions there are a few wakeups instead of one per timer. Timers which need to be exact keep their
+ * QTimer or get a slack of 0.
+ */
+class SharedTimer : public QObject {
+    Q_OBJECT
+public:
+    SharedTimer(QObject *parent = nullptr);
+    ~SharedTimer();
+
+    void setSingleShot(bool singleShot);
+    bool isSingleShot() const;
+    void setInterval(int msecs);
+    int  interval() const;
+    void setSlack(int percent);
+    int  slack() const;
+
+    bool isActive() const;
+    int  remainingTime() const; // -1 if inactive
+
+    // the wakeups of the shared timer of this thread and the timeouts they delivered
+    static quint64 wakeups();
+    static quint64 timeouts();
+
+public slots:
+    void start(int msecs);
+    void start();
+    void stop();
+
+signals:
+    void timeout();
+
+private:
+    friend class SharedTimerQueue;
+    class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // IRIS_SHAREDTIMER_H
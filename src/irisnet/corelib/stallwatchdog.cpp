@@ -0,0 +1,129 @@
+/*
+ * stallwatchdog.cpp - event loop stalls and the handlers they come from
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stallwatchdog.h"
+
+#include "metrics.h"
+
+#include <QMutex>
+#include <QPointer>
+#include <QThread>
+#include <QTimer>
+
+// msecs between the probes of the event loop lag
+#define LAG_PROBE_INTERVAL 100
+
+namespace XMPP {
+namespace {
+    const char *const componentNames[StallWatchdog::ComponentCount] = {
+        "event_loop", "stream", "distribute", "task", "ice", "file_transfer",
+    };
+
+    thread_local StallWatchdog::Scope *innermost = nullptr;
+
+    QMutex                  reporterMutex;
+    StallWatchdog::Reporter reporter;
+
+    // a timer which is late by the time the loop was busy elsewhere
+    class LagProbe : public QObject {
+        Q_OBJECT
+    public:
+        LagProbe()
+        {
+            timer.setTimerType(Qt::PreciseTimer);
+            connect(&timer, &QTimer::timeout, this, &LagProbe::probe);
+            timer.start(LAG_PROBE_INTERVAL);
+            since.start();
+        }
+
+    private:
+        void probe()
+        {
+            int lag = int(qMax<qint64>(since.restart() - LAG_PROBE_INTERVAL, 0));
+            IRIS_METRIC_RECORD(EventLoopLagMsecs, lag);
+            int threshold = StallWatchdog::threshold();
+            if (threshold >= 0 && lag >= threshold)
+                StallWatchdog::report(StallWatchdog::EventLoop, QString(), lag);
+        }
+
+        QTimer        timer;
+        QElapsedTimer since;
+    };
+
+    QPointer<LagProbe> lagProbe;
+} // namespace
+
+void StallWatchdog::setThreshold(int msecs)
+{
+    thresholdMsecs.store(qMax(msecs, -1), std::memory_order_relaxed);
+    if (lagProbe && (msecs < 0 || lagProbe->thread() != QThread::currentThread())) {
+        lagProbe->deleteLater();
+        lagProbe = nullptr;
+    }
+    if (msecs >= 0 && !lagProbe)
+        lagProbe = new LagProbe;
+}
+
+void StallWatchdog::setReporter(Reporter r)
+{
+    QMutexLocker locker(&reporterMutex);
+    reporter = std::move(r);
+}
+
+const char *StallWatchdog::name(Component component) { return componentNames[component]; }
+
+void StallWatchdog::report(Component component, const QString &detail, int msecs)
+{
+#ifdef IRIS_METRICS
+    // the counters are in the order of the components
+    Metrics::add(Metrics::Counter(Metrics::EventLoopStalls + component));
+    if (component != EventLoop)
+        Metrics::record(Metrics::StallMsecs, quint64(msecs));
+#endif
+
+    Reporter r;
+    {
+        QMutexLocker locker(&reporterMutex);
+        r = reporter;
+    }
+    if (r)
+        r(component, detail, msecs);
+}
+
+void StallWatchdog::Scope::begin(Component c)
+{
+    component = c;
+    parent    = std::exchange(innermost, this);
+    timer.start();
+}
+
+int StallWatchdog::Scope::end()
+{
+    innermost    = parent;
+    qint64 total = timer.nsecsElapsed();
+    qint64 own   = total - nestedNsecs;
+    int    limit = threshold();
+    bool   stall = limit >= 0 && own >= qint64(limit) * 1000000;
+    if (parent)
+        parent->nestedNsecs += stall ? total : nestedNsecs;
+    return stall ? int(own / 1000000) : -1;
+}
+} // namespace XMPP
+
+#include "stallwatchdog.moc"
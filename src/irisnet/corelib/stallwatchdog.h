@@ -0,0 +1,107 @@
+/*
+ * stallwatchdog.h - event loop stalls and the handlers they come from
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IRIS_STALLWATCHDOG_H
+#define IRIS_STALLWATCHDOG_H
+
+#include <QElapsedTimer>
+#include <QString>
+
+#include <atomic>
+#include <functional>
+#include <utility>
+
+namespace XMPP {
+/*
+ * Off by default. Once a threshold is set, the lag of the event loop of the thread which set it is measured,
+ * and the hot entry points of the library wrapped with IRIS_STALL_WATCH time their calls. A call taking longer
+ * than the threshold is reported with its component and a detail like the stanza type. Nested calls are
+ * attributed to the innermost one, an outer one is reported only for what it spent itself. The reports go to
+ * the reporter and, when built with IRIS_ENABLE_METRICS, to the stall counters and histograms of Metrics.
+ * A disabled watch is a relaxed atomic load.
+ */
+class StallWatchdog {
+public:
+    enum Component {
+        EventLoop, // the lag of the loop itself, reported without a detail
+        Stream,
+        Distribute, // the incoming stanzas in Client
+        Task,
+        Ice,
+        FileTransfer,
+        ComponentCount
+    };
+
+    // from the thread of the call which stalled
+    using Reporter = std::function<void(Component component, const QString &detail, int msecs)>;
+
+    // -1 disables it. the event loop is watched in the calling thread, the main one mostly
+    static void        setThreshold(int msecs);
+    static inline int  threshold() { return thresholdMsecs.load(std::memory_order_relaxed); }
+    static void        setReporter(Reporter reporter);
+    static const char *name(Component component);
+
+    class Scope {
+    public:
+        void begin(Component component);
+        int  end(); // msecs to report, -1 if none
+
+        Component component;
+
+    private:
+        QElapsedTimer timer;
+        qint64        nestedNsecs = 0; // reported by the nested ones
+        Scope        *parent      = nullptr;
+    };
+
+    // times its lifetime. detail is called only for a stall, so it's as cheap as a disabled watch otherwise.
+    //   it must not use what the call may delete
+    template <typename Detail> class Watch {
+    public:
+        inline Watch(Component component, Detail &&detail) : detail(std::move(detail))
+        {
+            if ((active = threshold() >= 0))
+                scope.begin(component);
+        }
+        inline ~Watch()
+        {
+            if (!active)
+                return;
+            int msecs = scope.end();
+            if (msecs >= 0)
+                report(scope.component, detail(), msecs);
+        }
+
+    private:
+        Scope  scope;
+        Detail detail;
+        bool   active;
+    };
+
+    static void report(Component component, const QString &detail, int msecs);
+
+private:
+    static inline std::atomic<int> thresholdMsecs { -1 };
+};
+} // namespace XMPP
+
+#define IRIS_STALL_WATCH(component, detail)                                                                            \
+    XMPP::StallWatchdog::Watch irisStallWatch(XMPP::StallWatchdog::component, [&]() -> QString { return detail; })
+
+#endif // IRIS_STALLWATCHDOG_H
@@ -0,0 +1,481 @@
+/*
+ * bosh.cpp - XMPP over BOSH (XEP-0124/XEP-0206)
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "bosh.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QPointer>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QUrl>
+#include <QXmlStreamReader>
+
+#define BOSH_VERSION "1.11"
+#define BOSH_DEFAULT_WAIT 60
+#define BOSH_DEFAULT_REQUESTS 2
+// transport level failures of one request we try to get over by sending it again
+#define BOSH_MAX_RETRIES 3
+
+static const char *NS_HTTPBIND = "http://jabber.org/protocol/httpbind";
+static const char *NS_XBOSH    = "urn:xmpp:xbosh";
+
+// CS_NAMESPACE_BEGIN
+static QByteArray attr(const char *name, const QString &value)
+{
+    return QByteArray(" ") + name + "=\"" + value.toHtmlEscaped().toUtf8() + '"';
+}
+
+static QByteArray attr(const char *name, qint64 value) { return attr(name, QString::number(value)); }
+
+// end of the start tag of the element starting at from, skipping '>' in attribute values
+static int startTagEnd(const QByteArray &data, int from)
+{
+    char quote = 0;
+    for (int n = from; n < data.size(); ++n) {
+        char c = data[n];
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '>') {
+            return n;
+        }
+    }
+    return -1;
+}
+
+class BoshStream::Private {
+public:
+    enum State { Idle, Creating, Open };
+
+    QNetworkAccessManager *nam    = nullptr;
+    bool                   ownNam = false;
+
+    QUrl    url;
+    QString domain;
+    QString route;
+    int     wait = BOSH_DEFAULT_WAIT;
+
+    State   state = Idle;
+    QString sid;
+    int     requests = BOSH_DEFAULT_REQUESTS;
+    int     hold     = 1;
+    int     polling  = 0; // secs to leave between empty requests when the manager doesn't hold any
+    qint64  rid      = 0; // the next request gets this one
+    qint64  nextRead = 0; // rid of the response to be read next
+
+    QHash<QNetworkReply *, qint64> replies;   // requests in flight
+    QMap<qint64, QByteArray>       sent;      // bodies of them, to be sent again on transport errors
+    QHash<qint64, int>             retries;   // how many times a request was sent again
+    QMap<qint64, QByteArray>       responses; // answered out of order, waiting for the earlier ones
+
+    QByteArray pending;                  // written, not looked at yet
+    QByteArray payload;                  // stanzas going with the next request
+    QByteArray early;                    // payload received before the XMPP layer opened its stream
+    int        streamHeaders    = 0;     // stream headers written by the XMPP layer
+    bool       restartPending   = false; // a stream restart waits for a free request
+    qint64     restartRid       = -1;    // the response to it is read behind a new stream header
+    bool       terminatePending = false; // the XMPP layer ended its stream
+
+    QTimer        flushTimer; // collects the writes of one event loop pass into one request
+    QTimer        pollTimer;
+    QElapsedTimer lastEmpty; // when the last request without payload went out
+
+    QByteArray streamHeader() const
+    {
+        return QByteArray("<?xml version=\"1.0\"?><stream:stream xmlns=\"jabber:client\" "
+                          "xmlns:stream=\"http://etherx.jabber.org/streams\" version=\"1.0\"")
+            + attr("from", domain) + attr("id", sid) + '>';
+    }
+};
+
+BoshStream::BoshStream(QObject *parent) : ByteStream(parent)
+{
+    d = new Private;
+    d->flushTimer.setSingleShot(true);
+    d->flushTimer.setInterval(0);
+    connect(&d->flushTimer, &QTimer::timeout, this, [this]() {
+        processWrites();
+        sendRequests();
+    });
+    d->pollTimer.setSingleShot(true);
+    connect(&d->pollTimer, &QTimer::timeout, this, [this]() { sendRequests(); });
+}
+
+BoshStream::~BoshStream()
+{
+    resetConnection(true);
+    if (d->ownNam)
+        delete d->nam;
+    delete d;
+}
+
+void BoshStream::setNetworkAccessManager(QNetworkAccessManager *nam)
+{
+    if (d->ownNam)
+        delete d->nam;
+    d->nam    = nam;
+    d->ownNam = false;
+}
+
+void BoshStream::setWait(int seconds) { d->wait = seconds; }
+
+int BoshStream::wait() const { return d->wait; }
+
+void BoshStream::resetConnection(bool clear)
+{
+    for (auto it = d->replies.begin(); it != d->replies.end(); ++it) {
+        it.key()->disconnect(this);
+        it.key()->abort();
+        it.key()->deleteLater();
+    }
+    d->replies.clear();
+    d->sent.clear();
+    d->retries.clear();
+    d->responses.clear();
+    d->pending.clear();
+    d->payload.clear();
+    d->early.clear();
+    d->sid.clear();
+    d->state            = Private::Idle;
+    d->streamHeaders    = 0;
+    d->restartPending   = false;
+    d->restartRid       = -1;
+    d->terminatePending = false;
+    d->flushTimer.stop();
+    d->pollTimer.stop();
+    if (clear)
+        clearReadBuffer();
+    clearWriteBuffer();
+}
+
+void BoshStream::connectToUrl(const QUrl &url, const QString &domain, const QString &route)
+{
+    resetConnection(true);
+    if (!d->nam) {
+        d->nam    = new QNetworkAccessManager;
+        d->ownNam = true;
+    }
+    d->url    = url;
+    d->domain = domain;
+    d->route  = route;
+    d->state  = Private::Creating;
+    // rids are up to 2^53 and must not wrap during the session
+    d->rid      = qint64(QRandomGenerator::global()->generate64() & ((quint64(1) << 40) - 1)) + 1;
+    d->nextRead = d->rid;
+
+    QByteArray b = QByteArray("<body") + attr("content", "text/xml; charset=utf-8") + attr("hold", 1)
+        + attr("rid", d->rid) + attr("to", domain);
+    if (!route.isEmpty())
+        b += attr("route", route);
+    b += attr("ver", BOSH_VERSION) + attr("wait", d->wait) + attr("ack", 1) + attr("xml:lang", "en")
+        + attr("xmpp:version", "1.0") + attr("xmlns", NS_HTTPBIND) + attr("xmlns:xmpp", NS_XBOSH) + "/>";
+    post(d->rid++, b);
+}
+
+bool BoshStream::isOpen() const { return d->state == Private::Open; }
+
+void BoshStream::close()
+{
+    if (d->state == Private::Idle)
+        return;
+
+    // tell the manager we are gone together with whatever is left. nobody waits for the answer
+    processWrites();
+    if (d->state == Private::Open) {
+        QByteArray b = QByteArray("<body") + attr("rid", d->rid++) + attr("sid", d->sid) + attr("type", "terminate")
+            + attr("xmlns", NS_HTTPBIND) + '>' + d->payload + "</body>";
+        QNetworkRequest req(d->url);
+        req.setHeader(QNetworkRequest::ContentTypeHeader, "text/xml; charset=utf-8");
+        QNetworkReply *r = d->nam->post(req, b);
+        connect(r, &QNetworkReply::finished, r, &QObject::deleteLater);
+    }
+    resetConnection();
+}
+
+int BoshStream::tryWrite()
+{
+    if (d->state != Private::Idle && !d->flushTimer.isActive())
+        d->flushTimer.start();
+    return 0;
+}
+
+// split what the XMPP layer wrote into stream headers, stream end and stanzas
+void BoshStream::processWrites()
+{
+    QByteArray a = takeWrite();
+    if (!a.isEmpty())
+        emit bytesWritten(a.size());
+    d->pending += a;
+
+    while (!d->pending.isEmpty()) {
+        QByteArray &p = d->pending;
+        if (p.startsWith("<?xml")) {
+            int end = p.indexOf("?>");
+            if (end == -1)
+                break;
+            p.remove(0, end + 2);
+        } else if (p.startsWith("<stream:stream")) {
+            int end = startTagEnd(p, 0);
+            if (end == -1)
+                break;
+            p.remove(0, end + 1);
+            if (d->streamHeaders++ == 0) {
+                // the session is created already. what came with it goes behind the header
+                appendRead(d->streamHeader() + d->early);
+                d->early.clear();
+                QTimer::singleShot(0, this, [this]() {
+                    if (bytesAvailable())
+                        emit readyRead();
+                });
+            } else {
+                d->restartPending = true;
+            }
+        } else if (p.startsWith("</stream:stream>")) {
+            p.remove(0, 16);
+            d->terminatePending = true;
+        } else {
+            int end = int(p.size());
+            for (const char *mark : { "<?xml", "<stream:stream", "</stream:stream>" }) {
+                int n = p.indexOf(mark, 1);
+                if (n != -1 && n < end)
+                    end = n;
+            }
+            d->payload += p.left(end);
+            p.remove(0, end);
+        }
+    }
+}
+
+void BoshStream::sendRequests()
+{
+    if (d->state != Private::Open)
+        return;
+    // whitespace keep-alives, the held request does that job here
+    if (!d->payload.isEmpty() && d->payload.trimmed().isEmpty())
+        d->payload.clear();
+
+    while (d->replies.size() < d->requests && !d->terminatePending) {
+        bool empty = d->payload.isEmpty() && !d->restartPending;
+        // an empty request only to have one for the manager to push data with
+        if (empty && !d->replies.isEmpty())
+            break;
+        if (empty && d->hold == 0 && d->polling > 0 && d->lastEmpty.isValid()
+            && d->lastEmpty.elapsed() < d->polling * 1000) {
+            if (!d->pollTimer.isActive())
+                d->pollTimer.start(int(d->polling * 1000 - d->lastEmpty.elapsed()));
+            break;
+        }
+
+        QByteArray b = QByteArray("<body") + attr("rid", d->rid) + attr("sid", d->sid);
+        // tell about the responses we got only if they didn't come in order
+        if (d->nextRead - 1 < d->rid - 1 && !d->responses.isEmpty())
+            b += attr("ack", d->nextRead - 1);
+        if (d->restartPending) {
+            b += attr("to", d->domain) + attr("xml:lang", "en") + attr("xmpp:restart", "true")
+                + attr("xmlns:xmpp", NS_XBOSH);
+            d->restartPending = false;
+            d->restartRid     = d->rid;
+        }
+        b += attr("xmlns", NS_HTTPBIND);
+        if (d->payload.isEmpty()) {
+            b += "/>";
+            d->lastEmpty.start();
+        } else {
+            b += '>' + d->payload + "</body>";
+            d->payload.clear();
+        }
+        post(d->rid++, b);
+    }
+
+    if (d->terminatePending) {
+        // the XMPP layer closed its stream. ask the manager to end the session and read its end back
+        QByteArray b = QByteArray("<body") + attr("rid", d->rid) + attr("sid", d->sid) + attr("type", "terminate")
+            + attr("xmlns", NS_HTTPBIND) + '>' + d->payload + "</body>";
+        d->payload.clear();
+        d->terminatePending = false;
+        post(d->rid++, b);
+    }
+}
+
+void BoshStream::post(qint64 rid, const QByteArray &data)
+{
+    QNetworkRequest req(d->url);
+    req.setHeader(QNetworkRequest::ContentTypeHeader, "text/xml; charset=utf-8");
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    req.setTransferTimeout((d->wait + 10) * 1000);
+#endif
+    QNetworkReply *r = d->nam->post(req, data);
+    d->replies.insert(r, rid);
+    d->sent.insert(rid, data);
+    connect(r, &QNetworkReply::finished, this, &BoshStream::reply_finished);
+}
+
+void BoshStream::reply_finished()
+{
+    auto r = qobject_cast<QNetworkReply *>(sender());
+    if (!r || !d->replies.contains(r))
+        return;
+    qint64 rid = d->replies.take(r);
+    r->deleteLater();
+
+    if (r->error() != QNetworkReply::NoError) {
+        switch (r->error()) {
+        case QNetworkReply::HostNotFoundError:
+            fail(ErrHostNotFound);
+            return;
+        case QNetworkReply::ConnectionRefusedError:
+            fail(ErrConnectionRefused);
+            return;
+        case QNetworkReply::ProxyConnectionRefusedError:
+        case QNetworkReply::ProxyConnectionClosedError:
+        case QNetworkReply::ProxyNotFoundError:
+        case QNetworkReply::ProxyTimeoutError:
+            fail(ErrProxyConnect);
+            return;
+        case QNetworkReply::ProxyAuthenticationRequiredError:
+            fail(ErrProxyAuth);
+            return;
+        case QNetworkReply::RemoteHostClosedError:
+        case QNetworkReply::TimeoutError:
+        case QNetworkReply::OperationCanceledError: // transfer timeout
+        case QNetworkReply::TemporaryNetworkFailureError:
+        case QNetworkReply::UnknownNetworkError:
+            // the manager drops the duplicates or answers them from its cache
+            if (++d->retries[rid] <= BOSH_MAX_RETRIES) {
+                post(rid, d->sent.value(rid));
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+        fail(d->state == Private::Creating ? int(ErrProxyNeg) : int(ErrRead));
+        return;
+    }
+
+    d->sent.remove(rid);
+    d->retries.remove(rid);
+    d->responses.insert(rid, r->readAll());
+    deliverResponses();
+}
+
+void BoshStream::deliverResponses()
+{
+    QPointer<QObject> self = this;
+    bool              read = false;
+    while (d->state != Private::Idle && d->responses.contains(d->nextRead)) {
+        qint64 rid = d->nextRead++;
+        processResponse(rid, d->responses.take(rid));
+        if (!self)
+            return;
+        read = true;
+    }
+    if (read && bytesAvailable()) {
+        emit readyRead();
+        if (!self)
+            return;
+    }
+    sendRequests();
+}
+
+void BoshStream::processResponse(qint64 rid, const QByteArray &data)
+{
+    int start = data.indexOf("<body");
+    int end   = start == -1 ? -1 : startTagEnd(data, start);
+    if (end == -1) {
+        fail(ErrRead);
+        return;
+    }
+    bool       selfClosing = data[end - 1] == '/';
+    QByteArray inner;
+    if (!selfClosing) {
+        int close = data.lastIndexOf("</body>");
+        if (close < end) {
+            fail(ErrRead);
+            return;
+        }
+        inner = data.mid(end + 1, close - end - 1);
+    }
+
+    // the attributes only. the payload is handed on as it came
+    QXmlStreamReader reader(data.mid(start, end + 1 - start) + (selfClosing ? "" : "</body>"));
+    while (!reader.atEnd() && reader.readNext() != QXmlStreamReader::StartElement) { }
+    if (reader.hasError() || reader.name() != QLatin1String("body")) {
+        fail(ErrRead);
+        return;
+    }
+    QXmlStreamAttributes attrs = reader.attributes();
+
+    if (attrs.value("type") == QLatin1String("terminate")) {
+        if (d->state == Private::Creating || !d->streamHeaders) {
+            auto condition = attrs.value("condition");
+            fail(condition == QLatin1String("host-unknown")               ? int(ErrHostNotFound)
+                     : condition == QLatin1String("remote-connection-failed") ? int(ErrConnectionRefused)
+                                                                              : int(ErrProxyNeg));
+            return;
+        }
+        // the session is over, give the XMPP layer the end of its stream
+        resetConnection();
+        appendRead(inner + "</stream:stream>");
+        return;
+    }
+
+    if (d->state == Private::Creating) {
+        d->sid = attrs.value("sid").toString();
+        if (d->sid.isEmpty()) {
+            fail(ErrProxyNeg);
+            return;
+        }
+        if (attrs.hasAttribute("requests"))
+            d->requests = qMax(1, attrs.value("requests").toInt());
+        if (attrs.hasAttribute("hold"))
+            d->hold = attrs.value("hold").toInt();
+        if (attrs.hasAttribute("wait"))
+            d->wait = attrs.value("wait").toInt();
+        d->polling = attrs.value("polling").toInt();
+        d->state   = Private::Open;
+        d->early += inner;
+        emit connected();
+        return;
+    }
+
+    if (rid == d->restartRid) {
+        d->restartRid = -1;
+        appendRead(d->streamHeader() + inner);
+    } else if (!d->streamHeaders) {
+        d->early += inner;
+    } else if (!inner.isEmpty()) {
+        appendRead(inner);
+    }
+}
+
+void BoshStream::fail(int code)
+{
+    resetConnection();
+    setError(code);
+}
+
+// CS_NAMESPACE_END
@@ -0,0 +1,79 @@
+/*
+ * bosh.h - XMPP over BOSH (XEP-0124/XEP-0206)
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CS_BOSH_H
+#define CS_BOSH_H
+
+#include "bytestream.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+class QUrl;
+
+// CS_NAMESPACE_BEGIN
+/*
+ * Carries an XMPP stream over BOSH. Looks like a plain byte stream to the XMPP layer: the stream headers
+ * written to it become session creation / restart requests, the stanzas are batched into <body/> elements
+ * and the payloads of the responses are read back in rid order behind a synthetic stream header.
+ */
+class BoshStream : public ByteStream {
+    Q_OBJECT
+public:
+    enum Error { ErrConnectionRefused = ErrCustom, ErrHostNotFound, ErrProxyConnect, ErrProxyNeg, ErrProxyAuth };
+    BoshStream(QObject *parent = nullptr);
+    ~BoshStream();
+
+    // not owned. without one the stream makes its own
+    void setNetworkAccessManager(QNetworkAccessManager *nam);
+    // seconds the connection manager may hold a request (the wait attribute)
+    void setWait(int seconds);
+    int  wait() const;
+
+    // route is optional, "xmpp:host:port" of the server if it's not the one of domain
+    void connectToUrl(const QUrl &url, const QString &domain, const QString &route = QString());
+
+    // from ByteStream
+    bool isOpen() const;
+    void close();
+
+signals:
+    void connected();
+
+protected:
+    int tryWrite();
+
+private slots:
+    void reply_finished();
+
+private:
+    class Private;
+    Private *d;
+
+    void resetConnection(bool clear = false);
+    void processWrites();
+    void sendRequests();
+    void post(qint64 rid, const QByteArray &data);
+    void processResponse(qint64 rid, const QByteArray &data);
+    void deliverResponses();
+    void fail(int code);
+};
+
+// CS_NAMESPACE_END
+
+#endif // CS_BOSH_H
@@ -22,13 +22,31 @@
 
 #include "netnames.h"
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QHostAddress>
 #include <QMetaType>
+#include <QMutex>
+#include <QSocketNotifier>
 #include <QTcpSocket>
 #include <QTimer>
 
+#include <memory>
 #include <optional>
 
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#ifdef TCP_FASTOPEN_CONNECT
+#define BS_FASTOPEN
+#endif
+#endif
+
 // #include <limits>  // if it's still needed please comment why
 
 #define BSDEBUG (qDebug() << this << "#" << __FUNCTION__ << ":")
@@ -47,6 +65,105 @@ static std::optional<bool> enable_logs;
 
 #define READBUFSIZE 65536
 
+// how long to give a connection attempt before racing the next SRV target against it
+#define RACE_DEFAULT_DELAY 250
+#define RACE_MIN_DELAY 50
+#define RACE_MAX_DELAY 2000
+
+// Interactive profile: keepalive probes after this many secs of silence, then every KEEPALIVE_INTERVAL secs. the
+// connection is given up after KEEPALIVE_COUNT probes without an answer
+#define KEEPALIVE_IDLE 60
+#define KEEPALIVE_INTERVAL 10
+#define KEEPALIVE_COUNT 6
+
+// Bulk profile: the kernel buffers of the socket
+#define BULK_BUFSIZE (4 * 1024 * 1024)
+
+//----------------------------------------------------------------------------
+// ConnectTimes
+//----------------------------------------------------------------------------
+// Time it took to connect to an address:port the last time, or -1 if that failed. Used to decide how
+// soon the next target is raced against it. Shared by all the sockets of the process, hence the lock.
+class ConnectTimes {
+public:
+    static const int MaxSize = 1024;
+
+    static void record(const QString &target, int msecs)
+    {
+        ConnectTimes &t = instance();
+        QMutexLocker  locker(&t.mutex);
+        if (t.times.size() >= MaxSize && !t.times.contains(target))
+            t.times.clear();
+        t.times.insert(target, msecs);
+    }
+
+    // msecs to wait before starting the next attempt in parallel to the one to target
+    static int raceDelay(const QString &target)
+    {
+        ConnectTimes &t = instance();
+        QMutexLocker  locker(&t.mutex);
+        auto          it = t.times.constFind(target);
+        if (it == t.times.constEnd())
+            return RACE_DEFAULT_DELAY;
+        if (*it < 0)
+            return 0; // it failed last time, don't wait for it
+        return qBound(RACE_MIN_DELAY, *it * 2, RACE_MAX_DELAY);
+    }
+
+    // connected to it before, and the last attempt didn't fail
+    static bool known(const QString &target)
+    {
+        ConnectTimes &t = instance();
+        QMutexLocker  locker(&t.mutex);
+        auto          it = t.times.constFind(target);
+        return it != t.times.constEnd() && *it >= 0;
+    }
+
+private:
+    QMutex              mutex;
+    QHash<QString, int> times;
+
+    static ConnectTimes &instance()
+    {
+        static ConnectTimes t;
+        return t;
+    }
+};
+
+static void applyProfile(QTcpSocket *sock, BSocket::Profile profile, const QByteArray &congestion)
+{
+#ifdef Q_OS_LINUX
+    int fd = int(sock->socketDescriptor());
+#endif
+    switch (profile) {
+    case BSocket::DefaultProfile:
+        break;
+    case BSocket::Interactive: {
+        sock->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        sock->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+#ifdef Q_OS_LINUX
+        int idle     = KEEPALIVE_IDLE;
+        int interval = KEEPALIVE_INTERVAL;
+        int count    = KEEPALIVE_COUNT;
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+        break;
+    }
+    case BSocket::Bulk:
+        sock->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, BULK_BUFSIZE);
+        sock->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, BULK_BUFSIZE);
+#ifdef Q_OS_LINUX
+        // fails if the kernel doesn't have it, the default stays then
+        if (!congestion.isEmpty())
+            setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion.constData(), socklen_t(congestion.size()));
+#endif
+        break;
+    }
+    Q_UNUSED(congestion)
+}
+
 // CS_NAMESPACE_BEGIN
 class QTcpSocketSignalRelay : public QObject {
     Q_OBJECT
@@ -96,6 +213,8 @@ public:
         QString                hostname; // last resolved name
         QString                service;  // one of services passed to service (SRV) resolver
         XMPP::ServiceResolver *resolver;
+        QString                target; // address:port of the current attempt
+        QElapsedTimer          started;
     };
 
     /*! source data */
@@ -105,18 +224,22 @@ public:
     quint16                               port = 0;
     QHostAddress                          address;
     QAbstractSocket::NetworkLayerProtocol fallbackProtocol = QAbstractSocket::IPv4Protocol;
+    bool                                  fastOpen         = false;
 
     /*! runtime data */
     QString         lastError;
     int             lastIndex;
     QList<SockData> sockets;
     QTimer          fallbackTimer;
+    QTimer          raceTimer; // starts the next SRV target while the current one is still connecting
 
     HappyEyeballsConnector(QObject *parent) : QObject(parent)
     {
         fallbackTimer.setSingleShot(true);
         fallbackTimer.setInterval(250); /* rfc recommends 150-250ms */
         connect(&fallbackTimer, SIGNAL(timeout()), SLOT(startFallback()));
+        raceTimer.setSingleShot(true);
+        connect(&raceTimer, SIGNAL(timeout()), SLOT(startRace()));
     }
 
     SockData &addSocket()
@@ -140,6 +263,7 @@ public:
             abortSocket(sockets[i]);
         }
         fallbackTimer.stop();
+        raceTimer.stop();
     }
 
     void connectToHost(const QHostAddress &address, quint16 port)
@@ -148,7 +272,7 @@ public:
         this->address = address;
         SockData &sd  = addSocket();
         sd.state      = Connecting;
-        sd.sock->connectToHost(address, port);
+        startConnect(sd, address, port);
     }
 
     /* Connect to a host via the specified protocol, or the default protocols if not specified */
@@ -179,7 +303,7 @@ public:
             // connecting by IP.
             lastIndex = sockets.count() - 1;
             sd.state  = Connecting;
-            sd.sock->connectToHost(addr, port);
+            startConnect(sd, addr, port);
         }
     }
 
@@ -214,12 +338,103 @@ public:
     }
 
 private:
+    void startConnect(SockData &sd, const QHostAddress &address, quint16 port)
+    {
+        sd.target = address.toString() + QLatin1Char(':') + QString::number(port);
+        sd.started.start();
+#ifdef BS_FASTOPEN
+        // what is left of an earlier attempt of the socket
+        qDeleteAll(sd.sock->findChildren<QSocketNotifier *>(QString(), Qt::FindDirectChildrenOnly));
+        if (fastOpen && ConnectTimes::known(sd.target) && fastOpenConnect(sd, address, port))
+            return;
+#endif
+        sd.sock->connectToHost(address, port);
+    }
+
+#ifdef BS_FASTOPEN
+    // with TCP_FASTOPEN_CONNECT and the cookie of the server cached by the kernel, connect() returns at once and
+    // the SYN goes with the first write. without the cookie it's a usual handshake which asks for one. false if
+    // it can't be done this way, a usual connect follows then
+    bool fastOpenConnect(SockData &sd, const QHostAddress &address, quint16 port)
+    {
+        sockaddr_storage sa;
+        socklen_t        len = 0;
+        memset(&sa, 0, sizeof(sa));
+        if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+            auto in             = reinterpret_cast<sockaddr_in *>(&sa);
+            in->sin_family      = AF_INET;
+            in->sin_port        = htons(port);
+            in->sin_addr.s_addr = htonl(address.toIPv4Address());
+            len                 = sizeof(sockaddr_in);
+        } else if (address.protocol() == QAbstractSocket::IPv6Protocol) {
+            auto       in6   = reinterpret_cast<sockaddr_in6 *>(&sa);
+            Q_IPV6ADDR a     = address.toIPv6Address();
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port   = htons(port);
+            memcpy(&in6->sin6_addr, &a, sizeof(a));
+            len = sizeof(sockaddr_in6);
+        } else {
+            return false;
+        }
+
+        int fd = ::socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            return false;
+        int one = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        QTcpSocket            *sock  = sd.sock;
+        QTcpSocketSignalRelay *relay = sd.relay;
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&sa), len) == 0) {
+            if (!sock->setSocketDescriptor(fd)) {
+                ::close(fd);
+                return false;
+            }
+            QMetaObject::invokeMethod(relay, &QTcpSocketSignalRelay::sock_connected, Qt::QueuedConnection);
+            return true;
+        }
+        if (errno != EINPROGRESS) {
+            ::close(fd);
+            return false;
+        }
+
+        // the socket takes the descriptor once connected. until then it's the notifier's, which goes with the
+        // socket if that is deleted first
+        auto notifier = new QSocketNotifier(fd, QSocketNotifier::Write, sock);
+        auto taken    = std::make_shared<bool>(false);
+        connect(notifier, &QObject::destroyed, [fd, taken]() {
+            if (!*taken)
+                ::close(fd);
+        });
+        connect(notifier, &QSocketNotifier::activated, this, [notifier, fd, taken, sock, relay]() {
+            notifier->setEnabled(false);
+            notifier->deleteLater();
+            int       err = 0;
+            socklen_t l   = sizeof(err);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &l) == 0 && err == 0 && sock->setSocketDescriptor(fd)) {
+                *taken = true;
+                relay->sock_connected();
+                return;
+            }
+            emit relay->error(err == ECONNREFUSED ? QAbstractSocket::ConnectionRefusedError
+                                                  : QAbstractSocket::NetworkError);
+        });
+        return true;
+    }
+#endif
+
     void abortSocket(SockData &sd)
     {
+        if (sd.state == Failure)
+            return; // already stopped by failCurrent(). its socket goes away with us
         sd.relay->disconnect(this);
         if (sd.state >= Connecting) {
             sd.sock->abort();
         }
+        sd.state = Failure;
         if (sd.resolver) {
             sd.resolver->stop();
             disconnect(sd.resolver);
@@ -247,6 +462,40 @@ private:
         lastIndex = -1;
     }
 
+    bool hasAttemptsLeft() const
+    {
+        for (const SockData &sd : sockets) {
+            if (sd.state != Failure)
+                return true;
+        }
+        return fallbackTimer.isActive();
+    }
+
+    // the socket of lastIndex can't go on. fail if it was the last one
+    void failCurrent(QAbstractSocket::SocketError errorCode)
+    {
+        SockData &sd = sockets[lastIndex];
+        sd.relay->disconnect(this);
+        sd.sock->abort();
+        if (sd.resolver) {
+            disconnect(sd.resolver);
+            sd.resolver->stop();
+        }
+        sd.state = Failure;
+        if (hasAttemptsLeft()) {
+            // nothing in flight anymore, don't let the other family wait for its head start
+            bool inFlight = false;
+            for (const SockData &other : std::as_const(sockets))
+                inFlight = inFlight || other.state == Resolve || other.state == Connecting;
+            if (!inFlight && fallbackTimer.isActive()) {
+                fallbackTimer.stop();
+                startFallback();
+            }
+            return;
+        }
+        emit error(errorCode);
+    }
+
     void setCurrentByRelay(QTcpSocketSignalRelay *relay)
     {
         for (int i = 0; i < sockets.count(); i++) {
@@ -265,8 +514,14 @@ private slots:
     void qs_connected()
     {
         BSLOG(BSDEBUG);
-        QPointer<HappyEyeballsConnector> valid(this);
         setCurrentByRelay(static_cast<QTcpSocketSignalRelay *>(sender()));
+        if (lastIndex < 0)
+            return;
+        SockData &winner = sockets[lastIndex];
+        if (!winner.target.isEmpty() && winner.started.isValid())
+            ConnectTimes::record(winner.target, int(winner.started.elapsed()));
+        fallbackTimer.stop();
+        raceTimer.stop();
         for (int i = 0; i < sockets.count(); i++) {
             if (i != lastIndex) {
                 abortSocket(sockets[i]);
@@ -274,18 +529,20 @@ private slots:
                 disconnect(sockets[i].relay);
                 sockets[i].state = Connected;
             }
-            emit connected();
-            if (!valid)
-                return;
         }
+        emit connected();
     }
 
     void qs_error(QAbstractSocket::SocketError errorCode)
     {
         setCurrentByRelay(static_cast<QTcpSocketSignalRelay *>(sender()));
+        if (lastIndex < 0)
+            return;
         // TODO remember error code
         lastError = sockets[lastIndex].sock->errorString();
         BSLOG(BSDEBUG << "error:" << lastError);
+        if (!sockets[lastIndex].target.isEmpty())
+            ConnectTimes::record(sockets[lastIndex].target, -1);
 
         if (sockets[lastIndex].resolver) {
             sockets[lastIndex].sock->abort();
@@ -293,7 +550,7 @@ private slots:
             sockets[lastIndex].resolver->tryNext();
         } else {
             // it seems we connect by hostaddress. just one socket w/o resolver
-            emit error(errorCode);
+            failCurrent(errorCode);
         }
     }
 
@@ -333,18 +590,40 @@ private slots:
     {
         BSLOG(BSDEBUG << "a:" << address << "p:" << port);
         setCurrentByResolver(static_cast<XMPP::ServiceResolver *>(sender()));
-        sockets[lastIndex].state    = Connecting;
-        sockets[lastIndex].hostname = hostname;
-        sockets[lastIndex].service  = service;
-        sockets[lastIndex].sock->connectToHost(address, port);
+        SockData &sd = sockets[lastIndex];
+        sd.state     = Connecting;
+        sd.hostname  = hostname;
+        sd.service   = service;
+        startConnect(sd, address, port);
+
+        // other SRV targets left? give this one a head start and then race the next one against it
+        if (!raceTimer.isActive() && sd.resolver->hasPendingSrv())
+            raceTimer.start(ConnectTimes::raceDelay(sd.target));
     }
 
     /* resolver failed the dns lookup */
     void handleDnsError(XMPP::ServiceResolver::Error e)
     {
         BSLOG(BSDEBUG << "e:" << e);
-        if (!fallbackTimer.isActive()) {
-            emit error(QAbstractSocket::HostNotFoundError);
+        setCurrentByResolver(static_cast<XMPP::ServiceResolver *>(sender()));
+        if (lastIndex < 0)
+            return;
+        failCurrent(QAbstractSocket::HostNotFoundError);
+    }
+
+    void startRace()
+    {
+        BSLOG(BSDEBUG);
+        for (int i = 0; i < sockets.count(); i++) {
+            if (sockets[i].state != Connecting || !sockets[i].resolver || !sockets[i].resolver->hasPendingSrv())
+                continue;
+            XMPP::ServiceResolver *next = sockets[i].resolver->splitPending();
+            SockData              &sd   = addSocket();
+            sd.resolver                 = next;
+            initResolver(sd.resolver);
+            sd.state = Resolve;
+            sd.resolver->tryNext();
+            return;
         }
     }
 
@@ -393,6 +672,10 @@ public:
     quint16      port;    //!< Port we are currently connected to
 
     QPointer<HappyEyeballsConnector> connector;
+
+    BSocket::Profile profile  = BSocket::DefaultProfile;
+    QByteArray       congestion;
+    bool             fastOpen = false;
 };
 
 BSocket::BSocket(QObject *parent) : ByteStream(parent)
@@ -450,7 +733,8 @@ void BSocket::resetConnection(bool clear)
 void BSocket::ensureConnector()
 {
     if (!d->connector) {
-        d->connector = new HappyEyeballsConnector(this);
+        d->connector           = new HappyEyeballsConnector(this);
+        d->connector->fastOpen = d->fastOpen;
         connect(d->connector, &HappyEyeballsConnector::connected, this, &BSocket::qs_connected);
         connect(d->connector, &HappyEyeballsConnector::error, this, &BSocket::qs_error);
     }
@@ -513,6 +797,24 @@ void BSocket::setSocket(QTcpSocket *s)
     qs_connected_step2(false); // we have desriptor already. so it's already known to be connected
 }
 
+void BSocket::setProfile(Profile profile)
+{
+    d->profile = profile;
+    if (d->qsock && d->state == Connected)
+        applyProfile(d->qsock, d->profile, d->congestion);
+}
+
+BSocket::Profile BSocket::profile() const { return d->profile; }
+
+void BSocket::setCongestionControl(const QByteArray &name) { d->congestion = name; }
+
+void BSocket::setFastOpen(bool enabled)
+{
+    d->fastOpen = enabled;
+    if (d->connector)
+        d->connector->fastOpen = enabled;
+}
+
 int BSocket::state() const { return d->state; }
 
 const QString &BSocket::host() const { return d->host; }
@@ -579,6 +881,18 @@ qint64 BSocket::bytesAvailable() const
         return ByteStream::bytesAvailable();
 }
 
+QList<QByteArray> BSocket::takeReadChunks()
+{
+    if (!d->qsock)
+        return ByteStream::takeReadChunks();
+    // the only copy on the way up: out of the QTcpSocket buffer
+    QByteArray block = d->qsock->readAll();
+    BSLOG(BSDEBUG << "- [" << block.size() << "]: {" << block << "}");
+    if (block.isEmpty())
+        return {};
+    return { block };
+}
+
 qint64 BSocket::bytesToWrite() const
 {
     if (!d->qsock)
@@ -640,6 +954,7 @@ void BSocket::qs_connected_step2(bool signalConnected)
 
     setOpenMode(QIODevice::ReadWrite);
     d->state = Connected;
+    applyProfile(d->qsock, d->profile, d->congestion);
     BSLOG(BSDEBUG << "Connected");
     QPointer<BSocket> valid(this);
     if (signalConnected) {
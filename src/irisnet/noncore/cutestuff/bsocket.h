@@ -40,6 +40,10 @@ class BSocket : public ByteStream {
 public:
     enum Error { ErrConnectionRefused = ErrCustom, ErrHostNotFound };
     enum State { Idle, HostLookup, Connecting, Connected, Closing };
+    /*! Socket options set once connected. Interactive is for the XMPP stream: no Nagle, and keepalive probes
+        after a minute of silence (the timing is tuned on linux only). Bulk is for file transfers: large kernel
+        buffers and the congestion control of setCongestionControl() */
+    enum Profile { DefaultProfile, Interactive, Bulk };
     BSocket(QObject *parent = nullptr);
     ~BSocket();
 
@@ -52,6 +56,15 @@ public:
     void connectToHost(const QStringList &services, const QString &transport, const QString &domain,
                        quint16 port = std::numeric_limits<quint16>::max());
 
+    /*! Applied at once if connected already */
+    void    setProfile(Profile profile);
+    Profile profile() const;
+    /*! Bulk only, linux only, e.g. "bbr". The default stays if the kernel doesn't have it */
+    void setCongestionControl(const QByteArray &name);
+    /*! TCP Fast Open (linux only) to the addresses connected to before. With the cookie of the server at hand
+        the first data goes with the SYN, a round trip less. Set before connecting */
+    void setFastOpen(bool enabled);
+
     virtual QAbstractSocket *abstractSocket() const;
     qintptr                  socket() const;
     void                     setSocket(QTcpSocket *);
@@ -62,8 +75,9 @@ public:
     bool isOpen() const;
     void close();
 
-    qint64 bytesAvailable() const;
-    qint64 bytesToWrite() const;
+    qint64            bytesAvailable() const;
+    qint64            bytesToWrite() const;
+    QList<QByteArray> takeReadChunks();
 
     // local
     QHostAddress address() const;
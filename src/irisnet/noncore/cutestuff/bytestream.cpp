@@ -54,12 +54,156 @@
 //!
 //! Also available are the static convenience functions ByteStream::appendArray()
 //! and ByteStream::takeArray(), which make dealing with byte queues very easy.
+//!
+//! Both buffers are kept as chains of implicitly shared chunks, the read one exactly as the chunks
+//! were passed to appendRead().  Taking data from the front costs only what is taken, however much
+//! is buffered.  Readers which are able to consume the data chunk by chunk should use takeReadChunks()
+//! which hands the chain over without copying.
+
+// small writes are appended to the last chunk up to this size instead of starting a new one
+#define BYTESTREAM_COALESCE 4096
+
+namespace {
+// a byte queue as a chain of chunks. the first chunk may be partially taken already
+class ChunkQueue {
+public:
+    QList<QByteArray> chunks;
+    int               head      = 0; // taken from the first chunk
+    qint64            count     = 0;
+    bool              flattened = false; // flat() handed out the only chunk, which may be modified since
+
+    qint64 size() const { return flattened ? chunks.first().size() : count; }
+
+    void clear()
+    {
+        flattened = false;
+        chunks.clear();
+        head  = 0;
+        count = 0;
+    }
+
+    void append(const QByteArray &block, bool coalesce = false)
+    {
+        if (block.isEmpty())
+            return;
+        settle();
+        if (coalesce && !chunks.isEmpty() && chunks.last().size() + block.size() <= BYTESTREAM_COALESCE)
+            chunks.last() += block;
+        else
+            chunks.append(block);
+        count += block.size();
+    }
+
+    void append(const char *data, int len)
+    {
+        if (len <= 0)
+            return;
+        settle();
+        if (!chunks.isEmpty() && chunks.last().size() + len <= BYTESTREAM_COALESCE)
+            chunks.last().append(data, len);
+        else
+            chunks.append(QByteArray(data, len));
+        count += len;
+    }
+
+    // copies max bytes from the front to data. with del they are removed
+    qint64 read(char *data, qint64 max, bool del = true)
+    {
+        settle();
+        qint64 done = 0;
+        int    h    = head;
+        int    i    = 0;
+        while (done < max && i < chunks.size()) {
+            const QByteArray &chunk = chunks.at(i);
+            qint64            n     = qMin(max - done, qint64(chunk.size() - h));
+            memcpy(data + done, chunk.constData() + h, size_t(n));
+            done += n;
+            h += int(n);
+            if (h == chunk.size()) {
+                ++i;
+                h = 0;
+            }
+        }
+        if (del)
+            drop(i, h, done);
+        return done;
+    }
+
+    // len bytes from the front, all of them if len is 0. a whole chunk is returned without copying
+    QByteArray take(qint64 len, bool del = true)
+    {
+        settle();
+        if (chunks.isEmpty())
+            return QByteArray();
+        if (len <= 0 || len > count)
+            len = count;
+        if (head == 0 && chunks.first().size() == len) {
+            QByteArray ret = chunks.first();
+            if (del)
+                drop(1, 0, len);
+            return ret;
+        }
+        if (head == 0 && len == count && !del && chunks.size() == 1)
+            return chunks.first();
+        QByteArray ret(int(len), Qt::Uninitialized);
+        read(ret.data(), len, del);
+        return ret;
+    }
+
+    // the whole queue as one chunk, for the api which hands out the buffer itself
+    QByteArray &flat()
+    {
+        settle();
+        if (chunks.isEmpty()) {
+            chunks.append(QByteArray());
+        } else if (chunks.size() > 1 || head) {
+            QByteArray joined = take(0, false);
+            chunks.clear();
+            chunks.append(joined);
+            head = 0;
+        }
+        flattened = true;
+        return chunks.first();
+    }
+
+    QList<QByteArray> takeAll()
+    {
+        settle();
+        if (head)
+            chunks.first() = chunks.first().mid(head);
+        QList<QByteArray> ret;
+        ret.swap(chunks);
+        head  = 0;
+        count = 0;
+        return ret;
+    }
+
+private:
+    void settle()
+    {
+        if (!flattened)
+            return;
+        flattened = false;
+        count     = chunks.first().size();
+        if (!count)
+            chunks.clear();
+    }
+
+    void drop(int wholeChunks, int newHead, qint64 bytes)
+    {
+        chunks.erase(chunks.begin(), chunks.begin() + wholeChunks);
+        head = chunks.isEmpty() ? 0 : newHead;
+        count -= bytes;
+    }
+};
+}
 
 class ByteStream::Private {
 public:
     Private() { }
 
-    QByteArray readBuf, writeBuf;
+    ChunkQueue readQueue;
+    ChunkQueue writeQueue;
     int        errorCode;
     QString    errorText;
 };
@@ -80,7 +224,7 @@ qint64 ByteStream::writeData(const char *data, qint64 maxSize)
         return -1;
 
     bool doWrite = bytesToWrite() == 0;
-    d->writeBuf.append(data, int(maxSize));
+    d->writeQueue.append(data, int(maxSize));
     if (doWrite)
         tryWrite();
     return maxSize;
@@ -89,57 +233,64 @@ qint64 ByteStream::writeData(const char *data, qint64 maxSize)
 //!
 //! Reads bytes \a bytes of data from the stream and returns them as an array.  If \a bytes is 0, then
 //! \a read will return all available data.
-qint64 ByteStream::readData(char *data, qint64 maxSize)
-{
-    maxSize = maxSize > d->readBuf.size() ? d->readBuf.size() : maxSize;
-    memcpy(data, d->readBuf.constData(), size_t(maxSize));
-    d->readBuf.remove(0, int(maxSize));
-    return maxSize;
-}
+qint64 ByteStream::readData(char *data, qint64 maxSize) { return d->readQueue.read(data, maxSize); }
 
 //!
 //! Returns the number of bytes available for reading.
-qint64 ByteStream::bytesAvailable() const { return QIODevice::bytesAvailable() + d->readBuf.size(); }
+qint64 ByteStream::bytesAvailable() const { return QIODevice::bytesAvailable() + d->readQueue.size(); }
+
+//!
+//! Takes all the data available for reading and returns it as a list of implicitly shared chunks.
+//! Unlike readAll() this doesn't copy anything unless some data was already buffered by QIODevice.
+QList<QByteArray> ByteStream::takeReadChunks()
+{
+    QList<QByteArray> ret;
+    qint64            buffered = QIODevice::bytesAvailable();
+    if (buffered > 0)
+        ret.append(QIODevice::read(buffered));
+    ret += d->readQueue.takeAll();
+    return ret;
+}
 
 //!
 //! Returns the number of bytes that are waiting to be written.
-qint64 ByteStream::bytesToWrite() const { return d->writeBuf.size(); }
+qint64 ByteStream::bytesToWrite() const { return d->writeQueue.size(); }
 
 //!
 //! Clears the read buffer.
-void ByteStream::clearReadBuffer() { d->readBuf.resize(0); }
+void ByteStream::clearReadBuffer() { d->readQueue.clear(); }
 
 //!
 //! Clears the write buffer.
-void ByteStream::clearWriteBuffer() { d->writeBuf.resize(0); }
+void ByteStream::clearWriteBuffer() { d->writeQueue.clear(); }
 
 //!
 //! Appends \a block to the end of the read buffer.
-void ByteStream::appendRead(const QByteArray &block) { d->readBuf += block; }
+void ByteStream::appendRead(const QByteArray &block) { d->readQueue.append(block); }
 
 //!
 //! Appends \a block to the end of the write buffer.
-void ByteStream::appendWrite(const QByteArray &block) { d->writeBuf += block; }
+void ByteStream::appendWrite(const QByteArray &block) { d->writeQueue.append(block, true); }
 
 //!
 //! Returns \a size bytes from the start of the read buffer.
 //! If \a size is 0, then all available data will be returned.
 //! If \a del is TRUE, then the bytes are also removed.
-QByteArray ByteStream::takeRead(int size, bool del) { return takeArray(d->readBuf, size, del); }
+QByteArray ByteStream::takeRead(int size, bool del) { return d->readQueue.take(size, del); }
 
 //!
 //! Returns \a size bytes from the start of the write buffer.
 //! If \a size is 0, then all available data will be returned.
 //! If \a del is TRUE, then the bytes are also removed.
-QByteArray ByteStream::takeWrite(int size, bool del) { return takeArray(d->writeBuf, size, del); }
+QByteArray ByteStream::takeWrite(int size, bool del) { return d->writeQueue.take(size, del); }
 
 //!
 //! Returns a reference to the read buffer.
-QByteArray &ByteStream::readBuf() { return d->readBuf; }
+QByteArray &ByteStream::readBuf() { return d->readQueue.flat(); }
 
 //!
 //! Returns a reference to the write buffer.
-QByteArray &ByteStream::writeBuf() { return d->writeBuf; }
+QByteArray &ByteStream::writeBuf() { return d->writeQueue.flat(); }
 
 //!
 //! Attempts to try and write some bytes from the write buffer, and returns the number
@@ -22,6 +22,7 @@
 
 #include <QByteArray>
 #include <QIODevice>
+#include <QList>
 #include <QObject>
 
 class QAbstractSocket;
@@ -41,6 +42,8 @@ public:
 
     static QByteArray takeArray(QByteArray &from, int size = 0, bool del = true);
 
+    virtual QList<QByteArray> takeReadChunks();
+
     int      errorCode() const;
     QString &errorText() const;
 
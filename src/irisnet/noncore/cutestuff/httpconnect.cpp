@@ -22,6 +22,10 @@
 #include "bsocket.h"
 
 #include <QByteArray>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QMutex>
+#include <QRandomGenerator>
 #include <QStringList>
 #include <QtCrypto>
 
@@ -87,6 +91,61 @@ static bool extractMainHeader(const QString &line, QString *proto, int *code, QS
     return true;
 }
 
+// a Proxy-Authenticate value, e.g. Digest realm="proxy", nonce="abc", qop="auth". returns the scheme, lowercase
+static QString parseChallenge(const QString &value, QHash<QString, QString> *params)
+{
+    int     sp     = value.indexOf(' ');
+    QString scheme = (sp == -1 ? value : value.left(sp)).toLower();
+    int     n      = sp == -1 ? int(value.size()) : sp + 1;
+    while (n < value.size()) {
+        while (n < value.size() && (value[n] == ' ' || value[n] == ','))
+            ++n;
+        int eq = value.indexOf('=', n);
+        if (eq == -1)
+            break;
+        QString key = value.mid(n, eq - n).trimmed().toLower();
+        QString v;
+        n = eq + 1;
+        if (n < value.size() && value[n] == '"') {
+            for (++n; n < value.size() && value[n] != '"'; ++n) {
+                if (value[n] == '\\' && n + 1 < value.size())
+                    ++n;
+                v += value[n];
+            }
+            ++n;
+        } else {
+            int end = value.indexOf(',', n);
+            if (end == -1)
+                end = int(value.size());
+            v = value.mid(n, end - n).trimmed();
+            n = end;
+        }
+        params->insert(key, v);
+    }
+    return scheme;
+}
+
+static QByteArray md5Hex(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Md5).toHex();
+}
+
+namespace {
+// how a proxy wants to be authenticated, as learned from its last 407 or from a Basic one it accepted. kept for
+//   the process, so the first CONNECT of the next connection to that proxy goes out authenticated already
+class ProxyAuth {
+public:
+    QString    user, pass;
+    QString    scheme; // basic or digest
+    QByteArray realm, nonce, opaque, algorithm;
+    bool       qop = false; // qop=auth
+    int        nc  = 0;     // requests made with nonce
+};
+
+QMutex                    authMutex;
+QHash<QString, ProxyAuth> authCache; // by proxy host:port
+} // namespace
+
 class HttpConnect::Private {
 public:
     Private(HttpConnect *_q) : sock(_q) { }
@@ -105,6 +164,125 @@ public:
 
     int  toWrite;
     bool active;
+
+    QString sentScheme;      // of the Proxy-Authorization of the request, empty for none
+    bool    retried = false; // after a 407, with what it asked for
+
+    QString proxyKey() const { return host.toLower() + ':' + QString::number(port); }
+
+    // the value of Proxy-Authorization, from what the proxy asked for last time. without that, Basic right away
+    //   like it always was, if there are credentials
+    QString authorization()
+    {
+        QMutexLocker locker(&authMutex);
+        auto         it = authCache.find(proxyKey());
+        if (it == authCache.end()) {
+            sentScheme = user.isEmpty() ? QString() : QStringLiteral("basic");
+            return sentScheme.isEmpty() ? QString() : basic(user, pass);
+        }
+
+        // the ones given win over the cached ones
+        const QString &u = user.isEmpty() ? it->user : user;
+        const QString &p = user.isEmpty() ? it->pass : pass;
+        sentScheme       = it->scheme;
+        return it->scheme == QLatin1String("digest") ? digest(*it, u, p) : basic(u, p);
+    }
+
+    static QString basic(const QString &user, const QString &pass)
+    {
+        return QString("Basic ") + QCA::Base64().encodeString(user + ':' + pass);
+    }
+
+    // RFC 2617, the uri of a CONNECT is the authority
+    QString digest(ProxyAuth &a, const QString &u, const QString &p)
+    {
+        QByteArray uri    = (real_host + ':' + QString::number(real_port)).toUtf8();
+        QByteArray cnonce = QByteArray::number(QRandomGenerator::global()->generate64(), 16);
+        QByteArray nc     = QByteArray::number(++a.nc, 16).rightJustified(8, '0');
+        QByteArray ha1    = md5Hex(u.toUtf8() + ':' + a.realm + ':' + p.toUtf8());
+        if (a.algorithm.toLower() == "md5-sess")
+            ha1 = md5Hex(ha1 + ':' + a.nonce + ':' + cnonce);
+        QByteArray ha2      = md5Hex("CONNECT:" + uri);
+        QByteArray response = a.qop ? md5Hex(ha1 + ':' + a.nonce + ':' + nc + ':' + cnonce + ":auth:" + ha2)
+                                    : md5Hex(ha1 + ':' + a.nonce + ':' + ha2);
+
+        QString s = QString("Digest username=\"%1\", realm=\"%2\", nonce=\"%3\", uri=\"%4\", response=\"%5\"")
+                        .arg(u, QString::fromUtf8(a.realm), QString::fromLatin1(a.nonce), QString::fromUtf8(uri),
+                             QString::fromLatin1(response));
+        if (!a.algorithm.isEmpty())
+            s += ", algorithm=" + QString::fromLatin1(a.algorithm);
+        if (!a.opaque.isEmpty())
+            s += ", opaque=\"" + QString::fromLatin1(a.opaque) + '"';
+        if (a.qop)
+            s += ", qop=auth, nc=" + QString::fromLatin1(nc) + ", cnonce=\"" + QString::fromLatin1(cnonce) + '"';
+        return s;
+    }
+
+    // got through. a Basic one sent right away is remembered, so the connections without credentials of their
+    //   own, e.g. for TURN, are authenticated too
+    void authenticated()
+    {
+        if (sentScheme.isEmpty())
+            return;
+        QMutexLocker locker(&authMutex);
+        auto        &a = authCache[proxyKey()];
+        if (a.scheme.isEmpty())
+            a.scheme = sentScheme;
+        if (!user.isEmpty()) {
+            a.user = user;
+            a.pass = pass;
+        }
+    }
+
+    // a 407. takes what the proxy asks for into the cache for another try. false if there is no point in one,
+    //   e.g. the same credentials were rejected the same way already
+    bool challenged()
+    {
+        QHash<QString, QString> digestParams;
+        bool                    haveBasic = false, haveDigest = false;
+        for (const QString &line : std::as_const(headerLines)) {
+            int colon = line.indexOf(':');
+            if (colon == -1 || line.left(colon).trimmed().compare("Proxy-Authenticate", Qt::CaseInsensitive) != 0)
+                continue;
+            QHash<QString, QString> params;
+            QString                 scheme = parseChallenge(line.mid(colon + 1).trimmed(), &params);
+            QString                 algo   = params.value("algorithm").toLower();
+            if (scheme == "digest" && !haveDigest && (algo.isEmpty() || algo == "md5" || algo == "md5-sess")) {
+                haveDigest   = true;
+                digestParams = params;
+            } else if (scheme == "basic") {
+                haveBasic = true;
+            }
+        }
+
+        QMutexLocker locker(&authMutex);
+        ProxyAuth    old = authCache.take(proxyKey());
+        QString      u   = user.isEmpty() ? old.user : user;
+        QString      p   = user.isEmpty() ? old.pass : pass;
+        if (retried || u.isEmpty() || (!haveDigest && !haveBasic))
+            return false;
+
+        QString scheme = haveDigest ? QStringLiteral("digest") : QStringLiteral("basic");
+        bool    stale  = digestParams.value("stale").compare("true", Qt::CaseInsensitive) == 0;
+        if (scheme == sentScheme && !stale)
+            return false;
+
+        ProxyAuth a;
+        a.user      = u;
+        a.pass      = p;
+        a.scheme    = scheme;
+        a.realm     = digestParams.value("realm").toUtf8();
+        a.nonce     = digestParams.value("nonce").toLatin1();
+        a.opaque    = digestParams.value("opaque").toLatin1();
+        a.algorithm = digestParams.value("algorithm").toLatin1();
+        for (const QString &q : digestParams.value("qop").split(',')) {
+            if (q.trimmed().toLower() == "auth")
+                a.qop = true;
+        }
+        authCache.insert(proxyKey(), a);
+        retried = true;
+        return true;
+    }
 };
 
 HttpConnect::HttpConnect(QObject *parent) : ByteStream(parent)
@@ -144,6 +322,12 @@ void HttpConnect::setAuth(const QString &user, const QString &pass)
     d->pass = pass;
 }
 
+void HttpConnect::clearAuthCache()
+{
+    QMutexLocker locker(&authMutex);
+    authCache.clear();
+}
+
 void HttpConnect::connectToHost(const QString &proxyHost, quint16 proxyPort, const QString &host, int port)
 {
     resetConnection(true);
@@ -152,6 +336,7 @@ void HttpConnect::connectToHost(const QString &proxyHost, quint16 proxyPort, con
     d->port      = proxyPort;
     d->real_host = host;
     d->real_port = port;
+    d->retried   = false;
 
 #ifdef PROX_DEBUG
     fprintf(stderr, "HttpConnect: Connecting to %s:%d", qPrintable(proxyHost), proxyPort);
@@ -196,10 +381,9 @@ void HttpConnect::sock_connected()
     // connected, now send the request
     QString s;
     s += QString("CONNECT ") + d->real_host + ':' + QString::number(d->real_port) + " HTTP/1.0\r\n";
-    if (!d->user.isEmpty()) {
-        QString str = d->user + ':' + d->pass;
-        s += QString("Proxy-Authorization: Basic ") + QCA::Base64().encodeString(str) + "\r\n";
-    }
+    QString auth = d->authorization();
+    if (!auth.isEmpty())
+        s += QString("Proxy-Authorization: ") + auth + "\r\n";
     s += "Pragma: no-cache\r\n";
     s += "\r\n";
 
@@ -279,6 +463,7 @@ void HttpConnect::sock_readyRead()
                     fprintf(stderr, "HttpConnect: << Success >>\n");
 #endif
                     d->active = true;
+                    d->authenticated();
                     setOpenMode(QIODevice::ReadWrite);
                     emit connected();
 
@@ -288,6 +473,14 @@ void HttpConnect::sock_readyRead()
                         emit readyRead();
                         return;
                     }
+                } else if (code == 407 && d->challenged()) {
+#ifdef PROX_DEBUG
+                    fprintf(stderr, "HttpConnect: << Retry authenticated >>\n");
+#endif
+                    // a proxy mostly closes the connection after a 407, so again on a new one
+                    resetConnection(true);
+                    d->sock.connectToHost(d->host, d->port);
+                    return;
                 } else {
                     int     err;
                     QString errStr;
@@ -30,8 +30,12 @@ public:
     HttpConnect(QObject *parent = nullptr);
     ~HttpConnect();
 
+    // without credentials of its own, the ones a connection to the same proxy got through with are used.
+    //   the scheme a proxy asked for is kept as well, the next CONNECT to it doesn't have to wait for a 407
     void setAuth(const QString &user, const QString &pass = "");
     void connectToHost(const QString &proxyHost, quint16 proxyPort, const QString &host, int port);
+    // forgets the schemes and the credentials of all the proxies, e.g. when the settings change
+    static void clearAuthCache();
 
     // from ByteStream
     void   close();
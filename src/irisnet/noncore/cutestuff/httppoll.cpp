@@ -35,6 +35,10 @@
 #include <stdlib.h>
 
 #define POLL_KEYS 64
+// first poll delay after traffic stopped, doubled up to the poll interval while idle (msecs)
+#define POLL_IDLE_MIN 250
+// how long writes are collected into one request (msecs)
+#define POLL_WRITE_DELAY 10
 
 // CS_NAMESPACE_BEGIN
 static QByteArray randomArray(int size)
@@ -80,6 +84,7 @@ public:
     int     key_n;
 
     int polltime;
+    int interval = 0; // msecs to the next poll. 0 while data is flowing
 };
 
 HttpPoll::HttpPoll(QObject *parent) : ByteStream(parent)
@@ -108,14 +113,14 @@ QAbstractSocket *HttpPoll::abstractSocket() const { return d->http.abstractSocke
 
 void HttpPoll::resetConnection(bool clear)
 {
-    if (d->http.isActive())
-        d->http.stop();
+    d->http.stop(); // also drops a kept alive connection
     if (clear)
         clearReadBuffer();
     clearWriteBuffer();
     d->out.resize(0);
-    d->state   = 0;
-    d->closing = false;
+    d->state    = 0;
+    d->closing  = false;
+    d->interval = 0;
     d->t->stop();
 }
 
@@ -258,9 +263,15 @@ void HttpPoll::http_result()
         justNowConnected = true;
     }
 
+    // poll right away while there is traffic, back off to the poll interval once it's quiet
+    if (!block.isEmpty() || !d->out.isEmpty() || justNowConnected)
+        d->interval = 0;
+    else
+        d->interval = qMin(d->polltime * 1000, qMax(POLL_IDLE_MIN, d->interval * 2));
+
     // sync up again soon
     if (bytesToWrite() > 0 || !d->closing) {
-        d->t->start(d->polltime * 1000);
+        d->t->start(d->interval);
     }
 
     // connecting
@@ -316,8 +327,9 @@ void HttpPoll::http_error(int x)
 
 int HttpPoll::tryWrite()
 {
-    if (!d->http.isActive())
-        do_sync();
+    // collect the writes of a moment into one request. what comes while one is in flight goes with the next
+    if (!d->http.isActive() && (!d->t->isActive() || d->t->remainingTime() > POLL_WRITE_DELAY))
+        d->t->start(POLL_WRITE_DELAY);
     return 0;
 }
 
@@ -431,7 +443,13 @@ public:
     bool         asProxy;
     bool         useSsl;
     QString      host;
+    quint16      port = 0;
     QCA::TLS    *tls;
+
+    bool busy          = false; // a request is in flight
+    bool keepAlive     = false; // the connection may be used for the next request
+    bool reused        = false; // the request went over the connection of an earlier one
+    int  contentLength = -1;    // -1 if the body ends with the connection
 };
 
 HttpProxyPost::HttpProxyPost(QObject *parent) : QObject(parent)
@@ -458,9 +476,16 @@ void HttpProxyPost::resetConnection(bool clear)
 {
     if (d->sock.state() != BSocket::Idle)
         d->sock.close();
+    if (d->tls) {
+        d->tls->disconnect(this);
+        d->tls->deleteLater();
+        d->tls = nullptr;
+    }
     d->recvBuf.resize(0);
     if (clear)
         d->body.resize(0);
+    d->busy      = false;
+    d->keepAlive = false;
 }
 
 void HttpProxyPost::setAuth(const QString &user, const QString &pass)
@@ -469,31 +494,48 @@ void HttpProxyPost::setAuth(const QString &user, const QString &pass)
     d->pass = pass;
 }
 
-bool HttpProxyPost::isActive() const { return d->sock.state() != BSocket::Idle; }
+bool HttpProxyPost::isActive() const { return d->busy; }
 
 void HttpProxyPost::post(const QString &proxyHost, quint16 proxyPort, const QUrl &url, const QByteArray &data,
                          bool asProxy)
 {
-    resetConnection(true);
+    bool reuse = d->keepAlive && !d->busy && d->sock.state() == BSocket::Connected && d->host == proxyHost
+        && d->port == proxyPort && d->asProxy == asProxy;
+    if (!reuse)
+        resetConnection(true);
 
     d->host     = proxyHost;
+    d->port     = proxyPort;
     d->url      = url;
     d->postdata = data;
     d->asProxy  = asProxy;
+    d->busy     = true;
+    d->reused   = reuse;
+
+    if (reuse) {
+        d->recvBuf.resize(0);
+        d->body.resize(0);
+        sendRequest();
+        return;
+    }
+    startConnect();
+}
+
+void HttpProxyPost::startConnect()
+{
+    quint16 proxyPort = d->port;
 
 #ifdef PROX_DEBUG
-    fprintf(stderr, "HttpProxyPost: Connecting to %s:%d", proxyHost.latin1(), proxyPort);
+    fprintf(stderr, "HttpProxyPost: Connecting to %s:%d", d->host.latin1(), proxyPort);
     if (d->user.isEmpty())
         fprintf(stderr, "\n");
     else
         fprintf(stderr, ", auth {%s,%s}\n", d->user.latin1(), d->pass.latin1());
 #endif
-    if (d->sock.state() != QAbstractSocket::ConnectingState) { // in case of http/1.1 it may be connected
-        if (d->lastAddress.isNull()) {
-            d->sock.connectToHost(proxyHost, proxyPort);
-        } else {
-            d->sock.connectToHost(d->lastAddress, proxyPort);
-        }
+    if (d->lastAddress.isNull()) {
+        d->sock.connectToHost(d->host, proxyPort);
+    } else {
+        d->sock.connectToHost(d->lastAddress, proxyPort);
     }
 }
 
@@ -528,7 +570,13 @@ void HttpProxyPost::sock_connected()
     }
 
     d->lastAddress = d->sock.peerAddress();
-    d->inHeader    = true;
+    sendRequest();
+}
+
+void HttpProxyPost::sendRequest()
+{
+    d->inHeader      = true;
+    d->contentLength = -1;
     d->headerLines.clear();
 
     QUrl u = d->url;
@@ -542,10 +590,12 @@ void HttpProxyPost::sock_connected()
             s += QByteArray("Proxy-Authorization: Basic ") + str.toBase64() + "\r\n";
         }
         s += "Pragma: no-cache\r\n";
+        s += "Proxy-Connection: keep-alive\r\n";
         s += QByteArray("Host: ") + u.host().toUtf8() + "\r\n";
     } else {
         s += QByteArray("Host: ") + d->host.toUtf8() + "\r\n";
     }
+    s += "Connection: keep-alive\r\n";
     s += "Content-Type: application/x-www-form-urlencoded\r\n";
     s += QByteArray("Content-Length: ") + QByteArray::number(d->postdata.size()) + "\r\n";
     s += "\r\n";
@@ -565,8 +615,27 @@ void HttpProxyPost::sock_connected()
     }
 }
 
+bool HttpProxyPost::retryOnFreshConnection()
+{
+    // a kept alive connection may be closed by the other side right when we reuse it. the request
+    // didn't get anywhere then, so just send it again
+    if (!d->busy || !d->reused || !d->inHeader || !d->recvBuf.isEmpty())
+        return false;
+    resetConnection(true);
+    d->busy   = true;
+    d->reused = false;
+    startConnect();
+    return true;
+}
+
 void HttpProxyPost::sock_connectionClosed()
 {
+    if (!d->busy) { // idle kept alive connection went away
+        resetConnection();
+        return;
+    }
+    if (retryOnFreshConnection())
+        return;
     d->body = d->recvBuf;
     resetConnection();
     emit result();
@@ -589,6 +658,12 @@ void HttpProxyPost::tls_error()
 #ifdef PROX_DEBUG
     fprintf(stderr, "HttpProxyGetStream: ssl error: %d\n", d->tls->errorCode());
 #endif
+    if (!d->busy) { // idle kept alive connection went away
+        resetConnection();
+        return;
+    }
+    if (retryOnFreshConnection())
+        return;
     resetConnection(true);
     emit error(ErrConnectionRefused); // FIXME: bogus error
 }
@@ -675,8 +750,27 @@ void HttpProxyPost::processData(const QByteArray &block)
                 emit error(err);
                 return;
             }
+
+            bool ok;
+            int  len         = getHeader("Content-Length").toInt(&ok);
+            d->contentLength = ok && len >= 0 ? len : -1;
+            QString conn     = getHeader("Proxy-Connection");
+            if (conn.isEmpty())
+                conn = getHeader("Connection");
+            conn = conn.toLower();
+            // without a length the body ends with the connection, so it can't be reused anyway
+            d->keepAlive = d->contentLength >= 0 && (proto == "HTTP/1.1" ? conn != "close" : conn == "keep-alive");
         }
     }
+
+    if (!d->inHeader && d->busy && d->contentLength >= 0 && d->recvBuf.size() >= d->contentLength) {
+        d->body = d->recvBuf.left(d->contentLength);
+        d->recvBuf.resize(0);
+        d->busy = false;
+        if (!d->keepAlive)
+            resetConnection();
+        emit result();
+    }
 }
 
 void HttpProxyPost::sock_error(int x)
@@ -684,6 +778,12 @@ void HttpProxyPost::sock_error(int x)
 #ifdef PROX_DEBUG
     fprintf(stderr, "HttpProxyPost: socket error: %d\n", x);
 #endif
+    if (!d->busy) { // idle kept alive connection went away
+        resetConnection();
+        return;
+    }
+    if (retryOnFreshConnection())
+        return;
     resetConnection(true);
     if (x == BSocket::ErrHostNotFound)
         emit error(ErrProxyConnect);
@@ -104,6 +104,9 @@ private:
     Private *d;
 
     void resetConnection(bool clear = false);
+    void startConnect();
+    void sendRequest();
+    bool retryOnFreshConnection();
     void processData(const QByteArray &block);
 };
 
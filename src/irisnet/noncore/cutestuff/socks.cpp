@@ -456,6 +456,8 @@ SocksClient::~SocksClient()
 
 QAbstractSocket *SocksClient::abstractSocket() const { return d->sock.abstractSocket(); }
 
+void SocksClient::setProfile(BSocket::Profile profile) { d->sock.setProfile(profile); }
+
 void SocksClient::resetConnection(bool clear)
 {
     if (d->sock.state() != BSocket::Idle)
@@ -539,6 +541,14 @@ qint64 SocksClient::readData(char *data, qint64 maxSize)
 
 qint64 SocksClient::bytesAvailable() const { return ByteStream::bytesAvailable(); }
 
+QList<QByteArray> SocksClient::takeReadChunks()
+{
+    QList<QByteArray> ret = ByteStream::takeReadChunks();
+    if (d->sock.state() != BSocket::Connected)
+        setOpenMode(QIODevice::NotOpen);
+    return ret;
+}
+
 qint64 SocksClient::bytesToWrite() const
 {
     if (isOpen())
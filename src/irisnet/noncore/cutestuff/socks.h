@@ -20,6 +20,7 @@
 #ifndef CS_SOCKS_H
 #define CS_SOCKS_H
 
+#include "bsocket.h"
 #include "bytestream.h"
 
 // CS_NAMESPACE_BEGIN
@@ -63,6 +64,9 @@ public:
 
     virtual QAbstractSocket *abstractSocket() const;
 
+    // of the connection to the proxy or of the incoming one, see BSocket::setProfile()
+    void setProfile(BSocket::Profile profile);
+
     bool isIncoming() const;
 
     // outgoing
@@ -77,9 +81,10 @@ public:
     void grantUDPAssociate(const QString &relayHost, quint16 relayPort);
 
     // from ByteStream
-    void   close();
-    qint64 bytesAvailable() const;
-    qint64 bytesToWrite() const;
+    void              close();
+    qint64            bytesAvailable() const;
+    qint64            bytesToWrite() const;
+    QList<QByteArray> takeReadChunks();
 
     // remote address
     QHostAddress peerAddress() const;
@@ -0,0 +1,725 @@
+/*
+ * socksrelay.cpp - relaying two SOCKS5 connections to each other
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "socksrelay.h"
+
+#include "socks.h"
+
+#include <QAbstractSocket>
+#include <QHash>
+#include <QMutex>
+#include <QPointer>
+#include <QSet>
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
+#endif
+#endif
+
+// what may be in flight per direction, the pipe with splice or the buffer of the read/write loop
+#define SOCKSRELAY_BUFFER 65536
+
+// the worker threads shared by the relays, see SocksRelay::setWorkerThreads()
+#define SOCKSRELAY_THREADS 4
+
+// what one epoll_wait() returns at most
+#define SOCKSRELAY_EVENTS 256
+
+// CS_NAMESPACE_BEGIN
+
+#ifdef Q_OS_UNIX
+namespace {
+// one direction of the relay, run by the worker thread only
+class Direction {
+    Q_DISABLE_COPY(Direction)
+public:
+    int                  from;
+    int                  to;
+    std::atomic<qint64> *count;
+    QByteArray           early; // read by the SocksClient already, goes out first
+    qint64               inFlight = 0;
+    bool                 eof      = false;
+    bool                 shut     = false; // nothing more goes out
+#ifdef Q_OS_LINUX
+    int pipe[2] = { -1, -1 };
+#else
+    QByteArray buf;
+    int        head = 0;
+#endif
+
+    Direction(int _from, int _to, std::atomic<qint64> *_count, const QByteArray &_early) :
+        from(_from), to(_to), count(_count), early(_early)
+    {
+#ifdef Q_OS_LINUX
+        if (::pipe2(pipe, O_NONBLOCK | O_CLOEXEC) == 0)
+            ::fcntl(pipe[1], F_SETPIPE_SZ, SOCKSRELAY_BUFFER);
+#else
+        buf.resize(SOCKSRELAY_BUFFER);
+#endif
+    }
+
+    ~Direction()
+    {
+#ifdef Q_OS_LINUX
+        if (pipe[0] != -1) {
+            ::close(pipe[0]);
+            ::close(pipe[1]);
+        }
+#endif
+    }
+
+    bool isValid() const
+    {
+#ifdef Q_OS_LINUX
+        return pipe[0] != -1;
+#else
+        return true;
+#endif
+    }
+
+    bool wantsRead() const
+    {
+#ifdef Q_OS_LINUX
+        return !eof && inFlight < SOCKSRELAY_BUFFER;
+#else
+        return !eof && inFlight == 0;
+#endif
+    }
+    bool wantsWrite() const { return !shut && (!early.isEmpty() || inFlight > 0); }
+
+    // the receiving side is gone, what's in flight is dropped
+    void abandon()
+    {
+        eof = shut = true;
+        early.clear();
+    }
+
+    void pump()
+    {
+        flush();
+        if (wantsRead()) {
+#ifdef Q_OS_LINUX
+            ssize_t n = ::splice(from, nullptr, pipe[1], nullptr, size_t(SOCKSRELAY_BUFFER - inFlight),
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+            ssize_t n = ::read(from, buf.data(), size_t(buf.size()));
+            head      = 0;
+#endif
+            if (n > 0)
+                inFlight += n;
+            else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                eof = true;
+            flush();
+        }
+        if (eof && !shut && early.isEmpty() && !inFlight) {
+            ::shutdown(to, SHUT_WR);
+            shut = true;
+        }
+    }
+
+private:
+    void flush()
+    {
+        while (!shut && !early.isEmpty()) {
+            ssize_t n = ::write(to, early.constData(), size_t(early.size()));
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR)
+                    abandon();
+                return;
+            }
+            early.remove(0, int(n));
+            *count += n;
+        }
+        while (!shut && inFlight) {
+#ifdef Q_OS_LINUX
+            ssize_t n = ::splice(pipe[0], nullptr, to, nullptr, size_t(inFlight), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+            ssize_t n = ::write(to, buf.constData() + head, size_t(inFlight));
+            if (n > 0)
+                head += int(n);
+#endif
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR)
+                    abandon();
+                return;
+            }
+            inFlight -= n;
+            *count += n;
+        }
+    }
+};
+
+// a peer which is gone makes the writes fail with EPIPE instead of killing the process
+void blockPipeSignal()
+{
+    sigset_t pipeSignal;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, nullptr);
+}
+
+// the two sockets of a relay. the directions are the loop's, the rest is shared with the relay
+class Session {
+    Q_DISABLE_COPY(Session)
+public:
+    struct End {
+        Session *session;
+        int      side; // read by dirs[side], written by the other one
+    };
+
+    int                 fds[2];
+    std::atomic<qint64> toB { 0 };
+    std::atomic<qint64> toA { 0 };
+    Direction           dirs[2];
+    End                 ends[2];
+
+    QMutex                mutex; // guards receiver, which is cleared when the relay stops
+    QObject              *receiver = nullptr;
+    std::function<void()> done;
+
+    Session(int fa, int fb, const QByteArray &earlyB, const QByteArray &earlyA) :
+        fds { fa, fb }, dirs { { fa, fb, &toB, earlyB }, { fb, fa, &toA, earlyA } }, ends { { this, 0 }, { this, 1 } }
+    {
+    }
+
+    ~Session() { closeSockets(); }
+
+    bool isValid() const { return dirs[0].isValid() && dirs[1].isValid(); }
+    bool isDone() const { return dirs[0].shut && dirs[1].shut; }
+    int  events(int side) const
+    {
+        return (dirs[side].wantsRead() ? POLLIN : 0) | (dirs[1 - side].wantsWrite() ? POLLOUT : 0);
+    }
+
+    void pump()
+    {
+        dirs[0].pump();
+        dirs[1].pump();
+    }
+
+    void closeSockets()
+    {
+        for (int &fd : fds) {
+            if (fd != -1)
+                ::close(fd);
+            fd = -1;
+        }
+    }
+
+    // called by the loop. the relay may be stopping right now in its own thread
+    void notify()
+    {
+        QMutexLocker locker(&mutex);
+        if (receiver)
+            QMetaObject::invokeMethod(receiver, done, Qt::QueuedConnection);
+    }
+};
+
+#ifdef Q_OS_LINUX
+// level triggered epoll. the kernel keeps the interest, so a wait costs what is ready, not what is registered
+class Poller {
+public:
+    struct Event {
+        void *tag;
+        int   events; // POLLIN, POLLOUT, and POLLHUP for a hangup or an error
+    };
+
+    Poller() : efd(::epoll_create1(EPOLL_CLOEXEC)) { }
+    ~Poller()
+    {
+        if (efd != -1)
+            ::close(efd);
+    }
+
+    bool isValid() const { return efd != -1; }
+
+    // 0 takes the fd out, a hangup would be reported over and over otherwise
+    void set(int fd, int events, void *tag)
+    {
+        int old = registered.value(fd);
+        if (events == old)
+            return;
+        epoll_event ev = {};
+        ev.events      = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+        ev.data.ptr    = tag;
+        ::epoll_ctl(efd, !events ? EPOLL_CTL_DEL : old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+        if (events)
+            registered.insert(fd, events);
+        else
+            registered.remove(fd);
+    }
+
+    void wait(QVector<Event> &out)
+    {
+        epoll_event evs[SOCKSRELAY_EVENTS];
+        int         n = ::epoll_wait(efd, evs, SOCKSRELAY_EVENTS, -1);
+        for (int i = 0; i < n; ++i) {
+            uint32_t e = evs[i].events;
+            out += { evs[i].data.ptr,
+                     (e & EPOLLIN ? POLLIN : 0) | (e & EPOLLOUT ? POLLOUT : 0)
+                         | (e & (EPOLLERR | EPOLLHUP) ? POLLHUP : 0) };
+        }
+    }
+
+private:
+    int             efd;
+    QHash<int, int> registered;
+};
+#else
+// poll() with the interest collected for every wait
+class Poller {
+public:
+    struct Event {
+        void *tag;
+        int   events; // POLLIN, POLLOUT, and POLLHUP for a hangup or an error
+    };
+
+    bool isValid() const { return true; }
+
+    // 0 takes the fd out, a hangup would be reported over and over otherwise
+    void set(int fd, int events, void *tag)
+    {
+        if (events)
+            registered.insert(fd, { events, tag });
+        else
+            registered.remove(fd);
+    }
+
+    void wait(QVector<Event> &out)
+    {
+        fds.resize(0);
+        tags.resize(0);
+        for (auto it = registered.cbegin(); it != registered.cend(); ++it) {
+            fds += pollfd { it.key(), short(it->first), 0 };
+            tags += it->second;
+        }
+        if (::poll(fds.data(), nfds_t(fds.size()), -1) <= 0)
+            return;
+        for (int i = 0; i < fds.size(); ++i) {
+            short e = fds[i].revents;
+            if (e)
+                out += { tags[i], (e & (POLLIN | POLLOUT)) | (e & (POLLERR | POLLHUP | POLLNVAL) ? POLLHUP : 0) };
+        }
+    }
+
+private:
+    QHash<int, QPair<int, void *>> registered;
+    QVector<pollfd>                fds;
+    QVector<void *>                tags;
+};
+#endif
+
+// a worker thread serving any number of relays. the relays are added and stopped through commands, anything
+// else happens in the thread
+class Loop {
+    Q_DISABLE_COPY(Loop)
+public:
+    std::atomic<int> load { 0 }; // relays served
+
+    Loop()
+    {
+        if (::pipe(wake) == 0) {
+            for (int fd : wake) {
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        if (isValid()) {
+            thread = QThread::create([this]() { run(); });
+            thread->start();
+        }
+    }
+
+    ~Loop()
+    {
+        if (thread) {
+            post([this]() { quitting = true; });
+            thread->wait();
+            delete thread;
+        }
+        for (int fd : wake)
+            if (fd != -1)
+                ::close(fd);
+    }
+
+    bool isValid() const { return wake[0] != -1 && poller.isValid(); }
+
+    void add(const std::shared_ptr<Session> &s)
+    {
+        ++load;
+        post([this, s]() { start(s); });
+    }
+
+    // the sockets are closed by the thread a bit later
+    void stop(const std::shared_ptr<Session> &s)
+    {
+        post([this, s]() { finish(s.get(), false); });
+    }
+
+private:
+    QMutex                                     mutex;
+    QList<std::function<void()>>               commands;
+    int                                        wake[2] = { -1, -1 };
+    QThread                                   *thread  = nullptr;
+    Poller                                     poller;
+    QHash<Session *, std::shared_ptr<Session>> sessions;
+    bool                                       quitting = false;
+
+    void post(std::function<void()> &&command)
+    {
+        {
+            QMutexLocker locker(&mutex);
+            commands += std::move(command);
+        }
+        // a full pipe is readable already
+        char c = 0;
+        while (::write(wake[1], &c, 1) < 0 && errno == EINTR) { }
+    }
+
+    void runCommands()
+    {
+        char buf[64];
+        while (::read(wake[0], buf, sizeof(buf)) > 0) { }
+        QList<std::function<void()>> todo;
+        {
+            QMutexLocker locker(&mutex);
+            todo.swap(commands);
+        }
+        for (auto const &command : std::as_const(todo))
+            command();
+    }
+
+    void run()
+    {
+        blockPipeSignal();
+        poller.set(wake[0], POLLIN, nullptr);
+
+        QVector<Poller::Event> events;
+        QSet<Session *>        ready;
+        while (!quitting) {
+            events.resize(0);
+            poller.wait(events);
+
+            bool woken = false;
+            ready.clear();
+            for (auto const &ev : std::as_const(events)) {
+                if (!ev.tag) {
+                    woken = true;
+                    continue;
+                }
+                auto end = static_cast<Session::End *>(ev.tag);
+                if (ev.events & POLLHUP)
+                    end->session->dirs[1 - end->side].abandon(); // what's still readable from it is passed on below
+                ready += end->session;
+            }
+            for (Session *s : std::as_const(ready))
+                serve(s);
+            // last, a stop may remove a session of this round
+            if (woken)
+                runCommands();
+        }
+
+        while (!sessions.isEmpty())
+            finish(sessions.begin().key(), false);
+    }
+
+    void start(const std::shared_ptr<Session> &s)
+    {
+        sessions.insert(s.get(), s);
+        if (!s->isValid()) {
+            finish(s.get(), true);
+            return;
+        }
+        serve(s.get());
+    }
+
+    void serve(Session *s)
+    {
+        s->pump();
+        if (s->isDone()) {
+            finish(s, true);
+            return;
+        }
+        for (int i = 0; i < 2; ++i)
+            poller.set(s->fds[i], s->events(i), &s->ends[i]);
+    }
+
+    void finish(Session *s, bool notify)
+    {
+        auto it = sessions.find(s);
+        if (it == sessions.end())
+            return; // done already
+        for (int fd : s->fds)
+            poller.set(fd, 0, nullptr);
+        s->closeSockets();
+        if (notify)
+            s->notify();
+        sessions.erase(it);
+        --load;
+    }
+};
+
+// the loops are started as the relays need them, up to maxThreads, and stay until the exit
+class Loops {
+public:
+    QMutex        mutex;
+    QList<Loop *> loops;
+    int           maxThreads = SOCKSRELAY_THREADS;
+
+    ~Loops() { qDeleteAll(loops); }
+
+    static Loops &instance()
+    {
+        static Loops loops;
+        return loops;
+    }
+
+    // the least busy one, or a new one while all of them have work and there are less than maxThreads
+    Loop *pick()
+    {
+        QMutexLocker locker(&mutex);
+        if (!maxThreads)
+            return nullptr;
+        Loop *best = nullptr;
+        for (Loop *l : std::as_const(loops)) {
+            if (!best || l->load < best->load)
+                best = l;
+        }
+        if ((!best || best->load > 0) && loops.size() < maxThreads) {
+            auto l = new Loop;
+            if (!l->isValid()) {
+                delete l;
+                return best;
+            }
+            loops += l;
+            best = l;
+        }
+        return best;
+    }
+};
+}
+#endif
+
+class SocksRelay::Private {
+public:
+    SocksRelay           *q;
+    QPointer<SocksClient> a;
+    QPointer<SocksClient> b;
+    std::atomic<qint64>   toB { 0 };
+    std::atomic<qint64>   toA { 0 };
+    bool                  active = false;
+#ifdef Q_OS_UNIX
+    std::shared_ptr<Session> session; // stays after the stop, for the counters
+    Loop                    *loop = nullptr;
+#endif
+
+    Private(SocksRelay *_q, SocksClient *_a, SocksClient *_b) : q(_q), a(_a), b(_b) { }
+
+    // the replies of the handshakes may still be in the socket buffers
+    void startWhenFlushed()
+    {
+        if (!active)
+            return;
+        if (!a || !b) {
+            finish();
+            return;
+        }
+        a->disconnect(q);
+        b->disconnect(q);
+        if (a->bytesToWrite() || b->bytesToWrite()) {
+            QObject::connect(a, &SocksClient::bytesWritten, q, [this]() { startWhenFlushed(); });
+            QObject::connect(b, &SocksClient::bytesWritten, q, [this]() { startWhenFlushed(); });
+            return;
+        }
+#ifdef Q_OS_UNIX
+        if (takeOver())
+            return;
+#endif
+        relayInThread();
+    }
+
+#ifdef Q_OS_UNIX
+    bool takeOver()
+    {
+        QAbstractSocket *sa = a->abstractSocket();
+        QAbstractSocket *sb = b->abstractSocket();
+        if (!sa || !sb || sa->socketDescriptor() == -1 || sb->socketDescriptor() == -1)
+            return false;
+        Loop *l = Loops::instance().pick();
+        if (!l)
+            return false;
+        int fa = ::fcntl(int(sa->socketDescriptor()), F_DUPFD_CLOEXEC, 0);
+        int fb = ::fcntl(int(sb->socketDescriptor()), F_DUPFD_CLOEXEC, 0);
+        if (fa == -1 || fb == -1) {
+            for (int fd : { fa, fb })
+                if (fd != -1)
+                    ::close(fd);
+            return false;
+        }
+        QByteArray earlyB = a->readAll();
+        QByteArray earlyA = b->readAll();
+        ::fcntl(fa, F_SETFL, ::fcntl(fa, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fb, F_SETFL, ::fcntl(fb, F_GETFL) | O_NONBLOCK);
+
+        // the duplicates keep the connections, closing the originals doesn't shut them down
+        for (SocksClient *c : { a.data(), b.data() }) {
+            c->disconnect();
+            c->abstractSocket()->abort();
+            c->deleteLater();
+        }
+        a = nullptr;
+        b = nullptr;
+
+        session           = std::make_shared<Session>(fa, fb, earlyB, earlyA);
+        session->receiver = q;
+        session->done     = [this]() { finish(); };
+        loop              = l;
+        loop->add(session);
+        return true;
+    }
+#endif
+
+    // the portable way: the clients stay and the data goes through their buffers
+    void relayInThread()
+    {
+        auto pass = [this](SocksClient *from, SocksClient *to, std::atomic<qint64> *count) {
+            QByteArray data = from->readAll();
+            if (!data.isEmpty()) {
+                to->write(data);
+                *count += data.size();
+            }
+        };
+        QObject::connect(a, &SocksClient::readyRead, q, [=, this]() { pass(a, b, &toB); });
+        QObject::connect(b, &SocksClient::readyRead, q, [=, this]() { pass(b, a, &toA); });
+        for (SocksClient *c : { a.data(), b.data() }) {
+            QObject::connect(c, &SocksClient::connectionClosed, q, [this]() { finish(); });
+            QObject::connect(c, &SocksClient::error, q, [this]() { finish(); });
+        }
+        pass(a, b, &toB);
+        pass(b, a, &toA);
+    }
+
+    void stopWorker()
+    {
+#ifdef Q_OS_UNIX
+        if (!loop)
+            return;
+        {
+            QMutexLocker locker(&session->mutex);
+            session->receiver = nullptr;
+        }
+        loop->stop(session);
+        loop = nullptr;
+#endif
+    }
+
+    qint64 sent(bool toSideB) const
+    {
+        qint64 n = toSideB ? toB : toA;
+#ifdef Q_OS_UNIX
+        if (session)
+            n += toSideB ? session->toB : session->toA;
+#endif
+        return n;
+    }
+
+    void finish()
+    {
+        if (!active)
+            return;
+        active = false;
+        stopWorker();
+        for (SocksClient *c : { a.data(), b.data() }) {
+            if (c) {
+                c->disconnect(q);
+                c->close();
+                c->deleteLater();
+            }
+        }
+        emit q->finished();
+    }
+};
+
+SocksRelay::SocksRelay(SocksClient *a, SocksClient *b, QObject *parent) : QObject(parent)
+{
+    d = new Private(this, a, b);
+}
+
+SocksRelay::~SocksRelay()
+{
+    d->stopWorker();
+    for (SocksClient *c : { d->a.data(), d->b.data() })
+        delete c;
+    delete d;
+}
+
+void SocksRelay::start()
+{
+    if (d->active)
+        return;
+    d->active = true;
+    d->startWhenFlushed();
+}
+
+void SocksRelay::stop()
+{
+    if (!d->active)
+        return;
+    d->active = false;
+    d->stopWorker();
+    for (SocksClient *c : { d->a.data(), d->b.data() }) {
+        if (c) {
+            c->disconnect(this);
+            c->close();
+        }
+    }
+}
+
+bool SocksRelay::isActive() const { return d->active; }
+
+qint64 SocksRelay::bytesToB() const { return d->sent(true); }
+
+qint64 SocksRelay::bytesToA() const { return d->sent(false); }
+
+void SocksRelay::setWorkerThreads(int count)
+{
+#ifdef Q_OS_UNIX
+    auto        &loops = Loops::instance();
+    QMutexLocker locker(&loops.mutex);
+    loops.maxThreads = qMax(count, 0);
+#else
+    Q_UNUSED(count)
+#endif
+}
+
+// CS_NAMESPACE_END
@@ -0,0 +1,66 @@
+/*
+ * socksrelay.h - relaying two SOCKS5 connections to each other
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CS_SOCKSRELAY_H
+#define CS_SOCKSRELAY_H
+
+#include <QObject>
+
+class SocksClient;
+
+// CS_NAMESPACE_BEGIN
+/*
+ * Passes the data between two connections whose SOCKS5 handshakes are done, e.g. the target and the
+ * requester of an S5B proxy after activation. On Unix the sockets are taken from the clients and served by
+ * worker threads shared by all the relays, each waiting on its sockets with epoll (poll on the other
+ * systems), so only finished() comes back to the thread of the relay. Linux splices from socket to socket
+ * through a pipe, so the data never reaches user space, the other systems run a read/write loop with one
+ * buffer per direction. Elsewhere the clients stay and the data is passed between them in this thread.
+ * When one side closes, the other one is shut down for writing once everything is passed on. finished()
+ * comes when both directions are done or one of the sockets failed.
+ */
+class SocksRelay : public QObject {
+    Q_OBJECT
+public:
+    // takes over both clients, which may have read past the handshake already
+    SocksRelay(SocksClient *a, SocksClient *b, QObject *parent = nullptr);
+    ~SocksRelay();
+
+    void start();
+    void stop(); // closes both connections
+    bool isActive() const;
+
+    // per direction, may be read while the relay runs
+    qint64 bytesToB() const;
+    qint64 bytesToA() const;
+
+    // the most worker threads the relays are spread over, 4 by default. with 0 the relays started from now on
+    // pass the data in their own thread. unix only
+    static void setWorkerThreads(int count);
+
+signals:
+    void finished();
+
+private:
+    class Private;
+    Private *d;
+};
+// CS_NAMESPACE_END
+
+#endif // CS_SOCKSRELAY_H
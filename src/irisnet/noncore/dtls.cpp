@@ -17,14 +17,13 @@
  */
 
 #include "dtls.h"
+#include "dtlsbackend.h"
+#include "dtlsidentitypool.h"
 #include "xmpp_xmlcommon.h"
 
 #include <array>
 
 #include <QtCrypto>
-#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
-#include <QRandomGenerator>
-#endif
 #include <QAbstractSocket>
 
 #define DTLS_DEBUG(msg, ...) qDebug("dtls: " msg, ##__VA_ARGS__)
@@ -91,11 +90,94 @@ QDomElement Dtls::FingerPrint::toXml(QDomDocument *doc) const
     return fingerprint;
 }
 
+//----------------------------------------------------------------------------
+// QcaDtlsBackend
+//----------------------------------------------------------------------------
+class QcaDtlsBackend : public DtlsBackend {
+    Q_OBJECT
+public:
+    QCA::TLS *tls = nullptr;
+
+    QcaDtlsBackend(QObject *parent) : DtlsBackend(parent) { }
+
+    ~QcaDtlsBackend() override { delete tls; }
+
+    bool start(bool server, const QCA::Certificate &cert, const QCA::PrivateKey &pkey) override
+    {
+        if (!QCA::isSupported("dtls"))
+            return false;
+
+        tls = new QCA::TLS(QCA::TLS::Datagram);
+        tls->setCertificate(cert, pkey);
+
+        connect(tls, &QCA::TLS::certificateRequested, tls, &QCA::TLS::continueAfterStep);
+        connect(tls, &QCA::TLS::handshaken, this, &DtlsBackend::handshaken);
+        connect(tls, &QCA::TLS::readyRead, this, &DtlsBackend::readyRead);
+        connect(tls, &QCA::TLS::readyReadOutgoing, this, &DtlsBackend::readyReadOutgoing);
+        connect(tls, &QCA::TLS::closed, this, &DtlsBackend::closed);
+        connect(tls, &QCA::TLS::error, this, &QcaDtlsBackend::tls_error);
+
+        if (server)
+            tls->startServer();
+        else
+            tls->startClient();
+        return true;
+    }
+
+    QCA::Certificate peerCertificate() const override
+    {
+        auto peerIdentity = tls->peerIdentityResult();
+        if (peerIdentity != QCA::TLS::Valid && peerIdentity != QCA::TLS::InvalidCertificate) {
+            qWarning("dtls peerIdentity failure: %d", int(peerIdentity));
+            return {};
+        }
+        const auto chain = tls->peerCertificateChain();
+        return chain.isEmpty() ? QCA::Certificate() : chain.first();
+    }
+
+    void continueAfterHandshake() override { tls->continueAfterStep(); }
+
+    void       write(const QByteArray &data) override { tls->write(data); }
+    QByteArray read() override { return tls->read(); }
+    void       writeIncoming(const QByteArray &datagram) override { tls->writeIncoming(datagram); }
+    QByteArray readOutgoing() override { return tls->readOutgoing(); }
+
+private:
+    void tls_error()
+    {
+        DTLS_DEBUG("tls error: %d", tls->errorCode());
+        QAbstractSocket::SocketError e;
+        switch (tls->errorCode()) {
+        case QCA::TLS::ErrorSignerExpired:
+        case QCA::TLS::ErrorSignerInvalid:
+        case QCA::TLS::ErrorCertKeyMismatch:
+            e = QAbstractSocket::SocketError::SslInvalidUserDataError;
+            break;
+        case QCA::TLS::ErrorInit:
+            e = QAbstractSocket::SocketError::SslInternalError;
+            break;
+        case QCA::TLS::ErrorHandshake:
+            e = QAbstractSocket::SocketError::SslHandshakeFailedError;
+            break;
+        case QCA::TLS::ErrorCrypt:
+        default:
+            e = QAbstractSocket::SocketError::UnknownSocketError;
+            break;
+        }
+        emit error(e);
+    }
+};
+
+DtlsBackend *DtlsBackend::createQca(QObject *parent) { return new QcaDtlsBackend(parent); }
+
+//----------------------------------------------------------------------------
+// Dtls
+//----------------------------------------------------------------------------
 class Dtls::Private : public QObject {
     Q_OBJECT
 public:
     Dtls            *q;
-    QCA::TLS        *tls = nullptr;
+    DtlsBackend     *backend = nullptr;
     QCA::PrivateKey  pkey;
     QCA::Certificate cert;
 
@@ -117,57 +199,38 @@ public:
         return Hash::from(hashType, cert.toDER());
     }
 
-    void tls_handshaken()
+    void backend_handshaken()
     {
         DTLS_DEBUG("tls handshaken");
-        auto peerIdentity = tls->peerIdentityResult();
-        if (peerIdentity == QCA::TLS::Valid || peerIdentity == QCA::TLS::InvalidCertificate) {
-            const auto  chain = tls->peerCertificateChain();
-            const auto &cert  = chain.first();
+        auto cert = backend->peerCertificate();
+        if (!cert.isNull()) {
             if (computeFingerprint(cert, remoteFingerprint.hash.type()) == remoteFingerprint.hash) {
                 DTLS_DEBUG("valid");
-                tls->continueAfterStep();
+                backend->continueAfterHandshake();
                 emit q->connected();
                 return;
             } else {
-                qWarning("dtls fingerprints do not match: %d", int(tls->peerIdentityResult()));
+                qWarning("dtls fingerprints do not match");
             }
-        } else {
-            qWarning("dtls peerIdentity failure: %d", int(tls->peerIdentityResult()));
         }
 
         lastError = QAbstractSocket::SslHandshakeFailedError;
-        tls->reset();
+        // nothing more goes through this session
+        backend->deleteLater();
+        backend = nullptr;
         emit q->errorOccurred(lastError);
     }
 
-    void tls_error()
+    void backend_error(QAbstractSocket::SocketError error)
     {
-        DTLS_DEBUG("tls error: %d", tls->errorCode());
-        switch (tls->errorCode()) {
-        case QCA::TLS::ErrorSignerExpired:
-        case QCA::TLS::ErrorSignerInvalid:
-        case QCA::TLS::ErrorCertKeyMismatch:
-            lastError = QAbstractSocket::SocketError::SslInvalidUserDataError;
-            break;
-        case QCA::TLS::ErrorInit:
-            lastError = QAbstractSocket::SocketError::SslInternalError;
-            break;
-        case QCA::TLS::ErrorHandshake:
-            lastError = QAbstractSocket::SocketError::SslHandshakeFailedError;
-            break;
-        case QCA::TLS::ErrorCrypt:
-        default:
-            lastError = QAbstractSocket::SocketError::UnknownSocketError;
-            break;
-        }
+        lastError = error;
         emit q->errorOccurred(lastError);
     }
 
     void setRemoteFingerprint(const FingerPrint &fp)
     {
         bool needRestart = false;
-        if (tls) {
+        if (backend) {
             if (remoteFingerprint == fp)
                 return;
             // need to restart dtls. see rfc8842 (todo: but in fact we need more checks)
@@ -226,9 +289,8 @@ public:
 
     void negotiate()
     {
-        if (tls) {
-            delete tls;
-        }
+        delete backend;
+        backend = nullptr;
 
         if (!remoteFingerprint.isValid()) {
             qWarning("remote fingerprint is not set");
@@ -237,53 +299,44 @@ public:
             return;
         }
 
-        tls = new QCA::TLS(QCA::TLS::Datagram);
-        tls->setCertificate(cert, pkey);
-
-        connect(tls, &QCA::TLS::certificateRequested, tls, &QCA::TLS::continueAfterStep);
-        connect(tls, &QCA::TLS::handshaken, this, &Dtls::Private::tls_handshaken);
-        connect(tls, &QCA::TLS::readyRead, q, &Dtls::readyRead);
-        connect(tls, &QCA::TLS::readyReadOutgoing, q, &Dtls::readyReadOutgoing);
-        connect(tls, &QCA::TLS::closed, q, &Dtls::closed);
-        connect(tls, &QCA::TLS::error, this, &Dtls::Private::tls_error);
-
-        if (localFingerprint.setup == Dtls::Passive) {
-            qDebug("Starting DTLS server");
-            tls->startServer();
-        } else {
-            qDebug("Starting DTLS client");
-            tls->startClient();
+        bool server = localFingerprint.setup == Dtls::Passive;
+        qDebug("Starting DTLS %s", server ? "server" : "client");
+#ifdef IRIS_DTLS_OPENSSL
+        backend = DtlsBackend::createOpenSsl(this);
+        prepareBackend();
+        if (!backend->start(server, cert, pkey)) {
+            qWarning("dtls: OpenSSL can't use the certificate, falling back to QCA");
+            delete backend;
+            backend = nullptr;
+        }
+#endif
+        if (!backend) {
+            backend = DtlsBackend::createQca(this);
+            prepareBackend();
+            if (!backend->start(server, cert, pkey)) {
+                delete backend;
+                backend   = nullptr;
+                lastError = QAbstractSocket::SocketError::SslInternalError;
+                emit q->errorOccurred(lastError);
+            }
         }
     }
 
-    void generateCertificate()
+    void prepareBackend()
     {
-        QCA::CertificateOptions opts;
-
-        QCA::CertificateInfo info;
-        info.insert(QCA::CommonName, QStringLiteral("iris.psi-im.org"));
-        if (!localJid.isEmpty())
-            info.insert(QCA::XMPP, localJid);
-        opts.setInfo(info);
-
-#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
-        QCA::BigInteger sn(QRandomGenerator::global()->generate());
-#else
-        QCA::BigInteger sn(qrand());
-#endif
-        opts.setSerialNumber(sn);
-
-        auto nowUTC = QDateTime::currentDateTimeUtc();
-        opts.setValidityPeriod(nowUTC, nowUTC.addDays(30));
-
-        QCA::Constraints constraints = { { QCA::DigitalSignature, QCA::KeyEncipherment, QCA::DataEncipherment,
-                                           QCA::ClientAuth, QCA::ServerAuth } };
-        opts.setConstraints(constraints);
-        opts.setAsCA();
+        connect(backend, &DtlsBackend::handshaken, this, &Dtls::Private::backend_handshaken);
+        connect(backend, &DtlsBackend::readyRead, q, &Dtls::readyRead);
+        connect(backend, &DtlsBackend::readyReadOutgoing, q, &Dtls::readyReadOutgoing);
+        connect(backend, &DtlsBackend::closed, q, &Dtls::closed);
+        connect(backend, &DtlsBackend::error, this, &Dtls::Private::backend_error);
+    }
 
-        pkey                  = QCA::KeyGenerator().createRSA(2048);
-        cert                  = QCA::Certificate(opts, pkey);
-        localFingerprint.hash = Private::computeFingerprint(cert, Hash::Sha256);
+    void generateCertificate()
+    {
+        auto identity         = DtlsIdentityPool::generate(localJid);
+        pkey                  = identity.pkey;
+        cert                  = identity.cert;
+        localFingerprint.hash = identity.fingerprint;
     }
 };
 
@@ -314,18 +367,28 @@ void Dtls::setLocalCertificate(const QCA::Certificate &cert, const QCA::PrivateK
         break;
     }
 
-    d->tls->setCertificate(cert, pkey);
+    // used by the next negotiate()
+    d->cert                  = cert;
+    d->pkey                  = pkey;
     d->localFingerprint.hash = Private::computeFingerprint(cert, hashType);
 }
 
+void Dtls::setLocalCertificate(const QCA::Certificate &cert, const QCA::PrivateKey &pkey, const Hash &fingerprint)
+{
+    d->cert                  = cert;
+    d->pkey                  = pkey;
+    d->localFingerprint.hash = fingerprint;
+}
+
 QCA::Certificate Dtls::localCertificate() const { return d->cert; }
 
+QCA::PrivateKey Dtls::localPrivateKey() const { return d->pkey; }
+
 QCA::Certificate Dtls::remoteCertificate() const
 {
-    if (!d->tls || d->tls->peerCertificateChain().isEmpty())
+    if (!d->backend)
         return {};
-    auto const &chain = d->tls->peerCertificateChain();
-    return chain.first();
+    return d->backend->peerCertificate();
 }
 
 void Dtls::initOutgoing()
@@ -355,28 +418,36 @@ QAbstractSocket::SocketError Dtls::error() const { return d->lastError; }
 
 void Dtls::negotiate() { d->negotiate(); }
 
-bool Dtls::isStarted() const { return d->tls != nullptr; }
+bool Dtls::isStarted() const { return d->backend != nullptr; }
 
-bool Dtls::isSupported() { return QCA::isSupported("dtls"); }
+bool Dtls::isSupported()
+{
+#ifdef IRIS_DTLS_OPENSSL
+    // QCA still makes the certificates
+    if (QCA::isSupported("cert") && QCA::isSupported("rsa"))
+        return true;
+#endif
+    return QCA::isSupported("dtls");
+}
 
 QByteArray Dtls::readDatagram()
 {
-    if (!d->tls) {
+    if (!d->backend) {
         DTLS_DEBUG("negotiation hasn't started yet. ignore readDatagram");
         return {};
     }
-    QByteArray a = d->tls->read();
+    QByteArray a = d->backend->read();
     // DTLS_DEBUG("read %d bytes of decrypted data", a.size());
     return a;
 }
 
 QByteArray Dtls::readOutgoingDatagram()
 {
-    if (!d->tls) {
+    if (!d->backend) {
         DTLS_DEBUG("negotiation hasn't started yet. ignore readOutgoingDatagram");
         return {};
     }
-    auto ba = d->tls->readOutgoing();
+    auto ba = d->backend->readOutgoing();
     // DTLS_DEBUG("read outgoing packet of %d bytes", ba.size());
     return ba;
 }
@@ -384,21 +455,21 @@ QByteArray Dtls::readOutgoingDatagram()
 void Dtls::writeDatagram(const QByteArray &data)
 {
     // DTLS_DEBUG("write %d bytes for encryption\n", data.size());
-    if (!d->tls) {
+    if (!d->backend) {
         DTLS_DEBUG("negotiation hasn't started yet. ignore writeDatagram");
         return;
     }
-    d->tls->write(data);
+    d->backend->write(data);
 }
 
 void Dtls::writeIncomingDatagram(const QByteArray &data)
 {
     // DTLS_DEBUG("write incoming %d bytes for decryption\n", data.size());
-    if (!d->tls) {
+    if (!d->backend) {
         DTLS_DEBUG("negotiation hasn't started yet. ignore incoming datagram");
         return;
     }
-    d->tls->writeIncoming(data);
+    d->backend->writeIncoming(data);
 }
 
 } // namespace XMPP
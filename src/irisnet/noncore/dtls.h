@@ -71,8 +71,13 @@ public:
     void acceptIncoming(); // when we need to respond to the remote dtls info
     void onRemoteAcceptedFingerprint();
 
-    void             setLocalCertificate(const QCA::Certificate &cert, const QCA::PrivateKey &pkey);
+    // set before initOutgoing()/acceptIncoming() to reuse a certificate instead of generating a new one. the
+    //   second one takes the fingerprint known already, e.g. from DtlsIdentityPool
+    void setLocalCertificate(const QCA::Certificate &cert, const QCA::PrivateKey &pkey);
+    void setLocalCertificate(const QCA::Certificate &cert, const QCA::PrivateKey &pkey, const Hash &fingerprint);
+
     QCA::Certificate localCertificate() const;
+    QCA::PrivateKey  localPrivateKey() const;
     QCA::Certificate remoteCertificate() const;
 
     const FingerPrint &localFingerprint() const;
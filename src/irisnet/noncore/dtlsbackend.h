@@ -0,0 +1,76 @@
+/*
+ * dtlsbackend.h - record layer engines of Dtls
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_DTLSBACKEND_H
+#define XMPP_DTLSBACKEND_H
+
+#include <QAbstractSocket>
+#include <QObject>
+
+namespace QCA {
+class Certificate;
+class PrivateKey;
+}
+
+namespace XMPP {
+
+/*
+The part of Dtls which actually speaks the protocol. Dtls does the signalling side (fingerprints, roles)
+and drives one of these.
+
+Every datagram in or out is one call and one signal: readyReadOutgoing() is emitted once per datagram
+which can be taken with readOutgoing(), the same for readyRead() and read().
+*/
+class DtlsBackend : public QObject {
+    Q_OBJECT
+public:
+    using QObject::QObject;
+
+    // false if the backend can't work with these, the caller may try another one then
+    virtual bool start(bool server, const QCA::Certificate &cert, const QCA::PrivateKey &pkey) = 0;
+
+    // after handshaken(). the certificate is null if the backend already knows it's not acceptable
+    virtual QCA::Certificate peerCertificate() const = 0;
+    // the peer certificate is fine, let the data flow
+    virtual void continueAfterHandshake() = 0;
+
+    virtual void       write(const QByteArray &data) = 0;
+    virtual QByteArray read()                        = 0;
+
+    virtual void       writeIncoming(const QByteArray &datagram) = 0;
+    virtual QByteArray readOutgoing()                            = 0;
+
+    // QCA::TLS in datagram mode. always available, if QCA has a DTLS capable provider
+    static DtlsBackend *createQca(QObject *parent = nullptr);
+#ifdef IRIS_DTLS_OPENSSL
+    // OpenSSL with memory BIOs. everything happens synchronously, within the calls
+    static DtlsBackend *createOpenSsl(QObject *parent = nullptr);
+#endif
+
+signals:
+    void handshaken();
+    void readyRead();
+    void readyReadOutgoing();
+    void closed();
+    void error(QAbstractSocket::SocketError error);
+};
+
+} // namespace XMPP
+
+#endif // XMPP_DTLSBACKEND_H
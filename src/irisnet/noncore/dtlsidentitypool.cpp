@@ -0,0 +1,173 @@
+/*
+ * dtlsidentitypool.cpp - DTLS certificates shared by the sessions of a local jid
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dtlsidentitypool.h"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QRandomGenerator>
+
+#include <utility>
+
+// secs an identity is handed out by default
+#define ROTATION_INTERVAL 86400
+
+// days a certificate is valid
+#define CERT_VALIDITY 30
+
+// secs before the end of its validity a certificate isn't handed out anymore. a session has to live with it
+#define EXPIRY_MARGIN 86400
+
+// QCA has no EC keys, so Dtls and its backends work with RSA ones
+#define RSA_BITS 2048
+
+namespace XMPP {
+namespace {
+    DtlsIdentityPool::Identity makeIdentity(const QString &localJid, const QCA::PrivateKey &pkey)
+    {
+        DtlsIdentityPool::Identity identity;
+        if (pkey.isNull())
+            return identity;
+
+        QCA::CertificateOptions opts;
+
+        QCA::CertificateInfo info;
+        info.insert(QCA::CommonName, QStringLiteral("iris.psi-im.org"));
+        if (!localJid.isEmpty())
+            info.insert(QCA::XMPP, localJid);
+        opts.setInfo(info);
+
+        QCA::BigInteger sn(QRandomGenerator::global()->generate());
+        opts.setSerialNumber(sn);
+
+        auto nowUTC = QDateTime::currentDateTimeUtc();
+        opts.setValidityPeriod(nowUTC, nowUTC.addDays(CERT_VALIDITY));
+
+        QCA::Constraints constraints = { { QCA::DigitalSignature, QCA::KeyEncipherment, QCA::DataEncipherment,
+                                           QCA::ClientAuth, QCA::ServerAuth } };
+        opts.setConstraints(constraints);
+        opts.setAsCA();
+
+        identity.cert = QCA::Certificate(opts, pkey);
+        if (identity.cert.isNull())
+            return identity;
+        identity.pkey        = pkey;
+        identity.fingerprint = Hash::from(Hash::Sha256, identity.cert.toDER());
+        return identity;
+    }
+} // namespace
+
+class DtlsIdentityPool::Private : public QObject {
+    Q_OBJECT
+
+public:
+    class Entry {
+    public:
+        Identity           current;
+        Identity           next;
+        QElapsedTimer      age;                 // since current is handed out
+        QCA::KeyGenerator *generator = nullptr; // of the next one, or of the first
+    };
+
+    DtlsIdentityPool     *q;
+    int                   rotation = ROTATION_INTERVAL;
+    QHash<QString, Entry> entries; // by local jid
+
+    Private(DtlsIdentityPool *_q) : QObject(_q), q(_q) { }
+
+    void start(const QString &localJid, Entry &entry)
+    {
+        if (entry.generator)
+            return;
+
+        // QCA generates it on a thread of its own
+        auto generator  = new QCA::KeyGenerator(this);
+        entry.generator = generator;
+        generator->setBlockingEnabled(false);
+        connect(generator, &QCA::KeyGenerator::finished, this,
+                [this, localJid, generator]() { generated(localJid, generator); });
+        generator->createRSA(RSA_BITS);
+    }
+
+    void generated(const QString &localJid, QCA::KeyGenerator *generator)
+    {
+        generator->deleteLater();
+        auto it = entries.find(localJid);
+        if (it == entries.end() || it->generator != generator)
+            return;
+        it->generator = nullptr;
+
+        auto identity = makeIdentity(localJid, generator->key().toPrivateKey());
+        if (identity.isNull()) {
+            qWarning("dtls: failed to generate a certificate for %s", qPrintable(localJid));
+            return;
+        }
+        if (it->current.isNull()) {
+            it->current = identity;
+            it->age.start();
+        } else {
+            it->next = identity;
+        }
+    }
+
+    Identity take(const QString &localJid)
+    {
+        auto &entry = entries[localJid];
+        if (!entry.current.isNull()) {
+            bool old      = entry.age.hasExpired(qint64(rotation) * 1000);
+            bool expiring = entry.current.cert.notValidAfter() < QDateTime::currentDateTimeUtc().addSecs(EXPIRY_MARGIN);
+            if ((old || expiring) && !entry.next.isNull()) {
+                entry.current = std::exchange(entry.next, Identity());
+                entry.age.start();
+            } else if (expiring) {
+                entry.current = Identity();
+            }
+        }
+
+        // the next one is generated in the last quarter of the interval, to be there when it ends
+        if (entry.current.isNull() || (entry.next.isNull() && entry.age.hasExpired(qint64(rotation) * 750)))
+            start(localJid, entry);
+        return entry.current;
+    }
+};
+
+DtlsIdentityPool::DtlsIdentityPool(QObject *parent) : QObject(parent) { d = new Private(this); }
+
+DtlsIdentityPool::~DtlsIdentityPool() { delete d; }
+
+void DtlsIdentityPool::setRotationInterval(int secs)
+{
+    d->rotation = qBound(0, secs, CERT_VALIDITY * 86400 - 2 * EXPIRY_MARGIN);
+}
+
+int DtlsIdentityPool::rotationInterval() const { return d->rotation; }
+
+void DtlsIdentityPool::prepare(const QString &localJid) { d->take(localJid); }
+
+DtlsIdentityPool::Identity DtlsIdentityPool::identity(const QString &localJid) { return d->take(localJid); }
+
+DtlsIdentityPool::Identity DtlsIdentityPool::generate(const QString &localJid)
+{
+    return makeIdentity(localJid, QCA::KeyGenerator().createRSA(RSA_BITS));
+}
+
+} // namespace XMPP
+
+#include "dtlsidentitypool.moc"
@@ -0,0 +1,71 @@
+/*
+ * dtlsidentitypool.h - DTLS certificates shared by the sessions of a local jid
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_DTLSIDENTITYPOOL_H
+#define XMPP_DTLSIDENTITYPOOL_H
+
+#include "xmpp_hash.h"
+
+#include <QObject>
+#include <QtCrypto>
+
+namespace XMPP {
+// self-signed DTLS certificates shared by the sessions of a local jid. generating the RSA key of one takes
+//   long, so the pool does it in the background and has the next identity ready by the time the current one
+//   is rotated out. a session takes a ready certificate with its fingerprint computed already
+class DtlsIdentityPool : public QObject {
+    Q_OBJECT
+
+public:
+    class Identity {
+    public:
+        QCA::Certificate cert;
+        QCA::PrivateKey  pkey;
+        Hash             fingerprint; // sha-256, what Dtls announces
+
+        bool isNull() const { return cert.isNull(); }
+    };
+
+    DtlsIdentityPool(QObject *parent = nullptr);
+    ~DtlsIdentityPool();
+
+    // secs an identity is handed out before the next one takes over, a day by default. it's kept well below
+    //   the 30 days the certificates are valid
+    void setRotationInterval(int secs);
+    int  rotationInterval() const;
+
+    // generates the identity of localJid in the background if there is none yet, e.g. when a session is
+    //   created, so it's there when the session wants its fingerprint
+    void prepare(const QString &localJid);
+
+    // the current identity of localJid, or null while the first one is still being generated. the next one
+    //   is started on when the current one gets old
+    Identity identity(const QString &localJid);
+
+    // the blocking way, used by Dtls without a pool. the key is generated on the calling thread
+    static Identity generate(const QString &localJid);
+
+private:
+    class Private;
+    friend class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // XMPP_DTLSIDENTITYPOOL_H
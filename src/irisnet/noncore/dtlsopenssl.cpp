@@ -0,0 +1,302 @@
+/*
+ * dtlsopenssl.cpp - DTLS with OpenSSL directly
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dtlsbackend.h"
+
+#include <QPointer>
+#include <QTimer>
+#include <QtCrypto>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+// what we allow a record to be. ICE over TURN over IPv6 still fits
+#define DTLS_MTU 1200
+// the biggest record plaintext
+#define DTLS_READ_SIZE 16384
+
+namespace XMPP {
+
+/*
+The incoming datagrams go to a memory BIO, the outgoing ones are caught by our own BIO where every write
+is one datagram (OpenSSL writes a complete flight of records at once only if it fits the mtu). Nothing is
+buffered besides the datagrams, so there is no ssl-to-qca pipe and no event loop turn per record.
+The peer certificate is accepted as is during the handshake, Dtls checks its fingerprint afterwards.
+*/
+class OpenSslDtlsBackend : public DtlsBackend {
+    Q_OBJECT
+public:
+    SSL_CTX          *ctx = nullptr;
+    SSL              *ssl = nullptr;
+    QTimer           *timer;
+    QList<QByteArray> in;  // decrypted
+    QList<QByteArray> out; // encrypted
+    int               pendingIn   = 0;
+    int               pendingOut  = 0;
+    bool              handshaked  = false;
+    bool              signalled   = false; // handshaken()
+    bool              established = false;
+    bool              failed      = false;
+
+    OpenSslDtlsBackend(QObject *parent) : DtlsBackend(parent)
+    {
+        timer = new QTimer(this);
+        timer->setSingleShot(true);
+        connect(timer, &QTimer::timeout, this, &OpenSslDtlsBackend::timer_timeout);
+    }
+
+    ~OpenSslDtlsBackend() override
+    {
+        SSL_free(ssl); // frees the BIOs too
+        SSL_CTX_free(ctx);
+    }
+
+    bool start(bool server, const QCA::Certificate &cert, const QCA::PrivateKey &pkey) override
+    {
+        const QByteArray       certDer = cert.toDER();
+        const QCA::SecureArray keyDer  = pkey.toDER();
+        if (certDer.isEmpty() || keyDer.isEmpty())
+            return false;
+
+        auto      certData = reinterpret_cast<const unsigned char *>(certDer.constData());
+        auto      keyData  = reinterpret_cast<const unsigned char *>(keyDer.constData());
+        X509     *x509     = d2i_X509(nullptr, &certData, long(certDer.size()));
+        EVP_PKEY *key      = d2i_AutoPrivateKey(nullptr, &keyData, long(keyDer.size()));
+
+        ctx     = SSL_CTX_new(DTLS_method());
+        bool ok = ctx && x509 && key && SSL_CTX_set_min_proto_version(ctx, DTLS1_2_VERSION)
+            && SSL_CTX_use_certificate(ctx, x509) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1
+            && SSL_CTX_check_private_key(ctx) == 1;
+        X509_free(x509);
+        EVP_PKEY_free(key);
+        if (!ok) {
+            ERR_clear_error();
+            SSL_CTX_free(ctx);
+            ctx = nullptr;
+            return false;
+        }
+
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT,
+                           [](int, X509_STORE_CTX *) { return 1; });
+
+        ssl       = SSL_new(ctx);
+        BIO *rbio = BIO_new(BIO_s_mem());
+        BIO *wbio = BIO_new(outgoingMethod());
+        BIO_set_mem_eof_return(rbio, -1);
+        BIO_set_data(wbio, this);
+        BIO_set_init(wbio, 1);
+        SSL_set_bio(ssl, rbio, wbio);
+
+        SSL_set_options(ssl, SSL_OP_NO_QUERY_MTU);
+        SSL_set_mtu(ssl, DTLS_MTU);
+
+        if (server) {
+            SSL_set_accept_state(ssl);
+        } else {
+            SSL_set_connect_state(ssl);
+            step(); // ClientHello
+        }
+        return true;
+    }
+
+    QCA::Certificate peerCertificate() const override
+    {
+        if (!handshaked)
+            return {};
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        X509 *x509 = SSL_get1_peer_certificate(ssl);
+#else
+        X509 *x509 = SSL_get_peer_certificate(ssl);
+#endif
+        if (!x509)
+            return {};
+        QByteArray der(i2d_X509(x509, nullptr), Qt::Uninitialized);
+        auto       p = reinterpret_cast<unsigned char *>(der.data());
+        i2d_X509(x509, &p);
+        X509_free(x509);
+        return QCA::Certificate::fromDER(der);
+    }
+
+    void continueAfterHandshake() override
+    {
+        established = true;
+        step(); // application data which came with the last flight
+    }
+
+    void write(const QByteArray &data) override
+    {
+        if (!established || failed)
+            return;
+        if (SSL_write(ssl, data.constData(), int(data.size())) <= 0) {
+            fail(QAbstractSocket::UnknownSocketError);
+            return;
+        }
+        notify();
+    }
+
+    QByteArray read() override { return in.isEmpty() ? QByteArray() : in.takeFirst(); }
+
+    void writeIncoming(const QByteArray &datagram) override
+    {
+        if (failed)
+            return;
+        BIO_write(SSL_get_rbio(ssl), datagram.constData(), int(datagram.size()));
+        step();
+    }
+
+    QByteArray readOutgoing() override { return out.isEmpty() ? QByteArray() : out.takeFirst(); }
+
+private:
+    static BIO_METHOD *outgoingMethod()
+    {
+        static BIO_METHOD *method = []() {
+            BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "iris dtls datagram");
+            BIO_meth_set_write(m, [](BIO *b, const char *data, int size) {
+                auto backend = static_cast<OpenSslDtlsBackend *>(BIO_get_data(b));
+                backend->out.append(QByteArray(data, size));
+                ++backend->pendingOut;
+                return size;
+            });
+            BIO_meth_set_ctrl(m, [](BIO *, int cmd, long, void *) -> long {
+                switch (cmd) {
+                case BIO_CTRL_FLUSH:
+                    return 1;
+                case BIO_CTRL_DGRAM_QUERY_MTU:
+                    return DTLS_MTU;
+                default:
+                    return 0;
+                }
+            });
+            return m;
+        }();
+        return method;
+    }
+
+    void step()
+    {
+        if (!handshaked) {
+            int ret = SSL_do_handshake(ssl);
+            if (ret == 1) {
+                handshaked = true;
+            } else if (!checkError(ret, QAbstractSocket::SslHandshakeFailedError)) {
+                return;
+            }
+        }
+        if (established) {
+            QByteArray buf(DTLS_READ_SIZE, Qt::Uninitialized);
+            for (;;) {
+                int ret = SSL_read(ssl, buf.data(), int(buf.size()));
+                if (ret > 0) {
+                    in.append(buf.left(ret));
+                    ++pendingIn;
+                    continue;
+                }
+                if (SSL_get_error(ssl, ret) == SSL_ERROR_ZERO_RETURN) {
+                    SSL_shutdown(ssl);
+                    failed = true;
+                    timer->stop();
+                    QPointer<OpenSslDtlsBackend> self(this);
+                    notify();
+                    if (self)
+                        emit closed();
+                    return;
+                }
+                if (!checkError(ret, QAbstractSocket::UnknownSocketError))
+                    return;
+                break;
+            }
+        }
+        notify(true);
+    }
+
+    // false if it was fatal and failed is set
+    bool checkError(int ret, QAbstractSocket::SocketError e)
+    {
+        int err = SSL_get_error(ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return true;
+        qWarning("dtls: openssl error %d: %s", err, ERR_error_string(ERR_get_error(), nullptr));
+        ERR_clear_error();
+        fail(e);
+        return false;
+    }
+
+    void fail(QAbstractSocket::SocketError e)
+    {
+        failed = true;
+        timer->stop();
+        QPointer<OpenSslDtlsBackend> self(this);
+        notify(); // most likely an alert
+        if (self)
+            emit error(e);
+    }
+
+    // one signal per datagram. handshaken() goes first if the handshake has just finished
+    void notify(bool justStepped = false)
+    {
+        QPointer<OpenSslDtlsBackend> self(this);
+        if (justStepped)
+            armTimer();
+        while (pendingOut) {
+            --pendingOut;
+            emit readyReadOutgoing();
+            if (!self)
+                return;
+        }
+        if (justStepped && handshaked && !signalled) {
+            signalled = true;
+            emit handshaken();
+            return; // continueAfterHandshake() will step again
+        }
+        while (pendingIn) {
+            --pendingIn;
+            emit readyRead();
+            if (!self)
+                return;
+        }
+    }
+
+    void armTimer()
+    {
+        timeval tv;
+        if (DTLSv1_get_timeout(ssl, &tv) == 1)
+            timer->start(int(tv.tv_sec * 1000 + tv.tv_usec / 1000));
+        else
+            timer->stop();
+    }
+
+    void timer_timeout()
+    {
+        if (failed)
+            return;
+        if (DTLSv1_handle_timeout(ssl) < 0) {
+            fail(handshaked ? QAbstractSocket::UnknownSocketError : QAbstractSocket::SocketTimeoutError);
+            return;
+        }
+        armTimer();
+        notify();
+    }
+};
+
+DtlsBackend *DtlsBackend::createOpenSsl(QObject *parent) { return new OpenSslDtlsBackend(parent); }
+
+} // namespace XMPP
+
+#include "dtlsopenssl.moc"
@@ -24,6 +24,11 @@
 #include "icecomponent.h"
 #include "icelocaltransport.h"
 #include "iceturntransport.h"
+#include "icewarmpool.h"
+#include "metrics.h"
+#include "natbehavior.h"
+#include "sharedtimer.h"
+#include "stallwatchdog.h"
 #include "stunbinding.h"
 #include "stunmessage.h"
 #include "stuntransaction.h"
@@ -31,15 +36,23 @@
 #include "udpportreserver.h"
 
 #include <QDeadlineTimer>
+#include <QElapsedTimer>
 #include <QEvent>
+#include <QMutex>
 #include <QNetworkInterface>
 #include <QPointer>
 #include <QQueue>
+#include <QRandomGenerator>
+#include <QRegularExpression>
 #include <QSet>
+#include <QThreadStorage>
 #include <QTimer>
 #include <QUdpSocket>
 #include <QtCrypto>
 
+#include <functional>
+#include <limits>
+
 #define ICE_DEBUG
 #ifdef ICE_DEBUG
 #define iceDebug qDebug
@@ -59,6 +72,142 @@ static qint64 calc_pair_priority(int a, int b)
     return priority;
 }
 
+// Ta of RFC8445 14.2. it's shared by all the agents of the process, so many sessions starting at once don't
+//   multiply the rate of checks
+#define CHECK_PACING 20
+
+// books the next free check slot and returns in how many ms it comes
+static int reserveCheckSlot()
+{
+    static QBasicMutex mutex;
+    static qint64      nextSlot = 0;
+
+    QMutexLocker locker(&mutex);
+    qint64       now  = QDeadlineTimer::current().deadline();
+    qint64       slot = qMax(now, nextSlot);
+    nextSlot          = slot + CHECK_PACING;
+    return int(slot - now);
+}
+
+// RFC8445 11. a selected pair with nothing sent over it for this long gets a binding indication
+#define KEEPALIVE_INTERVAL 15000
+
+// RFC7675 5.1. consent checks on the selected pairs come every 5 seconds randomized by 20%, and the consent
+//   expires when none of them was answered for 30 seconds
+#define CONSENT_INTERVAL 5000
+#define CONSENT_TIMEOUT 30000
+
+// path monitoring, see Ice176::setPathMonitoring(). a backup pair takes over when it costs that many percent less
+//   than the selected one for that many rounds of consent checks in a row, and not sooner than that after a switch
+#define SWITCH_MARGIN 30
+#define SWITCH_ROUNDS 3
+#define SWITCH_HOLDOFF 30000
+
+// the cost of a pair is its rtt in msecs, and that much for every percent of loss
+#define LOSS_COST 10
+
+// the keepalives of the selected pairs of all the agents of a thread, on one shared timer. the pairs sending from
+//   the same base to the same remote address keep the same NAT binding alive, so the agents on such a 5-tuple
+//   share an entry and one keepalive goes out for all of them
+class IceKeepalives {
+public:
+    using Sender = std::function<void()>;
+
+    class Key {
+    public:
+        TransportAddress base;
+        TransportAddress remote;
+        bool             tcp = false;
+
+        bool operator==(const Key &other) const
+        {
+            return base == other.base && remote == other.remote && tcp == other.tcp;
+        }
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+        friend inline uint qHash(const Key &key, uint seed = 0)
+#else
+        friend inline size_t qHash(const Key &key, size_t seed = 0)
+#endif
+        {
+            return qHash(key.base, seed) ^ qHash(key.remote, seed) ^ uint(key.tcp);
+        }
+    };
+
+    class Entry {
+    public:
+        Key                                key;
+        qint64                             lastSent = 0; // QDeadlineTimer::current() ms
+        QList<QPair<const void *, Sender>> senders; // by owner. any of them may send for all
+    };
+
+    ~IceKeepalives() { qDeleteAll(entries); }
+
+    static IceKeepalives *instance()
+    {
+        static QThreadStorage<IceKeepalives *> instances;
+        if (!instances.hasLocalData())
+            instances.setLocalData(new IceKeepalives);
+        return instances.localData();
+    }
+
+    Entry *add(const Key &key, const void *owner, const Sender &send)
+    {
+        auto &entry = entries[key];
+        if (!entry) {
+            entry           = new Entry;
+            entry->key      = key;
+            entry->lastSent = QDeadlineTimer::current().deadline();
+        }
+        entry->senders.append({ owner, send });
+        if (!timer.isActive())
+            timer.start();
+        return entry;
+    }
+
+    void remove(Entry *entry, const void *owner)
+    {
+        auto &senders = entry->senders;
+        senders.erase(std::remove_if(senders.begin(), senders.end(), [&](auto const &s) { return s.first == owner; }),
+                      senders.end());
+        if (senders.isEmpty()) {
+            entries.remove(entry->key);
+            delete entry;
+        }
+        if (entries.isEmpty())
+            timer.stop();
+    }
+
+    // something went out over the 5-tuple, so there is no need for a keepalive for a while
+    static void touch(Entry *entry) { entry->lastSent = QDeadlineTimer::current().deadline(); }
+
+private:
+    SharedTimer         timer;
+    QHash<Key, Entry *> entries;
+
+    IceKeepalives()
+    {
+        // the keepalives go out between 15 and 20 seconds of silence, well before the NATs forget the bindings
+        timer.setInterval(KEEPALIVE_INTERVAL / 3);
+        QObject::connect(&timer, &SharedTimer::timeout, &timer, [this]() { sendDue(); });
+    }
+
+    void sendDue()
+    {
+        qint64        now = QDeadlineTimer::current().deadline();
+        QList<Sender> due;
+        for (auto entry : std::as_const(entries)) {
+            if (now - entry->lastSent < KEEPALIVE_INTERVAL)
+                continue;
+            entry->lastSent = now;
+            due += entry->senders.first().second;
+        }
+        // the senders don't touch the entries, but a failed write may stop an agent
+        for (auto const &send : std::as_const(due))
+            send();
+    }
+};
+
 // scope values: 0 = local, 1 = link-local, 2 = private, 3 = public
 // FIXME: dry (this is in psi avcall also)
 static int getAddressScope(const QHostAddress &a)
@@ -105,21 +254,44 @@ static int comparePriority(const QHostAddress &a, const QHostAddress &b)
     return 0;
 }
 
-static QList<QHostAddress> sortAddrs(const QList<QHostAddress> &in)
+// '*' is any run of characters, the rest is literal
+static bool matchInterface(const QStringList &patterns, const QNetworkInterface &ni)
 {
-    QList<QHostAddress> out;
-
-    for (const QHostAddress &a : in) {
-        int at;
-        for (at = 0; at < out.count(); ++at) {
-            if (comparePriority(a, out[at]) < 0)
-                break;
-        }
-
-        out.insert(at, a);
+    for (auto const &pattern : patterns) {
+        QStringList parts;
+        for (auto const &part : pattern.split(QLatin1Char('*')))
+            parts += QRegularExpression::escape(part);
+        QRegularExpression re(QLatin1Char('^') + parts.join(QLatin1String(".*")) + QLatin1Char('$'),
+                              QRegularExpression::CaseInsensitiveOption);
+        if (re.match(ni.name()).hasMatch() || re.match(ni.humanReadableName()).hasMatch())
+            return true;
     }
+    return false;
+}
+
+static bool isVpnInterface(const QNetworkInterface &ni)
+{
+    static const auto tunnels = QStringList { QStringLiteral("tun*"),  QStringLiteral("tap*"), QStringLiteral("wg*"),
+                                              QStringLiteral("utun*"), QStringLiteral("ppp*"), QStringLiteral("ipsec*"),
+                                              QStringLiteral("*VPN*") };
+#if QT_VERSION >= QT_VERSION_CHECK(5, 11, 0)
+    if (ni.type() == QNetworkInterface::Ppp)
+        return true;
+#endif
+    return matchInterface(tunnels, ni);
+}
 
-    return out;
+// the address the system sends from to the internet, or null. connecting a datagram socket sends nothing
+static QHostAddress defaultRouteSource(QAbstractSocket::NetworkLayerProtocol proto)
+{
+    // documentation addresses. nothing has a more specific route to them than the default one
+    QUdpSocket sock;
+    sock.connectToHost(QHostAddress(proto == QAbstractSocket::IPv4Protocol ? QStringLiteral("192.0.2.1")
+                                                                           : QStringLiteral("2001:db8::1")),
+                       9);
+    if (!sock.waitForConnected(0))
+        return QHostAddress();
+    return sock.localAddress();
 }
 
 class Ice176::Private : public QObject {
@@ -161,7 +333,8 @@ public:
         qint64  priority = 0;
         QString foundation; // rfc8445 6.1.2.6 (combination of foundations)
 
-        StunBinding *binding = nullptr;
+        StunBinding  *binding = nullptr;
+        QElapsedTimer checkTimer; // since the binding was started
 
         // FIXME: this is wrong i think, it should be in LocalTransport
         //   or such, to multiplex ids
@@ -180,27 +353,119 @@ public:
 
     class CheckList {
     public:
-        QList<QSharedPointer<CandidatePair>> pairs;
+        // pairs with the same key are redundant. RFC8445 6.1.2.4
+        struct PairKey {
+            int              componentId;
+            TransportAddress base;
+            TransportAddress remote;
+
+            PairKey(const CandidatePair &pair) :
+                componentId(pair.local->componentId), base(pair.local->base), remote(pair.remote->addr)
+            {
+            }
+            bool operator==(const PairKey &other) const
+            {
+                return componentId == other.componentId && base == other.base && remote == other.remote;
+            }
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+            friend inline uint qHash(const PairKey &key, uint seed = 0)
+#else
+            friend inline size_t qHash(const PairKey &key, size_t seed = 0)
+#endif
+            {
+                return qHash(key.base, seed) ^ qHash(key.remote, seed) ^ uint(key.componentId);
+            }
+        };
+
+        QList<QSharedPointer<CandidatePair>> pairs; // sorted with pairOrder()
+        QHash<PairKey, CandidatePair *>      pairIndex;
         QQueue<QWeakPointer<CandidatePair>>  triggeredPairs;
         QList<QSharedPointer<CandidatePair>> validPairs; // highest priority and nominated come first
         CheckListState                       state;
+
+        static bool pairOrder(const QSharedPointer<CandidatePair> &a, const QSharedPointer<CandidatePair> &b)
+        {
+            return a->priority == b->priority ? a->local->componentId < b->local->componentId
+                                              : a->priority > b->priority;
+        }
+
+        void insert(const QSharedPointer<CandidatePair> &pair)
+        {
+            pairs.insert(std::upper_bound(pairs.begin(), pairs.end(), pair, pairOrder), pair);
+            pairIndex.insert(PairKey(*pair), pair.data());
+        }
+
+        void removeAt(int n)
+        {
+            auto it = pairIndex.find(PairKey(*pairs[n]));
+            if (it != pairIndex.end() && it.value() == pairs[n].data())
+                pairIndex.erase(it);
+            pairs.removeAt(n);
+        }
+
+        // the pairs list is sorted, so look around the position the pair would take
+        int indexOf(const CandidatePair *pair) const
+        {
+            for (auto it = std::lower_bound(pairs.begin(), pairs.end(), pair->priority,
+                                            [](const QSharedPointer<CandidatePair> &p, qint64 priority) {
+                                                return p->priority > priority;
+                                            });
+                 it != pairs.end() && (*it)->priority == pair->priority; ++it) {
+                if (it->data() == pair)
+                    return int(it - pairs.begin());
+            }
+            return -1;
+        }
+
+        QSharedPointer<CandidatePair> find(const PairKey &key) const
+        {
+            auto pair = pairIndex.value(key);
+            int  at   = pair ? indexOf(pair) : -1;
+            return at == -1 ? QSharedPointer<CandidatePair>() : pairs[at];
+        }
+    };
+
+    // a pair checked for consent, and its rtt and loss measured by the answers to the checks
+    class Path {
+    public:
+        CandidatePair::Ptr       pair;
+        StunTransactionPool::Ptr pool;
+        QPointer<StunBinding>    check;           // the last one
+        QElapsedTimer            sent;            // the last check
+        QElapsedTimer            age;             // since the last answered check
+        bool                     pending = false; // the last check isn't answered yet
+        int                      rtt     = -1;    // smoothed, msecs. -1 until answered
+        int                      loss    = 0;     // smoothed, percent
+
+        qint64 cost() const { return rtt == -1 ? std::numeric_limits<qint64>::max() : rtt + qint64(loss) * LOSS_COST; }
     };
 
     class Component {
     public:
-        int                     id              = 0;
-        IceComponent           *ic              = nullptr;
-        std::unique_ptr<QTimer> nominationTimer = std::unique_ptr<QTimer>();
-        CandidatePair::Ptr      selectedPair; // final selected pair. won't be changed
-        CandidatePair::Ptr      highestPair;  // current highest priority pair to send data
-        bool                    localFinished     = false;
-        bool                    hasValidPairs     = false;
-        bool                    hasNominatedPairs = false;
-        bool                    stopped           = false;
-        bool                    lowOverhead       = false;
+        int                          id              = 0;
+        IceComponent                *ic              = nullptr;
+        std::unique_ptr<SharedTimer> nominationTimer = std::unique_ptr<SharedTimer>();
+        CandidatePair::Ptr           selectedPair; // final selected pair. only path monitoring changes it
+        CandidatePair::Ptr           highestPair;  // current highest priority pair to send data
+        bool                         localFinished     = false;
+        bool                         hasValidPairs     = false;
+        bool                         hasNominatedPairs = false;
+        bool                         stopped           = false;
+        bool                         lowOverhead       = false;
 
         // initiator is nominating the final pair (will be set as `selectePair` when ready)
         bool nominating = false; // with aggressive nomination it's always false
+
+        // the selected pair is kept alive and its consent refreshed once the agent is active
+        IceKeepalives::Entry        *keepalive = nullptr;
+        std::unique_ptr<SharedTimer> consentTimer;
+        std::vector<Path>            paths; // the selected pair first, then the backups
+
+        // path monitoring. the controlling agent switches to a backup which stays better for a while
+        CandidatePair::Ptr renominating; // will be the selected one once its check with USE-CANDIDATE is answered
+        int                betterRounds = 0;
+        QElapsedTimer      lastSwitch;
     };
 
     Ice176                                 *q;
@@ -209,6 +474,9 @@ public:
     QTimer                                  checkTimer;
     TurnClient::Proxy                       proxy;
     UdpPortReserver                        *portReserver = nullptr;
+    TcpPortScope                           *tcpPortScope = nullptr;
+    QPointer<IceWarmPool>                   warmPool;
+    QPointer<NatBehaviorCache>              natCache;
     std::unique_ptr<QTimer>                 pacTimer;
     int                                     nominationTimeout = 3000; // 3s
     int                                     pacTimeout = 30000; // 30s todo: compute from rto. see draft-ietf-ice-pac-06
@@ -222,6 +490,7 @@ public:
     TransportAddress                        stunRelayTcpAddr;
     QString                                 stunRelayTcpUser;
     QCA::SecureArray                        stunRelayTcpPass;
+    TurnClient::Mode                        stunRelayTcpMode = TurnClient::PlainMode;
     QPointer<AbstractStunDisco>             stunDiscoverer;
     QString                                 localUser, localPass;
     QString                                 peerUser, peerPass;
@@ -243,24 +512,31 @@ public:
     bool                                    remoteGatheringComplete    = false;
     bool                                    readyToSendMedia           = false;
     bool                                    canStartChecks             = false;
+    bool                                    earlyMedia                 = false;
+    bool                                    consentFreshness           = true;
+    QSet<QHostAddress>                      reachedAddrs; // the local addresses with a valid pair
+    QSet<QHostAddress>                      failedAddrs;  // and with a failed check
+    int                                     backupPairs                = 0;     // monitored along the selected one
+    bool                                    lite                       = false; // RFC8445 2.5 ICE-lite
 
     Private(Ice176 *_q) : QObject(_q), q(_q)
     {
         connect(&checkTimer, &QTimer::timeout, this, [this]() {
             auto pair = selectNextPairToCheck();
-            if (pair)
+            if (pair) {
                 checkPair(pair);
-            else
-                checkTimer.stop();
+                scheduleNextCheck();
+            }
         });
-        checkTimer.setInterval(20);
-        checkTimer.setSingleShot(false);
+        checkTimer.setSingleShot(true);
     }
 
     ~Private()
     {
-        for (const Component &c : components)
+        for (Component &c : components) {
+            stopKeepalives(c);
             delete c.ic;
+        }
     }
 
     void reset() { checkTimer.stop(); /*TODO*/ }
@@ -287,6 +563,11 @@ public:
             if (at == -1)
                 localAddrs += la;
         }
+
+        // the ones which got nowhere in the last sessions go last. the local preference of their candidates is
+        //   the lowest, so their pairs are checked last and pruned first
+        std::stable_partition(localAddrs.begin(), localAddrs.end(),
+                              [](auto const &la) { return !IceAgent::instance()->isUnreachable(la.addr); });
     }
 
     void updateExternalAddresses(const QList<ExternalAddress> &addrs)
@@ -314,21 +595,65 @@ public:
     void stunRemoved(AbstractStunDisco::Service::Ptr) { }
     void stunDiscoFinished() { }
 
+    // leaves out what the network is known not to let through, from an earlier probe. the first agent on a
+    //   network starts the probe for the next ones
+    void applyNatBehavior()
+    {
+        auto nat = natCache->behavior();
+        if (nat.isNull()) {
+            QList<TransportAddress> tcpServers;
+            if (stunRelayTcpAddr.isValid()) {
+                tcpServers += stunRelayTcpAddr;
+                if (stunRelayTcpAddr.port != 443)
+                    tcpServers += TransportAddress(stunRelayTcpAddr.addr, 443);
+            }
+            natCache->probe(stunBindAddr.isValid() ? stunBindAddr : stunRelayUdpAddr, tcpServers);
+            return;
+        }
+
+        iceDebug("nat behavior: %s", qPrintable(nat.toString()));
+        if (nat.isUdpBlocked()) {
+            useStunBind     = false;
+            useStunRelayUdp = false;
+        } else if (nat.isSymmetric() && nat.filtering != NatBehavior::EndpointIndependentFiltering) {
+            // the reflexive address is the mapping towards the STUN server, nobody else gets through to it
+            useStunBind = false;
+        }
+        if (nat.isTcp443Only() && stunRelayTcpAddr.port != 443)
+            useStunRelayTcp = false;
+    }
+
     void start()
     {
         Q_ASSERT(state == Stopped);
 
         state = Starting;
 
-        localUser = IceAgent::randomCredential(4);
-        localPass = IceAgent::randomCredential(22);
+        // on a shared port the ufrag is what tells the agents apart, so make clashes unlikely
+        bool multiplexed = portReserver && portReserver->isMultiplexed();
+        localUser        = IceAgent::randomCredential(multiplexed ? 16 : 4);
+        localPass        = IceAgent::randomCredential(22);
 
         if (!useLocal)
             useStunBind = false;
 
-        QList<QUdpSocket *> socketList;
-        if (portReserver)
-            // list size = componentCount * number of interfaces
+        // a lite agent has a public address, so its host candidates are all it needs. it's always controlled
+        if (lite) {
+            mode            = Responder;
+            useStunBind     = false;
+            useStunRelayUdp = false;
+            useStunRelayTcp = false;
+        }
+
+        if (natCache && !lite)
+            applyNatBehavior();
+
+        // list size = componentCount * number of interfaces
+        QList<QUdpSocket *>     socketList;
+        QList<UdpMuxEndpoint *> endpointList;
+        if (multiplexed)
+            endpointList = portReserver->borrowEndpoints(componentCount, localUser, this);
+        else if (portReserver)
             socketList = portReserver->borrowSockets(componentCount, this);
 
         components.reserve(ulong(componentCount));
@@ -349,6 +674,10 @@ public:
             c.ic->setProxy(proxy);
             if (portReserver)
                 c.ic->setPortReserver(portReserver);
+            if (tcpPortScope && c.id == 1 && !lite) // no rtcp over tcp
+                c.ic->setTcpPortScope(tcpPortScope, localUser);
+            if (warmPool && !lite)
+                c.ic->setWarmPool(warmPool);
             c.ic->setLocalAddresses(localAddrs);
             c.ic->setExternalAddresses(extAddrs);
             if (stunBindAddr.isValid())
@@ -356,7 +685,7 @@ public:
             if (stunRelayUdpAddr.isValid())
                 c.ic->setStunRelayUdpService(stunRelayUdpAddr, stunRelayUdpUser, stunRelayUdpPass);
             if (stunRelayTcpAddr.isValid())
-                c.ic->setStunRelayTcpService(stunRelayTcpAddr, stunRelayTcpUser, stunRelayTcpPass);
+                c.ic->setStunRelayTcpService(stunRelayTcpAddr, stunRelayTcpUser, stunRelayTcpPass, stunRelayTcpMode);
 
             c.ic->setUseLocal(useLocal && allowIpExposure);
             c.ic->setUseStunBind(useStunBind && allowIpExposure);
@@ -366,7 +695,7 @@ public:
             // create an inbound queue for this component
             in += QList<QByteArray>();
 
-            c.ic->update(&socketList);
+            c.ic->update(&socketList, &endpointList);
         }
 
         // socketList should always empty here, but might not be if
@@ -375,6 +704,8 @@ public:
         //   a dumb thing to do but I'm not going to Q_ASSERT it
         if (!socketList.isEmpty())
             portReserver->returnSockets(socketList);
+        if (!endpointList.isEmpty())
+            portReserver->returnEndpoints(endpointList);
     }
 
     void startChecks()
@@ -384,9 +715,11 @@ public:
         pacTimer->setInterval(pacTimeout);
         connect(pacTimer.get(), &QTimer::timeout, this, &Ice176::Private::onPacTimeout);
         iceDebug("Start Patiently Awaiting Connectivity timer");
-        canStartChecks = true;
         pacTimer->start();
-        checkTimer.start();
+        if (lite)
+            return; // the peer does all the checks
+        canStartChecks = true;
+        scheduleNextCheck();
     }
 
     void stop()
@@ -403,6 +736,7 @@ public:
         if (!components.empty()) {
             for (auto &c : components) {
                 c.nominationTimer.reset();
+                stopKeepalives(c);
                 c.ic->stop();
             }
 
@@ -416,6 +750,17 @@ public:
     {
         QList<IceComponent::CandidateInfo::Ptr> remoteCandidates;
         for (const Candidate &c : list) {
+            IceComponent::TcpType tcpType = IceComponent::NoTcp;
+            if (c.protocol.compare(QLatin1String("tcp"), Qt::CaseInsensitive) == 0) {
+                tcpType = string_to_tcpType(c.tcptype);
+                if (tcpType == IceComponent::NoTcp) {
+                    iceDebug("skip remote tcp candidate %s;%d without a valid tcptype", qPrintable(c.ip.toString()),
+                             c.port);
+                    continue;
+                }
+            } else if (!c.protocol.isEmpty() && c.protocol.compare(QLatin1String("udp"), Qt::CaseInsensitive) != 0)
+                continue;
+
             auto ci       = IceComponent::CandidateInfo::Ptr::create();
             ci->addr.addr = c.ip;
             ci->addr.addr.setScopeId(QString());
@@ -431,12 +776,12 @@ public:
             }
             ci->network = c.network;
             ci->id      = c.id;
+            ci->tcpType = tcpType;
 
             // find remote prflx with same addr. we have to update them instead adding new one. RFC8445 7.3.1.3
             auto it = std::find_if(this->remoteCandidates.begin(), this->remoteCandidates.end(),
                                    [&](IceComponent::CandidateInfo::Ptr rc) {
-                                       return ci->addr == rc->addr && ci->componentId == rc->componentId
-                                           && rc->type == IceComponent::PeerReflexiveType;
+                                       return *ci == rc && rc->type == IceComponent::PeerReflexiveType;
                                    });
             if (it != this->remoteCandidates.end()) {
                 (*it)->type = ci->type; // RFC8445 5.1.2.1.  Recommended Formula (peer-reflexive are preferred)
@@ -446,6 +791,7 @@ public:
                 (*it)->base       = ci->base;
                 (*it)->network    = ci->network;
                 (*it)->id         = ci->id;
+                (*it)->tcpType    = ci->tcpType;
                 iceDebug("Previously known remote prflx was updated from signalling: %s", qPrintable((*it)->addr));
             } else {
                 remoteCandidates += ci;
@@ -481,6 +827,14 @@ public:
             return {};
         }
 
+        // RFC 6544 6.2. someone has to connect and someone has to listen. so goes with so, which we don't gather
+        if (lc->tcpType != rc->tcpType
+            && !((lc->tcpType == IceComponent::ActiveTcp && rc->tcpType == IceComponent::PassiveTcp)
+                 || (lc->tcpType == IceComponent::PassiveTcp && rc->tcpType == IceComponent::ActiveTcp))) {
+            iceDebug("Skip building pair: %s - %s (transport mismatch)", qPrintable(lc->addr), qPrintable(rc->addr));
+            return {};
+        }
+
         // don't relay to localhost.  turnserver
         //   doesn't like it.  i don't know if this
         //   should qualify as a HACK or not.
@@ -516,39 +870,24 @@ public:
         if (!pairs.count())
             return;
 
-        // combine pairs with existing, and sort
-        checkList.pairs += pairs;
-        std::sort(checkList.pairs.begin(), checkList.pairs.end(),
-                  [&](const QSharedPointer<CandidatePair> &a, const QSharedPointer<CandidatePair> &b) {
-                      return a->priority == b->priority ? a->local->componentId < b->local->componentId
-                                                        : a->priority > b->priority;
-                  });
-
-        // pruning
-        for (int n = 0; n < checkList.pairs.count(); ++n) {
-            auto &pair = checkList.pairs[n];
-#ifdef ICE_DEBUG
-            if (pair->logNew)
-                iceDebug("C%d, %s", pair->local->componentId, qPrintable(*pair));
-#endif
-
-            for (int i = n - 1; i >= 0; --i) {
-                // RFC8445 says to use base only for reflexive. but base is set properly for host and relayed too.
-                if (pair->local->componentId == checkList.pairs[i]->local->componentId
-                    && pair->local->base == checkList.pairs[i]->local->base
-                    && pair->remote->addr == checkList.pairs[i]->remote->addr) {
-
-                    checkList.pairs.removeAt(n);
-                    --n; // adjust position
-                    break;
-                }
+        // insert each into its sorted position, pruning the redundant ones on the way.
+        for (auto const &pair : pairs) {
+            // RFC8445 says to use base only for reflexive. but base is set properly for host and relayed too.
+            auto existing = checkList.pairIndex.value(CheckList::PairKey(*pair));
+            if (existing) {
+                int at = checkList.indexOf(existing);
+                Q_ASSERT(at != -1);
+                if (!CheckList::pairOrder(pair, checkList.pairs[at]))
+                    continue; // the one we have is at least as good
+                checkList.removeAt(at);
             }
+            checkList.insert(pair);
         }
 
         // max pairs is 100 * number of components
         int max_pairs = 100 * int(components.size());
         while (checkList.pairs.count() > max_pairs)
-            checkList.pairs.removeLast();
+            checkList.removeAt(int(checkList.pairs.count()) - 1);
 #ifdef ICE_DEBUG
         iceDebug("%lld after pruning (just new below):", qsizetype(checkList.pairs.count()));
         for (auto &p : checkList.pairs) {
@@ -559,6 +898,13 @@ public:
 #endif
     }
 
+    // the next check goes out when the process wide pacing allows
+    void scheduleNextCheck()
+    {
+        if (!checkTimer.isActive())
+            checkTimer.start(reserveCheckSlot());
+    }
+
     QSharedPointer<CandidatePair> selectNextPairToCheck()
     {
         // rfc8445 6.1.4.2.  Performing Connectivity Checks
@@ -603,7 +949,7 @@ public:
         pair->foundation = pair->local->foundation + pair->remote->foundation;
         pair->state      = PInProgress;
 
-        int at = findLocalCandidate(pair->local->addr);
+        int at = findLocalCandidate(pair->local);
         Q_ASSERT(at != -1);
 
         auto &lc = localCandidates[at];
@@ -617,7 +963,7 @@ public:
                     auto pair = weakPair.toStrongRef();
                     if (!pair)
                         return;
-                    int at = findLocalCandidate(pair->local->addr);
+                    int at = findLocalCandidate(pair->local);
                     if (at == -1) { // FIXME: assert?
                         qDebug("Failed to find local candidate %s", qPrintable(pair->local->addr));
                         return;
@@ -661,12 +1007,16 @@ public:
         pair->binding->setShortTermUsername(peerUser + ':' + localUser);
         pair->binding->setShortTermPassword(peerPass);
 
+        pair->checkTimer.start();
         pair->binding->start();
     }
 
     void doPairing(const QList<IceComponent::Candidate>          &localCandidates,
                    const QList<IceComponent::CandidateInfo::Ptr> &remoteCandidates)
     {
+        if (lite)
+            return; // no checklist, the pairs come with the checks of the peer. RFC8445 6.1.2.1
+
         QList<QSharedPointer<CandidatePair>> pairs;
         for (const IceComponent::Candidate &cc : localCandidates) {
             auto lc = cc.info;
@@ -675,6 +1025,10 @@ public:
                 // see RFC8445 7.2.5.3.1.  Discovering Peer-Reflexive Candidates
                 continue;
             }
+            if (lc->tcpType == IceComponent::PassiveTcp) {
+                // nothing to send from, the pairs come with the checks of the peer. RFC 6544 6.2
+                continue;
+            }
 
             for (const IceComponent::CandidateInfo::Ptr &rc : std::as_const(remoteCandidates)) {
                 auto pair = makeCandidatesPair(lc, rc);
@@ -687,8 +1041,8 @@ public:
             return;
 
         addChecklistPairs(pairs);
-        if (canStartChecks && !checkTimer.isActive())
-            checkTimer.start();
+        if (canStartChecks)
+            scheduleNextCheck();
     }
 
     void write(int componentIndex, const QByteArray &datagram)
@@ -705,7 +1059,7 @@ public:
             }
         }
 
-        int at = findLocalCandidate(pair->local->addr);
+        int at = findLocalCandidate(pair->local);
         if (at == -1) { // FIXME: assert?
             iceDebug("FIXME! Failed to find local candidate for componentId=%d, addr=%s", componentIndex + 1,
                      qPrintable(pair->local->addr));
@@ -717,6 +1071,8 @@ public:
         int path = lc.path;
 
         lc.iceTransport->writeDatagram(path, datagram, pair->remote->addr);
+        if (cIt->keepalive)
+            IceKeepalives::touch(cIt->keepalive);
 
         // DOR-SR?
         QMetaObject::invokeMethod(q, "datagramsWritten", Qt::QueuedConnection, Q_ARG(int, componentIndex),
@@ -739,14 +1095,23 @@ public:
         Q_ASSERT(selected);
         decltype(checkList.validPairs) newValid;
         newValid.push_back(selected);
-        for (auto &p : checkList.validPairs)
+        auto t = findTransport(selected->local->base);
+        Q_ASSERT(t.data() != nullptr);
+
+        // the best few of the others stay when the paths are monitored. the list is sorted
+        QList<QSharedPointer<IceTransport>> keep { t };
+        int                                 backups = consentFreshness ? backupPairs : 0;
+        for (auto &p : checkList.validPairs) {
             if (p->local->componentId != componentId)
                 newValid.push_back(p);
+            else if (p != selected && backups > 0) {
+                newValid.push_back(p);
+                keep += findTransport(p->local->base);
+                --backups;
+            }
+        }
         checkList.validPairs = newValid;
 
-        auto t = findTransport(selected->local->base);
-        Q_ASSERT(t.data() != nullptr);
-
         // cancel planned/active transactions
         QMutableListIterator<QWeakPointer<CandidatePair>> it(checkList.triggeredPairs);
         while (it.hasNext()) {
@@ -763,7 +1128,7 @@ public:
         }
         // stop not used transports
         for (auto &c : localCandidates) {
-            if (c.info->componentId == componentId && c.iceTransport != t) {
+            if (c.info->componentId == componentId && !keep.contains(c.iceTransport)) {
                 c.iceTransport->stop();
             }
         }
@@ -856,8 +1221,7 @@ public:
         c.highestPair->finalNomination = true;
         iceDebug("Nominating valid pair: %s", qPrintable(*c.highestPair));
         checkList.triggeredPairs.prepend(c.highestPair);
-        if (!checkTimer.isActive())
-            checkTimer.start();
+        scheduleNextCheck();
     }
 
     void tryNominateSelectedPair(int componentId)
@@ -880,9 +1244,330 @@ public:
 #endif
         pacTimer.reset();
         state = Active;
+        reportReachability();
+        // a lite agent is checked by the peer, whose consent checks keep the bindings as well
+        if (!lite)
+            startKeepalives();
         emit q->iceFinished();
     }
 
+    // only a connected session tells something about its addresses, the peer was reachable after all
+    void reportReachability()
+    {
+        for (auto const &addr : std::as_const(failedAddrs)) {
+            if (findLocalAddress(addr) != -1 && !reachedAddrs.contains(addr))
+                IceAgent::instance()->reportReachability(addr, false);
+        }
+        for (auto const &addr : std::as_const(reachedAddrs)) {
+            if (findLocalAddress(addr) != -1)
+                IceAgent::instance()->reportReachability(addr, true);
+        }
+    }
+
+    // RFC8445 11 and RFC7675. the checks are over, and the selected pairs have to stay open and wanted
+    void startKeepalives()
+    {
+        for (auto &c : components) {
+            if (c.keepalive)
+                continue; // running already
+            addKeepalive(c);
+
+            if (!consentFreshness)
+                continue;
+            // and the backups left by cleanupButSelectedPair()
+            c.paths.clear();
+            c.paths.emplace_back();
+            c.paths.back().pair = c.selectedPair;
+            for (auto const &p : std::as_const(checkList.validPairs)) {
+                if (p->local->componentId == c.id && p != c.selectedPair) {
+                    c.paths.emplace_back();
+                    c.paths.back().pair = p;
+                }
+            }
+            for (auto &path : c.paths)
+                path.age.start();
+            c.consentTimer = std::make_unique<SharedTimer>();
+            c.consentTimer->setSingleShot(true);
+            connect(c.consentTimer.get(), &SharedTimer::timeout, this, [this, id = c.id]() { checkConsent(id); });
+            scheduleConsentCheck(c);
+        }
+    }
+
+    void addKeepalive(Component &c)
+    {
+        IceKeepalives::Key key;
+        key.base   = c.selectedPair->local->base;
+        key.remote = c.selectedPair->remote->addr;
+        key.tcp    = c.selectedPair->local->tcpType != IceComponent::NoTcp;
+
+        c.keepalive = IceKeepalives::instance()->add(key, this, [self = QPointer<Private>(this), id = c.id]() {
+            if (self)
+                self->sendKeepalive(id);
+        });
+    }
+
+    void stopKeepalives(Component &c)
+    {
+        if (c.keepalive) {
+            IceKeepalives::instance()->remove(c.keepalive, this);
+            c.keepalive = nullptr;
+        }
+        if (c.consentTimer)
+            c.consentTimer.release()->deleteLater(); // may be in its timeout
+        c.paths.clear();
+        c.renominating.reset();
+    }
+
+    // jittered, so the checks of the sessions started together drift apart
+    void scheduleConsentCheck(Component &c)
+    {
+        c.consentTimer->start(CONSENT_INTERVAL * (80 + int(QRandomGenerator::global()->bounded(41))) / 100);
+    }
+
+    // anything sent over the selected pair keeps its 5-tuple alive
+    void sendOnPair(Component &c, const CandidatePair::Ptr &pair, const QByteArray &packet)
+    {
+        int at = findLocalCandidate(pair->local);
+        if (at == -1)
+            return; // going away
+        auto &lc = localCandidates[at];
+        lc.iceTransport->writeDatagram(lc.path, packet, pair->remote->addr);
+        if (c.keepalive && pair == c.selectedPair)
+            IceKeepalives::touch(c.keepalive);
+    }
+
+    void sendKeepalive(int componentId)
+    {
+        auto c = findComponent(componentId);
+        if (c == components.end() || !c->selectedPair)
+            return;
+
+        // a binding indication with just the fingerprint. nobody answers it
+        quint32 id[3];
+        QRandomGenerator::global()->fillRange(id);
+        quint8            packet[20 + 8];
+        StunMessageWriter indication(packet, sizeof(packet));
+        indication.begin(StunMessage::Indication, StunTypes::Binding, reinterpret_cast<const quint8 *>(id));
+        int size = indication.finish(StunMessage::Fingerprint);
+        if (size != -1)
+            sendOnPair(*c, c->selectedPair, QByteArray(reinterpret_cast<const char *>(packet), size));
+    }
+
+    Path *findPath(Component &c, const CandidatePair *pair)
+    {
+        auto it = std::find_if(c.paths.begin(), c.paths.end(), [&](auto const &p) { return p.pair.data() == pair; });
+        return it == c.paths.end() ? nullptr : &*it;
+    }
+
+    void checkConsent(int componentId)
+    {
+        auto &c = *findComponent(componentId);
+
+        // a check not answered till the next one is lost. so is a renomination then, unless it's the selected
+        //   pair already
+        for (auto &path : c.paths) {
+            if (!path.pending)
+                continue;
+            path.loss = (path.loss * 3 + 100) / 4;
+            if (path.pair == c.renominating && path.pair != c.selectedPair)
+                c.renominating.reset();
+        }
+
+        if (c.paths.front().age.hasExpired(CONSENT_TIMEOUT)) {
+            Path *backup = nullptr;
+            if (mode == Initiator) {
+                for (auto &path : c.paths) {
+                    if (!path.age.hasExpired(2 * CONSENT_INTERVAL) && (!backup || path.cost() < backup->cost()))
+                        backup = &path;
+                }
+            }
+            if (!backup) {
+                qInfo("C%d: the peer didn't answer consent checks for %d seconds. set ICE status to failed", c.id,
+                      CONSENT_TIMEOUT / 1000);
+                stop();
+                emit q->error(ErrorDisconnected);
+                return;
+            }
+            // the peer learns it from the next check
+            qInfo("C%d: no consent on the selected pair, the data goes over %s", c.id, qPrintable(*backup->pair));
+            c.renominating = backup->pair;
+            switchSelectedPair(c, backup->pair);
+        } else if (mode == Initiator && !c.renominating && c.paths.size() > 1) {
+            considerSwitch(c);
+        }
+
+        for (auto &path : c.paths)
+            startConsentCheck(c, path);
+
+        scheduleConsentCheck(c);
+    }
+
+    // hysteresis. a backup has to be clearly better for a few rounds, and the paths settle after a switch
+    void considerSwitch(Component &c)
+    {
+        Path *best = nullptr;
+        for (size_t n = 1; n < c.paths.size(); ++n) {
+            auto &path = c.paths[n];
+            if (!path.pending && path.rtt != -1 && (!best || path.cost() < best->cost()))
+                best = &path;
+        }
+        auto const &selected = c.paths.front();
+        bool        better   = best
+            && (selected.cost() == std::numeric_limits<qint64>::max()
+                || best->cost() * 100 < selected.cost() * (100 - SWITCH_MARGIN));
+        if (!better || (c.lastSwitch.isValid() && !c.lastSwitch.hasExpired(SWITCH_HOLDOFF))) {
+            c.betterRounds = 0;
+            return;
+        }
+        if (++c.betterRounds < SWITCH_ROUNDS)
+            return;
+
+        iceDebug("C%d: %s (rtt %d, loss %d%%) is better than %s (rtt %d, loss %d%%). renominating", c.id,
+                 qPrintable(*best->pair), best->rtt, best->loss, qPrintable(*selected.pair), selected.rtt,
+                 selected.loss);
+        c.renominating = best->pair;
+    }
+
+    void startConsentCheck(Component &c, Path &path)
+    {
+        if (!path.pool) {
+            path.pool = StunTransactionPool::Ptr::create(StunTransaction::Udp);
+            connect(path.pool.data(), &StunTransactionPool::outgoingMessage, this,
+                    [this, componentId = c.id, pair = path.pair.data()](const QByteArray &packet,
+                                                                        const TransportAddress &) {
+                        auto c = findComponent(componentId);
+                        if (c == components.end())
+                            return;
+                        if (auto path = findPath(*c, pair))
+                            sendOnPair(*c, path->pair, packet);
+                    });
+        }
+
+        // one check in flight. an unanswered one isn't the loss of consent yet, only its expiry is
+        delete path.check;
+        auto binding = new StunBinding(path.pool.data());
+        path.check   = binding;
+        path.pending = true;
+        path.sent.start();
+        bool useCandidate = path.pair == c.renominating;
+        connect(binding, &StunBinding::success, this,
+                [this, componentId = c.id, pair = path.pair.data(), useCandidate]() {
+                    auto c = findComponent(componentId);
+                    if (c == components.end())
+                        return;
+                    auto path = findPath(*c, pair);
+                    if (!path)
+                        return;
+                    int sample    = int(path->sent.elapsed());
+                    path->rtt     = path->rtt == -1 ? sample : (path->rtt * 7 + sample) / 8;
+                    path->loss    = path->loss * 3 / 4;
+                    path->pending = false;
+                    path->age.start();
+                    if (useCandidate && c->renominating == path->pair) {
+                        c->renominating.reset();
+                        switchSelectedPair(*c, path->pair);
+                    }
+                });
+
+        int at = findLocalCandidate(path.pair->local);
+        if (at != -1) {
+            auto &lc = localCandidates[at];
+            binding->setPriority(c.ic->peerReflexivePriority(lc.iceTransport, lc.path));
+        }
+        if (mode == Ice176::Initiator) {
+            binding->setIceControlling(0);
+            binding->setUseCandidate(useCandidate);
+        } else
+            binding->setIceControlled(0);
+        binding->setShortTermUsername(peerUser + ':' + localUser);
+        binding->setShortTermPassword(peerPass);
+        binding->start();
+    }
+
+    // the data goes over another monitored pair from now on. the old one stays a backup
+    void switchSelectedPair(Component &c, CandidatePair::Ptr pair)
+    {
+        auto it = std::find_if(c.paths.begin(), c.paths.end(), [&](auto const &p) { return p.pair == pair; });
+        if (it == c.paths.end() || it == c.paths.begin())
+            return;
+        std::iter_swap(c.paths.begin(), it);
+
+        qInfo("C%d: switching from %s to %s", c.id, qPrintable(*c.selectedPair), qPrintable(*pair));
+        c.selectedPair = pair;
+        c.highestPair  = pair;
+        c.betterRounds = 0;
+        c.lastSwitch.start();
+        if (c.keepalive) {
+            IceKeepalives::instance()->remove(c.keepalive, this);
+            addKeepalive(c);
+        }
+        emit q->selectedPairChanged(c.id - 1);
+    }
+
+    // RFC8445 forbids the controlling agent to nominate again, so it's an agent with path monitoring. it's
+    //   followed when the pair is one of the monitored ones here as well
+    void followRenomination(const IceComponent::Candidate &locCand, const TransportAddress &fromAddr)
+    {
+        auto c = findComponent(locCand.info->componentId);
+        if (c == components.end() || c->paths.size() < 2)
+            return;
+        auto it = std::find_if(c->paths.begin() + 1, c->paths.end(), [&](auto const &p) {
+            return *(p.pair->local) == locCand.info && p.pair->remote->addr == fromAddr;
+        });
+        if (it != c->paths.end())
+            switchSelectedPair(*c, it->pair);
+    }
+
+    // RFC8445 8.2.2. the check the lite agent just answered is as good as its own would be. the nominated pair with
+    //   the highest priority takes over
+    void liteNominated(const IceComponent::Candidate &locCand, const TransportAddress &fromAddr,
+                       const StunMessageView &msg)
+    {
+        auto c = findComponent(locCand.info->componentId);
+        if (c == components.end())
+            return;
+
+        IceComponent::CandidateInfo::Ptr remCand;
+        for (auto const &rc : std::as_const(remoteCandidates)) {
+            if (rc->componentId == c->id && rc->addr == fromAddr) {
+                remCand = rc;
+                break;
+            }
+        }
+        if (!remCand) {
+            quint32 priority = 0;
+            StunTypes::parsePriority(msg.attribute(StunTypes::PRIORITY), &priority);
+            remCand = IceComponent::CandidateInfo::makeRemotePrflx(c->id, fromAddr, priority);
+            remoteCandidates += remCand;
+        }
+
+        if (c->selectedPair && *(c->selectedPair->local) == locCand.info && c->selectedPair->remote == remCand)
+            return;
+        auto pair = makeCandidatesPair(locCand.info, remCand);
+        if (!pair || (c->selectedPair && c->selectedPair->priority >= pair->priority))
+            return;
+
+        pair->state          = PSucceeded;
+        pair->isValid        = true;
+        pair->isNominated    = true;
+        bool first           = !c->selectedPair;
+        c->selectedPair      = pair;
+        c->highestPair       = pair;
+        c->hasValidPairs     = true;
+        c->hasNominatedPairs = true;
+        iceDebug("C%d: lite, selected pair: %s", c->id, qPrintable(*pair));
+        if (!first) {
+            emit q->selectedPairChanged(c->id - 1);
+            return;
+        }
+
+        auto &cc = localCandidates[findLocalCandidate(pair->local)];
+        c->ic->flagPathAsLowOverhead(cc.id, pair->remote->addr);
+        tryReadyToSendMedia();
+        emit q->componentReady(c->id - 1);
+        tryIceFinished();
+    }
+
     void setupNominationTimer(int componentId)
     {
         Component &c = *findComponent(componentId);
@@ -892,11 +1577,11 @@ public:
         if (!agrNom && mode == Responder)
             return; // responder will wait for nominated pairs till very end
 
-        auto timer = new QTimer();
+        auto timer = new SharedTimer();
         c.nominationTimer.reset(timer);
         timer->setSingleShot(true);
         timer->setInterval(nominationTimeout);
-        connect(timer, &QTimer::timeout, this, [this, componentId, agrNom]() {
+        connect(timer, &SharedTimer::timeout, this, [this, componentId, agrNom]() {
             Q_ASSERT(state == Started);
             Component &c = *findComponent(componentId);
             c.nominationTimer.release()->deleteLater();
@@ -969,8 +1654,8 @@ public:
         pair->isTriggeredForNominated = nominated;
         checkList.triggeredPairs.enqueue(pair);
 
-        if (canStartChecks && !checkTimer.isActive())
-            checkTimer.start();
+        if (canStartChecks)
+            scheduleNextCheck();
     }
 
     void onPacTimeout()
@@ -1006,6 +1691,17 @@ private:
         return -1;
     }
 
+    // udp and tcp candidates may share an address, but not the info
+    int findLocalCandidate(const IceComponent::CandidateInfo::Ptr &info) const
+    {
+        for (int n = 0; n < localCandidates.count(); ++n) {
+            if (localCandidates[n].info == info)
+                return n;
+        }
+
+        return -1;
+    }
+
     int findLocalCandidate(const TransportAddress &fromAddr)
     {
         for (int n = 0; n < localCandidates.count(); ++n) {
@@ -1060,6 +1756,32 @@ private:
             return -1;
     }
 
+    static QString tcpType_to_string(IceComponent::TcpType type)
+    {
+        switch (type) {
+        case IceComponent::ActiveTcp:
+            return QLatin1String("active");
+        case IceComponent::PassiveTcp:
+            return QLatin1String("passive");
+        case IceComponent::SoTcp:
+            return QLatin1String("so");
+        default:
+            return QString();
+        }
+    }
+
+    static IceComponent::TcpType string_to_tcpType(const QString &in)
+    {
+        if (in == "active")
+            return IceComponent::ActiveTcp;
+        else if (in == "passive")
+            return IceComponent::PassiveTcp;
+        else if (in == "so")
+            return IceComponent::SoTcp;
+        else
+            return IceComponent::NoTcp;
+    }
+
     static void toOutCandidate(const IceComponent::Candidate &cc, Ice176::Candidate &out)
     {
         out.component  = cc.info->componentId;
@@ -1071,7 +1793,8 @@ private:
         out.network  = cc.info->network;
         out.port     = cc.info->addr.port;
         out.priority = cc.info->priority;
-        out.protocol = "udp";
+        out.protocol = cc.info->tcpType == IceComponent::NoTcp ? "udp" : "tcp";
+        out.tcptype  = tcpType_to_string(cc.info->tcpType);
         if (cc.info->type != IceComponent::HostType) {
             out.rel_addr = cc.info->related.addr;
             out.rel_addr.setScopeId(QString());
@@ -1118,7 +1841,8 @@ private:
         if (readyToSendMedia) {
             return;
         }
-        bool allowNotNominatedData = (localFeatures & NotNominatedData) && (remoteFeatures & NotNominatedData);
+        bool allowNotNominatedData
+            = earlyMedia || ((localFeatures & NotNominatedData) && (remoteFeatures & NotNominatedData));
         // if both follow RFC8445 and allow to send data on any valid pair
         if (!std::all_of(components.begin(), components.end(),
                          [&](auto &c) { return (allowNotNominatedData && c.hasValidPairs) || c.hasNominatedPairs; })) {
@@ -1171,6 +1895,7 @@ private:
         pair->state              = PSucceeded; // what if it was in progress?
 
         component.hasValidPairs = true;
+        reachedAddrs += pair->local->base.addr;
 
         // mark all with same foundation as Waiting to prioritize them (see RFC8445 7.2.5.3.3)
         for (auto &p : checkList.pairs)
@@ -1184,7 +1909,7 @@ private:
 
         // if (c.lowOverhead) { // commented out since we need turn permissions for all components
         iceDebug("component is flagged for low overhead.  setting up for %s", qPrintable(*pair));
-        auto &cc = localCandidates[findLocalCandidate(pair->local->addr)];
+        auto &cc = localCandidates[findLocalCandidate(pair->local)];
         component.ic->flagPathAsLowOverhead(cc.id, pair->remote->addr);
         //}
 
@@ -1211,6 +1936,7 @@ private:
         */
 
         StunBinding *binding = pair->binding;
+        IRIS_METRIC_RECORD(IceCheckRttMsecs, pair->checkTimer.elapsed());
         // pair->isValid = true;
         pair->state                   = CandidatePairState::PSucceeded;
         bool  isTriggeredForNominated = pair->isTriggeredForNominated;
@@ -1222,8 +1948,9 @@ private:
 
         // RFC8445 7.2.5.3.1.  Discovering Peer-Reflexive Candidates
         auto mappedAddr = binding->reflexiveAddress();
-        // skip "If the valid pair equals the pair that generated the check"
-        if (pair->local->addr != binding->reflexiveAddress()) {
+        // skip "If the valid pair equals the pair that generated the check". over tcp the mapped port of the
+        //   connection is never a candidate, and the pair is the connection anyway. RFC 6544 7.2.2
+        if (pair->local->tcpType == IceComponent::NoTcp && pair->local->addr != binding->reflexiveAddress()) {
             // so mapped address doesn't match with local candidate sending binding request.
             // gotta find/create one
             auto locIt = std::find_if(localCandidates.begin(), localCandidates.end(), [&](const auto &c) {
@@ -1244,15 +1971,15 @@ private:
             } else {
                 // local candidate found. If it's a part of a pair on checklist, we have to add this pair to valid list,
                 // otherwise we have to create a new pair and add it to valid list
-                auto it = std::find_if(checkList.pairs.begin(), checkList.pairs.end(), [&](auto const &p) {
-                    return p->local->base == locIt->info->base && p->remote->addr == pair->remote->addr
-                        && p->local->componentId == locIt->info->componentId;
-                });
-                if (it == checkList.pairs.end()) {
+                CheckList::PairKey key(*pair);
+                key.componentId = locIt->info->componentId;
+                key.base        = locIt->info->base;
+                auto known      = checkList.find(key);
+                if (!known) {
                     // allow v4/v6 proto mismatch in case NAT does magic
                     pair = makeCandidatesPair(locIt->info, pair->remote);
                 } else {
-                    pair = *it;
+                    pair = known;
                     iceDebug("mapped address belongs to another pair on checklist %s", qPrintable(QString(*pair)));
                 }
             }
@@ -1276,19 +2003,30 @@ private:
             return; // we don't care about late errors
 
         if (state == Active) {
-            iceDebug("todo! binding error ignored in Active state");
-            return; // TODO hadle keep-alive binding properly
+            // a check still in flight when the pairs were selected. the selected ones have the consent checks
+            iceDebug("binding error ignored in Active state for %s", qPrintable(*pair));
+            return;
         }
 
         iceDebug("check failed for %s", qPrintable(*pair));
         auto &c     = *findComponent(pair->local->componentId);
         pair->state = CandidatePairState::PFailed;
+        failedAddrs += pair->local->base.addr;
         if (pair->isValid) { // RFC8445 7.2.5.3.4.  Updating the Nominated Flag /  about failure
             checkList.validPairs.removeOne(pair);
             pair->isValid = false;
             if (c.highestPair == pair) {
-                // the failed binding is nomination or triggered after receiving success on canceled binding
+                // the failed binding is nomination or triggered after receiving success on canceled binding.
+                //   keep the data flowing over the next best valid pair (the list is sorted)
                 c.highestPair.reset();
+                for (auto const &p : std::as_const(checkList.validPairs)) {
+                    if (p->local->componentId == c.id) {
+                        c.highestPair = p;
+                        iceDebug("C%d: data falls back to %s", c.id, qPrintable(*p));
+                        break;
+                    }
+                }
+                c.hasValidPairs = bool(c.highestPair);
             }
         }
 
@@ -1392,7 +2130,7 @@ private slots:
                 }
                 checkList.pairs[n]->pool.reset();
 
-                checkList.pairs.removeAt(n);
+                checkList.removeAt(n);
                 --n; // adjust position
             }
         }
@@ -1446,6 +2184,7 @@ private slots:
 
         it->stopped = true;
         it->nominationTimer.reset();
+        stopKeepalives(*it);
 
         bool allStopped = true;
         for (const Component &c : components) {
@@ -1476,6 +2215,7 @@ private slots:
     // path is either direct or relayed
     void it_readyRead(int path)
     {
+        IRIS_STALL_WATCH(Ice, QString::fromLatin1(path == Direct ? "direct" : "relayed"));
         IceTransport *it = static_cast<IceTransport *>(sender());
         int           at = findLocalCandidate(it, path, true); // just host or relay
         Q_ASSERT(at != -1);
@@ -1484,19 +2224,24 @@ private slots:
 
         IceTransport *sock = it;
 
+        QString    requser = localUser + ':' + peerUser;
+        QByteArray reqkey  = localPass.toUtf8();
+
         while (sock->hasPendingDatagrams(path)) {
             TransportAddress fromAddr;
             QByteArray       buf = sock->readDatagram(path, fromAddr);
 
             // iceDebug("port %d: received packet (%d bytes)", lt->sock->localPort(), buf.size());
 
-            QString    requser = localUser + ':' + peerUser;
-            QByteArray reqkey  = localPass.toUtf8();
-
-            StunMessage::ConvertResult result;
-            StunMessage                msg = StunMessage::fromBinary(buf, &result,
-                                                                     StunMessage::MessageIntegrity | StunMessage::Fingerprint, reqkey);
-            if (!msg.isNull() && (msg.mclass() == StunMessage::Request || msg.mclass() == StunMessage::Indication)) {
+            // most of the packets are application data or checks, so parse in place and copy nothing. and the
+            //   data isn't even tried as STUN, its first byte says it's something else (RFC 7983)
+            StunMessageView msg;
+            bool            isStun    = IceTransport::packetKind(buf) == IceTransport::StunPacket && msg.parse(buf);
+            bool            isRequest = isStun
+                && (msg.mclass() == StunMessage::Request || msg.mclass() == StunMessage::Indication);
+            if (isRequest
+                && msg.validate(StunMessage::MessageIntegrity | StunMessage::Fingerprint, reqkey)
+                    == StunMessage::ConvertGood) {
                 iceDebug("received validated request or indication from %s", qPrintable(fromAddr));
                 QString user = QString::fromUtf8(msg.attribute(StunTypes::USERNAME));
                 if (requser != user) {
@@ -1510,28 +2255,33 @@ private slots:
                     continue;
                 }
 
-                StunMessage response;
-                response.setClass(StunMessage::SuccessResponse);
-                response.setMethod(StunTypes::Binding);
-                response.setId(msg.id());
-
-                QList<StunMessage::Attribute> list;
-                StunMessage::Attribute        attr;
-                attr.type  = StunTypes::XOR_MAPPED_ADDRESS;
-                attr.value = StunTypes::createXorPeerAddress(fromAddr, response.magic(), response.id());
-                list += attr;
-
-                response.setAttributes(list);
+                // header, xor-mapped-address of ipv6, message-integrity and fingerprint
+                quint8            packet[20 + 24 + 24 + 8];
+                StunMessageWriter response(packet, sizeof(packet));
+                response.begin(StunMessage::SuccessResponse, StunTypes::Binding, msg.id());
+                response.appendAttribute(StunTypes::XOR_MAPPED_ADDRESS,
+                                         StunTypes::createXorPeerAddress(fromAddr, response.magic(), msg.id()));
+                int size = response.finish(StunMessage::MessageIntegrity | StunMessage::Fingerprint, reqkey);
+                if (size != -1)
+                    sock->writeDatagram(path, QByteArray((const char *)packet, size), fromAddr);
+
+                if (lite) {
+                    if ((state == Started || state == Active) && msg.hasAttribute(StunTypes::USE_CANDIDATE))
+                        liteNominated(locCand, fromAddr, msg);
+                    continue;
+                }
 
-                QByteArray packet = response.toBinary(StunMessage::MessageIntegrity | StunMessage::Fingerprint, reqkey);
-                sock->writeDatagram(path, packet, fromAddr);
+                if (state == Active && mode == Responder && msg.hasAttribute(StunTypes::USE_CANDIDATE))
+                    followRenomination(locCand, fromAddr);
 
                 if (state != Started) // only in started state we do triggered checks
                     return;
 
                 auto it = std::find_if(
                     remoteCandidates.begin(), remoteCandidates.end(), [&](IceComponent::CandidateInfo::Ptr remCand) {
-                        return remCand->componentId == locCand.info->componentId && remCand->addr == fromAddr;
+                        return remCand->componentId == locCand.info->componentId && remCand->addr == fromAddr
+                            && (remCand->tcpType == IceComponent::NoTcp)
+                            == (locCand.info->tcpType == IceComponent::NoTcp);
                     });
                 bool nominated = false;
                 if (mode == Responder)
@@ -1543,51 +2293,49 @@ private slots:
                     StunTypes::parsePriority(msg.attribute(StunTypes::PRIORITY), &priority);
                     auto remCand
                         = IceComponent::CandidateInfo::makeRemotePrflx(locCand.info->componentId, fromAddr, priority);
+                    // whoever connected to our listener is active
+                    if (locCand.info->tcpType == IceComponent::PassiveTcp)
+                        remCand->tcpType = IceComponent::ActiveTcp;
+                    else if (locCand.info->tcpType == IceComponent::ActiveTcp)
+                        remCand->tcpType = IceComponent::PassiveTcp;
                     remoteCandidates += remCand;
                     doTriggeredCheck(locCand, remCand, nominated);
                 } else {
                     doTriggeredCheck(locCand, *it, nominated);
                 }
             } else {
-                QByteArray  reskey = peerPass.toUtf8();
-                StunMessage msg    = StunMessage::fromBinary(
-                    buf, &result, StunMessage::MessageIntegrity | StunMessage::Fingerprint, reskey);
-                if (!msg.isNull()
-                    && (msg.mclass() == StunMessage::SuccessResponse || msg.mclass() == StunMessage::ErrorResponse)) {
+                QByteArray reskey = peerPass.toUtf8();
+                if (isStun && !isRequest
+                    && msg.validate(StunMessage::MessageIntegrity | StunMessage::Fingerprint, reskey)
+                        == StunMessage::ConvertGood) {
                     iceDebug("received validated response from %s to %s", qPrintable(fromAddr),
                              qPrintable(locCand.info->addr));
 
                     // FIXME: this is so gross and completely defeats the point of having pools
+                    StunMessage response = msg.toMessage();
                     for (int n = 0; n < checkList.pairs.count(); ++n) {
                         CandidatePair &pair = *checkList.pairs[n];
                         if (pair.state == PInProgress && pair.local->addr.addr == locCand.info->addr.addr
                             && pair.local->addr.port == locCand.info->addr.port)
-                            pair.pool->writeIncomingMessage(msg);
+                            pair.pool->writeIncomingMessage(response);
+                    }
+                    for (auto &c : components) {
+                        for (auto const &path : c.paths) {
+                            if (path.pool && path.pair->local->addr == locCand.info->addr)
+                                path.pool->writeIncomingMessage(response);
+                        }
                     }
                 } else {
                     // iceDebug("received some non-stun or invalid stun packet");
 
                     // FIXME: i don't know if this is good enough
-                    if (StunMessage::isProbablyStun(buf)) {
+                    if (isStun) {
                         iceDebug("unexpected stun packet (loopback?), skipping.");
                         continue;
                     }
 
-                    int at = -1;
-                    for (int n = 0; n < checkList.pairs.count(); ++n) {
-                        CandidatePair &pair = *checkList.pairs[n];
-                        if (pair.local->addr.addr == locCand.info->addr.addr
-                            && pair.local->addr.port == locCand.info->addr.port) {
-                            at = n;
-                            break;
-                        }
-                    }
-                    if (at == -1) {
-                        iceDebug("the local transport does not seem to be associated with a candidate?!");
-                        continue;
-                    }
-
-                    int componentIndex = checkList.pairs[at]->local->componentId - 1;
+                    // the transport belongs to one component, no need to look for a pair
+                    int componentIndex = locCand.info->componentId - 1;
                     // iceDebug("packet is considered to be application data for component index %d", componentIndex);
 
                     // FIXME: this assumes components are ordered by id in our local arrays
@@ -1615,6 +2363,27 @@ void Ice176::reset() { d->reset(); }
 
 void Ice176::setProxy(const TurnClient::Proxy &proxy) { d->proxy = proxy; }
 
+void Ice176::setTcpPortScope(TcpPortScope *scope)
+{
+    Q_ASSERT(d->state == Private::Stopped);
+
+    d->tcpPortScope = scope;
+}
+
+void Ice176::setWarmPool(IceWarmPool *pool)
+{
+    Q_ASSERT(d->state == Private::Stopped);
+
+    d->warmPool = pool;
+}
+
+void Ice176::setNatBehaviorCache(NatBehaviorCache *cache)
+{
+    Q_ASSERT(d->state == Private::Stopped);
+
+    d->natCache = cache;
+}
+
 void Ice176::setPortReserver(UdpPortReserver *portReserver)
 {
     Q_ASSERT(d->state == Private::Stopped);
@@ -1637,11 +2406,12 @@ void Ice176::setStunRelayUdpService(const QHostAddress &addr, quint16 port, cons
 }
 
 void Ice176::setStunRelayTcpService(const QHostAddress &addr, quint16 port, const QString &user,
-                                    const QCA::SecureArray &pass)
+                                    const QCA::SecureArray &pass, TurnClient::Mode mode)
 {
     d->stunRelayTcpAddr = { addr, port };
     d->stunRelayTcpUser = user;
     d->stunRelayTcpPass = pass;
+    d->stunRelayTcpMode = mode;
 }
 
 void Ice176::setAllowIpExposure(bool enabled) { d->allowIpExposure = enabled; }
@@ -1675,6 +2445,24 @@ void Ice176::setLocalFeatures(const Features &features) { d->localFeatures = fea
 
 void Ice176::setRemoteFeatures(const Features &features) { d->remoteFeatures = features; }
 
+void Ice176::setEarlyMedia(bool enabled) { d->earlyMedia = enabled; }
+
+void Ice176::setConsentFreshness(bool enabled) { d->consentFreshness = enabled; }
+
+void Ice176::setLiteMode(bool enabled)
+{
+    Q_ASSERT(d->state == Private::Stopped);
+
+    d->lite = enabled;
+}
+
+void Ice176::setPathMonitoring(int backupPairs)
+{
+    Q_ASSERT(d->state == Private::Stopped);
+
+    d->backupPairs = qMax(backupPairs, 0);
+}
+
 void Ice176::start(Mode mode)
 {
     d->mode = mode;
@@ -1761,24 +2549,50 @@ QList<Ice176::SelectedCandidate> Ice176::selectedCandidates() const
     return ret;
 }
 
+Ice176::AddressPolicy::AddressPolicy() :
+    denyInterfaces { QStringLiteral("docker*"), QStringLiteral("br-*"),     QStringLiteral("veth*"),
+                     QStringLiteral("virbr*"),  QStringLiteral("lxcbr*"),   QStringLiteral("lxdbr*"),
+                     QStringLiteral("cni*"),    QStringLiteral("podman*"),  QStringLiteral("vmnet*"),
+                     QStringLiteral("vnic*"),   QStringLiteral("vboxnet*"), QStringLiteral("*VMnet*"),
+                     QStringLiteral("*VirtualBox*") }
+{
+}
+
 QList<QHostAddress> Ice176::availableNetworkAddresses()
 {
+    // as it always was. with the link-local ones, and just the virtual machine adapters left out
+    AddressPolicy policy;
+    policy.linkLocal      = true;
+    policy.denyInterfaces = QStringList { QStringLiteral("vmnet*"), QStringLiteral("vnic*"),
+                                          QStringLiteral("vboxnet*"), QStringLiteral("*VMnet*") };
+
     QList<QHostAddress> listenAddrs;
+    for (auto const &la : availableLocalAddresses(policy))
+        listenAddrs += la.addr;
+    return listenAddrs;
+}
+
+QList<Ice176::LocalAddress> Ice176::availableLocalAddresses(const AddressPolicy &policy)
+{
+    QHostAddress routeSource4, routeSource6;
+    if (policy.defaultRouteOnly) {
+        routeSource4 = defaultRouteSource(QAbstractSocket::IPv4Protocol);
+        routeSource6 = defaultRouteSource(QAbstractSocket::IPv6Protocol);
+        routeSource6.setScopeId(QString());
+    }
+
+    QList<LocalAddress> listenAddrs;
     auto const          interfaces = QNetworkInterface::allInterfaces();
-#ifdef Q_OS_UNIX
-    static const auto ignored
-        = QStringList { QStringLiteral("vmnet"), QStringLiteral("vnic"), QStringLiteral("vboxnet") };
-#endif
     for (const QNetworkInterface &ni : interfaces) {
         if ((ni.flags() & (QNetworkInterface::IsRunning | QNetworkInterface::IsUp))
                 != (QNetworkInterface::IsRunning | QNetworkInterface::IsUp)
             || ni.flags() & QNetworkInterface::IsLoopBack
-#ifdef Q_OS_UNIX
-            || std::any_of(ignored.begin(), ignored.end(), [&ni](auto const &ign) { return ni.name().startsWith(ign); })
-#elif defined(Q_OS_WIN)
-            || ni.humanReadableName().contains(QStringLiteral("VMnet"))
-#endif
-        )
+            || (!policy.allowInterfaces.isEmpty() && !matchInterface(policy.allowInterfaces, ni))
+            || matchInterface(policy.denyInterfaces, ni))
+            continue;
+
+        bool isVpn = isVpnInterface(ni);
+        if (isVpn && !policy.vpn)
             continue;
 
         QList<QNetworkAddressEntry> entries = ni.addressEntries();
@@ -1796,22 +2610,39 @@ QList<QHostAddress> Ice176::availableNetworkAddresses()
                 || (h.protocol() == QAbstractSocket::IPv4Protocol && h.toIPv4Address() < 0x01000000))
                 continue;
 
+            if (!policy.linkLocal && getAddressScope(h) == 1)
+                continue;
+
+            if (policy.defaultRouteOnly) {
+                QHostAddress unscoped = h;
+                unscoped.setScopeId(QString());
+                if (unscoped != routeSource4 && unscoped != routeSource6)
+                    continue;
+            }
+
             // don't put the same address in twice.
             //   this also means that if there are
             //   two link-local ipv6 interfaces
             //   with the exact same address, we
             //   only use the first one
-            if (listenAddrs.contains(h))
+            if (std::any_of(listenAddrs.begin(), listenAddrs.end(), [&](auto const &la) { return la.addr == h; }))
                 continue;
 
             // TODO review if the next condition is needed (and the above too)
             if (h.protocol() == QAbstractSocket::IPv6Protocol && XMPP::Ice176::isIPv6LinkLocalAddress(h))
                 h.setScopeId(ni.name());
-            listenAddrs += h;
+
+            LocalAddress la;
+            la.addr    = h;
+            la.network = ni.index();
+            la.isVpn   = isVpn;
+            listenAddrs += la;
         }
     }
 
-    return sortAddrs(listenAddrs);
+    std::stable_sort(listenAddrs.begin(), listenAddrs.end(),
+                     [](auto const &a, auto const &b) { return comparePriority(a.addr, b.addr) < 0; });
+    return listenAddrs;
 }
 
 } // namespace XMPP
@@ -24,6 +24,7 @@
 #include <QHostAddress>
 #include <QObject>
 #include <QString>
+#include <QStringList>
 
 namespace QCA {
 class SecureArray;
@@ -31,6 +32,9 @@ class SecureArray;
 
 namespace XMPP {
 class UdpPortReserver;
+class TcpPortScope;
+class IceWarmPool;
+class NatBehaviorCache;
 class AbstractStunDisco;
 
 class Ice176 : public QObject {
@@ -48,6 +52,19 @@ public:
         bool         isVpn   = false;
     };
 
+    // which local addresses become candidates, see availableLocalAddresses(). the interface patterns are wildcards
+    //   matched against the name of the interface and its human readable one
+    class AddressPolicy {
+    public:
+        AddressPolicy(); // denies the usual container bridges and virtual machine adapters
+
+        QStringList allowInterfaces; // if not empty, only these
+        QStringList denyInterfaces;
+        bool        linkLocal        = false; // 169.254/16 and fe80::/10
+        bool        vpn              = true;  // tunnels and ppp. they get LocalAddress::isVpn, so rank last
+        bool        defaultRouteOnly = false; // just the addresses the default routes of ipv4 and ipv6 go from
+    };
+
     class ExternalAddress {
     public:
         LocalAddress base;
@@ -72,6 +89,7 @@ public:
         int          rel_port = -1;
         QHostAddress rem_addr;
         int          rem_port = -1;
+        QString      tcptype; // "active", "passive" or "so" when protocol is "tcp"
         QString      type;
     };
 
@@ -93,6 +111,19 @@ public:
     // note: ownership is not passed
     void setPortReserver(UdpPortReserver *portReserver);
 
+    // if set, there will be ICE-TCP host candidates on the listeners of the scope. the scope has to make
+    //   IceTcpServer, see IceTcpServersProducer. note: ownership is not passed
+    void setTcpPortScope(TcpPortScope *scope);
+
+    // if set, the local transports come from the pool when it has them ready, with the STUN and TURN
+    //   addresses obtained already. ports from the reserver go first. note: ownership is not passed
+    void setWarmPool(IceWarmPool *pool);
+
+    // if set, the STUN and TURN candidates which can't work on the network, as probed before, aren't gathered:
+    //   none over udp when it's blocked, and no reflexive ones behind a symmetric NAT. the first agent on a network
+    //   not probed yet starts the probe. note: ownership is not passed
+    void setNatBehaviorCache(NatBehaviorCache *cache);
+
     void setLocalAddresses(const QList<LocalAddress> &addrs);
 
     // one per local address.  you must set local addresses first.
@@ -101,8 +132,9 @@ public:
     void setStunBindService(const QHostAddress &addr, quint16 port); // REVIEW if we need both v4 and v6?
     void setStunRelayUdpService(const QHostAddress &addr, quint16 port, const QString &user,
                                 const QCA::SecureArray &pass);
+    // TlsMode is TURN over TLS ("turns"), usually on port 443 for networks which let nothing else through
     void setStunRelayTcpService(const QHostAddress &addr, quint16 port, const QString &user,
-                                const QCA::SecureArray &pass);
+                                const QCA::SecureArray &pass, TurnClient::Mode mode = TurnClient::PlainMode);
 
     // these all start out enabled, but can be disabled for diagnostic
     //   purposes
@@ -127,6 +159,29 @@ public:
     void setLocalFeatures(const Features &features);
     void setRemoteFeatures(const Features &features);
 
+    // send data over the first valid pair of each component without waiting for nomination. better pairs take
+    //   over as they get validated and the nominated one once selected. the peer has to accept data on any valid
+    //   pair anyway (RFC8445 12.1), so it works without NotNominatedData on the remote side
+    void setEarlyMedia(bool enabled);
+
+    // on by default. once the pairs are selected, they are checked every 5 seconds or so and the session fails
+    //   with ErrorDisconnected when the peer stopped answering for 30 seconds (RFC7675). the keepalives of the
+    //   selected pairs go out anyway, and once per 5-tuple for all the sessions sharing it
+    void setConsentFreshness(bool enabled);
+
+    // off (0) by default. the best backupPairs valid pairs of each component are kept along the selected one, and
+    //   the consent checks measure the rtt and the loss of all of them. the controlling agent switches to a backup
+    //   which stays clearly better for a few rounds, and tells the peer with USE-CANDIDATE on it. a peer with path
+    //   monitoring follows, see selectedPairChanged(). the data above doesn't notice, it's the same transports.
+    //   needs consent freshness
+    void setPathMonitoring(int backupPairs);
+
+    // RFC8445 ICE-lite, for an endpoint with a public address which just takes sessions, like a file ingest
+    //   service. the host candidates only, and the agent is always controlled: the checks of the peer are answered,
+    //   and the highest priority pair the peer nominates is selected. no checks, timers or keepalives of its own
+    //   besides the PAC timeout. the peer has to be a full agent and the controlling one
+    void setLiteMode(bool enabled);
+
     void start(Mode mode); // init everything and prepare candidates
     void stop();
     bool isStopped() const;
@@ -164,6 +219,9 @@ public:
     QList<SelectedCandidate> selectedCandidates() const;
 
     static QList<QHostAddress> availableNetworkAddresses();
+    // the same with the policy applied, best first, with network and isVpn filled in. the addresses which got no
+    //   valid pair in the sessions which got connected otherwise go last in setLocalAddresses(), see IceAgent
+    static QList<LocalAddress> availableLocalAddresses(const AddressPolicy &policy = AddressPolicy());
 
 signals:
     // indicates that the ice engine is started and is ready to receive
@@ -179,6 +237,9 @@ signals:
     void componentReady(int index); // has valid nominated candidate for component with index
     void iceFinished();             // Final nominated candidates are selected for all components
 
+    // path monitoring took another pair for the component, see selectedCandidates()
+    void selectedPairChanged(int componentIndex);
+
     void readyRead(int componentIndex);
     void datagramsWritten(int componentIndex, int count);
 
@@ -1,8 +1,12 @@
 #include "iceagent.h"
 
 #include <QCoreApplication>
+#include <QMutex>
 #include <QtCrypto>
 
+// connected sessions in a row without a valid pair on a local address, for it to rank last
+#define UNREACHABLE_SESSIONS 3
+
 namespace XMPP {
 
 struct Foundation {
@@ -45,6 +49,10 @@ static QChar randomPrintableChar()
 
 struct IceAgent::Private {
     QHash<Foundation, QString> foundations;
+
+    // the sessions of all the threads report here
+    mutable QMutex           mutex;
+    QHash<QHostAddress, int> failures; // connected sessions in a row without a valid pair on the address
 };
 
 IceAgent *IceAgent::instance()
@@ -79,6 +87,21 @@ QString IceAgent::randomCredential(int len)
     return out;
 }
 
+void IceAgent::reportReachability(const QHostAddress &localAddr, bool reached)
+{
+    QMutexLocker locker(&d->mutex);
+    if (reached)
+        d->failures.remove(localAddr);
+    else
+        ++d->failures[localAddr];
+}
+
+bool IceAgent::isUnreachable(const QHostAddress &localAddr) const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->failures.value(localAddr) >= UNREACHABLE_SESSIONS;
+}
+
 IceAgent::IceAgent(QObject *parent) : QObject(parent), d(new Private) { }
 
 } // namespace XMPP
@@ -20,6 +20,11 @@ public:
 
     static QString randomCredential(int len);
 
+    // what the connected sessions learned about the local addresses: whether the address got a valid pair. an
+    //   address which didn't for a few sessions in a row is unreachable until it does again
+    void reportReachability(const QHostAddress &localAddr, bool reached);
+    bool isUnreachable(const QHostAddress &localAddr) const;
+
 private:
     explicit IceAgent(QObject *parent = nullptr);
 
@@ -20,10 +20,13 @@
 
 #include "iceagent.h"
 #include "icelocaltransport.h"
+#include "icetcptransport.h"
 #include "iceturntransport.h"
+#include "icewarmpool.h"
 #include "objectsession.h"
 #include "udpportreserver.h"
 
+#include <QPointer>
 #include <QTimer>
 #include <QUdpSocket>
 #include <QUuid>
@@ -65,11 +68,13 @@ public:
         TransportAddress stunRelayTcpAddr;
         QString          stunRelayTcpUser;
         QCA::SecureArray stunRelayTcpPass;
+        TurnClient::Mode stunRelayTcpMode = TurnClient::PlainMode;
     };
 
     class LocalTransport {
     public:
         QUdpSocket                       *qsock;
+        UdpMuxEndpoint                   *endpoint = nullptr; // instead of qsock, if the port is shared
         QHostAddress                      addr;
         QSharedPointer<IceLocalTransport> sock;
         int                               network;
@@ -88,24 +93,32 @@ public:
         }
     };
 
-    IceComponent                      *q;
-    ObjectSession                      sess;
-    int                                id;
-    QString                            clientSoftware;
-    TurnClient::Proxy                  proxy;
-    UdpPortReserver                   *portReserver = nullptr;
-    Config                             pending;
-    Config                             config;
-    bool                               stopping = false;
-    QList<LocalTransport *>            udpTransports; // transport for local host-only candidates
-    QSharedPointer<IceTurnTransport>   tcpTurn;       // tcp relay candidate
-    QList<Candidate>                   localCandidates;
-    QHash<int, QSet<TransportAddress>> channelPeers;
-    bool                               useLocal        = true; // use local host candidates
-    bool                               useStunBind     = true;
-    bool                               useStunRelayUdp = true;
-    bool                               useStunRelayTcp = true;
-    bool                               localFinished   = false;
+    IceComponent                          *q;
+    ObjectSession                          sess;
+    int                                    id;
+    QString                                clientSoftware;
+    TurnClient::Proxy                      proxy;
+    UdpPortReserver                       *portReserver = nullptr;
+    TcpPortScope                          *tcpScope     = nullptr;
+    IceWarmPool                           *warmPool     = nullptr;
+    QString                                tcpUfrag;
+    Config                                 pending;
+    Config                                 config;
+    bool                                   stopping = false;
+    QList<LocalTransport *>                udpTransports; // transport for local host-only candidates
+    QSharedPointer<IceTurnTransport>       tcpTurn;       // tcp relay candidate
+    QList<QSharedPointer<IceTcpTransport>> tcpTransports; // ICE-TCP candidates, one per listener
+    QSet<IceTcpTransport *>                tcpStarting;
+    QPointer<TcpPortDiscoverer>            tcpDisco;
+    QList<Candidate>                       localCandidates;
+    QHash<int, QSet<TransportAddress>>     channelPeers;
+    bool                                   useLocal        = true; // use local host candidates
+    bool                                   useStunBind     = true;
+    bool                                   useStunRelayUdp = true;
+    bool                                   useStunRelayTcp = true;
+    bool                                   localFinished   = false;
+    bool                                   tcpStarted      = false;
+    bool                                   tcpGathered     = false; // all the listeners are known
     // bool                               stunFinished      = false;
     bool gatheringComplete = false;
     int  debugLevel        = DL_Packet;
@@ -114,12 +127,14 @@ public:
 
     ~Private() { qDeleteAll(udpTransports); }
 
-    LocalTransport *createLocalTransport(QUdpSocket *socket, const Ice176::LocalAddress &la)
+    // warm is a started transport from the pool, instead of one on socket
+    LocalTransport *createLocalTransport(QUdpSocket *socket, const Ice176::LocalAddress &la,
+                                         const QSharedPointer<IceLocalTransport> &warm = {})
     {
         auto lt   = new LocalTransport;
         lt->qsock = socket;
         lt->addr  = la.addr;
-        lt->sock  = QSharedPointer<IceLocalTransport>::create();
+        lt->sock  = warm ? warm : QSharedPointer<IceLocalTransport>::create();
         lt->sock->setDebugLevel(IceTransport::DebugLevel(debugLevel));
         lt->network = la.network;
         lt->isVpn   = la.isVpn;
@@ -143,7 +158,7 @@ public:
         return lt;
     }
 
-    void update(QList<QUdpSocket *> *socketList)
+    void update(QList<QUdpSocket *> *socketList, QList<UdpMuxEndpoint *> *endpointList)
     {
         Q_ASSERT(!stopping);
 
@@ -158,21 +173,34 @@ public:
             config.stunRelayTcpAddr = pending.stunRelayTcpAddr;
             config.stunRelayTcpUser = pending.stunRelayTcpUser;
             config.stunRelayTcpPass = pending.stunRelayTcpPass;
+            config.stunRelayTcpMode = pending.stunRelayTcpMode;
         }
 
         // for now, only allow setting localAddrs once
         if (!pending.localAddrs.isEmpty() && config.localAddrs.isEmpty()) {
+            if (warmPool)
+                prepareWarmPool();
+
             for (const Ice176::LocalAddress &la : as_const(pending.localAddrs)) {
                 // skip duplicate addrs
                 if (findLocalAddr(la.addr) != -1)
                     continue;
 
+                UdpMuxEndpoint *endpoint = nullptr;
+                if (useLocal && endpointList)
+                    endpoint = takeFromEndpointList(endpointList, la.addr, this);
+
                 QUdpSocket *qsock = nullptr;
-                if (useLocal && socketList) {
+                if (useLocal && socketList && !endpoint) {
                     qsock = takeFromSocketList(socketList, la.addr, this);
                 }
-                bool borrowedSocket = qsock != nullptr;
-                if (!qsock) {
+                bool borrowedSocket = qsock != nullptr || endpoint != nullptr;
+
+                QSharedPointer<IceLocalTransport> warm;
+                if (warmPool && !borrowedSocket && la.addr.protocol() != QAbstractSocket::IPv6Protocol)
+                    warm = warmPool->take(la.addr);
+
+                if (!qsock && !endpoint && !warm) {
                     // otherwise, bind to random
                     qsock = new QUdpSocket(this);
                     if (!qsock->bind(la.addr, 0)) {
@@ -183,11 +211,22 @@ public:
                 }
 
                 config.localAddrs += la;
-                auto lt      = createLocalTransport(qsock, la);
+                auto lt      = createLocalTransport(qsock, la, warm);
+                lt->endpoint = endpoint;
                 lt->borrowed = borrowedSocket;
                 udpTransports += lt;
 
-                if (lt->addr.protocol() != QAbstractSocket::IPv6Protocol) {
+                if (warm) {
+                    // set up the same way below, and the servers answered already
+                    lt->stun_started = true;
+                    sess.defer(this, &Private::adoptWarmTransport, warm.data());
+                    emit q->debugLine(QLatin1String("taking warm transport ") + warm->localAddress()
+                                      + " for component " + QString::number(id));
+                    continue;
+                }
+
+                // servers see only the shared port, they couldn't tell us from the other agents using it
+                if (!endpoint && lt->addr.protocol() != QAbstractSocket::IPv6Protocol) {
                     lt->sock->setClientSoftwareNameAndVersion(clientSoftware);
                     if (useStunBind && config.stunBindAddr.isValid()) {
                         lt->sock->setStunBindService(config.stunBindAddr);
@@ -198,8 +237,14 @@ public:
                     }
                 }
 
-                int port = qsock->localPort();
-                lt->sock->start(qsock);
+                int port;
+                if (endpoint) {
+                    port = endpoint->localAddress().port;
+                    lt->sock->start(endpoint);
+                } else {
+                    port = qsock->localPort();
+                    lt->sock->start(qsock);
+                }
                 emit q->debugLine(QString("starting transport ") + la.addr.toString() + ';' + QString::number(port)
                                   + " for component " + QString::number(id));
             }
@@ -263,10 +308,16 @@ public:
             tcpTurn->setProxy(proxy);
             tcpTurn->setUsername(config.stunRelayTcpUser);
             tcpTurn->setPassword(config.stunRelayTcpPass);
-            tcpTurn->start(config.stunRelayTcpAddr);
+            tcpTurn->start(config.stunRelayTcpAddr, config.stunRelayTcpMode);
 
             emit q->debugLine(QLatin1String("starting TURN transport with server ") + config.stunRelayTcpAddr
-                              + " for component " + QString::number(id));
+                              + (config.stunRelayTcpMode == TurnClient::TlsMode ? " (tls)" : "") + " for component "
+                              + QString::number(id));
+        }
+
+        if (useLocal && tcpScope && !tcpStarted && !config.localAddrs.isEmpty()) {
+            tcpStarted = true;
+            startTcp();
         }
 
         if (udpTransports.isEmpty() && !localFinished) {
@@ -293,6 +344,9 @@ public:
 
         if (tcpTurn)
             tcpTurn->stop();
+
+        for (auto const &t : as_const(tcpTransports))
+            t->stop();
     }
 
     int peerReflexivePriority(QSharedPointer<IceTransport> iceTransport, int path) const
@@ -308,6 +362,12 @@ public:
                 // lower priority, but not as far as IceTurnTransport
                 addrAt += 512;
             }
+        } else if (auto tt = qobject_cast<const IceTcpTransport *>(iceTransport.data())) {
+            auto it = std::find_if(tcpTransports.begin(), tcpTransports.end(),
+                                   [&](auto const &a) { return a.data() == tt; });
+            Q_ASSERT(it != tcpTransports.end());
+            return choose_tcp_priority(PeerReflexiveType, path == IceTcpTransport::Active ? ActiveTcp : PassiveTcp,
+                                       int(std::distance(tcpTransports.begin(), it)), false, id);
         } else if (qobject_cast<const IceTurnTransport *>(iceTransport) == tcpTurn) {
             // lower priority by making it seem like the last nic
             addrAt = 1024;
@@ -353,9 +413,10 @@ public:
         ci->foundation  = IceAgent::instance()->foundation(IceComponent::PeerReflexiveType, ci->base.addr);
         ci->componentId = base->componentId;
         ci->network     = base->network;
+        ci->tcpType     = base->tcpType;
 
         auto baseCand = std::find_if(localCandidates.begin(), localCandidates.end(), [&](auto const &c) {
-            return c.info->base == base->base && c.info->type == HostType;
+            return c.info->base == base->base && c.info->type == HostType && c.info->tcpType == base->tcpType;
         });
         Q_ASSERT(baseCand != localCandidates.end());
 
@@ -393,6 +454,25 @@ private:
         return calc_priority(typePref, localPref, componentId);
     }
 
+    // RFC 6544 4.2. addrAt is the position of the listener, the direction goes in the top bits of localPref.
+    //   anything direct over tcp is still below the udp candidates, but above the relays
+    static int choose_tcp_priority(CandidateType type, TcpType tcpType, int addrAt, bool isVpn, int componentId)
+    {
+        int typePref;
+        if (type == HostType) {
+            if (isVpn)
+                typePref = 0;
+            else
+                typePref = 90;
+        } else if (type == PeerReflexiveType)
+            typePref = 80;
+        else // ServerReflexiveType
+            typePref = 70;
+
+        int dirPref = tcpType == ActiveTcp ? 6 : tcpType == PassiveTcp ? 4 : 2;
+        return calc_priority(typePref, (1 << 13) * dirPref + (8191 - qMin(addrAt, 8191)), componentId);
+    }
+
     static QUdpSocket *takeFromSocketList(QList<QUdpSocket *> *socketList, const QHostAddress &addr,
                                           QObject *parent = nullptr)
     {
@@ -407,6 +487,20 @@ private:
         return nullptr;
     }
 
+    static UdpMuxEndpoint *takeFromEndpointList(QList<UdpMuxEndpoint *> *endpointList, const QHostAddress &addr,
+                                                QObject *parent = nullptr)
+    {
+        for (int n = 0; n < endpointList->count(); ++n) {
+            if ((*endpointList)[n]->localAddress().addr == addr) {
+                UdpMuxEndpoint *ep = endpointList->takeAt(n);
+                ep->setParent(parent);
+                return ep;
+            }
+        }
+
+        return nullptr;
+    }
+
     int getId() const
     {
         for (int n = 0;; ++n) {
@@ -493,7 +587,7 @@ private:
         }
     }
 
-    bool allStopped() const { return udpTransports.isEmpty() && !tcpTurn; }
+    bool allStopped() const { return udpTransports.isEmpty() && !tcpTurn && tcpTransports.isEmpty(); }
 
     void tryStopped()
     {
@@ -501,6 +595,120 @@ private:
             postStop();
     }
 
+    void startTcp()
+    {
+        // the listeners of the other agents will do
+        auto servers = tcpScope->allServers();
+        if (servers.isEmpty()) {
+            // the local ones come when the discoverer starts, on the next pass. the application may add mapped
+            //   ones when it's told about the discoverer, that is right here
+            tcpDisco = tcpScope->disco();
+            tcpDisco->setTypeMask(TcpPortServer::PortTypes(TcpPortServer::Direct | TcpPortServer::NatAssited));
+            connect(tcpDisco, &TcpPortDiscoverer::portAvailable, this,
+                    [this]() { addTcpServers(tcpDisco->takeServers()); });
+        } else
+            addTcpServers(servers);
+
+        QTimer::singleShot(0, this, [this]() {
+            if (tcpDisco) {
+                tcpDisco->disconnect(this);
+                tcpDisco->deleteLater();
+            }
+            tcpGathered = true;
+            tryGatheringComplete();
+        });
+    }
+
+    void addTcpServers(const QList<TcpPortServer::Ptr> &servers)
+    {
+        if (stopping)
+            return;
+
+        for (auto const &server : servers) {
+            auto ts = server.objectCast<IceTcpServer>();
+            if (!ts || findLocalAddr(ts->serverAddress()) == -1)
+                continue;
+            if (std::any_of(tcpTransports.begin(), tcpTransports.end(),
+                            [&](auto const &t) { return t->server() == server; }))
+                continue;
+
+            // it may go away in its own signal
+            QSharedPointer<IceTcpTransport> t(new IceTcpTransport, &QObject::deleteLater);
+            t->setDebugLevel(IceTransport::DebugLevel(debugLevel));
+            auto tp = t.data();
+            connect(tp, &IceTcpTransport::started, this, [this, tp]() { tcp_started(tp); });
+            connect(tp, &IceTcpTransport::stopped, this, [this, tp]() {
+                if (eraseTcpTransport(tp))
+                    tryStopped();
+            });
+            connect(tp, &IceTcpTransport::error, this, [this, tp](int) {
+                emit q->debugLine(QLatin1String("ICE-TCP listener ") + tp->localAddress()
+                                  + QLatin1String(" is taken by another agent with the same ufrag"));
+                if (eraseTcpTransport(tp))
+                    tryGatheringComplete();
+            });
+            connect(tp, &IceTcpTransport::debugLine, this, &Private::lt_debugLine);
+            tcpTransports += t;
+            tcpStarting += tp;
+            t->start(ts, tcpUfrag);
+
+            emit q->debugLine(QLatin1String("starting ICE-TCP transport ") + t->localAddress() + " for component "
+                              + QString::number(id));
+        }
+    }
+
+    // what the transports on own ports are going to ask the servers, the same as in update()
+    void prepareWarmPool()
+    {
+        IceWarmPool::Setup setup;
+        for (auto const &la : as_const(pending.localAddrs)) {
+            if (la.addr.protocol() != QAbstractSocket::IPv6Protocol && !setup.addrs.contains(la.addr))
+                setup.addrs += la.addr;
+        }
+        if (useStunBind && config.stunBindAddr.isValid())
+            setup.stunBindAddr = config.stunBindAddr;
+        if (useStunRelayUdp && config.stunRelayUdpAddr.isValid() && !config.stunRelayUdpUser.isEmpty()) {
+            setup.stunRelayAddr = config.stunRelayUdpAddr;
+            setup.stunRelayUser = config.stunRelayUdpUser;
+            setup.stunRelayPass = config.stunRelayUdpPass;
+        }
+        setup.clientSoftware = clientSoftware;
+        warmPool->prepare(setup);
+    }
+
+    // the transport was started on the pool's watch, so it won't signal that again
+    void adoptWarmTransport(IceLocalTransport *sock)
+    {
+        if (stopping || std::none_of(udpTransports.begin(), udpTransports.end(),
+                                     [&](auto const &lt) { return lt->sock == sock; }))
+            return;
+
+        ObjectSessionWatcher watch(&sess);
+        localTransportStarted(sock);
+        if (!watch.isValid())
+            return;
+        localTransportAddressesChanged(sock);
+    }
+
+    // return true if component is still alive after transport removal
+    bool eraseTcpTransport(IceTcpTransport *t)
+    {
+        ObjectSessionWatcher watch(&sess);
+
+        tcpStarting.remove(t);
+        auto it = std::find_if(tcpTransports.begin(), tcpTransports.end(), [&](auto const &a) { return a == t; });
+        if (it == tcpTransports.end())
+            return true;
+        auto transport = *it;
+        removeLocalCandidates(transport);
+        if (!watch.isValid())
+            return false;
+
+        transport->disconnect(this);
+        tcpTransports.removeOne(transport);
+        return true;
+    }
+
     // return true if component is still alive after transport removal
     bool eraseLocalTransport(LocalTransport *lt)
     {
@@ -512,7 +720,10 @@ private:
             return false;
 
         lt->sock->disconnect(this);
-        if (lt->borrowed) {
+        if (lt->endpoint) {
+            // the transport is done with it, and the socket stays with the reserver
+            portReserver->returnEndpoints({ lt->endpoint });
+        } else if (lt->borrowed) {
             lt->qsock->disconnect(this);
             portReserver->returnSockets({ lt->qsock });
         }
@@ -526,6 +737,8 @@ private slots:
     {
         if (gatheringComplete || (tcpTurn && !tcpTurn->isStarted()))
             return;
+        if (tcpStarted && (!tcpGathered || !tcpStarting.isEmpty()))
+            return;
 
         auto checkFinished = [&](const LocalTransport *lt) {
             return lt->started && (!lt->sock->stunBindServiceAddress().isValid() || lt->stun_finished)
@@ -553,10 +766,15 @@ private slots:
         emit q->stopped();
     }
 
-    void lt_started()
-    {
-        IceLocalTransport *sock = static_cast<IceLocalTransport *>(sender());
+    void lt_started() { localTransportStarted(static_cast<IceLocalTransport *>(sender())); }
+
+    void lt_addressesChanged() { localTransportAddressesChanged(static_cast<IceLocalTransport *>(sender())); }
 
+    void lt_debugLine(const QString &line) { emit q->debugLine(line); }
+
+private:
+    void localTransportStarted(IceLocalTransport *sock)
+    {
         auto it
             = std::find_if(udpTransports.begin(), udpTransports.end(), [&](auto const &a) { return a->sock == sock; });
         Q_ASSERT(it != udpTransports.end());
@@ -629,10 +847,9 @@ private slots:
         tryGatheringComplete();
     }
 
-    void lt_addressesChanged()
+    void localTransportAddressesChanged(IceLocalTransport *sock)
     {
-        IceLocalTransport *sock = static_cast<IceLocalTransport *>(sender());
-        auto               it
+        auto it
             = std::find_if(udpTransports.begin(), udpTransports.end(), [&](auto const &a) { return a->sock == sock; });
 
         Q_ASSERT(it != udpTransports.end());
@@ -710,7 +927,59 @@ private slots:
         tryGatheringComplete();
     }
 
-    void lt_debugLine(const QString &line) { emit q->debugLine(line); }
+private slots:
+    void tcp_started(IceTcpTransport *t)
+    {
+        tcpStarting.remove(t);
+
+        auto const &server = t->server();
+        int         addrAt = findLocalAddr(server->serverAddress());
+        Q_ASSERT(addrAt != -1);
+        auto const &la = config.localAddrs[addrAt];
+
+        ObjectSessionWatcher watch(&sess);
+
+        auto addCandidate = [&](CandidateType type, TcpType tcpType, const TransportAddress &addr, int path) {
+            auto ci         = CandidateInfo::Ptr::create();
+            ci->addr        = addr;
+            ci->type        = type;
+            ci->tcpType     = tcpType;
+            ci->componentId = id;
+            ci->priority    = choose_tcp_priority(type, tcpType, addrAt, la.isVpn, ci->componentId);
+            ci->base        = t->localAddress();
+            if (type != HostType)
+                ci->related = ci->base;
+            ci->network    = la.network;
+            ci->foundation = IceAgent::instance()->foundation(type, ci->base.addr, QHostAddress(),
+                                                              QAbstractSocket::TcpSocket);
+
+            Candidate c;
+            c.id           = getId();
+            c.info         = ci;
+            c.iceTransport = t->sharedFromThis();
+            c.path         = path;
+
+            localCandidates += c;
+
+            emit q->candidateAdded(c);
+            return watch.isValid();
+        };
+
+        // the port of an active candidate means nothing, RFC 6544 wants the discard one
+        if (!addCandidate(HostType, PassiveTcp, t->localAddress(), IceTcpTransport::Passive)
+            || !addCandidate(HostType, ActiveTcp, TransportAddress(t->localAddress().addr, 9), IceTcpTransport::Active))
+            return;
+
+        if (server->portType() == TcpPortServer::NatAssited) {
+            QHostAddress extAddr(server->publishHost());
+            if (!extAddr.isNull()
+                && !addCandidate(ServerReflexiveType, PassiveTcp, TransportAddress(extAddr, server->publishPort()),
+                                 IceTcpTransport::Passive))
+                return;
+        }
+
+        tryGatheringComplete();
+    }
 
     void tt_started()
     {
@@ -793,6 +1062,14 @@ void IceComponent::setPortReserver(UdpPortReserver *portReserver) { d->portReser
 
 UdpPortReserver *IceComponent::portReserver() const { return d->portReserver; }
 
+void IceComponent::setWarmPool(IceWarmPool *pool) { d->warmPool = pool; }
+
+void IceComponent::setTcpPortScope(TcpPortScope *scope, const QString &localUfrag)
+{
+    d->tcpScope = scope;
+    d->tcpUfrag = localUfrag;
+}
+
 void IceComponent::setLocalAddresses(const QList<Ice176::LocalAddress> &addrs) { d->pending.localAddrs = addrs; }
 
 void IceComponent::setExternalAddresses(const QList<Ice176::ExternalAddress> &addrs) { d->pending.extAddrs = addrs; }
@@ -808,11 +1085,12 @@ void IceComponent::setStunRelayUdpService(const TransportAddress &addr, const QS
 }
 
 void IceComponent::setStunRelayTcpService(const TransportAddress &addr, const QString &user,
-                                          const QCA::SecureArray &pass)
+                                          const QCA::SecureArray &pass, TurnClient::Mode mode)
 {
     d->pending.stunRelayTcpAddr = addr;
     d->pending.stunRelayTcpUser = user;
     d->pending.stunRelayTcpPass = pass;
+    d->pending.stunRelayTcpMode = mode;
 }
 
 void IceComponent::setUseLocal(bool enabled) { d->useLocal = enabled; }
@@ -823,7 +1101,10 @@ void IceComponent::setUseStunRelayUdp(bool enabled) { d->useStunRelayUdp = enabl
 
 void IceComponent::setUseStunRelayTcp(bool enabled) { d->useStunRelayTcp = enabled; }
 
-void IceComponent::update(QList<QUdpSocket *> *socketList) { d->update(socketList); }
+void IceComponent::update(QList<QUdpSocket *> *socketList, QList<UdpMuxEndpoint *> *endpointList)
+{
+    d->update(socketList, endpointList);
+}
 
 void IceComponent::stop() { d->stop(); }
 
@@ -850,6 +1131,8 @@ void IceComponent::setDebugLevel(DebugLevel level)
         lt->sock->setDebugLevel(IceTransport::DebugLevel(level));
     if (d->tcpTurn)
         d->tcpTurn->setDebugLevel((IceTransport::DebugLevel)level);
+    for (auto const &t : as_const(d->tcpTransports))
+        t->setDebugLevel(IceTransport::DebugLevel(level));
 }
 
 IceComponent::CandidateInfo::Ptr
@@ -28,6 +28,9 @@
 class QUdpSocket;
 
 namespace XMPP {
+class IceWarmPool;
+class TcpPortScope;
+class UdpMuxEndpoint;
 class UdpPortReserver;
 
 class IceComponent : public QObject {
@@ -36,11 +39,15 @@ class IceComponent : public QObject {
 public:
     enum CandidateType { HostType, PeerReflexiveType, ServerReflexiveType, RelayedType };
 
+    // RFC 6544. NoTcp is udp
+    enum TcpType { NoTcp, ActiveTcp, PassiveTcp, SoTcp };
+
     class CandidateInfo {
     public:
         using Ptr = QSharedPointer<CandidateInfo>;
 
         CandidateType type;
+        TcpType       tcpType = NoTcp;
         int           priority;
         int           componentId;
         int           network;
@@ -53,7 +60,10 @@ public:
         QString id;
 
         static Ptr  makeRemotePrflx(int componentId, const TransportAddress &fromAddr, quint32 priority);
-        inline bool operator==(const CandidateInfo &o) const { return addr == o.addr && componentId == o.componentId; }
+        inline bool operator==(const CandidateInfo &o) const
+        {
+            return addr == o.addr && componentId == o.componentId && (tcpType == NoTcp) == (o.tcpType == NoTcp);
+        }
         inline bool operator==(CandidateInfo::Ptr o) const { return *this == *o; }
     };
 
@@ -88,6 +98,13 @@ public:
     void             setPortReserver(UdpPortReserver *portReserver);
     UdpPortReserver *portReserver() const;
 
+    // ICE-TCP host candidates on the listeners of the scope, which should be an IceTcpServersProducer. the
+    //   listeners are shared with the other agents, the connections come to the one with localUfrag
+    void setTcpPortScope(TcpPortScope *scope, const QString &localUfrag);
+
+    // transports on own ports are taken from the pool when it has them ready. note: ownership is not passed
+    void setWarmPool(IceWarmPool *pool);
+
     // can be set once, but later changes are ignored
     void setLocalAddresses(const QList<Ice176::LocalAddress> &addrs);
 
@@ -98,7 +115,8 @@ public:
     // can be set at any time, but only once.  later changes are ignored
     void setStunBindService(const TransportAddress &addr);
     void setStunRelayUdpService(const TransportAddress &addr, const QString &user, const QCA::SecureArray &pass);
-    void setStunRelayTcpService(const TransportAddress &addr, const QString &user, const QCA::SecureArray &pass);
+    void setStunRelayTcpService(const TransportAddress &addr, const QString &user, const QCA::SecureArray &pass,
+                                TurnClient::Mode mode = TurnClient::PlainMode);
 
     // these all start out enabled, but can be disabled for diagnostic
     //   purposes
@@ -112,8 +130,10 @@ public:
      * @param socketList
      * If socketList is not null then port reserver must be set.
      * If the pool doesn't have enough sockets, the component will allocate its own.
+     * @param endpointList
+     * Shared ports of a multiplexed port reserver. Preferred over socketList.
      */
-    void update(QList<QUdpSocket *> *socketList = nullptr);
+    void update(QList<QUdpSocket *> *socketList = nullptr, QList<UdpMuxEndpoint *> *endpointList = nullptr);
     void stop();
 
     // prflx priority to use when replying from this transport/path
@@ -19,19 +19,36 @@
 #include "icelocaltransport.h"
 
 #include "objectsession.h"
+#include "stallwatchdog.h"
 #include "stunallocate.h"
 #include "stunbinding.h"
 #include "stunmessage.h"
 #include "stuntransaction.h"
 #include "turnclient.h"
+#include "udpportreserver.h"
 
 #include <QHostAddress>
+#include <QNetworkInterface>
 #include <QUdpSocket>
 #include <QtCrypto>
 
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
 // don't queue more incoming packets than this per transmit path
 #define MAX_PACKET_QUEUE 64
 
+#ifdef Q_OS_LINUX
+// datagrams moved by one recvmmsg()/sendmmsg() call
+#define IO_BATCH 16
+// a slot of the receive ring. anything bigger would be fragmented on the wire anyway
+#define IO_SLOT_SIZE 9216
+#endif
+
 namespace XMPP {
 enum { Direct, Relayed };
 
@@ -43,9 +60,96 @@ class SafeUdpSocket : public QObject {
     Q_OBJECT
 
 private:
-    ObjectSession sess;
-    QUdpSocket   *sock;
-    int           writtenCount;
+    using Datagram   = QPair<TransportAddress, QByteArray>;
+    using InDatagram = QPair<TransportKey, QByteArray>;
+
+    ObjectSession     sess;
+    QUdpSocket       *sock = nullptr;
+    UdpMuxEndpoint   *ep   = nullptr; // instead of sock, when sharing the port with other agents
+    int               writtenCount;
+    QList<InDatagram> inBatch;  // read ahead by the last batch
+    QList<Datagram>   outBatch; // waiting for flushWrites()
+#ifdef Q_OS_LINUX
+    QByteArray ring; // IO_BATCH slots of IO_SLOT_SIZE, allocated on first use
+
+    static TransportKey fromSockAddr(const sockaddr_storage &ss)
+    {
+        if (ss.ss_family == AF_INET) {
+            auto sin = reinterpret_cast<const sockaddr_in *>(&ss);
+            return TransportKey::fromIPv4(ntohl(sin->sin_addr.s_addr), ntohs(sin->sin_port));
+        }
+        if (ss.ss_family == AF_INET6) {
+            auto sin6 = reinterpret_cast<const sockaddr_in6 *>(&ss);
+            return TransportKey::fromIPv6(sin6->sin6_addr.s6_addr, ntohs(sin6->sin6_port), sin6->sin6_scope_id);
+        }
+        return TransportKey();
+    }
+
+    static socklen_t toSockAddr(const TransportAddress &a, sockaddr_storage &ss)
+    {
+        std::memset(&ss, 0, sizeof(ss));
+        if (a.addr.protocol() == QAbstractSocket::IPv4Protocol) {
+            auto sin             = reinterpret_cast<sockaddr_in *>(&ss);
+            sin->sin_family      = AF_INET;
+            sin->sin_port        = htons(a.port);
+            sin->sin_addr.s_addr = htonl(a.addr.toIPv4Address());
+            return sizeof(sockaddr_in);
+        }
+        if (a.addr.protocol() == QAbstractSocket::IPv6Protocol) {
+            auto sin6         = reinterpret_cast<sockaddr_in6 *>(&ss);
+            auto ip6          = a.addr.toIPv6Address();
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port   = htons(a.port);
+            std::memcpy(&sin6->sin6_addr, &ip6, sizeof(ip6));
+            auto scope = a.addr.scopeId();
+            if (!scope.isEmpty()) {
+                bool ok;
+                sin6->sin6_scope_id = scope.toUInt(&ok);
+                if (!ok)
+                    sin6->sin6_scope_id = QNetworkInterface::interfaceIndexFromName(scope);
+            }
+            return sizeof(sockaddr_in6);
+        }
+        return 0;
+    }
+
+    // drains whatever is queued in the kernel right now, up to MAX_PACKET_QUEUE datagrams
+    void readBatch()
+    {
+        if (ring.isEmpty())
+            ring.resize(IO_BATCH * IO_SLOT_SIZE);
+        int fd = int(sock->socketDescriptor());
+        while (inBatch.size() < MAX_PACKET_QUEUE) {
+            mmsghdr          msgs[IO_BATCH];
+            iovec            iovs[IO_BATCH];
+            sockaddr_storage addrs[IO_BATCH];
+            std::memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < IO_BATCH; ++i) {
+                iovs[i].iov_base            = ring.data() + i * IO_SLOT_SIZE;
+                iovs[i].iov_len             = IO_SLOT_SIZE;
+                msgs[i].msg_hdr.msg_iov     = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen  = 1;
+                msgs[i].msg_hdr.msg_name    = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            }
+            int n = recvmmsg(fd, msgs, IO_BATCH, MSG_DONTWAIT, nullptr);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            for (int i = 0; i < n; ++i) {
+                if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                    qWarning("SafeUdpSocket: dropped a datagram bigger than %d bytes", IO_SLOT_SIZE);
+                    continue;
+                }
+                inBatch.append({ fromSockAddr(addrs[i]),
+                                 QByteArray(static_cast<const char *>(iovs[i].iov_base), int(msgs[i].msg_len)) });
+            }
+            if (n < IO_BATCH)
+                return; // the kernel queue is empty
+        }
+    }
+#endif
 
 public:
     SafeUdpSocket(QUdpSocket *_sock, QObject *parent = nullptr) : QObject(parent), sess(this), sock(_sock)
@@ -57,6 +161,15 @@ public:
         writtenCount = 0;
     }
 
+    // the endpoint isn't owned
+    SafeUdpSocket(UdpMuxEndpoint *_ep, QObject *parent = nullptr) : QObject(parent), sess(this), ep(_ep)
+    {
+        connect(ep, &UdpMuxEndpoint::readyRead, this, &SafeUdpSocket::sock_readyRead);
+        connect(ep, &UdpMuxEndpoint::datagramsWritten, this, &SafeUdpSocket::datagramsWritten);
+
+        writtenCount = 0;
+    }
+
     ~SafeUdpSocket()
     {
         if (sock) {
@@ -67,6 +180,7 @@ public:
 
     QUdpSocket *release()
     {
+        flushWrites();
         sock->disconnect(this);
         sock->setParent(nullptr);
         QUdpSocket *out = sock;
@@ -74,28 +188,69 @@ public:
         return out;
     }
 
-    TransportAddress localTransportAddress() const { return { sock->localAddress(), sock->localPort() }; }
+    TransportAddress localTransportAddress() const
+    {
+        if (ep)
+            return ep->localAddress();
+        return { sock->localAddress(), sock->localPort() };
+    }
 
-    QHostAddress localAddress() const { return sock->localAddress(); }
+    QHostAddress localAddress() const { return localTransportAddress().addr; }
 
-    quint16 localPort() const { return sock->localPort(); }
+    quint16 localPort() const { return localTransportAddress().port; }
 
-    bool hasPendingDatagrams() const { return sock->hasPendingDatagrams(); }
+    bool hasPendingDatagrams() const
+    {
+        if (ep)
+            return ep->hasPendingDatagrams();
+        return !inBatch.isEmpty() || sock->hasPendingDatagrams();
+    }
 
-    QByteArray readDatagram(TransportAddress &address)
+    // the sender comes as a key, the transport makes a TransportAddress only of what it passes on
+    QByteArray readDatagram(TransportKey &from)
     {
+        if (ep) {
+            TransportAddress address;
+            QByteArray       buf = ep->readDatagram(address);
+            from                 = TransportKey(address);
+            return buf;
+        }
+        if (!inBatch.isEmpty()) {
+            auto dg = inBatch.takeFirst();
+            from    = dg.first;
+            return dg.second;
+        }
         if (!sock->hasPendingDatagrams())
             return QByteArray();
 
-        QByteArray buf;
+        // the first one always goes through QUdpSocket, so it re-arms its read notifier
+        TransportAddress address;
+        QByteArray       buf;
         buf.resize(int(sock->pendingDatagramSize()));
         sock->readDatagram(buf.data(), buf.size(), &address.addr, &address.port);
+        from = TransportKey(address);
+#ifdef Q_OS_LINUX
+        readBatch();
+#endif
         return buf;
     }
 
     void writeDatagram(const QByteArray &buf, const TransportAddress &address)
     {
+        if (ep) {
+            ep->writeDatagram(buf, address);
+            return;
+        }
+#ifdef Q_OS_LINUX
+        // coalesced with whatever else is written in this event loop iteration
+        outBatch.append({ address, buf });
+        if (outBatch.size() >= IO_BATCH)
+            flushWrites();
+        else
+            sess.deferExclusive(this, &SafeUdpSocket::flushWrites);
+#else
         sock->writeDatagram(buf, address.addr, address.port);
+#endif
     }
 
 signals:
@@ -110,7 +265,43 @@ private slots:
         Q_UNUSED(bytes);
 
         ++writtenCount;
-        sess.deferExclusive(this, "processWritten");
+        sess.deferExclusive(this, &SafeUdpSocket::processWritten);
+    }
+
+    void flushWrites()
+    {
+#ifdef Q_OS_LINUX
+        int fd = int(sock->socketDescriptor());
+        while (!outBatch.isEmpty()) {
+            mmsghdr          msgs[IO_BATCH];
+            iovec            iovs[IO_BATCH];
+            sockaddr_storage addrs[IO_BATCH];
+            std::memset(msgs, 0, sizeof(msgs));
+            int count = qMin(int(outBatch.size()), IO_BATCH);
+            for (int i = 0; i < count; ++i) {
+                auto &dg                    = outBatch[i];
+                iovs[i].iov_base            = dg.second.data();
+                iovs[i].iov_len             = size_t(dg.second.size());
+                msgs[i].msg_hdr.msg_iov     = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen  = 1;
+                msgs[i].msg_hdr.msg_name    = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = toSockAddr(dg.first, addrs[i]);
+            }
+            int n = sendmmsg(fd, msgs, unsigned(count), MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // let QUdpSocket deal with it (address mapping, error reporting)
+                auto dg = outBatch.takeFirst();
+                sock->writeDatagram(dg.second, dg.first.addr, dg.first.port);
+                continue;
+            }
+            outBatch.erase(outBatch.begin(), outBatch.begin() + n);
+            writtenCount += n;
+        }
+        if (writtenCount)
+            sess.deferExclusive(this, &SafeUdpSocket::processWritten);
+#endif
     }
 
     void processWritten()
@@ -149,10 +340,18 @@ public:
         QByteArray       buf;
     };
 
+    // received directly. readDatagram() makes the address
+    class DirectDatagram {
+    public:
+        TransportKey from;
+        QByteArray   buf;
+    };
+
     IceLocalTransport       *q;
     ObjectSession            sess;
-    QUdpSocket              *extSock = nullptr;
-    SafeUdpSocket           *sock    = nullptr;
+    QUdpSocket              *extSock     = nullptr;
+    UdpMuxEndpoint          *extEndpoint = nullptr;
+    SafeUdpSocket           *sock        = nullptr;
     StunTransactionPool::Ptr pool;
     StunBinding             *stunBinding   = nullptr;
     TurnClient              *turn          = nullptr;
@@ -163,10 +362,12 @@ public:
     QHostAddress             refAddrSource;
     TransportAddress         stunBindAddr;
     TransportAddress         stunRelayAddr;
+    TransportKey             stunBindKey; // the same two, to tell the servers from the peers on every datagram
+    TransportKey             stunRelayKey;
     QString                  stunUser;
     QCA::SecureArray         stunPass;
     QString                  clientSoftware;
-    QList<Datagram>          in;
+    QList<DirectDatagram>    in;
     QList<Datagram>          inRelayed;
     QList<WriteItem>         pendingWrites;
     int                      retryCount = 0;
@@ -195,7 +396,8 @@ public:
             }
 
             delete sock;
-            sock = nullptr;
+            sock        = nullptr;
+            extEndpoint = nullptr;
         }
 
         addr          = TransportAddress();
@@ -279,6 +481,37 @@ public:
         stunBinding->start(stunBindAddr);
     }
 
+    void stunRefresh()
+    {
+        if (!pool || stunBinding || stopping)
+            return;
+        if (stunBindAddr.isValid()) {
+            do_stun();
+            return;
+        }
+        if (!turnActivated)
+            return;
+
+        // TURN servers answer plain binding requests as well. the allocation tells the reflexive address
+        stunBinding = new StunBinding(pool.data());
+        connect(stunBinding, &StunBinding::success, this, [this]() {
+            bool changed = refAddr != stunBinding->reflexiveAddress();
+            refAddr      = stunBinding->reflexiveAddress();
+
+            delete stunBinding;
+            stunBinding = nullptr;
+
+            if (changed)
+                emit q->addressesChanged();
+        });
+        connect(stunBinding, &StunBinding::error, this, [this](XMPP::StunBinding::Error) {
+            delete stunBinding;
+            stunBinding = nullptr;
+            emit q->error(IceLocalTransport::ErrorStun);
+        });
+        stunBinding->start(stunRelayAddr);
+    }
+
     void do_turn()
     {
         if (!stunRelayAddr.isValid()) {
@@ -374,8 +607,24 @@ private:
         QByteArray       data;
         TransportAddress dataAddr;
 
+        // only STUN goes through the pool. relayed data comes mostly as ChannelData, which goes to the TURN
+        //   client right away
         bool notStun;
-        if (!pool->writeIncomingMessage(buf, &notStun, fromAddr) && turn) {
+        switch (IceTransport::packetKind(buf)) {
+        case IceTransport::StunPacket:
+            if (pool->writeIncomingMessage(buf, &notStun, fromAddr))
+                return false;
+            break;
+        case IceTransport::ChannelDataPacket:
+            notStun = true;
+            break;
+        default:
+            if (debugLevel >= IceTransport::DL_Packet)
+                emit q->debugLine("Warning: server sent neither STUN nor ChannelData, skipping.");
+            return false;
+        }
+
+        if (turn) {
             data = turn->processIncomingDatagram(buf, notStun, dataAddr);
             if (!data.isNull()) {
                 dg->addr = dataAddr;
@@ -399,6 +648,8 @@ private slots:
 
         if (extSock) {
             sock = new SafeUdpSocket(extSock, this);
+        } else if (extEndpoint) {
+            sock = new SafeUdpSocket(extEndpoint, this);
         } else {
             QUdpSocket *qsock = createSocket();
             if (!qsock) {
@@ -422,21 +673,21 @@ private slots:
 
     void sock_readyRead()
     {
+        IRIS_STALL_WATCH(Ice, QStringLiteral("socket"));
         ObjectSessionWatcher watch(&sess);
 
-        QList<Datagram> dreads; // direct
-        QList<Datagram> rreads; // relayed
+        QList<DirectDatagram> dreads; // direct
+        QList<Datagram>       rreads; // relayed
 
         while (sock->hasPendingDatagrams()) {
-            TransportAddress from;
-            Datagram         dg;
+            TransportKey from;
+            Datagram     dg;
 
             QByteArray buf = sock->readDatagram(from);
             if (buf.isEmpty()) // it's weird we ever came here, but should relax static analyzer
                 break;
-            // qDebug("got packet from %s", qPrintable(from));
-            if (from == stunBindAddr || from == stunRelayAddr) {
-                bool haveData = processIncomingStun(buf, from, &dg);
+            if (from == stunBindKey || from == stunRelayKey) {
+                bool haveData = processIncomingStun(buf, from == stunBindKey ? stunBindAddr : stunRelayAddr, &dg);
 
                 // processIncomingStun could cause signals to
                 //   emit.  for example, stopped()
@@ -446,9 +697,7 @@ private slots:
                 if (haveData)
                     rreads += dg;
             } else {
-                dg.addr = from;
-                dg.buf  = buf;
-                dreads += dg;
+                dreads += DirectDatagram { from, buf };
             }
         }
 
@@ -606,7 +855,7 @@ private slots:
         turnActivated     = false;
 
         if (e == TurnClient::ErrorMismatch) {
-            if (!extSock && handleRetry())
+            if (!extSock && !extEndpoint && handleRetry())
                 return;
         }
 
@@ -644,6 +893,12 @@ void IceLocalTransport::start(QUdpSocket *sock)
     d->start();
 }
 
+void IceLocalTransport::start(UdpMuxEndpoint *endpoint)
+{
+    d->extEndpoint = endpoint;
+    d->start();
+}
+
 void IceLocalTransport::start(const QHostAddress &addr)
 {
     d->addr.addr = addr;
@@ -652,12 +907,17 @@ void IceLocalTransport::start(const QHostAddress &addr)
 
 void IceLocalTransport::stop() { d->stop(); }
 
-void IceLocalTransport::setStunBindService(const TransportAddress &addr) { d->stunBindAddr = addr; }
+void IceLocalTransport::setStunBindService(const TransportAddress &addr)
+{
+    d->stunBindAddr = addr;
+    d->stunBindKey  = TransportKey(addr);
+}
 
 void IceLocalTransport::setStunRelayService(const TransportAddress &addr, const QString &user,
                                             const QCA::SecureArray &pass)
 {
     d->stunRelayAddr = addr;
+    d->stunRelayKey  = TransportKey(addr);
     d->stunUser      = user;
     d->stunPass      = pass;
 }
@@ -668,6 +928,8 @@ const TransportAddress &IceLocalTransport::stunRelayServiceAddress() const { ret
 
 void IceLocalTransport::stunStart() { d->stunStart(); }
 
+void IceLocalTransport::stunRefresh() { d->stunRefresh(); }
+
 const TransportAddress &IceLocalTransport::localAddress() const { return d->addr; }
 
 const TransportAddress &IceLocalTransport::serverReflexiveAddress() const { return d->refAddr; }
@@ -700,20 +962,22 @@ bool IceLocalTransport::hasPendingDatagrams(int path) const
 
 QByteArray IceLocalTransport::readDatagram(int path, TransportAddress &addr)
 {
-    QList<Private::Datagram> *in = nullptr;
-    if (path == Direct)
-        in = &d->in;
-    else if (path == Relayed)
-        in = &d->inRelayed;
-    else
-        Q_ASSERT(0);
-
-    if (!in->isEmpty()) {
-        Private::Datagram datagram = in->takeFirst();
+    if (path == Direct) {
+        if (d->in.isEmpty())
+            return QByteArray();
+        Private::DirectDatagram datagram = d->in.takeFirst();
+        addr                             = datagram.from.toTransportAddress();
+        return datagram.buf;
+    } else if (path == Relayed) {
+        if (d->inRelayed.isEmpty())
+            return QByteArray();
+        Private::Datagram datagram = d->inRelayed.takeFirst();
         addr                       = datagram.addr;
         return datagram.buf;
     } else
-        return QByteArray();
+        Q_ASSERT(0);
+
+    return QByteArray();
 }
 
 void IceLocalTransport::writeDatagram(int path, const QByteArray &buf, const TransportAddress &addr)
@@ -33,6 +33,8 @@ class SecureArray;
 }
 
 namespace XMPP {
+class UdpMuxEndpoint;
+
 // this class manages a single port on a single interface, including the
 //   relationship with an associated STUN/TURN server.  if TURN is used, this
 //   class offers two paths (0=direct and 1=relayed), otherwise it offers
@@ -52,6 +54,10 @@ public:
     //   ErrorMismatch retries
     void start(QUdpSocket *sock);
 
+    // shared port, see UdpPortReserver::setMultiplexed(). the endpoint must outlive the
+    //   transport. no STUN/TURN server can be used through it
+    void start(UdpMuxEndpoint *endpoint);
+
     // bind to this address on a random port, do support ErrorMismatch
     //   retries
     void start(const QHostAddress &addr);
@@ -65,6 +71,11 @@ public:
     // obtain relay / reflexive
     void stunStart();
 
+    // binds with the STUN server again after stunStart(), or with the TURN one if there is no other, to
+    //   keep the NAT mapping of an idle port. addressesChanged() may come with the answer, error() if
+    //   there is none
+    void stunRefresh();
+
     const TransportAddress &localAddress() const;
     const TransportAddress &serverReflexiveAddress() const;
     QHostAddress            reflexiveAddressSource() const; // address of stun/turn server provided the srflx
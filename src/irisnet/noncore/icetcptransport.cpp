@@ -0,0 +1,367 @@
+/*
+ * icetcptransport.cpp - ICE-TCP candidates over shared listeners
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "icetcptransport.h"
+
+#include "stunmessage.h"
+#include "stuntypes.h"
+
+#include <QHash>
+#include <QPointer>
+#include <QQueue>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtEndian>
+
+// how long a new connection may take to send its first check
+#define ROUTE_TIMEOUT 10000
+
+// a connectivity check is far smaller, anything bigger coming first isn't ICE
+#define MAX_FIRST_FRAME 1500
+
+// frames received but not read yet, per path. the oldest ones are dropped beyond that
+#define MAX_PACKET_QUEUE 256
+
+namespace XMPP {
+//----------------------------------------------------------------------------
+// IceTcpServer
+//----------------------------------------------------------------------------
+class IceTcpServer::Private : public QObject {
+    Q_OBJECT
+
+public:
+    IceTcpServer                             *q;
+    QPointer<QTcpServer>                      listener; // a child of the scope, which may go first
+    QHash<QString, QPointer<IceTcpTransport>> byUfrag;
+    QHash<QTcpSocket *, QByteArray>           unrouted; // waiting for the first frame
+
+    Private(IceTcpServer *_q) : q(_q) { }
+
+    void accept(QTcpSocket *sock)
+    {
+        sock->setParent(this);
+        unrouted.insert(sock, QByteArray());
+        connect(sock, &QTcpSocket::readyRead, this, [this, sock]() { route(sock); });
+        connect(sock, &QTcpSocket::disconnected, this, [this, sock]() { drop(sock); });
+        QTimer::singleShot(ROUTE_TIMEOUT, sock, [this, sock]() { drop(sock); });
+    }
+
+    void drop(QTcpSocket *sock)
+    {
+        if (unrouted.remove(sock)) {
+            sock->abort();
+            sock->deleteLater();
+        }
+    }
+
+    void route(QTcpSocket *sock)
+    {
+        auto it = unrouted.find(sock);
+        if (it == unrouted.end())
+            return;
+
+        QByteArray &buf = it.value();
+        buf += sock->readAll();
+        if (buf.size() < 2)
+            return;
+        int len = qFromBigEndian<quint16>(buf.constData());
+        if (len > MAX_FIRST_FRAME) {
+            drop(sock);
+            return;
+        }
+        if (buf.size() < 2 + len)
+            return;
+
+        // "<our ufrag>:<their ufrag>"
+        IceTcpTransport *transport = nullptr;
+        StunMessageView  msg;
+        if (msg.parse(reinterpret_cast<const quint8 *>(buf.constData()) + 2, len)
+            && msg.mclass() == StunMessage::Request) {
+            QByteArray user = msg.attribute(StunTypes::USERNAME);
+            int        at   = int(user.indexOf(':'));
+            if (at != -1)
+                transport = byUfrag.value(QString::fromUtf8(user.constData(), at));
+        }
+        if (!transport) {
+            drop(sock);
+            return;
+        }
+
+        QByteArray received = buf;
+        unrouted.erase(it);
+        sock->disconnect(this);
+        transport->takeConnection(sock, received);
+    }
+};
+
+IceTcpServer::IceTcpServer(QTcpServer *serverSocket) : TcpPortServer(serverSocket), d(new Private(this))
+{
+    d->listener = serverSocket;
+    connect(serverSocket, &QTcpServer::newConnection, d.get(), [this]() {
+        while (auto sock = this->serverSocket->nextPendingConnection())
+            d->accept(sock);
+    });
+}
+
+IceTcpServer::~IceTcpServer()
+{
+    // the listener goes with the last agent using it
+    delete d->listener;
+}
+
+bool IceTcpServer::addTransport(const QString &localUfrag, IceTcpTransport *transport)
+{
+    auto &slot = d->byUfrag[localUfrag];
+    if (slot)
+        return false;
+    slot = transport;
+    return true;
+}
+
+void IceTcpServer::removeTransport(const QString &localUfrag) { d->byUfrag.remove(localUfrag); }
+
+//----------------------------------------------------------------------------
+// IceTcpServersProducer
+//----------------------------------------------------------------------------
+TcpPortServer *IceTcpServersProducer::makeServer(QTcpServer *socket) { return new IceTcpServer(socket); }
+
+//----------------------------------------------------------------------------
+// IceTcpTransport
+//----------------------------------------------------------------------------
+class IceTcpTransport::Private : public QObject {
+    Q_OBJECT
+
+public:
+    using Datagram = QPair<TransportAddress, QByteArray>;
+
+    class Connection {
+    public:
+        QTcpSocket      *sock;
+        int              path;
+        TransportAddress peer;
+        QByteArray       inbuf;
+    };
+
+    IceTcpTransport                      *q;
+    QSharedPointer<IceTcpServer>          server;
+    TcpPortServer::Ptr                    serverPtr; // same, for server()
+    QString                               ufrag;
+    TransportAddress                      local;
+    QHash<TransportAddress, Connection *> connections[2]; // by path
+    QQueue<Datagram>                      in[2];
+    int                                   debugLevel = IceTransport::DL_None;
+    bool                                  registered = false;
+
+    Private(IceTcpTransport *_q) : QObject(_q), q(_q) { }
+
+    ~Private()
+    {
+        for (auto &byPeer : connections)
+            qDeleteAll(byPeer);
+        if (registered)
+            server->removeTransport(ufrag);
+    }
+
+    void start()
+    {
+        registered = server->addTransport(ufrag, q);
+        QTimer::singleShot(0, this, [this]() {
+            if (registered)
+                emit q->started();
+            else
+                emit q->error(IceTransport::ErrorGeneric);
+        });
+    }
+
+    void stop()
+    {
+        if (registered) {
+            server->removeTransport(ufrag);
+            registered = false;
+        }
+        for (auto &byPeer : connections) {
+            for (auto c : std::as_const(byPeer)) {
+                c->sock->disconnect(this);
+                c->sock->abort();
+                c->sock->deleteLater();
+                delete c;
+            }
+            byPeer.clear();
+        }
+        QTimer::singleShot(0, this, [this]() { emit q->stopped(); });
+    }
+
+    Connection *addConnection(QTcpSocket *sock, int path, const TransportAddress &peer)
+    {
+        if (auto old = connections[path].take(peer))
+            removeConnection(old);
+
+        auto c  = new Connection;
+        c->sock = sock;
+        c->path = path;
+        c->peer = peer;
+        connections[path].insert(peer, c);
+
+        sock->setParent(this);
+        connect(sock, &QTcpSocket::readyRead, this, [this, c]() { readFrames(c); });
+        connect(sock, &QTcpSocket::disconnected, this, [this, c]() { dropConnection(c); });
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+        connect(sock, &QTcpSocket::errorOccurred, this, [this, c]() {
+#else
+        connect(sock, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this, [this, c]() {
+#endif
+            if (debugLevel >= IceTransport::DL_Info)
+                emit q->debugLine(QLatin1String("tcp connection to ") + c->peer + QLatin1String(" failed: ")
+                                  + c->sock->errorString());
+            dropConnection(c);
+        });
+        return c;
+    }
+
+    void removeConnection(Connection *c)
+    {
+        c->sock->disconnect(this);
+        c->sock->abort();
+        c->sock->deleteLater();
+        delete c;
+    }
+
+    void dropConnection(Connection *c)
+    {
+        auto it = connections[c->path].find(c->peer);
+        if (it == connections[c->path].end() || it.value() != c)
+            return;
+        connections[c->path].erase(it);
+        removeConnection(c);
+    }
+
+    void readFrames(Connection *c)
+    {
+        c->inbuf += c->sock->readAll();
+
+        // RFC 4571: every frame is a 16 bits length and that many bytes
+        int count = 0;
+        int at    = 0;
+        while (c->inbuf.size() - at >= 2) {
+            int len = qFromBigEndian<quint16>(c->inbuf.constData() + at);
+            if (c->inbuf.size() - at - 2 < len)
+                break;
+            if (in[c->path].size() >= MAX_PACKET_QUEUE)
+                in[c->path].dequeue();
+            in[c->path].enqueue({ c->peer, c->inbuf.mid(at + 2, len) });
+            at += 2 + len;
+            ++count;
+        }
+        c->inbuf.remove(0, at);
+
+        if (count)
+            emit q->readyRead(c->path);
+    }
+
+    void write(int path, const QByteArray &buf, const TransportAddress &addr)
+    {
+        if (buf.size() > 0xffff)
+            return;
+
+        auto c = connections[path].value(addr);
+        if (!c) {
+            if (path == Passive) {
+                // the peer has to connect first
+                if (debugLevel >= IceTransport::DL_Packet)
+                    emit q->debugLine(QLatin1String("no tcp connection from ") + addr + QLatin1String(", dropped"));
+                return;
+            }
+            auto sock = new QTcpSocket(this);
+            sock->bind(local.addr, 0);
+            c = addConnection(sock, Active, addr);
+            // writes are buffered by the socket until it's connected
+            sock->connectToHost(addr.addr, addr.port);
+        }
+
+        char header[2];
+        qToBigEndian<quint16>(quint16(buf.size()), header);
+        c->sock->write(header, 2);
+        c->sock->write(buf);
+        emit q->datagramsWritten(path, 1, addr);
+    }
+};
+
+IceTcpTransport::IceTcpTransport(QObject *parent) : IceTransport(parent) { d = new Private(this); }
+
+IceTcpTransport::~IceTcpTransport() { delete d; }
+
+void IceTcpTransport::start(const QSharedPointer<IceTcpServer> &server, const QString &localUfrag)
+{
+    d->server    = server;
+    d->serverPtr = server;
+    d->ufrag     = localUfrag;
+    d->local     = TransportAddress(server->serverAddress(), server->serverPort());
+    d->start();
+}
+
+TransportAddress IceTcpTransport::localAddress() const { return d->local; }
+
+const TcpPortServer::Ptr &IceTcpTransport::server() const { return d->serverPtr; }
+
+void IceTcpTransport::takeConnection(QTcpSocket *sock, const QByteArray &received)
+{
+    auto c   = d->addConnection(sock, Passive, TransportAddress(sock->peerAddress(), sock->peerPort()));
+    c->inbuf = received;
+    d->readFrames(c);
+}
+
+void IceTcpTransport::stop() { d->stop(); }
+
+bool IceTcpTransport::hasPendingDatagrams(int path) const
+{
+    Q_ASSERT(path == Passive || path == Active);
+    return !d->in[path].isEmpty();
+}
+
+QByteArray IceTcpTransport::readDatagram(int path, TransportAddress &addr)
+{
+    Q_ASSERT(path == Passive || path == Active);
+    if (d->in[path].isEmpty())
+        return QByteArray();
+
+    auto datagram = d->in[path].dequeue();
+    addr          = datagram.first;
+    return datagram.second;
+}
+
+void IceTcpTransport::writeDatagram(int path, const QByteArray &buf, const TransportAddress &addr)
+{
+    Q_ASSERT(path == Passive || path == Active);
+    d->write(path, buf, addr);
+}
+
+void IceTcpTransport::addChannelPeer(const TransportAddress &addr)
+{
+    // no TURN channels over a direct connection
+    Q_UNUSED(addr)
+}
+
+void IceTcpTransport::setDebugLevel(DebugLevel level) { d->debugLevel = level; }
+
+void IceTcpTransport::changeThread(QThread *thread) { moveToThread(thread); }
+
+} // namespace XMPP
+
+#include "icetcptransport.moc"
@@ -0,0 +1,103 @@
+/*
+ * icetcptransport.h - ICE-TCP candidates over shared listeners
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ICETCPTRANSPORT_H
+#define ICETCPTRANSPORT_H
+
+#include "icetransport.h"
+#include "tcpportreserver.h"
+#include "transportaddress.h"
+
+#include <QByteArray>
+#include <QEnableSharedFromThis>
+#include <QObject>
+
+#include <memory>
+
+class QTcpSocket;
+
+namespace XMPP {
+class IceTcpTransport;
+
+// a listener shared by all the agents of the process. the first RFC 4571 frame coming over a new
+//   connection is a connectivity check, and the ufrag in front of its USERNAME tells whose it is
+class IceTcpServer : public TcpPortServer {
+    Q_OBJECT
+
+public:
+    IceTcpServer(QTcpServer *serverSocket);
+    ~IceTcpServer();
+
+private:
+    friend class IceTcpTransport;
+
+    // false if the ufrag is taken already
+    bool addTransport(const QString &localUfrag, IceTcpTransport *transport);
+    void removeTransport(const QString &localUfrag);
+
+    class Private;
+    std::unique_ptr<Private> d;
+};
+
+// register it under "ice" with TcpPortReserver::registerScope() to have ICE-TCP candidates
+class IceTcpServersProducer : public TcpPortScope {
+protected:
+    TcpPortServer *makeServer(QTcpServer *socket) override; // in fact returns IceTcpServer
+};
+
+// ICE-TCP (RFC 6544) on one listener. path 0 is the passive candidate on the listener port and carries
+//   the connections the peers made, path 1 is the active one and connects out on the first write to
+//   an address. the datagrams are RFC 4571 frames, one connection per remote address
+class IceTcpTransport : public IceTransport, public QEnableSharedFromThis<IceTcpTransport> {
+    Q_OBJECT
+
+public:
+    enum Path { Passive, Active };
+
+    IceTcpTransport(QObject *parent = nullptr);
+    ~IceTcpTransport();
+
+    // started() comes on the next event loop pass, error() if another agent took the ufrag already
+    void start(const QSharedPointer<IceTcpServer> &server, const QString &localUfrag);
+
+    TransportAddress          localAddress() const; // of the listener
+    const TcpPortServer::Ptr &server() const;
+
+    // reimplemented
+    void       stop() override;
+    bool       hasPendingDatagrams(int path) const override;
+    QByteArray readDatagram(int path, TransportAddress &addr) override;
+    void       writeDatagram(int path, const QByteArray &buf, const TransportAddress &addr) override;
+    void       addChannelPeer(const TransportAddress &addr) override;
+    void       setDebugLevel(DebugLevel level) override;
+    void       changeThread(QThread *thread) override;
+
+private:
+    friend class IceTcpServer;
+
+    // a connection to the listener routed here. received is what was read from it so far
+    void takeConnection(QTcpSocket *sock, const QByteArray &received);
+
+    class Private;
+    friend class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // ICETCPTRANSPORT_H
@@ -35,6 +35,24 @@ public:
 
     enum DebugLevel { DL_None, DL_Info, DL_Packet };
 
+    // RFC 7983 7. the first byte tells the protocols sharing a 5-tuple apart. ZRTP, DTLS and RTP/RTCP all
+    //   belong to the application. anything else isn't defined there and is left to the application too
+    enum PacketKind { StunPacket, ChannelDataPacket, ApplicationPacket, UnknownPacket };
+
+    static PacketKind packetKind(const QByteArray &buf)
+    {
+        if (buf.isEmpty())
+            return UnknownPacket;
+        quint8 b = quint8(buf[0]);
+        if (b <= 3)
+            return StunPacket;
+        if (b >= 64 && b <= 79)
+            return ChannelDataPacket;
+        if ((b >= 16 && b <= 63) || (b >= 128 && b <= 191))
+            return ApplicationPacket;
+        return UnknownPacket;
+    }
+
     IceTransport(QObject *parent = nullptr);
     ~IceTransport();
 
@@ -0,0 +1,216 @@
+/*
+ * icewarmpool.cpp - local transports with the STUN/TURN work done ahead of time
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "icewarmpool.h"
+
+#include "icelocaltransport.h"
+#include "objectsession.h"
+
+#include <QTimer>
+
+// how often an idle transport binds again. NATs tend to forget udp mappings after 30 seconds
+#define REFRESH_INTERVAL 20000
+
+// how long to leave the servers alone after they failed a transport
+#define RETRY_INTERVAL 30000
+
+namespace XMPP {
+bool IceWarmPool::Setup::operator==(const Setup &other) const
+{
+    return addrs == other.addrs && stunBindAddr == other.stunBindAddr && stunRelayAddr == other.stunRelayAddr
+        && stunRelayUser == other.stunRelayUser && stunRelayPass == other.stunRelayPass
+        && clientSoftware == other.clientSoftware;
+}
+
+class IceWarmPool::Private : public QObject {
+    Q_OBJECT
+
+public:
+    class Item {
+    public:
+        QSharedPointer<IceLocalTransport> sock;
+        QHostAddress                      addr;
+        bool                              started = false;
+        bool                              ready   = false; // all the addresses are there
+    };
+
+    IceWarmPool                             *q;
+    ObjectSession                            sess;
+    Setup                                    setup;
+    int                                      size = 1;
+    QList<Item *>                            items;
+    QList<QSharedPointer<IceLocalTransport>> stopping; // releasing their allocations
+    QTimer                                   refreshTimer;
+    QTimer                                   retryTimer;
+
+    Private(IceWarmPool *_q) : QObject(_q), q(_q), sess(this)
+    {
+        refreshTimer.setInterval(REFRESH_INTERVAL);
+        connect(&refreshTimer, &QTimer::timeout, this, &Private::refresh);
+        retryTimer.setSingleShot(true);
+        retryTimer.setInterval(RETRY_INTERVAL);
+        connect(&retryTimer, &QTimer::timeout, this, &Private::fill);
+    }
+
+    ~Private() { qDeleteAll(items); }
+
+    void release(Item *item)
+    {
+        items.removeOne(item);
+        auto sock    = item->sock;
+        bool started = item->started;
+        delete item;
+
+        sock->disconnect(this);
+        if (!started)
+            return;
+
+        // the server deletes the allocation when asked, otherwise it lingers there until it expires
+        auto sp = sock.data();
+        connect(sp, &IceLocalTransport::stopped, this, [this, sp]() {
+            auto it = std::find_if(stopping.begin(), stopping.end(), [&](auto const &s) { return s == sp; });
+            if (it != stopping.end())
+                stopping.erase(it);
+        });
+        stopping += sock;
+        sock->stop();
+    }
+
+    QSharedPointer<IceLocalTransport> take(const QHostAddress &addr)
+    {
+        auto it = std::find_if(items.begin(), items.end(), [&](auto const &i) { return i->ready && i->addr == addr; });
+        if (it == items.end())
+            return {};
+
+        auto item = *it;
+        items.erase(it);
+        auto sock = item->sock;
+        delete item;
+
+        sock->disconnect(this);
+        sess.deferExclusive(this, &Private::fill);
+        return sock;
+    }
+
+    void trim()
+    {
+        for (int n = int(items.count()) - 1; n >= 0; --n) {
+            auto item = items[n];
+            int  same = int(std::count_if(items.begin(), items.begin() + n,
+                                          [&](auto const &i) { return i->addr == item->addr; }));
+            if (same >= size || !setup.addrs.contains(item->addr))
+                release(item);
+        }
+    }
+
+    void fill()
+    {
+        // nothing to wait for without the servers
+        if (retryTimer.isActive() || (!setup.stunBindAddr.isValid() && !setup.stunRelayAddr.isValid()))
+            return;
+
+        for (auto const &addr : std::as_const(setup.addrs)) {
+            int have = int(std::count_if(items.begin(), items.end(), [&](auto const &i) { return i->addr == addr; }));
+            for (; have < size; ++have)
+                items += createItem(addr);
+        }
+
+        if (!items.isEmpty() && !refreshTimer.isActive())
+            refreshTimer.start();
+    }
+
+private:
+    Item *createItem(const QHostAddress &addr)
+    {
+        auto item  = new Item;
+        item->addr = addr;
+        // it may go away in its own signal
+        item->sock = QSharedPointer<IceLocalTransport>(new IceLocalTransport, &QObject::deleteLater);
+
+        auto sock = item->sock.data();
+        sock->setClientSoftwareNameAndVersion(setup.clientSoftware);
+        if (setup.stunBindAddr.isValid())
+            sock->setStunBindService(setup.stunBindAddr);
+        if (setup.stunRelayAddr.isValid())
+            sock->setStunRelayService(setup.stunRelayAddr, setup.stunRelayUser, setup.stunRelayPass);
+
+        connect(sock, &IceLocalTransport::started, this, [item]() {
+            item->started = true;
+            item->sock->stunStart();
+        });
+        connect(sock, &IceLocalTransport::addressesChanged, this, [this, item]() {
+            auto const &s = item->sock;
+            item->ready   = (!setup.stunBindAddr.isValid() || s->serverReflexiveAddress().isValid())
+                && (!setup.stunRelayAddr.isValid() || s->relayedAddress().isValid());
+        });
+        connect(sock, &IceLocalTransport::error, this, [this, item](int) {
+            // likely the next one would fail the same way
+            release(item);
+            retryTimer.start();
+        });
+
+        sock->start(addr);
+        return item;
+    }
+
+private slots:
+    void refresh()
+    {
+        if (items.isEmpty()) {
+            refreshTimer.stop();
+            return;
+        }
+
+        for (auto item : std::as_const(items)) {
+            if (item->ready)
+                item->sock->stunRefresh();
+        }
+    }
+};
+
+IceWarmPool::IceWarmPool(QObject *parent) : QObject(parent) { d = new Private(this); }
+
+IceWarmPool::~IceWarmPool() { delete d; }
+
+void IceWarmPool::setSize(int count)
+{
+    d->size = qMax(count, 0);
+    d->trim();
+    d->fill();
+}
+
+int IceWarmPool::size() const { return d->size; }
+
+void IceWarmPool::prepare(const Setup &setup)
+{
+    if (setup == d->setup)
+        return;
+
+    d->setup = setup;
+    while (!d->items.isEmpty())
+        d->release(d->items.first());
+    d->retryTimer.stop();
+    d->fill();
+}
+
+QSharedPointer<IceLocalTransport> IceWarmPool::take(const QHostAddress &addr) { return d->take(addr); }
+
+} // namespace XMPP
+
+#include "icewarmpool.moc"
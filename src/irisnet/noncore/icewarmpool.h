@@ -0,0 +1,78 @@
+/*
+ * icewarmpool.h - local transports with the STUN/TURN work done ahead of time
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ICEWARMPOOL_H
+#define ICEWARMPOOL_H
+
+#include "transportaddress.h"
+
+#include <QHostAddress>
+#include <QList>
+#include <QObject>
+#include <QSharedPointer>
+#include <QtCrypto>
+
+namespace XMPP {
+class IceLocalTransport;
+
+// keeps a few started IceLocalTransport per local address, with the reflexive address and the TURN
+//   allocation obtained already, so a new agent has its candidates right away instead of after the
+//   server round trips. the idle allocations are refreshed by their StunAllocate, the reflexive
+//   addresses are bound again now and then to keep the NAT mappings
+class IceWarmPool : public QObject {
+    Q_OBJECT
+
+public:
+    // what the transports are warmed up for. only ipv4 addresses, like IceComponent does it
+    class Setup {
+    public:
+        QList<QHostAddress> addrs;
+        TransportAddress    stunBindAddr;
+        TransportAddress    stunRelayAddr;
+        QString             stunRelayUser;
+        QCA::SecureArray    stunRelayPass;
+        QString             clientSoftware;
+
+        bool operator==(const Setup &other) const;
+        bool operator!=(const Setup &other) const { return !(*this == other); }
+    };
+
+    IceWarmPool(QObject *parent = nullptr);
+    ~IceWarmPool();
+
+    // idle transports per address, 1 by default. 0 releases them
+    void setSize(int count);
+    int  size() const;
+
+    // the agents tell what they use, and the next ones likely want the same. a change releases the
+    //   transports prepared for the old setup
+    void prepare(const Setup &setup);
+
+    // a ready transport on addr for the last prepared setup, or null. it's started and stunStart()
+    //   was called already, the addresses are known. the pool makes a new one in its place
+    QSharedPointer<IceLocalTransport> take(const QHostAddress &addr);
+
+private:
+    class Private;
+    friend class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // ICEWARMPOOL_H
@@ -18,16 +18,12 @@
  */
 
 //! \class NDns ndns.h
-//! \brief Simple DNS resolution using native system calls
+//! \brief Simple resolution of a host name to one IPv4 address
 //!
-//! This class is to be used when Qt's QDns is not good enough.  Because QDns
-//! does not use threads, it cannot make a system call asyncronously.  Thus,
-//! QDns tries to imitate the behavior of each platform's native behavior, and
-//! generally falls short.
-//!
-//! NDns uses a thread to make the system call happen in the background.  This
-//! gives your program native DNS behavior, at the cost of requiring threads
-//! to build.
+//! NDns is kept for older code.  It is a thin wrapper around XMPP::NameResolver,
+//! so its lookups are shared with the rest of the process: a name another
+//! resolver is asking for already is not asked twice, and the answers come
+//! from the cache of the resolver backend while their TTL lasts.
 //!
 //! \code
 //! #include "ndns.h"
@@ -107,7 +103,7 @@ bool NDns::isBusy() const { return busy; }
 
 void NDns::dns_resultsReady(const QList<XMPP::NameRecord> &results)
 {
-    addr = results[0].address();
+    addr = results.isEmpty() ? QHostAddress() : results.first().address();
     busy = false;
     emit resultsReady();
 }
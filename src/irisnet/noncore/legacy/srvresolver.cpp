@@ -19,10 +19,6 @@
 
 #include "srvresolver.h"
 
-#ifndef NO_NDNS
-#include "ndns.h"
-#endif
-
 // CS_NAMESPACE_BEGIN
 static void sortSRVList(QList<Q3Dns::Server> &list)
 {
@@ -50,23 +46,14 @@ static void sortSRVList(QList<Q3Dns::Server> &list)
 
 class SrvResolver::Private {
 public:
-    Private(SrvResolver *_q) :
-        nndns(_q),
-#ifndef NO_NDNS
-        ndns(_q),
-#endif
-        t(_q)
-    {
-    }
+    Private(SrvResolver *_q) : nndns(_q), t(_q) { }
 
+    // the records are asked the way ServiceResolver does it, aaaa before a, so the answers are shared
+    //   with the connector through the name manager and the backend cache
     XMPP::NameResolver     nndns;
     XMPP::NameRecord::Type nntype;
     bool                   nndns_busy;
 
-#ifndef NO_NDNS
-    NDns ndns;
-#endif
-
     bool         failed;
     QHostAddress resultAddress;
     quint16      resultPort;
@@ -87,10 +74,6 @@ SrvResolver::SrvResolver(QObject *parent) : QObject(parent)
     connect(&d->nndns, SIGNAL(resultsReady(QList<XMPP::NameRecord>)),
             SLOT(nndns_resultsReady(QList<XMPP::NameRecord>)));
     connect(&d->nndns, SIGNAL(error(XMPP::NameResolver::Error)), SLOT(nndns_error(XMPP::NameResolver::Error)));
-
-#ifndef NO_NDNS
-    connect(&d->ndns, SIGNAL(resultsReady()), SLOT(ndns_done()));
-#endif
     connect(&d->t, SIGNAL(timeout()), SLOT(t_timeout()));
     stop();
 }
@@ -145,10 +128,6 @@ void SrvResolver::stop()
         d->nndns.stop();
         d->nndns_busy = false;
     }
-#ifndef NO_NDNS
-    if (d->ndns.isBusy())
-        d->ndns.stop();
-#endif
     d->resultAddress = QHostAddress();
     d->resultPort    = 0;
     d->servers.clear();
@@ -156,17 +135,7 @@ void SrvResolver::stop()
     d->failed = true;
 }
 
-bool SrvResolver::isBusy() const
-{
-#ifndef NO_NDNS
-    if (d->nndns_busy || d->ndns.isBusy())
-#else
-    if (d->nndns_busy)
-#endif
-        return true;
-    else
-        return false;
-}
+bool SrvResolver::isBusy() const { return d->nndns_busy; }
 
 QList<Q3Dns::Server> SrvResolver::servers() const { return d->servers; }
 
@@ -178,13 +147,9 @@ quint16 SrvResolver::resultPort() const { return d->resultPort; }
 
 void SrvResolver::tryNext()
 {
-#ifndef NO_NDNS
-    d->ndns.resolve(d->servers.first().name);
-#else
     d->nndns_busy = true;
     d->nntype     = d->aaaa ? XMPP::NameRecord::Aaaa : XMPP::NameRecord::A;
     d->nndns.start(d->servers.first().name.toLatin1(), d->nntype);
-#endif
 }
 
 void SrvResolver::nndns_resultsReady(const QList<XMPP::NameRecord> &results)
@@ -259,31 +224,6 @@ void SrvResolver::nndns_resultsReady(const QList<XMPP::NameRecord> &results)
 
 void SrvResolver::nndns_error(XMPP::NameResolver::Error) { nndns_resultsReady(QList<XMPP::NameRecord>()); }
 
-void SrvResolver::ndns_done()
-{
-#ifndef NO_NDNS
-    QHostAddress r    = d->ndns.result();
-    int          port = d->servers.first().port;
-    d->servers.removeFirst();
-
-    if (!r.isNull()) {
-        d->resultAddress = d->ndns.result();
-        d->resultPort    = quint16(port);
-        emit resultsReady();
-    } else {
-        // failed?  bail if last one
-        if (d->servers.isEmpty()) {
-            stop();
-            emit resultsReady();
-            return;
-        }
-
-        // otherwise try the next
-        tryNext();
-    }
-#endif
-}
-
 void SrvResolver::t_timeout()
 {
     stop();
@@ -66,7 +66,6 @@ signals:
 private slots:
     void nndns_resultsReady(const QList<XMPP::NameRecord> &);
     void nndns_error(XMPP::NameResolver::Error);
-    void ndns_done();
     void t_timeout();
 
 private:
@@ -0,0 +1,455 @@
+/*
+ * natbehavior.cpp - what the NAT and the firewall of the local network let through
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "natbehavior.h"
+
+#include "corelib/irisnetglobal_p.h"
+#include "netinterface.h"
+#include "stunmessage.h"
+#include "stuntypes.h"
+
+#include <QHash>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUdpSocket>
+#include <QtCrypto>
+
+#include <algorithm>
+
+// msecs before the binding of a test is sent again, doubled each time
+#define RTO 500
+
+// times the binding of a test is sent. with the RTO above a test without an answer takes 3.5 secs
+#define SENDS 3
+
+// msecs a tcp connect may take
+#define TCP_TIMEOUT 5000
+
+// secs a result is good for by default
+#define MAX_AGE 86400
+
+namespace XMPP {
+static QLatin1String mappingName(NatBehavior::Mapping m)
+{
+    switch (m) {
+    case NatBehavior::NoNat:
+        return QLatin1String("none");
+    case NatBehavior::EndpointIndependentMapping:
+        return QLatin1String("endpoint-independent");
+    case NatBehavior::AddressDependentMapping:
+        return QLatin1String("address-dependent");
+    case NatBehavior::AddressPortDependentMapping:
+        return QLatin1String("address-port-dependent");
+    default:
+        return QLatin1String("unknown");
+    }
+}
+
+static QLatin1String filteringName(NatBehavior::Filtering f)
+{
+    switch (f) {
+    case NatBehavior::EndpointIndependentFiltering:
+        return QLatin1String("endpoint-independent");
+    case NatBehavior::AddressDependentFiltering:
+        return QLatin1String("address-dependent");
+    case NatBehavior::AddressPortDependentFiltering:
+        return QLatin1String("address-port-dependent");
+    default:
+        return QLatin1String("unknown");
+    }
+}
+
+QString NatBehavior::toString() const
+{
+    if (isNull())
+        return QLatin1String("not probed");
+    auto yesNo = [](bool b) { return QLatin1String(b ? "yes" : "no"); };
+    return QString(QLatin1String("udp=%1 mapping=%2 filtering=%3 tcp=%4 tcp443=%5"))
+        .arg(yesNo(udp), mappingName(mapping), filteringName(filtering), yesNo(tcp), yesNo(tcp443));
+}
+
+class NatBehaviorCache::Private : public QObject {
+    Q_OBJECT
+
+public:
+    enum Test { NoTest, BindingTest, MappingTestII, MappingTestIII, FilteringTestII, FilteringTestIII };
+
+    NatBehaviorCache           *q;
+    int                         maxAge = MAX_AGE;
+    QHash<QString, NatBehavior> results; // by network
+    NetInterfaceManager         netman;
+    NetGatewayProvider         *gateways = nullptr;
+
+    // the running probe
+    NatBehavior         current;
+    TransportAddress    server;
+    TransportAddress    other;  // of the server, from OTHER-ADDRESS
+    TransportAddress    mapped; // by the last test which got one
+    QUdpSocket         *udp  = nullptr;
+    Test                test = NoTest;
+    TransportAddress    target;
+    QByteArray          id;     // of the binding of the test
+    QByteArray          packet; // the binding, for the retransmissions
+    int                 sends = 0;
+    QTimer              rto;
+    QList<QTcpSocket *> tcps;
+    QTimer              tcpTimeout;
+
+    Private(NatBehaviorCache *_q) : QObject(_q), q(_q), rto(this), tcpTimeout(this)
+    {
+        for (IrisNetProvider *p : irisNetProviders(IrisNetGateways)) {
+            gateways = p->createNetGatewayProvider();
+            if (gateways) {
+                gateways->setParent(this);
+                break;
+            }
+        }
+
+        rto.setSingleShot(true);
+        connect(&rto, &QTimer::timeout, this, &Private::rto_timeout);
+        tcpTimeout.setSingleShot(true);
+        tcpTimeout.setInterval(TCP_TIMEOUT);
+        connect(&tcpTimeout, &QTimer::timeout, this, [this]() {
+            for (auto sock : std::as_const(tcps)) {
+                sock->disconnect(this);
+                sock->deleteLater();
+            }
+            tcps.clear();
+            finish();
+        });
+    }
+
+    bool isProbing() const { return !current.isNull(); }
+
+    // ipv4 only, the ipv6 ones come and go with the privacy extensions and would make a new network each time
+    QList<QHostAddress> localAddresses(const QString &ifaceId)
+    {
+        QList<QHostAddress> out;
+        NetInterface        iface(ifaceId, &netman);
+        for (const auto &addr : iface.addresses())
+            if (addr.protocol() == QAbstractSocket::IPv4Protocol)
+                out += addr;
+        return out;
+    }
+
+    QString network()
+    {
+        QStringList parts;
+        if (gateways) {
+            gateways->start(); // polls
+            for (const auto &g : gateways->gateways())
+                parts += QLatin1String("gw ") + g.ifaceId + QLatin1Char(' ') + g.gateway.toString();
+        }
+        for (const auto &id : netman.interfaces()) {
+            QStringList addrs;
+            for (const auto &addr : localAddresses(id))
+                addrs += addr.toString();
+            if (!addrs.isEmpty())
+                parts += QLatin1String("if ") + id + QLatin1Char(' ') + addrs.join(QLatin1Char(','));
+        }
+        std::sort(parts.begin(), parts.end());
+        return parts.join(QLatin1Char(';'));
+    }
+
+    NatBehavior behavior()
+    {
+        auto it = results.constFind(network());
+        if (it == results.constEnd() || it->probed.secsTo(QDateTime::currentDateTimeUtc()) > maxAge)
+            return NatBehavior();
+        return *it;
+    }
+
+    void probe(const TransportAddress &stunServer, QList<TransportAddress> tcpServers)
+    {
+        auto net = network();
+        if (isProbing() || net.isEmpty() || !stunServer.isValid()
+            || stunServer.addr.protocol() != QAbstractSocket::IPv4Protocol)
+            return;
+        auto it = results.constFind(net);
+        if (it != results.constEnd() && it->probed.secsTo(QDateTime::currentDateTimeUtc()) <= maxAge)
+            return;
+
+        current         = NatBehavior();
+        current.network = net;
+        server          = stunServer;
+        other           = TransportAddress();
+        mapped          = TransportAddress();
+
+        // before the tcp connects, so one failing right away doesn't finish the probe
+        udp = new QUdpSocket(this);
+        connect(udp, &QUdpSocket::readyRead, this, &Private::udp_readyRead);
+
+        if (tcpServers.isEmpty())
+            tcpServers = { server, TransportAddress(server.addr, 443) };
+        for (const auto &addr : std::as_const(tcpServers)) {
+            if (!addr.isValid())
+                continue;
+            auto sock = new QTcpSocket(this);
+            tcps += sock;
+            connect(sock, &QTcpSocket::connected, this, [this, sock, addr]() {
+                if (addr.port == 443)
+                    current.tcp443 = true;
+                else
+                    current.tcp = true;
+                tcpDone(sock);
+            });
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+            connect(sock, &QTcpSocket::errorOccurred, this, [this, sock]() { tcpDone(sock); });
+#else
+            connect(sock, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this,
+                    [this, sock]() { tcpDone(sock); });
+#endif
+            sock->connectToHost(addr.addr, addr.port);
+        }
+        if (!tcps.isEmpty())
+            tcpTimeout.start();
+
+        if (udp->bind(QHostAddress::AnyIPv4, 0))
+            startTest(BindingTest, server);
+        else
+            udpFinished();
+    }
+
+    void startTest(Test t, const TransportAddress &to, bool changeIp = false, bool changePort = false)
+    {
+        test   = t;
+        target = to;
+        id     = QCA::Random::randomArray(12).toByteArray();
+
+        StunMessage message;
+        message.setClass(StunMessage::Request);
+        message.setMethod(StunTypes::Binding);
+        message.setId(reinterpret_cast<const quint8 *>(id.constData()));
+        if (changeIp || changePort) {
+            StunMessage::Attribute a;
+            a.type  = StunTypes::CHANGE_REQUEST;
+            a.value = StunTypes::createChangeRequest(changeIp, changePort);
+            message.setAttributes({ a });
+        }
+        packet = message.toBinary();
+        sends  = 0;
+        send();
+    }
+
+    void send()
+    {
+        udp->writeDatagram(packet, target.addr, target.port);
+        rto.start(RTO << sends);
+        ++sends;
+    }
+
+    static TransportAddress mappedAddress(const StunMessage &response)
+    {
+        TransportAddress addr;
+        auto             val = response.attribute(StunTypes::XOR_MAPPED_ADDRESS);
+        if (!val.isNull())
+            StunTypes::parseXorMappedAddress(val, response.magic(), response.id(), addr);
+        else if (!(val = response.attribute(StunTypes::MAPPED_ADDRESS)).isNull())
+            StunTypes::parseMappedAddress(val, addr);
+        return addr;
+    }
+
+    bool isLocal(const TransportAddress &addr)
+    {
+        if (addr.port != udp->localPort())
+            return false;
+        for (const auto &id : netman.interfaces())
+            if (localAddresses(id).contains(addr.addr))
+                return true;
+        return false;
+    }
+
+    void startFiltering()
+    {
+        // the server answers from its other address and port, then from its other port only
+        startTest(FilteringTestII, server, true, true);
+    }
+
+    // response is null when the test got no answer
+    void testDone(const StunMessage *response)
+    {
+        rto.stop();
+        TransportAddress addr;
+        if (response) {
+            if (test == BindingTest)
+                current.udp = true;
+            if (response->mclass() != StunMessage::SuccessResponse) {
+                // most likely a server without CHANGE-REQUEST. what is known so far stays
+                udpFinished();
+                return;
+            }
+            addr = mappedAddress(*response);
+        }
+
+        switch (test) {
+        case BindingTest:
+            if (!response || !addr.isValid()) {
+                udpFinished();
+                return;
+            }
+            mapped = addr;
+            if (isLocal(mapped))
+                current.mapping = NatBehavior::NoNat;
+            if (response->hasAttribute(StunTypes::OTHER_ADDRESS))
+                StunTypes::parseOtherAddress(response->attribute(StunTypes::OTHER_ADDRESS), other);
+            if (!other.isValid() || other.addr == server.addr || other.port == server.port) {
+                udpFinished(); // no RFC5780 on the server
+                return;
+            }
+            if (current.mapping == NatBehavior::NoNat)
+                startFiltering();
+            else
+                startTest(MappingTestII, TransportAddress(other.addr, server.port));
+            return;
+        case MappingTestII:
+            if (!addr.isValid()) {
+                startFiltering();
+            } else if (addr == mapped) {
+                current.mapping = NatBehavior::EndpointIndependentMapping;
+                startFiltering();
+            } else {
+                mapped = addr;
+                startTest(MappingTestIII, other);
+            }
+            return;
+        case MappingTestIII:
+            if (addr.isValid())
+                current.mapping = addr == mapped ? NatBehavior::AddressDependentMapping
+                                                 : NatBehavior::AddressPortDependentMapping;
+            startFiltering();
+            return;
+        case FilteringTestII:
+            if (response) {
+                current.filtering = NatBehavior::EndpointIndependentFiltering;
+                udpFinished();
+            } else {
+                startTest(FilteringTestIII, server, false, true);
+            }
+            return;
+        case FilteringTestIII:
+            current.filtering
+                = response ? NatBehavior::AddressDependentFiltering : NatBehavior::AddressPortDependentFiltering;
+            udpFinished();
+            return;
+        case NoTest:
+            return;
+        }
+    }
+
+    void udpFinished()
+    {
+        rto.stop();
+        test = NoTest;
+        if (udp) {
+            udp->disconnect(this);
+            udp->deleteLater();
+            udp = nullptr;
+        }
+        finish();
+    }
+
+    void tcpDone(QTcpSocket *sock)
+    {
+        sock->disconnect(this);
+        sock->deleteLater();
+        tcps.removeOne(sock);
+        if (tcps.isEmpty()) {
+            tcpTimeout.stop();
+            finish();
+        }
+    }
+
+    void finish()
+    {
+        if (udp || !tcps.isEmpty() || !isProbing())
+            return;
+        current.probed           = QDateTime::currentDateTimeUtc();
+        results[current.network] = current;
+        current                  = NatBehavior();
+        emit q->finished();
+    }
+
+    void cancel()
+    {
+        for (auto sock : std::as_const(tcps)) {
+            sock->disconnect(this);
+            sock->deleteLater();
+        }
+        tcps.clear();
+        tcpTimeout.stop();
+        current = NatBehavior();
+        udpFinished();
+    }
+
+private slots:
+    void rto_timeout()
+    {
+        if (sends < SENDS)
+            send();
+        else
+            testDone(nullptr);
+    }
+
+    void udp_readyRead()
+    {
+        while (udp && udp->hasPendingDatagrams()) {
+            auto size = udp->pendingDatagramSize();
+            if (size < 0)
+                return;
+            QByteArray buf(int(size), 0);
+            if (udp->readDatagram(buf.data(), buf.size()) < 0)
+                return;
+            // the filtering tests are answered from the other address, so only the id tells them apart
+            auto message = StunMessage::fromBinary(buf);
+            if (test == NoTest || message.isNull() || message.mclass() == StunMessage::Request
+                || message.mclass() == StunMessage::Indication
+                || QByteArray::fromRawData(reinterpret_cast<const char *>(message.id()), 12) != id)
+                continue;
+            testDone(&message);
+        }
+    }
+};
+
+NatBehaviorCache::NatBehaviorCache(QObject *parent) : QObject(parent) { d = new Private(this); }
+
+NatBehaviorCache::~NatBehaviorCache() { delete d; }
+
+void NatBehaviorCache::setMaxAge(int secs) { d->maxAge = secs; }
+
+int NatBehaviorCache::maxAge() const { return d->maxAge; }
+
+QString NatBehaviorCache::currentNetwork() const { return d->network(); }
+
+NatBehavior NatBehaviorCache::behavior() const { return d->behavior(); }
+
+void NatBehaviorCache::probe(const TransportAddress &stunServer, const QList<TransportAddress> &tcpServers)
+{
+    d->probe(stunServer, tcpServers);
+}
+
+bool NatBehaviorCache::isProbing() const { return d->isProbing(); }
+
+void NatBehaviorCache::clear()
+{
+    d->cancel();
+    d->results.clear();
+}
+} // namespace XMPP
+
+#include "natbehavior.moc"
@@ -0,0 +1,107 @@
+/*
+ * natbehavior.h - what the NAT and the firewall of the local network let through
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NATBEHAVIOR_H
+#define NATBEHAVIOR_H
+
+#include "transportaddress.h"
+
+#include <QDateTime>
+#include <QList>
+#include <QObject>
+#include <QString>
+
+namespace XMPP {
+// the result of a probe, see NatBehaviorCache. the mapping and the filtering are the ones of RFC5780, they stay
+//   unknown when the server doesn't tell its other address
+class NatBehavior {
+public:
+    enum Mapping {
+        UnknownMapping,
+        NoNat, // the reflexive address is a local one
+        EndpointIndependentMapping,
+        AddressDependentMapping,
+        AddressPortDependentMapping
+    };
+
+    enum Filtering {
+        UnknownFiltering,
+        EndpointIndependentFiltering,
+        AddressDependentFiltering,
+        AddressPortDependentFiltering
+    };
+
+    QString   network; // see NatBehaviorCache::currentNetwork()
+    QDateTime probed;
+    bool      udp       = false; // a binding got an answer
+    Mapping   mapping   = UnknownMapping;
+    Filtering filtering = UnknownFiltering;
+    bool      tcp       = false; // a connect to a port other than 443 worked
+    bool      tcp443    = false; // a connect to port 443 worked, the usual way out of the strict networks
+
+    bool isNull() const { return network.isEmpty(); }
+
+    bool isUdpBlocked() const { return !isNull() && !udp; }
+    // the mapping is per destination, so the reflexive address from the STUN server isn't the one a peer sees
+    bool isSymmetric() const { return mapping == AddressDependentMapping || mapping == AddressPortDependentMapping; }
+    bool isTcp443Only() const { return !isNull() && !udp && !tcp && tcp443; }
+
+    QString toString() const; // for the logs
+};
+
+// probes the network in the background, once per network the host is on, and keeps the results. a network is
+//   told apart by its gateways and the local interfaces with their ipv4 addresses, so coming back to a known one
+//   needs no new probe. the mapping and filtering tests (RFC5780 4.3, 4.4) are done on a socket of their own
+//   against a server which has an OTHER-ADDRESS in its answers, the tcp ones are plain connects. meant to be one
+//   per application, shared by the agents, see Ice176::setNatBehaviorCache()
+class NatBehaviorCache : public QObject {
+    Q_OBJECT
+
+public:
+    NatBehaviorCache(QObject *parent = nullptr);
+    ~NatBehaviorCache();
+
+    // a result older than this is probed again. 1 day by default
+    void setMaxAge(int secs);
+    int  maxAge() const;
+
+    // gateways from the platform's NetGatewayProvider (linux only for now), and the interfaces
+    QString currentNetwork() const;
+
+    // of the current network, null if it isn't probed yet or the result is too old
+    NatBehavior behavior() const;
+
+    // unless the current network has a result already or it's being probed. the tcp connects go to tcpServers,
+    //   or to the STUN server on its port and on 443 if empty. ipv4 only, like the agents
+    void probe(const TransportAddress &stunServer, const QList<TransportAddress> &tcpServers = {});
+    bool isProbing() const;
+
+    void clear();
+
+signals:
+    void finished(); // behavior() knows the probed network now
+
+private:
+    class Private;
+    friend class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // NATBEHAVIOR_H
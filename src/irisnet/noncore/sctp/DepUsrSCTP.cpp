@@ -159,7 +159,8 @@ DepUsrSCTP::Checker::Checker()
     MS_TRACE();
 
     this->timer = new QTimer();
-    QObject::connect(this->timer, &QTimer::timeout, qApp, [this]() { OnTimer(); });
+    // the timer context keeps OnTimer() on the thread which runs usrsctp
+    QObject::connect(this->timer, &QTimer::timeout, this->timer, [this]() { OnTimer(); });
 }
 
 DepUsrSCTP::Checker::~Checker()
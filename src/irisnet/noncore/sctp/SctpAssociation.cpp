@@ -82,7 +82,6 @@ inline static int onSendSctpData(struct socket * /*sock*/, uint32_t freeBuffer,
 namespace RTC {
 /* Static. */
 
-static constexpr size_t   SctpMtu { 1200 };
 static constexpr uint16_t MaxSctpStreams { 65535 };
 
 /* Instance methods. */
@@ -240,8 +239,6 @@ SctpAssociation::~SctpAssociation()
 
     // Register the SctpAssociation from the global map.
     DepUsrSCTP::DeregisterSctpAssociation(this);
-
-    delete[] this->messageBuffer;
 }
 
 void SctpAssociation::TransportConnected()
@@ -270,20 +267,7 @@ void SctpAssociation::TransportConnected()
             MS_THROW_ERROR("usrsctp_connect() failed: %s", std::strerror(errno));
 
         // Disable MTU discovery.
-        sctp_paddrparams peerAddrParams; // NOLINT(cppcoreguidelines-pro-type-member-init)
-
-        std::memset(&peerAddrParams, 0, sizeof(peerAddrParams));
-        std::memcpy(&peerAddrParams.spp_address, &rconn, sizeof(rconn));
-        peerAddrParams.spp_flags = SPP_PMTUD_DISABLE;
-
-        // The MTU value provided specifies the space available for chunks in the
-        // packet, so let's subtract the SCTP header size.
-        peerAddrParams.spp_pathmtu = SctpMtu - sizeof(struct sctp_common_header);
-
-        ret = usrsctp_setsockopt(this->socket, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &peerAddrParams,
-                                 sizeof(peerAddrParams));
-
-        if (ret < 0)
+        if (!ApplyMtu())
             MS_THROW_ERROR("usrsctp_setsockopt(SCTP_PEER_ADDR_PARAMS) failed: %s", std::strerror(errno));
 
         // Announce connecting state.
@@ -295,6 +279,105 @@ void SctpAssociation::TransportConnected()
     }
 }
 
+bool SctpAssociation::SetBufferSizes(size_t sendBufferSize, size_t recvBufferSize)
+{
+    MS_TRACE();
+
+    auto bufferSize = static_cast<int>(sendBufferSize);
+
+    if (usrsctp_setsockopt(this->socket, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(int)) < 0) {
+        MS_WARN_TAG(sctp, "usrsctp_setsockopt(SO_SNDBUF) failed: %s", std::strerror(errno));
+
+        return false;
+    }
+
+    this->sctpSendBufferSize = sendBufferSize;
+
+    bufferSize = static_cast<int>(recvBufferSize);
+
+    if (usrsctp_setsockopt(this->socket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(int)) < 0) {
+        MS_WARN_TAG(sctp, "usrsctp_setsockopt(SO_RCVBUF) failed: %s", std::strerror(errno));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool SctpAssociation::SetInterleaving(bool enabled)
+{
+    MS_TRACE();
+
+    // I-DATA may be announced only when the user messages of different streams may interleave on delivery.
+    int level = enabled ? 2 : 0;
+
+    if (usrsctp_setsockopt(this->socket, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &level, sizeof(level)) < 0) {
+        MS_WARN_TAG(sctp, "usrsctp_setsockopt(SCTP_FRAGMENT_INTERLEAVE) failed: %s", std::strerror(errno));
+
+        return false;
+    }
+
+    struct sctp_assoc_value av; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    std::memset(&av, 0, sizeof(av));
+    av.assoc_value = enabled ? 1 : 0;
+
+    if (usrsctp_setsockopt(this->socket, IPPROTO_SCTP, SCTP_INTERLEAVING_SUPPORTED, &av, sizeof(av)) < 0) {
+        MS_WARN_TAG(sctp, "usrsctp_setsockopt(SCTP_INTERLEAVING_SUPPORTED) failed: %s", std::strerror(errno));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool SctpAssociation::SetMtu(size_t mtu)
+{
+    MS_TRACE();
+
+    this->mtu = mtu;
+
+    // Before connecting there is no peer address to set it for, TransportConnected() does it then.
+    if (this->state == SctpState::NEW)
+        return true;
+
+    if (!ApplyMtu()) {
+        MS_WARN_TAG(sctp, "usrsctp_setsockopt(SCTP_PEER_ADDR_PARAMS) failed: %s", std::strerror(errno));
+
+        return false;
+    }
+
+    return true;
+}
+
+bool SctpAssociation::ApplyMtu()
+{
+    struct sockaddr_conn rconn; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    std::memset(&rconn, 0, sizeof(rconn));
+    rconn.sconn_family = AF_CONN;
+    rconn.sconn_port   = htons(5000);
+    rconn.sconn_addr   = reinterpret_cast<void *>(this->id);
+#ifdef HAVE_SCONN_LEN
+    rconn.sconn_len = sizeof(rconn);
+#endif
+
+    sctp_paddrparams peerAddrParams; // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    std::memset(&peerAddrParams, 0, sizeof(peerAddrParams));
+    std::memcpy(&peerAddrParams.spp_address, &rconn, sizeof(rconn));
+    peerAddrParams.spp_flags = SPP_PMTUD_DISABLE;
+
+    // The MTU value provided specifies the space available for chunks in the
+    // packet, so let's subtract the SCTP header size.
+    peerAddrParams.spp_pathmtu = uint32_t(this->mtu - sizeof(struct sctp_common_header));
+
+    int ret = usrsctp_setsockopt(this->socket, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &peerAddrParams,
+                                 sizeof(peerAddrParams));
+
+    return ret >= 0;
+}
+
 void SctpAssociation::FillJson(QJsonObject &jsonObject) const
 {
     MS_TRACE();
@@ -555,59 +638,58 @@ void SctpAssociation::OnUsrSctpSendSctpData(void *buffer, size_t len)
 void SctpAssociation::OnUsrSctpReceiveSctpData(uint16_t streamId, uint16_t ssn, uint32_t ppid, int flags,
                                                const uint8_t *data, size_t len)
 {
-    if (this->messageBufferLen != 0 && ssn != this->lastSsnReceived) {
+    auto eor     = static_cast<bool>(flags & MSG_EOR);
+    auto partial = this->partialMessages.find(streamId);
+
+    if (partial != this->partialMessages.end() && ssn != partial->second.ssn) {
         MS_WARN_TAG(sctp,
                     "message chunk received with different SSN while buffer not empty, buffer discarded [ssn:%" PRIu16
                     ", last ssn received:%" PRIu16 "]",
-                    ssn, this->lastSsnReceived);
+                    ssn, partial->second.ssn);
 
-        this->messageBufferLen = 0;
+        this->partialMessages.erase(partial);
+        partial = this->partialMessages.end();
     }
 
-    // Update last SSN received.
-    this->lastSsnReceived = ssn;
-
-    auto eor = static_cast<bool>(flags & MSG_EOR);
+    size_t bufferedLen = partial != this->partialMessages.end() ? partial->second.data.size() : 0u;
 
-    if (this->messageBufferLen + len > this->maxSctpMessageSize) {
+    if (bufferedLen + len > this->maxSctpMessageSize) {
         MS_WARN_TAG(sctp,
                     "ongoing received message exceeds max allowed message size [message size:%lu, max message "
                     "size:%lu, eor:%u]",
-                    this->messageBufferLen + len, this->maxSctpMessageSize, eor ? 1 : 0);
+                    bufferedLen + len, this->maxSctpMessageSize, eor ? 1 : 0);
 
-        this->lastSsnReceived = 0;
+        if (partial != this->partialMessages.end())
+            this->partialMessages.erase(partial);
 
         return;
     }
 
     // If end of message and there is no buffered data, notify it directly.
-    if (eor && this->messageBufferLen == 0) {
+    if (eor && bufferedLen == 0) {
         MS_DEBUG_DEV("directly notifying listener [eor:1, buffer len:0]");
 
         this->listener->OnSctpAssociationMessageReceived(this, streamId, ppid, data, len);
     }
     // If end of message and there is buffered data, append data and notify buffer.
-    else if (eor && this->messageBufferLen != 0) {
-        std::memcpy(this->messageBuffer + this->messageBufferLen, data, len);
-        this->messageBufferLen += len;
+    else if (eor) {
+        auto message = std::move(partial->second.data);
 
-        MS_DEBUG_DEV("notifying listener [eor:1, buffer len:%lu]", this->messageBufferLen);
+        this->partialMessages.erase(partial);
+        message.insert(message.end(), data, data + len);
 
-        this->listener->OnSctpAssociationMessageReceived(this, streamId, ppid, this->messageBuffer,
-                                                         this->messageBufferLen);
+        MS_DEBUG_DEV("notifying listener [eor:1, buffer len:%lu]", message.size());
 
-        this->messageBufferLen = 0;
+        this->listener->OnSctpAssociationMessageReceived(this, streamId, ppid, message.data(), message.size());
     }
     // If non end of message, append data to the buffer.
-    else if (!eor) {
-        // Allocate the buffer if not already done.
-        if (!this->messageBuffer)
-            this->messageBuffer = new uint8_t[this->maxSctpMessageSize];
+    else {
+        auto &buffer = this->partialMessages[streamId];
 
-        std::memcpy(this->messageBuffer + this->messageBufferLen, data, len);
-        this->messageBufferLen += len;
+        buffer.ssn = ssn;
+        buffer.data.insert(buffer.data.end(), data, data + len);
 
-        MS_DEBUG_DEV("data buffered [eor:0, buffer len:%lu]", this->messageBufferLen);
+        MS_DEBUG_DEV("data buffered [eor:0, buffer len:%lu]", buffer.data.size());
     }
 }
 
@@ -829,6 +911,7 @@ void SctpAssociation::OnUsrSctpReceiveSctpNotification(union sctp_notification *
                 auto streamId = notification->sn_strreset_event.strreset_stream_list[i];
 
                 ResetSctpStream(streamId, StreamDirection::OUTGOING);
+                this->partialMessages.erase(streamId);
                 this->listener->OnSctpStreamClosed(this, streamId);
             }
         }
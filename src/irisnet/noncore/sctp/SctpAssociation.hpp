@@ -10,6 +10,8 @@
 #include <QObject>
 #include <QtEndian>
 #include <functional>
+#include <unordered_map>
+#include <vector>
 
 // using json = nlohmann::json;
 
@@ -66,9 +68,16 @@ public:
     void      DataConsumerClosed(RTC::DataConsumer *dataConsumer);
     bool      isSendBufferFull() const { return sendBufferFull; }
 
+    // Tuning. The buffers and interleaving have to be set before TransportConnected(), the MTU at any time.
+    bool   SetBufferSizes(size_t sendBufferSize, size_t recvBufferSize);
+    bool   SetInterleaving(bool enabled); // RFC 8260 I-DATA, used only if the peer supports it too
+    bool   SetMtu(size_t mtu);
+    size_t GetSctpSendBufferSize() const { return this->sctpSendBufferSize; }
+
 private:
     void ResetSctpStream(uint16_t streamId, StreamDirection);
     void AddOutgoingStreams(bool force = false);
+    bool ApplyMtu();
 
     /* Callbacks fired by usrsctp events. */
 public:
@@ -91,14 +100,17 @@ private:
     size_t    sctpBufferedAmount { 0u };
     bool      isDataChannel { false };
     bool      sendBufferFull { false };
-    // Allocated by this.
-    uint8_t *messageBuffer { nullptr };
+    // Messages delivered in parts. Kept per stream since with I-DATA the parts of different streams interleave.
+    struct PartialMessage {
+        uint16_t             ssn { 0u }; // The low 16 bits of the MID with I-DATA.
+        std::vector<uint8_t> data;
+    };
+    std::unordered_map<uint16_t, PartialMessage> partialMessages;
     // Others.
     SctpState      state { SctpState::NEW };
     struct socket *socket { nullptr };
     uint16_t       desiredOs { 0u };
-    size_t         messageBufferLen { 0u };
-    uint16_t       lastSsnReceived { 0u }; // Valid for us since no SCTP I-DATA support.
+    size_t         mtu { 1200u };
 };
 } // namespace RTC
 
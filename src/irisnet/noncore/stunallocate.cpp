@@ -32,6 +32,12 @@
 // permissions last 5 minutes, update them every 4 minutes
 #define PERM_INTERVAL (4 * 60 * 1000)
 
+// new permissions are collected that long and go in one CreatePermission, trickled candidates come close together
+#define PERM_BATCH_DELAY 20
+
+// XOR-PEER-ADDRESS attributes in one CreatePermission
+#define PERM_BATCH_MAX 16
+
 // channels last 10 minutes, update them every 9 minutes
 #define CHAN_INTERVAL (9 * 60 * 1000)
 
@@ -46,11 +52,11 @@ void releaseAndDeleteLater(QObject *owner, QObject *obj)
 // return size of channelData packet, or -1
 static int check_channelData(const quint8 *data, int size)
 {
-    // top two bits are never zero for ChannelData
-    if ((data[0] & 0xc0) == 0)
+    if (size < 4)
         return -1;
 
-    if (size < 4)
+    // top two bits are never zero for ChannelData
+    if ((data[0] & 0xc0) == 0)
         return -1;
 
     quint16 len = StunUtil::read16(data + 2);
@@ -70,6 +76,8 @@ static int check_channelData(const quint8 *data, int size)
     return need;
 }
 
+// the permissions of one CreatePermission, refreshed together. an error is about all of them, the allocation
+//   splits such a request up to find the address it's about
 class StunAllocatePermission : public QObject {
     Q_OBJECT
 
@@ -78,13 +86,13 @@ public:
     StunTransactionPool::Ptr pool;
     StunTransaction         *trans;
     TransportAddress         stunAddr;
-    QHostAddress             addr;
+    QList<QHostAddress>      addrs;
     bool                     active;
 
     enum Error { ErrorGeneric, ErrorProtocol, ErrorCapacity, ErrorForbidden, ErrorRejected, ErrorTimeout };
 
-    StunAllocatePermission(StunTransactionPool::Ptr _pool, const QHostAddress &_addr) :
-        QObject(_pool.data()), pool(_pool), trans(nullptr), addr(_addr), active(false)
+    StunAllocatePermission(StunTransactionPool::Ptr _pool, const QList<QHostAddress> &_addrs) :
+        QObject(_pool.data()), pool(_pool), trans(nullptr), addrs(_addrs), active(false)
     {
         timer = new QTimer(this);
         connect(timer, &QTimer::timeout, this, &StunAllocatePermission::timer_timeout);
@@ -161,11 +169,8 @@ private slots:
 
         QList<StunMessage::Attribute> list;
 
-        // we only do one address per permission request, because
-        //   otherwise if we receive an error it would be ambiguous
-        //   as to which address the error applies to
-
-        {
+        // an error would be ambiguous with more than one address. the allocation retries them one by one then
+        for (const QHostAddress &addr : std::as_const(addrs)) {
             StunMessage::Attribute a;
             a.type  = StunTypes::XOR_PEER_ADDRESS;
             a.value = StunTypes::createXorPeerAddress(TransportAddress { addr, 0 }, message.magic(), message.id());
@@ -239,12 +244,14 @@ public:
     TransportAddress         stunAddr;
     int                      channelId;
     TransportAddress         addr;
+    TransportKey             key; // of addr, for the lookup on every datagram sent
     bool                     active = false;
 
     enum Error { ErrorGeneric, ErrorProtocol, ErrorCapacity, ErrorForbidden, ErrorRejected, ErrorTimeout };
 
     StunAllocateChannel(StunTransactionPool::Ptr _pool, int _channelId, const TransportAddress &_addr) :
-        QObject(_pool.data()), pool(_pool), trans(nullptr), channelId(_channelId), addr(_addr), active(false)
+        QObject(_pool.data()), pool(_pool), trans(nullptr), channelId(_channelId), addr(_addr), key(_addr),
+        active(false)
     {
         timer = new QTimer(this);
         connect(timer, &QTimer::timeout, this, &StunAllocateChannel::timer_timeout);
@@ -417,13 +424,16 @@ public:
     QString                         errorString;
     DontFragmentState               dfState;
     QString                         clientSoftware, serverSoftware;
-    TransportAddress                reflexiveAddress, relayedAddress;
+    bool                            dualStack = false;
+    TransportAddress                reflexiveAddress, relayedAddress, additionalRelayedAddress;
     StunMessage                     msg;
     int                             allocateLifetime;
     QTimer                         *allocateRefreshTimer;
     QList<StunAllocatePermission *> perms;
     QList<StunAllocateChannel *>    channels;
     QList<QHostAddress>             permQueue;
+    QList<QHostAddress>             permBatch; // to be requested when permBatchTimer fires
+    QTimer                         *permBatchTimer;
     QList<QHostAddress>             permsOut;
     QList<StunAllocate::Channel>    channelsOut;
     int                             erroringCode;
@@ -436,6 +446,10 @@ public:
         allocateRefreshTimer = new QTimer(this);
         connect(allocateRefreshTimer, &QTimer::timeout, this, &Private::refresh);
         allocateRefreshTimer->setSingleShot(true);
+        permBatchTimer = new QTimer(this);
+        connect(permBatchTimer, &QTimer::timeout, this, &Private::requestPermissions);
+        permBatchTimer->setSingleShot(true);
+        permBatchTimer->setInterval(PERM_BATCH_DELAY);
     }
 
     ~Private()
@@ -443,6 +457,7 @@ public:
         cleanup();
 
         releaseAndDeleteLater(this, allocateRefreshTimer);
+        releaseAndDeleteLater(this, permBatchTimer);
     }
 
     void start(const TransportAddress &_addr = TransportAddress())
@@ -496,18 +511,14 @@ public:
 
         // removed?
         for (int n = 0; n < perms.count(); ++n) {
-            bool found = false;
-            for (int k = 0; k < newPerms.count(); ++k) {
-                if (newPerms[k] == perms[n]->addr) {
-                    found = true;
-                    break;
-                }
-            }
+            auto &addrs = perms[n]->addrs;
+            for (int i = 0; i < addrs.count(); ++i) {
+                if (newPerms.contains(addrs[i]))
+                    continue;
 
-            if (!found) {
                 // delete related channels
                 for (int j = 0; j < channels.count(); ++j) {
-                    if (channels[j]->addr.addr == perms[n]->addr) {
+                    if (channels[j]->addr.addr == addrs[i]) {
                         delete channels[j];
                         channels.removeAt(j);
                         --j; // adjust position
@@ -516,41 +527,64 @@ public:
 
                 ++freeCount;
 
+                // the server lets it expire, it's not refreshed anymore
+                addrs.removeAt(i);
+                --i; // adjust position
+            }
+
+            if (addrs.isEmpty()) {
                 delete perms[n];
                 perms.removeAt(n);
                 --n; // adjust position
             }
         }
+        for (int n = 0; n < permBatch.count(); ++n) {
+            if (!newPerms.contains(permBatch[n])) {
+                permBatch.removeAt(n);
+                --n; // adjust position
+            }
+        }
 
         if (freeCount > 0) {
             // removals count as a change, so emit the signal
+            updatePermsOut();
             sess.deferExclusive(q, "permissionsChanged");
 
             // wake up inactive perms now that we've freed space
             for (int n = 0; n < perms.count(); ++n) {
-                if (!perms[n]->active)
+                if (!perms[n]->active && !perms[n]->trans)
                     perms[n]->start(stunAddr);
             }
         }
 
         // added?
-        for (int n = 0; n < newPerms.count(); ++n) {
-            bool found = false;
-            for (int k = 0; k < perms.count(); ++k) {
-                if (perms[k]->addr == newPerms[n]) {
-                    found = true;
-                    break;
-                }
-            }
+        for (const QHostAddress &addr : newPerms) {
+            if (!findPermission(addr) && !permBatch.contains(addr))
+                permBatch += addr;
+        }
 
-            if (!found) {
-                StunAllocatePermission *perm = new StunAllocatePermission(pool, newPerms[n]);
-                connect(perm, &StunAllocatePermission::ready, this, &Private::perm_ready);
-                connect(perm, &StunAllocatePermission::error, this, &Private::perm_error);
-                perms += perm;
-                perm->start(stunAddr);
-            }
+        if (permBatch.count() >= PERM_BATCH_MAX)
+            requestPermissions();
+        else if (!permBatch.isEmpty() && !permBatchTimer->isActive())
+            permBatchTimer->start();
+    }
+
+    StunAllocatePermission *findPermission(const QHostAddress &addr) const
+    {
+        for (auto perm : perms) {
+            if (perm->addrs.contains(addr))
+                return perm;
         }
+        return nullptr;
+    }
+
+    void addPermission(const QList<QHostAddress> &addrs)
+    {
+        StunAllocatePermission *perm = new StunAllocatePermission(pool, addrs);
+        connect(perm, &StunAllocatePermission::ready, this, &Private::perm_ready);
+        connect(perm, &StunAllocatePermission::error, this, &Private::perm_error);
+        perms += perm;
+        perm->start(stunAddr);
     }
 
     void setChannels(const QList<StunAllocate::Channel> &newChannels)
@@ -612,17 +646,10 @@ public:
             }
 
             if (!found) {
-                // look up the permission for this channel
-                int at = -1;
-                for (int k = 0; k < perms.count(); ++k) {
-                    if (perms[k]->addr == newChannels[n].address.addr) {
-                        at = k;
-                        break;
-                    }
-                }
-
-                // only install a channel if we have a permission
-                if (at != -1) {
+                // only install a channel if we have a permission, or it's about to be requested. ChannelBind
+                //   installs the permission as well
+                const QHostAddress &peer = newChannels[n].address.addr;
+                if (findPermission(peer) || permBatch.contains(peer)) {
                     int channelId = getFreeChannelNumber();
 
                     StunAllocateChannel *channel = new StunAllocateChannel(pool, channelId, newChannels[n].address);
@@ -657,8 +684,9 @@ public:
 
     int getChannel(const TransportAddress &addr)
     {
+        TransportKey key(addr);
         for (int n = 0; n < channels.count(); ++n) {
-            if (channels[n]->active && channels[n]->addr == addr)
+            if (channels[n]->active && channels[n]->key == key)
                 return channels[n]->channelId;
         }
 
@@ -708,6 +736,8 @@ private:
         qDeleteAll(perms);
         perms.clear();
         permsOut.clear();
+        permBatch.clear();
+        permBatchTimer->stop();
     }
 
     void doTransaction()
@@ -732,7 +762,7 @@ private:
 
         for (int n = 0; n < perms.count(); ++n) {
             if (perms[n]->active)
-                newList += perms[n]->addr;
+                newList += perms[n]->addrs;
         }
 
         if (newList == permsOut)
@@ -759,6 +789,16 @@ private:
     }
 
 private slots:
+    void requestPermissions()
+    {
+        permBatchTimer->stop();
+        while (!permBatch.isEmpty()) {
+            int count = qMin(int(permBatch.count()), PERM_BATCH_MAX);
+            addPermission(permBatch.mid(0, count));
+            permBatch.erase(permBatch.begin(), permBatch.begin() + count);
+        }
+    }
+
     void refresh()
     {
         Q_ASSERT(state == Started);
@@ -804,6 +844,14 @@ private slots:
                 list += a;
             }
 
+            // comprehension-optional, an older server just ignores it
+            if (dualStack) {
+                StunMessage::Attribute a;
+                a.type  = StunTypes::ADDITIONAL_ADDRESS_FAMILY;
+                a.value = StunTypes::createAddressFamily(0x02);
+                list += a;
+            }
+
             message.setAttributes(list);
 
             trans->setMessage(message);
@@ -942,14 +990,35 @@ private slots:
                 return;
             }
 
+            // a dual stack allocation has the relayed address of the other family next
+            TransportAddress xaddr;
+            if (dualStack) {
+                int seen = 0;
+                for (const StunMessage::Attribute &a : response.attributes()) {
+                    if (a.type != StunTypes::XOR_RELAYED_ADDRESS || ++seen < 2)
+                        continue;
+                    if (!StunTypes::parseXorRelayedAddress(a.value, response.magic(), response.id(), xaddr)
+                        || xaddr.addr.protocol() == raddr.addr.protocol())
+                        xaddr = TransportAddress();
+                    break;
+                }
+
+                int     addrCode;
+                QString addrReason;
+                if (StunTypes::parseErrorCode(response.attribute(StunTypes::ADDRESS_ERROR_CODE), &addrCode,
+                                              &addrReason))
+                    emit q->debugLine(QString("Warning: no ipv6 relayed address: %1 %2").arg(addrCode).arg(addrReason));
+            }
+
             QString str;
             if (StunTypes::parseSoftware(response.attribute(StunTypes::SOFTWARE), &str)) {
                 serverSoftware = str;
             }
 
-            allocateLifetime = lifetime;
-            relayedAddress   = raddr;
-            reflexiveAddress = saddr;
+            allocateLifetime         = lifetime;
+            relayedAddress           = raddr;
+            additionalRelayedAddress = xaddr;
+            reflexiveAddress         = saddr;
 
             if (dfState == DF_Unknown)
                 dfState = DF_Supported;
@@ -1017,6 +1086,18 @@ private slots:
 
     void perm_error(XMPP::StunAllocatePermission::Error e, const QString &reason)
     {
+        StunAllocatePermission *perm = static_cast<StunAllocatePermission *>(sender());
+        if (perm->addrs.count() > 1 && e != StunAllocatePermission::ErrorTimeout
+            && e != StunAllocatePermission::ErrorGeneric) {
+            // not known which of them it is about. one request per address now, as they are refreshed anyway
+            QList<QHostAddress> addrs = perm->addrs;
+            perms.removeAll(perm);
+            delete perm;
+            for (const QHostAddress &addr : std::as_const(addrs))
+                addPermission({ addr });
+            return;
+        }
+
         if (e == StunAllocatePermission::ErrorCapacity) {
             // if we aren't allowed to make anymore permissions,
             //   don't consider this an error.  the perm stays
@@ -1025,10 +1106,9 @@ private slots:
             return;
         } else if (e == StunAllocatePermission::ErrorForbidden) {
             // silently discard the permission request
-            StunAllocatePermission *perm = static_cast<StunAllocatePermission *>(sender());
-            QHostAddress            addr = perm->addr;
-            delete perm;
+            QHostAddress addr = perm->addrs.value(0);
             perms.removeAll(perm);
+            delete perm;
             emit q->debugLine(QString("Warning: permission forbidden to %1").arg(addr.toString()));
             return;
         }
@@ -1094,10 +1174,14 @@ void StunAllocate::stop() { d->stop(); }
 
 QString StunAllocate::serverSoftwareNameAndVersion() const { return d->serverSoftware; }
 
+void StunAllocate::setDualStack(bool enabled) { d->dualStack = enabled; }
+
 const TransportAddress &StunAllocate::reflexiveAddress() const { return d->reflexiveAddress; }
 
 const TransportAddress &StunAllocate::relayedAddress() const { return d->relayedAddress; }
 
+const TransportAddress &StunAllocate::additionalRelayedAddress() const { return d->additionalRelayedAddress; }
+
 QList<QHostAddress> StunAllocate::permissions() const { return d->permsOut; }
 
 void StunAllocate::setPermissions(const QList<QHostAddress> &perms) { d->setPermissions(perms); }
@@ -1150,61 +1234,62 @@ QByteArray StunAllocate::encode(const QByteArray &datagram, const TransportAddre
                 plen += (4 - remainder);
         }
 
-        QByteArray out(4 + plen, 0);
-        StunUtil::write16((quint8 *)out.data(), num);
-        StunUtil::write16((quint8 *)out.data() + 2, len);
-        memcpy(out.data() + 4, datagram.data(), size_t(datagram.size()));
+        // only the padding needs zeroing, the rest is overwritten anyway
+        QByteArray out(4 + plen, Qt::Uninitialized);
+        quint8    *p = (quint8 *)out.data();
+        StunUtil::write16(p, num);
+        StunUtil::write16(p + 2, len);
+        memcpy(p + 4, datagram.data(), size_t(len));
+        memset(p + 4 + len, 0, size_t(plen - len));
 
         return out;
     } else {
-        StunMessage message;
-        message.setClass(StunMessage::Indication);
-        message.setMethod(StunTypes::Send);
-        QByteArray id = d->pool->generateId();
-        message.setId((const quint8 *)id.data());
-
-        QList<StunMessage::Attribute> list;
-
-        {
-            StunMessage::Attribute a;
-            a.type  = StunTypes::XOR_PEER_ADDRESS;
-            a.value = StunTypes::createXorPeerAddress(addr, message.magic(), message.id());
-            list += a;
-        }
+        // header, XOR-PEER-ADDRESS of an ipv6 address, DONT-FRAGMENT and DATA with its padding
+        QByteArray        out(20 + 24 + 4 + 4 + datagram.size() + 3, Qt::Uninitialized);
+        StunMessageWriter w((quint8 *)out.data(), int(out.size()));
+        QByteArray        id = d->pool->generateId();
+        w.begin(StunMessage::Indication, StunTypes::Send, (const quint8 *)id.data());
+
+        if (!w.appendAttribute(StunTypes::XOR_PEER_ADDRESS,
+                               StunTypes::createXorPeerAddress(addr, w.magic(), (const quint8 *)id.data())))
+            return QByteArray();
 
-        if (d->dfState == StunAllocate::Private::DF_Supported) {
-            StunMessage::Attribute a;
-            a.type = StunTypes::DONT_FRAGMENT;
-            list += a;
-        }
+        if (d->dfState == StunAllocate::Private::DF_Supported)
+            w.appendAttribute(StunTypes::DONT_FRAGMENT, 0);
 
-        {
-            StunMessage::Attribute a;
-            a.type  = StunTypes::DATA;
-            a.value = datagram;
-            list += a;
-        }
+        quint8 *value = w.appendAttribute(StunTypes::DATA, int(datagram.size()));
+        if (!value)
+            return QByteArray();
+        memcpy(value, datagram.data(), size_t(datagram.size()));
 
-        message.setAttributes(list);
+        int size = w.finish();
+        if (size == -1)
+            return QByteArray();
+        out.resize(size);
 
-        return message.toBinary();
+        return out;
     }
 }
 
 QByteArray StunAllocate::decode(const QByteArray &encoded, TransportAddress &addr)
 {
-    if (encoded.size() < 4)
+    return decode((const quint8 *)encoded.constData(), int(encoded.size()), addr);
+}
+
+QByteArray StunAllocate::decode(const quint8 *data, int size, TransportAddress &addr)
+{
+    if (size < 4)
         return QByteArray();
 
-    quint16 num = StunUtil::read16((const quint8 *)encoded.data());
-    quint16 len = StunUtil::read16((const quint8 *)encoded.data() + 2);
-    if (encoded.size() - 4 < (int)len)
+    quint16 num = StunUtil::read16(data);
+    quint16 len = StunUtil::read16(data + 2);
+    if (size - 4 < (int)len)
         return QByteArray();
 
     if (!d->getAddressPort(num, addr))
         return QByteArray();
 
-    return encoded.mid(4, len);
+    return QByteArray((const char *)data + 4, len);
 }
 
 QByteArray StunAllocate::decode(const StunMessage &encoded, TransportAddress &addr)
@@ -1227,6 +1312,8 @@ QString StunAllocate::errorString() const { return d->errorString; }
 
 bool StunAllocate::containsChannelData(const quint8 *data, int size) { return check_channelData(data, size) != -1; }
 
+int StunAllocate::channelDataSize(const quint8 *data, int size) { return check_channelData(data, size); }
+
 QByteArray StunAllocate::readChannelData(const quint8 *data, int size)
 {
     int len = check_channelData(data, size);
@@ -59,8 +59,13 @@ public:
 
     QString serverSoftwareNameAndVersion() const;
 
+    // before start(). asks for an ipv6 relayed address along with the ipv4 one (RFC 8656 ADDITIONAL-ADDRESS-FAMILY),
+    //   in the same allocation. a server which doesn't do it gives the ipv4 one only
+    void setDualStack(bool enabled);
+
     const TransportAddress &reflexiveAddress() const;
     const TransportAddress &relayedAddress() const;
+    const TransportAddress &additionalRelayedAddress() const; // of a dual stack allocation, if it was granted
 
     QList<QHostAddress> permissions() const;
     void                setPermissions(const QList<QHostAddress> &perms);
@@ -72,12 +77,16 @@ public:
 
     QByteArray encode(const QByteArray &datagram, const TransportAddress &addr);
     QByteArray decode(const QByteArray &encoded, TransportAddress &addr);
+    // same for ChannelData which is still in the caller's buffer, copies the payload only
+    QByteArray decode(const quint8 *data, int size, TransportAddress &addr);
     QByteArray decode(const StunMessage &encoded, TransportAddress &addr);
 
     QString errorString() const;
 
     static bool       containsChannelData(const quint8 *data, int size);
     static QByteArray readChannelData(const quint8 *data, int size);
+    // size of the padded ChannelData at the head of a stream buffer, or -1 if there is none yet
+    static int channelDataSize(const quint8 *data, int size);
 
 signals:
     void started();
@@ -29,9 +29,7 @@ public:
     enum Class { Request, SuccessResponse, ErrorResponse, Indication };
 
     enum ValidationFlags {
-        Fingerprint = 0x01,
-
-        // you must have the hmac(sha1) algorithm in QCA to use
+        Fingerprint      = 0x01,
         MessageIntegrity = 0x02
     };
 
@@ -88,6 +86,77 @@ private:
     class Private;
     QSharedDataPointer<Private> d;
 };
+
+// Read-only access to a raw STUN packet without copying it. The attributes are indexed right over the packet, so
+//   the data must outlive the view.
+class StunMessageView {
+public:
+    enum { MaxAttributes = 64 };
+
+    StunMessageView() = default;
+
+    // checks the format and indexes the attributes. returns false if it's not a stun packet
+    bool parse(const quint8 *data, int size);
+    bool parse(const QByteArray &a) { return parse(reinterpret_cast<const quint8 *>(a.constData()), int(a.size())); }
+
+    // checks the fingerprint and/or message-integrity, same as StunMessage::fromBinary() does.  after the
+    //   integrity check the attributes following MESSAGE-INTEGRITY are dropped since nothing protects them
+    StunMessage::ConvertResult validate(int validationFlags, const QByteArray &key = QByteArray());
+
+    bool               isNull() const { return !_data; }
+    StunMessage::Class mclass() const;
+    quint16            method() const;
+    const quint8      *magic() const { return _data + 4; } // 4 bytes
+    const quint8      *id() const { return _data + 8; }    // 12 bytes
+
+    int     attributeCount() const { return _count; }
+    quint16 attributeType(int index) const { return _attribs[index].type; }
+
+    // returns the value of the first instance or null. len takes the value length
+    const quint8 *findAttribute(quint16 type, int *len) const;
+    // same, but wrapped into a QByteArray which refers to the packet
+    QByteArray attribute(quint16 type) const;
+    bool       hasAttribute(quint16 type) const;
+
+    // deep copy for the code which keeps the message around
+    StunMessage toMessage() const;
+
+private:
+    struct AttributeRef {
+        quint16 type;
+        quint16 length;
+        int     offset; // of the value
+    };
+
+    int indexOf(quint16 type) const;
+
+    const quint8 *_data  = nullptr;
+    int           _count = 0;
+    AttributeRef  _attribs[MaxAttributes];
+};
+
+// Writes a STUN packet straight into a buffer of the caller
+class StunMessageWriter {
+public:
+    StunMessageWriter(quint8 *buf, int capacity);
+
+    // magic defaults to the rfc5389 cookie
+    bool          begin(StunMessage::Class mclass, quint16 method, const quint8 *id, const quint8 *magic = nullptr);
+    const quint8 *magic() const { return _buf + 4; }
+
+    // returns where to write the value, or null if it doesn't fit. the padding is zeroed already
+    quint8 *appendAttribute(quint16 type, int len);
+    bool    appendAttribute(quint16 type, const QByteArray &value);
+
+    // appends the MESSAGE-INTEGRITY and FINGERPRINT attributes asked by validationFlags.
+    //   returns the size of the packet or -1 if anything didn't fit
+    int finish(int validationFlags = 0, const QByteArray &key = QByteArray());
+
+private:
+    quint8 *_buf;
+    int     _capacity;
+    int     _size = -1;
+};
 } // namespace XMPP
 
 #endif // STUNMESSAGE_H
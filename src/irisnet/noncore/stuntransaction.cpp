@@ -28,13 +28,49 @@
 #include <QElapsedTimer>
 #include <QHash>
 #include <QMetaType>
+#include <QPointer>
 #include <QTime>
 #include <QTimer>
 #include <QtCrypto>
 
+#include <algorithm>
+
 Q_DECLARE_METATYPE(XMPP::StunTransaction::Error)
 
+// retransmission timers of a pool run on a wheel of WHEEL_SLOTS slots, WHEEL_TICK ms each
+#define WHEEL_TICK 10
+#define WHEEL_SLOTS 512
+
 namespace XMPP {
+// the 96 bits of a transaction id, so the lookups don't need a QByteArray. ids are random, the bits hash well as
+//   they are
+struct StunTransactionId {
+    quint64 hi = 0;
+    quint32 lo = 0;
+
+    StunTransactionId() = default;
+    explicit StunTransactionId(const quint8 *id)
+    {
+        memcpy(&hi, id, 8);
+        memcpy(&lo, id + 8, 4);
+    }
+    explicit StunTransactionId(const QByteArray &id) : StunTransactionId((const quint8 *)id.constData()) { }
+
+    bool operator==(const StunTransactionId &other) const { return hi == other.hi && lo == other.lo; }
+};
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+inline uint qHash(const StunTransactionId &id, uint seed = 0)
+{
+    return uint(id.hi ^ (id.hi >> 32) ^ id.lo) ^ seed;
+}
+#else
+inline size_t qHash(const StunTransactionId &id, size_t seed = 0)
+{
+    return size_t(id.hi ^ (id.hi >> 32) ^ id.lo) ^ seed;
+}
+#endif
+
 // parse a stun message, optionally performing validity checks.  the
 //   StunMessage class itself provides parsing with validity or parsing
 //   without validity, but it does not provide a way to do both together,
@@ -92,24 +128,45 @@ class StunTransactionPoolPrivate : public QObject {
 public:
     StunTransactionPool                 *q;
     StunTransaction::Mode                mode;
-    QSet<StunTransaction *>              transactions;
-    QHash<StunTransaction *, QByteArray> transToId;
-    QHash<QByteArray, StunTransaction *> idToTrans;
-    bool                                 useLongTermAuth  = false;
-    bool                                 needLongTermAuth = false;
-    QSet<TransportAddress>               triedLongTermAuth;
-    QString                              user;
-    QCA::SecureArray                     pass;
-    QString                              realm;
-    QString                              nonce;
-    int                                  debugLevel = StunTransactionPool::DL_None;
-
-    StunTransactionPoolPrivate(StunTransactionPool *_q) : QObject(_q), q(_q) { }
+    QSet<StunTransaction *>                     transactions;
+    QHash<StunTransactionId, StunTransaction *> idToTrans;
+    bool                                        useLongTermAuth  = false;
+    bool                                        needLongTermAuth = false;
+    QSet<TransportAddress>                      triedLongTermAuth;
+    QString                                     user;
+    QCA::SecureArray                            pass;
+    QString                                     realm;
+    QString                                     nonce;
+    QByteArray                                  longTermKey; // md5 of user:realm:pass, made on first use
+    int                                         debugLevel = StunTransactionPool::DL_None;
+
+    // one timer for all the transactions instead of a QTimer each
+    QTimer                                 *wheelTimer;
+    QElapsedTimer                           clock;
+    qint64                                  wheelTick = 0; // the last processed one
+    qint64                                  nextTick  = 0; // when wheelTimer fires
+    int                                     scheduled = 0;
+    QVector<QSet<StunTransactionPrivate *>> wheel;
+
+    StunTransactionPoolPrivate(StunTransactionPool *_q) : QObject(_q), q(_q), wheel(WHEEL_SLOTS)
+    {
+        wheelTimer = new QTimer(this);
+        wheelTimer->setSingleShot(true);
+        connect(wheelTimer, &QTimer::timeout, this, &StunTransactionPoolPrivate::wheel_timeout);
+        clock.start();
+    }
 
     QByteArray generateId() const;
     void       insert(StunTransaction *trans);
     void       remove(StunTransaction *trans);
     void       transmit(StunTransaction *trans);
+
+    void schedule(StunTransactionPrivate *trans, int msecs);
+    void unschedule(StunTransactionPrivate *trans);
+
+private:
+    void startWheel();
+    void wheel_timeout();
 };
 
 //----------------------------------------------------------------------------
@@ -132,9 +189,12 @@ public:
 
     // defaults from RFC 5389
     int     rto = 500, rc = 7, rm = 16, ti = 39500;
-    int     tries;
-    int     last_interval;
-    QTimer *t;
+    int    tries;
+    int    last_interval;
+    int    wheelSlot = -1; // not scheduled
+    qint64 deadline  = 0;  // in wheel ticks
+
+    StunTransactionId poolId; // as inserted to the pool
 
     QString       stuser;
     QString       stpass;
@@ -142,23 +202,14 @@ public:
     QByteArray    key;
     QElapsedTimer time;
 
-    StunTransactionPrivate(StunTransaction *_q) : QObject(_q), q(_q)
-    {
-        qRegisterMetaType<StunTransaction::Error>();
-
-        t = new QTimer(this);
-        connect(t, &QTimer::timeout, this, &StunTransactionPrivate::t_timeout);
-        t->setSingleShot(true);
-    }
+    StunTransactionPrivate(StunTransaction *_q) : QObject(_q), q(_q) { qRegisterMetaType<StunTransaction::Error>(); }
 
     ~StunTransactionPrivate()
     {
-        if (pool)
+        if (pool) {
+            pool->d->unschedule(this);
             pool->d->remove(q);
-
-        t->disconnect(this);
-        t->setParent(nullptr);
-        t->deleteLater();
+        }
     }
 
     void start(StunTransactionPool::Ptr _pool, const TransportAddress &toAddress)
@@ -230,14 +281,16 @@ public:
             }
             out.setAttributes(list);
 
-            QCA::SecureArray buf;
-            buf += StunUtil::saslPrep(pool->d->user.toUtf8());
-            buf += QByteArray(1, ':');
-            buf += StunUtil::saslPrep(pool->d->realm.toUtf8());
-            buf += QByteArray(1, ':');
-            buf += StunUtil::saslPrep(pool->d->pass);
-
-            key = QCA::Hash("md5").process(buf).toByteArray();
+            if (pool->d->longTermKey.isEmpty()) {
+                QCA::SecureArray buf;
+                buf += StunUtil::saslPrep(pool->d->user.toUtf8());
+                buf += QByteArray(1, ':');
+                buf += StunUtil::saslPrep(pool->d->realm.toUtf8());
+                buf += QByteArray(1, ':');
+                buf += StunUtil::saslPrep(pool->d->pass);
+                pool->d->longTermKey = QCA::Hash("md5").process(buf).toByteArray();
+            }
+            key = pool->d->longTermKey;
         }
 
         if (!key.isEmpty())
@@ -258,10 +311,10 @@ public:
 
         if (mode == StunTransaction::Udp) {
             last_interval = rm * rto;
-            t->start(rto);
+            pool->d->schedule(this, rto);
             rto *= 2;
         } else if (mode == StunTransaction::Tcp) {
-            t->start(ti);
+            pool->d->schedule(this, ti);
         } else
             Q_ASSERT(0);
 
@@ -270,7 +323,7 @@ public:
         transmit();
     }
 
-private slots:
+    // called by the pool
     void t_timeout()
     {
         if (cancelling) {
@@ -285,9 +338,9 @@ private slots:
 
         ++tries;
         if (tries == rc) {
-            t->start(last_interval);
+            pool->d->schedule(this, last_interval);
         } else {
-            t->start(rto);
+            pool->d->schedule(this, rto);
             rto *= 2;
         }
 
@@ -326,7 +379,7 @@ private:
     void processIncoming(const StunMessage &msg, bool authed, const TransportAddress &from_addr)
     {
         active = false;
-        t->stop();
+        pool->d->unschedule(this);
         if (cancelling) {
             q->deleteLater();
             return;
@@ -356,8 +409,10 @@ private:
                         // always set these to the latest received values,
                         //   which will be used for all transactions
                         //   once creds are provided.
-                        if (pool->d->realm.isEmpty())
+                        if (pool->d->realm.isEmpty()) {
                             pool->d->realm = realm;
+                            pool->d->longTermKey.clear();
+                        }
                         pool->d->nonce = nonce;
 
                         if (!pool->d->needLongTermAuth) {
@@ -493,29 +548,98 @@ QByteArray StunTransactionPoolPrivate::generateId() const
 
     do {
         id = QCA::Random::randomArray(12).toByteArray();
-    } while (idToTrans.contains(id));
+    } while (idToTrans.contains(StunTransactionId(id)));
 
     return id;
 }
 
 void StunTransactionPoolPrivate::insert(StunTransaction *trans)
 {
-    Q_ASSERT(!trans->d->id.isEmpty());
+    Q_ASSERT(trans->d->id.size() == 12);
 
     transactions.insert(trans);
-    QByteArray id = trans->d->id;
-    transToId.insert(trans, id);
-    idToTrans.insert(id, trans);
+    trans->d->poolId = StunTransactionId(trans->d->id);
+    idToTrans.insert(trans->d->poolId, trans);
 }
 
 void StunTransactionPoolPrivate::remove(StunTransaction *trans)
 {
-    if (transactions.contains(trans)) {
-        transactions.remove(trans);
-        QByteArray id = transToId.value(trans);
-        transToId.remove(trans);
-        idToTrans.remove(id);
+    if (transactions.remove(trans))
+        idToTrans.remove(trans->d->poolId);
+}
+
+void StunTransactionPoolPrivate::schedule(StunTransactionPrivate *trans, int msecs)
+{
+    unschedule(trans);
+
+    trans->deadline  = qMax((clock.elapsed() + msecs + WHEEL_TICK - 1) / WHEEL_TICK, wheelTick + 1);
+    trans->wheelSlot = int(trans->deadline % WHEEL_SLOTS);
+    wheel[trans->wheelSlot].insert(trans);
+    ++scheduled;
+
+    if (!wheelTimer->isActive() || trans->deadline < nextTick) {
+        nextTick = trans->deadline;
+        wheelTimer->start(int(qMax(qint64(0), nextTick * WHEEL_TICK - clock.elapsed())));
+    }
+}
+
+void StunTransactionPoolPrivate::unschedule(StunTransactionPrivate *trans)
+{
+    if (trans->wheelSlot == -1)
+        return;
+    wheel[trans->wheelSlot].remove(trans);
+    trans->wheelSlot = -1;
+    --scheduled;
+}
+
+// sleeps until the nearest deadline, so an idle wheel doesn't tick
+void StunTransactionPoolPrivate::startWheel()
+{
+    if (!scheduled) {
+        wheelTimer->stop();
+        return;
+    }
+
+    nextTick = wheelTick + WHEEL_SLOTS; // nothing in this revolution, check again after it
+    for (qint64 tick = wheelTick + 1; tick <= wheelTick + WHEEL_SLOTS; ++tick) {
+        const auto &slot = wheel[int(tick % WHEEL_SLOTS)];
+        auto        due  = [tick](StunTransactionPrivate *trans) { return trans->deadline <= tick; };
+        if (std::any_of(slot.begin(), slot.end(), due)) {
+            nextTick = tick;
+            break;
+        }
     }
+    wheelTimer->start(int(qMax(qint64(0), nextTick * WHEEL_TICK - clock.elapsed())));
+}
+
+void StunTransactionPoolPrivate::wheel_timeout()
+{
+    qint64 now = clock.elapsed() / WHEEL_TICK;
+
+    QList<QPointer<StunTransactionPrivate>> expired;
+    for (qint64 tick = qMax(wheelTick + 1, now - WHEEL_SLOTS + 1); tick <= now; ++tick) {
+        auto &slot = wheel[int(tick % WHEEL_SLOTS)];
+        for (auto it = slot.begin(); it != slot.end();) {
+            if ((*it)->deadline <= now) {
+                (*it)->wheelSlot = -1;
+                --scheduled;
+                expired += *it;
+                it = slot.erase(it);
+            } else
+                ++it;
+        }
+    }
+    wheelTick = now;
+
+    // a handler may delete its transaction, the pool or any other transaction
+    QPointer<StunTransactionPoolPrivate> self(this);
+    for (auto const &trans : std::as_const(expired)) {
+        if (trans)
+            trans->t_timeout();
+        if (!self)
+            return;
+    }
+    startWheel();
 }
 
 void StunTransactionPoolPrivate::transmit(StunTransaction *trans)
@@ -548,7 +672,7 @@ bool StunTransactionPool::writeIncomingMessage(const StunMessage &msg, const Tra
         emit debugLine(StunTypes::print_packet_str(msg));
     }
 
-    QByteArray         id     = QByteArray::fromRawData((const char *)msg.id(), 12);
+    StunTransactionId  id(msg.id());
     StunMessage::Class mclass = msg.mclass();
 
     if (mclass != StunMessage::SuccessResponse && mclass != StunMessage::ErrorResponse)
@@ -581,7 +705,7 @@ bool StunTransactionPool::writeIncomingMessage(const QByteArray &packet, bool *n
 
     // isProbablyStun ensures the packet is 20 bytes long, so we can safely
     //   safely extract out the transaction id from the raw packet
-    QByteArray id = QByteArray((const char *)packet.data() + 8, 12);
+    StunTransactionId id((const quint8 *)packet.data() + 8);
 
     StunMessage::Class mclass = StunMessage::extractClass(packet);
 
@@ -611,11 +735,23 @@ void StunTransactionPool::setLongTermAuthEnabled(bool enabled) { d->useLongTermA
 
 QString StunTransactionPool::realm() const { return d->realm; }
 
-void StunTransactionPool::setUsername(const QString &username) { d->user = username; }
+void StunTransactionPool::setUsername(const QString &username)
+{
+    d->user = username;
+    d->longTermKey.clear();
+}
 
-void StunTransactionPool::setPassword(const QCA::SecureArray &password) { d->pass = password; }
+void StunTransactionPool::setPassword(const QCA::SecureArray &password)
+{
+    d->pass = password;
+    d->longTermKey.clear();
+}
 
-void StunTransactionPool::setRealm(const QString &realm) { d->realm = realm; }
+void StunTransactionPool::setRealm(const QString &realm)
+{
+    d->realm = realm;
+    d->longTermKey.clear();
+}
 
 void StunTransactionPool::continueAfterParams(const TransportAddress &addr)
 {
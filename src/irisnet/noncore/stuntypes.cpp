@@ -169,6 +169,14 @@ namespace StunTypes {
         return val;
     }
 
+    QByteArray createAddressFamily(quint8 family)
+    {
+        QByteArray val(4, 0);
+        val[0] = family;
+        // bytes 1-3 are zeroed out
+        return val;
+    }
+
     QByteArray createReservationToken(const QByteArray &token)
     {
         Q_ASSERT(token.size() == 8);
@@ -200,6 +208,13 @@ namespace StunTypes {
         return val;
     }
 
+    QByteArray createChangeRequest(bool changeIp, bool changePort)
+    {
+        QByteArray val(4, 0);
+        write32((quint8 *)val.data(), (changeIp ? 0x04 : 0) | (changePort ? 0x02 : 0));
+        return val;
+    }
+
     bool parseMappedAddress(const QByteArray &val, TransportAddress &addr)
     {
         if (val[1] == 0x02 && val.size() == 20) // IPv6
@@ -352,6 +367,10 @@ namespace StunTypes {
 
     bool parseAlternateServer(const QByteArray &val, TransportAddress &addr) { return parseMappedAddress(val, addr); }
 
+    bool parseOtherAddress(const QByteArray &val, TransportAddress &addr) { return parseMappedAddress(val, addr); }
+
+    bool parseResponseOrigin(const QByteArray &val, TransportAddress &addr) { return parseMappedAddress(val, addr); }
+
     bool parseIceControlled(const QByteArray &val, quint64 *i)
     {
         if (val.size() != 8)
@@ -423,9 +442,14 @@ namespace StunTypes {
                          ATTRIB_ENTRY(USE_CANDIDATE),
                          ATTRIB_ENTRY(SOFTWARE),
                          ATTRIB_ENTRY(ALTERNATE_SERVER),
+                         ATTRIB_ENTRY(ADDITIONAL_ADDRESS_FAMILY),
+                         ATTRIB_ENTRY(ADDRESS_ERROR_CODE),
                          ATTRIB_ENTRY(FINGERPRINT),
                          ATTRIB_ENTRY(ICE_CONTROLLED),
                          ATTRIB_ENTRY(ICE_CONTROLLING),
+                         ATTRIB_ENTRY(CHANGE_REQUEST),
+                         ATTRIB_ENTRY(RESPONSE_ORIGIN),
+                         ATTRIB_ENTRY(OTHER_ADDRESS),
                          { (Attribute)-1, nullptr } };
 
     QString attributeTypeToString(int type)
@@ -584,6 +608,15 @@ namespace StunTypes {
                 return QString::number(i);
             break;
         }
+        case CHANGE_REQUEST: {
+            if (val.size() == 4)
+                return QString::number(read32((const quint8 *)val.data()), 16);
+            break;
+        }
+        case RESPONSE_ORIGIN:
+        case OTHER_ADDRESS: {
+            return attributeValueToString(MAPPED_ADDRESS, val, magic, id);
+        }
         }
 
         return QString();
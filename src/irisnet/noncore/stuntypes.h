@@ -41,6 +41,7 @@ namespace StunTypes {
 
     enum Attribute {
         MAPPED_ADDRESS           = 0x0001,
+        CHANGE_REQUEST           = 0x0003, /* rfc5780 */
         USERNAME                 = 0x0006,
         MESSAGE_INTEGRITY        = 0x0008,
         ERROR_CODE               = 0x0009,
@@ -69,8 +70,8 @@ namespace StunTypes {
         RESPONSE_PORT = 0x0027, /* not implemented */
         CONNECTION_ID = 0x002a, /* not implemented rfc6062 */
 
-        ADDITIONAL_ADDRESS_FAMILY = 0x8000, /* not implemented [RFC8656] */
-        ADDRESS_ERROR_CODE        = 0x8001, /* not implemented [RFC8656] */
+        ADDITIONAL_ADDRESS_FAMILY = 0x8000, /* rfc8656 */
+        ADDRESS_ERROR_CODE        = 0x8001, /* rfc8656 */
         PASSWORD_ALGORITHMS       = 0x8002, /* not implemented [RFC8489] */
         ALTERNATE_DOMAIN          = 0x8003, /* not implemented [RFC8489] */
         ICMP                      = 0x8004, /* not implemented [RFC8656] */
@@ -84,8 +85,8 @@ namespace StunTypes {
         ICE_CONTROLLED  = 0x8029,
         ICE_CONTROLLING = 0x802a,
 
-        RESPONSE_ORIGIN           = 0x802b, /* not implemented [RFC5780] */
-        OTHER_ADDRESS             = 0x802c, /* not implemented [RFC5780] */
+        RESPONSE_ORIGIN           = 0x802b, /* rfc5780 */
+        OTHER_ADDRESS             = 0x802c, /* rfc5780 */
         ECN_CHECK                 = 0x802d, /* not implemented [RFC6679] */
         THIRD_PARTY_AUTHORIZATION = 0x802e, /* not implemented [RFC7635] */
         MOBILITY_TICKET           = 0x8030  /* not implemented [RFC8016] */
@@ -122,12 +123,14 @@ namespace StunTypes {
     QByteArray createXorRelayedAddress(const XMPP::TransportAddress &addr, const quint8 *magic, const quint8 *id);
     QByteArray createEvenPort(bool reserve);
     QByteArray createRequestedTransport(quint8 proto);
+    QByteArray createAddressFamily(quint8 family); // 0x01 ipv4, 0x02 ipv6
     QByteArray createReservationToken(const QByteArray &token);
     QByteArray createPriority(quint32 i);
     QByteArray createSoftware(const QString &str);
     QByteArray createAlternateServer(const XMPP::TransportAddress &addr);
     QByteArray createIceControlled(quint64 i);
     QByteArray createIceControlling(quint64 i);
+    QByteArray createChangeRequest(bool changeIp, bool changePort); // answer from the other address or port
 
     bool parseMappedAddress(const QByteArray &val, TransportAddress &addr);
     bool parseUsername(const QByteArray &val, QString *username);
@@ -146,6 +149,8 @@ namespace StunTypes {
     bool parsePriority(const QByteArray &val, quint32 *i);
     bool parseSoftware(const QByteArray &val, QString *str);
     bool parseAlternateServer(const QByteArray &val, TransportAddress &addr);
+    bool parseOtherAddress(const QByteArray &val, TransportAddress &addr);
+    bool parseResponseOrigin(const QByteArray &val, TransportAddress &addr);
     bool parseIceControlled(const QByteArray &val, quint64 *i);
     bool parseIceControlling(const QByteArray &val, quint64 *i);
 
@@ -18,7 +18,43 @@
 
 #include "stunutil.h"
 
+#include <cstring>
+
+#if defined(__ARM_FEATURE_CRC32) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#include <arm_acle.h>
+#define STUN_CRC32_ARM
+#endif
+
 namespace XMPP { namespace StunUtil {
+    namespace {
+        // slicing-by-8: t[k][b] is the crc of byte b followed by k zero bytes
+        struct Crc32Tables {
+            quint32 t[8][256];
+
+            constexpr Crc32Tables() : t()
+            {
+                for (quint32 b = 0; b < 256; ++b) {
+                    quint32 c = b;
+                    for (int i = 0; i < 8; ++i)
+                        c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+                    t[0][b] = c;
+                }
+                for (int k = 1; k < 8; ++k)
+                    for (int b = 0; b < 256; ++b)
+                        t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+            }
+        };
+
+        constexpr Crc32Tables crcTables;
+
+        inline quint32 readLE32(const quint8 *in)
+        {
+            return quint32(in[0]) | (quint32(in[1]) << 8) | (quint32(in[2]) << 16) | (quint32(in[3]) << 24);
+        }
+
+        inline quint32 rol(quint32 x, int n) { return (x << n) | (x >> (32 - n)); }
+    }
+
     quint16 read16(const quint8 *in)
     {
         quint16 out = in[0];
@@ -90,5 +126,136 @@ namespace XMPP { namespace StunUtil {
         // TODO
         return in;
     }
+
+    quint32 crc32(const quint8 *in, int size)
+    {
+        quint32 crc = 0xffffffff;
+#ifdef STUN_CRC32_ARM
+        for (; size >= 8; in += 8, size -= 8) {
+            quint64 v;
+            memcpy(&v, in, 8);
+            crc = __crc32d(crc, v);
+        }
+        for (; size > 0; ++in, --size)
+            crc = __crc32b(crc, *in);
+#else
+        const auto &t = crcTables.t;
+        for (; size >= 8; in += 8, size -= 8) {
+            quint32 one = readLE32(in) ^ crc;
+            quint32 two = readLE32(in + 4);
+            crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24]
+                ^ t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+        }
+        for (; size > 0; ++in, --size)
+            crc = (crc >> 8) ^ t[0][(crc ^ *in) & 0xff];
+#endif
+        return crc ^ 0xffffffff;
+    }
+
+    HmacSha1::Sha1::Sha1() : h { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 } { }
+
+    void HmacSha1::Sha1::update(const quint8 *in, int size)
+    {
+        total += quint64(size);
+        if (blockSize) {
+            int n = qMin(64 - blockSize, size);
+            memcpy(block + blockSize, in, size_t(n));
+            blockSize += n;
+            in += n;
+            size -= n;
+            if (blockSize < 64)
+                return;
+            compress(block);
+            blockSize = 0;
+        }
+        for (; size >= 64; in += 64, size -= 64)
+            compress(in);
+        memcpy(block, in, size_t(size));
+        blockSize = size;
+    }
+
+    void HmacSha1::Sha1::final(quint8 *out)
+    {
+        quint64 bits = total * 8;
+        block[blockSize++] = 0x80;
+        if (blockSize > 56) {
+            memset(block + blockSize, 0, size_t(64 - blockSize));
+            compress(block);
+            blockSize = 0;
+        }
+        memset(block + blockSize, 0, size_t(56 - blockSize));
+        write64(block + 56, bits);
+        compress(block);
+        for (int i = 0; i < 5; ++i)
+            write32(out + i * 4, h[i]);
+    }
+
+    void HmacSha1::Sha1::compress(const quint8 *in)
+    {
+        quint32 w[80];
+        for (int i = 0; i < 16; ++i)
+            w[i] = read32(in + i * 4);
+        for (int i = 16; i < 80; ++i)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        quint32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            quint32 f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            quint32 temp = rol(a, 5) + f + e + k + w[i];
+            e            = d;
+            d            = c;
+            c            = rol(b, 30);
+            b            = a;
+            a            = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    HmacSha1::HmacSha1(const QByteArray &key)
+    {
+        quint8 pad[64] = {};
+        if (key.size() > 64) {
+            Sha1 k;
+            k.update(reinterpret_cast<const quint8 *>(key.constData()), int(key.size()));
+            k.final(pad);
+        } else {
+            memcpy(pad, key.constData(), size_t(key.size()));
+        }
+
+        quint8 ipad[64], opad[64];
+        for (int i = 0; i < 64; ++i) {
+            ipad[i] = pad[i] ^ 0x36;
+            opad[i] = pad[i] ^ 0x5c;
+        }
+        inner.update(ipad, 64);
+        outer.update(opad, 64);
+    }
+
+    void HmacSha1::update(const quint8 *in, int size) { inner.update(in, size); }
+
+    void HmacSha1::final(quint8 *out)
+    {
+        quint8 digest[20];
+        inner.final(digest);
+        outer.update(digest, 20);
+        outer.final(out);
+    }
 } // namespace StunUtil
 } // namespace XMPP
@@ -32,6 +32,34 @@ namespace XMPP { namespace StunUtil {
 
     QCA::SecureArray saslPrep(const QCA::SecureArray &in);
 
+    // the CRC-32 of zlib and ethernet, which the FINGERPRINT attribute uses
+    quint32 crc32(const quint8 *in, int size);
+
+    // HMAC-SHA1 for MESSAGE-INTEGRITY. The padded key is hashed in once, so a copy does a message with the
+    // hashing of the message only. Plain data, copies are cheap and any thread may use them
+    class HmacSha1 {
+    public:
+        HmacSha1(const QByteArray &key = QByteArray());
+
+        void update(const quint8 *in, int size);
+        void final(quint8 *out); // 20 bytes. the object has to be copied anew for the next message
+
+    private:
+        struct Sha1 {
+            quint32 h[5];
+            quint8  block[64];
+            int     blockSize = 0;
+            quint64 total     = 0;
+
+            Sha1();
+            void update(const quint8 *in, int size);
+            void final(quint8 *out);
+            void compress(const quint8 *in);
+        };
+
+        Sha1 inner, outer;
+    };
+
 } // namespace StunUtil
 
 } // namespace XMPP
@@ -2,6 +2,10 @@
 #define TRANSPORTADDRESS_H
 
 #include <QHostAddress>
+#include <QNetworkInterface>
+#include <QtEndian>
+
+#include <cstring>
 
 namespace XMPP {
 
@@ -33,6 +37,88 @@ inline size_t qHash(const TransportAddress &key, size_t seed = 0)
     return ::qHash(key.addr, seed) ^ ::qHash(key.port, seed);
 }
 
+// the same as a plain value, for the lookups done on every datagram. comparing is a memcmp, hashing is one pass
+//   over 24 bytes and making one from a socket address allocates nothing. QHostAddress comes back only where the
+//   address leaves the transport
+class TransportKey {
+public:
+    quint8  ip[16] = {}; // network order. ipv4 in the first 4 bytes
+    quint32 scope  = 0;  // ipv6 interface index
+    quint16 port   = 0;
+    quint8  family = 0;  // 0 = null, 4 or 6
+    quint8  unused = 0;  // no padding left for memcmp to trip on
+
+    TransportKey() = default;
+    explicit TransportKey(const TransportAddress &a) : port(a.port)
+    {
+        if (a.addr.protocol() == QAbstractSocket::IPv4Protocol) {
+            family = 4;
+            qToBigEndian(a.addr.toIPv4Address(), ip);
+        } else if (a.addr.protocol() == QAbstractSocket::IPv6Protocol) {
+            family   = 6;
+            auto ip6 = a.addr.toIPv6Address();
+            std::memcpy(ip, &ip6, sizeof(ip));
+            auto scopeId = a.addr.scopeId();
+            if (!scopeId.isEmpty()) {
+                bool ok;
+                scope = scopeId.toUInt(&ok);
+                if (!ok)
+                    scope = quint32(QNetworkInterface::interfaceIndexFromName(scopeId));
+            }
+        }
+    }
+
+    // addr in host order, like QHostAddress::toIPv4Address()
+    static TransportKey fromIPv4(quint32 addr, quint16 port)
+    {
+        TransportKey k;
+        k.family = 4;
+        k.port   = port;
+        qToBigEndian(addr, k.ip);
+        return k;
+    }
+
+    static TransportKey fromIPv6(const quint8 *addr, quint16 port, quint32 scope = 0)
+    {
+        TransportKey k;
+        k.family = 6;
+        k.port   = port;
+        k.scope  = scope;
+        std::memcpy(k.ip, addr, sizeof(k.ip));
+        return k;
+    }
+
+    bool isValid() const { return family != 0; }
+
+    TransportAddress toTransportAddress() const
+    {
+        TransportAddress a;
+        a.port = port;
+        if (family == 4)
+            a.addr.setAddress(qFromBigEndian<quint32>(ip));
+        else if (family == 6) {
+            a.addr.setAddress(ip);
+            if (scope)
+                a.addr.setScopeId(QString::number(scope)); // as QHostAddress::setAddress(sockaddr*) does
+        }
+        return a;
+    }
+
+    bool operator==(const TransportKey &other) const { return std::memcmp(this, &other, sizeof(*this)) == 0; }
+    bool operator!=(const TransportKey &other) const { return !operator==(other); }
+};
+
+static_assert(sizeof(TransportKey) == 24, "TransportKey is compared and hashed as bytes");
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+inline uint qHash(const TransportKey &key, uint seed = 0)
+#else
+inline size_t qHash(const TransportKey &key, size_t seed = 0)
+#endif
+{
+    return qHashBits(&key, sizeof(key), seed);
+}
+
 }
 
 #endif // TRANSPORTADDRESS_H
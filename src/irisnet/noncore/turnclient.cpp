@@ -28,6 +28,7 @@
 #include "stuntransaction.h"
 #include "stuntypes.h"
 
+#include <QSet>
 #include <QtCrypto>
 
 namespace XMPP {
@@ -78,7 +79,8 @@ public:
     TurnClient              *q;
     Proxy                    proxy;
     QString                  clientSoftware;
-    TurnClient::Mode         mode = PlainMode;
+    bool                     dualStack = false;
+    TurnClient::Mode         mode      = PlainMode;
     TransportAddress         serverAddr;
     ObjectSession            sess;
     ByteStream              *bs            = nullptr;
@@ -110,6 +112,7 @@ public:
     };
 
     QList<WriteItem> writeItems;
+    qint64           writeItemsBytes = 0; // sum of the sizes in writeItems
     int              writtenBytes;
     bool             stopping;
 
@@ -129,6 +132,8 @@ public:
     int                          outPendingWrite;
     QList<QHostAddress>          desiredPerms;
     QList<StunAllocate::Channel> pendingChannels, desiredChannels;
+    QList<StunAllocate::Channel> autoChannels; // bound on first write, data doesn't wait for them
+    QSet<TransportKey>           writablePeers; // nothing to wait for. forgotten on any perm or channel change
 
     class Written {
     public:
@@ -173,13 +178,16 @@ public:
         inStream.clear();
         retryCount = 0;
         writeItems.clear();
-        writtenBytes = 0;
+        writeItemsBytes = 0;
+        writtenBytes    = 0;
         stopping     = false;
         outPending.clear();
         outPendingWrite = 0;
         desiredPerms.clear();
         pendingChannels.clear();
         desiredChannels.clear();
+        autoChannels.clear();
+        writablePeers.clear();
     }
 
     void do_connect()
@@ -293,6 +301,7 @@ public:
         connect(allocate, &StunAllocate::debugLine, this, &Private::allocate_debugLine);
 
         allocate->setClientSoftwareNameAndVersion(clientSoftware);
+        allocate->setDualStack(dualStack);
 
         allocateStarted = false;
         if (debugLevel >= TurnClient::DL_Info)
@@ -308,31 +317,43 @@ public:
     {
         inStream += in;
 
+        // packets are consumed in place and the buffer is compacted once at the end, rather than
+        //   shifting the rest of the stream after every packet
         ObjectSessionWatcher watch(&sess);
+        int                  at = 0;
         while (1) {
-            QByteArray packet;
-
-            // try to extract ChannelData or a STUN message from
-            //   the stream
-            packet = StunAllocate::readChannelData((const quint8 *)inStream.data(), inStream.size());
-            if (packet.isNull()) {
-                packet = StunMessage::readStun((const quint8 *)inStream.data(), inStream.size());
+            const quint8 *data = (const quint8 *)inStream.constData() + at;
+            int           size = int(inStream.size()) - at;
+
+            // ChannelData is by far the most common, and never needs the pool
+            int len = StunAllocate::channelDataSize(data, size);
+            if (len != -1) {
+                at += len;
+                processChannelData(data, len);
+            } else {
+                QByteArray packet = StunMessage::readStun(data, size);
                 if (packet.isNull())
                     break;
+                at += int(packet.size());
+                processDatagram(packet);
             }
 
-            inStream = inStream.mid(packet.size());
-
-            // processDatagram may cause the session to be reset
+            // processing may cause the session to be reset
             //   or the object to be deleted
-            processDatagram(packet);
             if (!watch.isValid())
-                break;
+                return;
         }
+
+        inStream.remove(0, at);
     }
 
     void processDatagram(const QByteArray &buf)
     {
+        if (!buf.isEmpty() && (buf[0] & 0xc0) != 0) {
+            processChannelData((const quint8 *)buf.constData(), int(buf.size()));
+            return;
+        }
+
         bool notStun;
         if (!pool->writeIncomingMessage(buf, &notStun)) {
             QByteArray       data;
@@ -344,6 +365,21 @@ public:
         }
     }
 
+    void processChannelData(const quint8 *buf, int size)
+    {
+        TransportAddress fromAddr;
+        QByteArray       data = allocate->decode(buf, size, fromAddr);
+        if (data.isNull()) {
+            if (debugLevel >= TurnClient::DL_Packet)
+                emit q->debugLine("Warning: received ChannelData for an unknown channel, skipping.");
+            return;
+        }
+
+        if (debugLevel >= TurnClient::DL_Packet)
+            emit q->debugLine("Received ChannelData-based data packet");
+        processDataPacket(data, fromAddr);
+    }
+
     QByteArray processNonPoolPacket(const QByteArray &buf, bool notStun, TransportAddress &addr)
     {
         if (notStun) {
@@ -394,9 +430,27 @@ public:
     {
         Q_ASSERT(allocateStarted);
 
+        // a peer which was written to already, without the list scans below
+        TransportKey key(addr);
+        if (writablePeers.contains(key)) {
+            write(buf, addr);
+            return;
+        }
+
         StunAllocate::Channel c(addr);
         bool                  writeImmediately = false;
-        bool                  requireChannel   = pendingChannels.contains(c) || desiredChannels.contains(c);
+        bool                  requireChannel
+            = !autoChannels.contains(c) && (pendingChannels.contains(c) || desiredChannels.contains(c));
+
+        // bind a channel to every peer we talk to, so that the traffic moves from Send indications to
+        //   ChannelData as soon as the server confirms it. unlike the channels asked by addChannelPeer,
+        //   nothing waits for these
+        if (!pendingChannels.contains(c) && !desiredChannels.contains(c)) {
+            autoChannels += c;
+            pendingChannels += c;
+            ensurePermission(addr.addr);
+            tryChannelQueued();
+        }
 
         QList<QHostAddress> actualPerms = allocate->permissions();
         if (actualPerms.contains(addr.addr)) {
@@ -409,6 +463,7 @@ public:
         }
 
         if (writeImmediately) {
+            writablePeers.insert(key);
             write(buf, addr);
         } else {
             Packet p;
@@ -472,6 +527,7 @@ public:
         }
 
         writeItems += WriteItem(packet.size(), addr);
+        writeItemsBytes += packet.size();
         ++outPendingWrite;
         if (udp) {
             emit q->outgoingDatagram(packet);
@@ -514,9 +570,11 @@ public:
 
     void addChannelPeer(const TransportAddress &addr)
     {
+        writablePeers.remove(TransportKey(addr)); // has to wait for the channel now
         ensurePermission(addr.addr);
 
         StunAllocate::Channel c(addr);
+        autoChannels.removeAll(c); // explicitly asked for now
         if (!pendingChannels.contains(c) && !desiredChannels.contains(c)) {
             pendingChannels += c;
 
@@ -531,6 +589,7 @@ public:
         while (count > 0) {
             Q_ASSERT(!writeItems.isEmpty());
             WriteItem wi = writeItems.takeFirst();
+            writeItemsBytes -= wi.size;
             --count;
 
             if (wi.type == WriteItem::Data) {
@@ -596,6 +655,10 @@ public:
 private slots:
     void bs_connected()
     {
+        // relayed media and data channels are latency bound, don't let small ChannelData frames wait for acks
+        if (QAbstractSocket *sock = bs->abstractSocket())
+            sock->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
         ObjectSessionWatcher watch(&sess);
         emit                 q->connected();
         if (!watch.isValid())
@@ -660,6 +723,7 @@ private slots:
 
             WriteItem wi = writeItems.takeFirst();
             writtenBytes -= wi.size;
+            writeItemsBytes -= wi.size;
 
             if (wi.type == WriteItem::Data) {
                 int at = -1;
@@ -765,6 +829,7 @@ private slots:
         Q_UNUSED(toAddress);
 
         writeItems += WriteItem(packet.size());
+        writeItemsBytes += packet.size();
 
         // emit q->debugLine(QString("Sending turn packet to: %1:%2")
         //                      .arg(bs->abstractSocket()->peerAddress().toString())
@@ -832,6 +897,7 @@ private slots:
         if (debugLevel >= TurnClient::DL_Info)
             emit q->debugLine("PermissionsChanged");
 
+        writablePeers.clear();
         tryChannelQueued();
         tryWriteQueued();
     }
@@ -841,6 +907,7 @@ private slots:
         if (debugLevel >= TurnClient::DL_Info)
             emit q->debugLine("ChannelsChanged");
 
+        writablePeers.clear();
         tryWriteQueued();
     }
 
@@ -855,6 +922,8 @@ void TurnClient::setProxy(const Proxy &proxy) { d->proxy = proxy; }
 
 void TurnClient::setClientSoftwareNameAndVersion(const QString &str) { d->clientSoftware = str; }
 
+void TurnClient::setDualStack(bool enabled) { d->dualStack = enabled; }
+
 void TurnClient::connectToHost(StunTransactionPool *pool, const TransportAddress &addr)
 {
     d->serverAddr = addr;
@@ -927,6 +996,8 @@ int TurnClient::packetsToRead() const { return d->in.count(); }
 
 int TurnClient::packetsToWrite() const { return d->outPending.count() + d->outPendingWrite; }
 
+qint64 TurnClient::bytesToWrite() const { return d->writeItemsBytes - d->writtenBytes; }
+
 QByteArray TurnClient::read(TransportAddress &addr)
 {
     if (!d->in.isEmpty()) {
@@ -100,6 +100,8 @@ public:
 
     void setProxy(const Proxy &proxy);
     void setClientSoftwareNameAndVersion(const QString &str);
+    // before connecting. see StunAllocate::setDualStack(), the address is in stunAllocate() then
+    void setDualStack(bool enabled);
 
     // for UDP.  does not take ownership of the pool.  stun transaction
     //   I/O occurs through the pool.  transfer of data packets occurs
@@ -136,6 +138,10 @@ public:
     int packetsToRead() const;
     int packetsToWrite() const;
 
+    // bytes handed to the socket (or TLS layer) and not reported as written yet, including STUN
+    //   control traffic. in TCP mode this is the depth of the stream queue
+    qint64 bytesToWrite() const;
+
     // TCP mode only
     QByteArray read(TransportAddress &addr);
 
@@ -18,10 +18,205 @@
 
 #include "udpportreserver.h"
 
+#include "objectsession.h"
+#include "stunmessage.h"
+#include "stuntypes.h"
+
+#include <QHash>
 #include <QUdpSocket>
 #include <stdlib.h>
 
+// don't queue more incoming packets than this per endpoint
+#define MAX_PACKET_QUEUE 64
+
 namespace XMPP {
+//----------------------------------------------------------------------------
+// UdpMuxSocket
+//----------------------------------------------------------------------------
+// demultiplexes a shared socket. STUN requests are routed by the ufrag in front of the USERNAME,
+//   everything else by the remote address, which is learned from both those requests and the writes
+class UdpMuxSocket : public QObject {
+    Q_OBJECT
+
+public:
+    QUdpSocket                           *sock;
+    QHash<QString, UdpMuxEndpoint *>      byUfrag;
+    QHash<TransportKey, UdpMuxEndpoint *> byRemote; // looked up for every datagram both ways
+
+    UdpMuxSocket(QUdpSocket *_sock, QObject *parent) : QObject(parent), sock(_sock)
+    {
+        connect(sock, &QUdpSocket::readyRead, this, &UdpMuxSocket::sock_readyRead);
+    }
+
+    ~UdpMuxSocket();
+
+    bool isUsed() const { return !byUfrag.isEmpty(); }
+
+    // null if the ufrag is taken already
+    UdpMuxEndpoint *addEndpoint(const QString &ufrag, QObject *parent)
+    {
+        if (byUfrag.contains(ufrag))
+            return nullptr;
+
+        auto ep = new UdpMuxEndpoint(this, ufrag, parent);
+        byUfrag.insert(ufrag, ep);
+        return ep;
+    }
+
+    void removeEndpoint(UdpMuxEndpoint *ep)
+    {
+        byUfrag.remove(ep->localUfrag());
+        for (auto it = byRemote.begin(); it != byRemote.end();) {
+            if (it.value() == ep)
+                it = byRemote.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    bool write(UdpMuxEndpoint *ep, const QByteArray &buf, const TransportAddress &addr)
+    {
+        byRemote.insert(TransportKey(addr), ep);
+        return sock->writeDatagram(buf, addr.addr, addr.port) != -1;
+    }
+
+private:
+    UdpMuxEndpoint *route(const QByteArray &buf, const TransportKey &from)
+    {
+        if (StunMessage::isProbablyStun(buf)) {
+            StunMessageView msg;
+            if (msg.parse(buf) && msg.mclass() == StunMessage::Request) {
+                // "<our ufrag>:<their ufrag>"
+                QByteArray user = msg.attribute(StunTypes::USERNAME);
+                int        at   = int(user.indexOf(':'));
+                if (at != -1) {
+                    UdpMuxEndpoint *ep = byUfrag.value(QString::fromUtf8(user.constData(), at));
+                    if (ep) {
+                        byRemote.insert(from, ep);
+                        return ep;
+                    }
+                }
+            }
+        }
+
+        return byRemote.value(from);
+    }
+
+private slots:
+    void sock_readyRead();
+};
+
+//----------------------------------------------------------------------------
+// UdpMuxEndpoint
+//----------------------------------------------------------------------------
+class UdpMuxEndpoint::Private : public QObject {
+    Q_OBJECT
+
+public:
+    using Datagram = QPair<TransportAddress, QByteArray>;
+
+    UdpMuxEndpoint *q;
+    ObjectSession   sess;
+    UdpMuxSocket   *mux;
+    QString         ufrag;
+    QList<Datagram> in;
+    int             writtenCount = 0;
+
+    Private(UdpMuxEndpoint *_q, UdpMuxSocket *_mux, const QString &_ufrag) :
+        QObject(_q), q(_q), sess(this), mux(_mux), ufrag(_ufrag)
+    {
+    }
+
+    void enqueue(const TransportAddress &from, const QByteArray &buf)
+    {
+        if (in.size() >= MAX_PACKET_QUEUE)
+            return;
+
+        in.append({ from, buf });
+        // one notification for everything which arrives in this event loop iteration
+        sess.deferExclusive(this, &Private::emitReadyRead);
+    }
+
+public slots:
+    void emitReadyRead() { emit q->readyRead(); }
+
+    void processWritten()
+    {
+        int count    = writtenCount;
+        writtenCount = 0;
+
+        emit q->datagramsWritten(count);
+    }
+};
+
+UdpMuxEndpoint::UdpMuxEndpoint(UdpMuxSocket *mux, const QString &localUfrag, QObject *parent) : QObject(parent)
+{
+    d = new Private(this, mux, localUfrag);
+}
+
+UdpMuxEndpoint::~UdpMuxEndpoint()
+{
+    if (d->mux)
+        d->mux->removeEndpoint(this);
+    delete d;
+}
+
+const QString &UdpMuxEndpoint::localUfrag() const { return d->ufrag; }
+
+TransportAddress UdpMuxEndpoint::localAddress() const
+{
+    if (!d->mux)
+        return TransportAddress();
+    return { d->mux->sock->localAddress(), d->mux->sock->localPort() };
+}
+
+bool UdpMuxEndpoint::hasPendingDatagrams() const { return !d->in.isEmpty(); }
+
+QByteArray UdpMuxEndpoint::readDatagram(TransportAddress &addr)
+{
+    if (d->in.isEmpty())
+        return QByteArray();
+
+    auto dg = d->in.takeFirst();
+    addr    = dg.first;
+    return dg.second;
+}
+
+void UdpMuxEndpoint::writeDatagram(const QByteArray &buf, const TransportAddress &addr)
+{
+    if (!d->mux || !d->mux->write(this, buf, addr))
+        return;
+
+    ++d->writtenCount;
+    d->sess.deferExclusive(d, &Private::processWritten);
+}
+
+UdpMuxSocket::~UdpMuxSocket()
+{
+    // the endpoints stay with their users, but they are deaf and mute from now on
+    for (UdpMuxEndpoint *ep : std::as_const(byUfrag))
+        ep->d->mux = nullptr;
+}
+
+void UdpMuxSocket::sock_readyRead()
+{
+    while (sock->hasPendingDatagrams()) {
+        QByteArray       buf(int(sock->pendingDatagramSize()), Qt::Uninitialized);
+        TransportAddress from;
+        qint64           size = sock->readDatagram(buf.data(), buf.size(), &from.addr, &from.port);
+        if (size < 0)
+            break;
+        buf.resize(int(size));
+
+        UdpMuxEndpoint *ep = route(buf, TransportKey(from));
+        if (ep)
+            ep->d->enqueue(from, buf);
+    }
+}
+
+//----------------------------------------------------------------------------
+// UdpPortReserver
+//----------------------------------------------------------------------------
 class UdpPortReserver::Private : public QObject {
     Q_OBJECT
 
@@ -53,9 +248,11 @@ public:
         }
     };
 
-    UdpPortReserver    *q;
-    QList<QHostAddress> addrs;
-    QList<int>          ports; // sorted.
+    UdpPortReserver                    *q;
+    QList<QHostAddress>                 addrs;
+    QList<int>                          ports; // sorted.
+    bool                                multiplexed = false;
+    QHash<QUdpSocket *, UdpMuxSocket *> muxes; // multiplexed mode only
 
     // addrs * ports = all available sockets
 
@@ -77,12 +274,58 @@ public:
         if (lendingAny)
             abort();
 
+        qDeleteAll(muxes);
         for (const Item &i : std::as_const(items)) {
             for (QUdpSocket *sock : i.sockList)
                 sock->deleteLater();
         }
     }
 
+    void setMultiplexed(bool enabled)
+    {
+        if (enabled == multiplexed)
+            return;
+
+        multiplexed = enabled;
+        for (const Item &i : std::as_const(items)) {
+            for (QUdpSocket *sock : i.sockList) {
+                // lent sockets are never shared, they come back through returnSockets()
+                if (!i.lentAddrs.contains(sock->localAddress()))
+                    setSocketMode(sock);
+            }
+        }
+        if (!multiplexed)
+            tryCleanup();
+    }
+
+    QList<UdpMuxEndpoint *> borrowEndpoints(int portCount, const QString &ufrag, QObject *parent)
+    {
+        Q_ASSERT(portCount > 0);
+
+        QList<UdpMuxEndpoint *> out;
+        if (!multiplexed)
+            return out;
+
+        for (int n = 0; n < items.count() && portCount > 0; ++n) {
+            const Item &i = items[n];
+            if (!ports.contains(i.port) || !isReserved(i))
+                continue;
+
+            for (QUdpSocket *sock : i.sockList) {
+                UdpMuxSocket *mux = muxes.value(sock);
+                if (!mux || !addrs.contains(sock->localAddress()))
+                    continue;
+
+                // a clashing ufrag leaves the agent without this socket, it will bind a random port instead
+                if (UdpMuxEndpoint *ep = mux->addEndpoint(ufrag, parent))
+                    out += ep;
+            }
+            --portCount;
+        }
+
+        return out;
+    }
+
     void updateAddresses(const QList<QHostAddress> &newAddrs)
     {
         addrs = newAddrs;
@@ -152,6 +395,8 @@ public:
         Q_ASSERT(portCount > 0);
 
         QList<QUdpSocket *> out;
+        if (multiplexed)
+            return out;
 
         if (portCount > 1) {
             // first try to see if we can find something all in a
@@ -209,9 +454,9 @@ public:
             Q_ASSERT(i.lentAddrs.contains(a));
 
             sock->setParent(q);
-            connect(sock, SIGNAL(readyRead()), SLOT(sock_readyRead()));
-
             i.lentAddrs.removeAll(a);
+            setSocketMode(sock);
+
             if (i.lentAddrs.isEmpty())
                 i.lent = false;
         }
@@ -230,6 +475,36 @@ private slots:
     }
 
 private:
+    // plain reserved sockets just eat everything, shared ones demultiplex
+    void setSocketMode(QUdpSocket *sock)
+    {
+        if (multiplexed) {
+            sock->disconnect(this);
+            if (!muxes.contains(sock))
+                muxes.insert(sock, new UdpMuxSocket(sock, this));
+        } else {
+            delete muxes.take(sock);
+            connect(sock, SIGNAL(readyRead()), SLOT(sock_readyRead()));
+        }
+    }
+
+    bool isShared(QUdpSocket *sock) const
+    {
+        UdpMuxSocket *mux = muxes.value(sock);
+        return mux && mux->isUsed();
+    }
+
+    bool isShared(const Item &i) const
+    {
+        return std::any_of(i.sockList.begin(), i.sockList.end(), [this](QUdpSocket *s) { return isShared(s); });
+    }
+
+    void deleteSocket(QUdpSocket *sock)
+    {
+        delete muxes.take(sock);
+        sock->deleteLater();
+    }
+
     void tryBind()
     {
         for (int n = 0; n < items.count(); ++n) {
@@ -253,7 +528,7 @@ private:
                     continue;
                 }
 
-                connect(sock, SIGNAL(readyRead()), SLOT(sock_readyRead()));
+                setSocketMode(sock);
 
                 i.sockList += sock;
             }
@@ -266,9 +541,9 @@ private:
             Item &i = items[n];
 
             // don't care about this port anymore?
-            if (!i.lent && !ports.contains(i.port)) {
+            if (!i.lent && !isShared(i) && !ports.contains(i.port)) {
                 for (QUdpSocket *sock : std::as_const(i.sockList))
-                    sock->deleteLater();
+                    deleteSocket(sock);
 
                 items.removeAt(n);
                 --n; // adjust position
@@ -281,8 +556,8 @@ private:
 
                 QHostAddress a = sock->localAddress();
 
-                if (!addrs.contains(a) && !i.lentAddrs.contains(a)) {
-                    sock->deleteLater();
+                if (!addrs.contains(a) && !i.lentAddrs.contains(a) && !isShared(sock)) {
+                    deleteSocket(sock);
                     i.sockList.removeAt(k);
                     --k; // adjust position
                     continue;
@@ -313,7 +588,7 @@ private:
         for (int n = 0; n < count; ++n) {
             const Item &i = items[at + n];
 
-            if (i.lent || !isReserved(i))
+            if (i.lent || isShared(i) || !isReserved(i))
                 return false;
 
             if (n > 0 && (i.port != items[at + n - 1].port + 1))
@@ -373,6 +648,17 @@ QList<QUdpSocket *> UdpPortReserver::borrowSockets(int portCount, QObject *paren
 }
 
 void UdpPortReserver::returnSockets(const QList<QUdpSocket *> &sockList) { d->returnSockets(sockList); }
+
+void UdpPortReserver::setMultiplexed(bool enabled) { d->setMultiplexed(enabled); }
+
+bool UdpPortReserver::isMultiplexed() const { return d->multiplexed; }
+
+QList<UdpMuxEndpoint *> UdpPortReserver::borrowEndpoints(int portCount, const QString &localUfrag, QObject *parent)
+{
+    return d->borrowEndpoints(portCount, localUfrag, parent);
+}
+
+void UdpPortReserver::returnEndpoints(const QList<UdpMuxEndpoint *> &endpoints) { qDeleteAll(endpoints); }
 } // namespace XMPP
 
 #include "udpportreserver.moc"
@@ -19,6 +19,8 @@
 #ifndef UDPPORTRESERVER_H
 #define UDPPORTRESERVER_H
 
+#include "transportaddress.h"
+
 #include <QList>
 #include <QObject>
 
@@ -26,6 +28,37 @@ class QHostAddress;
 class QUdpSocket;
 
 namespace XMPP {
+class UdpMuxSocket;
+
+// one ICE agent's share of a socket of a multiplexed UdpPortReserver. it gets the STUN requests
+//   carrying its ufrag and whatever else comes from the remote addresses it talked to. the
+//   endpoint may outlive the reserver, in which case it just stops working
+class UdpMuxEndpoint : public QObject {
+    Q_OBJECT
+
+public:
+    ~UdpMuxEndpoint();
+
+    const QString   &localUfrag() const;
+    TransportAddress localAddress() const;
+
+    bool       hasPendingDatagrams() const;
+    QByteArray readDatagram(TransportAddress &addr);
+    void       writeDatagram(const QByteArray &buf, const TransportAddress &addr);
+
+signals:
+    void readyRead();
+    void datagramsWritten(int count);
+
+private:
+    class Private;
+    friend class Private;
+    friend class UdpMuxSocket;
+    Private *d;
+
+    UdpMuxEndpoint(UdpMuxSocket *mux, const QString &localUfrag, QObject *parent);
+};
+
 // call both setAddresses() and setPorts() at least once for socket
 //   reservations to occur.  at any time you can update the list of addresses
 //   (interfaces) and ports to reserve.  note that the port must be available
@@ -60,6 +93,18 @@ public:
 
     void returnSockets(const QList<QUdpSocket *> &sockList);
 
+    // in multiplexed mode all the reserved sockets stay here and are shared by everyone who asks,
+    //   so many sessions can use the same few ports. borrowSockets() returns nothing then, use
+    //   borrowEndpoints() instead. only host candidates are possible over a shared socket, STUN
+    //   and TURN servers couldn't tell the agents apart
+    void setMultiplexed(bool enabled);
+    bool isMultiplexed() const;
+
+    // same ordering as borrowSockets(), for the agent using localUfrag. the endpoints are returned
+    //   by returnEndpoints() or just by deleting them
+    QList<UdpMuxEndpoint *> borrowEndpoints(int portCount, const QString &localUfrag, QObject *parent = nullptr);
+    void                    returnEndpoints(const QList<UdpMuxEndpoint *> &endpoints);
+
 private:
     class Private;
     Private *d;
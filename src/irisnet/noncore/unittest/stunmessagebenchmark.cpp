@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "irisnet/noncore/stunmessage.h"
+#include "irisnet/noncore/stuntypes.h"
+#include "qttestutil/qttestutil.h"
+
+#include <QObject>
+#include <QtCrypto>
+#include <QtTest/QtTest>
+
+using namespace XMPP;
+
+// Measures the encoding and the decoding of an ICE connectivity check, with and without the integrity and
+// fingerprint attributes.
+class StunMessageBenchmark : public QObject {
+    Q_OBJECT
+
+private:
+    static void addValidation()
+    {
+        QTest::addColumn<int>("flags");
+        QTest::newRow("plain") << 0;
+        QTest::newRow("fingerprint") << int(StunMessage::Fingerprint);
+        QTest::newRow("integrity") << int(StunMessage::Fingerprint | StunMessage::MessageIntegrity);
+    }
+
+    static StunMessage check()
+    {
+        const quint8 magic[] = { 0x21, 0x12, 0xa4, 0x42 };
+        const quint8 id[]    = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+
+        StunMessage msg;
+        msg.setClass(StunMessage::Request);
+        msg.setMethod(StunTypes::Binding);
+        msg.setMagic(magic);
+        msg.setId(id);
+
+        QList<StunMessage::Attribute> list;
+        list += { StunTypes::USERNAME, QByteArray("9uB6:Lw8v") };
+        list += { StunTypes::PRIORITY, QByteArray::fromHex("6e7f1eff") };
+        list += { StunTypes::ICE_CONTROLLING, QByteArray::fromHex("932ff9b151263b36") };
+        list += { StunTypes::USE_CANDIDATE, QByteArray() };
+        msg.setAttributes(list);
+        return msg;
+    }
+
+private slots:
+    void benchmarkToBinary_data() { addValidation(); }
+    void benchmarkToBinary()
+    {
+        QFETCH(int, flags);
+        const StunMessage msg = check();
+        QBENCHMARK
+        {
+            msg.toBinary(flags, key);
+        }
+    }
+
+    void benchmarkFromBinary_data() { addValidation(); }
+    void benchmarkFromBinary()
+    {
+        QFETCH(int, flags);
+        const QByteArray           buf    = check().toBinary(flags, key);
+        StunMessage::ConvertResult result = StunMessage::ErrorConvertUnknown;
+        QBENCHMARK
+        {
+            StunMessage::fromBinary(buf, &result, flags, key);
+        }
+        QCOMPARE(result, StunMessage::ConvertGood);
+    }
+
+    void benchmarkReadStun()
+    {
+        const QByteArray buf = check().toBinary(StunMessage::Fingerprint);
+        int              len = 0;
+        QBENCHMARK
+        {
+            len = StunMessage::readStun(reinterpret_cast<const quint8 *>(buf.constData()), int(buf.size())).size();
+        }
+        QCOMPARE(len, int(buf.size()));
+    }
+
+private:
+    QCA::Initializer initializer;
+    QByteArray       key = "VOkJxbRl1RmTxUk/WvJxBt"; // of the message integrity
+};
+
+QTTESTUTIL_REGISTER_TEST(StunMessageBenchmark);
+#include "stunmessagebenchmark.moc"
@@ -357,6 +357,22 @@ typedef struct jdns_callbacks
     int (*udp_write)(jdns_session_t *s, void *app, int handle,
         const jdns_address_t *addr, int port, unsigned char *buf,
         int bufsize);
+    // tcp_write: (0 if not supported)
+    //   s: session
+    //   app: user-supplied context
+    //   handle: handle of the unicast socket, obtained with udp_bind
+    //   addr: ip address of the name server
+    //   port: port of the name server
+    //   buf: query content, without the length prefix
+    //   bufsize: size of query
+    //   return: 1 if query taken for writing, 0 if tcp can't be used now
+    // note: a query answered truncated over udp is asked again with this.
+    //   the answer is to be given back by udp_read for the same handle, as
+    //   if it came over udp from addr and port.  if the connection fails,
+    //   sending the query over udp again gets the truncated answer used.
+    int (*tcp_write)(jdns_session_t *s, void *app, int handle,
+        const jdns_address_t *addr, int port, const unsigned char *buf,
+        int bufsize);
 } jdns_callbacks_t;
 
 typedef struct jdns_event
@@ -501,6 +517,23 @@ JDNS_EXPORT jdns_dnsparams_t *jdns_system_dnsparams();
 //   however new applications really should use it.
 JDNS_EXPORT void jdns_set_hold_ids_enabled(jdns_session_t *s, int enabled);
 
+// jdns_set_cache_max
+//   s: session
+//   max: most records to keep in the unicast cache.  default is 16384.  0
+//     disables the cache
+//   return: nothing
+// when the cache is full, the record which was used least recently is dropped
+//   to make room for a new one.  lowering the limit drops records right away.
+JDNS_EXPORT void jdns_set_cache_max(jdns_session_t *s, int max);
+
+// jdns_set_edns_payload
+//   s: session
+//   size: udp payload size advertised in an EDNS0 OPT record with unicast
+//     queries.  default is 1232.  0 sends plain queries
+//   return: nothing
+// servers answering such a query with an error get plain ones from then on.
+JDNS_EXPORT void jdns_set_edns_payload(jdns_session_t *s, int size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -75,6 +75,11 @@ public:
         QHostAddress address;
         int port;
 
+        // DNS over TLS (RFC 7858) to this port of the server if nonzero, the plain port is used whenever
+        //   the connection fails.  the certificate has to be valid for tlsName, any is taken if empty
+        int tlsPort;
+        QString tlsName;
+
         NameServer();
     };
 
@@ -136,6 +141,10 @@ public:
 
     void setNameServers(const QList<NameServer> &list);
 
+    // for unicast mode only.  the udp payload size advertised with EDNS0, 1232 by default, 0 for plain
+    //   queries.  answers truncated anyway are asked again over tcp
+    void setEdnsPayload(int size);
+
     int queryStart(const QByteArray &name, int type);
     void queryCancel(int id);
 
@@ -222,6 +222,15 @@ public:
         ErrorConflict   ///< Attempt to publish an already published unique record.
     };
 
+    /**
+       \brief Query priority
+    */
+    enum Priority
+    {
+        Interactive, ///< Somebody waits for the answer.  This is the default.
+        Background   ///< Looked up ahead of time, yields to the interactive queries.
+    };
+
     /**
        \brief Constructs a new object with the given \a jdnsShared and \a parent
     */
@@ -239,6 +248,18 @@ public:
     */
     Type type();
 
+    /**
+       \brief Sets the priority of the queries made by this object
+
+       In UnicastInternet mode QJDnsShared sends only so many queries to the name servers at the same time, and the others wait in a queue.  Interactive queries leave the queue first, and background queries are kept to a part of the capacity so there is always room for an interactive one.  Changing the priority of a waiting query moves it in the queue.
+    */
+    void setPriority(Priority p);
+
+    /**
+       \brief The priority of the queries made by this object
+    */
+    Priority priority() const;
+
     /**
        \brief Perform a query operation
     */
@@ -464,6 +485,13 @@ public:
     */
     void removeInterface(const QHostAddress &addr);
 
+    /**
+       \brief Sets the name servers to use instead of the system ones
+
+       This is for UnicastInternet mode only.  The servers may be reached over DNS over TLS, see QJDns::NameServer.  The connections are kept open across queries while the servers stay the same.  Pass an empty list to go back to the system name servers.
+    */
+    void setNameServers(const QList<QJDns::NameServer> &list);
+
     /**
        \brief Shuts down the object
 
@@ -28,7 +28,7 @@
 #include <time.h>
 
 #define JDNS_UDP_UNI_OUT_MAX  512
-#define JDNS_UDP_UNI_IN_MAX   16384
+#define JDNS_UDP_UNI_IN_MAX   65535 // answers asked again over tcp come in here too
 #define JDNS_UDP_MUL_OUT_MAX  9000
 #define JDNS_UDP_MUL_IN_MAX   16384
 
@@ -38,6 +38,22 @@
 #define JDNS_CNAME_MAX        16
 #define JDNS_QUERY_MAX        4096
 
+// unicast retransmit timeouts in ms, until a name server has round trips measured
+#define JDNS_RTO_INITIAL      800
+#define JDNS_RTO_RETRY        1500
+
+// bounds of the timeouts derived from the measured round trips
+#define JDNS_RTO_MIN          200
+#define JDNS_RTO_MAX          3000
+
+// udp payload size advertised with EDNS0 (RFC 6891) by default.  1232 keeps
+//   the answers clear of ip fragmentation on most paths
+#define JDNS_EDNS_PAYLOAD     1232
+#define JDNS_RTYPE_OPT        41
+
+// how long an answer asked again over tcp may take before udp is tried again
+#define JDNS_TCP_TIMEOUT      5000
+
 //----------------------------------------------------------------------------
 // util
 //----------------------------------------------------------------------------
@@ -277,7 +293,8 @@ static jdns_response_t *_packet2response(const jdns_packet_t *packet, const unsi
     {
         jdns_packet_resource_t *res = (jdns_packet_resource_t *)packet->additionalRecords->item[n];
         jdns_rr_t *rr;
-        if((res->qclass & classmask) != 0x0001)
+        // the class of an OPT record is the payload size of the sender
+        if(res->qtype == JDNS_RTYPE_OPT || (res->qclass & classmask) != 0x0001)
             continue;
         rr = jdns_rr_from_resource(res, packet);
         if(!rr)
@@ -611,6 +628,14 @@ typedef struct name_server
     int id;
     jdns_address_t *address;
     int port;
+
+    // smoothed round trip and its variation in ms (RFC 6298), srtt is -1
+    //   until the first sample
+    int srtt;
+    int rttvar;
+
+    // set once the server rejected a query with an OPT record in it
+    int no_edns;
 } name_server_t;
 
 static void name_server_delete(name_server_t *ns);
@@ -620,6 +645,9 @@ static name_server_t *name_server_new()
     name_server_t *ns = alloc_type(name_server_t);
     ns->dtor = name_server_delete;
     ns->address = 0;
+    ns->srtt = -1;
+    ns->rttvar = 0;
+    ns->no_edns = 0;
     return ns;
 }
 
@@ -631,6 +659,41 @@ void name_server_delete(name_server_t *ns)
     jdns_free(ns);
 }
 
+void name_server_add_rtt(name_server_t *ns, int rtt)
+{
+    if(ns->srtt == -1)
+    {
+        ns->srtt = rtt;
+        ns->rttvar = rtt / 2;
+    }
+    else
+    {
+        int delta = rtt > ns->srtt ? rtt - ns->srtt : ns->srtt - rtt;
+        ns->rttvar = (3 * ns->rttvar + delta) / 4;
+        ns->srtt = (7 * ns->srtt + rtt) / 8;
+    }
+}
+
+// how long to wait for an answer before the next transmission
+int name_server_rto(const name_server_t *ns, int retrying)
+{
+    int rto;
+    if(ns->srtt == -1)
+        return retrying ? JDNS_RTO_RETRY : JDNS_RTO_INITIAL;
+
+    rto = ns->srtt + 4 * ns->rttvar;
+    if(rto < JDNS_RTO_MIN)
+        rto = JDNS_RTO_MIN;
+    if(rto > JDNS_RTO_MAX)
+        rto = JDNS_RTO_MAX;
+
+    // the repeats are about loss rather than a slow server, so don't let
+    //   them go faster than before and shorten the time to give up
+    if(retrying && rto < JDNS_RTO_RETRY)
+        rto = JDNS_RTO_RETRY;
+    return rto;
+}
+
 int _intarray_indexOf(int *array, int count, int val)
 {
     int n;
@@ -709,6 +772,10 @@ typedef struct query
     int servers_failed_count;
     int *servers_failed;
 
+    // which servers were asked again over tcp after a truncated answer
+    int servers_tcp_count;
+    int *servers_tcp;
+
     // flag to indicate whether or not we've tried all available
     //  nameservers already.  this means that all future
     //  transmissions are likely repeats, and should be slowed
@@ -748,6 +815,8 @@ query_t *query_new()
     q->servers_tried = 0;
     q->servers_failed_count = 0;
     q->servers_failed = 0;
+    q->servers_tcp_count = 0;
+    q->servers_tcp = 0;
     q->nxdomain = 0;
     q->cname_chain_count = 0;
     q->cname_parent = 0;
@@ -768,6 +837,8 @@ void query_delete(query_t *q)
         free(q->servers_tried);
     if(q->servers_failed)
         free(q->servers_failed);
+    if(q->servers_tcp)
+        free(q->servers_tcp);
     jdns_response_delete(q->mul_known);
     jdns_free(q);
 }
@@ -805,6 +876,15 @@ void query_add_server_tried(query_t *q, int ns_id)
     _intarray_add(&q->servers_tried, &q->servers_tried_count, ns_id);
 }
 
+void query_remove_server_tried(query_t *q, int ns_id)
+{
+    int pos;
+
+    pos = _intarray_indexOf(q->servers_tried, q->servers_tried_count, ns_id);
+    if(pos != -1)
+        _intarray_remove(&q->servers_tried, &q->servers_tried_count, pos);
+}
+
 int query_server_failed(const query_t *q, int ns_id);
 
 void query_clear_servers_tried(query_t *q)
@@ -835,6 +915,18 @@ void query_add_server_failed(query_t *q, int ns_id)
     _intarray_add(&q->servers_failed, &q->servers_failed_count, ns_id);
 }
 
+int query_server_tcp(const query_t *q, int ns_id)
+{
+    if(_intarray_indexOf(q->servers_tcp, q->servers_tcp_count, ns_id) != -1)
+        return 1;
+    return 0;
+}
+
+void query_add_server_tcp(query_t *q, int ns_id)
+{
+    _intarray_add(&q->servers_tcp, &q->servers_tcp_count, ns_id);
+}
+
 void query_name_server_gone(query_t *q, int ns_id)
 {
     int pos;
@@ -846,6 +938,10 @@ void query_name_server_gone(query_t *q, int ns_id)
     pos = _intarray_indexOf(q->servers_failed, q->servers_failed_count, ns_id);
     if(pos != -1)
         _intarray_remove(&q->servers_failed, &q->servers_failed_count, pos);
+
+    pos = _intarray_indexOf(q->servers_tcp, q->servers_tcp_count, ns_id);
+    if(pos != -1)
+        _intarray_remove(&q->servers_tcp, &q->servers_tcp_count, pos);
 }
 
 typedef struct datagram
@@ -896,6 +992,12 @@ typedef struct cache_item
     int time_start;
     int ttl;
     jdns_rr_t *record; // if zero, nxdomain is assumed
+
+    // owned by cache_t
+    unsigned int hash;
+    struct cache_item *bucket_next;
+    struct cache_item *lru_prev, *lru_next;
+    int heap_pos;
 } cache_item_t;
 
 void cache_item_delete(cache_item_t *e);
@@ -919,6 +1021,234 @@ void cache_item_delete(cache_item_t *a)
     jdns_free(a);
 }
 
+static int cache_item_deadline(const cache_item_t *a)
+{
+    return a->time_start + (a->ttl * 1000);
+}
+
+// the items are found by (qname, qtype) in a hash table, expire through a
+//   min-heap on the deadline and are evicted in lru order when there are
+//   more than 'max' of them
+typedef struct cache
+{
+    cache_item_t **buckets;
+    int bucket_count; // power of 2
+    cache_item_t **heap;
+    int heap_alloc;
+    int count;
+    int max;
+    cache_item_t *lru_first, *lru_last; // least recently used first
+} cache_t;
+
+#define CACHE_BUCKETS_MIN 64
+
+static unsigned int cache_hash(const unsigned char *qname, int qtype)
+{
+    // fnv-1a. names compare case-insensitively, so hash them that way
+    unsigned int h = 2166136261u;
+    for(; *qname; ++qname)
+    {
+        h ^= (unsigned int)tolower(*qname);
+        h *= 16777619u;
+    }
+    h ^= (unsigned int)qtype;
+    h *= 16777619u;
+    return h;
+}
+
+static cache_item_t **cache_bucket(cache_t *c, unsigned int hash)
+{
+    return &c->buckets[hash & (unsigned int)(c->bucket_count - 1)];
+}
+
+// at the end, so the records of a name come out in the order they were added
+static void cache_bucket_append(cache_t *c, cache_item_t *i)
+{
+    cache_item_t **b = cache_bucket(c, i->hash);
+    while(*b)
+        b = &(*b)->bucket_next;
+    i->bucket_next = 0;
+    *b = i;
+}
+
+static void cache_init(cache_t *c, int max)
+{
+    c->bucket_count = CACHE_BUCKETS_MIN;
+    c->buckets = (cache_item_t **)jdns_alloc(sizeof(cache_item_t *) * c->bucket_count);
+    memset(c->buckets, 0, sizeof(cache_item_t *) * c->bucket_count);
+    c->heap = 0;
+    c->heap_alloc = 0;
+    c->count = 0;
+    c->max = max;
+    c->lru_first = 0;
+    c->lru_last = 0;
+}
+
+static void cache_grow_buckets(cache_t *c)
+{
+    int n;
+    cache_item_t **old = c->buckets;
+    int old_count = c->bucket_count;
+
+    c->bucket_count *= 2;
+    c->buckets = (cache_item_t **)jdns_alloc(sizeof(cache_item_t *) * c->bucket_count);
+    memset(c->buckets, 0, sizeof(cache_item_t *) * c->bucket_count);
+    for(n = 0; n < old_count; ++n)
+    {
+        cache_item_t *i = old[n];
+        while(i)
+        {
+            cache_item_t *next = i->bucket_next;
+            cache_bucket_append(c, i);
+            i = next;
+        }
+    }
+    jdns_free(old);
+}
+
+static void cache_heap_set(cache_t *c, int pos, cache_item_t *i)
+{
+    c->heap[pos] = i;
+    i->heap_pos = pos;
+}
+
+static void cache_heap_up(cache_t *c, int pos)
+{
+    cache_item_t *i = c->heap[pos];
+    while(pos > 0)
+    {
+        int parent = (pos - 1) / 2;
+        if(cache_item_deadline(c->heap[parent]) <= cache_item_deadline(i))
+            break;
+        cache_heap_set(c, pos, c->heap[parent]);
+        pos = parent;
+    }
+    cache_heap_set(c, pos, i);
+}
+
+static void cache_heap_down(cache_t *c, int pos)
+{
+    cache_item_t *i = c->heap[pos];
+    while(1)
+    {
+        int child = pos * 2 + 1;
+        if(child >= c->count)
+            break;
+        if(child + 1 < c->count && cache_item_deadline(c->heap[child + 1]) < cache_item_deadline(c->heap[child]))
+            ++child;
+        if(cache_item_deadline(i) <= cache_item_deadline(c->heap[child]))
+            break;
+        cache_heap_set(c, pos, c->heap[child]);
+        pos = child;
+    }
+    cache_heap_set(c, pos, i);
+}
+
+static void cache_lru_unlink(cache_t *c, cache_item_t *i)
+{
+    if(i->lru_prev)
+        i->lru_prev->lru_next = i->lru_next;
+    else
+        c->lru_first = i->lru_next;
+    if(i->lru_next)
+        i->lru_next->lru_prev = i->lru_prev;
+    else
+        c->lru_last = i->lru_prev;
+}
+
+static void cache_lru_append(cache_t *c, cache_item_t *i)
+{
+    i->lru_prev = c->lru_last;
+    i->lru_next = 0;
+    if(c->lru_last)
+        c->lru_last->lru_next = i;
+    else
+        c->lru_first = i;
+    c->lru_last = i;
+}
+
+// mark as recently used
+static void cache_touch(cache_t *c, cache_item_t *i)
+{
+    cache_lru_unlink(c, i);
+    cache_lru_append(c, i);
+}
+
+// takes ownership of 'i'
+static void cache_insert(cache_t *c, cache_item_t *i)
+{
+    if(c->count >= c->bucket_count)
+        cache_grow_buckets(c);
+    i->hash = cache_hash(i->qname, i->qtype);
+    cache_bucket_append(c, i);
+
+    cache_lru_append(c, i);
+
+    if(c->count == c->heap_alloc)
+    {
+        c->heap_alloc = c->heap_alloc ? c->heap_alloc * 2 : CACHE_BUCKETS_MIN;
+        c->heap = (cache_item_t **)jdns_realloc(c->heap, sizeof(cache_item_t *) * c->heap_alloc);
+    }
+    cache_heap_set(c, c->count++, i);
+    cache_heap_up(c, i->heap_pos);
+}
+
+// deletes 'i'
+static void cache_remove(cache_t *c, cache_item_t *i)
+{
+    cache_item_t **b = cache_bucket(c, i->hash);
+    int pos;
+
+    while(*b != i)
+        b = &(*b)->bucket_next;
+    *b = i->bucket_next;
+
+    cache_lru_unlink(c, i);
+
+    pos = i->heap_pos;
+    if(--c->count != pos)
+    {
+        cache_item_t *last = c->heap[c->count];
+        cache_heap_set(c, pos, last);
+        cache_heap_up(c, pos);
+        cache_heap_down(c, last->heap_pos);
+    }
+
+    cache_item_delete(i);
+}
+
+// the first item of the bucket for (qname, qtype), use cache_next() for the
+//   following ones.  removing the returned item invalidates it, as usual
+static cache_item_t *cache_match(cache_item_t *i, unsigned int hash, const unsigned char *qname, int qtype)
+{
+    for(; i; i = i->bucket_next)
+    {
+        if(i->hash == hash && i->qtype == qtype && jdns_domain_cmp(i->qname, qname))
+            return i;
+    }
+    return 0;
+}
+
+static cache_item_t *cache_first(cache_t *c, const unsigned char *qname, int qtype)
+{
+    unsigned int hash = cache_hash(qname, qtype);
+    return cache_match(*cache_bucket(c, hash), hash, qname, qtype);
+}
+
+static cache_item_t *cache_next(cache_item_t *i)
+{
+    return cache_match(i->bucket_next, i->hash, i->qname, i->qtype);
+}
+
+static void cache_clear(cache_t *c)
+{
+    while(c->count)
+        cache_remove(c, c->heap[c->count - 1]);
+    jdns_free(c->buckets);
+    if(c->heap)
+        jdns_free(c->heap);
+}
+
 typedef struct event
 {
     void (*dtor)(struct event *);
@@ -996,13 +1326,16 @@ struct jdns_session
     list_t *queries;
     list_t *outgoing;
     list_t *events;
-    list_t *cache;
+    cache_t cache;
 
     // for blocking req_ids from reuse until user explicitly releases
     int do_hold_req_ids;
     int held_req_ids_count;
     int *held_req_ids;
 
+    // udp payload size put in the OPT record of unicast queries, 0 for none
+    int edns_payload;
+
     // mdns
     mdnsd mdns;
     list_t *published;
@@ -1027,12 +1360,14 @@ jdns_session_t *jdns_session_new(jdns_callbacks_t *callbacks)
     s->queries = list_new();
     s->outgoing = list_new();
     s->events = list_new();
-    s->cache = list_new();
+    cache_init(&s->cache, JDNS_CACHE_MAX);
 
     s->do_hold_req_ids = 0;
     s->held_req_ids_count = 0;
     s->held_req_ids = 0;
 
+    s->edns_payload = JDNS_EDNS_PAYLOAD;
+
     s->mdns = 0;
     s->published = list_new();
     s->maddr = 0;
@@ -1050,7 +1385,7 @@ void jdns_session_delete(jdns_session_t *s)
     list_delete(s->queries);
     list_delete(s->outgoing);
     list_delete(s->events);
-    list_delete(s->cache);
+    cache_clear(&s->cache);
 
     if(s->held_req_ids)
         free(s->held_req_ids);
@@ -1544,6 +1879,23 @@ void jdns_set_hold_ids_enabled(jdns_session_t *s, int enabled)
     _set_hold_ids_enabled(s, enabled);
 }
 
+void jdns_set_cache_max(jdns_session_t *s, int max)
+{
+    s->cache.max = max;
+    while(s->cache.count > (max > 0 ? max : 0))
+        cache_remove(&s->cache, s->cache.lru_first);
+}
+
+void jdns_set_edns_payload(jdns_session_t *s, int size)
+{
+    // 512 is what plain dns gets anyway
+    if(size > 0 && size < 512)
+        size = 512;
+    if(size > 65535)
+        size = 65535;
+    s->edns_payload = size;
+}
+
 //----------------------------------------------------------------------------
 // jdns - internal functions
 //----------------------------------------------------------------------------
@@ -1627,28 +1979,27 @@ int _process_response(jdns_session_t *s, jdns_response_t *r, int nxdomain, int n
 
 jdns_response_t *_cache_get_response(jdns_session_t *s, const unsigned char *qname, int qtype, int *_lowest_timeleft)
 {
-    int n;
+    cache_item_t *i, *next;
     int lowest_timeleft = -1;
     int now = s->cb.time_now(s, s->cb.app);
     jdns_response_t *r = 0;
-    for(n = 0; n < s->cache->count; ++n)
+    for(i = cache_first(&s->cache, qname, qtype); i; i = next)
     {
-        cache_item_t *i = (cache_item_t *)s->cache->item[n];
-        if(jdns_domain_cmp(i->qname, qname) && i->qtype == qtype)
-        {
-            int passed, timeleft;
+        int passed, timeleft;
 
-            if(!r)
-                r = jdns_response_new();
+        next = cache_next(i);
+        cache_touch(&s->cache, i);
 
-            if(i->record)
-                jdns_response_append_answer(r, i->record);
+        if(!r)
+            r = jdns_response_new();
 
-            passed = now - i->time_start;
-            timeleft = (i->ttl * 1000) - passed;
-            if(lowest_timeleft == -1 || timeleft < lowest_timeleft)
-                lowest_timeleft = timeleft;
-        }
+        if(i->record)
+            jdns_response_append_answer(r, i->record);
+
+        passed = now - i->time_start;
+        timeleft = (i->ttl * 1000) - passed;
+        if(lowest_timeleft == -1 || timeleft < lowest_timeleft)
+            lowest_timeleft = timeleft;
     }
     if(_lowest_timeleft)
         *_lowest_timeleft = lowest_timeleft;
@@ -1746,10 +2097,10 @@ void _unicast_cancel(jdns_session_t *s, query_t *q)
     }
 }
 
-void _queue_packet(jdns_session_t *s, query_t *q, const name_server_t *ns, int recurse, int query_send_type)
+// returns an exported packet, or 0 on error
+jdns_packet_t *_make_query_packet(jdns_session_t *s, query_t *q, const name_server_t *ns, int recurse)
 {
     jdns_packet_t *packet;
-    datagram_t *a;
 
     packet = jdns_packet_new();
     packet->id = q->dns_id;
@@ -1763,12 +2114,36 @@ void _queue_packet(jdns_session_t *s, query_t *q, const name_server_t *ns, int r
         jdns_list_insert(packet->questions, question, -1);
         jdns_packet_question_delete(question);
     }
+    if(s->edns_payload > 0 && !ns->no_edns)
+    {
+        // the root name, the payload size in place of the class, and a
+        //   zero ttl for no extended rcode, version 0 and no flags
+        jdns_packet_resource_t *opt = jdns_packet_resource_new();
+        opt->qname = jdns_string_new();
+        jdns_string_set_cstr(opt->qname, ".");
+        opt->qtype = JDNS_RTYPE_OPT;
+        opt->qclass = (unsigned short int)s->edns_payload;
+        opt->ttl = 0;
+        jdns_list_insert(packet->additionalRecords, opt, -1);
+        jdns_packet_resource_delete(opt);
+    }
     if(!jdns_packet_export(packet, JDNS_UDP_UNI_OUT_MAX))
     {
         _debug_line(s, "outgoing packet export error, not sending");
         jdns_packet_delete(packet);
-        return;
+        return 0;
     }
+    return packet;
+}
+
+void _queue_packet(jdns_session_t *s, query_t *q, const name_server_t *ns, int recurse, int query_send_type)
+{
+    jdns_packet_t *packet;
+    datagram_t *a;
+
+    packet = _make_query_packet(s, q, ns, recurse);
+    if(!packet)
+        return;
 
     a = datagram_new();
     a->handle = s->handle;
@@ -1785,6 +2160,37 @@ void _queue_packet(jdns_session_t *s, query_t *q, const name_server_t *ns, int r
     list_insert(s->outgoing, a, -1);
 }
 
+// returns 1 if the application took the query for sending over tcp
+int _send_tcp(jdns_session_t *s, query_t *q, const name_server_t *ns, int now)
+{
+    jdns_packet_t *packet;
+    int ret;
+
+    if(!s->cb.tcp_write)
+        return 0;
+
+    packet = _make_query_packet(s, q, ns, 1);
+    if(!packet)
+        return 0;
+
+    _debug_line(s, "SEND TCP %s:%d (size=%d)", ns->address->c_str, ns->port, packet->raw_size);
+    ret = s->cb.tcp_write(s, s->cb.app, s->handle, ns->address, ns->port, packet->raw_data, packet->raw_size);
+    jdns_packet_delete(packet);
+    if(!ret)
+        return 0;
+
+    query_add_server_tcp(q, ns->id);
+
+    // a connection has to be made first, so don't resend over udp as soon
+    //   as usual.  an inactive query keeps its lifetime
+    if(q->step != -1 && q->time_start != -1)
+    {
+        q->time_start = now;
+        q->time_next = JDNS_TCP_TIMEOUT;
+    }
+    return 1;
+}
+
 // return 1 if packets still need to be written
 int _unicast_do_writes(jdns_session_t *s, int now);
 
@@ -1808,18 +2214,14 @@ int jdns_step_unicast(jdns_session_t *s, int now)
         return 0;
     }
 
-    // expire cached items
-    for(n = 0; n < s->cache->count; ++n)
+    // expire cached items, soonest first
+    while(s->cache.count && now >= cache_item_deadline(s->cache.heap[0]))
     {
-        cache_item_t *i = (cache_item_t *)s->cache->item[n];
-        if(now >= i->time_start + (i->ttl * 1000))
-        {
-            jdns_string_t *str = _make_printable_cstr((const char *)i->qname);
-            _debug_line(s, "cache exp [%s]", str->data);
-            jdns_string_delete(str);
-            list_remove(s->cache, i);
-            --n; // adjust position
-        }
+        cache_item_t *i = s->cache.heap[0];
+        jdns_string_t *str = _make_printable_cstr((const char *)i->qname);
+        _debug_line(s, "cache exp [%s]", str->data);
+        jdns_string_delete(str);
+        cache_remove(&s->cache, i);
     }
 
     need_write = _unicast_do_writes(s, now);
@@ -1840,11 +2242,9 @@ int jdns_step_unicast(jdns_session_t *s, int now)
                 smallest_time = timeleft;
         }
     }
-    for(n = 0; n < s->cache->count; ++n)
+    if(s->cache.count)
     {
-        cache_item_t *i = (cache_item_t *)(s->cache->item[n]);
-        int passed = now - i->time_start;
-        int timeleft = (i->ttl * 1000) - passed;
+        int timeleft = cache_item_deadline(s->cache.heap[0]) - now;
         if(timeleft < 0)
             timeleft = 0;
 
@@ -2110,7 +2510,7 @@ int _unicast_do_writes(jdns_session_t *s, int now)
         }
 
         q->time_start = now;
-        q->time_next = q->retrying ? 1500 : 800;
+        q->time_next = name_server_rto(ns, q->retrying);
         ++q->step;
     }
 
@@ -2148,10 +2548,15 @@ void _cache_add(jdns_session_t *s, const unsigned char *qname, int qtype, int ti
 {
     cache_item_t *i;
     jdns_string_t *str;
-    if(ttl == 0)
-        return;
-    if(s->cache->count >= JDNS_CACHE_MAX)
+    if(ttl == 0 || s->cache.max <= 0)
         return;
+    while(s->cache.count >= s->cache.max)
+    {
+        str = _make_printable_cstr((const char *)s->cache.lru_first->qname);
+        _debug_line(s, "cache evict [%s]", str->data);
+        jdns_string_delete(str);
+        cache_remove(&s->cache, s->cache.lru_first);
+    }
     i = cache_item_new();
     i->qname = _ustrdup(qname);
     i->qtype = qtype;
@@ -2159,7 +2564,7 @@ void _cache_add(jdns_session_t *s, const unsigned char *qname, int qtype, int ti
     i->ttl = ttl;
     if(record)
         i->record = jdns_rr_copy(record);
-    list_insert(s->cache, i, -1);
+    cache_insert(&s->cache, i);
 
     str = _make_printable_cstr((const char *)i->qname);
     _debug_line(s, "cache add [%s] for %d seconds", str->data, i->ttl);
@@ -2168,34 +2573,31 @@ void _cache_add(jdns_session_t *s, const unsigned char *qname, int qtype, int ti
 
 void _cache_remove_all_of_kind(jdns_session_t *s, const unsigned char *qname, int qtype)
 {
-    int n;
-    for(n = 0; n < s->cache->count; ++n)
+    cache_item_t *i, *next;
+    for(i = cache_first(&s->cache, qname, qtype); i; i = next)
     {
-        cache_item_t *i = (cache_item_t *)s->cache->item[n];
-        if(jdns_domain_cmp(i->qname, qname) && i->qtype == qtype)
-        {
-            jdns_string_t *str = _make_printable_cstr((const char *)i->qname);
-            _debug_line(s, "cache del [%s]", str->data);
-            jdns_string_delete(str);
-            list_remove(s->cache, i);
-            --n; // adjust position
-        }
+        jdns_string_t *str = _make_printable_cstr((const char *)i->qname);
+        _debug_line(s, "cache del [%s]", str->data);
+        jdns_string_delete(str);
+        next = cache_next(i);
+        cache_remove(&s->cache, i);
     }
 }
 
-void _cache_remove_all_of_record(jdns_session_t *s, const jdns_rr_t *record)
+// only the items stored under 'qname' are looked at.  a copy of the record
+//   kept for another name doesn't make the answers for this one wrong
+void _cache_remove_all_of_record(jdns_session_t *s, const unsigned char *qname, const jdns_rr_t *record)
 {
-    int n;
-    for(n = 0; n < s->cache->count; ++n)
+    cache_item_t *i, *next;
+    for(i = cache_first(&s->cache, qname, record->type); i; i = next)
     {
-        cache_item_t *i = (cache_item_t *)s->cache->item[n];
+        next = cache_next(i);
         if(i->record && _cmp_rr(i->record, record))
         {
             jdns_string_t *str = _make_printable_cstr((const char *)i->qname);
             _debug_line(s, "cache del [%s]", str->data);
             jdns_string_delete(str);
-            list_remove(s->cache, i);
-            --n; // adjust position
+            cache_remove(&s->cache, i);
         }
     }
 }
@@ -2208,7 +2610,7 @@ void _cache_add_no_dups(jdns_session_t *s, const unsigned char *qname, int qtype
     if(qtype == JDNS_RTYPE_CNAME)
         _cache_remove_all_of_kind(s, qname, qtype);
     else
-        _cache_remove_all_of_record(s, record);
+        _cache_remove_all_of_record(s, qname, record);
 
     _cache_add(s, qname, qtype, time_start, ttl, record);
 }
@@ -2331,6 +2733,14 @@ int _unicast_do_reads(jdns_session_t *s, int now)
 
         jdns_address_delete(addr);
 
+        // only a single transmission tells which one is answered (Karn).
+        //   an answer over tcp took a connection setup as well
+        if(q && ns && q->step == 1 && q->time_start != -1 && !query_server_tcp(q, ns->id))
+        {
+            name_server_add_rtt(ns, now - q->time_start);
+            _debug_line(s, "ns [%s:%d] rtt=%d srtt=%d", ns->address->c_str, ns->port, now - q->time_start, ns->srtt);
+        }
+
         // no queries?  eat the packet
         if(!q)
         {
@@ -2371,6 +2781,26 @@ void _process_message(jdns_session_t *s, jdns_packet_t *packet, int now, query_t
     if(packet->qdcount == packet->questions->count && packet->ancount == packet->answerRecords->count)
         answer_section_ok = 1;
 
+    // servers from before EDNS0 may reject the OPT record (RFC 6891 section
+    //   7).  stop sending it to this one and ask it again soon
+    if(ns && !ns->no_edns && s->edns_payload > 0 && (packet->opts.rcode == 1 || packet->opts.rcode == 4))
+    {
+        _debug_line(s, "ns [%s:%d] rejected edns, not using it there", ns->address->c_str, ns->port);
+        ns->no_edns = 1;
+        if(q->step != -1)
+        {
+            query_remove_server_tried(q, ns->id);
+            q->time_start = now;
+            q->time_next = 0;
+        }
+        return;
+    }
+
+    // ask the same server over tcp for the whole answer, once.  if the
+    //   application can't do that, the truncated answer is what we have
+    if(truncated && ns && !query_server_tcp(q, ns->id) && _send_tcp(s, q, ns, now))
+        return;
+
     r = 0;
 
     // nxdomain
@@ -3044,6 +3474,50 @@ static void _publish_applyrr_unknown(jdns_session_t *s, mdnsdr r, const jdns_rr_
     mdnsd_set_raw(s->mdns, r, (char *)rr->rdata, rr->rdlength);
 }
 
+static int _publish_same_string(const jdns_string_t *a, const jdns_string_t *b)
+{
+    return a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+// would the records look the same on the wire?  this follows what
+//   _publish_applyrr() takes from them
+static int _publish_same_rr(const jdns_rr_t *a, const jdns_rr_t *b)
+{
+    if(a->type != b->type || a->ttl != b->ttl || a->haveKnown != b->haveKnown)
+        return 0;
+    if(!a->haveKnown)
+        return _cmp_rdata(a, b);
+
+    switch(a->type)
+    {
+        case JDNS_RTYPE_A:
+        case JDNS_RTYPE_AAAA:
+            return jdns_address_cmp(a->data.address, b->data.address);
+        case JDNS_RTYPE_SRV:
+            return a->data.server->port == b->data.server->port
+                && a->data.server->priority == b->data.server->priority
+                && a->data.server->weight == b->data.server->weight
+                && jdns_domain_cmp(a->data.server->name, b->data.server->name);
+        case JDNS_RTYPE_CNAME:
+        case JDNS_RTYPE_PTR:
+            return jdns_domain_cmp(a->data.name, b->data.name);
+        case JDNS_RTYPE_TXT:
+        {
+            jdns_string_t *ta = _create_text(a->data.texts);
+            jdns_string_t *tb = _create_text(b->data.texts);
+            int same = _publish_same_string(ta, tb);
+            jdns_string_delete(ta);
+            jdns_string_delete(tb);
+            return same;
+        }
+        case JDNS_RTYPE_HINFO:
+            return _publish_same_string(a->data.hinfo.cpu, b->data.hinfo.cpu)
+                && _publish_same_string(a->data.hinfo.os, b->data.hinfo.os);
+        default:
+            return _cmp_rdata(a, b);
+    }
+}
+
 static int _publish_applyrr(jdns_session_t *s, mdnsdr r, const jdns_rr_t *rr)
 {
     if(!rr->haveKnown)
@@ -3203,6 +3677,7 @@ void _multicast_update_publish(jdns_session_t *s, int id, const jdns_rr_t *rr)
 {
     mdnsdr r;
     published_item_t *pub;
+    jdns_rr_t *old;
     int n;
 
     pub = 0;
@@ -3218,6 +3693,11 @@ void _multicast_update_publish(jdns_session_t *s, int id, const jdns_rr_t *rr)
     if(!pub)
         return;
 
+    // nothing to tell the network, don't make it forget and learn the
+    //   record again
+    if(_publish_same_rr(pub->rr, rr))
+        return;
+
     r = pub->rec;
 
     // expire existing record.  this is mostly needed for shared records
@@ -3236,6 +3716,12 @@ void _multicast_update_publish(jdns_session_t *s, int id, const jdns_rr_t *rr)
         _debug_line(s, "attempt to update_publish an unsupported type");
         return;
     }
+
+    // what's out there now, under the name it was published with
+    old = pub->rr;
+    pub->rr = jdns_rr_copy(rr);
+    jdns_rr_set_owner(pub->rr, old->owner);
+    jdns_rr_delete(old);
 }
 
 void _multicast_cancel_publish(jdns_session_t *s, int id)
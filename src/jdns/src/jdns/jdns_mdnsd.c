@@ -95,6 +95,7 @@ struct mdnsdr_struct
     struct mdnsda_struct rr;
     char unique; // # of checks performed to ensure
     int tries;
+    unsigned long int round; // of announcements it went out in last
     void (*pubresult)(int, char *, int, void *);
     void *arg;
     struct mdnsdr_struct *next, *list;
@@ -109,6 +110,8 @@ struct mdnsd_struct
     struct cached *cache[LPRIME];
     int cache_count;
     struct mdnsdr_struct *published[SPRIME], *probing, *a_now, *a_pause, *a_publish;
+    unsigned long int publish_round;
+    char publish_more; // the round didn't fit in one packet
     struct unicast *uanswers;
     struct query *queries[SPRIME], *qlist;
     int (*cb_time_now)(struct mdnsd_struct *dp, void *arg);
@@ -203,17 +206,29 @@ mdnsdr _r_next(mdnsd d, mdnsdr r, char *host, int type)
     return 0;
 }
 
-/*
+// size of the record in a packet, at most (names uncompressed)
 int _rr_len(mdnsda rr)
 {
-    int len = 12; // name is always compressed (dup of earlier), plus normal stuff
+    int len = (int)strlen((char *)rr->name) + 2 + 10;
     if(rr->rdata) len += rr->rdlen;
-    if(rr->rdname) len += strlen((char *)rr->rdname); // worst case
-    if(rr->ip) len += 4;
-    if(rr->type == QTYPE_PTR) len += 6; // srv record stuff
+    else if(rr->ip) len += 4;
+    else if(rr->rdname)
+    {
+        len += (int)strlen((char *)rr->rdname) + 2;
+        if(rr->type == QTYPE_SRV) len += 6;
+    }
     return len;
 }
-*/
+
+// account for r in a packet of *len bytes so far, if it fits.  the first
+//   record always does, so that big ones still go out alone
+int _r_fits(mdnsd d, int *len, mdnsdr r)
+{
+    int rlen = _rr_len(&r->rr);
+    if(*len > 12 && *len + rlen > d->frame) return 0;
+    *len += rlen;
+    return 1;
+}
 
 /*
 int _a_match(struct resource *r, mdnsda a)
@@ -622,12 +637,12 @@ int _r_out(mdnsd d, struct message *m, mdnsdr *list)
 }
 */
 
-int _r_out(mdnsd d, jdns_packet_t *m, mdnsdr *list)
-{ // copy a published record into an outgoing message
+int _r_out(mdnsd d, jdns_packet_t *m, mdnsdr *list, int *len)
+{ // copy a published record into an outgoing message, as many as fit
     mdnsdr r; //, next;
     unsigned short class;
     int ret = 0;
-    while((r = *list) != 0)
+    while((r = *list) != 0 && _r_fits(d, len, r))
     {
         *list = r->list;
         ret++;
@@ -802,6 +817,7 @@ int mdnsd_out(mdnsd d, jdns_packet_t **_m, jdns_address_t **addr, unsigned short
 {
     mdnsdr r;
     int ret = 0;
+    int len = 12; // header
     jdns_packet_t *m;
 
     mygettimeofday(d, &d->now);
@@ -837,15 +853,31 @@ int mdnsd_out(mdnsd d, jdns_packet_t **_m, jdns_address_t **addr, unsigned short
 //printf("OUT: probing %X now %X pause %X publish %X\n",d->probing,d->a_now,d->a_pause,d->a_publish);
 
     // accumulate any immediate responses
-    if(d->a_now) { ret += _r_out(d, m, &d->a_now); }
+    if(d->a_now) { ret += _r_out(d, m, &d->a_now, &len); }
 
-    if(d->a_publish && _tvdiff(d->now,d->publish) <= 0)
+    if(d->a_publish && (d->publish_more || _tvdiff(d->now,d->publish) <= 0))
     { // check to see if it's time to send the publish retries (and unlink if done)
         mdnsdr next, cur = d->a_publish, last = 0;
         unsigned short class;
-        while(cur /*&& message_packet_len(m) + _rr_len(&cur->rr) < d->frame*/ )
+        // all of them go out together, in as few packets as they fit.  the
+        //   ones sent already in this round are passed over
+        if(!d->publish_more) d->publish_round++;
+        d->publish_more = 0;
+        while(cur)
         {
             next = cur->list;
+            if(cur->round == d->publish_round)
+            {
+                last = cur;
+                cur = next;
+                continue;
+            }
+            if(!_r_fits(d, &len, cur))
+            {
+                d->publish_more = 1;
+                break;
+            }
+            cur->round = d->publish_round;
             ret++; cur->tries++;
             class = cur->unique ? d->class | 0x8000 : d->class;
             _a_copy(m->answerRecords, cur->rr.name, cur->rr.type, class, cur->rr.ttl, &cur->rr);
@@ -861,7 +893,7 @@ int mdnsd_out(mdnsd d, jdns_packet_t **_m, jdns_address_t **addr, unsigned short
             if(cur->rr.ttl == 0) _r_done(d,cur);
             cur = next;
         }
-        if(d->a_publish)
+        if(d->a_publish && !d->publish_more)
         {
             d->publish.tv_sec = d->now.tv_sec + 2;
             d->publish.tv_usec = d->now.tv_usec;
@@ -873,7 +905,7 @@ int mdnsd_out(mdnsd d, jdns_packet_t **_m, jdns_address_t **addr, unsigned short
         goto end;
 
     // check if a_pause is ready
-    if(d->a_pause && _tvdiff(d->now, d->pause) <= 0) ret += _r_out(d, m, &d->a_pause);
+    if(d->a_pause && _tvdiff(d->now, d->pause) <= 0) ret += _r_out(d, m, &d->a_pause, &len);
 
     // now process questions
     if(ret)
@@ -994,6 +1026,7 @@ struct mytimeval *mdnsd_sleep(mdnsd d)
 
     if(d->a_publish)
     { // now check for publish retries
+        if(d->publish_more) return &d->sleep;
         if((usec = _tvdiff(d->now,d->publish)) > 0) d->sleep.tv_usec = usec;
         RET;
     }
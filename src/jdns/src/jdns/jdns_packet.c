@@ -130,7 +130,68 @@ static int getoffset(const unsigned char *str, int refsize, int *hopsleft)
     return x;
 }
 
-static int readlabel(const unsigned char *in, int insize, const unsigned char *ref, int refsize, int *_at, jdns_string_t **name)
+// the names already decoded from a packet, by the offset they start at.  the
+//   owner names of the records are mostly pointers to the same few names (the
+//   question, typically), so this keeps readlabel from walking them each time
+#define NAME_CACHE_SIZE      16
+#define NAME_CACHE_HOPS      8
+
+typedef struct jdns_packet_name_cache
+{
+    int count, next;
+    struct
+    {
+        int offset;
+        int size;
+        unsigned char value[MAX_LABEL_LENGTH - 1];
+    } item[NAME_CACHE_SIZE];
+} jdns_packet_name_cache_t;
+
+static jdns_packet_name_cache_t *name_cache_new()
+{
+    jdns_packet_name_cache_t *c = (jdns_packet_name_cache_t *)jdns_alloc(sizeof(jdns_packet_name_cache_t));
+    c->count = 0;
+    c->next = 0;
+    return c;
+}
+
+// appends the name at offset to out.  0 if it's not known, -1 if it doesn't fit
+static int name_cache_find(const jdns_packet_name_cache_t *c, int offset, unsigned char *out, int *out_size)
+{
+    int n;
+    for(n = 0; n < c->count; ++n)
+    {
+        if(c->item[n].offset != offset)
+            continue;
+        if(*out_size + c->item[n].size > MAX_LABEL_LENGTH - 1)
+            return -1;
+        memcpy(out + *out_size, c->item[n].value, c->item[n].size);
+        *out_size += c->item[n].size;
+        return 1;
+    }
+    return 0;
+}
+
+static void name_cache_add(jdns_packet_name_cache_t *c, int offset, const unsigned char *value, int size)
+{
+    int n;
+
+    // oldest goes first
+    if(c->count < NAME_CACHE_SIZE)
+        n = c->count++;
+    else
+    {
+        n = c->next;
+        c->next = (c->next + 1) % NAME_CACHE_SIZE;
+    }
+
+    c->item[n].offset = offset;
+    c->item[n].size = size;
+    memcpy(c->item[n].value, value, size);
+}
+
+// cache is optional.  it must belong to ref
+static int readlabel(const unsigned char *in, int insize, const unsigned char *ref, int refsize, jdns_packet_name_cache_t *cache, int *_at, jdns_string_t **name)
 {
     int at;
     // string format is one character smaller than dns format.  e.g.:
@@ -143,6 +204,8 @@ static int readlabel(const unsigned char *in, int insize, const unsigned char *r
     int hopped_yet;
     int hopsleft;
     int label_size;
+    int hop_offset[NAME_CACHE_HOPS], hop_out[NAME_CACHE_HOPS];
+    int hops, n;
 
     at = *_at;
 
@@ -151,6 +214,16 @@ static int readlabel(const unsigned char *in, int insize, const unsigned char *r
         return 0;
 
     out_size = 0;
+    hops = 0;
+
+    // the name itself can be cached if it is in ref
+    if(cache && in >= ref && in + at < ref + refsize)
+    {
+        hop_offset[0] = (in + at) - ref;
+        hop_out[0] = 0;
+        hops = 1;
+    }
+
     label = in + at;
     hopped_yet = 0;
     last = in + insize;
@@ -184,6 +257,23 @@ static int readlabel(const unsigned char *in, int insize, const unsigned char *r
                 last = ref + refsize;
             }
 
+            if(cache)
+            {
+                int found = name_cache_find(cache, offset, out, &out_size);
+                if(found == -1)
+                    goto error;
+                if(found)
+                    goto done;
+
+                // remember where the name pointed to starts, to cache it below
+                if(hops < NAME_CACHE_HOPS)
+                {
+                    hop_offset[hops] = offset;
+                    hop_out[hops] = out_size;
+                    ++hops;
+                }
+            }
+
             // need a byte
             if(label + 1 > last)
                 goto error;
@@ -218,6 +308,13 @@ static int readlabel(const unsigned char *in, int insize, const unsigned char *r
         label += label_size + 1;
     }
 
+done:
+    if(cache)
+    {
+        for(n = 0; n < hops; ++n)
+            name_cache_add(cache, hop_offset[n], out + hop_out[n], out_size - hop_out[n]);
+    }
+
     *_at = at;
     *name = jdns_string_new();
     jdns_string_set(*name, out, out_size);
@@ -521,11 +618,21 @@ jdns_packet_resource_t *jdns_packet_resource_new()
     a->rdlength = 0;
     a->rdata = 0;
 
-    a->writelog = jdns_list_new();
-    a->writelog->valueList = 1;
+    a->writelog = 0;
+    a->rdata_shared = 0;
     return a;
 }
 
+static void jdns_packet_resource_add_write(jdns_packet_resource_t *a, jdns_packet_write_t *write)
+{
+    if(!a->writelog)
+    {
+        a->writelog = jdns_list_new();
+        a->writelog->valueList = 1;
+    }
+    jdns_list_insert_value(a->writelog, write, -1);
+}
+
 jdns_packet_resource_t *jdns_packet_resource_copy(const jdns_packet_resource_t *a)
 {
     jdns_packet_resource_t *c = jdns_packet_resource_new();
@@ -537,8 +644,8 @@ jdns_packet_resource_t *jdns_packet_resource_copy(const jdns_packet_resource_t *
     c->rdlength = a->rdlength;
     c->rdata = jdns_copy_array(a->rdata, a->rdlength);
 
-    jdns_list_delete(c->writelog);
-    c->writelog = jdns_list_copy(a->writelog);
+    if(a->writelog)
+        c->writelog = jdns_list_copy(a->writelog);
     return c;
 }
 
@@ -547,7 +654,7 @@ void jdns_packet_resource_delete(jdns_packet_resource_t *a)
     if(!a)
         return;
     jdns_string_delete(a->qname);
-    if(a->rdata)
+    if(a->rdata && !a->rdata_shared)
         jdns_free(a->rdata);
     jdns_list_delete(a->writelog);
     jdns_object_free(a);
@@ -559,7 +666,7 @@ void jdns_packet_resource_add_bytes(jdns_packet_resource_t *a, const unsigned ch
     write->type = JDNS_PACKET_WRITE_RAW;
     write->value = jdns_string_new();
     jdns_string_set(write->value, data, size);
-    jdns_list_insert_value(a->writelog, write, -1);
+    jdns_packet_resource_add_write(a, write);
     jdns_packet_write_delete(write);
 }
 
@@ -568,13 +675,13 @@ void jdns_packet_resource_add_name(jdns_packet_resource_t *a, const jdns_string_
     jdns_packet_write_t *write = jdns_packet_write_new();
     write->type = JDNS_PACKET_WRITE_NAME;
     write->value = jdns_string_copy(name);
-    jdns_list_insert_value(a->writelog, write, -1);
+    jdns_packet_resource_add_write(a, write);
     jdns_packet_write_delete(write);
 }
 
 int jdns_packet_resource_read_name(const jdns_packet_resource_t *a, const jdns_packet_t *p, int *at, jdns_string_t **name)
 {
-    return readlabel(a->rdata, a->rdlength, p->raw_data, p->raw_size, at, name);
+    return readlabel(a->rdata, a->rdlength, p->raw_data, p->raw_size, (jdns_packet_name_cache_t *)p->name_cache, at, name);
 }
 
 //----------------------------------------------------------------------------
@@ -585,14 +692,35 @@ int jdns_packet_resource_read_name(const jdns_packet_resource_t *a, const jdns_p
 //   even if later items cause an error.  this turns out to be convenient
 //   for handling truncated dns packets
 
-static int process_qsection(jdns_list_t *dest, int count, const unsigned char *data, int size, const unsigned char **bufp)
+// appends the item without copying it, as jdns_list_insert would do for a
+//   value list.  the item array is made for 'expected' items at once
+static void list_take(jdns_list_t *a, void *item, int expected)
 {
-    int n;
+    if(!a->item)
+        a->item = (void **)jdns_alloc(sizeof(void *) * (expected > 0 ? expected : 1));
+    else if(a->count >= expected)
+        a->item = (void **)jdns_realloc(a->item, sizeof(void *) * (a->count + 1));
+    a->item[a->count++] = item;
+}
+
+// how many items of at least minsize can follow, to not trust the counts of
+//   the header with the allocation
+static int expected_items(int count, int minsize, const unsigned char *data, int size, const unsigned char *buf)
+{
+    int left = (size - (buf - data)) / minsize;
+    return count < left ? count : left;
+}
+
+static int process_qsection(jdns_list_t *dest, int count, const unsigned char *data, int size, jdns_packet_name_cache_t *cache, const unsigned char **bufp)
+{
+    int n, expected;
     int offset, at;
     jdns_string_t *name = 0;
     const unsigned char *buf;
 
     buf = *bufp;
+    // root name + type + class
+    expected = expected_items(count, 5, data, size, buf);
     for(n = 0; n < count; ++n)
     {
         jdns_packet_question_t *q;
@@ -600,7 +728,7 @@ static int process_qsection(jdns_list_t *dest, int count, const unsigned char *d
         offset = buf - data;
         at = 0;
 
-        if(!readlabel(data + offset, size - offset, data, size, &at, &name))
+        if(!readlabel(data + offset, size - offset, data, size, cache, &at, &name))
             goto error;
 
         offset += at;
@@ -617,8 +745,7 @@ static int process_qsection(jdns_list_t *dest, int count, const unsigned char *d
         q->qtype = net2short(&buf);
         q->qclass = net2short(&buf);
 
-        jdns_list_insert_value(dest, q, -1);
-        jdns_packet_question_delete(q);
+        list_take(dest, q, expected);
     }
 
     *bufp = buf;
@@ -629,14 +756,17 @@ error:
     return 0;
 }
 
-static int process_rrsection(jdns_list_t *dest, int count, const unsigned char *data, int size, const unsigned char **bufp)
+// the rdata is not copied, it points into data.  the packet keeps that
+static int process_rrsection(jdns_list_t *dest, int count, const unsigned char *data, int size, jdns_packet_name_cache_t *cache, const unsigned char **bufp)
 {
-    int n;
+    int n, expected;
     int offset, at;
     jdns_string_t *name = 0;
     const unsigned char *buf;
 
     buf = *bufp;
+    // root name + type + class + ttl + rdlength
+    expected = expected_items(count, 11, data, size, buf);
     for(n = 0; n < count; ++n)
     {
         jdns_packet_resource_t *r;
@@ -644,7 +774,7 @@ static int process_rrsection(jdns_list_t *dest, int count, const unsigned char *
         offset = buf - data;
         at = 0;
 
-        if(!readlabel(data + offset, size - offset, data, size, &at, &name))
+        if(!readlabel(data + offset, size - offset, data, size, cache, &at, &name))
             goto error;
 
         offset += at;
@@ -679,11 +809,14 @@ static int process_rrsection(jdns_list_t *dest, int count, const unsigned char *
             goto error;
         }
 
-        r->rdata = jdns_copy_array(buf, r->rdlength);
+        if(r->rdlength > 0)
+        {
+            r->rdata = (unsigned char *)buf;
+            r->rdata_shared = 1;
+        }
         buf += r->rdlength;
 
-        jdns_list_insert_value(dest, r, -1);
-        jdns_packet_resource_delete(r);
+        list_take(dest, r, expected);
     }
 
     *bufp = buf;
@@ -750,7 +883,7 @@ static int append_rrsection(const jdns_list_t *src, int at, int left, unsigned c
         buf += 2;
 
         // play write log
-        for(i = 0; i < r->writelog->count; ++i)
+        for(i = 0; r->writelog && i < r->writelog->count; ++i)
         {
             jdns_packet_write_t *write = (jdns_packet_write_t *)r->writelog->item[i];
             if(write->type == JDNS_PACKET_WRITE_RAW)
@@ -806,6 +939,7 @@ jdns_packet_t *jdns_packet_new()
 
     a->raw_size = 0;
     a->raw_data = 0;
+    a->name_cache = 0;
     return a;
 }
 
@@ -849,6 +983,8 @@ void jdns_packet_delete(jdns_packet_t *a)
     jdns_list_delete(a->additionalRecords);
     if(a->raw_data)
         jdns_free(a->raw_data);
+    if(a->name_cache)
+        jdns_free(a->name_cache);
     jdns_object_free(a);
 }
 
@@ -866,6 +1002,13 @@ int jdns_packet_import(jdns_packet_t **a, const unsigned char *data, int size)
         goto error;
 
     tmp = jdns_packet_new();
+
+    // keep the raw data for reference during rdata parsing.  the
+    //   resources point into it, so parse from it as well
+    tmp->raw_size = size;
+    tmp->raw_data = jdns_copy_array(data, size);
+    tmp->name_cache = name_cache_new();
+    data = tmp->raw_data;
     buf = data;
 
     // id
@@ -895,22 +1038,18 @@ int jdns_packet_import(jdns_packet_t **a, const unsigned char *data, int size)
 
     // if these fail, we don't count them as errors, since the packet
     //   might have been truncated
-    if(!process_qsection(tmp->questions, tmp->qdcount, data, size, &buf))
+    if(!process_qsection(tmp->questions, tmp->qdcount, data, size, (jdns_packet_name_cache_t *)tmp->name_cache, &buf))
         goto skip;
-    if(!process_rrsection(tmp->answerRecords, tmp->ancount, data, size, &buf))
+    if(!process_rrsection(tmp->answerRecords, tmp->ancount, data, size, (jdns_packet_name_cache_t *)tmp->name_cache, &buf))
         goto skip;
-    if(!process_rrsection(tmp->authorityRecords, tmp->nscount, data, size, &buf))
+    if(!process_rrsection(tmp->authorityRecords, tmp->nscount, data, size, (jdns_packet_name_cache_t *)tmp->name_cache, &buf))
         goto skip;
-    if(!process_rrsection(tmp->additionalRecords, tmp->arcount, data, size, &buf))
+    if(!process_rrsection(tmp->additionalRecords, tmp->arcount, data, size, (jdns_packet_name_cache_t *)tmp->name_cache, &buf))
         goto skip;
 
     tmp->fully_parsed = 1;
 
 skip:
-    // keep the raw data for reference during rdata parsing
-    tmp->raw_size = size;
-    tmp->raw_data = jdns_copy_array(data, size);
-
     *a = tmp;
     return 1;
 
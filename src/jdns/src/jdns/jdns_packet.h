@@ -67,7 +67,8 @@ typedef struct jdns_packet_resource
     unsigned char *rdata;
 
     // private
-    jdns_list_t *writelog; // jdns_packet_write_t
+    jdns_list_t *writelog; // jdns_packet_write_t, created on first write
+    int rdata_shared;      // rdata points into the raw_data of the packet
 } jdns_packet_resource_t;
 
 jdns_packet_resource_t *jdns_packet_resource_new();
@@ -105,6 +106,9 @@ struct jdns_packet
 
     int raw_size;
     unsigned char *raw_data;
+
+    // private
+    void *name_cache; // names decoded from raw_data, by offset
 };
 
 jdns_packet_t *jdns_packet_new();
@@ -25,6 +25,7 @@
 #include "qjdns_sock.h"
 
 #include <stdio.h> // for fprintf
+#include <string.h> // for memcpy
 #include <time.h>
 
 // safeobj stuff, from qca
@@ -262,6 +263,7 @@ static jdns_rr_t *export_record(const QJDns::Record &in)
 QJDns::NameServer::NameServer()
 {
     port = JDNS_UNICAST_PORT;
+    tlsPort = 0;
 }
 
 //----------------------------------------------------------------------------
@@ -282,6 +284,227 @@ bool QJDns::Record::verify() const
     return (ok ? true : false);
 }
 
+//----------------------------------------------------------------------------
+// QJDnsStreamUpstream
+//----------------------------------------------------------------------------
+#define STREAM_CONNECT_TIMEOUT 3000
+#define STREAM_IDLE_TIMEOUT    30000
+#define STREAM_RETRY_INTERVAL  60000
+
+// connections to a name server for answers that were truncated over udp
+#define TCP_POOL_SIZE          2
+
+static int dns_id(const QByteArray &packet)
+{
+    return ((unsigned char)packet[0] << 8) + (unsigned char)packet[1];
+}
+
+QJDnsStreamUpstream::QJDnsStreamUpstream(const QJDns::NameServer &_server, bool _tls, QObject *parent)
+    : QObject(parent)
+    , server(_server)
+    , tls(_tls)
+    , handle(-1)
+    , sock(0)
+    , ready(false)
+    , answered(false)
+    , failedRecently(false)
+    , connectTimeout(this)
+    , idleTimer(this)
+{
+    connect(&connectTimeout, SIGNAL(timeout()), SLOT(connectTimeout_timeout()));
+    connectTimeout.setSingleShot(true);
+
+    connect(&idleTimer, SIGNAL(timeout()), SLOT(idleTimer_timeout()));
+    idleTimer.setSingleShot(true);
+}
+
+QJDnsStreamUpstream::~QJDnsStreamUpstream()
+{
+    closeSocket();
+}
+
+bool QJDnsStreamUpstream::isUsable() const
+{
+    return !failedRecently || failedAt.elapsed() >= STREAM_RETRY_INTERVAL;
+}
+
+int QJDnsStreamUpstream::pendingCount() const
+{
+    return outstanding.count();
+}
+
+void QJDnsStreamUpstream::write(const QByteArray &query)
+{
+    if(query.size() < 2)
+        return;
+
+    failedRecently = false;
+    idleTimer.stop();
+
+    // jdns resends to the same server when the answer is slow, which is
+    //   pointless over tcp
+    int id = dns_id(query);
+    if(outstanding.contains(id))
+        return;
+    outstanding.insert(id, query);
+
+    if(!sock)
+        connectToServer();
+    else if(ready)
+        sendQuery(query);
+}
+
+void QJDnsStreamUpstream::connectToServer()
+{
+    ready = false;
+    answered = false;
+    inbuf.clear();
+
+#ifndef QT_NO_SSL
+    if(tls)
+    {
+        QSslSocket *ssl = new QSslSocket(this);
+        connect(ssl, SIGNAL(encrypted()), SLOT(sock_ready()));
+        sock = ssl;
+    }
+    else
+#endif
+    {
+        sock = new QTcpSocket(this);
+        connect(sock, SIGNAL(connected()), SLOT(sock_ready()));
+    }
+    connect(sock, SIGNAL(readyRead()), SLOT(sock_readyRead()));
+    connect(sock, SIGNAL(disconnected()), SLOT(sock_closed()));
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    connect(sock, SIGNAL(errorOccurred(QAbstractSocket::SocketError)), SLOT(sock_closed()));
+#else
+    connect(sock, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(sock_closed()));
+#endif
+
+#ifndef QT_NO_SSL
+    if(tls)
+    {
+        QSslSocket *ssl = static_cast<QSslSocket *>(sock);
+
+        // without a name there is nothing to check the certificate against,
+        //   so it's just privacy from passive observers (RFC 7858 section 4.1)
+        QString peerName = server.tlsName;
+        if(peerName.isEmpty())
+        {
+            ssl->setPeerVerifyMode(QSslSocket::VerifyNone);
+            peerName = server.address.toString();
+        }
+        ssl->connectToHostEncrypted(server.address.toString(), server.tlsPort, peerName);
+    }
+    else
+#endif
+        sock->connectToHost(server.address, server.port);
+    connectTimeout.start(STREAM_CONNECT_TIMEOUT);
+}
+
+void QJDnsStreamUpstream::sendQuery(const QByteArray &query)
+{
+    QByteArray buf;
+    buf += (char)((query.size() >> 8) & 0xff);
+    buf += (char)(query.size() & 0xff);
+    buf += query;
+    sock->write(buf);
+}
+
+void QJDnsStreamUpstream::closeSocket()
+{
+    if(!sock)
+        return;
+    releaseAndDeleteLater(this, sock);
+    sock = 0;
+    ready = false;
+    connectTimeout.stop();
+}
+
+void QJDnsStreamUpstream::fail(const QString &reason)
+{
+    closeSocket();
+    failedRecently = true;
+    failedAt.start();
+
+    emit debugLine(QString("%1 to %2:%3 failed (%4), using udp for a while")
+        .arg(tls ? "tls" : "tcp").arg(server.address.toString()).arg(tls ? server.tlsPort : server.port)
+        .arg(reason));
+
+    QList<QByteArray> queries = outstanding.values();
+    outstanding.clear();
+    emit failed(queries);
+}
+
+void QJDnsStreamUpstream::sock_ready()
+{
+    connectTimeout.stop();
+    ready = true;
+    sock->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+    foreach(const QByteArray &query, outstanding)
+        sendQuery(query);
+}
+
+void QJDnsStreamUpstream::sock_readyRead()
+{
+    inbuf += sock->readAll();
+
+    while(inbuf.size() >= 2)
+    {
+        int size = dns_id(inbuf); // the length prefix reads the same way
+        if(inbuf.size() < 2 + size)
+            break;
+
+        QByteArray response = inbuf.mid(2, size);
+        inbuf = inbuf.mid(2 + size);
+
+        // not ours, or not anymore
+        if(response.size() < 2 || !outstanding.remove(dns_id(response)))
+            continue;
+
+        answered = true;
+        emit responseReady(response);
+    }
+
+    if(outstanding.isEmpty())
+        idleTimer.start(STREAM_IDLE_TIMEOUT);
+}
+
+void QJDnsStreamUpstream::sock_closed()
+{
+    if(!sock)
+        return;
+
+    QString reason = sock->errorString();
+    closeSocket();
+
+    // closed while idle, connect again when needed
+    if(outstanding.isEmpty())
+        return;
+
+    // servers may close a connection that has been working at any time,
+    //   try once more before giving up on it
+    if(answered)
+    {
+        connectToServer();
+        return;
+    }
+
+    fail(reason);
+}
+
+void QJDnsStreamUpstream::connectTimeout_timeout()
+{
+    fail("timed out");
+}
+
+void QJDnsStreamUpstream::idleTimer_timeout()
+{
+    if(outstanding.isEmpty())
+        closeSocket();
+}
+
 //----------------------------------------------------------------------------
 // QJDns
 //----------------------------------------------------------------------------
@@ -351,6 +574,11 @@ void QJDns::Private::cleanup()
     qDeleteAll(socketForHandle);
     socketForHandle.clear();
     handleForSocket.clear();
+    qDeleteAll(tlsUpstreams);
+    tlsUpstreams.clear();
+    qDeleteAll(tcpUpstreams);
+    tcpUpstreams.clear();
+    streamResponses.clear();
 
     stepTrigger.stop();
     stepTimeout.stop();
@@ -370,6 +598,7 @@ bool QJDns::Private::init(QJDns::Mode _mode, const QHostAddress &address)
     callbacks.udp_unbind = cb_udp_unbind;
     callbacks.udp_read = cb_udp_read;
     callbacks.udp_write = cb_udp_write;
+    callbacks.tcp_write = cb_tcp_write;
     sess = jdns_session_new(&callbacks);
     jdns_set_hold_ids_enabled(sess, 1);
     next_handle = 1;
@@ -414,6 +643,61 @@ void QJDns::Private::setNameServers(const QList<NameServer> &nslist)
     }
     jdns_set_nameservers(sess, addrs);
     jdns_nameserverlist_delete(addrs);
+
+    // this is done for every query, so keep the connections to the servers
+    //   which are still there
+    for(int n = 0; n < tcpUpstreams.count(); ++n)
+    {
+        QJDnsStreamUpstream *u = tcpUpstreams[n];
+        bool found = false;
+        for(int k = 0; k < nslist.count(); ++k)
+        {
+            if(nslist[k].address == u->server.address && nslist[k].port == u->server.port)
+            {
+                found = true;
+                break;
+            }
+        }
+        if(!found)
+        {
+            tcpUpstreams.removeAt(n);
+            --n; // adjust position
+            delete u;
+        }
+    }
+
+#ifndef QT_NO_SSL
+    QList<QJDnsStreamUpstream*> keep;
+    for(int n = 0; n < nslist.count(); ++n)
+    {
+        const NameServer &ns = nslist[n];
+        if(ns.tlsPort <= 0)
+            continue;
+
+        QJDnsStreamUpstream *u = 0;
+        foreach(QJDnsStreamUpstream *i, tlsUpstreams)
+        {
+            if(i->server.address == ns.address && i->server.port == ns.port && i->server.tlsPort == ns.tlsPort
+                && i->server.tlsName == ns.tlsName)
+            {
+                u = i;
+                break;
+            }
+        }
+
+        if(u)
+        {
+            tlsUpstreams.removeAll(u);
+        }
+        else
+        {
+            u = newUpstream(ns, true);
+        }
+        keep += u;
+    }
+    qDeleteAll(tlsUpstreams);
+    tlsUpstreams = keep;
+#endif
 }
 
 void QJDns::Private::process()
@@ -638,6 +922,97 @@ void QJDns::Private::udp_readyRead()
     }
 }
 
+QJDnsStreamUpstream *QJDns::Private::newUpstream(const NameServer &ns, bool tls)
+{
+    QJDnsStreamUpstream *u = new QJDnsStreamUpstream(ns, tls, this);
+    connect(u, SIGNAL(responseReady(QByteArray)), SLOT(upstream_responseReady(QByteArray)));
+    connect(u, SIGNAL(failed(QList<QByteArray>)), SLOT(upstream_failed(QList<QByteArray>)));
+    connect(u, SIGNAL(debugLine(QString)), SLOT(upstream_debugLine(QString)));
+    return u;
+}
+
+QJDnsStreamUpstream *QJDns::Private::tlsUpstreamFor(const QHostAddress &address, int port) const
+{
+    foreach(QJDnsStreamUpstream *u, tlsUpstreams)
+    {
+        if(u->server.address == address && u->server.port == port)
+            return u;
+    }
+    return 0;
+}
+
+QJDnsStreamUpstream *QJDns::Private::tcpUpstreamFor(const QHostAddress &address, int port)
+{
+    QJDnsStreamUpstream *best = 0;
+    int count = 0;
+    foreach(QJDnsStreamUpstream *u, tcpUpstreams)
+    {
+        if(u->server.address != address || u->server.port != port)
+            continue;
+
+        // they all fail the same way
+        if(!u->isUsable())
+            return 0;
+
+        ++count;
+        if(!best || u->pendingCount() < best->pendingCount())
+            best = u;
+    }
+
+    // all busy, open another one while the pool has room
+    if(!best || (best->pendingCount() > 0 && count < TCP_POOL_SIZE))
+    {
+        NameServer ns;
+        ns.address = address;
+        ns.port = port;
+        best = newUpstream(ns, false);
+        tcpUpstreams += best;
+    }
+    return best;
+}
+
+void QJDns::Private::upstream_responseReady(const QByteArray &response)
+{
+    QJDnsStreamUpstream *u = static_cast<QJDnsStreamUpstream *>(sender());
+
+    // same as udp, eat it if jdns doesn't want to read
+    if(!need_handle)
+        return;
+
+    StreamResponse r;
+    r.handle = u->handle;
+    r.address = u->server.address;
+    r.port = u->server.port;
+    r.data = response;
+    streamResponses += r;
+
+    jdns_set_handle_readable(sess, u->handle);
+    process();
+}
+
+void QJDns::Private::upstream_failed(const QList<QByteArray> &queries)
+{
+    QJDnsStreamUpstream *u = static_cast<QJDnsStreamUpstream *>(sender());
+
+    QUdpSocket *sock = socketForHandle.value(u->handle);
+    if(!sock)
+        return;
+
+    // don't let them wait for the next retry of jdns.  a query that came
+    //   over tcp for being truncated gets the truncated answer this time
+    foreach(const QByteArray &query, queries)
+    {
+        if(sock->writeDatagram(query, u->server.address, u->server.port) != -1)
+            ++pending;
+    }
+}
+
+void QJDns::Private::upstream_debugLine(const QString &line)
+{
+    debug_strings += line;
+    processDebug();
+}
+
 void QJDns::Private::udp_bytesWritten(qint64)
 {
     if(pending > 0)
@@ -767,6 +1142,20 @@ int QJDns::Private::cb_udp_read(jdns_session_t *, void *app, int handle, jdns_ad
 {
     QJDns::Private *self = (QJDns::Private *)app;
 
+    for(int n = 0; n < self->streamResponses.count(); ++n)
+    {
+        if(self->streamResponses[n].handle != handle)
+            continue;
+
+        StreamResponse r = self->streamResponses.takeAt(n);
+        int size = qMin(r.data.size(), *bufsize);
+        memcpy(buf, r.data.constData(), size);
+        qt2addr_set(addr, r.address);
+        *port = r.port;
+        *bufsize = size;
+        return 1;
+    }
+
     QUdpSocket *sock = self->socketForHandle.value(handle);
     if(!sock)
         return 0;
@@ -796,6 +1185,13 @@ int QJDns::Private::cb_udp_write(jdns_session_t *, void *app, int handle, const
         return 0;
 
     QHostAddress host = addr2qt(addr);
+    QJDnsStreamUpstream *u = self->tlsUpstreamFor(host, port);
+    if(u && u->isUsable())
+    {
+        u->handle = handle;
+        u->write(QByteArray((const char *)buf, bufsize));
+        return 1;
+    }
     int ret = sock->writeDatagram((const char *)buf, bufsize, host, port);
     if(ret == -1)
     {
@@ -811,6 +1207,22 @@ int QJDns::Private::cb_udp_write(jdns_session_t *, void *app, int handle, const
     return 1;
 }
 
+int QJDns::Private::cb_tcp_write(jdns_session_t *, void *app, int handle, const jdns_address_t *addr, int port, const unsigned char *buf, int bufsize)
+{
+    QJDns::Private *self = (QJDns::Private *)app;
+
+    if(!self->socketForHandle.contains(handle))
+        return 0;
+
+    QJDnsStreamUpstream *u = self->tcpUpstreamFor(addr2qt(addr), port);
+    if(!u)
+        return 0;
+
+    u->handle = handle;
+    u->write(QByteArray((const char *)buf, bufsize));
+    return 1;
+}
+
 QJDns::QJDns(QObject *parent)
 :QObject(parent)
 {
@@ -967,6 +1379,11 @@ void QJDns::setNameServers(const QList<NameServer> &list)
     d->setNameServers(list);
 }
 
+void QJDns::setEdnsPayload(int size)
+{
+    jdns_set_edns_payload(d->sess, size);
+}
+
 int QJDns::queryStart(const QByteArray &name, int type)
 {
     int id = jdns_query(d->sess, (const unsigned char *)name.data(), type);
@@ -32,6 +32,7 @@
 #include <QStringList>
 #include <QTime>
 
+class QTcpSocket;
 class QTimer;
 class QUdpSocket;
 
@@ -61,6 +62,53 @@ private:
     QTimer *t;
 };
 
+// a stream connection to one name server, DNS over TLS (RFC 7858) or plain tcp for the answers that
+//   were truncated over udp.  it carries the queries of the session to it, pipelined, and is closed when
+//   it's idle.  if it can't be made to work, the queries still waiting are handed back to go over udp,
+//   and so is everything else for a while
+class QJDnsStreamUpstream : public QObject
+{
+    Q_OBJECT
+public:
+    QJDns::NameServer server;
+    bool tls;
+    int handle; // of the socket jdns sends to the server through
+
+    QJDnsStreamUpstream(const QJDns::NameServer &server, bool tls, QObject *parent = 0);
+    ~QJDnsStreamUpstream();
+
+    bool isUsable() const;
+    int pendingCount() const;
+    void write(const QByteArray &query);
+
+signals:
+    void responseReady(const QByteArray &response);
+    void failed(const QList<QByteArray> &queries);
+    void debugLine(const QString &line);
+
+private slots:
+    void sock_ready();
+    void sock_readyRead();
+    void sock_closed();
+    void connectTimeout_timeout();
+    void idleTimer_timeout();
+
+private:
+    QTcpSocket *sock; // a QSslSocket for tls
+    bool ready; // connected, and encrypted for tls
+    bool answered; // since connecting
+    bool failedRecently;
+    QTime failedAt;
+    QByteArray inbuf;
+    QHash<int,QByteArray> outstanding; // by dns id
+    SafeTimer connectTimeout, idleTimer;
+
+    void connectToServer();
+    void sendQuery(const QByteArray &query);
+    void closeSocket();
+    void fail(const QString &reason);
+};
+
 class QJDns::Private : public QObject
 {
     Q_OBJECT
@@ -81,6 +129,15 @@ public:
         bool do_cancel;
     };
 
+    class StreamResponse
+    {
+    public:
+        int handle;
+        QHostAddress address;
+        int port;
+        QByteArray data;
+    };
+
     QJDns *q;
     QJDns::Mode mode;
     jdns_session_t *sess;
@@ -97,6 +154,9 @@ public:
     int pending;
     bool pending_wait;
     bool complete_shutdown;
+    QList<QJDnsStreamUpstream*> tlsUpstreams;
+    QList<QJDnsStreamUpstream*> tcpUpstreams; // a few per name server
+    QList<StreamResponse> streamResponses; // as if they came in over udp
 
     // pointers that will point to things we are currently signalling
     //   about.  when a query or publish is cancelled, we can use these
@@ -114,10 +174,16 @@ public:
     void processDebug();
     void doNextStep();
     void removeCancelled(int id);
+    QJDnsStreamUpstream *newUpstream(const NameServer &ns, bool tls);
+    QJDnsStreamUpstream *tlsUpstreamFor(const QHostAddress &address, int port) const;
+    QJDnsStreamUpstream *tcpUpstreamFor(const QHostAddress &address, int port);
     
 private slots:
     void udp_readyRead();
     void udp_bytesWritten(qint64);
+    void upstream_responseReady(const QByteArray &response);
+    void upstream_failed(const QList<QByteArray> &queries);
+    void upstream_debugLine(const QString &line);
     void st_timeout();
     void doNextStepSlot();
     void doDebug();
@@ -130,6 +196,7 @@ private:
     static void cb_udp_unbind(jdns_session_t *, void *app, int handle);
     static int cb_udp_read(jdns_session_t *, void *app, int handle, jdns_address_t *addr, int *port, unsigned char *buf, int *bufsize);
     static int cb_udp_write(jdns_session_t *, void *app, int handle, const jdns_address_t *addr, int port, unsigned char *buf, int bufsize);
+    static int cb_tcp_write(jdns_session_t *, void *app, int handle, const jdns_address_t *addr, int port, const unsigned char *buf, int bufsize);
 };
 
 #endif // QJDNS_P_H
@@ -38,32 +38,106 @@
 
 #include "qjdnsshared_p.h"
 
+// UnicastInternet queries in flight per name server, the others are queued
+#define QUERIES_PER_NAMESERVER 16
+
+// how often the files behind the system info are looked at
+#define SYSINFO_CHECK_INTERVAL 500
+
 // for caching system info
 
+class FileStamp
+{
+public:
+    QString path;
+    QDateTime modified; // invalid if missing
+    qint64 size;
+
+    bool operator==(const FileStamp &other) const
+    {
+        return path == other.path && modified == other.modified && size == other.size;
+    }
+};
+
 class SystemInfoCache
 {
 public:
     QJDns::SystemInfo info;
+    QHash<QByteArray,QList<QHostAddress> > hosts; // by lowercase name, in file order
+    QList<FileStamp> stamps;
+    bool valid;
     QTime time;
+
+    SystemInfoCache() : valid(false) {}
 };
 
 Q_GLOBAL_STATIC(QMutex, jdnsshared_mutex)
 Q_GLOBAL_STATIC(SystemInfoCache, jdnsshared_infocache)
 
+// what the system info is read from.  none on windows, where most of it
+//   is in the registry
+static QList<FileStamp> sys_info_stamps()
+{
+    QList<FileStamp> out;
+#ifndef Q_OS_WIN
+    QStringList paths;
+    paths << "/etc/resolv.conf" << "/etc/hosts";
+    foreach(const QString &path, paths)
+    {
+        QFileInfo fi(path);
+        FileStamp stamp;
+        stamp.path = path;
+        stamp.modified = fi.exists() ? fi.lastModified() : QDateTime();
+        stamp.size = fi.exists() ? fi.size() : -1;
+        out += stamp;
+    }
+#endif
+    return out;
+}
+
+// the mutex must be locked
+static SystemInfoCache *sys_info_cache()
+{
+    SystemInfoCache *c = jdnsshared_infocache();
+
+    // look for changes every 1/2 second at most, enough to prevent doing
+    //   it 20 times because of all the different resolves
+    if(c->valid && !c->time.isNull() && c->time.elapsed() < SYSINFO_CHECK_INTERVAL)
+        return c;
+    c->time.start();
+
+    // parsing a large hosts file takes a while, so only do it again when
+    //   the files changed.  without files to look at, do it every time
+    QList<FileStamp> stamps = sys_info_stamps();
+    if(c->valid && !stamps.isEmpty() && stamps == c->stamps)
+        return c;
+
+    c->info = QJDns::systemInfo();
+    c->stamps = stamps;
+    c->valid = true;
+    c->hosts.clear();
+    foreach(const QJDns::DnsHost &host, c->info.hosts)
+        c->hosts[host.name.toLower()] += host.address;
+    return c;
+}
+
 static QJDns::SystemInfo get_sys_info()
 {
     QMutexLocker locker(jdnsshared_mutex());
-    SystemInfoCache *c = jdnsshared_infocache();
+    return sys_info_cache()->info;
+}
 
-    // cache info for 1/2 second, enough to prevent re-reading of sys
-    //   info 20 times because of all the different resolves
-    if(c->time.isNull() || c->time.elapsed() >= 500)
+// the first address of the protocol given for name in the hosts file
+static QHostAddress get_sys_host(const QByteArray &name, QAbstractSocket::NetworkLayerProtocol protocol)
+{
+    QMutexLocker locker(jdnsshared_mutex());
+    const QList<QHostAddress> addrs = sys_info_cache()->hosts.value(name.toLower());
+    foreach(const QHostAddress &addr, addrs)
     {
-        c->info = QJDns::systemInfo();
-        c->time.start();
+        if(addr.protocol() == protocol)
+            return addr;
     }
-
-    return c->info;
+    return QHostAddress();
 }
 
 static bool domainCompare(const QByteArray &a, const QByteArray &b)
@@ -298,6 +372,7 @@ QStringList QJDnsSharedDebug::readDebugLines()
 QJDnsSharedPrivate::QJDnsSharedPrivate(QJDnsShared *_q)
     : QObject(_q)
     , q(_q)
+    , nameServerCount(0)
 {
 }
 
@@ -466,7 +541,12 @@ void QJDnsSharedPrivate::late_shutdown()
     emit q->shutdownFinished();
 }
 
-QJDnsSharedRequestPrivate::QJDnsSharedRequestPrivate(QJDnsSharedRequest *_q) : QObject(_q), q(_q), lateTimer(this)
+QJDnsSharedRequestPrivate::QJDnsSharedRequestPrivate(QJDnsSharedRequest *_q)
+    : QObject(_q)
+    , q(_q)
+    , priority(QJDnsSharedRequest::Interactive)
+    , queued(false)
+    , lateTimer(this)
 {
     connect(&lateTimer, SIGNAL(timeout()), SLOT(lateTimer_timeout()));
 }
@@ -503,6 +583,16 @@ QJDnsSharedRequest::Type QJDnsSharedRequest::type()
     return d->type;
 }
 
+void QJDnsSharedRequest::setPriority(Priority p)
+{
+    d->jsp->querySetPriority(this, p);
+}
+
+QJDnsSharedRequest::Priority QJDnsSharedRequest::priority() const
+{
+    return d->priority;
+}
+
 void QJDnsSharedRequest::query(const QByteArray &name, int type)
 {
     cancel();
@@ -525,7 +615,7 @@ void QJDnsSharedRequest::publishUpdate(const QJDns::Record &record)
 void QJDnsSharedRequest::cancel()
 {
     d->lateTimer.stop();
-    if(!d->handles.isEmpty())
+    if(!d->handles.isEmpty() || d->queued)
     {
         if(d->type == Query)
             d->jsp->queryCancel(this);
@@ -588,6 +678,11 @@ void QJDnsShared::removeInterface(const QHostAddress &addr)
     d->removeInterface(addr);
 }
 
+void QJDnsShared::setNameServers(const QList<QJDns::NameServer> &list)
+{
+    d->nameServers = list;
+}
+
 void QJDnsShared::shutdown()
 {
     d->shutting_down = true;
@@ -802,6 +897,7 @@ void QJDnsSharedPrivate::removeInterface(const QHostAddress &addr)
             if(mode == QJDnsShared::UnicastInternet || mode == QJDnsShared::UnicastLocal)
             {
                 // for unicast, we'll invalidate with ErrorNoNet
+                requests.remove(obj);
                 obj->d->success = false;
                 obj->d->error = QJDnsSharedRequest::ErrorNoNet;
                 obj->d->lateTimer.start();
@@ -816,6 +912,9 @@ void QJDnsSharedPrivate::removeInterface(const QHostAddress &addr)
     }
 
     addDebug(index, QString("removing from %1").arg(addr.toString()));
+
+    // the queued ones fail the same way if there is nothing left
+    startPending();
 }
 
 void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &name, int qType)
@@ -861,33 +960,28 @@ void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &n
         }
     }
 
-    QJDns::SystemInfo sysInfo = get_sys_info();
-
     // is the input name a known host and the qType is an address record?
     if(qType == QJDns::Aaaa || qType == QJDns::A)
     {
-        QByteArray lname = name.toLower();
-        QList<QJDns::DnsHost> known = sysInfo.hosts;
-        foreach(QJDns::DnsHost host, known)
+        QHostAddress addr = get_sys_host(name, qType == QJDns::Aaaa ? QAbstractSocket::IPv6Protocol
+            : QAbstractSocket::IPv4Protocol);
+        if(!addr.isNull())
         {
-            if(((qType == QJDns::Aaaa && host.address.protocol() == QAbstractSocket::IPv6Protocol)
-                || (qType == QJDns::A && host.address.protocol() == QAbstractSocket::IPv4Protocol))
-                && host.name.toLower() == lname)
-            {
-                QJDns::Record rec;
-                rec.owner = name;
-                rec.type = qType;
-                rec.ttl = 120;
-                rec.haveKnown = true;
-                rec.address = host.address;
-                obj->d->success = true;
-                obj->d->results = QList<QJDns::Record>() << rec;
-                obj->d->lateTimer.start();
-                return;
-            }
+            QJDns::Record rec;
+            rec.owner = name;
+            rec.type = qType;
+            rec.ttl = 120;
+            rec.haveKnown = true;
+            rec.address = addr;
+            obj->d->success = true;
+            obj->d->results = QList<QJDns::Record>() << rec;
+            obj->d->lateTimer.start();
+            return;
         }
     }
 
+    QJDns::SystemInfo sysInfo = get_sys_info();
+
     // if we have no QJDns instances to operate on, then error
     if(instances.isEmpty())
     {
@@ -902,7 +996,7 @@ void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &n
         QList<QJDns::NameServer> ns_v6;
         QList<QJDns::NameServer> ns_v4;
         {
-            QList<QJDns::NameServer> nameServers = sysInfo.nameServers;
+            QList<QJDns::NameServer> nameServers = this->nameServers.isEmpty() ? sysInfo.nameServers : this->nameServers;
             foreach(QJDns::NameServer ns, nameServers)
             {
                 if(ns.address.protocol() == QAbstractSocket::IPv6Protocol)
@@ -911,6 +1005,7 @@ void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &n
                     ns_v4 += ns;
             }
         }
+        nameServerCount = qMax(ns_v6.count(), ns_v4.count());
         foreach(Instance *i, instances)
         {
             if(i->addr.protocol() == QAbstractSocket::IPv6Protocol)
@@ -918,6 +1013,73 @@ void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &n
             else
                 i->jdns->setNameServers(ns_v4);
         }
+
+        // a burst of queries would overwhelm a small resolver, take
+        //   them in turn
+        obj->d->queued = true;
+        pending[obj->d->priority] += obj;
+        startPending();
+        return;
+    }
+
+    queryLaunch(obj);
+}
+
+void QJDnsSharedPrivate::queryCancel(QJDnsSharedRequest *obj)
+{
+    if(obj->d->queued)
+    {
+        pending[obj->d->priority].removeAll(obj);
+        obj->d->queued = false;
+        return;
+    }
+
+    if(!requests.contains(obj))
+        return;
+
+    foreach(Handle h, obj->d->handles)
+    {
+        h.jdns->queryCancel(h.id);
+        requestForHandle.remove(h);
+    }
+
+    obj->d->handles.clear();
+    requests.remove(obj);
+    startPending();
+}
+
+void QJDnsSharedPrivate::querySetPriority(QJDnsSharedRequest *obj, QJDnsSharedRequest::Priority p)
+{
+    if(obj->d->priority == p)
+        return;
+
+    if(obj->d->queued)
+    {
+        pending[obj->d->priority].removeAll(obj);
+        pending[p] += obj;
+    }
+    obj->d->priority = p;
+    startPending();
+}
+
+int QJDnsSharedPrivate::queryLimit(QJDnsSharedRequest::Priority p) const
+{
+    int limit = QUERIES_PER_NAMESERVER * qMax(nameServerCount, 1);
+
+    // leave the other half to the interactive queries
+    if(p == QJDnsSharedRequest::Background)
+        limit = qMax(limit / 2, 1);
+    return limit;
+}
+
+void QJDnsSharedPrivate::queryLaunch(QJDnsSharedRequest *obj)
+{
+    // the interfaces may have gone while it was queued
+    if(instances.isEmpty())
+    {
+        obj->d->error = QJDnsSharedRequest::ErrorNoNet;
+        obj->d->lateTimer.start();
+        return;
     }
 
     // keep track of this request
@@ -926,7 +1088,7 @@ void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &n
     // query on all jdns instances
     foreach(Instance *i, instances)
     {
-        Handle h(i->jdns, i->jdns->queryStart(name, qType));
+        Handle h(i->jdns, i->jdns->queryStart(obj->d->name, obj->d->qType));
         obj->d->handles += h;
 
         // keep track of this handle for this request
@@ -934,19 +1096,18 @@ void QJDnsSharedPrivate::queryStart(QJDnsSharedRequest *obj, const QByteArray &n
     }
 }
 
-void QJDnsSharedPrivate::queryCancel(QJDnsSharedRequest *obj)
+void QJDnsSharedPrivate::startPending()
 {
-    if(!requests.contains(obj))
-        return;
-
-    foreach(Handle h, obj->d->handles)
+    // in flight are the requests, as there are no publishes in this mode
+    for(int p = QJDnsSharedRequest::Interactive; p <= QJDnsSharedRequest::Background; ++p)
     {
-        h.jdns->queryCancel(h.id);
-        requestForHandle.remove(h);
+        while(!pending[p].isEmpty() && requests.count() < queryLimit(QJDnsSharedRequest::Priority(p)))
+        {
+            QJDnsSharedRequest *obj = pending[p].takeFirst();
+            obj->d->queued = false;
+            queryLaunch(obj);
+        }
     }
-
-    obj->d->handles.clear();
-    requests.remove(obj);
 }
 
 void QJDnsSharedPrivate::publishStart(QJDnsSharedRequest *obj, QJDns::PublishMode m, const QJDns::Record &record)
@@ -1041,6 +1202,7 @@ void QJDnsSharedPrivate::jdns_resultsReady(int id, const QJDns::Response &result
 
         obj->d->handles.clear();
         requests.remove(obj);
+        startPending();
     }
     else // Multicast
     {
@@ -1149,6 +1311,7 @@ void QJDnsSharedPrivate::jdns_error(int id, QJDns::Error e)
             return;
 
         requests.remove(obj);
+        startPending();
 
         obj->d->success = false;
         QJDnsSharedRequest::Error x = QJDnsSharedRequest::ErrorGeneric;
@@ -161,6 +161,7 @@ public:
     bool shutting_down;
     QJDnsSharedDebug *db;
     QString dbname;
+    QList<QJDns::NameServer> nameServers; // instead of the system ones
 
     QList<Instance*> instances;
     QHash<QJDns*,Instance*> instanceForQJDns;
@@ -168,6 +169,10 @@ public:
     QSet<QJDnsSharedRequest*> requests;
     QHash<Handle,QJDnsSharedRequest*> requestForHandle;
 
+    // UnicastInternet queries waiting for the name servers, by priority
+    QList<QJDnsSharedRequest*> pending[2];
+    int nameServerCount; // of the ip version having more
+
     QJDnsSharedPrivate(QJDnsShared *_q);
     QJDnsSharedRequest *findRequest(QJDns *jdns, int id) const;
     void jdns_link(QJDns *jdns);
@@ -181,6 +186,10 @@ public:
 
     void queryStart(QJDnsSharedRequest *obj, const QByteArray &name, int qType);
     void queryCancel(QJDnsSharedRequest *obj);
+    void querySetPriority(QJDnsSharedRequest *obj, QJDnsSharedRequest::Priority p);
+    int queryLimit(QJDnsSharedRequest::Priority p) const;
+    void queryLaunch(QJDnsSharedRequest *obj);
+    void startPending();
     void publishStart(QJDnsSharedRequest *obj, QJDns::PublishMode m, const QJDns::Record &record);
     void publishUpdate(QJDnsSharedRequest *obj, const QJDns::Record &record);
     void publishCancel(QJDnsSharedRequest *obj);
@@ -205,6 +214,8 @@ public:
 
     // current action
     QJDnsSharedRequest::Type type;
+    QJDnsSharedRequest::Priority priority;
+    bool queued; // in QJDnsSharedPrivate::pending
     QByteArray name;
     int qType;
     QJDns::PublishMode pubmode;
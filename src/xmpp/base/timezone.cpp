@@ -18,12 +18,88 @@
 
 #include "timezone.h"
 
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QEvent>
+#include <QMutex>
+#include <QPointer>
+#include <QThread>
 #include <QTimeZone>
 #include <QtGlobal>
 
-int TimeZone::offsetFromUtc() { return QTimeZone::systemTimeZone().offsetFromUtc(QDateTime::currentDateTime()) / 60; }
+// the zone settings of the system may change without an event
+#define TIMEZONE_RECHECK_INTERVAL 60000
 
-QString TimeZone::abbreviation() { return QTimeZone::systemTimeZone().abbreviation(QDateTime::currentDateTime()); }
+namespace {
+class ZoneWatcher : public QObject {
+public:
+    bool eventFilter(QObject *obj, QEvent *event) override
+    {
+        if (event->type() == QEvent::TimeZoneChange)
+            TimeZone::refresh();
+        return QObject::eventFilter(obj, event);
+    }
+};
+
+class ZoneCache {
+public:
+    QMutex                m;
+    QDeadlineTimer        validUntil { 0 }; // expired
+    int                   offset = 0;       // in minutes
+    QString               abbreviation;
+    QPointer<ZoneWatcher> watcher; // goes with the application
+
+    void update()
+    {
+        if (!validUntil.hasExpired())
+            return;
+
+        // the application gets the change events on its thread
+        if (!watcher && qApp && QThread::currentThread() == qApp->thread()) {
+            watcher = new ZoneWatcher;
+            watcher->setParent(qApp);
+            qApp->installEventFilter(watcher);
+        }
+
+        QTimeZone tz    = QTimeZone::systemTimeZone();
+        QDateTime now   = QDateTime::currentDateTime();
+        offset          = tz.offsetFromUtc(now) / 60;
+        abbreviation    = tz.abbreviation(now);
+        qint64 interval = TIMEZONE_RECHECK_INTERVAL;
+        if (tz.hasTransitions()) {
+            QDateTime next = tz.nextTransition(now).atUtc;
+            if (next.isValid())
+                interval = qBound(qint64(0), now.msecsTo(next), interval);
+        }
+        validUntil.setRemainingTime(interval);
+    }
+};
+
+Q_GLOBAL_STATIC(ZoneCache, zoneCache)
+} // namespace
+
+int TimeZone::offsetFromUtc()
+{
+    auto         c = zoneCache();
+    QMutexLocker locker(&c->m);
+    c->update();
+    return c->offset;
+}
+
+QString TimeZone::abbreviation()
+{
+    auto         c = zoneCache();
+    QMutexLocker locker(&c->m);
+    c->update();
+    return c->abbreviation;
+}
+
+void TimeZone::refresh()
+{
+    auto         c = zoneCache();
+    QMutexLocker locker(&c->m);
+    c->validUntil = QDeadlineTimer(0);
+}
 
 int TimeZone::tzdToInt(const QString &tzd)
 {
@@ -23,11 +23,14 @@
 
 #include <QObject>
 
+// the system zone is looked up once and kept until its next transition, a QEvent::TimeZoneChange or a minute
+//   at most, as that may change without an event on some platforms
 class TimeZone {
 public:
     static int     offsetFromUtc(); // in minutes
     static QString abbreviation();
     static int     tzdToInt(const QString &tzd);
+    static void    refresh(); // forget the cached zone, e.g. when the application was told of a change
 };
 
 #endif // IRIS_TIMEZONE_H
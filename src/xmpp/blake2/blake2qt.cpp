@@ -4,6 +4,8 @@
 
 #include <QIODevice>
 
+#include <cstring>
+
 namespace XMPP {
 /* Padded structs result in a compile-time error */
 static_assert(sizeof(blake2s_param) == BLAKE2S_OUTBYTES, "sizeof(blake2s_param) != BLAKE2S_OUTBYTES");
@@ -64,6 +66,21 @@ QByteArray Blake2Hash::final()
     return QByteArray();
 }
 
+QByteArray Blake2Hash::saveState() const
+{
+    if (!d)
+        return QByteArray();
+    return QByteArray(reinterpret_cast<const char *>(&d->state), int(sizeof(d->state)));
+}
+
+bool Blake2Hash::restoreState(const QByteArray &state)
+{
+    if (!d || state.size() != int(sizeof(d->state)))
+        return false;
+    std::memcpy(&d->state, state.constData(), sizeof(d->state));
+    return true;
+}
+
 QByteArray Blake2Hash::compute(const QByteArray &ba, DigestSize digestSize)
 {
     // otherwise try to libb2 or bundled reference implementation depending on which is available
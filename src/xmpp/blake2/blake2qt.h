@@ -21,6 +21,9 @@ public:
     bool       addData(QIODevice *dev);
     QByteArray final();
     bool       isValid() const { return d != nullptr; }
+    // raw hashing state, to continue later. it's valid only for the same build of the library
+    QByteArray saveState() const;
+    bool       restoreState(const QByteArray &state);
 
     static QByteArray compute(const QByteArray &ba, DigestSize digestSize);
     static QByteArray compute(QIODevice *dev, DigestSize digestSize);
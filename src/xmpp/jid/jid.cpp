@@ -24,7 +24,9 @@
 #endif
 
 #include "qstringprep.h"
+#include <QCache>
 #include <QCoreApplication>
+#include <QMutex>
 
 using namespace XMPP;
 
@@ -32,6 +34,7 @@ using namespace XMPP;
 // StringPrepCache
 //----------------------------------------------------------------------------
 std::unique_ptr<StringPrepCache> StringPrepCache::_instance;
+QMutex                           StringPrepCache::mutex;
 
 bool StringPrepCache::nameprep(const QString &in, int maxbytes, QString &out)
 {
@@ -40,6 +43,7 @@ bool StringPrepCache::nameprep(const QString &in, int maxbytes, QString &out)
         return false; // empty names or just spaces are disallowed (rfc5892+rfc6122)
     }
 
+    QMutexLocker     locker(&mutex);
     StringPrepCache *that = instance();
 
     auto it = that->nameprep_table.constFind(in);
@@ -68,6 +72,7 @@ bool StringPrepCache::nodeprep(const QString &in, int maxbytes, QString &out)
         return true;
     }
 
+    QMutexLocker     locker(&mutex);
     StringPrepCache *that = instance();
 
     auto it = that->nodeprep_table.constFind(in);
@@ -96,6 +101,7 @@ bool StringPrepCache::resourceprep(const QString &in, int maxbytes, QString &out
         return true;
     }
 
+    QMutexLocker     locker(&mutex);
     StringPrepCache *that = instance();
 
     auto it = that->resourceprep_table.constFind(in);
@@ -124,6 +130,7 @@ bool StringPrepCache::saslprep(const QString &in, int maxbytes, QString &out)
         return true;
     }
 
+    QMutexLocker     locker(&mutex);
     StringPrepCache *that = instance();
 
     auto it = that->saslprep_table.constFind(in);
@@ -145,7 +152,11 @@ bool StringPrepCache::saslprep(const QString &in, int maxbytes, QString &out)
     return true;
 }
 
-void StringPrepCache::cleanup() { _instance.reset(nullptr); }
+void StringPrepCache::cleanup()
+{
+    QMutexLocker locker(&mutex);
+    _instance.reset(nullptr);
+}
 
 StringPrepCache *StringPrepCache::instance()
 {
@@ -173,19 +184,64 @@ static inline bool validResource(const QString &s, QString &norm)
     return StringPrepCache::resourceprep(s, 1024, norm);
 }
 
-Jid::Jid()
+//----------------------------------------------------------------------------
+// JidInternTable
+//----------------------------------------------------------------------------
+// Bounded cache of parsed jids keyed by the string they were parsed from. Stanzas from the same
+// contacts arrive over and over, so most Jid(QString) constructions end up sharing already
+// normalized data instead of splitting and preparing the string again.
+// It's shared by all the clients in the process, hence the lock.
+class JidInternTable {
+public:
+    static const int MaxSize = 8192;
+
+    static bool lookup(const QString &s, QSharedDataPointer<JidData> &out)
+    {
+        JidInternTable &t = instance();
+        QMutexLocker    locker(&t.mutex);
+        auto           *v = t.cache.object(s); // moves it to the front
+        if (!v)
+            return false;
+        out = *v;
+        return true;
+    }
+
+    static void insert(const QString &s, const QSharedDataPointer<JidData> &data)
+    {
+        JidInternTable &t = instance();
+        QMutexLocker    locker(&t.mutex);
+        t.cache.insert(s, new QSharedDataPointer<JidData>(data));
+    }
+
+private:
+    QMutex                                       mutex;
+    QCache<QString, QSharedDataPointer<JidData>> cache { MaxSize };
+
+    static JidInternTable &instance()
+    {
+        static JidInternTable table;
+        return table;
+    }
+};
+
+static const QSharedDataPointer<JidData> &nullJidData()
 {
-    valid = false;
-    null  = true;
+    static const QSharedDataPointer<JidData> data(new JidData);
+    return data;
 }
 
+Jid::Jid() : p(nullJidData()) { }
+
 Jid::~Jid() { }
 
-Jid::Jid(const QString &s) { set(s); }
+Jid::Jid(const QString &s) : p(nullJidData()) { set(s); }
 
-Jid::Jid(const QString &node, const QString &domain, const QString &resource) { set(domain, node, resource); }
+Jid::Jid(const QString &node, const QString &domain, const QString &resource) : p(nullJidData())
+{
+    set(domain, node, resource);
+}
 
-Jid::Jid(const char *s) { set(QString(s)); }
+Jid::Jid(const char *s) : p(nullJidData()) { set(QString(s)); }
 
 Jid &Jid::operator=(const QString &s)
 {
@@ -199,35 +255,33 @@ Jid &Jid::operator=(const char *s)
     return *this;
 }
 
-void Jid::reset()
-{
-    f     = QString();
-    b     = QString();
-    d     = QString();
-    n     = QString();
-    r     = QString();
-    valid = false;
-    null  = true;
-}
+void Jid::reset() { p = nullJidData(); }
 
 void Jid::update()
 {
     // build 'bare' and 'full' jids
-    if (n.isEmpty())
-        b = d;
+    if (p->n.isEmpty())
+        p->b = p->d;
     else
-        b = n + '@' + d;
-    if (r.isEmpty())
-        f = b;
+        p->b = p->n + '@' + p->d;
+    if (p->r.isEmpty())
+        p->f = p->b;
     else
-        f = b + '/' + r;
-    if (f.isEmpty())
-        valid = false;
-    null = f.isEmpty() && r.isEmpty();
+        p->f = p->b + '/' + p->r;
+    if (p->f.isEmpty())
+        p->valid = false;
+    p->null = p->f.isEmpty() && p->r.isEmpty();
 }
 
 void Jid::set(const QString &s)
 {
+    if (s.isEmpty()) {
+        reset();
+        return;
+    }
+    if (JidInternTable::lookup(s, p))
+        return;
+
     QString rest, domain, node, resource;
     QString norm_domain, norm_node, norm_resource;
     int     x = s.indexOf('/');
@@ -240,6 +294,7 @@ void Jid::set(const QString &s)
     }
     if (!validResource(resource, norm_resource)) {
         reset();
+        JidInternTable::insert(s, p);
         return;
     }
 
@@ -253,15 +308,18 @@ void Jid::set(const QString &s)
     }
     if (!validDomain(domain, norm_domain) || !validNode(node, norm_node)) {
         reset();
+        JidInternTable::insert(s, p);
         return;
     }
 
-    valid = true;
-    null  = false;
-    d     = norm_domain;
-    n     = norm_node;
-    r     = norm_resource;
+    p        = new JidData;
+    p->valid = true;
+    p->null  = false;
+    p->d     = norm_domain;
+    p->n     = norm_node;
+    p->r     = norm_resource;
     update();
+    JidInternTable::insert(s, p);
 }
 
 void Jid::set(const QString &domain, const QString &node, const QString &resource)
@@ -271,53 +329,54 @@ void Jid::set(const QString &domain, const QString &node, const QString &resourc
         reset();
         return;
     }
-    valid = true;
-    null  = false;
-    d     = norm_domain;
-    n     = norm_node;
-    r     = norm_resource;
+    p        = new JidData;
+    p->valid = true;
+    p->null  = false;
+    p->d     = norm_domain;
+    p->n     = norm_node;
+    p->r     = norm_resource;
     update();
 }
 
 void Jid::setDomain(const QString &s)
 {
-    if (!valid)
+    if (!p.constData()->valid)
         return;
     QString norm;
     if (!validDomain(s, norm)) {
         reset();
         return;
     }
-    d = norm;
+    p->d = norm;
     update();
 }
 
 void Jid::setNode(const QString &s)
 {
-    if (!valid)
+    if (!p.constData()->valid)
         return;
     QString norm;
     if (!validNode(s, norm)) {
         reset();
         return;
     }
-    n = norm;
+    p->n = norm;
     update();
 }
 
 void Jid::setResource(const QString &s)
 {
-    if (r == s) {
+    if (p.constData()->r == s) {
         return;
     }
-    if (!valid)
+    if (!p.constData()->valid)
         return;
     QString norm;
     if (!validResource(s, norm)) {
         reset();
         return;
     }
-    r = norm;
+    p->r = norm;
     update();
 }
 
@@ -342,18 +401,22 @@ Jid Jid::withResource(const QString &s) const
     return j;
 }
 
-bool Jid::isValid() const { return valid; }
+bool Jid::isValid() const { return p->valid; }
 
-bool Jid::isEmpty() const { return f.isEmpty(); }
+bool Jid::isEmpty() const { return p->f.isEmpty(); }
 
 bool Jid::compare(const Jid &a, bool compareRes) const
 {
-    if (null && a.null)
+    // same interned data
+    if (p == a.p)
+        return p->null || p->valid;
+
+    if (p->null && a.p->null)
         return true;
 
     // only compare valid jids
-    if (!valid || !a.valid)
+    if (!p->valid || !a.p->valid)
         return false;
 
-    return !(compareRes ? (f != a.f) : (b != a.b));
+    return !(compareRes ? (p->f != a.p->f) : (p->b != a.p->b));
 }
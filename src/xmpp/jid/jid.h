@@ -22,9 +22,13 @@
 
 #include <QByteArray>
 #include <QHash>
+#include <QSharedData>
+#include <QSharedDataPointer>
 #include <QString>
 #include <memory>
 
+class QMutex;
+
 namespace XMPP {
 class StringPrepCache {
 public:
@@ -42,11 +46,18 @@ private:
     QHash<QString, QString> saslprep_table;
 
     static std::unique_ptr<StringPrepCache> _instance;
+    static QMutex                           mutex;
     static StringPrepCache                 *instance();
 
     StringPrepCache();
 };
 
+class JidData : public QSharedData {
+public:
+    QString f, b, d, n, r;
+    bool    valid = false, null = true;
+};
+
 class Jid {
 public:
     Jid();
@@ -58,12 +69,12 @@ public:
     Jid &operator=(const QString &s);
     Jid &operator=(const char *s);
 
-    bool           isNull() const { return null; }
-    const QString &domain() const { return d; }
-    const QString &node() const { return n; }
-    const QString &resource() const { return r; }
-    const QString &bare() const { return b; }
-    const QString &full() const { return f; }
+    bool           isNull() const { return p->null; }
+    const QString &domain() const { return p->d; }
+    const QString &node() const { return p->n; }
+    const QString &resource() const { return p->r; }
+    const QString &bare() const { return p->b; }
+    const QString &full() const { return p->f; }
 
     Jid withNode(const QString &s) const;
     Jid withDomain(const QString &s) const;
@@ -87,8 +98,8 @@ private:
     void reset();
     void update();
 
-    QString f, b, d, n, r;
-    bool    valid, null;
+    // shared with the other Jids parsed from the same string. see JidInternTable
+    QSharedDataPointer<JidData> p;
 };
 
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp/jid/jid.h"
+#include "qttestutil/qttestutil.h"
+
+#include <QObject>
+#include <QtTest/QtTest>
+
+using namespace XMPP;
+
+// Measures what a Jid costs to make and to compare, and the stringprep cache behind it.
+class JidBenchmark : public QObject {
+    Q_OBJECT
+
+private:
+    // another string each time, so neither the intern table nor the cache has it
+    QString fresh(const char *prefix) { return QString::fromLatin1(prefix) + QString::number(++counter_); }
+
+private slots:
+    void benchmarkConstructFull()
+    {
+        QBENCHMARK
+        {
+            Jid j("juliet@capulet.example/balcony");
+        }
+    }
+
+    void benchmarkConstructBare()
+    {
+        QBENCHMARK
+        {
+            Jid j("juliet@capulet.example");
+        }
+    }
+
+    void benchmarkConstructParts()
+    {
+        QBENCHMARK
+        {
+            Jid j("juliet", "capulet.example", "balcony");
+        }
+    }
+
+    void benchmarkConstructUnseen()
+    {
+        QBENCHMARK
+        {
+            Jid j(fresh("romeo") + "@montague.example/orchard");
+        }
+    }
+
+    void benchmarkConstructNonAscii()
+    {
+        QBENCHMARK
+        {
+            Jid j(QString::fromUtf8("J\xc3\xbcliet@Stra\xc3\x9f" "e.example/Balkon"));
+        }
+    }
+
+    void benchmarkCopy()
+    {
+        Jid a("juliet@capulet.example/balcony");
+        QBENCHMARK
+        {
+            Jid b(a);
+        }
+    }
+
+    void benchmarkCompareEqual()
+    {
+        Jid  a("juliet@capulet.example/balcony");
+        Jid  b(QString("juliet@capulet.example/") + "balcony");
+        bool same = false;
+        QBENCHMARK
+        {
+            same = a == b;
+        }
+        QVERIFY(same);
+    }
+
+    void benchmarkCompareBare()
+    {
+        Jid  a("juliet@capulet.example/balcony");
+        Jid  b("juliet@capulet.example/chamber");
+        bool same = false;
+        QBENCHMARK
+        {
+            same = a.compare(b, false);
+        }
+        QVERIFY(same);
+    }
+
+    void benchmarkCompareDifferent()
+    {
+        Jid  a("juliet@capulet.example/balcony");
+        Jid  b("romeo@montague.example/orchard");
+        bool same = true;
+        QBENCHMARK
+        {
+            same = a == b;
+        }
+        QVERIFY(!same);
+    }
+
+    void benchmarkNodePrepHit()
+    {
+        QString out;
+        StringPrepCache::nodeprep("Juliet", 1024, out);
+        QBENCHMARK
+        {
+            StringPrepCache::nodeprep("Juliet", 1024, out);
+        }
+    }
+
+    void benchmarkNodePrepMiss()
+    {
+        QString out;
+        QBENCHMARK
+        {
+            StringPrepCache::nodeprep(fresh("Juliet"), 1024, out);
+        }
+    }
+
+    void benchmarkNamePrepHit()
+    {
+        QString out;
+        StringPrepCache::nameprep("Capulet.Example", 1024, out);
+        QBENCHMARK
+        {
+            StringPrepCache::nameprep("Capulet.Example", 1024, out);
+        }
+    }
+
+    void benchmarkNamePrepMiss()
+    {
+        QString out;
+        QBENCHMARK
+        {
+            StringPrepCache::nameprep(fresh("capulet") + ".example", 1024, out);
+        }
+    }
+
+    void benchmarkResourcePrepHit()
+    {
+        QString out;
+        StringPrepCache::resourceprep("Balcony Home", 1024, out);
+        QBENCHMARK
+        {
+            StringPrepCache::resourceprep("Balcony Home", 1024, out);
+        }
+    }
+
+    void benchmarkResourcePrepMiss()
+    {
+        QString out;
+        QBENCHMARK
+        {
+            StringPrepCache::resourceprep(fresh("Balcony "), 1024, out);
+        }
+    }
+
+    // the misses above fill the cache, it shouldn't slow down the following tests
+    void cleanupTestCase() { StringPrepCache::cleanup(); }
+
+private:
+    int counter_ = 0;
+};
+
+QTTESTUTIL_REGISTER_TEST(JidBenchmark);
+#include "jidbenchmark.moc"
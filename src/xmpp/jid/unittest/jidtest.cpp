@@ -38,6 +38,27 @@ private slots:
         QCOMPARE(testling.domain(), QString("bar"));
         QCOMPARE(testling.resource(), QString("baz"));
     }
+
+    void testInternedCopiesStayIndependent()
+    {
+        Jid a("foo@bar/baz");
+        Jid b("foo@bar/baz");
+        QVERIFY(a == b);
+
+        b = b.withResource("other");
+        QCOMPARE(a.full(), QString("foo@bar/baz"));
+        QCOMPARE(b.full(), QString("foo@bar/other"));
+        QVERIFY(a.compare(b, false));
+        QVERIFY(Jid("foo@bar/baz") == a);
+    }
+
+    void testInvalidStringIsNull()
+    {
+        Jid testling("@bar");
+        QVERIFY(!testling.isValid());
+        QVERIFY(!Jid("@bar").isValid());
+        QVERIFY(Jid("") == Jid());
+    }
 };
 
 QTTESTUTIL_REGISTER_TEST(JidTest);
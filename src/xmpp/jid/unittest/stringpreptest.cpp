@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qstringprep.h"
+#include "qttestutil/qttestutil.h"
+
+#include <QObject>
+#include <QtTest/QtTest>
+
+// Checks the ASCII fast path of stringprep() against the generic code and measures both.
+class StringPrepTest : public QObject {
+    Q_OBJECT
+
+private:
+    static int prep(QString &s, const Stringprep_profile *profile, bool generic)
+    {
+        return stringprep(s, generic ? STRINGPREP_NO_ASCII_PATH : Stringprep_profile_flags(0), profile);
+    }
+
+    static void addProfiles()
+    {
+        QTest::addColumn<int>("profile");
+        QTest::newRow("nameprep") << 0;
+        QTest::newRow("nodeprep") << 1;
+        QTest::newRow("resourceprep") << 2;
+        QTest::newRow("saslprep") << 3;
+    }
+
+    static const Stringprep_profile *profile(int n)
+    {
+        const Stringprep_profile *profiles[] = { stringprep_nameprep, stringprep_xmpp_nodeprep,
+                                                 stringprep_xmpp_resourceprep, stringprep_saslprep };
+        return profiles[n];
+    }
+
+    static QStringList samples()
+    {
+        return { "example.com", "Juliet",  "juliet",   "Balcony Home", "a@b",    "foo/bar", "x\ty",
+                 "tab\x7f",     "<tag>",   "it's",     "Straße",       "٠", "",        "Mixed.CASE.org",
+                 " space",      "quote\"", "amp&char", "colon:" };
+    }
+
+private slots:
+    void testAsciiPathMatchesGeneric_data() { addProfiles(); }
+    void testAsciiPathMatchesGeneric()
+    {
+        QFETCH(int, profile);
+        const auto list = samples();
+        for (const QString &s : list) {
+            QString fast = s, generic = s;
+            int     rcFast    = prep(fast, StringPrepTest::profile(profile), false);
+            int     rcGeneric = prep(generic, StringPrepTest::profile(profile), true);
+            QCOMPARE(rcFast, rcGeneric);
+            if (rcFast == STRINGPREP_OK)
+                QCOMPARE(fast, generic);
+        }
+    }
+
+    void benchmarkAsciiPath_data() { addProfiles(); }
+    void benchmarkAsciiPath()
+    {
+        QFETCH(int, profile);
+        QBENCHMARK
+        {
+            QString s("Romeo.Montague-42");
+            prep(s, StringPrepTest::profile(profile), false);
+        }
+    }
+
+    void benchmarkGenericPath_data() { addProfiles(); }
+    void benchmarkGenericPath()
+    {
+        QFETCH(int, profile);
+        QBENCHMARK
+        {
+            QString s("Romeo.Montague-42");
+            prep(s, StringPrepTest::profile(profile), true);
+        }
+    }
+};
+
+QTTESTUTIL_REGISTER_TEST(StringPrepTest);
+#include "stringpreptest.moc"
@@ -31,10 +31,40 @@ void TestRegistry::registerTest(QObject *test) { tests_ += test; }
 
 int TestRegistry::runTests(int argc, char *argv[])
 {
+    QStringList args;
+    bool        benchmarks = false;
+    for (int i = 0; i < argc; ++i) {
+        if (i > 0 && QByteArray(argv[i]) == "-benchmarks")
+            benchmarks = true;
+        else
+            args += QString::fromLocal8Bit(argv[i]);
+    }
+    if (benchmarks)
+        return runBenchmarks(args);
+
     int result = 0;
     foreach (QObject *test, tests_) {
         result |= QTest::qExec(test, argc, argv);
     }
     return result;
 }
+
+int TestRegistry::runBenchmarks(const QStringList &args)
+{
+    int result = 0;
+    foreach (QObject *test, tests_) {
+        const QMetaObject *mo = test->metaObject();
+        QStringList        functions;
+        for (int i = mo->methodOffset(); i < mo->methodCount(); ++i) {
+            QMetaMethod m    = mo->method(i);
+            QByteArray  name = m.name();
+            if (m.methodType() == QMetaMethod::Slot && m.access() == QMetaMethod::Private
+                && name.startsWith("benchmark") && !name.endsWith("_data"))
+                functions += QString::fromLatin1(name);
+        }
+        if (!functions.isEmpty())
+            result |= QTest::qExec(test, args + functions);
+    }
+    return result;
+}
 } // namespace QtTestUtil
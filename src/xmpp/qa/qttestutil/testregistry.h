@@ -20,6 +20,7 @@
 #define QTTESTUTIL_TESTREGISTRY_H
 
 #include <QList>
+#include <QStringList>
 
 class QObject;
 
@@ -45,10 +46,18 @@ public:
     void registerTest(QObject *);
 
     /**
-     * Run all registered tests using QTest::qExec()
+     * Run all registered tests using QTest::qExec().
+     * With -benchmarks among the arguments, only the benchmark* slots
+     * of the tests are run, see runBenchmarks().
      */
     int runTests(int argc, char *argv[]);
 
+    /**
+     * Run the benchmark* slots of all registered tests, with the
+     * QtTest arguments given, e.g. -iterations or -callgrind.
+     */
+    int runBenchmarks(const QStringList &args);
+
 private:
     TestRegistry() { }
 
@@ -21,6 +21,8 @@
 #include "xmpp/jid/jid.h"
 
 #include <QByteArray>
+#include <QCache>
+#include <QMutex>
 #include <QRegularExpression>
 #include <QString>
 #include <QTextStream>
@@ -28,14 +30,90 @@
 #include <QtDebug>
 
 namespace XMPP {
-QCA::SecureArray HMAC_SHA_1(const QCA::SecureArray &key, const QCA::SecureArray &str)
+static QCA::SecureArray HMAC(const QString &hash, const QCA::SecureArray &key, const QCA::SecureArray &str)
 {
-    QCA::SecureArray result = QCA::MessageAuthenticationCode("hmac(sha1)", key).process(str);
+    return QCA::MessageAuthenticationCode(QString("hmac(%1)").arg(hash), key).process(str);
+}
+
+// Hi() of RFC 5802, for hashes the provider has no PBKDF2 for
+static QCA::SecureArray Hi(const QString &hash, const QCA::SecureArray &str, const QByteArray &salt,
+                           unsigned int i)
+{
+    QCA::MessageAuthenticationCode mac(QString("hmac(%1)").arg(hash), QCA::SymmetricKey(str));
+    mac.update(QCA::SecureArray(salt + QByteArray("\0\0\0\1", 4)));
+    QCA::SecureArray u      = mac.final();
+    QCA::SecureArray result = u;
+    for (unsigned int n = 1; n < i; ++n) {
+        mac.clear();
+        mac.update(u);
+        u = mac.final();
+        for (int k = 0; k < result.size(); ++k)
+            result[k] = result[k] ^ u[k];
+    }
     return result;
 }
 
+//----------------------------------------------------------------------------
+// SCRAMKeyCache
+//----------------------------------------------------------------------------
+// Keys derived by the last logins. Hi() is deliberately expensive and the server hands out the same
+// salt and iteration count on every login, so there is no point in running it again as long as the
+// password is the same. The keys depend on nothing but hash, password, salt and iteration count,
+// which is what they are looked up by. Shared by all the streams of the process, hence the lock.
+class SCRAMKeyCache {
+public:
+    static const int MaxSize = 4096;
+
+    struct Keys {
+        QCA::SecureArray salted_password;
+        QCA::SecureArray client_key;
+        QCA::SecureArray server_key;
+    };
+
+    // password is the normalized one
+    static QString key(const QString &hash, const QByteArray &password, const QString &salt, const QString &icount)
+    {
+        // don't keep the password itself around as part of the key
+        QCA::SecureArray digest = QCA::Hash(hash).process(QCA::SecureArray(password + salt.toUtf8()));
+        return hash + QLatin1Char(',') + salt + QLatin1Char(',') + icount + QLatin1Char(',')
+            + QCA::Base64().arrayToString(digest);
+    }
+
+    static bool lookup(const QString &key, Keys &out)
+    {
+        SCRAMKeyCache &c = instance();
+        QMutexLocker   locker(&c.mutex);
+        auto          *k = c.cache.object(key);
+        if (!k)
+            return false;
+        out = *k;
+        return true;
+    }
+
+    static void insert(const QString &key, const Keys &keys)
+    {
+        SCRAMKeyCache &c = instance();
+        QMutexLocker   locker(&c.mutex);
+        c.cache.insert(key, new Keys(keys));
+    }
+
+private:
+    QMutex                mutex;
+    QCache<QString, Keys> cache { MaxSize };
+
+    static SCRAMKeyCache &instance()
+    {
+        static SCRAMKeyCache c;
+        return c;
+    }
+};
+
+//----------------------------------------------------------------------------
+// SCRAMSHA1Response
+//----------------------------------------------------------------------------
 SCRAMSHA1Response::SCRAMSHA1Response(const QByteArray &server_first_message, const QByteArray &password_in,
-                                     const QByteArray &client_first_message, const QString &salted_password_base64)
+                                     const QByteArray &client_first_message, const QString &salted_password_base64,
+                                     const QString &hash)
 {
     QString pass_in = QString::fromUtf8(password_in);
     QString pass_out;
@@ -44,12 +122,11 @@ SCRAMSHA1Response::SCRAMSHA1Response(const QByteArray &server_first_message, con
     auto               match = pattern.match(QString(server_first_message));
     isValid_                 = match.hasMatch();
     if (!isValid_) {
-        qWarning("SASL/SCRAM-SHA-1: Failed to match pattern for server-final-message.");
+        qWarning("SASL/SCRAM: Failed to match pattern for server-final-message.");
         return;
     }
-    QCA::PBKDF2 hi("sha1");
-    if (!hi.context()) {
-        qWarning("SASL/SCRAM-SHA-1: sha1 is not supported by qca.");
+    if (!QCA::isSupported(QString("hmac(%1)").arg(hash).toLatin1().constData())) {
+        qWarning("SASL/SCRAM: %s is not supported by qca.", qPrintable(hash));
         isValid_ = false;
         return;
     }
@@ -60,33 +137,50 @@ SCRAMSHA1Response::SCRAMSHA1Response(const QByteArray &server_first_message, con
 
     unsigned int dkLen;
 
-    QCA::Hash shaHash("sha1");
+    QCA::Hash shaHash(hash);
     shaHash.update("", 0);
     dkLen = shaHash.final().size();
 
-    QByteArray password;
+    SCRAMKeyCache::Keys keys;
 
     // SaltedPassword  := Hi(Normalize(password), salt, i)
     if (salted_password_base64.size() > 0)
-        salted_password_
-            = QCA::SymmetricKey(QCA::SecureArray(QCA::Base64().stringToArray(salted_password_base64.toUtf8())));
-    if (salted_password_.size() == 0) {
+        keys.salted_password = QCA::SecureArray(QCA::Base64().stringToArray(salted_password_base64.toUtf8()));
+    if (keys.salted_password.size() == 0) {
         if (!StringPrepCache::saslprep(pass_in, 1023, pass_out)) {
             isValid_ = false;
             return;
         }
 
-        password = pass_out.toUtf8();
-        salted_password_
-            = hi.makeKey(QCA::SecureArray(password), QCA::InitializationVector(QCA::Base64().stringToArray(salt)),
-                         dkLen, icount.toULong());
+        QByteArray password = pass_out.toUtf8();
+        QString    cacheKey = SCRAMKeyCache::key(hash, password, salt, icount);
+        if (!SCRAMKeyCache::lookup(cacheKey, keys)) {
+            QCA::PBKDF2 hi(hash);
+            if (hi.context())
+                keys.salted_password = hi.makeKey(QCA::SecureArray(password),
+                                                  QCA::InitializationVector(QCA::Base64().stringToArray(salt)), dkLen,
+                                                  icount.toULong());
+            else
+                keys.salted_password
+                    = Hi(hash, QCA::SecureArray(password), QCA::Base64().stringToArray(salt).toByteArray(),
+                         icount.toUInt());
+
+            // ClientKey       := HMAC(SaltedPassword, "Client Key")
+            keys.client_key = HMAC(hash, keys.salted_password, QByteArray("Client Key"));
+            // ServerKey       := HMAC(SaltedPassword, "Server Key")
+            keys.server_key = HMAC(hash, keys.salted_password, QByteArray("Server Key"));
+            SCRAMKeyCache::insert(cacheKey, keys);
+        }
     }
-
-    // ClientKey       := HMAC(SaltedPassword, "Client Key")
-    QCA::SecureArray client_key(HMAC_SHA_1(salted_password_.toByteArray(), QByteArray("Client Key")));
+    if (keys.client_key.isEmpty()) {
+        keys.client_key = HMAC(hash, keys.salted_password, QByteArray("Client Key"));
+        keys.server_key = HMAC(hash, keys.salted_password, QByteArray("Server Key"));
+    }
+    salted_password_ = QCA::SymmetricKey(keys.salted_password);
+    const QCA::SecureArray &client_key = keys.client_key;
 
     // StoredKey       := H(ClientKey)
-    QCA::SecureArray stored_key = QCA::Hash("sha1").process(client_key);
+    QCA::SecureArray stored_key = QCA::Hash(hash).process(client_key);
 
     // assemble client-final-message-without-proof
 
@@ -117,7 +211,7 @@ SCRAMSHA1Response::SCRAMSHA1Response(const QByteArray &server_first_message, con
     auth_message += QCA::SecureArray(",") + QCA::SecureArray(client_final_message.toUtf8());
 
     // ClientSignature := HMAC(StoredKey, AuthMessage)
-    QCA::SecureArray client_signature = HMAC_SHA_1(stored_key, auth_message);
+    QCA::SecureArray client_signature = HMAC(hash, stored_key, auth_message);
 
     // ClientProof     := ClientKey XOR ClientSignature
     QCA::SecureArray client_proof(client_key.size());
@@ -125,11 +219,8 @@ SCRAMSHA1Response::SCRAMSHA1Response(const QByteArray &server_first_message, con
         client_proof[i] = client_key[i] ^ client_signature[i];
     }
 
-    // ServerKey       := HMAC(SaltedPassword, "Server Key")
-    QCA::SecureArray server_key = HMAC_SHA_1(salted_password_, QByteArray("Server Key"));
-
     // ServerSignature := HMAC(ServerKey, AuthMessage)
-    server_signature_ = HMAC_SHA_1(server_key, auth_message);
+    server_signature_ = HMAC(hash, keys.server_key, auth_message);
 
     final_message_stream << ",p=" << QCA::Base64().arrayToString(client_proof);
     value_ = client_final_message.toUtf8();
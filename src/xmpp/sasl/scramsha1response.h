@@ -27,8 +27,10 @@ namespace XMPP {
 
 class SCRAMSHA1Response {
 public:
+    // hash is the QCA name of the mechanism's hash, e.g. "sha256" for SCRAM-SHA-256
     SCRAMSHA1Response(const QByteArray &server_first_message, const QByteArray &password,
-                      const QByteArray &client_first_message, const QString &salted_password_base64);
+                      const QByteArray &client_first_message, const QString &salted_password_base64,
+                      const QString &hash = QStringLiteral("sha1"));
 
     const QByteArray &getValue() const { return value_; }
 
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp/sasl/scramsha1response.h"
+#include "qttestutil/qttestutil.h"
+#include "xmpp/sasl/scramsha1signature.h"
+
+#include <QObject>
+#include <QtCrypto>
+#include <QtTest/QtTest>
+
+using namespace XMPP;
+
+// Measures the client side of a SCRAM login: the proof with the salted password computed or taken from the
+// key cache, and the check of the server signature.
+class SCRAMSHA1Benchmark : public QObject {
+    Q_OBJECT
+
+private:
+    static void addHashes()
+    {
+        QTest::addColumn<QString>("hash");
+        QTest::newRow("sha1") << QString("sha1");
+        QTest::newRow("sha256") << QString("sha256");
+    }
+
+    static bool supported(const QString &hash) { return QCA::isSupported(qPrintable("hmac(" + hash + ")")); }
+
+    // another salt each time, so the key cache has nothing for it
+    QByteArray serverFirst(bool freshSalt)
+    {
+        QByteArray salt = freshSalt ? QByteArray::number(++counter_).toBase64() : QByteArray("QSXCR+Q6sek8bf92");
+        return "r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,s=" + salt + ",i=4096";
+    }
+
+private slots:
+    void benchmarkResponseCached_data() { addHashes(); }
+    void benchmarkResponseCached()
+    {
+        QFETCH(QString, hash);
+        if (!supported(hash))
+            QSKIP("not supported in QCA.");
+        const QByteArray first = serverFirst(false);
+        SCRAMSHA1Response warm(first, "pencil", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "", hash);
+        QBENCHMARK
+        {
+            SCRAMSHA1Response resp(first, "pencil", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "", hash);
+        }
+    }
+
+    void benchmarkResponseUncached_data() { addHashes(); }
+    void benchmarkResponseUncached()
+    {
+        QFETCH(QString, hash);
+        if (!supported(hash))
+            QSKIP("not supported in QCA.");
+        QBENCHMARK
+        {
+            SCRAMSHA1Response resp(serverFirst(true), "pencil", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "", hash);
+        }
+    }
+
+    void benchmarkSignature()
+    {
+        if (!supported("sha1"))
+            QSKIP("not supported in QCA.");
+        SCRAMSHA1Response      resp(serverFirst(false), "pencil", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "");
+        const QCA::SecureArray should = resp.getServerSignature();
+        bool                   valid  = false;
+        QBENCHMARK
+        {
+            valid = SCRAMSHA1Signature("v=rmF9pqV8S7suAoZWja4dJRkFsKQ=", should).isValid();
+        }
+        QVERIFY(valid);
+    }
+
+private:
+    QCA::Initializer initializer;
+    int              counter_ = 0;
+};
+
+QTTESTUTIL_REGISTER_TEST(SCRAMSHA1Benchmark);
+#include "scramsha1benchmark.moc"
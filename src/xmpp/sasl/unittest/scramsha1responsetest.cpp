@@ -50,6 +50,35 @@ private slots:
         }
     }
 
+    void testConstructor_SHA256()
+    {
+        // RFC 7677 example
+        if (!QCA::isSupported("hmac(sha256)"))
+            QSKIP("hmac(sha256) not supported in QCA.");
+        SCRAMSHA1Response resp("r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096",
+                               "pencil", "n,,n=user,r=rOprNGfwEbeRWgbNEkqO", "", "sha256");
+        QByteArray         resp_sig("v=6rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4=");
+        SCRAMSHA1Signature sig(resp_sig, resp.getServerSignature());
+        QCOMPARE(resp.getValue(),
+                 QByteArray("c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+                            "p=dHzbZapWIk4jUhN+Ute9ytag9zjfMHgsqmmiz7AndVQ="));
+        QVERIFY(sig.isValid());
+    }
+
+    void testConstructor_CachedKeys()
+    {
+        // the second login with the same salt comes from the key cache and has to give the same proof
+        QByteArray        first("r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,s=QSXCR+Q6sek8bf92,i=4096");
+        SCRAMSHA1Response resp1(first, "pencil", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "");
+        SCRAMSHA1Response resp2(first, "pencil", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "");
+        QCOMPARE(resp2.getValue(), resp1.getValue());
+        QCOMPARE(resp2.getSaltedPassword(), resp1.getSaltedPassword());
+
+        // but not for another password
+        SCRAMSHA1Response resp3(first, "pencil2", "n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL", "");
+        QVERIFY(resp3.getValue() != resp1.getValue());
+    }
+
 private:
     QCA::Initializer initializer;
 };
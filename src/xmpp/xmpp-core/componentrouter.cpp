@@ -0,0 +1,140 @@
+/*
+ * componentrouter.cpp - stanzas of an external component to the handlers of its users
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "componentrouter.h"
+
+#include "xmpp_clientstream.h"
+
+#include <QHash>
+#include <QPointer>
+#include <QVector>
+
+using namespace XMPP;
+
+class ComponentRouter::Private {
+public:
+    struct User {
+        QString node;
+        Handler handler; // empty for a free slot
+    };
+
+    QPointer<ClientStream>  stream;
+    QVector<User>           users; // indexed by id
+    QVector<int>            freeIds;
+    QHash<QString, int>     byNode;
+    QHash<QString, Handler> replies;
+    Handler                 fallback;
+    quint64                 routed  = 0;
+    quint64                 dropped = 0;
+
+    // the node of a bare, full or domain jid without parsing the jid
+    static QString nodeOf(const QString &to)
+    {
+        int at = to.indexOf(QLatin1Char('@'));
+        if (at == -1)
+            return QString();
+        int slash = to.indexOf(QLatin1Char('/'));
+        if (slash != -1 && slash < at)
+            return QString(); // "domain/res@ource"
+        return to.left(at);
+    }
+
+    // a copy, the handler may remove its user
+    Handler route(const Stanza &s)
+    {
+        if (s.kind() == Stanza::IQ && !replies.isEmpty()) {
+            QString type = s.type();
+            if (type == QLatin1String("result") || type == QLatin1String("error")) {
+                auto it = replies.find(s.id());
+                if (it != replies.end()) {
+                    Handler h = std::move(*it);
+                    replies.erase(it);
+                    return h;
+                }
+            }
+        }
+        QString node = nodeOf(s.element().attribute(QStringLiteral("to")));
+        if (!node.isEmpty()) {
+            auto it = byNode.constFind(node);
+            if (it != byNode.constEnd())
+                return users[*it].handler;
+        }
+        return fallback;
+    }
+};
+
+ComponentRouter::ComponentRouter(ClientStream *stream, QObject *parent) : QObject(parent), d(new Private)
+{
+    d->stream = stream;
+    connect(stream, &ClientStream::readyRead, this, [this]() {
+        QPointer<ComponentRouter> self = this;
+        while (self && d->stream && d->stream->stanzaAvailable()) {
+            Stanza  s       = d->stream->read();
+            Handler handler = d->route(s);
+            if (!handler) {
+                ++d->dropped;
+                continue;
+            }
+            ++d->routed;
+            handler(s);
+        }
+    });
+}
+
+ComponentRouter::~ComponentRouter() { delete d; }
+
+int ComponentRouter::addUser(const QString &node, Handler &&handler)
+{
+    auto it = d->byNode.constFind(node);
+    if (it != d->byNode.constEnd()) {
+        d->users[*it].handler = std::move(handler);
+        return *it;
+    }
+    int id;
+    if (!d->freeIds.isEmpty()) {
+        id = d->freeIds.takeLast();
+    } else {
+        id = d->users.size();
+        d->users.resize(id + 1);
+    }
+    d->users[id] = { node, std::move(handler) };
+    d->byNode.insert(node, id);
+    return id;
+}
+
+void ComponentRouter::removeUser(int id)
+{
+    if (id < 0 || id >= d->users.size() || !d->users[id].handler)
+        return;
+    d->byNode.remove(d->users[id].node);
+    d->users[id] = Private::User();
+    d->freeIds.append(id);
+}
+
+int ComponentRouter::userCount() const { return d->byNode.size(); }
+
+void ComponentRouter::setFallback(Handler &&handler) { d->fallback = std::move(handler); }
+
+void ComponentRouter::expectReply(const QString &id, Handler &&handler) { d->replies.insert(id, std::move(handler)); }
+
+void ComponentRouter::cancelReply(const QString &id) { d->replies.remove(id); }
+
+quint64 ComponentRouter::stanzasRouted() const { return d->routed; }
+
+quint64 ComponentRouter::stanzasDropped() const { return d->dropped; }
@@ -0,0 +1,67 @@
+/*
+ * componentrouter.h - stanzas of an external component to the handlers of its users
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_COMPONENTROUTER_H
+#define XMPP_COMPONENTROUTER_H
+
+#include "xmpp_stanza.h"
+
+#include <QObject>
+
+#include <functional>
+
+namespace XMPP {
+class ClientStream;
+
+/*
+ * Reads a component stream (see ClientStream::connectToComponent()) and hands every stanza to the handler of
+ * the virtual user it is addressed to, e.g. the users of a gateway. Nothing else looks at the stanzas: there
+ * is no Client, no roster, no task tree. The user is the node of the to address, taken from the attribute
+ * as the server sent it, so the nodes should be registered nodeprep'ed.
+ */
+class ComponentRouter : public QObject {
+    Q_OBJECT
+public:
+    using Handler = std::function<void(const Stanza &)>;
+
+    ComponentRouter(ClientStream *stream, QObject *parent = nullptr);
+    ~ComponentRouter();
+
+    // returns the id to remove the user with. a node added again replaces the handler
+    int  addUser(const QString &node, Handler &&handler);
+    void removeUser(int id);
+    int  userCount() const;
+
+    // stanzas to the component itself and to unknown users. they are dropped without one
+    void setFallback(Handler &&handler);
+
+    // the iq result or error with this id goes to the handler rather than to the user, once
+    void expectReply(const QString &id, Handler &&handler);
+    void cancelReply(const QString &id);
+
+    quint64 stanzasRouted() const;
+    quint64 stanzasDropped() const;
+
+private:
+    class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // XMPP_COMPONENTROUTER_H
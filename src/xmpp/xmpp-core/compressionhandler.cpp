@@ -3,28 +3,149 @@
 #include "xmpp/zlib/zlibdecompressor.h"
 
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QPair>
 #include <QTimer>
 
-CompressionHandler::CompressionHandler() : errorCode_(0)
+// amount of input to average the compressor speed over before reconsidering the level
+#define ADAPT_SAMPLE_BYTES (64 * 1024)
+
+//----------------------------------------------------------------------------
+// CompressionEngine
+//----------------------------------------------------------------------------
+CompressionEngine::~CompressionEngine() { }
+
+void CompressionEngine::setLevel(int level) { Q_UNUSED(level) }
+
+int CompressionEngine::level() const { return 0; }
+
+class ZLibEngine : public CompressionEngine {
+public:
+    int compress(const QByteArray &in, QByteArray &out) override { return compressor_.write(in, out); }
+    int decompress(const QByteArray &in, QByteArray &out) override { return decompressor_.write(in, out); }
+
+    void setLevel(int level) override { compressor_.setLevel(level); }
+    int  level() const override
+    {
+        int l = compressor_.level();
+        return l == Z_DEFAULT_COMPRESSION ? 6 : l;
+    }
+
+private:
+    ZLibCompressor   compressor_;
+    ZLibDecompressor decompressor_;
+};
+
+//----------------------------------------------------------------------------
+// Method registry
+//----------------------------------------------------------------------------
+using MethodList = QList<QPair<QString, CompressionHandler::EngineFactory>>;
+
+static QMutex &methodsMutex()
+{
+    static QMutex m;
+    return m;
+}
+
+static MethodList &registeredMethods()
+{
+    static MethodList list;
+    return list;
+}
+
+void CompressionHandler::registerMethod(const QString &method, const EngineFactory &factory)
+{
+    QMutexLocker locker(&methodsMutex());
+    MethodList  &list = registeredMethods();
+    for (auto it = list.begin(); it != list.end(); ++it) {
+        if (it->first == method) {
+            list.erase(it);
+            break;
+        }
+    }
+    list.prepend({ method, factory });
+}
+
+QStringList CompressionHandler::methods()
+{
+    QMutexLocker locker(&methodsMutex());
+    QStringList  names;
+    for (const auto &m : std::as_const(registeredMethods()))
+        names += m.first;
+    if (!names.contains(QLatin1String("zlib")))
+        names += QLatin1String("zlib");
+    return names;
+}
+
+static CompressionEngine *createEngine(const QString &method)
+{
+    {
+        QMutexLocker locker(&methodsMutex());
+        for (const auto &m : std::as_const(registeredMethods())) {
+            if (m.first == method)
+                return m.second();
+        }
+    }
+    if (method != QLatin1String("zlib"))
+        qWarning("CompressionHandler: unknown method %s, using zlib", qPrintable(method));
+    return new ZLibEngine;
+}
+
+//----------------------------------------------------------------------------
+// CompressionHandler
+//----------------------------------------------------------------------------
+CompressionHandler::CompressionHandler(const QString &method) :
+    engine_(createEngine(method)), method_(method), errorCode_(0), linkSpeed_(0), sampleBytes_(0), sampleNsecs_(0)
+{
+}
+
+CompressionHandler::~CompressionHandler() { delete engine_; }
+
+QString CompressionHandler::method() const { return method_; }
+
+void CompressionHandler::setLevel(int level)
 {
-    outgoing_buffer_.open(QIODevice::ReadWrite);
-    compressor_ = new ZLibCompressor(&outgoing_buffer_);
+    linkSpeed_ = 0;
+    engine_->setLevel(level);
+}
+
+int CompressionHandler::level() const { return engine_->level(); }
 
-    incoming_buffer_.open(QIODevice::ReadWrite);
-    decompressor_ = new ZLibDecompressor(&incoming_buffer_);
+void CompressionHandler::setLinkSpeed(qint64 bytesPerSecond)
+{
+    linkSpeed_   = bytesPerSecond;
+    sampleBytes_ = 0;
+    sampleNsecs_ = 0;
 }
 
-CompressionHandler::~CompressionHandler()
+void CompressionHandler::adaptLevel(int bytes, qint64 nsecs)
 {
-    delete compressor_;
-    delete decompressor_;
+    sampleBytes_ += bytes;
+    sampleNsecs_ += nsecs;
+    if (sampleBytes_ < ADAPT_SAMPLE_BYTES)
+        return;
+
+    // Compressing much slower than the link can carry adds latency for nothing, while a compressor
+    // that is far ahead of the link can afford to squeeze harder.
+    qint64 cpuSpeed = sampleNsecs_ > 0 ? sampleBytes_ * 1000000000 / sampleNsecs_ : 0;
+    int    lvl      = engine_->level();
+    if (lvl > 0) {
+        if (cpuSpeed < linkSpeed_ * 4 && lvl > 1)
+            engine_->setLevel(lvl - 1);
+        else if (cpuSpeed > linkSpeed_ * 16 && lvl < 9)
+            engine_->setLevel(lvl + 1);
+    }
+    sampleBytes_ = 0;
+    sampleNsecs_ = 0;
 }
 
 void CompressionHandler::writeIncoming(const QByteArray &a)
 {
     // qDebug("CompressionHandler::writeIncoming");
     // qDebug() << QString("Incoming %1 bytes").arg(a.size());
-    errorCode_ = int(decompressor_->write(a));
+    errorCode_ = engine_->decompress(a, incoming_);
     if (!errorCode_)
         QTimer::singleShot(0, this, SIGNAL(readyRead()));
     else
@@ -34,7 +155,14 @@ void CompressionHandler::writeIncoming(const QByteArray &a)
 void CompressionHandler::write(const QByteArray &a)
 {
     // qDebug() << QString("CompressionHandler::write(%1)").arg(a.size());
-    errorCode_ = compressor_->write(a);
+    if (linkSpeed_ > 0) {
+        QElapsedTimer t;
+        t.start();
+        errorCode_ = engine_->compress(a, outgoing_);
+        adaptLevel(int(a.size()), t.nsecsElapsed());
+    } else {
+        errorCode_ = engine_->compress(a, outgoing_);
+    }
     if (!errorCode_)
         QTimer::singleShot(0, this, SIGNAL(readyReadOutgoing()));
     else
@@ -44,20 +172,18 @@ void CompressionHandler::write(const QByteArray &a)
 QByteArray CompressionHandler::read()
 {
     // qDebug("CompressionHandler::read");
-    QByteArray b = incoming_buffer_.buffer();
-    incoming_buffer_.buffer().clear();
-    incoming_buffer_.reset();
+    QByteArray b = incoming_;
+    incoming_.clear();
     return b;
 }
 
 QByteArray CompressionHandler::readOutgoing(int *i)
 {
     // qDebug("CompressionHandler::readOutgoing");
-    // qDebug() << QString("Outgoing %1 bytes").arg(outgoing_buffer_.size());
-    QByteArray b = outgoing_buffer_.buffer();
-    outgoing_buffer_.buffer().clear();
-    outgoing_buffer_.reset();
-    *i = b.size();
+    // qDebug() << QString("Outgoing %1 bytes").arg(outgoing_.size());
+    QByteArray b = outgoing_;
+    outgoing_.clear();
+    *i = int(b.size());
     return b;
 }
 
@@ -1,17 +1,33 @@
 #ifndef COMPRESSIONHANDLER_H
 #define COMPRESSIONHANDLER_H
 
-#include <QBuffer>
+#include <QByteArray>
 #include <QObject>
+#include <QStringList>
 
-class ZLibCompressor;
-class ZLibDecompressor;
+#include <functional>
+
+// A stream codec. Both calls append to out and return 0 on success or a codec specific error code.
+// Everything passed to compress() has to be decodable by the peer as soon as it arrives.
+class CompressionEngine {
+public:
+    virtual ~CompressionEngine();
+
+    virtual int compress(const QByteArray &in, QByteArray &out)   = 0;
+    virtual int decompress(const QByteArray &in, QByteArray &out) = 0;
+
+    // 1 (fastest) .. 9 (smallest). Engines without levels ignore it
+    virtual void setLevel(int level);
+    virtual int  level() const;
+};
 
 class CompressionHandler : public QObject {
     Q_OBJECT
 
 public:
-    CompressionHandler();
+    using EngineFactory = std::function<CompressionEngine *()>;
+
+    CompressionHandler(const QString &method = QLatin1String("zlib"));
     ~CompressionHandler();
     void       writeIncoming(const QByteArray &a);
     void       write(const QByteArray &a);
@@ -19,16 +35,36 @@ public:
     QByteArray readOutgoing(int *);
     int        errorCode();
 
+    QString method() const;
+
+    // fixed compression level, disables adaptation
+    void setLevel(int level);
+    int  level() const;
+
+    // Estimated link throughput in bytes per second. When set, the level is adjusted to keep the
+    // compressor well ahead of the link: faster levels when CPU is the bottleneck, better ones when
+    // the link is. 0 disables adaptation
+    void setLinkSpeed(qint64 bytesPerSecond);
+
+    // Makes an additional XEP-0138 method available, e.g. a zstd based one for links where both ends
+    // are under our control. Methods registered later are preferred. "zlib" is always available.
+    static void        registerMethod(const QString &method, const EngineFactory &factory);
+    static QStringList methods();
+
 signals:
     void readyRead();
     void readyReadOutgoing();
     void error();
 
 private:
-    ZLibCompressor   *compressor_;
-    ZLibDecompressor *decompressor_;
-    QBuffer           outgoing_buffer_, incoming_buffer_;
-    int               errorCode_;
+    void adaptLevel(int bytes, qint64 nsecs);
+
+    CompressionEngine *engine_;
+    QString            method_;
+    QByteArray         outgoing_, incoming_;
+    int                errorCode_;
+    qint64             linkSpeed_;
+    qint64             sampleBytes_, sampleNsecs_;
 };
 
 #endif // COMPRESSIONHANDLER_H
@@ -28,12 +28,15 @@
   greatly simplify this class.  - Sep 3rd, 2003.
 */
 
+#include "bosh.h"
 #include "bsocket.h"
 #include "httpconnect.h"
 #include "httppoll.h"
+#include "netnames.h"
 #include "socks.h"
 #include "xmpp.h"
 
+#include <QElapsedTimer>
 #include <QList>
 #include <QNetworkProxy>
 #include <QPointer>
@@ -41,6 +44,8 @@
 #include <QUrl>
 #include <qca.h>
 
+#include <algorithm>
+
 // #define XMPP_DEBUG
 #ifdef XMPP_DEBUG
 #define XDEBUG (qDebug() << this << "#" << __FUNCTION__ << ":")
@@ -54,6 +59,32 @@ static const char *XMPP_CLIENT_SRV       = "xmpp-client";
 static const char *XMPP_CLIENT_TLS_SRV   = "xmpps-client";
 static const char *XMPP_CLIENT_TRANSPORT = "tcp";
 
+// bounds for how long the cached addresses of a connect path are used (secs)
+static const int PATH_MIN_TTL     = 30;
+static const int PATH_DEFAULT_TTL = 300;
+static const int PATH_MAX_TTL     = 86400;
+
+// a spare tunnel closed sooner than this isn't replaced until the next connect (msecs)
+static const int SPARE_MIN_LIFE = 60000;
+
+//----------------------------------------------------------------------------
+// ConnectPathCache
+//----------------------------------------------------------------------------
+ConnectPathCache::~ConnectPathCache() { }
+
+bool ConnectPathCache::lookup(const QString &domain, Path &path) const
+{
+    auto it = paths.constFind(domain);
+    if (it == paths.constEnd())
+        return false;
+    path = *it;
+    return true;
+}
+
+void ConnectPathCache::store(const QString &domain, const Path &path) { paths.insert(domain, path); }
+
+void ConnectPathCache::remove(const QString &domain) { paths.remove(domain); }
+
 //----------------------------------------------------------------------------
 // Connector
 //----------------------------------------------------------------------------
@@ -131,6 +162,12 @@ void AdvancedConnector::Proxy::setSocks(const QString &host, quint16 port)
     v_port = port;
 }
 
+void AdvancedConnector::Proxy::setBosh(const QUrl &url)
+{
+    t     = Bosh;
+    v_url = url;
+}
+
 void AdvancedConnector::Proxy::setUserPass(const QString &user, const QString &pass)
 {
     v_user = user;
@@ -167,6 +204,22 @@ public:
     QString host;          //!< Host we currently try to connect to, set from connectToServer()
     int     port;          //!< Port we currently try to connect to, set from connectToServer() and bs_error()
     int     errorCode = 0; //!< Current error, if any
+
+    QNetworkAccessManager *nam       = nullptr; //!< for BOSH requests, not owned
+    ConnectPathCache      *pathCache = nullptr; //!< where to remember the working endpoint, not owned
+    QString                domain;              //!< server as passed to connectToServer(), ACE encoded
+    bool                   fromCache = false;   //!< current attempt goes to the cached endpoint
+    ConnectPathCache::Path cachedPath;          //!< the endpoint of that attempt
+
+    bool          keepSpare = false;   //!< see setKeepSpareTunnel()
+    HttpConnect  *spare     = nullptr; //!< idle tunnel for the next connect
+    QString       spareKey;            //!< proxy and server of the spare
+    QElapsedTimer spareAge;            //!< since the spare was started
+
+    QString tunnelKey() const
+    {
+        return proxy.host() + ':' + QString::number(proxy.port()) + '/' + host + ':' + QString::number(port);
+    }
 };
 
 AdvancedConnector::AdvancedConnector(QObject *parent) : Connector(parent), d(new Private)
@@ -175,7 +228,11 @@ AdvancedConnector::AdvancedConnector(QObject *parent) : Connector(parent), d(new
     d->errorCode = 0;
 }
 
-AdvancedConnector::~AdvancedConnector() { cleanup(); }
+AdvancedConnector::~AdvancedConnector()
+{
+    cleanup();
+    dropSpare();
+}
 
 void AdvancedConnector::cleanup()
 {
@@ -235,6 +292,78 @@ void AdvancedConnector::setOptTlsSrv(bool value)
     d->opt_srvtls = value;
 }
 
+void AdvancedConnector::setConnectPathCache(ConnectPathCache *cache) { d->pathCache = cache; }
+
+void AdvancedConnector::setKeepSpareTunnel(bool enabled)
+{
+    d->keepSpare = enabled;
+    if (!enabled)
+        dropSpare();
+}
+
+void AdvancedConnector::makeSpare()
+{
+    if (!d->keepSpare || d->spare || d->proxy.type() != Proxy::HttpConnect)
+        return;
+
+    auto s      = new HttpConnect;
+    d->spare    = s;
+    d->spareKey = d->tunnelKey();
+    d->spareAge.start();
+    auto gone = [this, s]() {
+        if (d->spare != s)
+            return;
+        bool lasted = d->spareAge.hasExpired(SPARE_MIN_LIFE);
+        dropSpare();
+        // the server or the proxy doesn't keep idle tunnels for long. no point in a new one each time
+        if (lasted && d->mode == Connected)
+            makeSpare();
+    };
+    connect(s, &HttpConnect::error, this, gone);
+    connect(s, &HttpConnect::connectionClosed, this, gone);
+    if (!d->proxy.user().isEmpty())
+        s->setAuth(d->proxy.user(), d->proxy.pass());
+    s->connectToHost(d->proxy.host(), d->proxy.port(), d->host, d->port);
+}
+
+bool AdvancedConnector::takeSpare()
+{
+    if (!d->spare)
+        return false;
+    if (d->spareKey != d->tunnelKey()) {
+        dropSpare();
+        return false;
+    }
+
+    auto s   = d->spare;
+    d->spare = nullptr;
+    s->disconnect(this);
+    d->bs = s;
+    connect(s, SIGNAL(connected()), SLOT(bs_connected()));
+    connect(s, SIGNAL(error(int)), SLOT(bs_error(int)));
+    if (!s->isOpen())
+        return true; // still on its way
+
+    // connected already. like the others, it's told from the event loop
+    QPointer<ByteStream> bs(s);
+    QTimer::singleShot(0, this, [this, bs]() {
+        if (bs && d->bs == bs && d->mode == Connecting)
+            bs_connected();
+    });
+    return true;
+}
+
+void AdvancedConnector::dropSpare()
+{
+    if (!d->spare)
+        return;
+    d->spare->disconnect(this);
+    d->spare->deleteLater();
+    d->spare = nullptr;
+}
+
+void AdvancedConnector::setNetworkAccessManager(QNetworkAccessManager *nam) { d->nam = nam; }
+
 void AdvancedConnector::connectToServer(const QString &server)
 {
 #ifdef XMPP_DEBUG
@@ -255,7 +384,8 @@ void AdvancedConnector::connectToServer(const QString &server)
         /* server contains invalid characters for DNS name, but maybe valid characters for connecting, like "::1" */
         d->host = server;
     }
-    d->port = XMPP_DEFAULT_PORT;
+    d->domain = d->host;
+    d->port   = XMPP_DEFAULT_PORT;
 
     if (d->proxy.type() == Proxy::HttpPoll) {
         HttpPoll *s = new HttpPoll;
@@ -274,17 +404,32 @@ void AdvancedConnector::connectToServer(const QString &server)
             s->connectToUrl(d->proxy.url());
         else
             s->connectToHost(d->proxy.host(), d->proxy.port(), d->proxy.url());
-    } else if (d->proxy.type() == Proxy::HttpConnect) {
-        HttpConnect *s = new HttpConnect;
-        d->bs          = s;
+    } else if (d->proxy.type() == Proxy::Bosh) {
+        BoshStream *s = new BoshStream;
+        d->bs         = s;
 
         connect(s, SIGNAL(connected()), SLOT(bs_connected()));
         connect(s, SIGNAL(error(int)), SLOT(bs_error(int)));
 
+        if (d->nam)
+            s->setNetworkAccessManager(d->nam);
+        QString route;
+        if (!d->opt_host.isEmpty())
+            route = QString("xmpp:%1:%2").arg(d->opt_host).arg(d->opt_port);
+        s->connectToUrl(d->proxy.url(), d->host, route);
+    } else if (d->proxy.type() == Proxy::HttpConnect) {
         if (!d->opt_host.isEmpty()) {
             d->host = d->opt_host;
             d->port = d->opt_port;
         }
+        if (takeSpare())
+            return;
+
+        HttpConnect *s = new HttpConnect;
+        d->bs          = s;
+
+        connect(s, SIGNAL(connected()), SLOT(bs_connected()));
+        connect(s, SIGNAL(error(int)), SLOT(bs_error(int)));
 
         if (!d->proxy.user().isEmpty())
             s->setAuth(d->proxy.user(), d->proxy.pass());
@@ -307,36 +452,119 @@ void AdvancedConnector::connectToServer(const QString &server)
 
         s->connectToHost(d->proxy.host(), d->proxy.port(), d->host, d->port);
     } else {
-        BSocket *s = new BSocket;
-        d->bs      = s;
+        connectDirect(true);
+    }
+}
+
+void AdvancedConnector::connectDirect(bool useCache)
+{
+    BSocket *s = new BSocket;
+    d->bs      = s;
+    s->setProfile(BSocket::Interactive);
+    s->setFastOpen(true);
 #ifdef XMPP_DEBUG
-        XDEBUG << "Adding socket:" << s;
+    XDEBUG << "Adding socket:" << s;
 #endif
 
-        connect(s, &BSocket::connected, this, [this, s]() {
-            if (!useSSL()) {
-                setUseSSL(s->service() == QLatin1String(XMPP_CLIENT_TLS_SRV));
-            }
-            bs_connected();
-        });
-        connect(s, SIGNAL(error(int)), SLOT(bs_error(int)));
-
-        if (!d->opt_host.isEmpty()) { /* if custom host:port */
-            d->host = d->opt_host;
-            d->port = d->opt_port;
-            s->connectToHost(d->host, quint16(d->port));
-            return;
+    connect(s, &BSocket::connected, this, [this, s]() {
+        if (!useSSL()) {
+            setUseSSL(d->fromCache ? d->cachedPath.directTLS : s->service() == QLatin1String(XMPP_CLIENT_TLS_SRV));
         }
+        bs_connected();
+    });
+    connect(s, SIGNAL(error(int)), SLOT(bs_error(int)));
+
+    d->fromCache = false;
+    if (!d->opt_host.isEmpty()) { /* if custom host:port */
+        d->host = d->opt_host;
+        d->port = d->opt_port;
+        s->connectToHost(d->host, quint16(d->port));
+        return;
+    }
 
-        QStringList services;
-        if (!d->opt_directtls && d->opt_srvtls) {
-            services << XMPP_CLIENT_TLS_SRV;
-        }
-        services << XMPP_CLIENT_SRV;
-        if (d->opt_directtls) {
-            d->port = XMPP_LEGACY_PORT;
-        }
-        s->connectToHost(services, XMPP_CLIENT_TRANSPORT, d->host, quint16(d->port));
+    // try where we got through last time first. bs_error() falls back to the lookups below if it's gone
+    d->fromCache = useCache && d->pathCache && d->pathCache->lookup(d->domain, d->cachedPath)
+        && d->cachedPath.isValid()
+        && (d->cachedPath.directTLS ? d->opt_directtls || d->opt_srvtls : !d->opt_directtls);
+    if (d->fromCache) {
+#ifdef XMPP_DEBUG
+        XDEBUG << "cached path:" << d->cachedPath.host << d->cachedPath.port;
+#endif
+        d->port = d->cachedPath.port;
+        if (d->cachedPath.hasAddresses())
+            s->connectToHost(d->cachedPath.addresses.first(), d->cachedPath.port);
+        else
+            s->connectToHost(d->cachedPath.host, d->cachedPath.port);
+        return;
+    }
+
+    QStringList services;
+    if (!d->opt_directtls && d->opt_srvtls) {
+        services << XMPP_CLIENT_TLS_SRV;
+    }
+    services << XMPP_CLIENT_SRV;
+    if (d->opt_directtls) {
+        d->port = XMPP_LEGACY_PORT;
+    }
+    s->connectToHost(services, XMPP_CLIENT_TRANSPORT, d->domain, quint16(d->port));
+}
+
+void AdvancedConnector::storePath()
+{
+    auto bs = qobject_cast<BSocket *>(d->bs);
+    if (!bs || !d->pathCache || !d->opt_host.isEmpty())
+        return;
+
+    ConnectPathCache::Path path;
+    if (!d->pathCache->lookup(d->domain, path) || path.host != d->host) {
+        path         = ConnectPathCache::Path();
+        path.host    = d->host;
+        path.expires = QDateTime::currentDateTimeUtc().addSecs(PATH_DEFAULT_TTL);
+    }
+    path.port      = peerPort();
+    path.directTLS = useSSL();
+    // the working address goes first
+    path.addresses.removeAll(peerAddress());
+    path.addresses.prepend(peerAddress());
+    d->pathCache->store(d->domain, path);
+
+    if (QHostAddress(path.host).isNull())
+        refreshPathAddresses(d->domain, path);
+}
+
+void AdvancedConnector::refreshPathAddresses(const QString &domain, const ConnectPathCache::Path &path)
+{
+    for (auto type : { NameRecord::A, NameRecord::Aaaa }) {
+        auto dns = new NameResolver(this);
+        connect(dns, &NameResolver::resultsReady, this,
+                [this, dns, domain, type, host = path.host](const QList<XMPP::NameRecord> &records) {
+                    dns->deleteLater();
+                    ConnectPathCache::Path p;
+                    if (!d->pathCache || !d->pathCache->lookup(domain, p) || p.host != host)
+                        return;
+
+                    auto                protocol = type == NameRecord::A ? QAbstractSocket::IPv4Protocol
+                                                                         : QAbstractSocket::IPv6Protocol;
+                    int                 ttl      = PATH_MAX_TTL;
+                    QList<QHostAddress> fresh;
+                    for (const auto &r : records) {
+                        fresh += r.address();
+                        ttl = qMin(ttl, r.ttl());
+                    }
+                    p.addresses.erase(std::remove_if(p.addresses.begin(), p.addresses.end(),
+                                                     [&](const QHostAddress &a) {
+                                                         return a.protocol() == protocol && !fresh.contains(a);
+                                                     }),
+                                      p.addresses.end());
+                    for (const auto &a : std::as_const(fresh)) {
+                        if (!p.addresses.contains(a))
+                            p.addresses += a;
+                    }
+                    p.expires = QDateTime::currentDateTimeUtc().addSecs(qMax(ttl, PATH_MIN_TTL));
+                    d->pathCache->store(domain, p);
+                });
+        connect(dns, &NameResolver::error, dns, &QObject::deleteLater);
+        dns->start(path.host.toLatin1(), type);
     }
 }
 
@@ -371,16 +599,21 @@ void AdvancedConnector::bs_connected()
         setPeerAddress(h, p);
     }
 
-    // We won't use ssl with HttpPoll since it has own tls handler enabled for https.
+    // We won't use ssl with HttpPoll and BOSH since they have own tls handlers enabled for https.
     // The only variant for ssl is legacy port in probing or forced mde.
-    if (d->proxy.type() != Proxy::HttpPoll && (d->opt_directtls || peerPort() == XMPP_LEGACY_PORT)) {
+    if (d->proxy.type() != Proxy::HttpPoll && d->proxy.type() != Proxy::Bosh
+        && (d->opt_directtls || peerPort() == XMPP_LEGACY_PORT)) {
         setUseSSL(true);
     }
 
     if (auto bs = qobject_cast<BSocket *>(d->bs); bs && !bs->host().isEmpty()) {
         d->host = bs->host();
+    } else if (d->fromCache) {
+        d->host = d->cachedPath.host;
     }
     d->mode = Connected;
+    storePath();
+    makeSpare();
     emit connected();
 }
 
@@ -396,6 +629,17 @@ void AdvancedConnector::bs_error(int x)
         return;
     }
 
+    if (d->fromCache) {
+        // the remembered endpoint is gone. forget it and do the full lookup
+        d->pathCache->remove(d->domain);
+        d->fromCache = false;
+        d->bs->disconnect(this);
+        d->bs->deleteLater();
+        d->bs = nullptr;
+        connectDirect(false);
+        return;
+    }
+
     bool proxyError = false;
     int  err        = ErrConnectionRefused;
     int  t          = d->proxy.type();
@@ -438,6 +682,20 @@ void AdvancedConnector::bs_error(int x)
             else
                 err = ErrProxyConnect;
         }
+    } else if (t == Proxy::Bosh) {
+        if (x == BoshStream::ErrConnectionRefused)
+            err = ErrConnectionRefused;
+        else if (x == BoshStream::ErrHostNotFound)
+            err = ErrHostNotFound;
+        else {
+            proxyError = true;
+            if (x == BoshStream::ErrProxyAuth)
+                err = ErrProxyAuth;
+            else if (x == BoshStream::ErrProxyNeg)
+                err = ErrProxyNeg;
+            else
+                err = ErrProxyConnect;
+        }
     } else if (t == Proxy::Socks) {
         if (x == SocksClient::ErrConnectionRefused)
             err = ErrConnectionRefused;
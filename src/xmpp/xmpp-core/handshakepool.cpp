@@ -0,0 +1,80 @@
+/*
+ * handshakepool.cpp - threads for the handshake crypto of the streams
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "handshakepool.h"
+
+#include <QObject>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+
+namespace XMPP {
+namespace {
+    // made on the thread of the context, so its signal is queued there. the connection goes with the context
+    class HandshakeCourier : public QObject {
+        Q_OBJECT
+    signals:
+        void finished();
+    };
+
+    class HandshakeRunnable : public QRunnable {
+    public:
+        HandshakeRunnable(std::function<void()> &&work, HandshakeCourier *courier) :
+            work(std::move(work)), courier(courier)
+        {
+        }
+
+        void run() override
+        {
+            work();
+            emit courier->finished();
+            courier->deleteLater();
+        }
+
+    private:
+        std::function<void()> work;
+        HandshakeCourier     *courier;
+    };
+
+    // a pool of our own, the handshakes must not wait for whatever else uses the global one
+    class HandshakeThreads : public QThreadPool {
+    public:
+        HandshakeThreads() { setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2)); }
+    };
+
+    QThreadPool *handshakeThreads()
+    {
+        static HandshakeThreads pool;
+        return &pool;
+    }
+} // namespace
+
+void HandshakePool::setMaxThreads(int count) { handshakeThreads()->setMaxThreadCount(qMax(1, count)); }
+
+int HandshakePool::maxThreads() { return handshakeThreads()->maxThreadCount(); }
+
+void HandshakePool::run(QObject *context, std::function<void()> &&work, std::function<void()> &&done)
+{
+    auto courier = new HandshakeCourier;
+    QObject::connect(courier, &HandshakeCourier::finished, context, std::move(done), Qt::QueuedConnection);
+    handshakeThreads()->start(new HandshakeRunnable(std::move(work), courier));
+}
+} // namespace XMPP
+
+#include "handshakepool.moc"
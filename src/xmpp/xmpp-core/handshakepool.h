@@ -0,0 +1,43 @@
+/*
+ * handshakepool.h - threads for the handshake crypto of the streams
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_HANDSHAKEPOOL_H
+#define XMPP_HANDSHAKEPOOL_H
+
+#include <functional>
+
+class QObject;
+
+namespace XMPP {
+// The threads the expensive part of a login runs on: the key exchange of OpenSslTLSHandler and the key
+// derivation of SCRAM. When hundreds of streams of the process reconnect at once they take turns on a few
+// threads, and the thread of the streams which are connected already stays free for their traffic.
+class HandshakePool {
+public:
+    // how many handshakes compute at the same time, the others queue up. half the cores by default
+    static void setMaxThreads(int count);
+    static int  maxThreads();
+
+    // work on a thread of the pool, then done on the thread of context. done is dropped if context is
+    //   deleted before
+    static void run(QObject *context, std::function<void()> &&work, std::function<void()> &&done);
+};
+} // namespace XMPP
+
+#endif // XMPP_HANDSHAKEPOOL_H
@@ -19,10 +19,145 @@
 
 #include "parser.h"
 
+#include <QElapsedTimer>
+#include <QHash>
+
 #include <queue>
+#include <utility>
 
 namespace XMPP {
 
+//----------------------------------------------------------------------------
+// CompactElement
+//----------------------------------------------------------------------------
+void CompactElement::clear()
+{
+    arena_.clear();
+    nodes_.clear();
+    attrs_.clear();
+    current_ = -1;
+}
+
+qint64 CompactElement::memoryUsage() const
+{
+    return qint64(arena_.capacity()) * qint64(sizeof(QChar)) + qint64(nodes_.capacity() * sizeof(Node))
+        + qint64(attrs_.capacity() * sizeof(Attribute));
+}
+
+QStringView CompactElement::namespaceURI() const { return isNull() ? QStringView() : view(nodes_.front().ns); }
+
+QStringView CompactElement::localName() const { return isNull() ? QStringView() : view(nodes_.front().name); }
+
+QStringView CompactElement::attribute(QStringView name) const
+{
+    if (isNull())
+        return {};
+    auto const &root = nodes_.front();
+    for (int i = root.attrBegin; i < root.attrEnd; ++i) {
+        if (view(attrs_[i].name) == name && attrs_[i].ns.length == 0)
+            return view(attrs_[i].value);
+    }
+    return {};
+}
+
+CompactElement::StrRef CompactElement::store(QStringView s)
+{
+    StrRef r;
+    r.offset = int(arena_.size());
+    r.length = int(s.size());
+    arena_.append(s.data(), int(s.size()));
+    return r;
+}
+
+void CompactElement::startElement(QStringView ns, QStringView name, const QXmlStreamAttributes &attrs)
+{
+    if (nodes_.empty())
+        arena_.reserve(1024);
+
+    Node n;
+    n.type   = Node::Element;
+    n.parent = current_;
+    // children almost always inherit namespace of the parent. don't copy it again
+    if (current_ != -1 && view(nodes_[current_].ns) == ns)
+        n.ns = nodes_[current_].ns;
+    else
+        n.ns = store(ns);
+    n.name      = store(name);
+    n.attrBegin = int(attrs_.size());
+    for (auto const &a : attrs) {
+        Attribute ca;
+        ca.ns     = store(a.namespaceUri());
+        ca.prefix = store(a.prefix());
+        ca.name   = store(a.name());
+        ca.value  = store(a.value());
+        attrs_.push_back(ca);
+    }
+    n.attrEnd = int(attrs_.size());
+    current_  = int(nodes_.size());
+    nodes_.push_back(n);
+}
+
+void CompactElement::endElement()
+{
+    Q_ASSERT(current_ != -1);
+    current_ = nodes_[current_].parent;
+}
+
+void CompactElement::appendText(QStringView text)
+{
+    Q_ASSERT(current_ != -1);
+    auto &last = nodes_.back();
+    if (last.type == Node::Text && last.parent == current_
+        && last.name.offset + last.name.length == int(arena_.size())) {
+        // QXmlStreamReader may split text into a few chunks. merge them back
+        arena_.append(text.data(), int(text.size()));
+        last.name.length += int(text.size());
+        return;
+    }
+    Node n;
+    n.type   = Node::Text;
+    n.parent = current_;
+    n.name   = store(text);
+    nodes_.push_back(n);
+}
+
+QDomElement CompactElement::toDomElement(QDomDocument &doc) const
+{
+    if (isNull())
+        return QDomElement();
+
+    std::vector<QDomElement> elements(nodes_.size());
+    for (std::size_t i = 0; i < nodes_.size(); ++i) {
+        auto const &n = nodes_[i];
+        if (n.type == Node::Text) {
+            elements[n.parent].appendChild(doc.createTextNode(view(n.name).toString()));
+            continue;
+        }
+
+        QString     ns = view(n.ns).toString();
+        QDomElement el = ns.isEmpty() ? doc.createElement(view(n.name).toString())
+                                      : doc.createElementNS(ns, view(n.name).toString());
+        for (int ai = n.attrBegin; ai < n.attrEnd; ++ai) {
+            auto const &a = attrs_[ai];
+            QDomAttr    da;
+            if (a.ns.length == 0)
+                da = doc.createAttribute(view(a.name).toString());
+            else
+                da = doc.createAttributeNS(view(a.ns).toString(), view(a.name).toString());
+            da.setPrefix(view(a.prefix).toString());
+            da.setValue(view(a.value).toString());
+            if (a.ns.length == 0)
+                el.setAttributeNode(da);
+            else
+                el.setAttributeNodeNS(da);
+        }
+        if (n.parent != -1)
+            elements[n.parent].appendChild(el);
+        elements[i] = el;
+    }
+    return elements.front();
+}
+
 //----------------------------------------------------------------------------
 // Event
 //----------------------------------------------------------------------------
@@ -32,6 +167,8 @@ public:
     QString              ns, ln, qn;
     QXmlStreamAttributes a;
     QDomElement          e;
+    CompactElement       ce;
+    QDomDocument         ceDoc; // where to materialize the compact element
     QString              str;
 
     QXmlStreamNamespaceDeclarations nsPrefixes;
@@ -107,9 +244,23 @@ QString Parser::Event::actualString() const
 QDomElement Parser::Event::element() const
 {
     Q_ASSERT(d != nullptr);
+    if (d->e.isNull() && !d->ce.isNull())
+        d->e = d->ce.toDomElement(d->ceDoc);
     return d->e;
 }
 
+bool Parser::Event::isCompact() const
+{
+    Q_ASSERT(d != nullptr);
+    return !d->ce.isNull();
+}
+
+const CompactElement &Parser::Event::compactElement() const
+{
+    Q_ASSERT(d != nullptr);
+    return d->ce;
+}
+
 void Parser::Event::setDocumentOpen(const QString &namespaceURI, const QString &localName, const QString &qName,
                                     const QXmlStreamAttributes &atts, const QXmlStreamNamespaceDeclarations &nsPrefixes)
 {
@@ -138,6 +289,14 @@ void Parser::Event::setElement(const QDomElement &elem)
     d->e    = elem;
 }
 
+void Parser::Event::setCompactElement(CompactElement &&elem, const QDomDocument &doc)
+{
+    ensureD();
+    d->type  = Element;
+    d->ce    = std::move(elem);
+    d->ceDoc = doc;
+}
+
 void Parser::Event::setError()
 {
     ensureD();
@@ -164,9 +323,110 @@ public:
     int                   completeOffset = 0;
     bool                  streamOpened   = false;
     bool                  readerStarted  = false;
+    bool                  compact        = false;
+    CompactElement        compactElement;
     std::queue<Event>     events;
     QString               streamQName;
 
+    Limits        limits;
+    Violation     violation   = NoViolation;
+    qint64        stanzaStart = 0; // reader's offset when the stanza began
+    int           depth       = 0;
+    int           rateCount   = 0; // stanzas since rateTimer was started
+    QElapsedTimer rateTimer;
+
+    // the element a sink takes the text of. see ContentSink
+    QHash<QPair<QString, QString>, ContentSink *> sinks;
+    ContentSink                                  *sink      = nullptr;
+    int                                           sinkDepth = 0;     // children of its element, ignored
+    bool                                          sinkOk    = true;  // no bad base64 so far
+    QByteArray                                    sinkCarry;         // less than a base64 quad
+
+    ~Private() { endSink(false); }
+
+    void endSink(bool ok)
+    {
+        if (!sink)
+            return;
+        auto s = std::exchange(sink, nullptr);
+        if (ok && sinkOk && !sinkCarry.isEmpty())
+            decode(s, true);
+        sinkCarry.clear();
+        s->end(ok && sinkOk);
+    }
+
+    // whole quads only unless it's the end, the rest waits for the next text
+    void decode(ContentSink *s, bool last)
+    {
+        int n = last ? int(sinkCarry.size()) : int(sinkCarry.size()) & ~3;
+        if (!n)
+            return;
+        auto r = QByteArray::fromBase64Encoding(sinkCarry.left(n), QByteArray::AbortOnBase64DecodingErrors);
+        sinkCarry.remove(0, n);
+        if (!r) {
+            sinkOk = false;
+            return;
+        }
+        if (!r.decoded.isEmpty())
+            s->data(r.decoded);
+    }
+
+    void sinkText(QStringView text)
+    {
+        if (!sinkOk || sinkDepth)
+            return;
+        for (QChar c : text) {
+            if (c.unicode() > 0x7f) {
+                sinkOk = false;
+                return;
+            }
+            if (!c.isSpace())
+                sinkCarry += char(c.unicode());
+        }
+        // a block of quads at a time, not a call per chunk of the reader
+        if (sinkCarry.size() >= 4096)
+            decode(sink, false);
+    }
+
+    // what is held for the peer is freed at once, it isn't wanted anyway
+    void fail(Violation v)
+    {
+        endSink(false);
+        violation = v;
+        in.clear();
+        completeTag = nullptr;
+        reader.clear();
+        compactElement.clear();
+        curElement = QDomElement();
+        element    = QDomElement();
+        Event e;
+        e.setError();
+        events.push(e);
+    }
+
+    bool withinSize() const
+    {
+        if (!limits.stanzaSize)
+            return true;
+        qint64 size = insideStanza() ? reader.characterOffset() - stanzaStart : 0;
+        for (auto const &a : in)
+            size += a.size();
+        return size <= limits.stanzaSize;
+    }
+
+    bool withinRate()
+    {
+        if (!limits.stanzasPerSecond)
+            return true;
+        if (!rateTimer.isValid() || rateTimer.elapsed() >= 1000) {
+            rateTimer.start();
+            rateCount = 0;
+        }
+        return ++rateCount <= limits.stanzasPerSecond;
+    }
+
+    inline bool insideStanza() const { return compact ? !compactElement.isNull() : !curElement.isNull(); }
+
     void pushDataToReader()
     {
         if (completeTag) {
@@ -194,9 +454,39 @@ public:
 
     void handleStartElement()
     {
+        if (limits.attributes && reader.attributes().size() > limits.attributes) {
+            fail(AttributesExceeded);
+            return;
+        }
+        if (streamOpened) {
+            if (!insideStanza()) {
+                stanzaStart = reader.characterOffset();
+                depth       = 0;
+            }
+            if (limits.depth && ++depth > limits.depth) {
+                fail(DepthExceeded);
+                return;
+            }
+        }
+
         auto    ns   = reader.namespaceUri().toString();
         QString name = reader.name().toString();
-        if (streamOpened) {
+        if (streamOpened && compact) {
+            if (sink) {
+                ++sinkDepth;
+                compactElement.startElement(ns, name, reader.attributes());
+                return;
+            }
+            compactElement.startElement(ns, name, reader.attributes());
+            if (!sinks.isEmpty() && compactElement.nodes().size() > 1) {
+                ContentSink *s = sinks.value({ ns, name });
+                if (s && s->begin(compactElement, reader.attributes())) {
+                    sink      = s;
+                    sinkDepth = 0;
+                    sinkOk    = true;
+                }
+            }
+        } else if (streamOpened) {
             QDomElement newEl;
             if (ns.isEmpty())
                 newEl = doc.createElement(name);
@@ -234,12 +524,31 @@ public:
 
     void handleEndElement()
     {
-        if (curElement.isNull() && reader.qualifiedName() == streamQName) {
+        if (!insideStanza() && reader.qualifiedName() == streamQName) {
             Event e;
             e.setDocumentClose(reader.namespaceUri().toString(), reader.name().toString(), streamQName);
             events.push(e);
             return;
         }
+        --depth;
+        if (compact) {
+            Q_ASSERT_X(!compactElement.isNull(), "xml parser",
+                       "XML reader hasn't reported error for invalid element close");
+            if (sink && !sinkDepth--)
+                endSink(true);
+            compactElement.endElement();
+            if (compactElement.isComplete()) {
+                if (!withinRate()) {
+                    fail(StanzaRateExceeded);
+                    return;
+                }
+                Event e;
+                e.setCompactElement(std::move(compactElement), doc);
+                events.push(e);
+                compactElement.clear();
+            }
+            return;
+        }
         Q_ASSERT_X(!curElement.isNull(), "xml parser", "XML reader hasn't reported error for invalid element close");
         Q_ASSERT_X(
             curElement.namespaceURI() == reader.namespaceUri() && curElement.tagName() == reader.name(), "xml parser",
@@ -265,6 +574,10 @@ public:
         }
 #endif
         if (curElement.parentNode().isNull()) {
+            if (!withinRate()) {
+                fail(StanzaRateExceeded);
+                return;
+            }
             Event e;
             e.setElement(curElement);
             events.push(e);
@@ -274,11 +587,19 @@ public:
 
     void handleText()
     {
-        if (curElement.isNull()) {
+        if (!insideStanza()) {
             if (!reader.isWhitespace())
                 qWarning("Text node out of element (ignored): %s", qPrintable(reader.text().toString()));
             return;
         }
+        if (sink) {
+            sinkText(reader.text());
+            return;
+        }
+        if (compact) {
+            compactElement.appendText(reader.text());
+            return;
+        }
         auto node = doc.createTextNode(reader.text().toString());
         curElement.appendChild(node);
     }
@@ -297,6 +618,12 @@ public:
                 Q_ASSERT_X(tt != QXmlStreamReader::EntityReference, "xml parser",
                            qPrintable(QString("unexpected xml entity: %1").arg(reader.text())));
             }
+            if (violation)
+                return;
+            if (!withinSize()) {
+                fail(StanzaSizeExceeded);
+                return;
+            }
             tt = reader.readNext();
         }
         if (tt == QXmlStreamReader::Invalid) {
@@ -312,10 +639,14 @@ public:
     Parser::Event readNext()
     {
         Event e;
-        pushDataToReader();
-        if (!readerStarted)
-            return e;
-        collectEvents();
+        // e.g. a huge text without a single '>', it would wait in the input forever
+        if (!violation && !withinSize())
+            fail(StanzaSizeExceeded);
+        if (!violation) {
+            pushDataToReader();
+            if (readerStarted)
+                collectEvents();
+        }
         if (!events.empty()) {
             e = events.front();
             events.pop();
@@ -328,11 +659,44 @@ Parser::Parser() { reset(); }
 
 Parser::~Parser() { }
 
-void Parser::reset() { d.reset(new Private); }
+void Parser::reset()
+{
+    bool compact = d && d->compact;
+    auto sinks   = d ? d->sinks : decltype(d->sinks)();
+    auto limits  = d ? d->limits : Limits();
+    d.reset(new Private);
+    d->compact = compact;
+    d->sinks   = sinks;
+    d->limits  = limits;
+}
+
+void Parser::setCompactMode(bool enabled) { d->compact = enabled; }
+
+bool Parser::isCompactMode() const { return d->compact; }
+
+void Parser::addContentSink(const QString &ns, const QString &localName, ContentSink *sink)
+{
+    d->sinks.insert({ ns, localName }, sink);
+}
+
+void Parser::removeContentSink(ContentSink *sink)
+{
+    if (d->sink == sink) {
+        // the rest of its text is dropped
+        d->sink = nullptr;
+        d->sinkCarry.clear();
+    }
+    for (auto it = d->sinks.begin(); it != d->sinks.end();)
+        it = it.value() == sink ? d->sinks.erase(it) : std::next(it);
+}
+
+void Parser::setLimits(const Limits &limits) { d->limits = limits; }
+
+Parser::Violation Parser::violation() const { return d->violation; }
 
 void Parser::appendData(const QByteArray &a)
 {
-    if (a.isEmpty())
+    if (a.isEmpty() || d->violation)
         return;
     d->in.push_back(a);
     for (int i = a.size() - 1; i >= 0; --i) {
@@ -357,4 +721,13 @@ QByteArray Parser::unprocessed() const
 
 QStringView Parser::encoding() const { return d->reader.documentEncoding(); }
 
+qint64 Parser::memoryUsage() const
+{
+    // a DOM stanza in the making isn't counted, the streams use the compact mode
+    qint64 bytes = d->compactElement.memoryUsage();
+    for (auto const &a : d->in)
+        bytes += a.capacity();
+    return bytes;
+}
+
 }
@@ -25,9 +25,83 @@
 #include <QXmlStreamAttributes>
 
 #include <memory>
+#include <vector>
 
 namespace XMPP {
 
+/*
+ * Flat representation of a parsed stanza.
+ *
+ * All the strings live in one character arena and the tree is stored as a vector of nodes in document order
+ * where each node refers to its parent by index. So a stanza of any size costs a handful of allocations instead
+ * of one DOM node per element, attribute and text chunk. QDom tree is built only if somebody asks for it.
+ */
+class CompactElement {
+public:
+    struct StrRef {
+        int offset = 0;
+        int length = 0;
+    };
+
+    struct Attribute {
+        StrRef ns, prefix, name, value;
+    };
+
+    struct Node {
+        enum Type : quint8 { Element, Text };
+        Type   type;
+        int    parent;            // index of parent element or -1 for the root
+        StrRef ns, name;          // for Text nodes name keeps the text itself
+        int    attrBegin = 0;     // range in the attributes vector
+        int    attrEnd   = 0;
+    };
+
+    inline bool isNull() const { return nodes_.empty(); }
+    inline bool isComplete() const { return !nodes_.empty() && current_ == -1; }
+    void        clear();
+    qint64      memoryUsage() const; // approximate heap bytes
+
+    // root element info
+    QStringView namespaceURI() const;
+    QStringView localName() const;
+    QStringView attribute(QStringView name) const;
+
+    inline const std::vector<Node>      &nodes() const { return nodes_; }
+    inline const std::vector<Attribute> &attributes() const { return attrs_; }
+    inline QStringView view(const StrRef &r) const { return QStringView(arena_).mid(r.offset, r.length); }
+
+    QDomElement toDomElement(QDomDocument &doc) const;
+
+    // building
+    void startElement(QStringView ns, QStringView name, const QXmlStreamAttributes &attrs);
+    void endElement();
+    void appendText(QStringView text);
+
+private:
+    StrRef store(QStringView s);
+
+    QString                arena_;
+    std::vector<Node>      nodes_;
+    std::vector<Attribute> attrs_;
+    int                    current_ = -1;
+};
+
+/*
+ * Takes the base64 text of an element inside a stanza while it's parsed, decoded piece by piece as the data comes
+ * in, instead of the text being kept in the stanza. The element stays in the stanza, empty. Only in compact mode.
+ * See Parser::addContentSink()
+ */
+class ContentSink {
+public:
+    virtual ~ContentSink() = default;
+
+    // the element starts, it's the last node of stanza. false leaves its text in the stanza as usual
+    virtual bool begin(const CompactElement &stanza, const QXmlStreamAttributes &attrs) = 0;
+    virtual void data(const QByteArray &decoded)                                        = 0;
+    // the element is closed. ok is false for bad base64, or when the parser is reset inside the element
+    virtual void end(bool ok) = 0;
+};
+
 class Parser {
 public:
     struct NSPrefix {
@@ -35,6 +109,15 @@ public:
         QString value;
     };
 
+    // what the peer may send before the parser gives up. 0 is no limit
+    struct Limits {
+        qint64 stanzaSize       = 0; // characters of the stanza being parsed, with the input not parsed yet
+        int    depth            = 0; // nested elements of a stanza, the stanza itself is 1
+        int    attributes       = 0; // of any element
+        int    stanzasPerSecond = 0;
+    };
+    enum Violation { NoViolation, StanzaSizeExceeded, DepthExceeded, AttributesExceeded, StanzaRateExceeded };
+
     class Event {
     public:
         enum Type { DocumentOpen, DocumentClose, Element, Error };
@@ -56,7 +139,9 @@ public:
         QXmlStreamAttributes atts() const;
 
         // for element
-        QDomElement element() const;
+        QDomElement           element() const; // materialized on first call for compact events
+        bool                  isCompact() const;
+        const CompactElement &compactElement() const;
 
         // for any
         QString actualString() const;
@@ -66,6 +151,7 @@ public:
                              const QXmlStreamAttributes &atts, const QXmlStreamNamespaceDeclarations &nsPrefixes);
         void setDocumentClose(const QString &namespaceURI, const QString &localName, const QString &qName);
         void setElement(const QDomElement &elem);
+        void setCompactElement(CompactElement &&elem, const QDomDocument &doc);
         void setError();
         void setActualString(const QString &);
 
@@ -79,10 +165,20 @@ public:
     ~Parser();
 
     void        reset();
+    void        setCompactMode(bool enabled); // emit CompactElement instead of building QDom tree
+    bool        isCompactMode() const;
+    // not owned. for the elements ns:localName at any depth of a stanza. the sinks stay over reset()
+    void        addContentSink(const QString &ns, const QString &localName, ContentSink *sink);
+    void        removeContentSink(ContentSink *sink);
+    // stays over reset(). a violation frees what is parsed and buffered, the next event is an error and the data
+    // is ignored after that, until reset()
+    void        setLimits(const Limits &limits);
+    Violation   violation() const;
     void        appendData(const QByteArray &a);
     Event       readNext();
     QByteArray  unprocessed() const;
     QStringView encoding() const;
+    qint64      memoryUsage() const; // approximate, the input not parsed yet and the stanza being built
 
 private:
     class Private;
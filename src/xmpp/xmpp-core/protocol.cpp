@@ -23,6 +23,8 @@
 
 #include "protocol.h"
 
+#include "compressionhandler.h"
+
 #ifdef XMPP_TEST
 #include "td.h"
 #endif
@@ -68,6 +70,26 @@ static QDomElement firstChildElement(const QDomElement &e)
     return QDomElement();
 }
 
+// fastHmac
+//
+// The QCA name of the HMAC behind an XEP-0484 mechanism, empty if it can't be done here. There is no
+// channel binding data at this level, so only the -NONE variants are
+static QString fastHmac(const QString &mech)
+{
+    QString hmac;
+    if (mech == QLatin1String("HT-SHA-256-NONE"))
+        hmac = QStringLiteral("hmac(sha256)");
+    else if (mech == QLatin1String("HT-SHA-512-NONE"))
+        hmac = QStringLiteral("hmac(sha512)");
+    return !hmac.isEmpty() && QCA::isSupported(hmac.toLatin1().constData()) ? hmac : QString();
+}
+
+static QByteArray fastHash(const QString &mech, const QString &token, const QByteArray &data)
+{
+    QCA::MessageAuthenticationCode mac(fastHmac(mech), QCA::SymmetricKey(token.toUtf8()));
+    return mac.process(data).toByteArray();
+}
+
 //----------------------------------------------------------------------------
 // Version
 //----------------------------------------------------------------------------
@@ -82,14 +104,18 @@ Version::Version(int maj, int min)
 //----------------------------------------------------------------------------
 StreamFeatures::StreamFeatures()
 {
-    tls_supported      = false;
-    sasl_supported     = false;
-    bind_supported     = false;
-    tls_required       = false;
-    compress_supported = false;
-    sm_supported       = false;
-    session_supported  = false;
-    session_required   = false;
+    tls_supported       = false;
+    sasl_supported      = false;
+    bind_supported      = false;
+    tls_required        = false;
+    compress_supported  = false;
+    sm_supported        = false;
+    session_supported   = false;
+    session_required    = false;
+    rosterver_supported = false;
+    sasl2_supported     = false;
+    bind2_supported     = false;
+    sm_resume_inline    = false;
 }
 
 //----------------------------------------------------------------------------
@@ -180,6 +206,13 @@ void BasicProtocol::sendStanza(const QDomElement &e)
     sendList += i;
 }
 
+void BasicProtocol::sendStanzaData(const QByteArray &data)
+{
+    SendItem i;
+    i.dataToSend = data;
+    sendList += i;
+}
+
 void BasicProtocol::sendDirect(const QString &s)
 {
     SendItem i;
@@ -465,6 +498,19 @@ void BasicProtocol::handleDocOpen(const Parser::Event &pe)
 
 bool BasicProtocol::handleError()
 {
+    switch (parserViolation()) {
+    case Parser::NoViolation:
+        break;
+    case Parser::StanzaSizeExceeded:
+        return errorAndClose(StreamCond::PolicyViolation, QStringLiteral("Stanza is too large"));
+    case Parser::DepthExceeded:
+        return errorAndClose(StreamCond::PolicyViolation, QStringLiteral("Stanza is nested too deeply"));
+    case Parser::AttributesExceeded:
+        return errorAndClose(StreamCond::PolicyViolation, QStringLiteral("Too many attributes"));
+    case Parser::StanzaRateExceeded:
+        return errorAndClose(StreamCond::PolicyViolation, QStringLiteral("Too many stanzas"));
+    }
+
     if (isIncoming())
         return errorAndClose(StreamCond::NotWellFormed);
     else
@@ -528,6 +574,10 @@ bool BasicProtocol::doStep(const QDomElement &e)
                 ++stanzasPending;
                 writeElement(i.stanzaToSend, TypeStanza, true);
                 event = ESend;
+            } else if (!i.dataToSend.isEmpty()) {
+                ++stanzasPending;
+                writeData(i.dataToSend, TypeStanza, true);
+                event = ESend;
             }
             // direct send?
             else if (!i.stringToSend.isEmpty()) {
@@ -593,6 +643,7 @@ void CoreProtocol::init()
     server          = false;
     dialback        = false;
     dialback_verify = false;
+    component       = false;
 
     // settings
     jid_       = Jid();
@@ -604,6 +655,24 @@ void CoreProtocol::init()
     doCompress = true;
     doBinding  = true;
 
+    component_secret = QString();
+
+    doSASL2        = false;
+    doCarbons      = false;
+    requestFast    = false;
+    fastInUse      = false;
+    smInline       = false;
+    carbonsInline  = false;
+    bindTag        = QString();
+    agentId        = QString();
+    agentSoftware  = QString();
+    agentDevice    = QString();
+    fastLoginMech  = QString();
+    fastLoginToken = QString();
+    fastRequested  = QString();
+    fastLoginCount = 0;
+    sasl2Success   = QDomElement();
+
     // input
     user = QString();
     host = QString();
@@ -614,6 +683,12 @@ void CoreProtocol::init()
     tls_started      = false;
     sasl_started     = false;
     compress_started = false;
+    compressMethod   = QString();
+    sasl2            = false;
+    carbonsEnabled   = false;
+    fastMechanism    = QString();
+    fastToken        = QString();
+    fastExpiry       = QDateTime();
 
     sm.reset();
 }
@@ -634,14 +709,32 @@ void CoreProtocol::needTimer(int seconds)
 void CoreProtocol::sendStanza(const QDomElement &e)
 {
     if (sm.isActive()) {
-        int len = sm.addUnacknowledgedStanza(e);
-        if (len > 5 && len % 4 == 0)
-            if (needSMRequest())
-                event = ESend;
+        // serialize once, the same bytes go out now and again on resumption
+        sendStanzaData(serializeElement(e));
+        return;
     }
     BasicProtocol::sendStanza(e);
 }
 
+void CoreProtocol::sendStanzaData(const QByteArray &stanza)
+{
+    if (!sm.isActive()) {
+        BasicProtocol::sendStanzaData(stanza);
+        return;
+    }
+    sm.addUnacknowledgedStanza(stanza);
+    // ask for the ack in the same write as the stanza, rather than in a packet of its own
+    QByteArray data = stanza;
+    if (sm.isAckRequestDue()) {
+        QByteArray r = sm.generateRequest();
+        if (!r.isEmpty()) {
+            data += r;
+            needTimer(sm.timerInterval());
+        }
+    }
+    BasicProtocol::sendStanzaData(data);
+}
+
 void CoreProtocol::startClientOut(const Jid &_jid, bool _oldOnly, bool tlsActive, bool _doAuth, bool _doCompress)
 {
     jid_        = _jid;
@@ -685,6 +778,16 @@ void CoreProtocol::startDialbackVerifyOut(const QString &_to, const QString &_fr
     startConnect();
 }
 
+void CoreProtocol::startComponentOut(const QString &_to, const QString &secret)
+{
+    component        = true;
+    jid_             = _to;
+    to               = _to;
+    component_secret = secret;
+    version          = Version(0, 0); // the component protocol has no version attribute
+    startConnect();
+}
+
 void CoreProtocol::startClientIn(const QString &_id)
 {
     id = _id;
@@ -708,6 +811,34 @@ void CoreProtocol::setAllowPlain(bool b) { allowPlain = b; }
 
 const Jid &CoreProtocol::jid() const { return jid_; }
 
+void CoreProtocol::setAllowSASL2(bool b) { doSASL2 = b; }
+
+void CoreProtocol::setBind2(const QString &tag, bool enableCarbons)
+{
+    bindTag   = tag;
+    doCarbons = enableCarbons;
+}
+
+void CoreProtocol::setUserAgent(const QString &id, const QString &software, const QString &device)
+{
+    agentId       = id;
+    agentSoftware = software;
+    agentDevice   = device;
+}
+
+void CoreProtocol::setFastToken(const QString &mechanism, const QString &token, int count)
+{
+    fastLoginMech  = mechanism;
+    fastLoginToken = token;
+    fastLoginCount = count;
+    fastMechanism  = mechanism;
+    fastToken      = token;
+}
+
+void CoreProtocol::setRequestFastToken(bool b) { requestFast = b; }
+
+QStringList CoreProtocol::offeredSASLMechs() const { return sasl2 ? features.sasl2_mechs : features.sasl_mechs; }
+
 void CoreProtocol::setPassword(const QString &s) { password = s; }
 
 void CoreProtocol::setFrom(const QString &s) { from = s; }
@@ -721,6 +852,8 @@ bool CoreProtocol::loginComplete()
     // deal with stream management
     if (features.sm_supported && sm.state().isEnabled() && !sm.isActive()) {
         if (sm.state().isResumption()) {
+            if (beforeResume)
+                beforeResume();
             QDomElement e = doc.createElementNS(NS_STREAM_MANAGEMENT, "resume");
             e.setAttribute("previd", sm.state().resumption_id);
             e.setAttribute("h", sm.state().received_count);
@@ -739,6 +872,57 @@ bool CoreProtocol::loginComplete()
     return true;
 }
 
+// an <enabled/> of XEP-0198, standalone or inline with Bind2
+void CoreProtocol::startSM(const QDomElement &enabled)
+{
+    QString rs = enabled.attribute("resume");
+    QString id = (rs == "true" || rs == "1") ? enabled.attribute("id") : QString();
+    sm.start(id);
+    if (!id.isEmpty()) {
+#ifdef IRIS_SM_DEBUG
+        qDebug() << "Stream Management: [INF] Resumption Supported";
+#endif
+        QString location = enabled.attribute("location").trimmed();
+        if (!location.isEmpty()) {
+            int         port_off = 0;
+            QStringView sm_host;
+            int         sm_port       = 0;
+            auto        location_view = QStringView { location };
+            if (location.startsWith('[')) { // ipv6
+                port_off = location.indexOf(']');
+                if (port_off != -1) { // looks valid
+                    sm_host = location_view.mid(1, port_off - 1);
+                    if (location.length() > port_off + 2 && location.at(port_off + 1) == ':')
+                        sm_port = location_view.mid(port_off + 2).toUInt();
+                }
+            }
+            if (port_off == 0) {
+                port_off = location.indexOf(':');
+                if (port_off != -1) {
+                    sm_host = location_view.left(port_off);
+                    sm_port = location_view.mid(port_off + 1).toUInt();
+                } else {
+                    sm_host = location_view.mid(0);
+                }
+            }
+            sm.setLocation(sm_host.toString(), sm_port);
+        }
+    } // else resumption is not supported on this server
+    needTimer(SM_TIMER_INTERVAL_SECS);
+}
+
+void CoreProtocol::resumeSM(quint32 h)
+{
+    sm.resume(h);
+    while (true) {
+        QByteArray st = sm.getUnacknowledgedStanza();
+        if (st.isEmpty())
+            break;
+        writeData(st, TypeElement, false);
+    }
+    needTimer(SM_TIMER_INTERVAL_SECS);
+}
+
 int CoreProtocol::getOldErrorCode(const QDomElement &e)
 {
     QDomElement err = e.elementsByTagNameNS(NS_CLIENT, "error").item(0).toElement();
@@ -783,6 +967,7 @@ bool CoreProtocol::stepRequiresElement() const
     case GetRequest:
     case GetSASLResponse:
     case GetSMResponse:
+    case GetHandshake:
         return true;
     }
     return false;
@@ -810,6 +995,8 @@ QString CoreProtocol::defaultNamespace()
 {
     if (server)
         return NS_SERVER;
+    else if (component)
+        return NS_COMPONENT;
     else
         return NS_CLIENT;
 }
@@ -847,7 +1034,7 @@ void CoreProtocol::handleStreamOpen(const Parser::Event &pe)
             return;
         }
     } else {
-        if (!dialback) {
+        if (!dialback && !component) {
             old = version.major < 1 || oldOnly;
         }
     }
@@ -875,6 +1062,8 @@ bool CoreProtocol::doStep2(const QDomElement &e)
 {
     if (dialback)
         return dialbackStep(e);
+    else if (component)
+        return componentStep(e);
     else
         return normalStep(e);
 }
@@ -883,7 +1072,7 @@ bool CoreProtocol::isValidStanza(const QDomElement &e) const
 {
     QString      s    = e.tagName();
     Stanza::Kind kind = Stanza::kind(s);
-    return e.namespaceURI() == (server ? NS_SERVER : NS_CLIENT)
+    return e.namespaceURI() == (server ? NS_SERVER : component ? NS_COMPONENT : NS_CLIENT)
         && (kind == Stanza::Message || kind == Stanza::Presence || kind == Stanza::IQ);
 }
 
@@ -894,7 +1083,7 @@ bool CoreProtocol::streamManagementHandleStanza(const QDomElement &e)
 #ifdef IRIS_SM_DEBUG
         qDebug() << "Stream Management: [<-?] Received request from server";
 #endif
-        sendUrgent(sm.makeResponseStanza(doc));
+        writeData(sm.makeResponse(), TypeElement, false, true);
         event = ESend;
         return true;
     } else if (s == "a") {
@@ -915,10 +1104,10 @@ bool CoreProtocol::streamManagementHandleStanza(const QDomElement &e)
 
 bool CoreProtocol::needSMRequest()
 {
-    QDomElement e = sm.generateRequestStanza(doc);
-    if (!e.isNull()) {
-        send(e);
-        needTimer(SM_TIMER_INTERVAL_SECS);
+    QByteArray r = sm.generateRequest();
+    if (!r.isEmpty()) {
+        writeData(r, TypeElement, false);
+        needTimer(sm.timerInterval());
         return true;
     }
     return false;
@@ -1055,6 +1244,203 @@ bool CoreProtocol::dialbackStep(const QDomElement &e)
     return false;
 }
 
+bool CoreProtocol::componentStep(const QDomElement &e)
+{
+    if (step == Start) {
+        // the stream id is known by now, it's salted into the secret
+        QDomElement h = doc.createElementNS(NS_COMPONENT, "handshake");
+        h.appendChild(doc.createTextNode(
+            QCA::Hash("sha1").hashToString(QByteArray(id.toUtf8() + component_secret.toUtf8()))));
+        send(h);
+        event = ESend;
+        step  = GetHandshake;
+        return true;
+    } else if (step == GetHandshake) {
+        // a wrong secret is answered with a stream error, which doStep() has reported already
+        if (e.namespaceURI() != NS_COMPONENT || e.tagName() != "handshake")
+            return error(ErrProtocol);
+        setReady(true);
+        step  = Done;
+        event = EReady;
+        return true;
+    }
+
+    if (!e.isNull() && isReady() && isValidStanza(e)) {
+        stanzaToRecv = e;
+        event        = EStanzaReady;
+        setIncomingAsExternal();
+        return true;
+    }
+
+    need = NNotify;
+    notify |= NRecv;
+    return false;
+}
+
+QDomElement CoreProtocol::sasl2Authenticate()
+{
+    QDomElement e = doc.createElementNS(NS_SASL2, "authenticate");
+    e.setAttribute("mechanism", sasl_mech);
+    if (!sasl_step.isEmpty()) {
+        QDomElement r = doc.createElementNS(NS_SASL2, "initial-response");
+        r.appendChild(doc.createTextNode(QCA::Base64().arrayToString(sasl_step)));
+        e.appendChild(r);
+    }
+
+    if (!agentId.isEmpty() || !agentSoftware.isEmpty() || !agentDevice.isEmpty()) {
+        QDomElement ua = doc.createElementNS(NS_SASL2, "user-agent");
+        if (!agentId.isEmpty())
+            ua.setAttribute("id", agentId);
+        if (!agentSoftware.isEmpty()) {
+            QDomElement software = doc.createElementNS(NS_SASL2, "software");
+            software.appendChild(doc.createTextNode(agentSoftware));
+            ua.appendChild(software);
+        }
+        if (!agentDevice.isEmpty()) {
+            QDomElement device = doc.createElementNS(NS_SASL2, "device");
+            device.appendChild(doc.createTextNode(agentDevice));
+            ua.appendChild(device);
+        }
+        e.appendChild(ua);
+    }
+
+    if (fastInUse) {
+        QDomElement f = doc.createElementNS(NS_FAST, "fast");
+        f.setAttribute("count", fastLoginCount);
+        e.appendChild(f);
+    }
+    fastRequested = QString();
+    if (requestFast) {
+        for (const QString &mech : std::as_const(features.fast_mechs)) {
+            if (!fastHmac(mech).isEmpty()) {
+                fastRequested = mech;
+                break;
+            }
+        }
+        if (!fastRequested.isEmpty()) {
+            QDomElement r = doc.createElementNS(NS_FAST, "request-token");
+            r.setAttribute("mechanism", fastRequested);
+            e.appendChild(r);
+        }
+    }
+
+    // resuming is instead of binding
+    if (sm.state().isResumption()) {
+        if (beforeResume)
+            beforeResume();
+        QDomElement r = doc.createElementNS(NS_STREAM_MANAGEMENT, "resume");
+        r.setAttribute("previd", sm.state().resumption_id);
+        r.setAttribute("h", sm.state().received_count);
+        e.appendChild(r);
+    } else if (doBinding) {
+        QDomElement b   = doc.createElementNS(NS_BIND2, "bind");
+        QString     tag = bindTag.isEmpty() ? jid_.resource() : bindTag; // the server picks the resource
+        if (!tag.isEmpty()) {
+            QDomElement t = doc.createElementNS(NS_BIND2, "tag");
+            t.appendChild(doc.createTextNode(tag));
+            b.appendChild(t);
+        }
+        smInline = sm.state().isEnabled() && features.bind2_features.contains(NS_STREAM_MANAGEMENT);
+        if (smInline) {
+            QDomElement en = doc.createElementNS(NS_STREAM_MANAGEMENT, "enable");
+            en.setAttribute("resume", "true");
+            b.appendChild(en);
+        }
+        carbonsInline = doCarbons && features.bind2_features.contains(NS_CARBONS);
+        if (carbonsInline)
+            b.appendChild(doc.createElementNS(NS_CARBONS, "enable"));
+        e.appendChild(b);
+    }
+    return e;
+}
+
+bool CoreProtocol::sasl2Failure(const QDomElement &e)
+{
+    if (fastInUse) {
+        // most likely the token has expired. forget it and log in the usual way on the same stream
+        fastInUse      = false;
+        fastLoginToken = QString();
+        fastMechanism  = QString();
+        fastToken      = QString();
+        fastExpiry     = QDateTime();
+        sasl_mech      = QString();
+        sasl_step      = QByteArray();
+        need           = NSASLFirst;
+        step           = GetSASLFirst;
+        return false;
+    }
+
+    QDomElement t = firstChildElement(e);
+    if (t.isNull() || t.namespaceURI() != NS_SASL)
+        errCond = {};
+    else
+        errCond = stringToSASLCond(t.tagName());
+
+    decltype(errLangText) lt;
+    for (QDomElement c = e.firstChildElement("text"); !c.isNull(); c = c.nextSiblingElement("text"))
+        lt.insert(c.attributeNS(NS_XML, "lang", ""), c.text());
+    errLangText = lt;
+    event       = EError;
+    errorCode   = ErrAuth;
+    return true;
+}
+
+bool CoreProtocol::sasl2Complete()
+{
+    QDomElement s = sasl2Success;
+    sasl2Success  = QDomElement();
+
+    QDomElement bound, resumed, resumeFailed;
+    for (QDomElement c = s.firstChildElement(); !c.isNull(); c = c.nextSiblingElement()) {
+        if (c.localName() == QLatin1String("authorization-identifier") && c.namespaceURI() == NS_SASL2) {
+            Jid j(c.text());
+            if (j.isValid())
+                jid_ = j;
+        } else if (c.localName() == QLatin1String("token") && c.namespaceURI() == NS_FAST) {
+            // asked for, or a new one instead of the one used
+            fastMechanism = fastRequested.isEmpty() ? fastLoginMech : fastRequested;
+            fastToken     = c.attribute("token");
+            fastExpiry    = QDateTime::fromString(c.attribute("expiry"), Qt::ISODate);
+        } else if (c.localName() == QLatin1String("bound") && c.namespaceURI() == NS_BIND2) {
+            bound = c;
+        } else if (c.localName() == QLatin1String("resumed") && c.namespaceURI() == NS_STREAM_MANAGEMENT) {
+            resumed = c;
+        } else if (c.localName() == QLatin1String("failed") && c.namespaceURI() == NS_STREAM_MANAGEMENT) {
+            resumeFailed = c;
+        }
+    }
+
+    setReady(true);
+    features.session_required = false; // there is no session to establish after Bind2
+
+    if (!resumed.isNull()) {
+        resumeSM(resumed.attribute("h").toUInt());
+        event = EReady;
+        step  = Done;
+        return true;
+    }
+    if (!resumeFailed.isNull() && sm.state().isResumption()) {
+        sm.state().resumption_id.clear();
+        event = ESMResumeFailed;
+        return true;
+    }
+    if (bound.isNull())
+        return loginComplete();
+
+    carbonsEnabled = carbonsInline;
+    if (smInline) {
+        QDomElement enabled = bound.firstChildElement("enabled");
+        if (!enabled.isNull() && enabled.namespaceURI() == NS_STREAM_MANAGEMENT)
+            startSM(enabled);
+        // else it failed, and asking again would fail the same way
+    } else if (sm.state().isEnabled()) {
+        return loginComplete();
+    }
+    event = EReady;
+    step  = Done;
+    return true;
+}
+
 bool CoreProtocol::normalStep(const QDomElement &e)
 {
     if (step == Start) {
@@ -1089,11 +1475,19 @@ bool CoreProtocol::normalStep(const QDomElement &e)
             return loginComplete();
 
         // Deal with compression
-        if (doCompress && !compress_started && features.compress_supported
-            && features.compression_mechs.contains("zlib")) {
+        if (doCompress && !compress_started && features.compress_supported) {
+            const QStringList methods = CompressionHandler::methods();
+            for (const QString &method : methods) {
+                if (features.compression_mechs.contains(method)) {
+                    compressMethod = method;
+                    break;
+                }
+            }
+        }
+        if (!compressMethod.isEmpty() && !compress_started) {
             QDomElement e = doc.createElementNS(NS_COMPRESS_PROTOCOL, "compress");
             QDomElement m = doc.createElementNS(NS_COMPRESS_PROTOCOL, "method");
-            m.appendChild(doc.createTextNode("zlib"));
+            m.appendChild(doc.createTextNode(compressMethod));
             e.appendChild(m);
             send(e, true);
             event = ESend;
@@ -1103,6 +1497,25 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 
         // deal with SASL?
         if (!sasl_authed) {
+            // SASL2 leaves no way to bind afterwards, nor to resume without it being inline
+            if (doSASL2 && features.sasl2_supported && (features.bind2_supported || !doBinding)
+                && (!sm.state().isResumption() || features.sm_resume_inline)) {
+                sasl2 = true;
+                if (!fastLoginToken.isEmpty() && features.fast_mechs.contains(fastLoginMech)
+                    && !fastHmac(fastLoginMech).isEmpty()) {
+                    fastInUse = true;
+                    sasl_mech = fastLoginMech;
+                    sasl_step = jid_.node().toUtf8();
+                    sasl_step.append('\0');
+                    sasl_step += fastHash(fastLoginMech, fastLoginToken, "Initiator");
+                    step = GetSASLFirst;
+                    return processStep();
+                }
+                need = NSASLFirst;
+                step = GetSASLFirst;
+                return false;
+            }
+
             if (!features.sasl_supported) {
                 // SASL MUST be supported
                 // event = EError;
@@ -1163,6 +1576,13 @@ bool CoreProtocol::normalStep(const QDomElement &e)
             return true;
         }
     } else if (step == GetSASLFirst) {
+        if (sasl2) {
+            send(sasl2Authenticate(), true);
+            event = ESend;
+            step  = GetSASLChallenge;
+            return true;
+        }
+
         QDomElement e = doc.createElementNS(NS_SASL, "auth");
         e.setAttribute("mechanism", sasl_mech);
         if (!sasl_step.isEmpty()) {
@@ -1219,6 +1639,9 @@ bool CoreProtocol::normalStep(const QDomElement &e)
             return true;
         }
     } else if (step == HandleSASLSuccess) {
+        if (sasl2)
+            return sasl2Complete();
+
         need  = NSASLLayer;
         spare = resetStream();
         step  = Start;
@@ -1345,6 +1768,30 @@ bool CoreProtocol::normalStep(const QDomElement &e)
                 } else if (c.localName() == QLatin1String("bind") && c.namespaceURI() == NS_BIND) {
                     f.bind_supported = true;
 
+                } else if (c.localName() == QLatin1String("authentication") && c.namespaceURI() == NS_SASL2) {
+                    f.sasl2_supported = true;
+                    for (QDomElement m = c.firstChildElement(); !m.isNull(); m = m.nextSiblingElement()) {
+                        if (m.localName() == QLatin1String("mechanism"))
+                            f.sasl2_mechs += m.text();
+                        else if (m.localName() != QLatin1String("inline"))
+                            continue;
+                        for (QDomElement i = m.firstChildElement(); !i.isNull(); i = i.nextSiblingElement()) {
+                            if (i.localName() == QLatin1String("bind") && i.namespaceURI() == NS_BIND2) {
+                                f.bind2_supported = true;
+                                QDomNodeList l    = i.elementsByTagNameNS(NS_BIND2, QLatin1String("feature"));
+                                for (int n = 0; n < l.count(); ++n)
+                                    f.bind2_features += l.item(n).toElement().attribute(QLatin1String("var"));
+                            } else if (i.localName() == QLatin1String("sm")
+                                       && i.namespaceURI() == NS_STREAM_MANAGEMENT) {
+                                f.sm_resume_inline = true;
+                            } else if (i.localName() == QLatin1String("fast") && i.namespaceURI() == NS_FAST) {
+                                QDomNodeList l = i.elementsByTagNameNS(NS_FAST, QLatin1String("mechanism"));
+                                for (int n = 0; n < l.count(); ++n)
+                                    f.fast_mechs += l.item(n).toElement().text();
+                            }
+                        }
+                    }
+
                 } else if (c.localName() == QLatin1String("hosts") && c.namespaceURI() == NS_HOSTS) {
                     QDomNodeList l = c.elementsByTagNameNS(NS_HOSTS, QLatin1String("host"));
                     for (int n = 0; n < l.count(); ++n)
@@ -1360,6 +1807,9 @@ bool CoreProtocol::normalStep(const QDomElement &e)
                     f.session_required  = c.elementsByTagName(QLatin1String("optional")).count() == 0;
                     // more details https://tools.ietf.org/html/draft-cridland-xmpp-session-01
 
+                } else if (c.localName() == QLatin1String("ver") && c.namespaceURI() == NS_ROSTERVER) {
+                    f.rosterver_supported = true;
+
                 } else {
                     unhandled.append(c);
                 }
@@ -1499,6 +1949,41 @@ bool CoreProtocol::normalStep(const QDomElement &e)
                 errorCode = ErrProtocol;
                 return true;
             }
+        } else if (sasl2 && e.namespaceURI() == NS_SASL2) {
+            if (e.tagName() == "challenge") {
+                sasl_step = QCA::Base64().stringToArray(e.text()).toByteArray();
+                need      = NSASLNext;
+                step      = GetSASLNext;
+                return false;
+            } else if (e.tagName() == "success") {
+                sasl2Success = e;
+                sasl_authed  = true;
+                QByteArray a = QCA::Base64().stringToArray(e.firstChildElement("additional-data").text()).toByteArray();
+                if (fastInUse) {
+                    // the server proves it knows the token too
+                    if (!a.isEmpty() && a != fastHash(sasl_mech, fastLoginToken, "Responder")) {
+                        errCond   = {};
+                        event     = EError;
+                        errorCode = ErrAuth;
+                        return true;
+                    }
+                } else if (!a.isEmpty()) {
+                    sasl_step = a;
+                    need      = NSASLNext;
+                    step      = GetSASLNext;
+                    return false;
+                }
+                event = ESASLSuccess;
+                step  = HandleSASLSuccess;
+                return true;
+            } else if (e.tagName() == "failure") {
+                return sasl2Failure(e);
+            } else {
+                // <continue/>, tasks like a second factor aren't supported
+                event     = EError;
+                errorCode = ErrProtocol;
+                return true;
+            }
         }
     } else if (step == GetBindResponse) {
         if (e.namespaceURI() == NS_CLIENT && e.tagName() == "iq") {
@@ -1702,52 +2187,12 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 #ifdef IRIS_SM_DEBUG
                 qDebug() << "Stream Management: [INF] Enabled";
 #endif
-                QString rs = e.attribute("resume");
-                QString id = (rs == "true" || rs == "1") ? e.attribute("id") : QString();
-                sm.start(id);
-                if (!id.isEmpty()) {
-#ifdef IRIS_SM_DEBUG
-                    qDebug() << "Stream Management: [INF] Resumption Supported";
-#endif
-                    QString location = e.attribute("location").trimmed();
-                    if (!location.isEmpty()) {
-                        int         port_off = 0;
-                        QStringView sm_host;
-                        int         sm_port       = 0;
-                        auto        location_view = QStringView { location };
-                        if (location.startsWith('[')) { // ipv6
-                            port_off = location.indexOf(']');
-                            if (port_off != -1) { // looks valid
-                                sm_host = location_view.mid(1, port_off - 1);
-                                if (location.length() > port_off + 2 && location.at(port_off + 1) == ':')
-                                    sm_port = location_view.mid(port_off + 2).toUInt();
-                            }
-                        }
-                        if (port_off == 0) {
-                            port_off = location.indexOf(':');
-                            if (port_off != -1) {
-                                sm_host = location_view.left(port_off);
-                                sm_port = location_view.mid(port_off + 1).toUInt();
-                            } else {
-                                sm_host = location_view.mid(0);
-                            }
-                        }
-                        sm.setLocation(sm_host.toString(), sm_port);
-                    }
-                } // else resumption is not supported on this server
-                needTimer(SM_TIMER_INTERVAL_SECS);
+                startSM(e);
                 event = EReady;
                 step  = Done;
                 return true;
             } else if (e.localName() == "resumed") {
-                sm.resume(e.attribute("h").toUInt());
-                while (true) {
-                    QDomElement st = sm.getUnacknowledgedStanza();
-                    if (st.isNull())
-                        break;
-                    send(st);
-                }
-                needTimer(SM_TIMER_INTERVAL_SECS);
+                resumeSM(e.attribute("h").toUInt());
                 event = EReady;
                 step  = Done;
                 return true;
@@ -1774,7 +2219,7 @@ bool CoreProtocol::normalStep(const QDomElement &e)
             }
         }
         if (sm.isActive()) {
-            if (sm.lastAckElapsed() >= SM_TIMER_INTERVAL_SECS) {
+            if (sm.lastAckElapsed() >= sm.timerInterval()) {
                 if (needSMRequest())
                     event = ESend;
                 else
@@ -24,17 +24,20 @@
 #include "xmlprotocol.h"
 #include "xmpp.h"
 
+#include <QDateTime>
 #include <QList>
 #include <QObject>
 #include <QPair>
 #include <QTimer>
 
+#include <functional>
 #include <optional>
 
 #define NS_ETHERX "http://etherx.jabber.org/streams"
 #define NS_CLIENT "jabber:client"
 #define NS_SERVER "jabber:server"
 #define NS_DIALBACK "jabber:server:dialback"
+#define NS_COMPONENT "jabber:component:accept"
 #define NS_STREAMS "urn:ietf:params:xml:ns:xmpp-streams"
 #define NS_TLS "urn:ietf:params:xml:ns:xmpp-tls"
 #define NS_SASL "urn:ietf:params:xml:ns:xmpp-sasl"
@@ -46,6 +49,11 @@
 #define NS_COMPRESS_FEATURE "http://jabber.org/features/compress"
 #define NS_COMPRESS_PROTOCOL "http://jabber.org/protocol/compress"
 #define NS_HOSTS "http://barracuda.com/xmppextensions/hosts"
+#define NS_ROSTERVER "urn:xmpp:features:rosterver"
+#define NS_SASL2 "urn:xmpp:sasl:2"
+#define NS_BIND2 "urn:xmpp:bind:0"
+#define NS_FAST "urn:xmpp:fast:0"
+#define NS_CARBONS "urn:xmpp:carbons:2"
 
 namespace XMPP {
 class Version {
@@ -64,9 +72,18 @@ public:
     bool        sm_supported;
     bool        session_supported;
     bool        session_required;
+    bool        rosterver_supported; // XEP-0237
     QStringList sasl_mechs;
     QStringList compression_mechs;
     QStringList hosts;
+
+    // XEP-0388 and what can be done inline with it
+    bool        sasl2_supported;
+    bool        bind2_supported;  // XEP-0386
+    bool        sm_resume_inline; // the <sm/> of the SASL2 inline features
+    QStringList sasl2_mechs;
+    QStringList bind2_features; // what can be enabled in the bind request
+    QStringList fast_mechs;     // XEP-0484
 };
 
 class BasicProtocol : public XmlProtocol {
@@ -160,6 +177,7 @@ public:
 
     // send / recv
     void        sendStanza(const QDomElement &e);
+    void        sendStanzaData(const QByteArray &data);
     void        sendDirect(const QString &s);
     void        sendWhitespace();
     void        clearSendQueue();
@@ -240,6 +258,7 @@ private:
 
     struct SendItem {
         QDomElement stanzaToSend;
+        QByteArray  dataToSend; // already serialized stanza
         QString     stringToSend;
         bool        doWhitespace;
     };
@@ -268,11 +287,14 @@ public:
 
     // reimplemented to do SM
     void sendStanza(const QDomElement &e);
+    void sendStanzaData(const QByteArray &stanza);
 
     void startClientOut(const Jid &jid, bool oldOnly, bool tlsActive, bool doAuth, bool doCompression);
     void startServerOut(const QString &to);
     void startDialbackOut(const QString &to, const QString &from);
     void startDialbackVerifyOut(const QString &to, const QString &from, const QString &id, const QString &key);
+    // XEP-0114, as the component named to. there are no features, just the handshake with the shared secret
+    void startComponentOut(const QString &to, const QString &secret);
     void startClientIn(const QString &id);
     void startServerIn(const QString &id);
 
@@ -282,6 +304,19 @@ public:
     void       setAllowPlain(bool b); // old-mode
     const Jid &jid() const;
 
+    // XEP-0388 login with the resource bound, SM and carbons enabled in the same exchange. it's used only if the
+    // server offers Bind2 as well, there is no stream restart after it
+    void setAllowSASL2(bool b);
+    void setBind2(const QString &tag, bool enableCarbons);
+    void setUserAgent(const QString &id, const QString &software, const QString &device);
+    // XEP-0484. with a token the login is a single HMAC instead of the SCRAM exchange. count is how many times
+    // it has been used before
+    void setFastToken(const QString &mechanism, const QString &token, int count);
+    void setRequestFastToken(bool b);
+
+    // the mechanisms for the QCA::SASL to pick from, the SASL2 ones if it's used
+    QStringList offeredSASLMechs() const;
+
     void setPassword(const QString &s);
     void setFrom(const QString &s);
     void setDialbackKey(const QString &s);
@@ -295,10 +330,20 @@ public:
     StreamFeatures     features;
     QList<QDomElement> unhandledFeatures;
     QStringList        hosts;
+    QString            compressMethod; // negotiated XEP-0138 method
+    bool               sasl2;          // logged in with XEP-0388
+    bool               carbonsEnabled; // inline with Bind2
+
+    // the XEP-0484 token to use from now on: the one set, or the one the server issued instead. empty if the
+    // server has rejected it
+    QString   fastMechanism, fastToken;
+    QDateTime fastExpiry;
 
     // static QString xmlToString(const QDomElement &e, bool clip=false);
 
     StreamManagement sm;
+    // called right before a <resume/> is built from sm.state(), which may still be brought up to date then
+    std::function<void()> beforeResume;
 
     class DBItem {
     public:
@@ -331,12 +376,13 @@ private:
         GetAuthGetResponse, // read auth-get response
         HandleAuthSet,      // send old-protocol auth-set
         GetAuthSetResponse, // read auth-set response
-        GetSMResponse       // read SM init response
+        GetSMResponse,      // read SM init response
+        GetHandshake        // read the component handshake response
     };
 
     QList<DBItem> dbrequests, dbpending, dbvalidated;
 
-    bool server, dialback, dialback_verify;
+    bool server, dialback, dialback_verify, component;
     int  step;
 
     bool digest;
@@ -349,6 +395,15 @@ private:
     QString password;
 
     QString dialback_id, dialback_key;
+    QString component_secret;
+
+    bool        doSASL2, doCarbons, requestFast;
+    bool        fastInUse, smInline, carbonsInline; // what the sasl2 authenticate carried
+    QString     bindTag;
+    QString     agentId, agentSoftware, agentDevice;
+    QString     fastLoginMech, fastLoginToken, fastRequested;
+    int         fastLoginCount;
+    QDomElement sasl2Success;
     QString self_from;
 
     void       init();
@@ -360,8 +415,15 @@ private:
     bool grabPendingItem(const Jid &to, const Jid &from, int type, DBItem *item);
     bool normalStep(const QDomElement &e);
     bool dialbackStep(const QDomElement &e);
+    bool componentStep(const QDomElement &e);
 
     bool needSMRequest();
+    void startSM(const QDomElement &enabled);
+    void resumeSM(quint32 h);
+
+    QDomElement sasl2Authenticate();
+    bool        sasl2Failure(const QDomElement &e);
+    bool        sasl2Complete();
 
     // reimplemented
     bool        stepAdvancesParser() const;
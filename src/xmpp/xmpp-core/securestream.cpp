@@ -28,6 +28,7 @@
 #include "securestream.h"
 
 #include "compressionhandler.h"
+#include "metrics.h"
 #ifdef USE_TLSHANDLER
 #include "xmpp.h"
 #endif
@@ -55,6 +56,10 @@ public:
 
     int         p;
     QList<Item> list;
+#ifdef IRIS_METRICS
+    // since the oldest plain byte not encoded yet came in. the delay of the layer is measured with this
+    QElapsedTimer pendingSince;
+#endif
 };
 
 LayerTracker::LayerTracker() { p = 0; }
@@ -63,9 +68,19 @@ void LayerTracker::reset()
 {
     p = 0;
     list.clear();
+#ifdef IRIS_METRICS
+    pendingSince.invalidate();
+#endif
 }
 
-void LayerTracker::addPlain(int plain) { p += plain; }
+void LayerTracker::addPlain(int plain)
+{
+#ifdef IRIS_METRICS
+    if (!p)
+        pendingSince.start();
+#endif
+    p += plain;
+}
 
 void LayerTracker::specifyEncoded(int encoded, int plain)
 {
@@ -73,6 +88,11 @@ void LayerTracker::specifyEncoded(int encoded, int plain)
     if (plain > p)
         plain = p;
     p -= plain;
+#ifdef IRIS_METRICS
+    // what is left came later than the oldest byte, so this overestimates its delay a bit
+    if (!p)
+        pendingSince.invalidate();
+#endif
     Item i;
     i.plain   = plain;
     i.encoded = encoded;
@@ -98,6 +118,34 @@ int LayerTracker::finished(int encoded)
     return plain;
 }
 
+#ifdef IRIS_METRICS
+// the time spent in one layer, without the layers it hands the data to synchronously
+class LayerTimer {
+public:
+    LayerTimer(XMPP::Metrics::Histogram histogram) : histogram(histogram), outerNested(nested)
+    {
+        nested = 0;
+        timer.start();
+    }
+
+    ~LayerTimer()
+    {
+        qint64 total = timer.nsecsElapsed();
+        XMPP::Metrics::record(histogram, quint64(qMax(qint64(0), total - nested) / 1000));
+        nested = outerNested + total;
+    }
+
+private:
+    static thread_local qint64 nested; // nsecs spent in the layers called from the current one
+
+    QElapsedTimer            timer;
+    XMPP::Metrics::Histogram histogram;
+    qint64                   outerNested;
+};
+
+thread_local qint64 LayerTimer::nested = 0;
+#endif
+
 //----------------------------------------------------------------------------
 // SecureStream
 //----------------------------------------------------------------------------
@@ -116,6 +164,7 @@ public:
     } p;
     LayerTracker layer;
     bool         tls_done;
+    bool         early_data; // plain bytes went out with the handshake, all of it is tracked then
     int          prebytes;
 
     SecureLayer(QCA::TLS *t)
@@ -168,12 +217,26 @@ public:
 
     void init()
     {
-        tls_done = false;
-        prebytes = 0;
+        tls_done   = false;
+        early_data = false;
+        prebytes   = 0;
+    }
+
+#ifdef IRIS_METRICS
+    enum Stage { Write, Read, Delay };
+
+    XMPP::Metrics::Histogram histogram(Stage stage) const
+    {
+        int kind = type == SASL ? 1 : type == Compression ? 2 : 0; // TLSH is TLS
+        return XMPP::Metrics::Histogram(XMPP::Metrics::TlsWriteUsecs + kind * 3 + stage);
     }
+#endif
 
     void write(const QByteArray &a)
     {
+#ifdef IRIS_METRICS
+        LayerTimer timer(histogram(Write));
+#endif
         layer.addPlain(a.size());
         switch (type) {
         case TLS: {
@@ -199,28 +262,44 @@ public:
 
     void writeIncoming(const QByteArray &a)
     {
+#ifdef IRIS_METRICS
+        LayerTimer timer(histogram(Read));
+#endif
         switch (type) {
         case TLS: {
+            IRIS_METRIC_ADD(TlsBytesIn, a.size());
             p.tls->writeIncoming(a);
             break;
         }
         case SASL: {
+            IRIS_METRIC_ADD(SaslBytesIn, a.size());
             p.sasl->writeIncoming(a);
             break;
         }
 #ifdef USE_TLSHANDLER
         case TLSH: {
+            IRIS_METRIC_ADD(TlsBytesIn, a.size());
             p.tlsHandler->writeIncoming(a);
             break;
         }
 #endif
         case Compression: {
+            IRIS_METRIC_ADD(CompressionBytesIn, a.size());
             p.compressionHandler->writeIncoming(a);
             break;
         }
         }
     }
 
+    void specifyEncoded(int encoded, int plain)
+    {
+#ifdef IRIS_METRICS
+        if (layer.pendingSince.isValid())
+            XMPP::Metrics::record(histogram(Delay), quint64(layer.pendingSince.nsecsElapsed() / 1000));
+#endif
+        layer.specifyEncoded(encoded, plain);
+    }
+
     int finished(int plain)
     {
         int written = 0;
@@ -239,7 +318,7 @@ public:
         }
 
         // put remainder into the layer tracker
-        if (type == SASL || tls_done)
+        if (type == SASL || tls_done || early_data)
             written += layer.finished(plain);
 
         return written;
@@ -269,7 +348,7 @@ private slots:
     {
         QByteArray a = p.tls->readOutgoing();
         if (tls_done)
-            layer.specifyEncoded(a.size(), plainBytes);
+            specifyEncoded(a.size(), plainBytes);
         emit needWrite(a);
     }
 
@@ -291,7 +370,7 @@ private slots:
     {
         int        plainBytes;
         QByteArray a = p.sasl->readOutgoing(&plainBytes);
-        layer.specifyEncoded(a.size(), plainBytes);
+        specifyEncoded(a.size(), plainBytes);
         emit needWrite(a);
     }
 
@@ -307,7 +386,7 @@ private slots:
     {
         int        plainBytes;
         QByteArray a = p.compressionHandler->readOutgoing(&plainBytes);
-        layer.specifyEncoded(a.size(), plainBytes);
+        specifyEncoded(a.size(), plainBytes);
         emit needWrite(a);
     }
 
@@ -328,8 +407,10 @@ private slots:
 
     void tlsHandler_readyReadOutgoing(const QByteArray &a, int plainBytes)
     {
-        if (tls_done)
-            layer.specifyEncoded(a.size(), plainBytes);
+        if (!tls_done && plainBytes > 0)
+            early_data = true;
+        if (tls_done || early_data)
+            specifyEncoded(a.size(), plainBytes);
         emit needWrite(a);
     }
 #endif
@@ -451,12 +532,14 @@ void SecureStream::startTLSServer(QCA::TLS *t, const QByteArray &spare)
     insertData(spare);
 }
 
-void SecureStream::setLayerCompress(const QByteArray &spare)
+void SecureStream::setLayerCompress(const QByteArray &spare, CompressionHandler *handler)
 {
-    if (!d->active || d->topInProgress || d->haveCompress())
+    if (!d->active || d->topInProgress || d->haveCompress()) {
+        delete handler;
         return;
+    }
 
-    SecureLayer *s = new SecureLayer(new CompressionHandler());
+    SecureLayer *s = new SecureLayer(handler ? handler : new CompressionHandler());
     s->prebytes    = calcPrebytes();
     linkLayer(s);
     d->layers.append(s);
@@ -532,14 +615,19 @@ qint64 SecureStream::bytesToWrite() const { return d->pending; }
 
 void SecureStream::bs_readyRead()
 {
-    QByteArray a = d->bs->readAll();
+    const auto chunks = d->bs->takeReadChunks();
 
     // send to the first layer
-    if (!d->layers.isEmpty()) {
-        SecureLayer *s = d->layers.first();
-        s->writeIncoming(a);
-    } else {
-        incomingData(a);
+    for (auto const &a : chunks) {
+        if (!d->active)
+            break;
+        IRIS_METRIC_ADD(StreamBytesIn, a.size());
+        if (!d->layers.isEmpty()) {
+            SecureLayer *s = d->layers.first();
+            s->writeIncoming(a);
+        } else {
+            incomingData(a);
+        }
     }
 }
 
@@ -598,6 +686,14 @@ void SecureStream::layer_needWrite(const QByteArray &a)
         ++it;
     }
     Q_ASSERT(it != d->layers.end());
+#ifdef IRIS_METRICS
+    if (s->type == SecureLayer::SASL)
+        IRIS_METRIC_ADD(SaslBytesOut, a.size());
+    else if (s->type == SecureLayer::Compression)
+        IRIS_METRIC_ADD(CompressionBytesOut, a.size());
+    else
+        IRIS_METRIC_ADD(TlsBytesOut, a.size());
+#endif
 
     // pass downwards
     if (it != d->layers.begin()) {
@@ -639,7 +735,11 @@ void SecureStream::insertData(const QByteArray &a)
     }
 }
 
-void SecureStream::writeRawData(const QByteArray &a) { d->bs->write(a); }
+void SecureStream::writeRawData(const QByteArray &a)
+{
+    IRIS_METRIC_ADD(StreamBytesOut, a.size());
+    d->bs->write(a);
+}
 
 void SecureStream::incomingData(const QByteArray &a)
 {
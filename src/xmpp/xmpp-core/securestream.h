@@ -42,7 +42,8 @@ public:
 
     void startTLSClient(QCA::TLS *t, const QByteArray &spare = QByteArray());
     void startTLSServer(QCA::TLS *t, const QByteArray &spare = QByteArray());
-    void setLayerCompress(const QByteArray &spare = QByteArray());
+    // takes ownership of handler, a zlib one is created if none is given
+    void setLayerCompress(const QByteArray &spare = QByteArray(), CompressionHandler *handler = nullptr);
     void setLayerSASL(QCA::SASL *s, const QByteArray &spare = QByteArray());
 #ifdef USE_TLSHANDLER
     void startTLSClient(XMPP::TLSHandler *t, const QString &server, const QByteArray &spare = QByteArray());
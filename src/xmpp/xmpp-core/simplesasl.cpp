@@ -19,6 +19,7 @@
 
 #include "simplesasl.h"
 
+#include "handshakepool.h"
 #include "xmpp/sasl/digestmd5response.h"
 #include "xmpp/sasl/plainmessage.h"
 #include "xmpp/sasl/scramsha1message.h"
@@ -29,11 +30,16 @@
 #include <QDebug>
 #include <QHostAddress>
 #include <QList>
+#include <QMutex>
 #include <QObject>
 #include <QStringList>
+#include <QWaitCondition>
 #include <QtCrypto>
 #include <qca.h>
 
+#include <climits>
+#include <memory>
+
 namespace XMPP {
 class SimpleSASLContext : public QCA::SASLContext {
     Q_OBJECT
@@ -84,6 +90,15 @@ public:
     QByteArray       client_first_message;
     QCA::SecureArray server_signature;
 
+    // the client-final-message is computed on the HandshakePool, Hi() is the expensive part of a login
+    class ScramJob {
+    public:
+        QMutex                             mutex;
+        QWaitCondition                     finished;
+        std::unique_ptr<SCRAMSHA1Response> response; // set when it's computed
+    };
+    std::shared_ptr<ScramJob> scramJob;
+
     SimpleSASLContext(QCA::Provider *p) : QCA::SASLContext(p) { reset(); }
 
     ~SimpleSASLContext() { reset(); }
@@ -113,6 +128,15 @@ public:
         out_mech = QString();
         out_buf.resize(0);
         authCondition_ = QCA::SASL::AuthFail;
+        scramJob.reset(); // what it computes is dropped
+    }
+
+    bool isScram() const { return out_mech == "SCRAM-SHA-1" || out_mech == "SCRAM-SHA-256"; }
+
+    // QCA name of the hash of the SCRAM mechanism in use
+    QString scramHash() const
+    {
+        return out_mech == "SCRAM-SHA-256" ? QStringLiteral("sha256") : QStringLiteral("sha1");
     }
 
     virtual void setConstraints(QCA::SASL::AuthFlags flags, int ssfMin, int)
@@ -137,6 +161,10 @@ public:
 
         mechanism_ = QString();
         for (const QString &mech : mechlist) {
+            if (mech == "SCRAM-SHA-256" && QCA::isSupported("hmac(sha256)")) {
+                mechanism_ = mech;
+                break;
+            }
             if (mech == "SCRAM-SHA-1") {
                 mechanism_ = "SCRAM-SHA-1";
                 break;
@@ -176,11 +204,12 @@ public:
     {
         // All exits of the method must emit the ready signal
         // so all exits go through a goto ready;
+        // but the SCRAM response, which emits it once it's computed
         if (step == 0) {
             out_mech = mechanism_;
 
             // PLAIN
-            if (out_mech == "PLAIN" || out_mech == "SCRAM-SHA-1") {
+            if (out_mech == "PLAIN" || isScram()) {
                 // First, check if we have everything
                 if (need.user || need.pass) {
                     qWarning("simplesasl.cpp: Did not receive necessary auth parameters");
@@ -198,7 +227,7 @@ public:
             }
             if (out_mech == "PLAIN") {
                 out_buf = PLAINMessage(authz, user, pass.toByteArray()).getValue();
-            } else if (out_mech == "SCRAM-SHA-1") {
+            } else if (isScram()) {
                 // send client-first-message
                 SCRAMSHA1Message msg(authz, user, QByteArray(0, ' '));
                 if (msg.isValid()) {
@@ -246,7 +275,7 @@ public:
                 out_buf = response.getValue();
                 ++step;
                 result_ = Continue;
-            } else if (out_mech == "SCRAM-SHA-1") {
+            } else if (isScram()) {
                 // if we still need params, then the app has failed us!
                 if (need.user || need.pass) {
                     qWarning("simplesasl.cpp: Did not receive necessary auth parameters");
@@ -271,20 +300,11 @@ public:
                 if (prop.isValid()) {
                     salted_password_base64 = prop.toString();
                 }
-                SCRAMSHA1Response response(in_buf, pass.toByteArray(), client_first_message, salted_password_base64);
-                if (!response.isValid()) {
-                    authCondition_ = QCA::SASL::BadProtocol;
-                    result_        = Error;
-                    goto ready;
-                }
-                setProperty("scram-salted-password-base64", QVariant(response.getSaltedPassword()));
-                server_signature = response.getServerSignature();
-                out_buf          = response.getValue();
-                ++step;
-                result_ = Continue;
+                startScramResponse(salted_password_base64);
+                return;
             }
-        } else if (step == 2 && out_mech == "SCRAM-SHA-1") {
-            // verify the server's response on success, for SCRAM-SHA-1
+        } else if (step == 2 && isScram()) {
+            // verify the server's response on success, for SCRAM
             SCRAMSHA1Signature sig(in_buf, server_signature);
             if (sig.isValid()) {
                 result_ = Success;
@@ -309,6 +329,44 @@ public:
         QMetaObject::invokeMethod(this, "resultsReady", Qt::QueuedConnection);
     }
 
+    void startScramResponse(const QString &salted_password_base64)
+    {
+        auto job = std::make_shared<ScramJob>();
+        scramJob = job;
+        HandshakePool::run(
+            this,
+            [job, server_first = in_buf, password = pass, client_first = client_first_message, salted_password_base64,
+             hash = scramHash()]() {
+                auto response = std::make_unique<SCRAMSHA1Response>(server_first, password.toByteArray(), client_first,
+                                                                    salted_password_base64, hash);
+                QMutexLocker locker(&job->mutex);
+                job->response = std::move(response);
+                job->finished.wakeAll();
+            },
+            [this, job]() { scramResponseReady(job); });
+    }
+
+    void scramResponseReady(const std::shared_ptr<ScramJob> &job)
+    {
+        // reset since, or taken by waitForResultsReady() already
+        if (job != scramJob)
+            return;
+        scramJob.reset();
+
+        SCRAMSHA1Response &response = *job->response;
+        if (!response.isValid()) {
+            authCondition_ = QCA::SASL::BadProtocol;
+            result_        = Error;
+        } else {
+            setProperty("scram-salted-password-base64", QVariant(response.getSaltedPassword()));
+            server_signature = response.getServerSignature();
+            out_buf          = response.getValue();
+            ++step;
+            result_ = Continue;
+        }
+        QMetaObject::invokeMethod(this, "resultsReady", Qt::QueuedConnection);
+    }
+
     virtual void update(const QByteArray &from_net, const QByteArray &from_app)
     {
         result_to_app_ = from_net;
@@ -320,9 +378,18 @@ public:
 
     virtual bool waitForResultsReady(int msecs)
     {
-
-        // TODO: for now, all operations block anyway
-        Q_UNUSED(msecs);
+        // all the operations but the SCRAM response are done right away
+        auto job = scramJob;
+        if (!job)
+            return true;
+        {
+            QMutexLocker locker(&job->mutex);
+            while (!job->response) {
+                if (!job->finished.wait(&job->mutex, msecs < 0 ? ULONG_MAX : ulong(msecs)))
+                    return false;
+            }
+        }
+        scramResponseReady(job);
         return true;
     }
 
@@ -19,6 +19,12 @@
 
 #include "sm.h"
 
+#include "metrics.h"
+#include "xmpp_stanza.h"
+
+#include <QDataStream>
+#include <QIODevice>
+
 #ifdef IRIS_SM_DEBUG
 #include <QDebug>
 #endif
@@ -41,6 +47,90 @@ void SMState::resetCounters()
     send_queue.clear();
 }
 
+// don't bother moving less than this to the front of the queue
+#define SM_QUEUE_COMPACT_BYTES 4096
+
+void SMSendQueue::enqueue(const QByteArray &stanza)
+{
+    data += stanza;
+    ends.enqueue(base + data.size());
+}
+
+void SMSendQueue::dequeue()
+{
+    head        = ends.dequeue();
+    qint64 dead = head - base;
+    if (ends.isEmpty()) {
+        data.resize(0);
+        base = head;
+    } else if (dead >= SM_QUEUE_COMPACT_BYTES && dead * 2 >= data.size()) {
+        data.remove(0, int(dead));
+        base = head;
+    }
+}
+
+void SMSendQueue::clear()
+{
+    data.clear();
+    ends.clear();
+    head = 0;
+    base = 0;
+}
+
+QByteArray SMSendQueue::at(int index) const
+{
+    qint64 start = index == 0 ? head : ends.at(index - 1);
+    return data.mid(int(start - base), int(ends.at(index) - start));
+}
+
+// "IRSM" in ASCII
+#define SM_SNAPSHOT_MAGIC 0x4952534d
+#define SM_SNAPSHOT_VERSION 1
+
+QByteArray SMState::save() const
+{
+    QByteArray  data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << quint32(SM_SNAPSHOT_MAGIC) << quint8(SM_SNAPSHOT_VERSION);
+    out << enabled << resumption_id << resumption_location.host << resumption_location.port;
+    out << received_count << server_last_handled;
+    out << quint32(send_queue.size());
+    for (int n = 0; n < send_queue.size(); ++n)
+        out << send_queue.at(n);
+    return data;
+}
+
+bool SMState::restore(const QByteArray &data)
+{
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 magic   = 0;
+    quint8  version = 0;
+    in >> magic >> version;
+    if (magic != SM_SNAPSHOT_MAGIC || version != SM_SNAPSHOT_VERSION)
+        return false;
+
+    SMState s;
+    quint32 count = 0;
+    in >> s.enabled >> s.resumption_id >> s.resumption_location.host >> s.resumption_location.port;
+    in >> s.received_count >> s.server_last_handled;
+    in >> count;
+    if (in.status() != QDataStream::Ok)
+        return false;
+
+    for (quint32 n = 0; n < count; ++n) {
+        QByteArray xml;
+        in >> xml;
+        if (in.status() != QDataStream::Ok)
+            return false;
+        s.send_queue.enqueue(xml);
+    }
+
+    *this = s;
+    return true;
+}
+
 StreamManagement::StreamManagement(QObject *parent) :
     QObject(parent), sm_started(false), sm_resumed(false), sm_stanzas_notify(0), sm_resend_pos(0)
 {
@@ -48,12 +138,15 @@ StreamManagement::StreamManagement(QObject *parent) :
 
 void StreamManagement::reset()
 {
-    sm_started                     = false;
-    sm_resumed                     = false;
-    sm_stanzas_notify              = 0;
-    sm_resend_pos                  = 0;
-    sm_timeout_data.elapsed_timer  = QElapsedTimer();
-    sm_timeout_data.waiting_answer = false;
+    sm_started                        = false;
+    sm_resumed                        = false;
+    sm_stanzas_notify                 = 0;
+    sm_resend_pos                     = 0;
+    sm_timeout_data.elapsed_timer     = QElapsedTimer();
+    sm_timeout_data.request_timer     = QElapsedTimer();
+    sm_timeout_data.waiting_answer    = false;
+    sm_ack_window.unrequested_stanzas = 0;
+    sm_ack_window.unrequested_bytes   = 0;
 }
 
 void StreamManagement::start(const QString &resumption_id)
@@ -107,25 +200,76 @@ void StreamManagement::countInputRawData(int bytes)
     }
 }
 
-QDomElement StreamManagement::getUnacknowledgedStanza()
+QByteArray StreamManagement::getUnacknowledgedStanza()
 {
     if (sm_resend_pos < state_.send_queue.size())
         return state_.send_queue.at(sm_resend_pos++);
-    return QDomElement();
+    return QByteArray();
 }
 
-int StreamManagement::addUnacknowledgedStanza(const QDomElement &e)
+int StreamManagement::addUnacknowledgedStanza(const QByteArray &stanza)
 {
-    state_.send_queue.enqueue(e);
+    state_.send_queue.enqueue(stanza);
+    ++sm_ack_window.unrequested_stanzas;
+    sm_ack_window.unrequested_bytes += stanza.size();
     int len = state_.send_queue.length();
+    IRIS_METRIC_RECORD(SmQueueDepth, len);
 #ifdef IRIS_SM_DEBUG
     qDebug() << "Stream Management: [INF] Send queue length is changed: " << len;
 #endif
     return len;
 }
 
+bool StreamManagement::isSendQueueFull() const
+{
+    return sm_queue_limit > 0 && state_.send_queue.bytes() >= sm_queue_limit;
+}
+
+void StreamManagement::setAckWindow(int stanzas, qint64 bytes)
+{
+    sm_ack_window.stanzas = stanzas;
+    sm_ack_window.bytes   = bytes;
+}
+
+bool StreamManagement::isAckRequestDue() const
+{
+    if (sm_timeout_data.waiting_answer)
+        return false;
+    return (sm_ack_window.stanzas > 0 && sm_ack_window.unrequested_stanzas >= sm_ack_window.stanzas)
+        || (sm_ack_window.bytes > 0 && sm_ack_window.unrequested_bytes >= sm_ack_window.bytes);
+}
+
+int StreamManagement::roundTripTime() const { return sm_timeout_data.srtt; }
+
+int StreamManagement::ackTimeout() const
+{
+    if (sm_timeout_data.srtt < 0)
+        return SM_TIMER_INTERVAL_SECS;
+    // the usual retransmission timeout, generous enough for a server which is slow to answer
+    int rto  = sm_timeout_data.srtt + 4 * sm_timeout_data.rttvar;
+    int secs = (rto + 999) / 1000;
+    return qBound(SM_MIN_ACK_TIMEOUT_SECS, secs, SM_TIMER_INTERVAL_SECS);
+}
+
+int StreamManagement::timerInterval() const
+{
+    return sm_timeout_data.waiting_answer ? ackTimeout() : SM_TIMER_INTERVAL_SECS;
+}
+
 void StreamManagement::processAcknowledgement(quint32 last_handled)
 {
+    if (sm_timeout_data.waiting_answer && sm_timeout_data.request_timer.isValid()) {
+        int sample = int(sm_timeout_data.request_timer.elapsed());
+        IRIS_METRIC_RECORD(SmAckRttMsecs, sample);
+        if (sm_timeout_data.srtt < 0) {
+            sm_timeout_data.srtt   = sample;
+            sm_timeout_data.rttvar = sample / 2;
+        } else {
+            sm_timeout_data.rttvar = (3 * sm_timeout_data.rttvar + qAbs(sm_timeout_data.srtt - sample)) / 4;
+            sm_timeout_data.srtt   = (7 * sm_timeout_data.srtt + sample) / 8;
+        }
+        sm_timeout_data.request_timer.invalidate();
+    }
     sm_timeout_data.waiting_answer = false;
     sm_timeout_data.elapsed_timer.start();
 #ifdef IRIS_SM_DEBUG
@@ -157,7 +301,7 @@ void StreamManagement::markStanzaHandled()
 #endif
 }
 
-QDomElement StreamManagement::generateRequestStanza(QDomDocument &doc)
+QByteArray StreamManagement::generateRequest()
 {
     if (!sm_timeout_data.waiting_answer) {
 #ifdef IRIS_SM_DEBUG
@@ -165,17 +309,20 @@ QDomElement StreamManagement::generateRequestStanza(QDomDocument &doc)
 #endif
         sm_timeout_data.waiting_answer = true;
         sm_timeout_data.elapsed_timer.start();
-        return doc.createElementNS(NS_STREAM_MANAGEMENT, "r");
+        sm_timeout_data.request_timer.start();
+        sm_ack_window.unrequested_stanzas = 0;
+        sm_ack_window.unrequested_bytes   = 0;
+        return Stanza::Builder(QLatin1String("r"), QLatin1String(NS_STREAM_MANAGEMENT)).data();
     }
-    return QDomElement();
+    return QByteArray();
 }
 
-QDomElement StreamManagement::makeResponseStanza(QDomDocument &doc)
+QByteArray StreamManagement::makeResponse()
 {
 #ifdef IRIS_SM_DEBUG
     qDebug() << "Stream Management: [-->] Sending acknowledgment with h =" << state_.received_count;
 #endif
-    QDomElement e = doc.createElementNS(NS_STREAM_MANAGEMENT, "a");
-    e.setAttribute("h", state_.received_count);
-    return e;
+    return Stanza::Builder(QLatin1String("a"), QLatin1String(NS_STREAM_MANAGEMENT))
+        .attribute(QLatin1String("h"), QString::number(state_.received_count))
+        .data();
 }
@@ -20,6 +20,7 @@
 #ifndef XMPP_SM_H
 #define XMPP_SM_H
 
+#include <QByteArray>
 #include <QDomElement>
 #include <QElapsedTimer>
 #include <QObject>
@@ -27,10 +28,36 @@
 
 #define NS_STREAM_MANAGEMENT "urn:xmpp:sm:3"
 #define SM_TIMER_INTERVAL_SECS 40
+// bounds for how long to wait for an <a/> once it was requested, see ackTimeout()
+#define SM_MIN_ACK_TIMEOUT_SECS 5
+// default amount of unacknowledged traffic after which an ack is requested
+#define SM_ACK_WINDOW_STANZAS 5
+#define SM_ACK_WINDOW_BYTES (16 * 1024)
 
 // #define IRIS_SM_DEBUG
 
 namespace XMPP {
+// Unacknowledged outgoing stanzas, kept as the UTF-8 they were sent as. The stanzas share one byte
+// array which is only compacted when the acknowledged part at its front outweighs the rest.
+class SMSendQueue {
+public:
+    void       enqueue(const QByteArray &stanza);
+    void       dequeue();
+    void       clear();
+    bool       isEmpty() const { return ends.isEmpty(); }
+    int        size() const { return int(ends.size()); }
+    int        length() const { return size(); }
+    qint64     bytes() const { return data.size() - (head - base); }
+    qint64     memoryUsage() const { return data.capacity() + qint64(ends.size()) * qint64(sizeof(qint64)); }
+    QByteArray at(int index) const;
+
+private:
+    QByteArray     data;
+    QQueue<qint64> ends;     // absolute end offset of every stanza
+    qint64         head = 0; // absolute offset of the first stanza
+    qint64         base = 0; // absolute offset of data[0]
+};
+
 class SMState {
 public:
     SMState();
@@ -40,11 +67,16 @@ public:
     bool isLocationValid() { return !resumption_location.host.isEmpty() && resumption_location.port != 0; }
     void setEnabled(bool e) { enabled = e; }
 
+    // Compact binary snapshot of everything needed to <resume/> the session from another process.
+    // restore() returns false and leaves the state untouched if data is not a valid snapshot
+    QByteArray save() const;
+    bool       restore(const QByteArray &data);
+
 public:
     bool                enabled;
     quint32             received_count;
     quint32             server_last_handled;
-    QQueue<QDomElement> send_queue;
+    SMSendQueue         send_queue;
     QString             resumption_id;
     struct {
         QString host;
@@ -66,12 +98,28 @@ public:
     int                  lastAckElapsed() const;
     int                  takeAckedCount();
     void                 countInputRawData(int bytes);
-    QDomElement          getUnacknowledgedStanza();
-    int                  addUnacknowledgedStanza(const QDomElement &e);
+    QByteArray           getUnacknowledgedStanza();
+    int                  addUnacknowledgedStanza(const QByteArray &stanza);
+    // soft cap of the unacknowledged bytes, 0 for none. Stanzas are never dropped, the owner is
+    // expected to stop sending while the queue is full
+    void                 setSendQueueLimit(qint64 bytes) { sm_queue_limit = bytes; }
+    bool                 isSendQueueFull() const;
     void                 processAcknowledgement(quint32 last_handled);
     void                 markStanzaHandled();
-    QDomElement          generateRequestStanza(QDomDocument &doc);
-    QDomElement          makeResponseStanza(QDomDocument &doc);
+
+    // Acks are requested once this many stanzas or bytes went out unrequested. 0 disables a limit
+    void setAckWindow(int stanzas, qint64 bytes);
+    bool isAckRequestDue() const;
+    // smoothed round trip of <r/> to <a/> in msecs, -1 until measured
+    int  roundTripTime() const;
+    // secs to wait for a requested ack before the connection is considered dead
+    int  ackTimeout() const;
+    // secs the ack timer should run for in the current state
+    int  timerInterval() const;
+
+    // serialized, they are sent too often to be built as trees. the request is empty while one is pending
+    QByteArray generateRequest();
+    QByteArray makeResponse();
 
 private:
     SMState state_;
@@ -79,9 +127,19 @@ private:
     bool    sm_resumed;
     int     sm_stanzas_notify;
     int     sm_resend_pos;
+    qint64  sm_queue_limit = 0;
+    struct {
+        int    stanzas             = SM_ACK_WINDOW_STANZAS;
+        qint64 bytes               = SM_ACK_WINDOW_BYTES;
+        int    unrequested_stanzas = 0;
+        qint64 unrequested_bytes   = 0;
+    } sm_ack_window;
     struct {
         QElapsedTimer elapsed_timer;
+        QElapsedTimer request_timer; // runs from <r/> to <a/>
         bool          waiting_answer = false;
+        int           srtt           = -1; // msecs, RFC 6298 style
+        int           rttvar         = 0;
     } sm_timeout_data;
 };
 } // namespace XMPP
@@ -42,28 +42,44 @@
 */
 
 #include "bytestream.h"
+#include "compressionhandler.h"
 #ifndef NO_IRISNET
 #include "irisnet/corelib/irisnetglobal_p.h"
 #endif
 #include "protocol.h"
 #include "securestream.h"
+#include "sharedtimer.h"
 #include "simplesasl.h"
+#include "stallwatchdog.h"
+#include "streamrecorder.h"
+#include "timerwheel.h"
 #ifdef XMPP_TEST
 #include "td.h"
 #endif
 
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QList>
+#include <QMetaMethod>
 #include <QPointer>
 #include <QTextStream>
 #include <QTimer>
 #include <QUrl>
 #include <QtCrypto>
 // #include <stdio.h>
+#include <algorithm>
+#include <array>
 #include <stdlib.h>
 
 // #define XMPP_DEBUG
 
+// what the socket may have left to write before ClientStream holds stanzas back in its priority queues
+#define STREAM_SEND_BACKLOG 16384
+// keepalives which have to get through on a probed interval before a longer one is tried
+#define NOOP_PROBE_ROUNDS 3
+// how much longer the next one is, in percent
+#define NOOP_PROBE_STEP 25
+
 using namespace XMPP;
 
 static Debug *debug_ptr = nullptr;
@@ -102,6 +118,14 @@ Stanza Stream::createStanza(Stanza::Kind k, const Jid &to, const QString &type,
 
 Stanza Stream::createStanza(const QDomElement &e) { return Stanza(this, e); }
 
+Stanza Stream::createStanza(const QDomElement &e, const QSharedPointer<QDomDocument> &doc)
+{
+    Stanza s(this, e);
+    if (s.d)
+        s.d->sharedDoc = doc;
+    return s;
+}
+
 QString Stream::xmlToString(const QDomElement &e, bool clip)
 {
     if (!foo) {
@@ -177,7 +201,21 @@ public:
     bool tls_warned = false;
     bool using_tls;
     bool doAuth;
-    bool doCompress = false;
+    bool   doCompress        = false;
+    qint64 compressLinkSpeed = 0;
+
+    // XEP-0114, see connectToComponent()
+    bool    component = false;
+    QString componentSecret;
+
+    // XEP-0388 and XEP-0484, see setSASL2Enabled()
+    bool    doSASL2       = false;
+    bool    inlineCarbons = true;
+    bool    requestFast   = false;
+    QString bindTag;
+    QString agentId, agentSoftware, agentDevice;
+    QString fastMech, fastToken;
+    int     fastCount = 0;
 
     QStringList sasl_mechlist;
 
@@ -188,10 +226,50 @@ public:
 
     QList<Stanza *> in;
 
-    QTimer timeout_timer;
-    QTimer noopTimer;
-    int    noop_time;
-    bool   quiet_reconnection = false;
+    SharedTimer timeout_timer;
+    SharedTimer noopTimer;
+    int         noop_time;
+    bool        quiet_reconnection = false;
+
+    QPointer<TimerWheel> timerWheel; // for the keepalives instead of noopTimer
+
+    StreamRecorder *recorder = nullptr; // see setRecorder()
+
+    // make-before-break, see takeOver()
+    QPointer<ClientStream> handoverFrom; // whose session this one resumes, until <resume/> goes out
+    QPointer<ClientStream> handoverTo;   // dropped, what is written here goes there
+    bool                   handingOver = false;
+
+    // adaptive keepalives, see setNoopTimeMax(). they survive reconnections, it's the same network mostly
+    QElapsedTimer lastTraffic;          // anything read or written
+    int           noopMax      = 0;     // 0 for a fixed interval
+    int           noopCurrent  = 0;     // the interval in use
+    int           noopGood     = 0;     // the longest one known to get through
+    int           noopRounds   = 0;     // keepalives which got through on noopCurrent
+    bool          noopProbing  = false; // a keepalive went out after a full idle interval, no answer yet
+    bool          noopSettled  = false; // a longer interval has failed, noopGood is final
+
+    bool smQueueFull = false;
+
+    // write coalescing. see setWriteCoalescing()
+    bool   coalesceWrites   = false;
+    int    coalesceMaxBytes = 16384;
+    QTimer flushTimer;
+
+    // read budget. see setReadBudget()
+    int    readMaxStanzas = 0;
+    int    readMaxMsecs   = 0;
+    QTimer readTimer; // going on with what is left in the parser
+
+    // stanzas held back while the socket has a backlog, one queue per Stanza::Priority. see write()
+    struct QueuedStanza {
+        QByteArray data;
+        QString    supersedes; // a later stanza with the same key makes this one stale, see supersedeKey()
+    };
+    std::array<QList<QueuedStanza>, 4> sendQueues;
+    int                                queuedStanzas    = 0;
+    qint64                             queuedBytes      = 0;
+    qint64                             congestionBudget = 0;
 };
 
 ClientStream::ClientStream(Connector *conn, TLSHandler *tlsHandler, QObject *parent) : Stream(parent)
@@ -203,8 +281,17 @@ ClientStream::ClientStream(Connector *conn, TLSHandler *tlsHandler, QObject *par
     connect(d->conn, SIGNAL(error()), SLOT(cr_error()));
 
     d->noop_time = 0;
+    d->noopTimer.setSingleShot(true);
     connect(&d->noopTimer, SIGNAL(timeout()), SLOT(doNoop()));
 
+    d->flushTimer.setSingleShot(true);
+    d->flushTimer.setInterval(0);
+    connect(&d->flushTimer, SIGNAL(timeout()), SLOT(flushOutgoing()));
+
+    d->readTimer.setSingleShot(true);
+    d->readTimer.setInterval(0);
+    connect(&d->readTimer, SIGNAL(timeout()), SLOT(doReadMore()));
+
     d->tlsHandler = tlsHandler;
 }
 
@@ -232,6 +319,8 @@ ClientStream::ClientStream(const QString &host, const QString &defRealm, ByteStr
 
     d->tls = tls;
 
+    // srvProcessNext() has no use for the transfer items
+    d->srv.setTransfersObserved(false, false);
     d->srv.startClientIn(genId());
     // d->srv.startServerIn(genId());
     // d->state = Connecting;
@@ -239,6 +328,7 @@ ClientStream::ClientStream(const QString &host, const QString &defRealm, ByteStr
     // d->server = QString();
 
     connect(&(d->timeout_timer), SIGNAL(timeout()), SLOT(sm_timeout()));
+    d->client.beforeResume = [this]() { takeOverSession(); };
 }
 
 ClientStream::~ClientStream()
@@ -254,8 +344,31 @@ void ClientStream::reset(bool all)
     // fprintf(stderr, "\tClientStream::reset\n");
     // fflush(stderr);
 
+    // the held back stanzas go to the stream management queue, so a resumption sends them like the unacked ones
+    for (auto &queue : d->sendQueues) {
+        if (d->client.sm.isActive()) {
+            for (const auto &item : std::as_const(queue))
+                d->client.sendStanzaData(item.data);
+        }
+        queue.clear();
+    }
+    d->queuedStanzas = 0;
+    d->queuedBytes   = 0;
+
+    // an active stream dying while idle for longer than what is known to work says that was too long
+    if (d->state == Active && d->noopCurrent > d->noopGood && d->lastTraffic.isValid()
+        && d->lastTraffic.elapsed() >= d->noopGood) {
+        d->noopCurrent = d->noopGood;
+        d->noopSettled = true;
+    }
+    d->noopProbing = false;
+
     d->reset();
     d->noopTimer.stop();
+    if (d->timerWheel)
+        d->timerWheel->stop(this);
+    d->flushTimer.stop();
+    d->readTimer.stop();
 
     // delete securestream
     delete d->ss;
@@ -317,6 +430,20 @@ void ClientStream::connectToServer(const Jid &jid, bool auth)
     d->doAuth = auth;
     d->server = d->jid.domain();
 
+    d->component = false;
+    d->conn->connectToServer(d->server);
+}
+
+void ClientStream::connectToComponent(const Jid &component, const QString &secret)
+{
+    reset(true);
+    d->state  = Connecting;
+    d->jid    = component.domain();
+    d->doAuth = false;
+    d->server = d->jid.domain();
+
+    d->component       = true;
+    d->componentSecret = secret;
     d->conn->connectToServer(d->server);
 }
 
@@ -434,20 +561,75 @@ void ClientStream::setResourceBinding(bool b) { d->doBinding = b; }
 
 void ClientStream::setLang(const QString &lang) { d->lang = lang; }
 
+/*
+ * A keepalive goes out only once the stream has been quiet in both directions for the whole interval, any
+ * other traffic keeps the NAT bindings on the way alive just as well.
+ */
 void ClientStream::setNoopTime(int mills)
 {
-    d->noop_time = mills;
+    d->noop_time   = mills;
+    d->noopCurrent = mills;
+    d->noopGood    = mills;
+    d->noopRounds  = 0;
+    d->noopSettled = false;
+    startNoop();
+}
 
+/*
+ * Lets the keepalive interval grow from the noop time up to mills, to find how long the link may stay idle.
+ * Every NOOP_PROBE_ROUNDS keepalives that got an answer (any incoming data, the ack if stream management
+ * is on) the next one goes NOOP_PROBE_STEP percent later. When the stream dies while idle for longer than
+ * the last interval which worked, it goes back to that one and stays there. 0 turns probing off.
+ */
+void ClientStream::setNoopTimeMax(int mills) { d->noopMax = mills; }
+
+int ClientStream::noopTime() const { return d->noopCurrent; }
+
+void ClientStream::startNoop()
+{
     if (d->state != Active)
         return;
 
-    if (d->noop_time == 0) {
+    if (d->noopCurrent == 0) {
         d->noopTimer.stop();
+        if (d->timerWheel)
+            d->timerWheel->stop(this);
         return;
     }
-    d->noopTimer.start(d->noop_time);
+    armNoop(d->noopCurrent);
 }
 
+void ClientStream::armNoop(int msecs)
+{
+    if (d->timerWheel)
+        d->timerWheel->start(this, msecs, [this]() { doNoop(); });
+    else
+        d->noopTimer.start(msecs);
+}
+
+// called on incoming data while a keepalive waits for the proof it got through
+void ClientStream::noopAnswered()
+{
+    d->noopProbing = false;
+    if (d->noopCurrent > d->noopGood)
+        d->noopGood = d->noopCurrent;
+    if (d->noopSettled || d->noopCurrent >= d->noopMax || ++d->noopRounds < NOOP_PROBE_ROUNDS)
+        return;
+    d->noopRounds  = 0;
+    d->noopCurrent = qMin(d->noopMax, d->noopCurrent + d->noopCurrent * NOOP_PROBE_STEP / 100);
+}
+
+void ClientStream::setTimerWheel(TimerWheel *wheel)
+{
+    if (d->timerWheel)
+        d->timerWheel->stop(this);
+    d->noopTimer.stop();
+    d->timerWheel = wheel;
+    startNoop();
+}
+
+void ClientStream::setRecorder(StreamRecorder *recorder) { d->recorder = recorder; }
+
 QString ClientStream::saslMechanism() const { return d->client.saslMech(); }
 
 int ClientStream::saslSSF() const { return d->sasl_ssf; }
@@ -463,6 +645,112 @@ void ClientStream::setLocalAddr(const QHostAddress &addr, quint16 port)
 
 void ClientStream::setCompress(bool compress) { d->doCompress = compress; }
 
+void ClientStream::setCompressionLinkSpeed(qint64 bytesPerSecond) { d->compressLinkSpeed = bytesPerSecond; }
+
+void ClientStream::setSASL2Enabled(bool b) { d->doSASL2 = b; }
+
+void ClientStream::setBind2(const QString &tag, bool enableCarbons)
+{
+    d->bindTag       = tag;
+    d->inlineCarbons = enableCarbons;
+}
+
+void ClientStream::setUserAgent(const QString &id, const QString &software, const QString &device)
+{
+    d->agentId       = id;
+    d->agentSoftware = software;
+    d->agentDevice   = device;
+}
+
+bool ClientStream::carbonsEnabled() const { return d->client.carbonsEnabled; }
+
+void ClientStream::setFastToken(const QString &mechanism, const QString &token, int count)
+{
+    d->fastMech  = mechanism;
+    d->fastToken = token;
+    d->fastCount = count;
+}
+
+void ClientStream::setRequestFastToken(bool b) { d->requestFast = b; }
+
+/*
+ * With coalescing enabled, stanzas serialized while the stream is active are not written one by one. They are
+ * collected and written at once when the control gets back to the event loop (or after maxDelay msecs), or as soon as
+ * maxBytes are pending. This saves a TLS record and a syscall per stanza on bursts. Urgent data, like stream
+ * management acks, is still written immediately.
+ */
+void ClientStream::setWriteCoalescing(bool enabled, int maxBytes, int maxDelay)
+{
+    d->coalesceWrites   = enabled;
+    d->coalesceMaxBytes = maxBytes;
+    d->flushTimer.setInterval(maxDelay);
+    if (!enabled)
+        flushOutgoing();
+}
+
+/*
+ * Everything the parser can make of the received data is parsed before the stanzas are announced with a single
+ * readyRead(). With a budget the parsing stops after maxStanzas stanzas or maxMsecs msecs, whichever comes first,
+ * the stanzas so far are announced and the rest is parsed on the next event loop turn. So a flood doesn't block
+ * the event loop until the last stanza of it is handled. 0 for no limit, the default for both.
+ */
+void ClientStream::setReadBudget(int maxStanzas, int maxMsecs)
+{
+    d->readMaxStanzas = qMax(maxStanzas, 0);
+    d->readMaxMsecs   = qMax(maxMsecs, 0);
+}
+
+void ClientStream::addContentSink(const QString &ns, const QString &localName, ContentSink *sink)
+{
+    d->client.addContentSink(ns, localName, sink);
+    d->srv.addContentSink(ns, localName, sink);
+}
+
+void ClientStream::removeContentSink(ContentSink *sink)
+{
+    d->client.removeContentSink(sink);
+    d->srv.removeContentSink(sink);
+}
+
+void ClientStream::setBatchDocuments(bool enabled)
+{
+    d->client.setBatchDocuments(enabled);
+    d->srv.setBatchDocuments(enabled);
+}
+
+void ClientStream::setStanzaLimits(qint64 maxSize, int maxDepth, int maxAttributes, int maxPerSecond)
+{
+    Parser::Limits limits;
+    limits.stanzaSize       = maxSize;
+    limits.depth            = maxDepth;
+    limits.attributes       = maxAttributes;
+    limits.stanzasPerSecond = maxPerSecond;
+    d->client.setParserLimits(limits);
+    d->srv.setParserLimits(limits);
+}
+
+void ClientStream::flushOutgoing()
+{
+    d->flushTimer.stop();
+    if (!d->ss)
+        return;
+
+    CoreProtocol &proto = d->mode == Client ? d->client : d->srv;
+    while (true) {
+        QByteArray a = proto.takeOutgoingData();
+        if (a.isEmpty())
+            break;
+        writeOut(a);
+    }
+}
+
+void ClientStream::writeOut(const QByteArray &data)
+{
+    if (d->recorder && d->mode == Client && d->state == Active)
+        d->recorder->record(StreamRecorder::Outgoing, data);
+    d->ss->write(data);
+}
+
 int ClientStream::errorCondition() const { return d->errCond; }
 
 QString ClientStream::errorText() const { return d->errText; }
@@ -486,7 +774,7 @@ void ClientStream::close()
 
 QDomDocument &ClientStream::doc() const { return d->client.doc; }
 
-QString ClientStream::baseNS() const { return NS_CLIENT; }
+QString ClientStream::baseNS() const { return d->component ? NS_COMPONENT : NS_CLIENT; }
 
 void ClientStream::setAllowPlain(AllowPlainType a) { d->allowPlain = a; }
 
@@ -514,15 +802,162 @@ Stanza ClientStream::read()
     }
 }
 
-void ClientStream::write(const Stanza &s)
+// empty if nothing later can make the stanza stale
+static QString supersedeKey(const QDomElement &e)
 {
-    if (d->state == Active) {
-        d->client.sendStanza(s.element());
-        processNext();
+    const QString tag = e.tagName();
+    const QString to  = e.attribute(QStringLiteral("to"));
+    if (tag == QLatin1String("presence")) {
+        const QString type = e.attribute(QStringLiteral("type"));
+        if (!type.isEmpty() && type != QLatin1String("unavailable"))
+            return QString(); // subscriptions, probes and errors all count
+        // joining a room is more than a state
+        for (QDomElement c = e.firstChildElement(QStringLiteral("x")); !c.isNull();
+             c = c.nextSiblingElement(QStringLiteral("x"))) {
+            if (c.namespaceURI() == QLatin1String("http://jabber.org/protocol/muc"))
+                return QString();
+        }
+        return QLatin1String("presence ") + to;
+    }
+    if (tag == QLatin1String("message")) {
+        bool chatState = false;
+        for (QDomElement c = e.firstChildElement(); !c.isNull(); c = c.nextSiblingElement()) {
+            if (c.namespaceURI() == QLatin1String("http://jabber.org/protocol/chatstates"))
+                chatState = true;
+            else if (c.tagName() != QLatin1String("thread"))
+                return QString(); // a body or anything else which must arrive
+        }
+        if (chatState)
+            return QLatin1String("chatstate ") + to;
+    }
+    return QString();
+}
+
+void ClientStream::write(const Stanza &s) { write(s, Stanza::Priority::Auto); }
+
+void ClientStream::write(const Stanza &s, Stanza::Priority priority)
+{
+    if (d->handoverTo) {
+        d->handoverTo->writeTakenOver(d->client.serializeElement(s.element()));
+        return;
+    }
+    if (d->state != Active)
+        return;
+    if (d->queuedStanzas || isSendBacklogged()) {
+        if (priority == Stanza::Priority::Auto)
+            priority = s.priority();
+        queueStanza(d->client.serializeElement(s.element()), priority, supersedeKey(s.element()));
+        writeQueued();
+        return;
+    }
+    d->client.sendStanza(s.element());
+    QPointer<QObject> self = this;
+    checkSMSendQueue();
+    if (!self)
+        return;
+    processNext();
+}
+
+void ClientStream::write(const Stanza::Builder &b, Stanza::Priority priority)
+{
+    if (d->handoverTo) {
+        d->handoverTo->writeTakenOver(b.data());
+        return;
     }
+    if (d->state != Active)
+        return;
+    if (d->queuedStanzas || isSendBacklogged()) {
+        if (priority == Stanza::Priority::Auto)
+            priority = b.priority();
+        queueStanza(b.data(), priority, QString());
+        writeQueued();
+        return;
+    }
+    d->client.sendStanzaData(b.data());
+    QPointer<QObject> self = this;
+    checkSMSendQueue();
+    if (!self)
+        return;
+    processNext();
+}
+
+void ClientStream::clearSendQueue()
+{
+    for (auto &queue : d->sendQueues)
+        queue.clear();
+    d->queuedStanzas = 0;
+    d->queuedBytes   = 0;
+    d->client.clearSendQueue();
+}
+
+// what the socket and the protocol have not written yet
+bool ClientStream::isSendBacklogged() const
+{
+    const CoreProtocol &proto = d->mode == Client ? d->client : d->srv;
+    return d->ss && d->ss->bytesToWrite() + proto.outgoingDataSize() >= STREAM_SEND_BACKLOG;
 }
 
-void ClientStream::clearSendQueue() { d->client.clearSendQueue(); }
+/*
+ * With a budget, a congested link doesn't queue every state change. Once the held back stanzas are over it, an
+ * availability presence or a chat state without a body replaces the one still queued for the same recipient
+ * instead of queueing behind it. Everything else is still queued, so nothing the user wrote gets lost.
+ * 0 (the default) queues all.
+ */
+void ClientStream::setCongestionBudget(qint64 bytes) { d->congestionBudget = bytes; }
+
+qint64 ClientStream::parserMemory() const { return (d->mode == Client ? d->client : d->srv).bufferedBytes(); }
+
+qint64 ClientStream::smQueueMemory() const
+{
+    return (d->mode == Client ? d->client : d->srv).sm.state().send_queue.memoryUsage();
+}
+
+qint64 ClientStream::bufferMemory() const
+{
+    qint64 bytes = d->queuedBytes;
+    if (d->ss)
+        bytes += d->ss->bytesAvailable();
+    if (d->bs)
+        bytes += d->bs->bytesAvailable() + d->bs->bytesToWrite();
+    return bytes;
+}
+
+void ClientStream::queueStanza(const QByteArray &data, Stanza::Priority priority, const QString &supersedes)
+{
+    QList<Private::QueuedStanza> &queue = d->sendQueues[size_t(priority)];
+    if (!supersedes.isEmpty() && d->congestionBudget > 0 && d->queuedBytes >= d->congestionBudget) {
+        for (auto &item : queue) {
+            if (item.supersedes == supersedes) {
+                d->queuedBytes += data.size() - item.data.size();
+                item.data = data;
+                return;
+            }
+        }
+    }
+    queue.append({ data, supersedes });
+    ++d->queuedStanzas;
+    d->queuedBytes += data.size();
+}
+
+// hands the queued stanzas to the protocol, the most urgent class first, until there is a backlog again
+void ClientStream::writeQueued()
+{
+    QPointer<QObject> self = this;
+    while (d->queuedStanzas && d->state == Active && !isSendBacklogged()) {
+        auto queue = std::find_if(d->sendQueues.begin(), d->sendQueues.end(),
+                                  [](const QList<Private::QueuedStanza> &q) { return !q.isEmpty(); });
+        Private::QueuedStanza item = queue->takeFirst();
+        --d->queuedStanzas;
+        d->queuedBytes -= item.data.size();
+        d->client.sendStanzaData(item.data);
+        checkSMSendQueue();
+        if (!self)
+            return;
+        processNext();
+        if (!self)
+            return;
+    }
+}
 
 void ClientStream::cr_connected()
 {
@@ -543,11 +978,20 @@ void ClientStream::cr_connected()
     // d->client.startDialbackOut("andbit.net", "im.pyxa.org");
     // d->client.startServerOut(d->server);
 
-    d->client.startClientOut(d->jid, d->oldOnly, d->conn->useSSL(), d->doAuth, d->doCompress);
+    if (d->component)
+        d->client.startComponentOut(d->server, d->componentSecret);
+    else
+        d->client.startClientOut(d->jid, d->oldOnly, d->conn->useSSL(), d->doAuth, d->doCompress);
     d->client.setAllowTLS(d->tlsHandler != nullptr);
     d->client.setAllowBind(d->doBinding);
     d->client.setAllowPlain(d->allowPlain == AllowPlain || (d->allowPlain == AllowPlainOverTLS && d->conn->useSSL()));
     d->client.setLang(d->lang);
+    d->client.setAllowSASL2(d->doSASL2);
+    d->client.setBind2(d->bindTag, d->inlineCarbons);
+    d->client.setUserAgent(d->agentId, d->agentSoftware, d->agentDevice);
+    d->client.setRequestFastToken(d->requestFast);
+    if (!d->fastToken.isEmpty())
+        d->client.setFastToken(d->fastMech, d->fastToken, d->fastCount++);
 
     /*d->client.jid = d->jid;
     d->client.server = d->server;
@@ -567,6 +1011,9 @@ void ClientStream::cr_connected()
     if (d->conn->useSSL()) {
         d->using_tls = true;
         d->ss->startTLSClient(d->tlsHandler, d->server, spare);
+        // the stream header can go out with the ClientHello
+        if (d->tlsHandler && d->tlsHandler->acceptsEarlyData())
+            processNext();
     } else {
         d->client.addIncomingData(spare);
         processNext();
@@ -597,19 +1044,24 @@ void ClientStream::bs_error(int)
 
 void ClientStream::ss_readyRead()
 {
-    QByteArray a = d->ss->readAll();
-
+    d->lastTraffic.start();
+    if (d->noopProbing)
+        noopAnswered();
+
+    // the chunks are shared with the layers below, so nothing is copied until the xml reader gets them
+    const auto    chunks = d->ss->takeReadChunks();
+    CoreProtocol &proto  = d->mode == Client ? d->client : d->srv;
+    int           total  = 0;
+    for (auto const &a : chunks) {
 #ifdef XMPP_DEBUG
-    qDebug("ClientStream: recv: %d [%s]\n", a.size(), a.data());
+        qDebug("ClientStream: recv: %d [%s]\n", a.size(), a.data());
 #endif
-
-    if (d->mode == Client) {
-        d->client.addIncomingData(a);
-        d->client.sm.countInputRawData(a.size());
-    } else {
-        d->srv.addIncomingData(a);
-        d->srv.sm.countInputRawData(a.size());
+        if (d->recorder && d->mode == Client && d->state == Active)
+            d->recorder->record(StreamRecorder::Incoming, a);
+        proto.addIncomingData(a);
+        total += a.size();
     }
+    proto.sm.countInputRawData(total);
     if (d->notify & CoreProtocol::NRecv) {
 #ifdef XMPP_DEBUG
         qDebug("We needed data, so let's process it\n");
@@ -620,6 +1072,8 @@ void ClientStream::ss_readyRead()
 
 void ClientStream::ss_bytesWritten(qint64 bytes)
 {
+    // the keepalive's own bytes restart the countdown too
+    d->lastTraffic.start();
     if (d->mode == Client)
         d->client.outgoingDataWritten(int(bytes));
     else
@@ -629,8 +1083,13 @@ void ClientStream::ss_bytesWritten(qint64 bytes)
 #ifdef XMPP_DEBUG
         qDebug("We were waiting for data to be written, so let's process\n");
 #endif
+        QPointer<QObject> self = this;
         processNext();
+        if (!self)
+            return;
     }
+    if (d->queuedStanzas)
+        writeQueued();
 }
 
 void ClientStream::ss_tlsHandshaken()
@@ -734,7 +1193,7 @@ void ClientStream::sasl_error()
 #endif
     // has to be auth error
     int x      = convertedSASLCond();
-    d->errText = tr("Offered mechanisms: ") + d->client.features.sasl_mechs.join(", ");
+    d->errText = tr("Offered mechanisms: ") + d->client.offeredSASLMechs().join(", ");
     reset();
     d->errCond = x;
     emit error(ErrAuth);
@@ -860,30 +1319,49 @@ void ClientStream::srvProcessNext()
 void ClientStream::doReadyRead()
 {
     // QGuardedPtr<QObject> self = this;
-    if (isActive())
+    if (isActive() && !d->in.isEmpty())
         emit readyRead();
     // if(!self)
     //    return;
     // d->in_rrsig = false;
 }
 
+void ClientStream::doReadMore()
+{
+    QPointer<QObject> self = this;
+    doReadyRead();
+    if (self)
+        processNext();
+}
+
 void ClientStream::processNext()
 {
+    IRIS_STALL_WATCH(Stream, QString());
     if (d->mode == Server) {
         srvProcessNext();
         return;
     }
 
-    QPointer<QObject> self = this;
+    QPointer<QObject> self    = this;
+    int               stanzas = 0;
+    QElapsedTimer     spent;
+    if (d->readMaxMsecs)
+        spent.start();
+    // the stanzas of this round share a document, see setBatchDocuments()
+    d->client.startBatch();
 
     while (1) {
 #ifdef XMPP_DEBUG
         qDebug("Processing step...\n");
 #endif
+        // nothing is recorded, and no stanza stringified, for a direction nobody listens to
+        const bool observeSent = isSignalConnected(QMetaMethod::fromSignal(&ClientStream::outgoingXml));
+        const bool observeRecv = isSignalConnected(QMetaMethod::fromSignal(&ClientStream::incomingXml));
+        d->client.setTransfersObserved(observeSent, observeRecv);
         bool ok = d->client.processStep();
         // deal with send/received items
         for (const XmlProtocol::TransferItem &i : std::as_const(d->client.transferItemList)) {
-            if (i.isExternal)
+            if (i.isExternal || !(i.isSent ? observeSent : observeRecv))
                 continue;
             QString str;
             if (i.isString) {
@@ -941,6 +1419,16 @@ void ClientStream::processNext()
             return;
         }
         case CoreProtocol::ESend: {
+            if (d->coalesceWrites && d->state == Active) {
+                QByteArray a = d->client.takeOutgoingUrgentData();
+                if (!a.isEmpty())
+                    writeOut(a);
+                if (d->client.outgoingDataSize() >= d->coalesceMaxBytes)
+                    flushOutgoing();
+                else if (d->client.outgoingDataSize() > 0 && !d->flushTimer.isActive())
+                    d->flushTimer.start();
+                break;
+            }
             while (true) {
                 QByteArray a = d->client.takeOutgoingData();
                 if (a.isEmpty())
@@ -948,7 +1436,7 @@ void ClientStream::processNext()
 #ifdef XMPP_DEBUG
                 qDebug("Need Send: {%s}\n", a.data());
 #endif
-                d->ss->write(a);
+                writeOut(a);
             }
             break;
         }
@@ -1000,8 +1488,31 @@ void ClientStream::processNext()
             // grab the JID, in case it changed
             d->jid   = d->client.jid();
             d->state = Active;
-            setNoopTime(d->noop_time);
-            if (!d->quiet_reconnection)
+            if (d->recorder)
+                d->recorder->start(d->jid);
+            // a new token, or the one used was rejected
+            if (d->client.fastToken != d->fastToken) {
+                d->fastMech  = d->client.fastMechanism;
+                d->fastToken = d->client.fastToken;
+                d->fastCount = 0;
+                emit fastTokenChanged(d->fastMech, d->fastToken, d->client.fastExpiry);
+                if (!self)
+                    return;
+            }
+            d->lastTraffic.start();
+            startNoop();
+            if (d->handingOver) {
+                d->handingOver        = false;
+                d->handoverFrom       = nullptr;
+                d->quiet_reconnection = false;
+                // e.g. this server has no stream management. the old one was left alone then
+                if (!d->client.sm.isResumed()) {
+                    reset();
+                    emit error(ErrSmResume);
+                    return;
+                }
+                emit handedOver();
+            } else if (!d->quiet_reconnection)
                 emit authenticated();
             if (!self)
                 return;
@@ -1021,12 +1532,19 @@ void ClientStream::processNext()
 #endif
             // store the stanza for now, announce after processing all events
             // TODO: add a method to the stanza to mark them handled.
-            Stanza s = createStanza(d->client.recvStanza());
+            Stanza s = createStanza(d->client.recvStanza(), d->client.batchDocument());
             if (s.isNull())
                 break;
             if (d->client.sm.isActive())
                 d->client.sm.markStanzaHandled();
             d->in.append(new Stanza(s));
+            ++stanzas;
+            if ((d->readMaxStanzas && stanzas >= d->readMaxStanzas)
+                || (d->readMaxMsecs && spent.elapsed() >= d->readMaxMsecs)) {
+                // the budget is spent. these are announced first, then the parsing goes on
+                d->readTimer.start();
+                return;
+            }
             break;
         }
         case CoreProtocol::EStanzaSent: {
@@ -1052,6 +1570,11 @@ void ClientStream::processNext()
             qDebug() << "Stream Management: [INF] Received ack amount: " << ack_cnt;
 #endif
             emit stanzasAcked(ack_cnt);
+            if (!self)
+                return;
+            checkSMSendQueue();
+            if (!self)
+                return;
             break;
         }
         case CoreProtocol::ESMConnTimeout: {
@@ -1114,7 +1637,10 @@ bool ClientStream::handleNeed()
 #ifdef XMPP_DEBUG
         qDebug("Need compress\n");
 #endif
-        d->ss->setLayerCompress(d->client.spare);
+        auto handler = new CompressionHandler(d->client.compressMethod);
+        if (d->compressLinkSpeed > 0)
+            handler->setLinkSpeed(d->compressLinkSpeed);
+        d->ss->setLayerCompress(d->client.spare, handler);
         return true;
     }
     case CoreProtocol::NSASLFirst: {
@@ -1148,7 +1674,8 @@ bool ClientStream::handleNeed()
         else {
             QMap<int, QString> prefOrdered;
             QStringList        unpreferred;
-            for (auto const &m : std::as_const(d->client.features.sasl_mechs)) {
+            const QStringList  offered = d->client.offeredSASLMechs();
+            for (auto const &m : offered) {
                 int i = preference.indexOf(m);
                 if (i != -1) {
                     prefOrdered.insert(i, m);
@@ -1266,13 +1793,31 @@ void ClientStream::sm_timeout()
 
 void ClientStream::doNoop()
 {
-    if (d->state == Active) {
+    if (d->state != Active || d->noopCurrent == 0)
+        return;
+
+    const qint64 idle = d->lastTraffic.isValid() ? d->lastTraffic.elapsed() : qint64(d->noopCurrent);
+    if (idle < d->noopCurrent) {
+        armNoop(int(d->noopCurrent - idle));
+        return;
+    }
 #ifdef XMPP_DEBUG
-        qDebug("doPing\n");
+    qDebug("doPing\n");
 #endif
+    // with stream management the server has to answer, so a dead link shows up within the ack timeout
+    QByteArray r = d->client.sm.isActive() ? d->client.sm.generateRequest() : QByteArray();
+    if (r.isEmpty()) {
         d->client.sendWhitespace();
-        processNext();
+    } else {
+        d->client.sendDirect(QString::fromUtf8(r));
+        setTimer(d->client.sm.timerInterval());
     }
+    d->noopProbing = d->noopMax > 0;
+    QPointer<QObject> self = this;
+    processNext();
+    if (!self)
+        return;
+    armNoop(d->noopCurrent);
 }
 
 void ClientStream::writeDirect(const QString &s)
@@ -1510,6 +2055,77 @@ bool ClientStream::isResumed() const { return d->client.sm.isResumed(); }
 
 void ClientStream::setSMEnabled(bool e) { d->client.sm.state().setEnabled(e); }
 
+QByteArray ClientStream::saveSMState() const { return d->client.sm.state().save(); }
+
+bool ClientStream::restoreSMState(const QByteArray &data) { return d->client.sm.state().restore(data); }
+
+bool ClientStream::takeOver(ClientStream *old)
+{
+    if (!old || old == this || !old->isResumable())
+        return false;
+
+    // the resumption id decides how to log in already. the rest is taken when <resume/> goes out
+    d->client.sm.state().restore(old->saveSMState());
+    d->handoverFrom       = old;
+    d->handingOver        = true;
+    d->quiet_reconnection = true;
+    return true;
+}
+
+bool ClientStream::isResumable() const
+{
+    return d->mode == Client && d->client.sm.isActive() && d->client.sm.state().isResumption();
+}
+
+bool ClientStream::isTakenOver() const { return d->handoverTo; }
+
+void ClientStream::takeOverSession()
+{
+    ClientStream *old = d->handoverFrom;
+    d->handoverFrom   = nullptr;
+    if (!old)
+        return;
+
+    // the server drops the old connection once the session is resumed anyway. what it has read so far stays
+    // there to be read, what it got after that comes again here. its held back stanzas become unacked ones
+    old->reset();
+    old->d->timeout_timer.stop();
+    old->d->handoverTo = this;
+    d->client.sm.state().restore(old->saveSMState());
+}
+
+void ClientStream::writeTakenOver(const QByteArray &data)
+{
+    if (d->state != Active) {
+        // sent with the unacked ones once the session is resumed
+        d->client.sm.addUnacknowledgedStanza(data);
+        return;
+    }
+    d->client.sendStanzaData(data);
+    QPointer<QObject> self = this;
+    checkSMSendQueue();
+    if (!self)
+        return;
+    processNext();
+}
+
+void ClientStream::setSMSendQueueLimit(qint64 bytes)
+{
+    d->client.sm.setSendQueueLimit(bytes);
+    checkSMSendQueue();
+}
+
+void ClientStream::setSMAckWindow(int stanzas, qint64 bytes) { d->client.sm.setAckWindow(stanzas, bytes); }
+
+void ClientStream::checkSMSendQueue()
+{
+    bool full = d->client.sm.isSendQueueFull();
+    if (full != d->smQueueFull) {
+        d->smQueueFull = full;
+        emit smSendQueueFull(full);
+    }
+}
+
 void ClientStream::setTimer(int secs)
 {
     d->timeout_timer.setSingleShot(true);
@@ -0,0 +1,432 @@
+/*
+ * streamrecorder.cpp - recording the traffic of a session and replaying it
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "streamrecorder.h"
+
+#include "bytestream.h"
+#include "xmpp.h"
+#include "xmpp/xmpp-im/xmpp_client.h"
+#include "xmpp_clientstream.h"
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QPointer>
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <QTimer>
+#include <QtEndian>
+
+#include <climits>
+
+// the file starts with this and the version byte
+#define RECORDING_MAGIC "IRISREC"
+#define RECORDING_VERSION 1
+
+// records collected before they are compressed and written
+#define RECORDING_BLOCK 65536
+
+// hex digits of the hash a pseudonym is made of
+#define PSEUDONYM_LENGTH 10
+
+namespace XMPP {
+namespace {
+    // a record is the type, the usecs since the previous one, the size and the data, big endian
+    enum RecordType : quint8 { StartRecord, IncomingRecord, OutgoingRecord };
+
+    void putU32(QByteArray &to, quint32 v)
+    {
+        char buf[4];
+        qToBigEndian(v, buf);
+        to.append(buf, 4);
+    }
+
+    quint32 getU32(const char *p) { return qFromBigEndian<quint32>(p); }
+
+    class ReplayByteStream : public ByteStream {
+    public:
+        ReplayByteStream(QObject *parent) : ByteStream(parent) { setOpenMode(QIODevice::ReadWrite); }
+
+        void feed(const QByteArray &data)
+        {
+            appendRead(data);
+            emit readyRead();
+        }
+
+    protected:
+        // nobody is there to read it
+        int tryWrite() override
+        {
+            int n = int(takeWrite().size());
+            QMetaObject::invokeMethod(this, [this, n]() { emit bytesWritten(n); }, Qt::QueuedConnection);
+            return n;
+        }
+    };
+
+    class ReplayConnector : public Connector {
+    public:
+        ReplayByteStream *bs;
+        QByteArray        greeting; // from the server, right after connecting
+
+        ReplayConnector(QObject *parent) : Connector(parent) { bs = new ReplayByteStream(this); }
+
+        void setOptHostPort(const QString &, quint16) override { }
+        void connectToServer(const QString &) override
+        {
+            QTimer::singleShot(0, this, [this]() {
+                emit connected();
+                bs->feed(greeting);
+            });
+        }
+        ByteStream *stream() const override { return bs; }
+        void        done() override { }
+    };
+} // namespace
+
+class StreamRecorder::Private {
+public:
+    QFile                         file;
+    QString                       error;
+    bool                          anonymize = false;
+    bool                          started   = false;
+    QByteArray                    salt; // of the pseudonyms, new for each file
+    QHash<QByteArray, QByteArray> pseudonyms;
+    QElapsedTimer                 clock;
+    qint64                        last = 0; // usecs of the previous record
+    QByteArray                    block;    // records not written yet
+    QByteArray                    carry[2]; // of each direction, a tag not complete yet. it may hold a jid
+
+    void append(RecordType type, const QByteArray &data)
+    {
+        qint64 now = clock.nsecsElapsed() / 1000;
+        block.append(char(type));
+        putU32(block, quint32(qBound<qint64>(0, now - last, UINT_MAX)));
+        putU32(block, quint32(data.size()));
+        block.append(data);
+        last = now;
+        if (block.size() >= RECORDING_BLOCK)
+            flush();
+    }
+
+    void flush()
+    {
+        if (block.isEmpty() || !error.isEmpty())
+            return;
+        QByteArray z = qCompress(block);
+        QByteArray head;
+        putU32(head, quint32(z.size()));
+        block.clear();
+        if (file.write(head) != head.size() || file.write(z) != z.size())
+            error = file.errorString();
+    }
+
+    QByteArray hashed(const QByteArray &part) const
+    {
+        return QCryptographicHash::hash(salt + part, QCryptographicHash::Sha256).toHex().left(PSEUDONYM_LENGTH);
+    }
+
+    // node and domain are hashed case-insensitively, like they compare
+    QByteArray pseudonym(const QByteArray &jid)
+    {
+        if (jid.isEmpty())
+            return jid;
+        auto it = pseudonyms.constFind(jid);
+        if (it != pseudonyms.constEnd())
+            return *it;
+
+        int        slash = int(jid.indexOf('/'));
+        QByteArray bare  = slash == -1 ? jid : jid.left(slash);
+        int        at    = int(bare.indexOf('@'));
+        QByteArray ret;
+        if (at != -1)
+            ret += 'u' + hashed(bare.left(at).toLower()) + '@';
+        ret += 'd' + hashed(bare.mid(at + 1).toLower()) + ".example";
+        if (slash != -1)
+            ret += "/r" + hashed(jid.mid(slash + 1));
+        pseudonyms.insert(jid, ret);
+        return ret;
+    }
+
+    // latin1, so the bytes come back as they were, utf-8 or not
+    QByteArray anonymized(const QByteArray &data)
+    {
+        static const QRegularExpression re(QStringLiteral("(\\s(?:from|to|jid)\\s*=\\s*)(['\"])([^'\"<>]*)\\2"));
+
+        const QString s  = QString::fromLatin1(data);
+        auto          it = re.globalMatch(s);
+        if (!it.hasNext())
+            return data;
+
+        QByteArray ret;
+        int        at = 0;
+        while (it.hasNext()) {
+            auto m = it.next();
+            ret += data.mid(at, int(m.capturedStart(3)) - at);
+            ret += pseudonym(m.captured(3).toLatin1());
+            at = int(m.capturedEnd(3));
+        }
+        ret += data.mid(at);
+        return ret;
+    }
+};
+
+StreamRecorder::StreamRecorder() : d(new Private) { }
+
+StreamRecorder::~StreamRecorder() { close(); }
+
+bool StreamRecorder::open(const QString &fileName)
+{
+    close();
+    d->error.clear();
+    d->file.setFileName(fileName);
+    if (!d->file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        d->error = d->file.errorString();
+        return false;
+    }
+    QByteArray head(RECORDING_MAGIC);
+    head.append(char(RECORDING_VERSION));
+    d->file.write(head);
+
+    d->salt.clear();
+    for (int n = 0; n < 2; ++n) {
+        char buf[8];
+        qToBigEndian(QRandomGenerator::global()->generate64(), buf);
+        d->salt.append(buf, 8);
+    }
+    d->pseudonyms.clear();
+    d->started = false;
+    d->last    = 0;
+    d->clock.start();
+    return true;
+}
+
+void StreamRecorder::close()
+{
+    if (!d->file.isOpen())
+        return;
+
+    for (int n = 0; n < 2; ++n) {
+        if (!d->carry[n].isEmpty())
+            d->append(n == Incoming ? IncomingRecord : OutgoingRecord, d->anonymized(d->carry[n]));
+        d->carry[n].clear();
+    }
+    d->flush();
+    if (!d->file.flush() && d->error.isEmpty())
+        d->error = d->file.errorString();
+    d->file.close();
+    d->started = false;
+}
+
+bool StreamRecorder::isOpen() const { return d->file.isOpen(); }
+
+QString StreamRecorder::errorString() const { return d->error; }
+
+void StreamRecorder::setAnonymizeJids(bool enabled) { d->anonymize = enabled; }
+
+void StreamRecorder::start(const Jid &jid)
+{
+    if (!d->file.isOpen() || d->started)
+        return;
+
+    d->started   = true;
+    QByteArray j = jid.full().toUtf8();
+    d->append(StartRecord, d->anonymize ? d->pseudonym(j) : j);
+}
+
+void StreamRecorder::record(Direction direction, const QByteArray &data)
+{
+    if (!d->started || data.isEmpty())
+        return;
+
+    RecordType type = direction == Incoming ? IncomingRecord : OutgoingRecord;
+    if (!d->anonymize) {
+        d->append(type, data);
+        return;
+    }
+
+    // an unfinished tag waits for the rest, the attribute may be split
+    QByteArray &carry = d->carry[direction];
+    QByteArray  buf   = carry + data;
+    int         lt    = int(buf.lastIndexOf('<'));
+    int         cut   = lt != -1 && buf.indexOf('>', lt) == -1 ? lt : int(buf.size());
+    carry             = buf.mid(cut);
+    if (cut > 0)
+        d->append(type, d->anonymized(buf.left(cut)));
+}
+
+bool StreamRecorder::load(const QString &fileName, Jid *jid, QList<Chunk> *chunks, QString *errorString)
+{
+    auto fail = [errorString](const QString &s) {
+        if (errorString)
+            *errorString = s;
+        return false;
+    };
+
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly))
+        return fail(f.errorString());
+    const QByteArray data  = f.readAll();
+    const QByteArray magic = RECORDING_MAGIC;
+    if (!data.startsWith(magic) || data.size() <= magic.size())
+        return fail(QStringLiteral("not a recording"));
+    if (quint8(data[magic.size()]) != RECORDING_VERSION)
+        return fail(QStringLiteral("unknown version of a recording"));
+
+    bool   started = false;
+    qint64 usecs   = 0;
+    chunks->clear();
+    // a block cut short, e.g. by a crash, ends it
+    for (int pos = int(magic.size()) + 1; pos + 4 <= data.size();) {
+        int len = int(getU32(data.constData() + pos));
+        pos += 4;
+        if (len <= 0 || pos + len > data.size())
+            break;
+        const QByteArray block = qUncompress(reinterpret_cast<const uchar *>(data.constData() + pos), len);
+        pos += len;
+        if (block.isEmpty())
+            return fail(QStringLiteral("corrupt recording"));
+
+        for (int at = 0; at + 9 <= block.size();) {
+            auto type = RecordType(quint8(block[at]));
+            usecs += getU32(block.constData() + at + 1);
+            int size = int(getU32(block.constData() + at + 5));
+            at += 9;
+            if (size < 0 || at + size > block.size())
+                return fail(QStringLiteral("corrupt recording"));
+            QByteArray payload = block.mid(at, size);
+            at += size;
+
+            if (type == StartRecord) {
+                if (!started && jid)
+                    *jid = Jid(QString::fromUtf8(payload));
+                if (!started)
+                    usecs = 0;
+                started = true;
+            } else if (started) {
+                *chunks += Chunk { type == IncomingRecord ? Incoming : Outgoing, usecs, payload };
+            }
+        }
+    }
+    if (!started)
+        return fail(QStringLiteral("empty recording"));
+    return true;
+}
+
+class StreamReplayer::Private : public QObject {
+    Q_OBJECT
+
+public:
+    StreamReplayer              *q;
+    QString                      error;
+    Jid                          jid;
+    QList<StreamRecorder::Chunk> chunks; // the incoming ones
+    qint64                       bytes    = 0;
+    bool                         realTime = false;
+    QPointer<Client>             client;
+    ReplayConnector             *conn   = nullptr;
+    ClientStream                *stream = nullptr;
+    int                          next   = 0;
+    QElapsedTimer                clock; // since the first chunk
+    QTimer                       timer;
+
+    Private(StreamReplayer *_q) : QObject(_q), q(_q)
+    {
+        timer.setSingleShot(true);
+        timer.setTimerType(Qt::PreciseTimer);
+        connect(&timer, &QTimer::timeout, this, &Private::feed);
+    }
+
+    void schedule()
+    {
+        if (next >= chunks.size()) {
+            emit q->finished();
+            return;
+        }
+        qint64 wait = realTime ? (chunks[next].usecs - chunks[0].usecs) / 1000 - clock.elapsed() : 0;
+        timer.start(int(qBound<qint64>(0, wait, INT_MAX)));
+    }
+
+    void feed()
+    {
+        if (next == 0)
+            clock.start();
+        conn->bs->feed(chunks[next++].data);
+        schedule();
+    }
+
+    void authenticated()
+    {
+        if (client)
+            client->start(jid.domain(), jid.node(), QString(), jid.resource());
+        next = 0;
+        schedule();
+    }
+};
+
+StreamReplayer::StreamReplayer(QObject *parent) : QObject(parent) { d = new Private(this); }
+
+StreamReplayer::~StreamReplayer() { delete d; }
+
+bool StreamReplayer::load(const QString &fileName)
+{
+    QList<StreamRecorder::Chunk> all;
+    if (!StreamRecorder::load(fileName, &d->jid, &all, &d->error))
+        return false;
+
+    d->chunks.clear();
+    d->bytes = 0;
+    for (auto const &c : std::as_const(all)) {
+        if (c.direction == StreamRecorder::Incoming) {
+            d->chunks += c;
+            d->bytes += c.data.size();
+        }
+    }
+    return true;
+}
+
+QString StreamReplayer::errorString() const { return d->error; }
+
+Jid StreamReplayer::jid() const { return d->jid; }
+
+qint64 StreamReplayer::incomingBytes() const { return d->bytes; }
+
+void StreamReplayer::setRealTime(bool enabled) { d->realTime = enabled; }
+
+void StreamReplayer::start(Client *client)
+{
+    d->timer.stop();
+    d->client = client;
+    d->conn   = new ReplayConnector(d);
+    d->conn->greeting = "<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+                        "xmlns:stream='http://etherx.jabber.org/streams' from='"
+        + d->jid.domain().toUtf8() + "' id='replay' version='1.0'><stream:features/>";
+    d->stream = new ClientStream(d->conn, nullptr, d);
+
+    // no TLS is offered, which is fine here
+    connect(d->stream, &ClientStream::warning, d->stream, &ClientStream::continueAfterWarning);
+    connect(d->stream, &ClientStream::authenticated, d, &Private::authenticated);
+    client->connectToServer(d->stream, d->jid, false);
+}
+
+ClientStream *StreamReplayer::stream() const { return d->stream; }
+
+} // namespace XMPP
+
+#include "streamrecorder.moc"
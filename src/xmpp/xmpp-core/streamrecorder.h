@@ -0,0 +1,110 @@
+/*
+ * streamrecorder.h - recording the traffic of a session and replaying it
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_STREAMRECORDER_H
+#define XMPP_STREAMRECORDER_H
+
+#include "xmpp/jid/jid.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QObject>
+
+#include <memory>
+
+namespace XMPP {
+class Client;
+class ClientStream;
+
+/*
+ * What a ClientStream reads and writes once it's logged in, after TLS and compression, with the time of each
+ * read and write, see ClientStream::setRecorder(). Nothing before the login is recorded, so the credentials
+ * never end up in the file. The chunks are compressed in blocks of 64 KiB, the last block is written by close().
+ * A reconnection with the same recorder goes on in the same file, a resumed session is still one recording.
+ * Meant for perf corpora of real sessions, see StreamReplayer.
+ */
+class StreamRecorder {
+public:
+    enum Direction { Incoming, Outgoing };
+
+    struct Chunk {
+        Direction  direction;
+        qint64     usecs; // since the login
+        QByteArray data;
+    };
+
+    StreamRecorder();
+    ~StreamRecorder(); // closes it
+
+    bool    open(const QString &fileName); // truncates it
+    void    close();
+    bool    isOpen() const;
+    QString errorString() const;
+
+    // before open(). the values of the from, to and jid attributes are replaced by pseudonyms, the same part
+    //   of a jid gets the same one within a file. the rest, e.g. the message bodies, is kept as it is
+    void setAnonymizeJids(bool);
+
+    // by ClientStream
+    void start(const Jid &jid); // logged in as jid. nothing is recorded before
+    void record(Direction direction, const QByteArray &data);
+
+    // the chunks of a recording and the jid it starts with. false if fileName isn't one
+    static bool load(const QString &fileName, Jid *jid, QList<Chunk> *chunks, QString *errorString = nullptr);
+
+private:
+    class Private;
+    std::unique_ptr<Private> d;
+};
+
+/*
+ * Feeds a recording into a Client as if a server sent it, through a ClientStream over a stream in memory and
+ * everything above it. The login is skipped: a stream header and empty features are made up, and the stream
+ * is connected without auth. What the client writes is dropped. As fast as the event loop takes it by default.
+ */
+class StreamReplayer : public QObject {
+    Q_OBJECT
+public:
+    StreamReplayer(QObject *parent = nullptr);
+    ~StreamReplayer() override;
+
+    bool    load(const QString &fileName);
+    QString errorString() const;
+    Jid     jid() const;           // of the recorded session, a pseudonym if it's anonymized
+    qint64  incomingBytes() const; // what is fed
+
+    // with the recorded gaps between the reads
+    void setRealTime(bool);
+
+    // connects client to a stream of its own and starts it once it's logged in. finished() when the last
+    //   chunk is read
+    void          start(Client *client);
+    ClientStream *stream() const;
+
+signals:
+    void finished();
+
+private:
+    class Private;
+    friend class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // XMPP_STREAMRECORDER_H
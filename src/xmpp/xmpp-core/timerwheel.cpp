@@ -0,0 +1,119 @@
+/*
+ * timerwheel.cpp - one timer for many periodic jobs
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "timerwheel.h"
+
+#include <QHash>
+#include <QPair>
+#include <QTimer>
+#include <QVector>
+
+// one turn of the wheel. longer intervals take more turns
+#define TIMERWHEEL_SLOTS 256
+
+using namespace XMPP;
+
+class TimerWheel::Private {
+public:
+    struct Entry {
+        quint64                 id;
+        int                     ticks;
+        int                     rounds;
+        std::function<void()>   callback;
+        QMetaObject::Connection destroyed;
+    };
+    using SlotItem = QPair<QObject *, quint64>; // stopped jobs stay in their slot and are skipped by id
+
+    int                      granularity;
+    QTimer                   timer;
+    QHash<QObject *, Entry>  entries;
+    QVector<QList<SlotItem>> wheel;
+    int                      current = 0;
+    quint64                  nextId  = 0;
+
+    void schedule(QObject *receiver, Entry &e)
+    {
+        int slot = (current + e.ticks) % TIMERWHEEL_SLOTS;
+        e.rounds = (e.ticks - 1) / TIMERWHEEL_SLOTS;
+        wheel[slot].append({ receiver, e.id });
+    }
+};
+
+TimerWheel::TimerWheel(int granularity, QObject *parent) : QObject(parent), d(new Private)
+{
+    d->granularity = qMax(1, granularity);
+    d->wheel.resize(TIMERWHEEL_SLOTS);
+    d->timer.setInterval(d->granularity);
+    connect(&d->timer, &QTimer::timeout, this, [this]() {
+        d->current = (d->current + 1) % TIMERWHEEL_SLOTS;
+        const QList<Private::SlotItem> due = std::move(d->wheel[d->current]);
+        d->wheel[d->current].clear();
+        for (const auto &item : due) {
+            auto it = d->entries.find(item.first);
+            if (it == d->entries.end() || it->id != item.second)
+                continue;
+            if (it->rounds > 0) {
+                --it->rounds;
+                d->wheel[d->current].append(item);
+                continue;
+            }
+            d->schedule(item.first, *it);
+            auto callback = it->callback; // it may stop or restart itself
+            callback();
+        }
+        if (d->entries.isEmpty())
+            d->timer.stop();
+    });
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (const auto &e : std::as_const(d->entries))
+        disconnect(e.destroyed);
+    delete d;
+}
+
+int TimerWheel::granularity() const { return d->granularity; }
+
+void TimerWheel::start(QObject *receiver, int msecs, std::function<void()> &&callback)
+{
+    stop(receiver);
+    Private::Entry &e = d->entries[receiver];
+    e.id              = d->nextId++;
+    e.ticks           = qMax(1, (msecs + d->granularity - 1) / d->granularity);
+    e.callback        = std::move(callback);
+    e.destroyed       = connect(receiver, &QObject::destroyed, this,
+                                    [this, receiver]() { d->entries.remove(receiver); });
+    d->schedule(receiver, e);
+    if (!d->timer.isActive())
+        d->timer.start();
+}
+
+void TimerWheel::stop(QObject *receiver)
+{
+    auto it = d->entries.find(receiver);
+    if (it == d->entries.end())
+        return;
+    disconnect(it->destroyed);
+    d->entries.erase(it);
+}
+
+bool TimerWheel::isActive(QObject *receiver) const { return d->entries.contains(receiver); }
+
+int TimerWheel::count() const { return d->entries.size(); }
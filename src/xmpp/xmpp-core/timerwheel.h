@@ -0,0 +1,55 @@
+/*
+ * timerwheel.h - one timer for many periodic jobs
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_TIMERWHEEL_H
+#define XMPP_TIMERWHEEL_H
+
+#include <QObject>
+
+#include <functional>
+
+#define TIMERWHEEL_GRANULARITY 1000
+
+namespace XMPP {
+/*
+ * Periodic jobs of many objects on one QTimer, e.g. the keepalives of a lot of streams. The intervals are
+ * rounded up to the granularity and the jobs due within the same tick run together. Starting, stopping and
+ * running a job costs the same however many there are.
+ */
+class TimerWheel : public QObject {
+    Q_OBJECT
+public:
+    TimerWheel(int granularity = TIMERWHEEL_GRANULARITY, QObject *parent = nullptr);
+    ~TimerWheel();
+
+    int granularity() const;
+
+    // one job per receiver, starting it again restarts the countdown. it's stopped when the receiver is destroyed
+    void start(QObject *receiver, int msecs, std::function<void()> &&callback);
+    void stop(QObject *receiver);
+    bool isActive(QObject *receiver) const;
+    int  count() const;
+
+private:
+    class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // XMPP_TIMERWHEEL_H
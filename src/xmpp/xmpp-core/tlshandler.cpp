@@ -17,10 +17,14 @@
  *
  */
 
+#include "handshakepool.h"
 #include "qca.h"
 #include "xmpp.h"
 
+#include <QCache>
+#include <QMutex>
 #include <QRegularExpression>
+#include <QSet>
 #include <QTimer>
 #include <QUrl>
 
@@ -301,6 +305,134 @@ TLSHandler::TLSHandler(QObject *parent) : QObject(parent) { }
 
 TLSHandler::~TLSHandler() { }
 
+bool TLSHandler::isSessionResumed() const { return false; }
+
+bool TLSHandler::acceptsEarlyData() const { return false; }
+
+void TLSHandler::setHandshakeThreads(int count) { HandshakePool::setMaxThreads(count); }
+
+int TLSHandler::handshakeThreads() { return HandshakePool::maxThreads(); }
+
+//----------------------------------------------------------------------------
+// TLSSessionCache
+//----------------------------------------------------------------------------
+// Sessions of the last handshakes per server host, so reconnects can resume them instead of doing
+// the full handshake again. Shared by all the streams of the process, hence the lock.
+class TLSSessionCache {
+public:
+    static const int MaxSize = 64;
+
+    static bool lookup(const QString &host, QCA::TLSSession &out)
+    {
+        TLSSessionCache &c = instance();
+        QMutexLocker     locker(&c.mutex);
+        auto            *s = c.cache.object(host);
+        if (!s)
+            return false;
+        out = *s;
+        return true;
+    }
+
+    static void insert(const QString &host, const QCA::TLSSession &session)
+    {
+        TLSSessionCache &c = instance();
+        QMutexLocker     locker(&c.mutex);
+        c.cache.insert(host, new QCA::TLSSession(session));
+    }
+
+    static void remove(const QString &host)
+    {
+        TLSSessionCache &c = instance();
+        QMutexLocker     locker(&c.mutex);
+        c.cache.remove(host);
+    }
+
+private:
+    QMutex                           mutex;
+    QCache<QString, QCA::TLSSession> cache { MaxSize };
+
+    static TLSSessionCache &instance()
+    {
+        static TLSSessionCache c;
+        return c;
+    }
+};
+
+//----------------------------------------------------------------------------
+// TLSHandshakeGate
+//----------------------------------------------------------------------------
+// Full handshakes are what costs the CPU time of a connect. When the streams of a process come back all at
+// once, e.g. after an outage, only so many of them handshake at the same time and the others wait in line.
+class TLSHandshakeGate {
+public:
+    static void setLimit(int max)
+    {
+        TLSHandshakeGate &g = instance();
+        QMutexLocker      locker(&g.mutex);
+        g.max = max;
+        g.startWaiting();
+    }
+
+    static int limit()
+    {
+        TLSHandshakeGate &g = instance();
+        QMutexLocker      locker(&g.mutex);
+        return g.max;
+    }
+
+    // true if h may go ahead now. otherwise its gate_entered() slot is invoked once it's its turn
+    static bool enter(QCATLSHandler *h)
+    {
+        TLSHandshakeGate &g = instance();
+        QMutexLocker      locker(&g.mutex);
+        if (g.max > 0 && g.inside.size() >= g.max) {
+            g.waiting += h;
+            return false;
+        }
+        g.inside += h;
+        return true;
+    }
+
+    static bool isInside(QCATLSHandler *h)
+    {
+        TLSHandshakeGate &g = instance();
+        QMutexLocker      locker(&g.mutex);
+        return g.inside.contains(h);
+    }
+
+    // the handshake of h is over, or h gave up on it
+    static void leave(QCATLSHandler *h)
+    {
+        TLSHandshakeGate &g = instance();
+        QMutexLocker      locker(&g.mutex);
+        g.waiting.removeAll(h);
+        if (g.inside.remove(h))
+            g.startWaiting();
+    }
+
+private:
+    QMutex                 mutex;
+    int                    max = 0;
+    QSet<QCATLSHandler *>  inside;
+    QList<QCATLSHandler *> waiting;
+
+    // with the lock held. the handlers may live in other threads, but can't get deleted before they leave()
+    void startWaiting()
+    {
+        while (!waiting.isEmpty() && (max <= 0 || inside.size() < max)) {
+            QCATLSHandler *h = waiting.takeFirst();
+            inside += h;
+            QMetaObject::invokeMethod(h, "gate_entered", Qt::QueuedConnection);
+        }
+    }
+
+    static TLSHandshakeGate &instance()
+    {
+        static TLSHandshakeGate g;
+        return g;
+    }
+};
+
 //----------------------------------------------------------------------------
 // QCATLSHandler
 //----------------------------------------------------------------------------
@@ -309,7 +441,12 @@ public:
     QCA::TLS *tls;
     int       state, err;
     QString   host;
+    QString   startHost;   // what to give to the tls, for when the gate lets us in
+    QString   sessionHost; // key of the session cache, empty if resumption is off
     bool      internalHostMatch;
+    bool      sessionResumption;
+    bool      gated   = false; // in the handshake gate, or waiting for it
+    bool      started = false; // the tls got startClient() for this handshake
 };
 
 QCATLSHandler::QCATLSHandler(QCA::TLS *parent) : TLSHandler(parent)
@@ -324,9 +461,18 @@ QCATLSHandler::QCATLSHandler(QCA::TLS *parent) : TLSHandler(parent)
     d->state             = 0;
     d->err               = -1;
     d->internalHostMatch = false;
+    d->sessionResumption = true;
 }
 
-QCATLSHandler::~QCATLSHandler() { delete d; }
+QCATLSHandler::~QCATLSHandler()
+{
+    leaveGate();
+    delete d;
+}
+
+void QCATLSHandler::setMaxConcurrentHandshakes(int max) { TLSHandshakeGate::setLimit(max); }
+
+int QCATLSHandler::maxConcurrentHandshakes() { return TLSHandshakeGate::limit(); }
 
 void QCATLSHandler::setXMPPCertCheck(bool enable) { d->internalHostMatch = enable; }
 bool QCATLSHandler::XMPPCertCheck() { return d->internalHostMatch; }
@@ -350,23 +496,58 @@ bool QCATLSHandler::certMatchesHostname()
     return false;
 }
 
+void QCATLSHandler::setSessionResumption(bool enable) { d->sessionResumption = enable; }
+
+bool QCATLSHandler::isSessionResumed() const { return d->state >= 2 && d->tls->isSessionReused(); }
+
 QCA::TLS *QCATLSHandler::tls() const { return d->tls; }
 
 int QCATLSHandler::tlsError() const { return d->err; }
 
 void QCATLSHandler::reset()
 {
+    leaveGate();
     d->tls->reset();
     d->state = 0;
 }
 
 void QCATLSHandler::startClient(const QString &host)
 {
+    leaveGate();
     d->state = 0;
     d->err   = -1;
     if (d->internalHostMatch)
         d->host = host;
-    d->tls->startClient(d->internalHostMatch ? QString() : host);
+    d->sessionHost = d->sessionResumption ? host : QString();
+    d->startHost   = d->internalHostMatch ? QString() : host;
+    QCA::TLSSession session;
+    if (!d->sessionHost.isEmpty() && TLSSessionCache::lookup(d->sessionHost, session)) {
+        // resuming is cheap, no need to wait for the gate
+        d->tls->setSession(session);
+        d->tls->startClient(d->startHost);
+        return;
+    }
+    d->gated   = true;
+    d->started = false;
+    if (TLSHandshakeGate::enter(this))
+        gate_entered();
+}
+
+void QCATLSHandler::gate_entered()
+{
+    // the call may be a late one from an earlier startClient()
+    if (d->gated && !d->started && TLSHandshakeGate::isInside(this)) {
+        d->started = true;
+        d->tls->startClient(d->startHost);
+    }
+}
+
+void QCATLSHandler::leaveGate()
+{
+    if (d->gated) {
+        d->gated = false;
+        TLSHandshakeGate::leave(this);
+    }
 }
 
 void QCATLSHandler::write(const QByteArray &a) { d->tls->write(a); }
@@ -384,7 +565,13 @@ void QCATLSHandler::continueAfterHandshake()
 
 void QCATLSHandler::tls_handshaken()
 {
+    leaveGate();
     d->state = 2;
+    if (!d->sessionHost.isEmpty()) {
+        QCA::TLSSession session = d->tls->session();
+        if (session.context())
+            TLSSessionCache::insert(d->sessionHost, session);
+    }
     emit tlsHandshaken();
 }
 
@@ -401,7 +588,11 @@ void QCATLSHandler::tls_closed() { emit closed(); }
 
 void QCATLSHandler::tls_error()
 {
+    leaveGate();
     d->err   = d->tls->errorCode();
     d->state = 0;
+    // don't try a session again which may be why this failed
+    if (!d->sessionHost.isEmpty())
+        TLSSessionCache::remove(d->sessionHost);
     emit fail();
 }
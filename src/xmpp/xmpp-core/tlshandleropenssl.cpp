@@ -0,0 +1,545 @@
+/*
+ * tlshandleropenssl.cpp - TLS with OpenSSL directly, for ALPN and early data
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp.h"
+
+#include "handshakepool.h"
+#include "xmpp/jid/jid.h"
+
+#include <QCache>
+#include <QHostAddress>
+#include <QMutex>
+#include <QPointer>
+#include <QTimer>
+#include <QUrl>
+
+#include <memory>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+// the biggest record plaintext
+#define TLS_READ_SIZE 16384
+
+namespace XMPP {
+
+//----------------------------------------------------------------------------
+// OpenSslSessionCache
+//----------------------------------------------------------------------------
+// Like the TLSSessionCache of QCATLSHandler, the sessions of the last handshakes per server host. OpenSSL
+// hands them to us as the tickets arrive, its own cache is off since it wouldn't be keyed by host.
+class OpenSslSessionCache {
+public:
+    static const int MaxSize = 64;
+
+    // with a reference for the caller, nullptr if there is none
+    static SSL_SESSION *lookup(const QString &host)
+    {
+        OpenSslSessionCache &c = instance();
+        QMutexLocker         locker(&c.mutex);
+        auto                *s = c.cache.object(host);
+        if (!s)
+            return nullptr;
+        SSL_SESSION_up_ref(s->session);
+        return s->session;
+    }
+
+    // takes over the reference
+    static void insert(const QString &host, SSL_SESSION *session)
+    {
+        OpenSslSessionCache &c = instance();
+        QMutexLocker         locker(&c.mutex);
+        c.cache.insert(host, new Entry(session));
+    }
+
+    static void remove(const QString &host)
+    {
+        OpenSslSessionCache &c = instance();
+        QMutexLocker         locker(&c.mutex);
+        c.cache.remove(host);
+    }
+
+private:
+    struct Entry {
+        SSL_SESSION *session;
+
+        Entry(SSL_SESSION *s) : session(s) { }
+        ~Entry() { SSL_SESSION_free(session); }
+    };
+
+    QMutex                 mutex;
+    QCache<QString, Entry> cache { MaxSize };
+
+    static OpenSslSessionCache &instance()
+    {
+        static OpenSslSessionCache c;
+        return c;
+    }
+};
+
+//----------------------------------------------------------------------------
+// OpenSslTLSHandler
+//----------------------------------------------------------------------------
+/*
+The network side goes through two memory BIOs, whatever OpenSSL has written is emitted after every call
+into it. The peer certificate is accepted during the handshake and validated with QCA when asked for, the
+same as QCATLSHandler leaves it to the application.
+The handshake steps run on the HandshakePool. Meanwhile the ssl is the pool's, what comes from the network
+waits in pendingIn and the step holds a reference of its own, so a reset doesn't free the ssl under it.
+*/
+class OpenSslTLSHandler::Private {
+public:
+    OpenSslTLSHandler *q;
+    SSL               *ssl = nullptr;
+    QString            host;
+    QString            sessionHost; // key of the session cache, empty if resumption is off
+    QList<QByteArray>  protocols { "xmpp-client" };
+    QByteArray         pendingOut; // written before the handshake was over
+    QByteArray         pendingIn;  // received while a handshake step is on the pool
+    QByteArray         earlySent;  // as early data, to send again if the server didn't take it
+    bool               sessionResumption = true;
+    bool               earlyData         = false;
+    bool               early             = false; // the session we resume allows early data
+    bool               started           = false; // SSL_do_handshake() was called
+    bool               handshaked        = false;
+    bool               established       = false;
+    bool               failed            = false;
+    bool               busy              = false; // a handshake step is on the pool
+    int                generation        = 0; // of startClient(), for the deferred ClientHello
+    QString            error;
+
+    QCA::CertificateCollection trusted;
+    bool                       trustedSet = false;
+    QCA::CertificateChain      peerChain;
+
+    // sessionHost for the session callback, which may run on a thread of the pool
+    std::shared_ptr<const QString> ticketHost;
+
+    Private(OpenSslTLSHandler *q) : q(q) { }
+    ~Private() { SSL_free(ssl); }
+
+    static SSL_CTX *context()
+    {
+        static SSL_CTX *ctx = []() {
+            SSL_CTX *c = SSL_CTX_new(TLS_client_method());
+            SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+            SSL_CTX_set_verify(c, SSL_VERIFY_PEER, [](int, X509_STORE_CTX *) { return 1; });
+            SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(c, [](SSL *ssl, SSL_SESSION *session) {
+                auto host = static_cast<const QString *>(SSL_get_app_data(ssl));
+                if (!host || host->isEmpty())
+                    return 0;
+                OpenSslSessionCache::insert(*host, session);
+                return 1; // the reference is ours now
+            });
+            return c;
+        }();
+        return ctx;
+    }
+
+    void start(const QString &hostName)
+    {
+        SSL_free(ssl);
+        ssl       = SSL_new(context());
+        BIO *rbio = BIO_new(BIO_s_mem());
+        BIO *wbio = BIO_new(BIO_s_mem());
+        BIO_set_mem_eof_return(rbio, -1);
+        SSL_set_bio(ssl, rbio, wbio);
+        SSL_set_connect_state(ssl);
+
+        host = hostName;
+        pendingOut.clear();
+        pendingIn.clear();
+        earlySent.clear();
+        peerChain   = QCA::CertificateChain();
+        early       = false;
+        started     = false;
+        handshaked  = false;
+        established = false;
+        failed      = false;
+        busy        = false;
+        error.clear();
+
+        QByteArray ace = QUrl::toAce(host);
+        if (QHostAddress(host).isNull() && !ace.isEmpty())
+            SSL_set_tlsext_host_name(ssl, ace.constData());
+
+        QByteArray alpn; // length prefixed
+        for (const QByteArray &p : std::as_const(protocols)) {
+            if (!p.isEmpty() && p.size() < 256)
+                alpn += char(p.size()) + p;
+        }
+        if (!alpn.isEmpty())
+            SSL_set_alpn_protos(ssl, reinterpret_cast<const unsigned char *>(alpn.constData()),
+                                unsigned(alpn.size()));
+
+        sessionHost = sessionResumption ? host : QString();
+        ticketHost  = std::make_shared<const QString>(sessionHost);
+        SSL_set_app_data(ssl, const_cast<QString *>(ticketHost.get()));
+        if (!sessionHost.isEmpty()) {
+            if (SSL_SESSION *session = OpenSslSessionCache::lookup(sessionHost)) {
+                SSL_set_session(ssl, session);
+                early = earlyData && SSL_SESSION_get_max_early_data(session) > 0;
+                SSL_SESSION_free(session);
+            }
+        }
+    }
+
+    void step()
+    {
+        if (failed)
+            return;
+        if (!handshaked) {
+            if (!busy) {
+                started = true;
+                handshakeStep();
+            }
+            return;
+        }
+        if (!established) {
+            flush(0);
+            return;
+        }
+
+        QByteArray in;
+        QByteArray buf(TLS_READ_SIZE, Qt::Uninitialized);
+        bool       closed = false;
+        for (;;) {
+            int ret = SSL_read(ssl, buf.data(), int(buf.size()));
+            if (ret > 0) {
+                in += buf.left(ret);
+                continue;
+            }
+            if (SSL_get_error(ssl, ret) == SSL_ERROR_ZERO_RETURN) {
+                SSL_shutdown(ssl);
+                closed = true;
+            } else if (!checkError(ret)) {
+                return;
+            }
+            break;
+        }
+
+        QPointer<OpenSslTLSHandler> self(q);
+        flush(0); // session tickets and key updates make OpenSSL write too
+        if (self && !in.isEmpty())
+            emit q->readyRead(in);
+        if (self && closed) {
+            failed = true;
+            emit q->closed();
+        }
+    }
+
+    // SSL_do_handshake() on the pool, handshakeDone() gets what it returned
+    void handshakeStep()
+    {
+        struct Result {
+            int     ret = 0;
+            int     err = SSL_ERROR_NONE;
+            QString error;
+        };
+
+        SSL_up_ref(ssl);
+        SSL *s      = ssl;
+        auto host   = ticketHost; // for the session callback, until the step is over
+        auto result = std::make_shared<Result>();
+        int  gen    = generation;
+        busy        = true;
+        HandshakePool::run(
+            q,
+            [s, host, result]() {
+                // the error queue of OpenSSL is per thread
+                result->ret = SSL_do_handshake(s);
+                if (result->ret != 1) {
+                    result->err = SSL_get_error(s, result->ret);
+                    if (result->err != SSL_ERROR_WANT_READ && result->err != SSL_ERROR_WANT_WRITE)
+                        result->error = QString::fromLatin1(ERR_error_string(ERR_get_error(), nullptr));
+                }
+                ERR_clear_error();
+                SSL_free(s);
+            },
+            [this, gen, result]() { handshakeDone(gen, result->ret, result->err, result->error); });
+    }
+
+    void handshakeDone(int gen, int ret, int err, const QString &message)
+    {
+        // reset() or another startClient() since, the step was for an ssl which is gone
+        if (gen != generation || !ssl || !busy)
+            return;
+        busy = false;
+        bool received = !pendingIn.isEmpty();
+        if (received) {
+            BIO_write(SSL_get_rbio(ssl), pendingIn.constData(), int(pendingIn.size()));
+            pendingIn.clear();
+        }
+
+        if (ret != 1) {
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+                fail(message);
+                return;
+            }
+            QPointer<OpenSslTLSHandler> self(q);
+            flush(0);
+            if (self && received)
+                step();
+            return;
+        }
+
+        handshaked = true;
+        if (!earlySent.isEmpty() && SSL_get_early_data_status(ssl) != SSL_EARLY_DATA_ACCEPTED)
+            pendingOut.prepend(earlySent);
+        earlySent.clear();
+        peerChain = readPeerChain();
+
+        QPointer<OpenSslTLSHandler> self(q);
+        flush(0);
+        if (self)
+            emit q->tlsHandshaken();
+    }
+
+    void writePlain(const QByteArray &a)
+    {
+        int ret = SSL_write(ssl, a.constData(), int(a.size()));
+        if (ret <= 0) {
+            checkError(ret);
+            return;
+        }
+        flush(int(a.size()));
+    }
+
+    // false if it was fatal, fail() is emitted then
+    bool checkError(int ret)
+    {
+        int err = SSL_get_error(ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return true;
+        QString message = QString::fromLatin1(ERR_error_string(ERR_get_error(), nullptr));
+        ERR_clear_error();
+        fail(message);
+        return false;
+    }
+
+    void fail(const QString &message)
+    {
+        error  = message;
+        failed = true;
+        // a session the server refused to resume doesn't get better by trying it again
+        if (!sessionHost.isEmpty() && !handshaked)
+            OpenSslSessionCache::remove(sessionHost);
+        QPointer<OpenSslTLSHandler> self(q);
+        flush(0); // most likely an alert
+        if (self)
+            emit q->fail();
+    }
+
+    void flush(int plainBytes)
+    {
+        BIO   *wbio = SSL_get_wbio(ssl);
+        size_t size = BIO_ctrl_pending(wbio);
+        if (!size)
+            return;
+        QByteArray out(int(size), Qt::Uninitialized);
+        BIO_read(wbio, out.data(), int(size));
+        emit q->readyReadOutgoing(out, plainBytes);
+    }
+
+    QCA::CertificateChain readPeerChain() const
+    {
+        QCA::CertificateChain chain;
+        STACK_OF(X509) *stack = SSL_get_peer_cert_chain(ssl); // the leaf first on the client side
+        for (int i = 0; stack && i < sk_X509_num(stack); ++i) {
+            X509      *x509 = sk_X509_value(stack, i);
+            QByteArray der(i2d_X509(x509, nullptr), Qt::Uninitialized);
+            auto       p = reinterpret_cast<unsigned char *>(der.data());
+            i2d_X509(x509, &p);
+            QCA::Certificate cert = QCA::Certificate::fromDER(der);
+            if (!cert.isNull())
+                chain += cert;
+        }
+        return chain;
+    }
+};
+
+OpenSslTLSHandler::OpenSslTLSHandler(QObject *parent) : TLSHandler(parent) { d = new Private(this); }
+
+OpenSslTLSHandler::~OpenSslTLSHandler() { delete d; }
+
+void OpenSslTLSHandler::setApplicationProtocols(const QList<QByteArray> &protocols) { d->protocols = protocols; }
+
+QByteArray OpenSslTLSHandler::applicationProtocol() const
+{
+    if (!d->ssl || !d->handshaked)
+        return QByteArray();
+    const unsigned char *data = nullptr;
+    unsigned int         size = 0;
+    SSL_get0_alpn_selected(d->ssl, &data, &size);
+    return QByteArray(reinterpret_cast<const char *>(data), int(size));
+}
+
+void OpenSslTLSHandler::setSessionResumption(bool enable) { d->sessionResumption = enable; }
+
+bool OpenSslTLSHandler::isSessionResumed() const { return d->ssl && d->handshaked && SSL_session_reused(d->ssl); }
+
+void OpenSslTLSHandler::setEarlyData(bool enable) { d->earlyData = enable; }
+
+bool OpenSslTLSHandler::isEarlyDataAccepted() const
+{
+    return d->ssl && d->handshaked && SSL_get_early_data_status(d->ssl) == SSL_EARLY_DATA_ACCEPTED;
+}
+
+void OpenSslTLSHandler::setTrustedCertificates(const QCA::CertificateCollection &trusted)
+{
+    d->trusted    = trusted;
+    d->trustedSet = true;
+}
+
+QCA::CertificateChain OpenSslTLSHandler::peerCertificateChain() const { return d->peerChain; }
+
+QCA::Validity OpenSslTLSHandler::peerCertificateValidity() const
+{
+    if (d->peerChain.isEmpty())
+        return QCA::ErrorValidityUnknown;
+    QCA::CertificateCollection intermediates;
+    for (int i = 1; i < d->peerChain.size(); ++i)
+        intermediates.addCertificate(d->peerChain[i]);
+    return d->peerChain.primary().validate(d->trustedSet ? d->trusted : QCA::systemStore(), intermediates,
+                                           QCA::UsageTLSServer);
+}
+
+bool OpenSslTLSHandler::certMatchesHostname() const
+{
+    if (d->peerChain.isEmpty())
+        return false;
+
+    const QByteArray der   = d->peerChain.primary().toDER();
+    auto             data  = reinterpret_cast<const unsigned char *>(der.constData());
+    X509            *x509  = d2i_X509(nullptr, &data, long(der.size()));
+    const QByteArray ace   = QUrl::toAce(d->host);
+    bool             match = false;
+    if (x509) {
+        if (!QHostAddress(d->host).isNull())
+            match = X509_check_ip_asc(x509, d->host.toLatin1().constData(), 0) == 1;
+        else if (!ace.isEmpty())
+            match = X509_check_host(x509, ace.constData(), size_t(ace.size()), 0, nullptr) == 1;
+        X509_free(x509);
+    }
+    if (match)
+        return true;
+
+    Jid        host(d->host);
+    const auto hosts = d->peerChain.primary().subjectInfo().values(QCA::XMPP);
+    for (const QString &idOnXmppAddr : hosts) {
+        if (host.compare(Jid(idOnXmppAddr)))
+            return true;
+    }
+    return false;
+}
+
+QString OpenSslTLSHandler::errorString() const { return d->error; }
+
+void OpenSslTLSHandler::reset()
+{
+    ++d->generation;
+    SSL_free(d->ssl);
+    d->ssl = nullptr;
+    d->pendingOut.clear();
+    d->pendingIn.clear();
+    d->earlySent.clear();
+    d->busy        = false;
+    d->handshaked  = false;
+    d->established = false;
+}
+
+void OpenSslTLSHandler::startClient(const QString &host)
+{
+    int gen = ++d->generation;
+    d->start(host);
+    if (!d->early) {
+        d->step(); // ClientHello
+        return;
+    }
+    // give the stream a chance to write its header first, so it goes out with the ClientHello
+    QTimer::singleShot(0, this, [this, gen]() {
+        if (gen == d->generation && d->ssl && !d->started)
+            d->step();
+    });
+}
+
+void OpenSslTLSHandler::write(const QByteArray &a)
+{
+    if (!d->ssl || d->failed)
+        return;
+
+    if (d->early && !d->handshaked) {
+        size_t written = 0;
+        if (!d->busy && SSL_write_early_data(d->ssl, a.constData(), size_t(a.size()), &written) == 1) {
+            d->started = true;
+            d->earlySent += a;
+            d->flush(int(a.size()));
+            return;
+        }
+        // too late for early data, the handshake has moved on
+        ERR_clear_error();
+        d->early = false;
+    }
+
+    if (!d->established) {
+        d->pendingOut += a;
+        if (!d->started)
+            d->step();
+        return;
+    }
+    d->writePlain(a);
+}
+
+void OpenSslTLSHandler::writeIncoming(const QByteArray &a)
+{
+    if (!d->ssl || d->failed)
+        return;
+    if (d->busy) {
+        d->pendingIn += a;
+        return;
+    }
+    BIO_write(SSL_get_rbio(d->ssl), a.constData(), int(a.size()));
+    d->step();
+}
+
+bool OpenSslTLSHandler::acceptsEarlyData() const { return d->ssl && d->early && !d->started; }
+
+void OpenSslTLSHandler::continueAfterHandshake()
+{
+    if (!d->ssl || !d->handshaked || d->established)
+        return;
+    d->established = true;
+
+    QPointer<OpenSslTLSHandler> self(this);
+    emit success();
+    if (!self || d->failed)
+        return;
+    if (!d->pendingOut.isEmpty()) {
+        QByteArray a;
+        a.swap(d->pendingOut);
+        d->writePlain(a);
+        if (!self || d->failed)
+            return;
+    }
+    d->step(); // application data which came with the last flight
+}
+
+} // namespace XMPP
@@ -20,102 +20,16 @@
 #include "xmlprotocol.h"
 
 #include "bytestream.h"
+#include "metrics.h"
 
 #include <QByteArray>
 #include <QList>
+#include <QPair>
 #include <QTextStream>
 
-using namespace XMPP;
-
-// stripExtraNS
-//
-// This function removes namespace information from various nodes for
-// display purposes only (the element is pretty much useless for processing
-// after this).  We do this because QXml is a bit overzealous about outputting
-// redundant namespaces.
-static QDomElement stripExtraNS(const QDomElement &e)
-{
-    // find closest parent with a namespace
-    QDomNode par = e.parentNode();
-    while (!par.isNull() && par.namespaceURI().isNull())
-        par = par.parentNode();
-    bool noShowNS = false;
-    if (!par.isNull() && par.namespaceURI() == e.namespaceURI())
-        noShowNS = true;
-
-    // build qName (prefix:localName)
-    QString qName;
-    if (!e.prefix().isEmpty())
-        qName = e.prefix() + ':' + e.localName();
-    else
-        qName = e.tagName();
-
-    QDomElement i;
-    int         x;
-    if (noShowNS)
-        i = e.ownerDocument().createElement(qName);
-    else
-        i = e.ownerDocument().createElementNS(e.namespaceURI(), qName);
-
-    // copy attributes
-    QDomNamedNodeMap al = e.attributes();
-    for (x = 0; x < al.count(); ++x) {
-        QDomAttr a = al.item(x).cloneNode().toAttr();
-
-        // don't show xml namespace
-        if (a.namespaceURI() == NS_XML)
-            i.setAttribute(QString("xml:") + a.name(), a.value());
-        else
-            i.setAttributeNodeNS(a);
-    }
+#include <cstring>
 
-    // copy children
-    QDomNodeList nl = e.childNodes();
-    for (x = 0; x < nl.count(); ++x) {
-        QDomNode n = nl.item(x);
-        if (n.isElement())
-            i.appendChild(stripExtraNS(n.toElement()));
-        else
-            i.appendChild(n.cloneNode());
-    }
-    return i;
-}
-
-// xmlToString
-//
-// This function converts a QDomElement into a QString, using stripExtraNS
-// to make it pretty.
-static QString xmlToString(const QDomElement &e, const QString &fakeNS, const QString &fakeQName, bool clip)
-{
-    QDomElement i = e.cloneNode().toElement();
-
-    // It seems QDom can only have one namespace attribute at a time (see docElement 'HACK').
-    // Fortunately we only need one kind depending on the input, so it is specified here.
-    QDomElement fake = e.ownerDocument().createElementNS(fakeNS, fakeQName);
-    fake.appendChild(i);
-    fake = stripExtraNS(fake);
-    QString out;
-    {
-        QTextStream ts(&out, QIODevice::WriteOnly);
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-        // NOTE: Workaround for bug in QtXML https://bugreports.qt.io/browse/QTBUG-25291 (Qt4 and Qt5 MinGW only):
-        // Qt by default convert low surrogate to XML notation &#x....; and let high in binary!
-        //
-        // Qt is calling encode function per UTF-16 codepoint, which means that high and low
-        // surrogate pairs are encoded separately. So all encoding except UTF-16 will leads
-        // to damaged Unicode characters above 0xFFFF. Internal QString encoding is UTF-16
-        // so this should be safe as QString still contains valid Unicode characters.
-        ts.setCodec("UTF-16");
-#endif
-        fake.firstChild().save(ts, 0);
-    }
-    // 'clip' means to remove any unwanted (and unneeded) characters, such as a trailing newline
-    if (clip) {
-        int n = out.lastIndexOf('>');
-        out.truncate(n + 1);
-    }
-    return out;
-}
+using namespace XMPP;
 
 // createRootXmlTags
 //
@@ -230,6 +144,249 @@ static QString sanitizeForStream(const QString &in)
     return out;
 }
 
+// StanzaWriter
+//
+// Serializes an element straight into UTF-8, without going through QDom's
+// text output and a temporary UTF-16 string.  elementToString() uses it
+// too, so the console shows what goes out: namespaces are declared only
+// where they change relative to the stream, '>' is always encoded and chars
+// outside of the allowed XML range are dropped.
+class StanzaWriter {
+public:
+    StanzaWriter(QByteArray &buffer, const QString &prefix, const QString &ns) : out(buffer)
+    {
+        scope.append({ prefix, ns });
+    }
+
+    void writeElement(const QDomElement &e)
+    {
+        const int scopeSize = scope.size();
+
+        QString prefix = e.prefix();
+        QString ns     = e.namespaceURI();
+
+        out += '<';
+        writeQName(prefix, e.localName().isNull() ? e.tagName() : e.localName());
+
+        // declare the namespace if it differs from the one in scope, unless somebody did it with an attribute
+        if (!ns.isNull() && lookupNamespace(prefix) != ns) {
+            QString decl = prefix.isEmpty() ? QString::fromLatin1("xmlns") : QString::fromLatin1("xmlns:") + prefix;
+            if (!e.hasAttribute(decl))
+                writeDeclaration(prefix, ns);
+        }
+
+        QDomNamedNodeMap al = e.attributes();
+        for (int n = 0; n < al.count(); ++n) {
+            QDomAttr a         = al.item(n).toAttr();
+            QString  aNS       = a.namespaceURI();
+            QString  localName = a.localName().isNull() ? a.name() : a.localName();
+            out += ' ';
+            if (aNS == QLatin1String(NS_XML)) {
+                writeQName(QString::fromLatin1("xml"), localName);
+            } else if (!aNS.isNull() && !a.prefix().isEmpty()) {
+                if (lookupNamespace(a.prefix()) != aNS) {
+                    writeDeclaration(a.prefix(), aNS);
+                    out += ' ';
+                }
+                writeQName(a.prefix(), localName);
+            } else {
+                // namespaces declared by hand (see docElement 'HACK') still have to be known to the children
+                if (a.name() == QLatin1String("xmlns"))
+                    scope.append({ QString(), a.value() });
+                else if (a.name().startsWith(QLatin1String("xmlns:")))
+                    scope.append({ a.name().mid(6), a.value() });
+                writeText(a.name(), XmlProtocol::RawText);
+            }
+            out += "=\"";
+            writeText(a.value(), XmlProtocol::AttributeText);
+            out += '"';
+        }
+
+        bool         empty = true;
+        QDomNodeList nl    = e.childNodes();
+        for (int n = 0; n < nl.count(); ++n) {
+            QDomNode c = nl.item(n);
+            if (c.isElement()) {
+                if (empty)
+                    out += '>';
+                empty = false;
+                writeElement(c.toElement());
+            } else if (c.isText()) { // includes CDATA sections
+                if (empty)
+                    out += '>';
+                empty = false;
+                writeText(c.toCharacterData().data(), XmlProtocol::EscapedText);
+            }
+            // comments and processing instructions have no business in a stanza
+        }
+
+        if (empty) {
+            out += "/>";
+        } else {
+            out += "</";
+            writeQName(prefix, e.localName().isNull() ? e.tagName() : e.localName());
+            out += '>';
+        }
+
+        while (scope.size() > scopeSize)
+            scope.removeLast();
+    }
+
+private:
+    QByteArray                    &out;
+    QList<QPair<QString, QString>> scope; // prefix -> namespace, innermost last
+
+    QString lookupNamespace(const QString &prefix) const
+    {
+        for (int n = scope.size() - 1; n >= 0; --n) {
+            if (scope[n].first == prefix)
+                return scope[n].second;
+        }
+        return QString();
+    }
+
+    void writeQName(const QString &prefix, const QString &localName)
+    {
+        if (!prefix.isEmpty()) {
+            writeText(prefix, XmlProtocol::RawText);
+            out += ':';
+        }
+        writeText(localName, XmlProtocol::RawText);
+    }
+
+    void writeDeclaration(const QString &prefix, const QString &ns)
+    {
+        if (prefix.isEmpty()) {
+            out += "xmlns=\"";
+        } else {
+            out += "xmlns:";
+            writeText(prefix, XmlProtocol::RawText);
+            out += "=\"";
+        }
+        writeText(ns, XmlProtocol::AttributeText);
+        out += '"';
+        scope.append({ prefix, ns });
+    }
+
+    void writeText(const QString &s, XmlProtocol::TextMode mode) { XmlProtocol::appendText(out, s, mode); }
+};
+
+// whether c goes out as the same single byte
+static inline bool plainAscii(const quint32 c, XmlProtocol::TextMode mode)
+{
+    if (c >= 0x80)
+        return false;
+    if (mode == XmlProtocol::RawText)
+        return true;
+    return c >= 0x20 && c != '&' && c != '<' && c != '>' && (mode != XmlProtocol::AttributeText || c != '"');
+}
+
+// how many chars at p are plainAscii(). they are tested 4 at a time in a 64 bit word (SWAR) until one
+//   of the words may have something else, the tests can't give false negatives, only false positives
+static inline int plainRun(const QChar *p, int len, XmlProtocol::TextMode mode)
+{
+    constexpr quint64 ones  = 0x0001000100010001ULL;
+    constexpr quint64 highs = 0x8000800080008000ULL;
+
+    // a lane below v is flagged. exact while no lane is, which is all that matters for a break
+    auto below = [](quint64 w, quint64 v) { return (w - v * ones) & ~w & highs; };
+    auto equal = [&](quint64 w, quint64 v) { return below(w ^ (v * ones), 1); };
+
+    int n = 0;
+    for (; n + 4 <= len; n += 4) {
+        quint64 w;
+        memcpy(&w, p + n, sizeof(w));
+        if (w & (0xFF80 * ones))
+            break;
+        if (mode == XmlProtocol::RawText)
+            continue;
+        quint64 special = below(w, 0x20) | equal(w, '&') | equal(w, '<') | equal(w, '>');
+        if (mode == XmlProtocol::AttributeText)
+            special |= equal(w, '"');
+        if (special)
+            break;
+    }
+    while (n < len && plainAscii(p[n].unicode(), mode))
+        ++n;
+    return n;
+}
+
+// Names are written as is (like sanitizeForStream does), character data gets escaped and invalid chars dropped.
+//   The runs needing neither go out in one piece.
+void XmlProtocol::appendText(QByteArray &out, const QString &s, TextMode mode)
+{
+    const QChar *p   = s.constData();
+    const int    len = s.size();
+    for (int n = 0; n < len; ++n) {
+        const int run = plainRun(p + n, len - n, mode);
+        if (run) {
+            const int at = out.size();
+            out.resize(at + run);
+            char *d = out.data() + at;
+            for (int k = 0; k < run; ++k)
+                d[k] = char(p[n + k].unicode());
+            n += run;
+            if (n == len)
+                break;
+        }
+
+        quint32 c = p[n].unicode();
+        if (c < 0x80) {
+            // plainRun() took all the others
+            if (c == '&') {
+                out += "&amp;";
+            } else if (c == '<') {
+                out += "&lt;";
+            } else if (c == '>') {
+                out += "&gt;";
+            } else if (c == '\r') {
+                out += "&#xd;";
+            } else if (mode == AttributeText && c == '"') {
+                out += "&quot;";
+            } else if (mode == AttributeText && c == '\n') {
+                out += "&#xa;";
+            } else if (mode == AttributeText && c == '\t') {
+                out += "&#x9;";
+            } else if (!validChar(c)) {
+                qDebug("Dropping invalid XML char U+%04x", c);
+            } else {
+                out += char(c);
+            }
+            continue;
+        }
+
+        if (highSurrogate(c) && n + 1 < len && lowSurrogate(p[n + 1].unicode())) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (p[n + 1].unicode() - 0xDC00);
+            ++n;
+            out += char(0xF0 | (c >> 18));
+            out += char(0x80 | ((c >> 12) & 0x3F));
+            out += char(0x80 | ((c >> 6) & 0x3F));
+            out += char(0x80 | (c & 0x3F));
+            continue;
+        }
+        if (!validChar(c)) {
+            if (mode != RawText) {
+                qDebug("Dropping invalid XML char U+%04x", c);
+                continue;
+            }
+            if (highSurrogate(c) || lowSurrogate(c))
+                c = 0xFFFD; // same as QString::toUtf8() would do for broken pairs
+        }
+        if (c < 0x800) {
+            out += char(0xC0 | (c >> 6));
+        } else {
+            out += char(0xE0 | (c >> 12));
+            out += char(0x80 | ((c >> 6) & 0x3F));
+        }
+        out += char(0x80 | (c & 0x3F));
+    }
+}
+
+void XmlProtocol::appendElement(QByteArray &out, const QDomElement &e, const QString &ns)
+{
+    StanzaWriter(out, QString(), ns).writeElement(e);
+}
+
 //----------------------------------------------------------------------------
 // Protocol
 //----------------------------------------------------------------------------
@@ -245,7 +402,11 @@ XmlProtocol::TransferItem::TransferItem(const QDomElement &_elem, bool sent, boo
 {
 }
 
-XmlProtocol::XmlProtocol() { init(); }
+XmlProtocol::XmlProtocol()
+{
+    init();
+    xml.setCompactMode(true);
+}
 
 XmlProtocol::~XmlProtocol() { }
 
@@ -264,6 +425,7 @@ void XmlProtocol::reset()
     elemDoc  = QDomDocument();
     tagOpen  = QString();
     tagClose = QString();
+    batchDoc.reset();
     xml.reset();
     outDataNormal.resize(0);
     outDataUrgent.resize(0);
@@ -274,6 +436,17 @@ void XmlProtocol::reset()
 
 void XmlProtocol::addIncomingData(const QByteArray &a) { xml.appendData(a); }
 
+void XmlProtocol::addContentSink(const QString &ns, const QString &localName, ContentSink *sink)
+{
+    xml.addContentSink(ns, localName, sink);
+}
+
+void XmlProtocol::removeContentSink(ContentSink *sink) { xml.removeContentSink(sink); }
+
+void XmlProtocol::setParserLimits(const Parser::Limits &limits) { xml.setLimits(limits); }
+
+Parser::Violation XmlProtocol::parserViolation() const { return xml.violation(); }
+
 QByteArray XmlProtocol::takeOutgoingData()
 {
     if (!outDataUrgent.isEmpty()) {
@@ -286,6 +459,20 @@ QByteArray XmlProtocol::takeOutgoingData()
     return a;
 }
 
+QByteArray XmlProtocol::takeOutgoingUrgentData()
+{
+    QByteArray a = outDataUrgent;
+    outDataUrgent.resize(0);
+    return a;
+}
+
+int XmlProtocol::outgoingDataSize() const { return outDataUrgent.size() + outDataNormal.size(); }
+
+qint64 XmlProtocol::bufferedBytes() const
+{
+    return xml.memoryUsage() + outDataUrgent.capacity() + outDataNormal.capacity();
+}
+
 void XmlProtocol::outgoingDataWritten(int bytes)
 {
     int b = processTrackQueue(trackQueueUrgent, bytes);
@@ -302,23 +489,30 @@ void XmlProtocol::clearSendQueue()
 bool XmlProtocol::processStep()
 {
     Parser::Event pe;
+    QDomElement   stanza;
     notify = 0;
     transferItemList.clear();
 
     if (state != Closing && (state == RecvOpen || stepAdvancesParser())) {
         // if we get here, then it's because we're in some step that advances the parser
+#ifdef IRIS_METRICS
+        QElapsedTimer parseTimer;
+        parseTimer.start();
+#endif
         pe = xml.readNext();
         if (!pe.isNull()) {
             // note: error/close events should be handled for ALL steps, so do them here
             switch (pe.type()) {
             case Parser::Event::DocumentOpen: {
-                transferItemList += TransferItem(pe.actualString(), false);
+                if (observeRecv)
+                    transferItemList += TransferItem(pe.actualString(), false);
 
                 // stringRecv(pe.actualString());
                 break;
             }
             case Parser::Event::DocumentClose: {
-                transferItemList += TransferItem(pe.actualString(), false);
+                if (observeRecv)
+                    transferItemList += TransferItem(pe.actualString(), false);
 
                 // stringRecv(pe.actualString());
                 if (incoming) {
@@ -332,17 +526,25 @@ bool XmlProtocol::processStep()
                 return true;
             }
             case Parser::Event::Element: {
-                QDomElement e = elemDoc.importNode(pe.element(), true).toElement();
-                transferItemList += TransferItem(e, false);
+                // compact events are materialized right into our document, so there is no intermediate tree to copy
+                if (pe.isCompact())
+                    stanza = pe.compactElement().toDomElement(recvDocument(pe));
+                else
+                    stanza = elemDoc.importNode(pe.element(), true).toElement();
+                IRIS_METRIC_ADD(StanzasParsed, 1);
+                IRIS_METRIC_RECORD(StanzaParseUsecs, parseTimer.nsecsElapsed() / 1000);
+                if (observeRecv)
+                    transferItemList += TransferItem(stanza, false);
 
                 // elementRecv(pe.element());
                 break;
             }
             case Parser::Event::Error: {
-                if (incoming) {
+                // the peer is told about a limit whichever side it is
+                if (incoming || xml.violation() != Parser::NoViolation) {
                     // If we get a parse error during the initial element exchange,
                     // flip immediately into 'open' mode so that we can report an error.
-                    if (state == RecvOpen) {
+                    if (incoming && state == RecvOpen) {
                         sendTagOpen();
                         state = Open;
                     }
@@ -363,17 +565,25 @@ bool XmlProtocol::processStep()
         }
     }
 
-    return baseStep(pe);
+    return baseStep(pe, stanza);
 }
 
 QString XmlProtocol::xmlEncoding() const { return xml.encoding().toString(); }
 
 QString XmlProtocol::elementToString(const QDomElement &e, bool clip)
+{
+    Q_UNUSED(clip); // the writer never emits trailing whitespace
+    // the same markup as on the wire, escaped in the one pass
+    QByteArray out;
+    StanzaWriter(out, e.prefix(), streamNamespace(e)).writeElement(e);
+    return QString::fromUtf8(out);
+}
+
+QString XmlProtocol::streamNamespace(const QDomElement &e)
 {
     if (elem.isNull())
         elem = elemDoc.importNode(docElement(), true).toElement();
 
-    // Determine the appropriate 'fakeNS' to use
     QString ns;
 
     // first, check root namespace
@@ -404,15 +614,7 @@ QString XmlProtocol::elementToString(const QDomElement &e, bool clip)
             ns = elem.namespaceURI();
         }
     }
-
-    // build qName
-    QString qn;
-    if (!elem.prefix().isEmpty())
-        qn = elem.prefix() + ':';
-    qn += elem.localName();
-
-    // make the string
-    return sanitizeForStream(xmlToString(e, ns, qn, clip));
+    return ns;
 }
 
 bool XmlProtocol::stepRequiresElement() const
@@ -468,19 +670,55 @@ bool XmlProtocol::close()
 
 int XmlProtocol::writeString(const QString &s, int id, bool external)
 {
-    transferItemList += TransferItem(s, true, external);
+    if (observeSent)
+        transferItemList += TransferItem(s, true, external);
     return internalWriteString(s, TrackItem::Custom, id);
 }
 
 int XmlProtocol::writeElement(const QDomElement &e, int id, bool external, bool clip, bool urgent)
 {
+    Q_UNUSED(clip); // the writer never emits trailing whitespace, so there is nothing to clip
     if (e.isNull())
         return 0;
-    transferItemList += TransferItem(e, true, external);
+    if (observeSent)
+        transferItemList += TransferItem(e, true, external);
 
     // elementSend(e);
-    QString out = sanitizeForStream(elementToString(e, clip));
-    return internalWriteString(out, TrackItem::Custom, id, urgent);
+    // serialize right into the outgoing buffer
+    QByteArray &out   = urgent ? outDataUrgent : outDataNormal;
+    const int   start = out.size();
+    {
+        IRIS_METRIC_SCOPE(StanzaSerializeUsecs);
+        StanzaWriter(out, e.prefix(), streamNamespace(e)).writeElement(e);
+    }
+    IRIS_METRIC_ADD(StanzasSerialized, 1);
+
+    TrackItem i;
+    i.type = TrackItem::Custom;
+    i.id   = id;
+    i.size = out.size() - start;
+    if (urgent)
+        trackQueueUrgent += i;
+    else
+        trackQueueNormal += i;
+    return i.size;
+}
+
+int XmlProtocol::writeData(const QByteArray &data, int id, bool external, bool urgent)
+{
+    // external items are never shown, so don't decode them
+    if (observeSent)
+        transferItemList += TransferItem(external ? QString() : QString::fromUtf8(data), true, external);
+    return internalWriteData(data, TrackItem::Custom, id, urgent);
+}
+
+QByteArray XmlProtocol::serializeElement(const QDomElement &e)
+{
+    IRIS_METRIC_SCOPE(StanzaSerializeUsecs);
+    IRIS_METRIC_ADD(StanzasSerialized, 1);
+    QByteArray out;
+    StanzaWriter(out, e.prefix(), streamNamespace(e)).writeElement(e);
+    return out;
 }
 
 QByteArray XmlProtocol::resetStream()
@@ -561,8 +799,10 @@ void XmlProtocol::sendTagOpen()
     s += xmlHeader + '\n';
     s += sanitizeForStream(tagOpen) + '\n';
 
-    transferItemList += TransferItem(xmlHeader, true);
-    transferItemList += TransferItem(tagOpen, true);
+    if (observeSent) {
+        transferItemList += TransferItem(xmlHeader, true);
+        transferItemList += TransferItem(tagOpen, true);
+    }
 
     // stringSend(xmlHeader);
     // stringSend(tagOpen);
@@ -571,13 +811,14 @@ void XmlProtocol::sendTagOpen()
 
 void XmlProtocol::sendTagClose()
 {
-    transferItemList += TransferItem(tagClose, true);
+    if (observeSent)
+        transferItemList += TransferItem(tagClose, true);
 
     // stringSend(tagClose);
     internalWriteString(tagClose, TrackItem::Close);
 }
 
-bool XmlProtocol::baseStep(const Parser::Event &pe)
+bool XmlProtocol::baseStep(const Parser::Event &pe, const QDomElement &stanza)
 {
     // Basic
     if (state == SendOpen) {
@@ -599,10 +840,7 @@ bool XmlProtocol::baseStep(const Parser::Event &pe)
         event = ERecvOpen;
         return true;
     } else if (state == Open) {
-        QDomElement e;
-        if (pe.type() == Parser::Event::Element)
-            e = pe.element();
-        return doStep(e);
+        return doStep(stanza);
     }
     // Closing
     else {
@@ -629,3 +867,32 @@ void XmlProtocol::setIncomingAsExternal()
             i.isExternal = true;
     }
 }
+
+void XmlProtocol::setTransfersObserved(bool sent, bool received)
+{
+    observeSent = sent;
+    observeRecv = received;
+}
+
+void XmlProtocol::setBatchDocuments(bool enabled)
+{
+    batchDocs = enabled;
+    batchDoc.reset();
+}
+
+void XmlProtocol::startBatch() { batchDoc.reset(); }
+
+QSharedPointer<QDomDocument> XmlProtocol::batchDocument() const { return batchDoc; }
+
+QDomDocument &XmlProtocol::recvDocument(const Parser::Event &pe)
+{
+    // features, sasl and sm elements may be kept for the whole stream, they stay in ours
+    if (!batchDocs)
+        return elemDoc;
+    QStringView name = pe.compactElement().localName();
+    if (name != QLatin1String("message") && name != QLatin1String("presence") && name != QLatin1String("iq"))
+        return elemDoc;
+    if (!batchDoc)
+        batchDoc.reset(new QDomDocument);
+    return *batchDoc;
+}
@@ -24,6 +24,7 @@
 
 #include <QList>
 #include <QObject>
+#include <QSharedPointer>
 #include <qdom.h>
 
 #define NS_XML "http://www.w3.org/XML/1998/namespace"
@@ -62,9 +63,17 @@ public:
 
     // byte I/O for the stream
     void       addIncomingData(const QByteArray &);
+    // see Parser::addContentSink()
+    void       addContentSink(const QString &ns, const QString &localName, ContentSink *sink);
+    void       removeContentSink(ContentSink *sink);
+    // see Parser::setLimits(). a violation closes the stream with an error, see handleError()
+    void       setParserLimits(const Parser::Limits &limits);
     QByteArray takeOutgoingData();
+    QByteArray takeOutgoingUrgentData();
+    int        outgoingDataSize() const;
     void       outgoingDataWritten(int);
     void       clearSendQueue();
+    qint64     bufferedBytes() const; // approximate heap use of the parser and the outgoing data
 
     // advance the state machine
     bool processStep();
@@ -75,6 +84,13 @@ public:
     inline bool isIncoming() const { return incoming; }
     QString     xmlEncoding() const;
     QString     elementToString(const QDomElement &e, bool clip = false);
+    QByteArray  serializeElement(const QDomElement &e); // the UTF-8 of writeElement(), for writeData()
+
+    // the UTF-8 the way writeElement() puts it on the wire
+    enum TextMode { RawText, EscapedText, AttributeText };
+    static void appendText(QByteArray &out, const QString &s, TextMode mode);
+    // ns is the namespace in scope, e is declared only if it has another one
+    static void appendElement(QByteArray &out, const QDomElement &e, const QString &ns);
 
     class TransferItem {
     public:
@@ -90,6 +106,14 @@ public:
     };
     QList<TransferItem> transferItemList;
     void                setIncomingAsExternal();
+    // which directions go to transferItemList, both by default. nothing is recorded for the others
+    void                setTransfersObserved(bool sent, bool received);
+
+    // received message, presence and iq stanzas go to a document per batch instead of the long-lived one of the
+    // stream, so they are freed together with the last one of them held. off by default
+    void                         setBatchDocuments(bool enabled);
+    void                         startBatch();          // the next stanza starts a new document
+    QSharedPointer<QDomDocument> batchDocument() const; // where the stanzas since startBatch() are, if enabled
 
 protected:
     virtual QDomElement docElement()                           = 0;
@@ -100,6 +124,7 @@ protected:
     virtual bool        stepRequiresElement() const;
     virtual bool        doStep(const QDomElement &e) = 0;
     virtual void        itemWritten(int id, int size);
+    Parser::Violation   parserViolation() const; // why the parser failed, if it was a limit
 
     // 'debug'
     virtual void stringSend(const QString &s);
@@ -112,6 +137,8 @@ protected:
     bool       close();
     int        writeString(const QString &s, int id, bool external);
     int        writeElement(const QDomElement &e, int id, bool external, bool clip = false, bool urgent = false);
+    // writes an element serialized earlier with serializeElement()
+    int        writeData(const QByteArray &data, int id, bool external, bool urgent = false);
     QByteArray resetStream();
 
 private:
@@ -130,6 +157,11 @@ private:
     int          state = 0;
     bool         peerClosed;
     bool         closeWritten;
+    bool         observeSent = true;
+    bool         observeRecv = true;
+    bool         batchDocs   = false;
+
+    QSharedPointer<QDomDocument> batchDoc;
 
     Parser           xml;
     QByteArray       outDataNormal;
@@ -137,13 +169,16 @@ private:
     QList<TrackItem> trackQueueNormal;
     QList<TrackItem> trackQueueUrgent;
 
-    void init();
-    int  internalWriteData(const QByteArray &a, TrackItem::Type t, int id = -1, bool urgent = false);
-    int  internalWriteString(const QString &s, TrackItem::Type t, int id = -1, bool urgent = false);
-    int  processTrackQueue(QList<TrackItem> &queue, int bytes);
-    void sendTagOpen();
-    void sendTagClose();
-    bool baseStep(const Parser::Event &pe);
+    void    init();
+    QString streamNamespace(const QDomElement &e);
+    int     internalWriteData(const QByteArray &a, TrackItem::Type t, int id = -1, bool urgent = false);
+    int     internalWriteString(const QString &s, TrackItem::Type t, int id = -1, bool urgent = false);
+    int     processTrackQueue(QList<TrackItem> &queue, int bytes);
+    void    sendTagOpen();
+    void    sendTagClose();
+    bool    baseStep(const Parser::Event &pe, const QDomElement &stanza);
+
+    QDomDocument &recvDocument(const Parser::Event &pe);
 };
 } // namespace XMPP
 
@@ -23,7 +23,9 @@
 #include "iris/addressresolver.h"
 #include "xmpp_clientstream.h"
 
+#include <QDateTime>
 #include <QDomDocument>
+#include <QHash>
 #include <QHostAddress>
 #include <QObject>
 #include <QPair>
@@ -37,6 +39,8 @@
 class ByteStream;
 #endif
 
+class QNetworkAccessManager;
+
 namespace QCA {
 class TLS;
 };
@@ -95,6 +99,34 @@ private:
     quint16      port;
 };
 
+/*!
+ * Remembers per domain the endpoint the last connection went to, so the next connect can skip SRV
+ * lookups and attempts against dead targets. The default implementation keeps the paths in memory,
+ * reimplement it to make them persistent.
+ */
+class ConnectPathCache {
+public:
+    struct Path {
+        QString             host;              //!< host the connection went to
+        quint16             port      = 0;     //!< port on that host
+        bool                directTLS = false; //!< whether TLS was started right away
+        QList<QHostAddress> addresses;         //!< resolved addresses of host, the working one first
+        QDateTime           expires;           //!< addresses are not to be used after that
+
+        bool isValid() const { return !host.isEmpty() && port; }
+        bool hasAddresses() const { return !addresses.isEmpty() && expires > QDateTime::currentDateTimeUtc(); }
+    };
+
+    virtual ~ConnectPathCache();
+
+    virtual bool lookup(const QString &domain, Path &path) const;
+    virtual void store(const QString &domain, const Path &path);
+    virtual void remove(const QString &domain);
+
+private:
+    QHash<QString, Path> paths;
+};
+
 class AdvancedConnector : public Connector {
     Q_OBJECT
 public:
@@ -104,7 +136,7 @@ public:
 
     class Proxy {
     public:
-        enum { None, HttpConnect, HttpPoll, Socks };
+        enum { None, HttpConnect, HttpPoll, Socks, Bosh };
         Proxy() = default;
         ~Proxy() { }
 
@@ -119,6 +151,7 @@ public:
         void setHttpConnect(const QString &host, quint16 port);
         void setHttpPoll(const QString &host, quint16 port, const QUrl &url);
         void setSocks(const QString &host, quint16 port);
+        void setBosh(const QUrl &url);
         void setUserPass(const QString &user, const QString &pass);
         void setPollInterval(int secs);
 
@@ -137,6 +170,14 @@ public:
     void setProxy(const Proxy &proxy);
     void setOptSSL(bool);
     void setOptTlsSrv(bool);
+    // not owned. nullptr (the default) disables the cache
+    void setConnectPathCache(ConnectPathCache *cache);
+    // not owned. used for BOSH, e.g. the one of Client::networkAccessManager()
+    void setNetworkAccessManager(QNetworkAccessManager *nam);
+    // HTTP CONNECT proxies only. while connected, one more tunnel to the server is opened and kept idle, and
+    //   the next connectToServer() to the same server takes it instead of going through the proxy again. off
+    //   by default, the server sees a connection which doesn't log in
+    void setKeepSpareTunnel(bool enabled);
 
     void changePollInterval(int secs);
 
@@ -167,6 +208,12 @@ private:
     std::unique_ptr<Private> d;
 
     void cleanup();
+    void connectDirect(bool useCache);
+    void storePath();
+    void refreshPathAddresses(const QString &domain, const ConnectPathCache::Path &path);
+    void makeSpare();
+    bool takeSpare();
+    void dropSpare();
 };
 
 class TLSHandler : public QObject {
@@ -180,6 +227,17 @@ public:
     virtual void write(const QByteArray &a)         = 0;
     virtual void writeIncoming(const QByteArray &a) = 0;
 
+    // true if the last handshake resumed an earlier session instead of doing a full one
+    virtual bool isSessionResumed() const;
+    // true if what is written right after startClient() goes out with the handshake (TLS 1.3 early data)
+    virtual bool acceptsEarlyData() const;
+
+    // The threads of the process the handshake crypto of OpenSslTLSHandler and of SCRAM runs on, so the
+    // streams connected already keep their thread to themselves while the others log in. Half the cores
+    // by default, the handshakes beyond that wait for a thread
+    static void setHandshakeThreads(int count);
+    static int  handshakeThreads();
+
 signals:
     void success();
     void fail();
@@ -201,6 +259,15 @@ public:
     bool XMPPCertCheck();
     bool certMatchesHostname();
 
+    // Reuse sessions of earlier handshakes with the same host. On by default
+    void setSessionResumption(bool enable);
+    bool isSessionResumed() const;
+
+    // How many full handshakes the handlers of the process may do at the same time, the others wait for
+    // their turn. 0, the default, is no limit
+    static void setMaxConcurrentHandshakes(int max);
+    static int  maxConcurrentHandshakes();
+
     void reset();
     void startClient(const QString &host);
     void write(const QByteArray &a);
@@ -218,11 +285,65 @@ private slots:
     void tls_readyReadOutgoing();
     void tls_closed();
     void tls_error();
+    void gate_entered();
 
 private:
     class Private;
     Private *d;
+
+    void leaveGate();
 };
+
+#ifdef IRIS_TLS_OPENSSL
+/*
+ * TLS with OpenSSL directly, for what QCA has no API for: ALPN, so a direct TLS connect (XEP-0368) can share
+ * port 443 with a web server, and TLS 1.3 early data. When a resumed session allows it, what is written
+ * before the handshake is over, i.e. the stream header, goes out with the ClientHello and the stream opens a
+ * round trip earlier. The session got verified when it was made, the new peer certificate is checked
+ * against the trusted ones once tlsHandshaken() is emitted, and the application decides whether to go on.
+ */
+class OpenSslTLSHandler : public TLSHandler {
+    Q_OBJECT
+public:
+    OpenSslTLSHandler(QObject *parent = nullptr);
+    ~OpenSslTLSHandler();
+
+    // "xmpp-client" by default, none if empty
+    void       setApplicationProtocols(const QList<QByteArray> &protocols);
+    QByteArray applicationProtocol() const; // the one the server picked
+
+    // Reuse sessions of earlier handshakes with the same host. On by default
+    void setSessionResumption(bool enable);
+    bool isSessionResumed() const;
+    // Send the first writes as early data when the resumed session allows it. Off by default, the early
+    // data may be replayed by an attacker, which is harmless for a stream header but not for every stanza
+    void setEarlyData(bool enable);
+    bool isEarlyDataAccepted() const; // by the server, the data was sent again after the handshake if not
+
+    // the system store if not set
+    void                  setTrustedCertificates(const QCA::CertificateCollection &trusted);
+    QCA::CertificateChain peerCertificateChain() const;
+    QCA::Validity         peerCertificateValidity() const;
+    bool                  certMatchesHostname() const; // DNS or IP names and XMPP addresses
+    QString               errorString() const;
+
+    void reset();
+    void startClient(const QString &host);
+    void write(const QByteArray &a);
+    void writeIncoming(const QByteArray &a);
+    bool acceptsEarlyData() const;
+
+signals:
+    void tlsHandshaken();
+
+public slots:
+    void continueAfterHandshake();
+
+private:
+    class Private;
+    Private *d;
+};
+#endif
 }; // namespace XMPP
 
 #endif // XMPP_H
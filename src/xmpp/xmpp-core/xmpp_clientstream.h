@@ -25,6 +25,7 @@
 
 class ByteStream;
 class QByteArray;
+class QDateTime;
 class QDomDocument;
 class QDomElement;
 class QHostAddress;
@@ -33,8 +34,11 @@ class QString;
 
 namespace XMPP {
 class Connector;
+class ContentSink;
 class StreamFeatures;
+class StreamRecorder;
 class TLSHandler;
+class TimerWheel;
 
 class ClientStream : public Stream {
     Q_OBJECT
@@ -97,6 +101,8 @@ public:
 
     Jid  jid() const;
     void connectToServer(const Jid &jid, bool auth = true);
+    // XEP-0114 external component. the stream carries the stanzas of a whole domain, see ComponentRouter
+    void connectToComponent(const Jid &component, const QString &secret);
     void accept(); // server
     bool isActive() const;
     bool isAuthenticated() const;
@@ -135,6 +141,19 @@ public:
 
     // Compression
     void setCompress(bool);
+    // estimated link throughput in bytes per second, lets the compression level follow it. 0 keeps the default
+    void setCompressionLinkSpeed(qint64 bytesPerSecond);
+
+    // XEP-0388 SASL2 with Bind2, if the server offers both: the resource, SM and carbons in the login exchange
+    // and no stream restart. the server builds the resource from tag, the resource of the jid by default
+    void setSASL2Enabled(bool);
+    void setBind2(const QString &tag, bool enableCarbons = true);
+    void setUserAgent(const QString &id, const QString &software, const QString &device);
+    bool carbonsEnabled() const; // by Bind2, they needn't be enabled again
+    // XEP-0484 tokens to log in with a single HMAC. reconnections use the latest one by themselves,
+    // fastTokenChanged() tells when to save another
+    void setFastToken(const QString &mechanism, const QString &token, int count = 0);
+    void setRequestFastToken(bool);
 
     // reimplemented
     QDomDocument &doc() const;
@@ -147,6 +166,18 @@ public:
     void   write(const Stanza &s);
     void   clearSendQueue();
 
+    // Once the socket has a backlog, stanzas wait in a queue per priority class and go out the most urgent
+    // first, so a chat message doesn't wait for the file chunks written before it. Auto infers the class
+    void write(const Stanza &s, Stanza::Priority priority);
+    void write(const Stanza::Builder &b, Stanza::Priority priority = Stanza::Priority::Auto); // no tree made
+    // bytes of held back stanzas beyond which stale presence and chat states are replaced. 0 for none
+    void setCongestionBudget(qint64 bytes);
+
+    // Approximate heap bytes, see Client::memoryUsage()
+    qint64 parserMemory() const;  // input not parsed yet, the stanza being built and output not written yet
+    qint64 smQueueMemory() const; // stanzas waiting for an ack
+    qint64 bufferMemory() const;  // of the socket, the security layers and the send queues
+
     int                     errorCondition() const;
     QString                 errorText() const;
     QHash<QString, QString> errorLangText() const;
@@ -155,11 +186,49 @@ public:
     // extra
     void writeDirect(const QString &s);
     void setNoopTime(int mills);
+    void setNoopTimeMax(int mills); // probe longer keepalive intervals up to this
+    int  noopTime() const;          // the interval in use, the probed one if probing
+    // keepalives on a shared wheel instead of a timer of its own. not owned
+    void setTimerWheel(TimerWheel *wheel);
+    // what goes over the stream once it's logged in, after TLS and compression, see StreamRecorder. not owned
+    void setRecorder(StreamRecorder *recorder);
+    void setWriteCoalescing(bool enabled, int maxBytes = 16384, int maxDelay = 0);
+    void setReadBudget(int maxStanzas, int maxMsecs = 0);
+    // each round of received stanzas gets a document of its own, freed with the last Stanza of it, instead of all
+    // of them living in doc() for the whole session. an element of one kept beyond its Stanza needs
+    // Stanza::sharedDocument() kept too, or to be imported into another document. off by default
+    void setBatchDocuments(bool enabled);
+    // what the peer may send, 0 is no limit. more closes the stream with a policy-violation error
+    void setStanzaLimits(qint64 maxSize, int maxDepth = 0, int maxAttributes = 0, int maxPerSecond = 0);
+    // not owned. the base64 text of the ns:localName elements of received stanzas goes there as it's parsed
+    void addContentSink(const QString &ns, const QString &localName, ContentSink *sink);
+    void removeContentSink(ContentSink *sink);
 
     // Stream management
     bool isResumed() const;
     void setSMEnabled(bool enable);
 
+    // Stream management resumption state, to be kept over a restart of the process. Restore it
+    // before connectToServer() with the full jid of the saved session, and the stream resumes it instead
+    // of logging in from scratch. Returns false if data isn't a valid state
+    QByteArray saveSMState() const;
+    bool       restoreSMState(const QByteArray &data);
+
+    // Make-before-break, e.g. on a network change. Call before connectToServer() of this new stream, with the
+    // current one whose session it is to resume. That one keeps working while this one connects and logs in.
+    // Right before <resume/> goes out it's dropped, and its stream management state moves over here, as does
+    // whatever is written to it after that. handedOver() comes instead of authenticated() once the session is
+    // resumed. Returns false if old has no session to resume
+    bool takeOver(ClientStream *old);
+    bool isResumable() const; // there is a session takeOver() can resume
+    bool isTakenOver() const; // dropped for the stream which took over its session
+
+    // Soft cap in bytes for stanzas waiting for an ack, 0 (the default) for none. Nothing is dropped
+    // when it is reached, smSendQueueFull(true) asks the application to hold off instead.
+    void setSMSendQueueLimit(qint64 bytes);
+    // request an ack after this many stanzas or bytes, whichever comes first. 0 disables either limit
+    void setSMAckWindow(int stanzas, qint64 bytes);
+
     // barracuda extension
     QStringList hosts() const;
 
@@ -176,6 +245,9 @@ signals:
     void incomingXml(const QString &s);
     void outgoingXml(const QString &s);
     void stanzasAcked(int);
+    void smSendQueueFull(bool full);
+    void fastTokenChanged(const QString &mechanism, const QString &token, const QDateTime &expiry); // empty if rejected
+    void handedOver(); // see takeOver()
 
 public slots:
     void continueAfterWarning();
@@ -205,6 +277,8 @@ private slots:
 
     void doNoop();
     void doReadyRead();
+    void doReadMore();
+    void flushOutgoing();
 
 private:
     class Private;
@@ -212,11 +286,21 @@ private:
 
     void reset(bool all = false);
     void processNext();
+    bool isSendBacklogged() const;
+    void queueStanza(const QByteArray &data, Stanza::Priority priority, const QString &supersedes);
+    void writeQueued();
+    void startNoop();
+    void armNoop(int msecs);
+    void noopAnswered();
     int  convertedSASLCond() const;
     bool handleNeed();
     void handleError();
     void srvProcessNext();
     void setTimer(int secs);
+    void checkSMSendQueue();
+    void takeOverSession();
+    void writeTakenOver(const QByteArray &data);
+    void writeOut(const QByteArray &data);
 };
 } // namespace XMPP
 
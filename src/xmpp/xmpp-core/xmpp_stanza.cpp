@@ -18,6 +18,7 @@
 
 #include "xmpp_stanza.h"
 
+#include "xmlprotocol.h"
 #include "xmpp/jid/jid.h"
 #include "xmpp_clientstream.h"
 #include "xmpp_stream.h"
@@ -32,6 +33,13 @@ using namespace XMPP;
 
 #define NS_STANZAS "urn:ietf:params:xml:ns:xmpp-stanzas"
 #define NS_XML "http://www.w3.org/XML/1998/namespace"
+#define NS_CLIENT "jabber:client"
+#define NS_IBB "http://jabber.org/protocol/ibb"
+#define NS_PUBSUB "http://jabber.org/protocol/pubsub"
+#define NS_CHATSTATES "http://jabber.org/protocol/chatstates"
+
+// room for a typical stanza, so the builder allocates once
+#define STANZA_BUILDER_RESERVE 512
 
 //----------------------------------------------------------------------------
 // Stanza::Error
@@ -575,6 +583,43 @@ Stanza::Kind Stanza::kind() const { return (Kind)Private::stringToKind(d->e.tagN
 
 Stanza::Kind Stanza::kind(const QString &tagName) { return (Kind)Private::stringToKind(tagName); }
 
+// the class an element inside a stanza of the kind puts it in, Auto if none. direct is for the children of the stanza
+template <typename String>
+static Stanza::Priority elementPriority(Stanza::Kind kind, const String &name, const String &ns, bool direct)
+{
+    if ((name == QLatin1String("data") && ns == QLatin1String(NS_IBB))
+        || (name == QLatin1String("publish") && ns == QLatin1String(NS_PUBSUB)))
+        return Stanza::Priority::Bulk;
+    if (kind == Stanza::Message && direct && (name == QLatin1String("body") || ns == QLatin1String(NS_CHATSTATES)))
+        return Stanza::Priority::Interactive;
+    return Stanza::Priority::Auto;
+}
+
+Stanza::Priority Stanza::priority() const { return priority(d->e); }
+
+Stanza::Priority Stanza::priority(const QDomElement &e)
+{
+    int kind = Private::stringToKind(e.tagName());
+    if (kind == Presence)
+        return Priority::Presence;
+    if (kind == -1)
+        return Priority::Normal;
+
+    Priority ret = Priority::Normal;
+    for (QDomElement c = e.firstChildElement(); !c.isNull(); c = c.nextSiblingElement()) {
+        Priority    p     = elementPriority(Kind(kind), c.tagName(), c.namespaceURI(), true);
+        QDomElement inner = c.firstChildElement();
+        // <pubsub><publish/></pubsub>
+        if (p == Priority::Auto && !inner.isNull())
+            p = elementPriority(Kind(kind), inner.tagName(), inner.namespaceURI(), false);
+        if (p == Priority::Bulk)
+            return p;
+        if (p == Priority::Interactive)
+            ret = p;
+    }
+    return ret;
+}
+
 void Stanza::setKind(Kind k) { d->e.setTagName(Private::kindToString(k)); }
 
 Jid Stanza::to() const { return Jid(d->e.attribute("to")); }
@@ -629,6 +674,9 @@ void Stanza::clearError()
 
 QSharedPointer<QDomDocument> Stanza::unboundDocument(QSharedPointer<QDomDocument> sd)
 {
+    // it doesn't depend on the stream already
+    if (d->sharedDoc)
+        return sd;
     if (!sd) {
         sd = QSharedPointer<QDomDocument>(new QDomDocument);
     }
@@ -636,3 +684,201 @@ QSharedPointer<QDomDocument> Stanza::unboundDocument(QSharedPointer<QDomDocument
     d->sharedDoc = sd;
     return d->sharedDoc;
 }
+
+QSharedPointer<QDomDocument> Stanza::sharedDocument() const
+{
+    return d ? d->sharedDoc : QSharedPointer<QDomDocument>();
+}
+
+//----------------------------------------------------------------------------
+// Stanza::Builder
+//----------------------------------------------------------------------------
+static void appendLatin1(QByteArray &out, QLatin1String s) { out.append(s.data(), int(s.size())); }
+
+static QLatin1String kindName(Stanza::Kind kind)
+{
+    static const QLatin1String names[] = { QLatin1String("message"), QLatin1String("presence"), QLatin1String("iq") };
+    return names[kind];
+}
+
+Stanza::Builder::Builder(Kind kind, const QString &to, const QString &type, const QString &id) :
+    inStartTag(false), stanza(true), kind_(kind), priority_(kind == Presence ? Priority::Presence : Priority::Normal),
+    type_(type), id_(id)
+{
+    out.reserve(STANZA_BUILDER_RESERVE);
+    // the stream namespace, never declared
+    levels.append({ QLatin1String(NS_CLIENT), QLatin1String(NS_CLIENT) });
+    open(kindName(kind));
+    if (!to.isEmpty())
+        attribute(QLatin1String("to"), to);
+    if (!type.isEmpty())
+        attribute(QLatin1String("type"), type);
+    if (!id.isEmpty())
+        attribute(QLatin1String("id"), id);
+}
+
+Stanza::Builder::Builder(QLatin1String name, QLatin1String ns) :
+    inStartTag(false), stanza(false), kind_(IQ), priority_(Priority::Normal)
+{
+    levels.append({ QLatin1String(NS_CLIENT), QLatin1String(NS_CLIENT) });
+    open(name, ns);
+}
+
+Stanza::Builder &Stanza::Builder::attribute(QLatin1String name, const QString &value)
+{
+    Q_ASSERT(inStartTag);
+    out += ' ';
+    appendLatin1(out, name);
+    out += "=\"";
+    XmlProtocol::appendText(out, value, XmlProtocol::AttributeText);
+    out += '"';
+    return *this;
+}
+
+Stanza::Builder &Stanza::Builder::open(QLatin1String name, QLatin1String ns)
+{
+    Q_ASSERT(!levels.isEmpty());
+    finishStartTag();
+    out += '<';
+    appendLatin1(out, name);
+    if (ns.isEmpty()) {
+        ns = levels.last().ns;
+    } else if (ns != levels.last().ns) {
+        out += " xmlns=\"";
+        appendLatin1(out, ns);
+        out += '"';
+    }
+    notePriority(elementPriority(kind_, name, ns, levels.size() == 2));
+    levels.append({ name, ns });
+    inStartTag = true;
+    return *this;
+}
+
+Stanza::Builder &Stanza::Builder::close()
+{
+    Q_ASSERT(levels.size() > 1);
+    if (inStartTag) {
+        out += "/>";
+    } else {
+        out += "</";
+        appendLatin1(out, levels.last().name);
+        out += '>';
+    }
+    levels.removeLast();
+    inStartTag = false;
+    return *this;
+}
+
+Stanza::Builder &Stanza::Builder::text(const QString &text)
+{
+    finishStartTag();
+    XmlProtocol::appendText(out, text, XmlProtocol::EscapedText);
+    return *this;
+}
+
+Stanza::Builder &Stanza::Builder::element(QLatin1String name, QLatin1String ns) { return open(name, ns).close(); }
+
+Stanza::Builder &Stanza::Builder::textElement(QLatin1String name, const QString &text, QLatin1String ns)
+{
+    return open(name, ns).text(text).close();
+}
+
+Stanza::Builder &Stanza::Builder::element(const QDomElement &e)
+{
+    finishStartTag();
+    notePriority(elementPriority(kind_, e.tagName(), e.namespaceURI(), levels.size() == 2));
+    XmlProtocol::appendElement(out, e, levels.last().ns);
+    return *this;
+}
+
+Stanza::Builder &Stanza::Builder::appendContent(const QByteArray &data)
+{
+    finishStartTag();
+    out += data;
+    return *this;
+}
+
+void Stanza::Builder::finishStartTag()
+{
+    if (inStartTag) {
+        out += '>';
+        inStartTag = false;
+        if (levels.size() == 2 && contentAt == -1)
+            contentAt = out.size();
+    }
+}
+
+void Stanza::Builder::notePriority(Priority p)
+{
+    // bulk sticks, interactive only outranks normal
+    if (stanza && (p == Priority::Bulk || (p == Priority::Interactive && priority_ == Priority::Normal)))
+        priority_ = p;
+}
+
+bool Stanza::Builder::isStanza() const { return stanza; }
+
+Stanza::Kind Stanza::Builder::kind() const { return kind_; }
+
+QString Stanza::Builder::type() const { return type_; }
+
+QString Stanza::Builder::id() const { return id_; }
+
+Stanza::Priority Stanza::Builder::priority() const { return priority_; }
+
+QByteArray Stanza::Builder::data() const
+{
+    if (levels.size() == 1)
+        return out;
+
+    // close on a copy, so more can be added afterwards
+    QByteArray ret      = out;
+    bool       startTag = inStartTag;
+    for (int n = levels.size() - 1; n > 0; --n) {
+        if (startTag) {
+            ret += "/>";
+        } else {
+            ret += "</";
+            appendLatin1(ret, levels[n].name);
+            ret += '>';
+        }
+        startTag = false;
+    }
+    return ret;
+}
+
+QByteArray Stanza::Builder::content() const
+{
+    Q_ASSERT(levels.size() > 1);
+    if (contentAt == -1)
+        return QByteArray();
+
+    QByteArray ret      = out.mid(contentAt);
+    bool       startTag = inStartTag;
+    for (int n = levels.size() - 1; n > 1; --n) {
+        if (startTag) {
+            ret += "/>";
+        } else {
+            ret += "</";
+            appendLatin1(ret, levels[n].name);
+            ret += '>';
+        }
+        startTag = false;
+    }
+    return ret;
+}
+
+/**
+    \brief Parses the stanza built so far into a tree, owned by \a doc
+
+    For those who want to see (or change) the stanza the way the others are handled.
+*/
+QDomElement Stanza::Builder::toElement(QDomDocument &doc) const
+{
+    QByteArray xml = data();
+    if (stanza) // the stream namespace isn't written
+        xml.insert(1 + int(kindName(kind_).size()), " xmlns=\"" NS_CLIENT "\"");
+    QDomDocument tmp;
+    if (!tmp.setContent(xml, true))
+        return QDomElement();
+    return doc.importNode(tmp.documentElement(), true).toElement();
+}
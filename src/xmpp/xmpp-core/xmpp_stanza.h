@@ -19,10 +19,12 @@
 #ifndef XMPP_STANZA_H
 #define XMPP_STANZA_H
 
+#include <QByteArray>
 #include <QDomElement>
 #include <QPair>
 #include <QSharedPointer>
 #include <QString>
+#include <QVarLengthArray>
 
 class QDomDocument;
 
@@ -33,6 +35,8 @@ class Stream;
 class Stanza {
 public:
     enum Kind { Message, Presence, IQ };
+    // the classes of the outgoing queues, the most urgent first. see ClientStream::write()
+    enum class Priority { Auto = -1, Interactive, Presence, Normal, Bulk };
 
     Stanza();
     Stanza(const Stanza &from);
@@ -96,6 +100,58 @@ public:
         int originalCode;
     };
 
+    /*
+     * Writes a stanza right into the UTF-8 which goes over the wire, without the DOM tree and the strings it
+     * allocates. Names and namespaces are latin1 literals, values and text get escaped. Attributes go right
+     * after open(), before any child. An element opened without a namespace is in the one of its parent.
+     * See Client::send() and Task::send().
+     */
+    class Builder {
+    public:
+        Builder(Kind kind, const QString &to = QString(), const QString &type = QString(),
+                const QString &id = QString());
+        // a top level element which is not a stanza, e.g. one of stream management
+        Builder(QLatin1String name, QLatin1String ns);
+
+        Builder &attribute(QLatin1String name, const QString &value);
+        Builder &open(QLatin1String name, QLatin1String ns = QLatin1String());
+        Builder &close();
+        Builder &text(const QString &text);
+        Builder &element(QLatin1String name, QLatin1String ns = QLatin1String()); // an empty one
+        Builder &textElement(QLatin1String name, const QString &text, QLatin1String ns = QLatin1String());
+        Builder &element(const QDomElement &e);         // for the parts which exist as a tree anyway
+        Builder &appendContent(const QByteArray &data); // children serialized earlier by content()
+
+        bool     isStanza() const;
+        Kind     kind() const;
+        QString  type() const;
+        QString  id() const;
+        Priority priority() const; // inferred from what was written so far
+
+        QByteArray  data() const;    // what is still open gets closed
+        QByteArray  content() const; // the same for the children of the top element, which has to be open
+        QDomElement toElement(QDomDocument &doc) const;
+
+    private:
+        struct Level {
+            QLatin1String name;
+            QLatin1String ns;
+        };
+
+        QByteArray                out;
+        QVarLengthArray<Level, 8> levels;         // innermost last
+        int                       contentAt = -1; // where the children of the top element start in out
+        bool                      inStartTag;     // attributes may still follow
+        bool                      stanza;
+        Kind                      kind_;
+        Priority                  priority_;
+        QString                   type_;
+        QString                   id_;
+
+        void finishStartTag();
+        void notePriority(Priority p);
+    };
+
     bool isNull() const;
 
     QDomElement element() const;
@@ -111,6 +167,10 @@ public:
     static Kind kind(const QString &tagName);
     void        setKind(Kind k);
 
+    // interactive are messages with a body or a chat state, bulk are IBB data and pubsub publishing
+    Priority        priority() const;
+    static Priority priority(const QDomElement &e);
+
     Jid     to() const;
     Jid     from() const;
     QString id() const;
@@ -131,6 +191,9 @@ public:
     void setSMId(unsigned long id);
 
     QSharedPointer<QDomDocument> unboundDocument(QSharedPointer<QDomDocument>);
+    // the document of a received stanza if it has one of its own, see ClientStream::setBatchDocuments(). an
+    // element of it kept beyond the stanza needs this kept as well
+    QSharedPointer<QDomDocument> sharedDocument() const;
 
 private:
     friend class Stream;
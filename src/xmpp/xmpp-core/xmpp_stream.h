@@ -65,6 +65,8 @@ public:
 
     Stanza createStanza(Stanza::Kind k, const Jid &to = "", const QString &type = "", const QString &id = "");
     Stanza createStanza(const QDomElement &e);
+    // e lives in doc, the stanza keeps it. see Stanza::sharedDocument()
+    Stanza createStanza(const QDomElement &e, const QSharedPointer<QDomDocument> &doc);
 
     static QString xmlToString(const QDomElement &e, bool clip = false);
 
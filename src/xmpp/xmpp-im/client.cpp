@@ -73,30 +73,49 @@
 #include "jingle-ice.h"
 #include "jingle-s5b.h"
 #include "jingle.h"
+#include "netinterface.h"
+#include "netnames.h"
 #include "s5b.h"
+#include "stallwatchdog.h"
 #include "stundisco.h"
 #include "tcpportreserver.h"
 #include "xmpp/xmpp-core/protocol.h"
 #include "xmpp_bitsofbinary.h"
 #include "xmpp_caps.h"
+#include "xmpp_clienthost.h"
 #include "xmpp_externalservicediscovery.h"
 #include "xmpp_hash.h"
 #include "xmpp_ibb.h"
+#include "xmpp_iqcall.h"
 #include "xmpp_serverinfomanager.h"
 #include "xmpp_tasks.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMetaMethod>
 #include <QObject>
 #include <QPointer>
 #include <QTimer>
 
+#include <algorithm>
+#include <functional>
+
 #ifdef Q_OS_WIN
 #define vsnprintf _vsnprintf
 #endif
 
 #define GROUPS_DELIMITER_TIMEOUT 10
+// secs a task waits before it gives up, see Client::setTaskTimeout()
+#define TASK_TIMEOUT 120
+// rooms joined at a time by groupChatQueueJoin()
+#define GROUPCHAT_JOIN_WINDOW 3
+// secs a queued join waits for the room before its slot goes to the next one
+#define GROUPCHAT_JOIN_TIMEOUT 30
+// msecs the network interfaces are left to settle before a handover is started on a change
+#define HANDOVER_SETTLE 2000
 
 namespace XMPP {
 //----------------------------------------------------------------------------
@@ -107,9 +126,15 @@ public:
     enum { Connecting, Connected, Closing };
     GroupChat() = default;
 
-    Jid     j;
-    int     status = 0;
-    QString password;
+    Jid          j;
+    int          status = 0;
+    QString      password;
+    MUCOccupants occupants;
+
+    void updateOccupant(const Jid &from, const Status &s)
+    {
+        occupants.update(from.resource(), s.isAvailable(), s.hasMUCItem() ? s.mucItem() : MUCItem());
+    }
 };
 
 class Client::ClientPrivate {
@@ -147,8 +172,92 @@ public:
     StunDiscoManager         *stunDiscoManager         = nullptr;
     HttpFileUploadManager    *httpFileUploadManager    = nullptr;
     Jingle::Manager          *jingleManager            = nullptr;
+    NamePrefetcher           *namePrefetcher           = nullptr;
+    RosterStore              *rosterStore              = nullptr;
+    PEPCache                 *pepCache                 = nullptr;
+    MessageIdIndex           *messageIdIndex           = nullptr;
     QList<GroupChat>          groupChatList;
+
+    // the last message with a body from each room, by bare jid. kept over leaves and reconnects
+    struct GroupChatSeen {
+        QString   stanzaId; // the one by the room, if it gives them
+        QDateTime timeStamp;
+    };
+    bool                          groupChatTracking = false;
+    QHash<QString, GroupChatSeen> groupChatSeen;
+
+    // see groupChatQueueJoin()
+    struct QueuedJoin {
+        QString   host, room, nick, password;
+        int       priority, maxchars, maxstanzas, seconds;
+        QDateTime since;
+        Status    status;
+    };
+    int                    groupChatJoinWindow = GROUPCHAT_JOIN_WINDOW;
+    QList<QueuedJoin>      groupChatJoinQueue; // highest priority first
+    QHash<QString, qint64> groupChatJoining;   // bare jid -> taskClock msecs of the join. waits for our presence
+    QTimer                *groupChatJoinTimer = nullptr;
+
+    int                        presenceBatching   = -1;
+    QTimer                    *presenceBatchTimer = nullptr;
+    QList<QPair<Jid, Status>>  presenceBatch;
+    QHash<QString, int>        presenceBatchIndex; // full jid -> position in presenceBatch
+    bool                       quietPresence      = false;
+    Status                     presenceStatus; // what presenceContent was built for
+    CapsSpec                   presenceCaps;   // invalid if it has none
+    QByteArray                 presenceContent;
+    bool                       hasPresenceContent = false;
+
+    struct Outgoing {
+        Jid                      to;
+        Message::Type            type;
+        Message::ProcessingHints hints;
+        ChatState                state = StateNone;
+        QStringList              receipts; // ids of the received ones
+    };
+    int                      outgoingCoalescing = -1;
+    QTimer                  *outgoingTimer      = nullptr;
+    QHash<QString, Outgoing> outgoing; // by full jid
+
+    // make-before-break, see handoverStream()
+    QPointer<ClientStream>          handover;           // taking over the session of stream
+    bool                            streamLost = false; // stream failed meanwhile
+    std::function<ClientStream *()> streamFactory;
+    NetInterfaceManager            *netman        = nullptr;
+    QTimer                         *handoverTimer = nullptr;
+
     EncryptionHandler        *encryptionHandler = nullptr;
+    QPointer<ClientHost>      clientHost;
+
+    // the managers are made on first use. those serving pushes are made as well when an unclaimed one comes
+    // in, this is what makes them by (tag, child ns) like the push index of Task
+    QHash<QPair<QString, QString>, std::function<void()>> lazyPush;
+
+    IqCallTable *iqCalls = nullptr; // made by the first iq()
+
+    QSharedPointer<QDomDocument> stanzaDoc; // of the stanza distributed, see stanzaDocument()
+
+    struct ContentSinkEntry {
+        QString      ns, localName;
+        ContentSink *sink;
+    };
+    QList<ContentSinkEntry> contentSinks;
+
+    // task bookkeeping, see taskReport()
+    struct TaskClassStats {
+        int    started  = 0;
+        int    finished = 0;
+        int    timedOut = 0;
+        qint64 msecs    = 0; // summed over the finished ones
+    };
+    struct RunningTask {
+        qint64 since   = 0; // taskClock msecs
+        bool   waiting = false;
+    };
+    int                                        taskTimeout = TASK_TIMEOUT;
+    QElapsedTimer                              taskClock;
+    QHash<const QMetaObject *, TaskClassStats> taskStats;
+    QHash<Task *, RunningTask>                 runningTasks; // go() was called, not done yet
 };
 
 Client::Client(QObject *par) : QObject(par)
@@ -158,35 +267,35 @@ Client::Client(QObject *par) : QObject(par)
     d->osName        = "N/A";
     d->clientName    = "N/A";
     d->clientVersion = "0.0";
+    d->taskClock.start();
 
     d->root = new Task(this, true);
 
-    d->s5bman = new S5BManager(this);
-    connect(d->s5bman, SIGNAL(incomingReady()), SLOT(s5b_incomingReady()));
-
-    d->ibbman = new IBBManager(this);
-    connect(d->ibbman, SIGNAL(incomingReady()), SLOT(ibb_incomingReady()));
-
-    d->bobman = new BoBManager(this);
+    d->lazyPush.insert({ QStringLiteral("iq"), QStringLiteral("http://jabber.org/protocol/bytestreams") },
+                       [this]() { s5bManager(); });
+    d->lazyPush.insert({ QStringLiteral("iq"), QStringLiteral("http://jabber.org/protocol/ibb") },
+                       [this]() { ibbManager(); });
+    d->lazyPush.insert({ QStringLiteral("iq"), QStringLiteral("urn:xmpp:bob") }, [this]() { bobManager(); });
+    d->lazyPush.insert({ QStringLiteral("iq"), Jingle::NS }, [this]() { jingleManager(); });
 
-    d->ftman = nullptr;
+    // asks the server right after login, so it's needed anyway
+    d->serverInfoManager = new ServerInfoManager(this);
 
-    d->capsman = new CapsManager(this);
-
-    d->serverInfoManager        = new ServerInfoManager(this);
-    d->externalServiceDiscovery = new ExternalServiceDiscovery(this);
-    d->stunDiscoManager         = new StunDiscoManager(this);
-    d->httpFileUploadManager    = new HttpFileUploadManager(this);
-
-    d->jingleManager = new Jingle::Manager(this);
-    auto ft          = new Jingle::FileTransfer::Manager(this);
-    d->jingleManager->registerApplication(ft);
-    d->jingleS5BManager = new Jingle::S5B::Manager(d->jingleManager);
-    d->jingleIBBManager = new Jingle::IBB::Manager(d->jingleManager);
-    d->jingleICEManager = new Jingle::ICE::Manager(d->jingleManager);
-    d->jingleManager->registerTransport(d->jingleS5BManager);
-    d->jingleManager->registerTransport(d->jingleIBBManager);
-    d->jingleManager->registerTransport(d->jingleICEManager);
+    connect(d->serverInfoManager, &ServerInfoManager::servicesChanged, this, [this]() {
+        if (!d->namePrefetcher)
+            return;
+        for (const QString &service : d->serverInfoManager->services())
+            d->namePrefetcher->prefetchHost(Jid(service).domain());
+    });
+    connect(d->serverInfoManager, &ServerInfoManager::featuresChanged, this, [this]() {
+        if (!d->namePrefetcher || !externalServiceDiscovery()->isSupported())
+            return;
+        // stun/turn. the list is cached, so the first call won't have to ask for it again
+        d->externalServiceDiscovery->services(d->namePrefetcher, [this](const ExternalServiceList &services) {
+            for (const auto &s : services)
+                d->namePrefetcher->prefetchHost(s->host);
+        });
+    });
 }
 
 Client::~Client()
@@ -200,12 +309,28 @@ Client::~Client()
     delete d->ibbman;
     delete d->s5bman;
     delete d->jingleManager;
+    delete d->iqCalls;
     delete d->root;
     delete d;
     // fprintf(stderr, "\tClient::~Client\n");
 }
 
 void Client::connectToServer(ClientStream *s, const Jid &j, bool auth)
+{
+    setupStream(s);
+    attachStream(s);
+    d->stream->connectToServer(j, auth);
+}
+
+void Client::setupStream(ClientStream *s)
+{
+    for (auto const &e : std::as_const(d->contentSinks))
+        s->addContentSink(e.ns, e.localName, e.sink);
+    if (d->clientHost)
+        s->setTimerWheel(d->clientHost->timerWheel());
+}
+
+void Client::attachStream(ClientStream *s)
 {
     d->stream = s;
     // connect(d->stream, SIGNAL(connected()), SLOT(streamConnected()));
@@ -214,11 +339,122 @@ void Client::connectToServer(ClientStream *s, const Jid &j, bool auth)
     // connect(d->stream, SIGNAL(sslCertificateReady(QSSLCert)), SLOT(streamSSLCertificateReady(QSSLCert)));
     connect(d->stream, SIGNAL(readyRead()), SLOT(streamReadyRead()));
     // connect(d->stream, SIGNAL(closeFinished()), SLOT(streamCloseFinished()));
-    connect(d->stream, SIGNAL(incomingXml(QString)), SLOT(streamIncomingXml(QString)));
-    connect(d->stream, SIGNAL(outgoingXml(QString)), SLOT(streamOutgoingXml(QString)));
+    connectStreamXmlSignals();
     connect(d->stream, SIGNAL(haveUnhandledFeatures()), SLOT(parseUnhandledStreamFeatures()));
+}
 
-    d->stream->connectToServer(j, auth);
+bool Client::handoverStream(ClientStream *next)
+{
+    if (!d->stream || !d->active || d->handover || !next || !next->takeOver(d->stream))
+        return false;
+
+    d->handover   = next;
+    d->streamLost = false;
+    setupStream(next);
+    connect(next, &ClientStream::handedOver, this, [this, next]() {
+        if (d->handover != next)
+            return;
+        d->handover = nullptr;
+        next->disconnect(this);
+
+        // what the old one has read before it was dropped comes first
+        ClientStream *old = d->stream;
+        streamReadyRead();
+        old->disconnect(this);
+        attachStream(next);
+        emit streamHandedOver(old);
+    });
+    auto failed = [this, next]() {
+        if (d->handover != next)
+            return;
+        d->handover = nullptr;
+        next->disconnect(this);
+        if (d->streamLost || !d->stream || d->stream->isTakenOver()) {
+            emit disconnected();
+            cleanup();
+            return;
+        }
+        emit streamHandoverFailed(next);
+    };
+    connect(next, &ClientStream::error, this, failed);
+    connect(next, &ClientStream::connectionClosed, this, failed);
+
+    next->connectToServer(d->stream->jid(), true);
+    return true;
+}
+
+bool Client::isHandingOver() const { return d->handover; }
+
+void Client::setStreamFactory(std::function<ClientStream *()> factory)
+{
+    d->streamFactory = std::move(factory);
+    if (!d->streamFactory) {
+        delete d->netman;
+        d->netman = nullptr;
+        if (d->handoverTimer)
+            d->handoverTimer->stop();
+        return;
+    }
+    if (d->netman)
+        return;
+
+    if (!d->handoverTimer) {
+        d->handoverTimer = new QTimer(this);
+        d->handoverTimer->setSingleShot(true);
+        d->handoverTimer->setInterval(HANDOVER_SETTLE);
+        connect(d->handoverTimer, &QTimer::timeout, this, [this]() {
+            // the factory may say no, e.g. without a network to go to
+            if (!d->streamFactory || !d->stream || !d->active || d->handover || !d->stream->isResumable())
+                return;
+            ClientStream *next = d->streamFactory();
+            if (next && !handoverStream(next))
+                emit streamHandoverFailed(next);
+        });
+    }
+
+    d->netman = new NetInterfaceManager(this);
+    connect(d->netman, &NetInterfaceManager::interfaceAvailable, this, [this](const QString &id) {
+        watchInterface(id);
+        d->handoverTimer->start();
+    });
+    const QStringList ids = d->netman->interfaces();
+    for (const QString &id : ids)
+        watchInterface(id);
+}
+
+void Client::watchInterface(const QString &id)
+{
+    auto iface = new NetInterface(id, d->netman);
+    iface->setParent(d->netman);
+    connect(iface, &NetInterface::unavailable, this, [this, iface]() {
+        iface->deleteLater();
+        d->handoverTimer->start();
+    });
+}
+
+// Building xml console and debug strings for every stanza is expensive, so we do it only for observed signals.
+// The stream is also connected lazily, otherwise ClientStream would always think somebody needs its xml.
+void Client::connectStreamXmlSignals()
+{
+    if (!d->stream)
+        return;
+    if (isSignalConnected(QMetaMethod::fromSignal(&Client::xmlIncoming)))
+        connect(d->stream, SIGNAL(incomingXml(QString)), SLOT(streamIncomingXml(QString)), Qt::UniqueConnection);
+    if (isSignalConnected(QMetaMethod::fromSignal(&Client::xmlOutgoing)))
+        connect(d->stream, SIGNAL(outgoingXml(QString)), SLOT(streamOutgoingXml(QString)), Qt::UniqueConnection);
+}
+
+void Client::connectNotify(const QMetaMethod &signal)
+{
+    if (signal == QMetaMethod::fromSignal(&Client::xmlIncoming)
+        || signal == QMetaMethod::fromSignal(&Client::xmlOutgoing))
+        connectStreamXmlSignals();
+}
+
+bool Client::isOutgoingXmlObserved() const
+{
+    return isSignalConnected(QMetaMethod::fromSignal(&Client::debugText))
+        || isSignalConnected(QMetaMethod::fromSignal(&Client::xmlOutgoing));
 }
 
 void Client::start(const QString &host, const QString &user, const QString &pass, const QString &_resource)
@@ -268,19 +504,57 @@ void Client::setFileTransferEnabled(bool b)
 
 FileTransferManager *Client::fileTransferManager() const { return d->ftman; }
 
-S5BManager *Client::s5bManager() const { return d->s5bman; }
+S5BManager *Client::s5bManager() const
+{
+    if (!d->s5bman) {
+        auto self = const_cast<Client *>(this);
+        d->s5bman = new S5BManager(self);
+        connect(d->s5bman, SIGNAL(incomingReady()), self, SLOT(s5b_incomingReady()));
+    }
+    return d->s5bman;
+}
 
-Jingle::S5B::Manager *Client::jingleS5BManager() const { return d->jingleS5BManager; }
+Jingle::S5B::Manager *Client::jingleS5BManager() const
+{
+    jingleManager();
+    return d->jingleS5BManager;
+}
 
-Jingle::IBB::Manager *Client::jingleIBBManager() const { return d->jingleIBBManager; }
+Jingle::IBB::Manager *Client::jingleIBBManager() const
+{
+    jingleManager();
+    return d->jingleIBBManager;
+}
 
-Jingle::ICE::Manager *Client::jingleICEManager() const { return d->jingleICEManager; }
+Jingle::ICE::Manager *Client::jingleICEManager() const
+{
+    jingleManager();
+    return d->jingleICEManager;
+}
 
-IBBManager *Client::ibbManager() const { return d->ibbman; }
+IBBManager *Client::ibbManager() const
+{
+    if (!d->ibbman) {
+        auto self = const_cast<Client *>(this);
+        d->ibbman = new IBBManager(self);
+        connect(d->ibbman, SIGNAL(incomingReady()), self, SLOT(ibb_incomingReady()));
+    }
+    return d->ibbman;
+}
 
-BoBManager *Client::bobManager() const { return d->bobman; }
+BoBManager *Client::bobManager() const
+{
+    if (!d->bobman)
+        d->bobman = new BoBManager(const_cast<Client *>(this));
+    return d->bobman;
+}
 
-CapsManager *Client::capsManager() const { return d->capsman; }
+CapsManager *Client::capsManager() const
+{
+    if (!d->capsman)
+        d->capsman = new CapsManager(const_cast<Client *>(this));
+    return d->capsman;
+}
 
 void Client::setCapsOptimizationAllowed(bool allowed) { d->capsOptimization = allowed; }
 
@@ -293,15 +567,60 @@ bool Client::capsOptimizationAllowed() const
     return false;
 }
 
+void Client::setNamePrefetchEnabled(bool enabled)
+{
+    if (enabled && !d->namePrefetcher) {
+        d->namePrefetcher = new NamePrefetcher(this);
+    } else if (!enabled && d->namePrefetcher) {
+        delete d->namePrefetcher;
+        d->namePrefetcher = nullptr;
+    }
+}
+
+bool Client::namePrefetchEnabled() const { return d->namePrefetcher; }
+
+NamePrefetcher *Client::namePrefetcher() const { return d->namePrefetcher; }
+
 ServerInfoManager *Client::serverInfoManager() const { return d->serverInfoManager; }
 
-ExternalServiceDiscovery *Client::externalServiceDiscovery() const { return d->externalServiceDiscovery; }
+ExternalServiceDiscovery *Client::externalServiceDiscovery() const
+{
+    if (!d->externalServiceDiscovery)
+        d->externalServiceDiscovery = new ExternalServiceDiscovery(const_cast<Client *>(this));
+    return d->externalServiceDiscovery;
+}
+
+StunDiscoManager *Client::stunDiscoManager() const
+{
+    if (!d->stunDiscoManager)
+        d->stunDiscoManager = new StunDiscoManager(const_cast<Client *>(this));
+    return d->stunDiscoManager;
+}
 
-StunDiscoManager *Client::stunDiscoManager() const { return d->stunDiscoManager; }
+HttpFileUploadManager *Client::httpFileUploadManager() const
+{
+    if (!d->httpFileUploadManager)
+        d->httpFileUploadManager = new HttpFileUploadManager(const_cast<Client *>(this));
+    return d->httpFileUploadManager;
+}
 
-HttpFileUploadManager *Client::httpFileUploadManager() const { return d->httpFileUploadManager; }
+// the whole stack at once, the transports are of no use without it
+Jingle::Manager *Client::jingleManager() const
+{
+    if (d->jingleManager)
+        return d->jingleManager;
 
-Jingle::Manager *Client::jingleManager() const { return d->jingleManager; }
+    auto self        = const_cast<Client *>(this);
+    d->jingleManager = new Jingle::Manager(self);
+    d->jingleManager->registerApplication(new Jingle::FileTransfer::Manager(self));
+    d->jingleS5BManager = new Jingle::S5B::Manager(d->jingleManager);
+    d->jingleIBBManager = new Jingle::IBB::Manager(d->jingleManager);
+    d->jingleICEManager = new Jingle::ICE::Manager(d->jingleManager);
+    d->jingleManager->registerTransport(d->jingleS5BManager);
+    d->jingleManager->registerTransport(d->jingleIBBManager);
+    d->jingleManager->registerTransport(d->jingleICEManager);
+    return d->jingleManager;
+}
 
 bool Client::isActive() const { return d->active; }
 
@@ -362,7 +681,14 @@ bool Client::groupChatJoin(const QString &host, const QString &room, const QStri
     JT_Presence *j = new JT_Presence(rootTask());
     Status       s = _s;
     s.setMUC();
-    s.setMUCHistory(maxchars, maxstanzas, seconds, since);
+    // only what came after the last time, the other limits still apply
+    QDateTime from = since;
+    if (d->groupChatTracking && from.isNull() && seconds < 0) {
+        auto it = d->groupChatSeen.constFind(jid.bare());
+        if (it != d->groupChatSeen.constEnd())
+            from = it->timeStamp;
+    }
+    s.setMUCHistory(maxchars, maxstanzas, seconds, from);
     if (!password.isEmpty()) {
         s.setMUCPassword(password);
     }
@@ -372,6 +698,89 @@ bool Client::groupChatJoin(const QString &host, const QString &room, const QStri
     return true;
 }
 
+bool Client::groupChatQueueJoin(const QString &host, const QString &room, const QString &nick, int priority,
+                                const QString &password, int maxchars, int maxstanzas, int seconds,
+                                const QDateTime &since, const Status &s)
+{
+    Jid jid(room + "@" + host);
+    if (d->groupChatJoining.contains(jid.bare()))
+        return false;
+    for (const GroupChat &i : std::as_const(d->groupChatList)) {
+        if (i.j.compare(jid, false) && i.status != GroupChat::Closing)
+            return false;
+    }
+    for (const auto &q : std::as_const(d->groupChatJoinQueue)) {
+        if (jid.compare(Jid(q.room + "@" + q.host), false))
+            return false;
+    }
+
+    // behind those of the same priority
+    auto it = std::find_if(d->groupChatJoinQueue.begin(), d->groupChatJoinQueue.end(),
+                           [priority](const ClientPrivate::QueuedJoin &q) { return q.priority < priority; });
+    d->groupChatJoinQueue.insert(it, { host, room, nick, password, priority, maxchars, maxstanzas, seconds, since, s });
+    groupChatJoinNext();
+    return true;
+}
+
+void Client::setGroupChatJoinWindow(int rooms)
+{
+    d->groupChatJoinWindow = qMax(rooms, 1);
+    groupChatJoinNext();
+}
+
+int Client::groupChatJoinWindow() const { return d->groupChatJoinWindow; }
+
+int Client::groupChatJoinsPending() const { return int(d->groupChatJoinQueue.size()); }
+
+void Client::groupChatJoinNext()
+{
+    while (!d->groupChatJoinQueue.isEmpty() && d->groupChatJoining.size() < d->groupChatJoinWindow) {
+        auto q = d->groupChatJoinQueue.takeFirst();
+        if (!groupChatJoin(q.host, q.room, q.nick, q.password, q.maxchars, q.maxstanzas, q.seconds, q.since,
+                           q.status))
+            continue;
+        d->groupChatJoining.insert(Jid(q.room + "@" + q.host).bare(), d->taskClock.elapsed());
+    }
+
+    if (d->groupChatJoining.isEmpty()) {
+        if (d->groupChatJoinTimer)
+            d->groupChatJoinTimer->stop();
+        return;
+    }
+    if (!d->groupChatJoinTimer) {
+        d->groupChatJoinTimer = new QTimer(this);
+        d->groupChatJoinTimer->setInterval(1000);
+        connect(d->groupChatJoinTimer, &QTimer::timeout, this, [this]() {
+            // a room which doesn't answer keeps its join, but not its slot
+            qint64 now = d->taskClock.elapsed();
+            for (auto it = d->groupChatJoining.begin(); it != d->groupChatJoining.end();) {
+                if (now - it.value() >= qint64(GROUPCHAT_JOIN_TIMEOUT) * 1000)
+                    it = d->groupChatJoining.erase(it);
+                else
+                    ++it;
+            }
+            groupChatJoinNext();
+        });
+    }
+    if (!d->groupChatJoinTimer->isActive())
+        d->groupChatJoinTimer->start();
+}
+
+// what frees the slot of a queued join: our own presence from the room, or an error for the join
+bool Client::isGroupChatJoinDone(const Jid &j, const Status &s) const
+{
+    auto it = d->groupChatJoining.constFind(j.bare());
+    if (it == d->groupChatJoining.constEnd())
+        return false;
+    if (s.getMUCStatuses().contains(110))
+        return true;
+    for (const GroupChat &i : std::as_const(d->groupChatList)) {
+        if (i.j.compare(j, false))
+            return i.j.resource() == j.resource() || (s.hasError() && j.resource().isEmpty());
+    }
+    return true; // left already
+}
+
 void Client::groupChatSetStatus(const QString &host, const QString &room, const Status &_s)
 {
     Jid  jid(room + "@" + host);
@@ -397,6 +806,13 @@ void Client::groupChatSetStatus(const QString &host, const QString &room, const
 void Client::groupChatLeave(const QString &host, const QString &room, const QString &statusStr)
 {
     Jid jid(room + "@" + host);
+    d->groupChatJoinQueue.erase(std::remove_if(d->groupChatJoinQueue.begin(), d->groupChatJoinQueue.end(),
+                                               [&jid](const ClientPrivate::QueuedJoin &q) {
+                                                   return jid.compare(Jid(q.room + "@" + q.host), false);
+                                               }),
+                                d->groupChatJoinQueue.end());
+    if (d->groupChatJoining.remove(jid.bare()))
+        groupChatJoinNext();
     for (QList<GroupChat>::Iterator it = d->groupChatList.begin(); it != d->groupChatList.end(); it++) {
         GroupChat &i = *it;
 
@@ -417,6 +833,10 @@ void Client::groupChatLeave(const QString &host, const QString &room, const QStr
 
 void Client::groupChatLeaveAll(const QString &statusStr)
 {
+    d->groupChatJoinQueue.clear();
+    d->groupChatJoining.clear();
+    if (d->groupChatJoinTimer)
+        d->groupChatJoinTimer->stop();
     if (d->stream && d->active) {
         for (QList<GroupChat>::Iterator it = d->groupChatList.begin(); it != d->groupChatList.end(); it++) {
             GroupChat &i = *it;
@@ -432,6 +852,39 @@ void Client::groupChatLeaveAll(const QString &statusStr)
     }
 }
 
+void Client::setGroupChatHistoryTracking(bool enabled) { d->groupChatTracking = enabled; }
+
+bool Client::groupChatHistoryTracking() const { return d->groupChatTracking; }
+
+QDateTime Client::groupChatLastSeen(const QString &host, const QString &room) const
+{
+    return d->groupChatSeen.value(room + "@" + host).timeStamp;
+}
+
+QString Client::groupChatLastStanzaId(const QString &host, const QString &room) const
+{
+    return d->groupChatSeen.value(room + "@" + host).stanzaId;
+}
+
+void Client::setGroupChatLastSeen(const QString &host, const QString &room, const QDateTime &ts,
+                                  const QString &stanzaId)
+{
+    auto &seen     = d->groupChatSeen[room + "@" + host];
+    seen.timeStamp = ts;
+    seen.stanzaId  = stanzaId;
+}
+
+const MUCOccupants *Client::groupChatOccupants(const QString &host, const QString &room) const
+{
+    Jid jid(room + "@" + host);
+    for (const GroupChat &gc : std::as_const(d->groupChatList)) {
+        if (gc.j.compare(jid, false)) {
+            return &gc.occupants;
+        }
+    }
+    return nullptr;
+}
+
 QString Client::groupChatNick(const QString &host, const QString &room) const
 {
     Jid jid(room + "@" + host);
@@ -473,8 +926,29 @@ void Client::close(bool)
 void Client::cleanup()
 {
     d->active = false;
+    if (d->namePrefetcher)
+        d->namePrefetcher->clear();
     // d->authed = false;
     d->groupChatList.clear();
+    d->groupChatJoinQueue.clear();
+    d->groupChatJoining.clear();
+    if (d->groupChatJoinTimer)
+        d->groupChatJoinTimer->stop();
+    d->presenceBatch.clear();
+    if (d->handover) {
+        ClientStream *next = d->handover;
+        d->handover        = nullptr;
+        next->disconnect(this);
+        emit streamHandoverFailed(next);
+    }
+    d->presenceBatchIndex.clear();
+    if (d->presenceBatchTimer)
+        d->presenceBatchTimer->stop();
+    d->outgoing.clear();
+    if (d->outgoingTimer)
+        d->outgoingTimer->stop();
+    if (d->iqCalls)
+        d->iqCalls->finishAll(IqReply::Disconnected);
 }
 
 /*void Client::continueAfterCert()
@@ -494,6 +968,12 @@ void Client::streamHandshaken()
 
 void Client::streamError(int)
 {
+    // the stream taking over may still save the session
+    if (d->handover) {
+        d->streamLost = true;
+        return;
+    }
+
     // StreamError e = err;
     // error(e);
 
@@ -518,15 +998,22 @@ void Client::streamReadyRead()
     // fprintf(stderr, "\tClientStream::streamReadyRead\n");
     // fflush(stderr);
 
+    // all the stanzas parsed since the last time, see ClientStream::setReadBudget()
     while (d->stream && d->stream->stanzaAvailable()) {
         Stanza s = d->stream->read();
 
-        QString out = s.toString();
-        debug(QString("Client: incoming: [\n%1]\n").arg(out));
-        emit xmlIncoming(out);
+        // stringified only for somebody looking
+        if (isSignalConnected(QMetaMethod::fromSignal(&Client::debugText))
+            || isSignalConnected(QMetaMethod::fromSignal(&Client::xmlIncoming))) {
+            QString out = s.toString();
+            debug(QString("Client: incoming: [\n%1]\n").arg(out));
+            emit xmlIncoming(out);
+        }
 
         QDomElement x = s.element();
+        d->stanzaDoc  = s.sharedDocument();
         distribute(x);
+        d->stanzaDoc.reset();
     }
 }
 
@@ -552,8 +1039,8 @@ void Client::parseUnhandledStreamFeatures()
     for (const QDomElement &e : nl) {
         if (e.localName() == "c" && e.namespaceURI() == NS_CAPS) {
             d->serverCaps = CapsSpec::fromXml(e);
-            if (d->capsman->isEnabled()) {
-                d->capsman->updateCaps(Jid(d->stream->jid().domain()), d->serverCaps);
+            if (capsManager()->isEnabled()) {
+                capsManager()->updateCaps(Jid(d->stream->jid().domain()), d->serverCaps);
             }
         }
     }
@@ -573,10 +1060,110 @@ QString Client::genUniqueId()
 
 Task *Client::rootTask() { return d->root; }
 
+void Client::setTaskTimeout(int secs) { d->taskTimeout = qMax(0, secs); }
+
+int Client::taskTimeout() const { return d->taskTimeout; }
+
+static qint64 resourceListBytes(const ResourceList &list)
+{
+    qint64 bytes = 0;
+    for (const Resource &r : list)
+        bytes += qint64(sizeof(Resource)) + (r.name().size() + r.status().status().size()) * 2;
+    return bytes;
+}
+
+Client::MemoryUsage Client::memoryUsage() const
+{
+    MemoryUsage ret;
+    for (const LiveRosterItem &i : std::as_const(d->roster)) {
+        ret.roster += qint64(sizeof(LiveRosterItem)) + (i.jid().full().size() + i.name().size()) * 2;
+        for (const QString &g : i.groups())
+            ret.roster += qint64(sizeof(QString)) + g.size() * 2;
+        ret.roster += resourceListBytes(i.resourceList());
+    }
+    ret.resources = resourceListBytes(d->resourceList);
+    if (d->capsman)
+        ret.caps = d->capsman->memoryUsage();
+    if (d->stream) {
+        ret.smQueue = d->stream->smQueueMemory();
+        ret.buffers = d->stream->bufferMemory();
+        ret.parser  = d->stream->parserMemory();
+    }
+    if (d->jingleManager)
+        ret.jingle = d->jingleManager->memoryUsage();
+    return ret;
+}
+
+QString Client::taskReport(int oldest) const
+{
+    QHash<const QMetaObject *, int> running;
+    QList<QPair<qint64, Task *>>    waiting;
+    for (auto it = d->runningTasks.constBegin(); it != d->runningTasks.constEnd(); ++it) {
+        ++running[it.key()->metaObject()];
+        if (it->waiting)
+            waiting.append({ it->since, it.key() });
+    }
+
+    QList<const QMetaObject *> classes = d->taskStats.keys();
+    std::sort(classes.begin(), classes.end(),
+              [](const QMetaObject *a, const QMetaObject *b) { return qstrcmp(a->className(), b->className()) < 0; });
+
+    QString ret = QString::asprintf("%-40s %8s %8s %8s %8s %8s\n", "task", "started", "finished", "timeouts",
+                                    "avg ms", "running");
+    for (auto mo : std::as_const(classes)) {
+        auto const &st = d->taskStats[mo];
+        ret += QString::asprintf("%-40s %8d %8d %8d %8lld %8d\n", mo->className(), st.started, st.finished,
+                                 st.timedOut, st.finished ? st.msecs / st.finished : 0LL, running.value(mo));
+    }
+
+    std::sort(waiting.begin(), waiting.end());
+    if (!waiting.isEmpty())
+        ret += QLatin1String("\nwaiting for a reply:\n");
+    qint64 now = d->taskClock.elapsed();
+    for (int i = 0; i < waiting.size() && i < oldest; ++i) {
+        auto t = waiting[i].second;
+        ret += QString::asprintf("%8llds %-40s %s\n", (now - waiting[i].first) / 1000, t->metaObject()->className(),
+                                 qUtf8Printable(t->id()));
+    }
+    return ret;
+}
+
+void Client::taskStarted(Task *t)
+{
+    ++d->taskStats[t->metaObject()].started;
+    d->runningTasks.insert(t, { d->taskClock.elapsed(), false });
+}
+
+void Client::taskWaiting(Task *t)
+{
+    auto it = d->runningTasks.find(t);
+    if (it != d->runningTasks.end())
+        it->waiting = true;
+}
+
+void Client::taskDone(Task *t, bool timedOut)
+{
+    auto it = d->runningTasks.find(t);
+    if (it == d->runningTasks.end())
+        return;
+    auto &st = d->taskStats[t->metaObject()];
+    ++st.finished;
+    if (timedOut)
+        ++st.timedOut;
+    st.msecs += d->taskClock.elapsed() - it->since;
+    d->runningTasks.erase(it);
+}
+
+void Client::taskDestroyed(Task *t) { d->runningTasks.remove(t); }
+
 QDomDocument *Client::doc() const { return &d->doc; }
 
+QSharedPointer<QDomDocument> Client::stanzaDocument() const { return d->stanzaDoc; }
+
 void Client::distribute(const QDomElement &x)
 {
+    IRIS_STALL_WATCH(Distribute, x.tagName() + '/' + x.attribute(QStringLiteral("type")) + ' '
+                                     + x.firstChildElement().namespaceURI());
     static QString fromAttr(QStringLiteral("from"));
     if (x.hasAttribute(fromAttr)) {
         Jid j(x.attribute(fromAttr));
@@ -586,7 +1173,21 @@ void Client::distribute(const QDomElement &x)
         }
     }
 
-    if (!rootTask()->take(x) && (x.attribute("type") == "get" || x.attribute("type") == "set")) {
+    if (d->iqCalls && d->iqCalls->take(x, d->stanzaDoc))
+        return;
+
+    bool taken = rootTask()->take(x);
+    if (!taken && !d->lazyPush.isEmpty()) {
+        auto it = d->lazyPush.find(qMakePair(x.tagName(), x.firstChildElement().namespaceURI()));
+        if (it != d->lazyPush.end()) {
+            auto create = std::move(it.value());
+            d->lazyPush.erase(it);
+            create(); // its push task is there now
+            taken = rootTask()->take(x);
+        }
+    }
+
+    if (!taken && (x.attribute("type") == "get" || x.attribute("type") == "set")) {
         debug("Client: Unrecognized IQ.\n");
 
         // Create reply element
@@ -610,7 +1211,7 @@ void Client::distribute(const QDomElement &x)
     }
 }
 
-void Client::send(const QDomElement &x)
+void Client::send(const QDomElement &x, Stanza::Priority priority)
 {
     if (!d->stream)
         return;
@@ -633,14 +1234,37 @@ void Client::send(const QDomElement &x)
     if (e.isNull()) {              // so it was changed by signal above
         return;
     }
-    QString out = s.toString();
-    // qWarning() << "Out: " << out;
-    debug(QString("Client: outgoing: [\n%1]\n").arg(out));
-    emit xmlOutgoing(out);
+    if (isOutgoingXmlObserved()) {
+        QString out = s.toString();
+        // qWarning() << "Out: " << out;
+        debug(QString("Client: outgoing: [\n%1]\n").arg(out));
+        emit xmlOutgoing(out);
+    }
 
     // printf("x[%s] x2[%s] s[%s]\n", Stream::xmlToString(x).toLatin1(), Stream::xmlToString(e).toLatin1(),
     // s.toString().toLatin1());
-    d->stream->write(s);
+    d->stream->write(s, priority);
+}
+
+void Client::send(const Stanza::Builder &b, Stanza::Priority priority)
+{
+    if (!d->stream)
+        return;
+
+    // plugins may change the stanza, so they get a tree like for all the others
+    if (isSignalConnected(QMetaMethod::fromSignal(&Client::stanzaElementOutgoing))) {
+        QDomElement e = b.toElement(d->stream->doc());
+        if (!e.isNull())
+            send(e, priority == Stanza::Priority::Auto ? b.priority() : priority);
+        return;
+    }
+
+    if (isOutgoingXmlObserved()) {
+        QString out = QString::fromUtf8(b.data());
+        debug(QString("Client: outgoing: [\n%1]\n").arg(out));
+        emit xmlOutgoing(out);
+    }
+    d->stream->write(b, priority);
 }
 
 void Client::send(const QString &str)
@@ -648,11 +1272,71 @@ void Client::send(const QString &str)
     if (!d->stream)
         return;
 
-    debug(QString("Client: outgoing: [\n%1]\n").arg(str));
-    emit xmlOutgoing(str);
+    if (isOutgoingXmlObserved()) {
+        debug(QString("Client: outgoing: [\n%1]\n").arg(str));
+        emit xmlOutgoing(str);
+    }
     static_cast<ClientStream *>(d->stream)->writeDirect(str);
 }
 
+void Client::sendToMany(const QDomElement &x, const QList<Jid> &recipients)
+{
+    if (!d->stream || recipients.isEmpty())
+        return;
+
+    Stanza::Kind kind = Stanza::kind(x.tagName());
+    if (int(kind) == -1)
+        return;
+
+    // one which has addresses already is the caller's business
+    const QString &multicast = d->serverInfoManager->multicastService();
+    if (recipients.size() > 1 && !multicast.isEmpty() && x.firstChildElement(QStringLiteral("addresses")).isNull()) {
+        QDomElement e = x.cloneNode(true).toElement();
+        e.setAttribute(QStringLiteral("to"), multicast);
+        QDomElement addresses = doc()->createElementNS(QStringLiteral("http://jabber.org/protocol/address"),
+                                                       QStringLiteral("addresses"));
+        for (const Jid &j : recipients) {
+            QDomElement a = doc()->createElementNS(QStringLiteral("http://jabber.org/protocol/address"),
+                                                   QStringLiteral("address"));
+            a.setAttribute(QStringLiteral("type"), QStringLiteral("bcc"));
+            a.setAttribute(QStringLiteral("jid"), j.full());
+            addresses.appendChild(a);
+        }
+        e.appendChild(addresses);
+        send(e);
+        return;
+    }
+
+    // the builder writes no other attributes of the stanza, e.g. xml:lang. those go as trees
+    const QDomNamedNodeMap attrs = x.attributes();
+    bool                   plain = true;
+    for (int n = 0; n < attrs.count() && plain; ++n) {
+        const QString name = attrs.item(n).nodeName();
+        plain = name == QLatin1String("to") || name == QLatin1String("type") || name == QLatin1String("id")
+            || name == QLatin1String("xmlns");
+    }
+    if (!plain) {
+        for (const Jid &j : recipients) {
+            QDomElement e = x.cloneNode(true).toElement();
+            e.setAttribute(QStringLiteral("to"), j.full());
+            send(e);
+        }
+        return;
+    }
+
+    Stanza::Builder children(kind);
+    for (QDomElement c = x.firstChildElement(); !c.isNull(); c = c.nextSiblingElement())
+        children.element(c);
+    const QByteArray content = children.content();
+    const QString    type    = x.attribute(QStringLiteral("type"));
+    const QString    id      = x.attribute(QStringLiteral("id"));
+    for (const Jid &j : recipients) {
+        Stanza::Builder b(kind, j.full(), type, id);
+        b.appendContent(content);
+        send(b, children.priority());
+    }
+}
+
 /* drops any pending outgoing xml elements */
 void Client::clearSendQueue()
 {
@@ -660,6 +1344,29 @@ void Client::clearSendQueue()
         d->stream->clearSendQueue();
 }
 
+IqCall Client::iq(const QDomElement &request, int timeout)
+{
+    if (!d->iqCalls)
+        d->iqCalls = new IqCallTable(this);
+    return d->iqCalls->start(request, timeout);
+}
+
+void Client::addContentSink(const QString &ns, const QString &localName, ContentSink *sink)
+{
+    d->contentSinks += { ns, localName, sink };
+    if (d->stream)
+        d->stream->addContentSink(ns, localName, sink);
+}
+
+void Client::removeContentSink(ContentSink *sink)
+{
+    d->contentSinks.erase(std::remove_if(d->contentSinks.begin(), d->contentSinks.end(),
+                                         [sink](auto const &e) { return e.sink == sink; }),
+                          d->contentSinks.end());
+    if (d->stream)
+        d->stream->removeContentSink(sink);
+}
+
 bool Client::hasStream() const { return !!d->stream; }
 
 Stream &Client::stream() { return *(d->stream.data()); }
@@ -701,10 +1408,94 @@ void Client::setNetworkAccessManager(QNetworkAccessManager *qnam) { d->qnam = qn
 
 QNetworkAccessManager *Client::networkAccessManager() const { return d->qnam; }
 
+void Client::setClientHost(ClientHost *host)
+{
+    d->clientHost = host;
+    if (d->stream)
+        d->stream->setTimerWheel(host ? host->timerWheel() : nullptr);
+}
+
+ClientHost *Client::clientHost() const { return d->clientHost; }
+
 void Client::ppSubscription(const Jid &j, const QString &s, const QString &n) { emit subscription(j, s, n); }
 
+void Client::setPresenceBatching(int msecs)
+{
+    if (msecs < 0)
+        flushPresenceBatch();
+    d->presenceBatching = msecs;
+    if (msecs >= 0 && !d->presenceBatchTimer) {
+        d->presenceBatchTimer = new QTimer(this);
+        d->presenceBatchTimer->setSingleShot(true);
+        connect(d->presenceBatchTimer, &QTimer::timeout, this, &Client::flushPresenceBatch);
+    }
+}
+
+int Client::presenceBatching() const { return d->presenceBatching; }
+
+// whatever doesn't change the state of a groupchat. joins, leaves and errors are processed after the batch
+// collected so far, so the order is kept
+bool Client::isBatchablePresence(const Jid &j, const Status &s) const
+{
+    if (s.hasError())
+        return false;
+    for (const GroupChat &i : std::as_const(d->groupChatList)) {
+        if (i.j.compare(j, false))
+            return i.status == GroupChat::Connected;
+    }
+    return true;
+}
+
+void Client::flushPresenceBatch()
+{
+    if (d->presenceBatchTimer)
+        d->presenceBatchTimer->stop();
+    if (d->presenceBatch.isEmpty())
+        return;
+
+    QList<QPair<Jid, Status>> batch = std::move(d->presenceBatch);
+    d->presenceBatch.clear();
+    d->presenceBatchIndex.clear();
+
+    d->quietPresence = true;
+    for (const auto &p : std::as_const(batch)) {
+        auto gc = std::find_if(d->groupChatList.begin(), d->groupChatList.end(),
+                               [&p](const GroupChat &i) { return i.j.compare(p.first, false); });
+        if (gc != d->groupChatList.end())
+            gc->updateOccupant(p.first, p.second);
+        else
+            applyPresence(p.first, p.second);
+    }
+    d->quietPresence = false;
+
+    emit presenceBatch(batch);
+}
+
 void Client::ppPresence(const Jid &j, const Status &s)
 {
+    if (isGroupChatJoinDone(j, s)) {
+        d->groupChatJoining.remove(j.bare());
+        // once this one is processed, batched or not
+        QTimer::singleShot(0, this, &Client::groupChatJoinNext);
+    }
+
+    if (d->presenceBatching >= 0) {
+        if (isBatchablePresence(j, s)) {
+            // only the last one of a jid matters
+            auto it = d->presenceBatchIndex.constFind(j.full());
+            if (it != d->presenceBatchIndex.constEnd()) {
+                d->presenceBatch[it.value()].second = s;
+            } else {
+                d->presenceBatchIndex.insert(j.full(), int(d->presenceBatch.size()));
+                d->presenceBatch.append({ j, s });
+            }
+            if (!d->presenceBatchTimer->isActive())
+                d->presenceBatchTimer->start(d->presenceBatching);
+            return;
+        }
+        flushPresenceBatch();
+    }
+
     if (s.isAvailable())
         debug(QString("Client: %1 is available.\n").arg(j.full()));
     else
@@ -727,12 +1518,15 @@ void Client::ppPresence(const Jid &j, const Status &s)
                     // don't signal success unless it is a non-error presence
                     if (!s.hasError()) {
                         i.status = GroupChat::Connected;
+                        i.updateOccupant(j, s);
                         emit groupChatJoined(i.j);
                     }
                     emit groupChatPresence(j, s);
                 }
                 break;
             case GroupChat::Connected:
+                if (!s.hasError())
+                    i.updateOccupant(j, s);
                 emit groupChatPresence(j, s);
                 break;
             case GroupChat::Closing:
@@ -755,17 +1549,20 @@ void Client::ppPresence(const Jid &j, const Status &s)
         return;
     }
 
+    applyPresence(j, s);
+}
+
+void Client::applyPresence(const Jid &j, const Status &s)
+{
     // is it me?
     if (j.compare(jid(), false)) {
         updateSelfPresence(j, s);
     } else {
         // update all relavent roster entries
-        for (LiveRoster::Iterator it = d->roster.begin(); it != d->roster.end(); ++it) {
+        const auto items = d->roster.findAll(j, false);
+        for (LiveRoster::Iterator it : items) {
             LiveRosterItem &i = *it;
 
-            if (!i.jid().compare(j, false))
-                continue;
-
             // roster item has its own resource?
             if (!i.jid().resource().isEmpty()) {
                 if (i.jid().resource() != j.resource())
@@ -787,7 +1584,8 @@ void Client::updateSelfPresence(const Jid &j, const Status &s)
         if (found) {
             debug(QString("Client: Removing self resource: name=[%1]\n").arg(j.resource()));
             (*rit).setStatus(s);
-            emit resourceUnavailable(j, *rit);
+            if (!d->quietPresence)
+                emit resourceUnavailable(j, *rit);
             d->resourceList.erase(rit);
         }
     }
@@ -799,12 +1597,13 @@ void Client::updateSelfPresence(const Jid &j, const Status &s)
             d->resourceList += r;
             debug(QString("Client: Adding self resource: name=[%1]\n").arg(j.resource()));
         } else {
-            (*rit).setStatus(s);
+            d->resourceList.setStatus(rit, s);
             r = *rit;
             debug(QString("Client: Updating self resource: name=[%1]\n").arg(j.resource()));
         }
 
-        emit resourceAvailable(j, r);
+        if (!d->quietPresence)
+            emit resourceAvailable(j, r);
     }
 }
 
@@ -818,9 +1617,12 @@ void Client::updatePresence(LiveRosterItem *i, const Jid &j, const Status &s)
         if (found) {
             (*rit).setStatus(s);
             debug(QString("Client: Removing resource from [%1]: name=[%2]\n").arg(i->jid().full(), j.resource()));
-            emit resourceUnavailable(j, *rit);
+            if (!d->quietPresence)
+                emit resourceUnavailable(j, *rit);
             i->resourceList().erase(rit);
             i->setLastUnavailableStatus(s);
+        } else if (d->quietPresence) {
+            i->setLastUnavailableStatus(s);
         } else {
             // create the resource just for the purpose of emit
             Resource r = Resource(j.resource(), s);
@@ -839,12 +1641,13 @@ void Client::updatePresence(LiveRosterItem *i, const Jid &j, const Status &s)
             i->resourceList() += r;
             debug(QString("Client: Adding resource to [%1]: name=[%2]\n").arg(i->jid().full(), j.resource()));
         } else {
-            (*rit).setStatus(s);
+            i->resourceList().setStatus(rit, s);
             r = *rit;
             debug(QString("Client: Updating resource to [%1]: name=[%2]\n").arg(i->jid().full(), j.resource()));
         }
 
-        emit resourceAvailable(j, r);
+        if (!d->quietPresence)
+            emit resourceAvailable(j, r);
     }
 }
 
@@ -855,11 +1658,18 @@ void Client::pmMessage(const Message &m)
     // bits of binary. we can't do this in Message, since it knows nothing about Client
     auto const &dataList = m.bobDataList();
     for (const BoBData &b : dataList) {
-        d->bobman->append(b);
+        bobManager()->append(b);
     }
 
     if (!m.ibbData().data.isEmpty()) {
-        d->ibbman->takeIncomingData(m.from(), m.id(), m.ibbData(), Stanza::Message);
+        ibbManager()->takeIncomingData(m.from(), m.id(), m.ibbData(), Stanza::Message);
+    }
+
+    // the same items again, e.g. with +notify on login. a message with a body still goes through
+    if (d->pepCache && m.type() != Message::Type::Groupchat && !m.pubsubNode().isEmpty() && m.body().isEmpty()
+        && !d->pepCache->apply(m)) {
+        debug(QString("Client: Unchanged %1 items of %2\n").arg(m.pubsubNode(), m.from().full()));
+        return;
     }
 
     if (m.type() == Message::Type::Groupchat) {
@@ -869,44 +1679,88 @@ void Client::pmMessage(const Message &m)
             if (!i.j.compare(m.from(), false))
                 continue;
 
-            if (i.status == GroupChat::Connected)
-                emit messageReceived(m);
+            if (i.status != GroupChat::Connected)
+                continue;
+
+            if (d->groupChatTracking && !m.body().isEmpty()) {
+                auto       &seen = d->groupChatSeen[i.j.bare()];
+                const auto &sid  = m.stanzaId();
+                QString     id   = sid.by.compare(i.j, false) ? sid.id : QString();
+                // the last one seen again, from a server which rounds "since" down
+                if (m.spooled() && !id.isEmpty() && id == seen.stanzaId)
+                    continue;
+                seen.stanzaId  = id;
+                seen.timeStamp = m.timeStamp();
+            }
+            emit messageReceived(m);
         }
     } else
         emit messageReceived(m);
 }
 
-void Client::prRoster(const Roster &r) { importRoster(r); }
+void Client::prRoster(const Roster &r)
+{
+    importRoster(r);
+    if (d->rosterStore)
+        d->rosterStore->applyPush(r);
+}
+
+void Client::setRosterStore(RosterStore *store) { d->rosterStore = store; }
+
+RosterStore *Client::rosterStore() const { return d->rosterStore; }
+
+void Client::setPEPCache(PEPCache *cache) { d->pepCache = cache; }
+
+PEPCache *Client::pepCache() const { return d->pepCache; }
+
+void Client::setMessageIdIndex(MessageIdIndex *index) { d->messageIdIndex = index; }
+
+MessageIdIndex *Client::messageIdIndex() const { return d->messageIdIndex; }
+
+void Client::restoreRoster()
+{
+    if (d->rosterStore)
+        importRoster(d->rosterStore->roster());
+}
 
 void Client::rosterRequest(bool withGroupsDelimiter)
 {
     if (!d->active)
         return;
 
-    JT_Roster *r = new JT_Roster(rootTask());
     if (withGroupsDelimiter) {
-        connect(r, &JT_Roster::finished, this, [this, r]() mutable {
+        JT_Roster *r = new JT_Roster(rootTask());
+        connect(r, &JT_Roster::finished, this, [this, r]() {
             if (r->success()) {
                 d->roster.setGroupsDelimiter(r->groupsDelimiter());
                 emit rosterGroupsDelimiterRequestFinished(r->groupsDelimiter());
             }
 
-            r = new JT_Roster(rootTask());
-            connect(r, SIGNAL(finished()), SLOT(slotRosterRequestFinished()));
-            r->get();
-            d->roster.flagAllForDelete(); // mod_groups patch
-            r->go(true);
+            startRosterGet();
         });
         r->getGroupsDelimiter();
         // WORKAROUND: Some bad servers (Facebook for example) don't respond
         // on groups delimiter request. Wait timeout and go ahead.
         r->setTimeout(GROUPS_DELIMITER_TIMEOUT);
+        r->go(true);
     } else {
-        connect(r, SIGNAL(finished()), SLOT(slotRosterRequestFinished()));
-        r->get();
-        d->roster.flagAllForDelete(); // mod_groups patch
+        startRosterGet();
     }
+}
 
+void Client::startRosterGet()
+{
+    JT_Roster *r = new JT_Roster(rootTask());
+    connect(r, SIGNAL(finished()), SLOT(slotRosterRequestFinished()));
+    if (d->rosterStore && d->stream && d->stream->streamFeatures().rosterver_supported) {
+        // the server may answer with just "unchanged", so what we have must match the version we send
+        if (d->roster.isEmpty())
+            restoreRoster();
+        r->get(d->rosterStore->roster().version());
+    } else {
+        r->get();
+    }
+    d->roster.flagAllForDelete(); // mod_groups patch
     r->go(true);
 }
 
@@ -914,19 +1768,25 @@ void Client::slotRosterRequestFinished()
 {
     JT_Roster *r = static_cast<JT_Roster *>(sender());
     // on success, let's take it
-    if (r->success()) {
+    if (r->success() && r->isUnchanged()) {
+        // nothing goes away, the changes will come as pushes
+        for (LiveRoster::Iterator it = d->roster.begin(); it != d->roster.end(); ++it)
+            (*it).setFlagForDelete(false);
+    } else if (r->success()) {
         // d->roster.flagAllForDelete(); // mod_groups patch
 
         importRoster(r->roster());
+        if (d->rosterStore)
+            d->rosterStore->setRoster(r->roster());
 
-        for (LiveRoster::Iterator it = d->roster.begin(); it != d->roster.end();) {
-            LiveRosterItem &i = *it;
-            if (i.flagForDelete()) {
+        // one sweep, erasing them one by one would shift the rest of the list every time
+        for (const LiveRosterItem &i : std::as_const(d->roster)) {
+            if (i.flagForDelete())
                 emit rosterItemRemoved(i);
-                it = d->roster.erase(it);
-            } else
-                ++it;
         }
+        d->roster.erase(std::remove_if(d->roster.begin(), d->roster.end(),
+                                       [](const LiveRosterItem &i) { return i.flagForDelete(); }),
+                        d->roster.end());
     } else {
         // don't report a disconnect.  Client::error() will do that.
         if (r->statusCode() == Task::ErrDisc)
@@ -944,36 +1804,27 @@ void Client::importRoster(const Roster &r)
         importRosterItem(item);
     }
     emit endImportRoster();
-}
 
-void Client::importRosterItem(const RosterItem &item)
-{
-    QString substr;
-    switch (item.subscription().type()) {
-    case Subscription::Both:
-        substr = "<-->";
-        break;
-    case Subscription::From:
-        substr = "  ->";
-        break;
-    case Subscription::To:
-        substr = "<-  ";
-        break;
-    case Subscription::Remove:
-        substr = "xxxx";
-        break;
-    case Subscription::None:
-    default:
-        substr = "----";
-        break;
+    if (d->namePrefetcher) {
+        // our own domain is resolved already, the others are mostly conferences and transports
+        for (const auto &item : r) {
+            if (item.jid().domain() != jid().domain())
+                d->namePrefetcher->prefetchHost(item.jid().domain());
+        }
     }
+}
 
-    QString dstr, str = QString::asprintf("  %s %-32s", qPrintable(substr), qPrintable(item.jid().full()));
-    if (!item.name().isEmpty())
-        str += QString(" [") + item.name() + "]";
-    str += '\n';
+// whether applying b to a would change anything the application sees
+static bool sameRosterItem(const RosterItem &a, const RosterItem &b)
+{
+    return a.jid().full() == b.jid().full() && a.name() == b.name() && a.groups() == b.groups()
+        && a.subscription().type() == b.subscription().type() && a.ask() == b.ask();
+}
 
+void Client::importRosterItem(const RosterItem &item)
+{
     // Remove
+    QString dstr;
     if (item.subscription().type() == Subscription::Remove) {
         LiveRoster::Iterator it = d->roster.find(item.jid());
         if (it != d->roster.end()) {
@@ -988,9 +1839,15 @@ void Client::importRosterItem(const RosterItem &item)
         if (it != d->roster.end()) {
             LiveRosterItem &i = *it;
             i.setFlagForDelete(false);
-            i.setRosterItem(item);
-            emit rosterItemUpdated(i);
-            dstr = "Client: (Updated) ";
+            // a full roster repeats mostly what we have, only the changes are signalled
+            if (sameRosterItem(i, item)) {
+                i.setIsPush(item.isPush());
+                dstr = "Client: (Same)    ";
+            } else {
+                i.setRosterItem(item);
+                emit rosterItemUpdated(i);
+                dstr = "Client: (Updated) ";
+            }
         } else {
             LiveRosterItem i(item);
             d->roster += i;
@@ -1001,15 +1858,142 @@ void Client::importRosterItem(const RosterItem &item)
         }
     }
 
+    if (!isSignalConnected(QMetaMethod::fromSignal(&Client::debugText)))
+        return;
+
+    QString substr;
+    switch (item.subscription().type()) {
+    case Subscription::Both:
+        substr = "<-->";
+        break;
+    case Subscription::From:
+        substr = "  ->";
+        break;
+    case Subscription::To:
+        substr = "<-  ";
+        break;
+    case Subscription::Remove:
+        substr = "xxxx";
+        break;
+    case Subscription::None:
+    default:
+        substr = "----";
+        break;
+    }
+
+    QString str = QString::asprintf("  %s %-32s", qPrintable(substr), qPrintable(item.jid().full()));
+    if (!item.name().isEmpty())
+        str += QString(" [") + item.name() + "]";
+    str += '\n';
+
     debug(dstr + str);
 }
 
+void Client::setOutgoingCoalescing(int msecs)
+{
+    if (msecs < 0)
+        flushOutgoing();
+    d->outgoingCoalescing = msecs;
+    if (msecs >= 0 && !d->outgoingTimer) {
+        d->outgoingTimer = new QTimer(this);
+        d->outgoingTimer->setSingleShot(true);
+        connect(d->outgoingTimer, &QTimer::timeout, this, &Client::flushOutgoing);
+    }
+}
+
+int Client::outgoingCoalescing() const { return d->outgoingCoalescing; }
+
 void Client::sendMessage(Message &m)
 {
+    if (!d->outgoing.isEmpty())
+        takeOutgoing(m);
     JT_Message *j = new JT_Message(rootTask(), m);
     j->go(true);
 }
 
+void Client::sendMessageToMany(const Message &m, const QList<Jid> &recipients)
+{
+    if (!d->stream || recipients.isEmpty())
+        return;
+
+    if (d->encryptionHandler) {
+        for (const Jid &j : recipients) {
+            Message copy(m);
+            copy.setTo(j);
+            sendMessage(copy);
+        }
+        return;
+    }
+
+    Message copy(m);
+    copy.setTo(recipients.first());
+    sendToMany(copy.toStanza(d->stream.data()).element(), recipients);
+}
+
+void Client::queueMessage(const Message &m)
+{
+    if (d->outgoingCoalescing < 0) {
+        Message copy(m);
+        sendMessage(copy);
+        return;
+    }
+
+    auto &o = d->outgoing[m.to().full()];
+    o.to    = m.to();
+    o.type  = m.type();
+    o.hints = m.processingHints();
+    if (m.chatState() != StateNone)
+        o.state = m.chatState();
+    if (m.messageReceipt() == ReceiptReceived)
+        o.receipts += m.messageReceiptId();
+    if (!d->outgoingTimer->isActive())
+        d->outgoingTimer->start(d->outgoingCoalescing);
+}
+
+// what is waiting for the same jid goes with this one. a waiting chat state is outdated by it anyway
+void Client::takeOutgoing(Message &m)
+{
+    auto it = d->outgoing.find(m.to().full());
+    if (it == d->outgoing.end())
+        return;
+    if (m.chatState() == StateNone && it->state != StateNone && m.body().isEmpty())
+        m.setChatState(it->state);
+    it->state = StateNone;
+    if (m.messageReceipt() == ReceiptNone && !it->receipts.isEmpty()) {
+        m.setMessageReceipt(ReceiptReceived);
+        m.setMessageReceiptId(it->receipts.takeFirst());
+    }
+    if (it->receipts.isEmpty())
+        d->outgoing.erase(it);
+}
+
+void Client::flushOutgoing()
+{
+    if (d->outgoingTimer)
+        d->outgoingTimer->stop();
+    const auto outgoing = std::move(d->outgoing);
+    d->outgoing.clear();
+    for (const auto &o : outgoing) {
+        if (o.state == StateNone && o.receipts.isEmpty())
+            continue;
+        ChatState state = o.state;
+        int       i     = 0;
+        do {
+            Message m(o.to);
+            m.setType(o.type);
+            m.setProcessingHints(o.hints);
+            m.setChatState(state);
+            if (i < o.receipts.size()) {
+                m.setMessageReceipt(ReceiptReceived);
+                m.setMessageReceiptId(o.receipts.at(i));
+            }
+            JT_Message *j = new JT_Message(rootTask(), m);
+            j->go(true);
+            state = StateNone; // with the first one only
+        } while (++i < o.receipts.size());
+    }
+}
+
 void Client::sendSubscription(const Jid &jid, const QString &type, const QString &nick)
 {
     JT_Presence *j = new JT_Presence(rootTask());
@@ -1019,12 +2003,6 @@ void Client::sendSubscription(const Jid &jid, const QString &type, const QString
 
 void Client::setPresence(const Status &s)
 {
-    if (d->capsman->isEnabled()) {
-        if (d->caps.version().isEmpty() && !d->caps.node().isEmpty()) {
-            d->caps = CapsSpec(makeDiscoResult(d->caps.node())); /* recompute caps hash */
-        }
-    }
-
     JT_Presence *j = new JT_Presence(rootTask());
     j->pres(s);
     j->go(true);
@@ -1036,6 +2014,68 @@ void Client::setPresence(const Status &s)
     // r.setStatus(s);
 }
 
+// only what presenceContent() writes. the muc bits go after it, per room
+static bool samePresenceContent(const Status &a, const Status &b)
+{
+    if (a.show() != b.show() || a.status() != b.status() || a.priority() != b.priority() || a.keyID() != b.keyID()
+        || a.xsigned() != b.xsigned() || a.photoHash() != b.photoHash())
+        return false;
+
+    const auto la = a.bobDataList();
+    const auto lb = b.bobDataList();
+    return std::equal(la.begin(), la.end(), lb.begin(), lb.end(),
+                      [](const BoBData &x, const BoBData &y) { return x.cid() == y.cid(); });
+}
+
+QByteArray Client::presenceContent(const Status &s)
+{
+    CapsSpec caps;
+    if (capsManager()->isEnabled()) {
+        if (d->caps.version().isEmpty() && !d->caps.node().isEmpty()) {
+            d->caps = CapsSpec(makeDiscoResult(d->caps.node())); /* recompute caps hash */
+        }
+        if (!capsOptimizationAllowed() && d->caps.isValid())
+            caps = d->caps;
+    }
+
+    if (d->hasPresenceContent && caps == d->presenceCaps && samePresenceContent(s, d->presenceStatus))
+        return d->presenceContent;
+
+    Stanza::Builder b(Stanza::Presence);
+    if (!s.show().isEmpty())
+        b.textElement(QLatin1String("show"), s.show());
+    if (!s.status().isEmpty())
+        b.textElement(QLatin1String("status"), s.status());
+
+    b.textElement(QLatin1String("priority"), QString::number(s.priority()));
+
+    if (!s.keyID().isEmpty())
+        b.textElement(QLatin1String("x"), s.keyID(), QLatin1String("http://jabber.org/protocol/e2e"));
+    if (!s.xsigned().isEmpty())
+        b.textElement(QLatin1String("x"), s.xsigned(), QLatin1String("jabber:x:signed"));
+
+    if (caps.isValid())
+        b.element(caps.toXml(&d->doc));
+
+    if (s.photoHash().has_value()) {
+        b.open(QLatin1String("x"), QLatin1String("vcard-temp:x:update"));
+        b.textElement(QLatin1String("photo"), QString::fromLatin1(s.photoHash()->toHex()));
+        b.close();
+    }
+
+    // bits of binary
+    const auto &bdlist = s.bobDataList();
+    for (const BoBData &bd : bdlist) {
+        b.element(bd.toXml(&d->doc));
+    }
+
+    d->presenceStatus     = s;
+    d->presenceCaps       = caps;
+    d->presenceContent    = b.content();
+    d->hasPresenceContent = true;
+    return d->presenceContent;
+}
+
 QString Client::OSName() const { return d->osName; }
 
 QString Client::OSVersion() const { return d->osVersion; }
@@ -1152,7 +2192,12 @@ DiscoItem Client::makeDiscoResult(const QString &node) const
     features.addFeature("urn:xmpp:message-correct:0");
     features.addFeature("urn:xmpp:jingle:1");
     features.addFeature("urn:xmpp:extdisco:2");
-    features += d->jingleManager->discoFeatures();
+    if (d->jingleManager) {
+        features += d->jingleManager->discoFeatures();
+    } else { // what jingleManager() will make
+        features += QStringList { Jingle::FileTransfer::NS, Jingle::S5B::NS, Jingle::IBB::NS };
+        features += Jingle::ICE::Manager::supportedFeatures();
+    }
 
     // TODO rather do foreach for all registered jingle apps and transports
     // TODO: since it depends on UI it needs a way to be disabled
@@ -1281,6 +2326,18 @@ void LiveRosterItem::setFlagForDelete(bool b) { v_flagForDelete = b; }
 class LiveRoster::Private {
 public:
     QString groupsDelimiter;
+
+    // bare jid -> positions in the list
+    QMultiHash<QString, int> index;
+    int                      indexedSize = -1;
+
+    void rebuildIndex(const LiveRoster &list)
+    {
+        index.clear();
+        for (int n = 0; n < list.size(); ++n)
+            index.insert(list.at(n).jid().bare(), n);
+        indexedSize = list.size();
+    }
 };
 
 LiveRoster::LiveRoster() : QList<LiveRosterItem>(), d(new LiveRoster::Private) { }
@@ -1295,6 +2352,7 @@ LiveRoster &LiveRoster::operator=(const LiveRoster &other)
 {
     QList<LiveRosterItem>::operator=(other);
     d->groupsDelimiter = other.d->groupsDelimiter;
+    d->indexedSize     = -1;
     return *this;
 }
 void LiveRoster::flagAllForDelete()
@@ -1303,24 +2361,90 @@ void LiveRoster::flagAllForDelete()
         (*it).setFlagForDelete(true);
 }
 
-LiveRoster::Iterator LiveRoster::find(const Jid &j, bool compareRes)
+// Returns positions of the items matching \a j in list order
+QList<int> LiveRoster::positions(const Jid &j, bool compareRes) const
 {
-    Iterator it;
-    for (it = begin(); it != end(); ++it) {
-        if ((*it).jid().compare(j, compareRes))
+    if (d->indexedSize != size())
+        d->rebuildIndex(*this);
+
+    QList<int> candidates = d->index.values(j.bare());
+    for (int n : std::as_const(candidates)) {
+        if (n >= size() || at(n).jid().bare() != j.bare()) {
+            // the list was modified behind our back
+            d->rebuildIndex(*this);
+            candidates = d->index.values(j.bare());
             break;
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    QList<int> ret;
+    for (int n : std::as_const(candidates)) {
+        if (at(n).jid().compare(j, compareRes))
+            ret += n;
     }
-    return it;
+    return ret;
+}
+
+LiveRoster::Iterator LiveRoster::find(const Jid &j, bool compareRes)
+{
+    const QList<int> list = positions(j, compareRes);
+    return list.isEmpty() ? end() : begin() + list.first();
 }
 
 LiveRoster::ConstIterator LiveRoster::find(const Jid &j, bool compareRes) const
 {
-    ConstIterator it;
-    for (it = begin(); it != end(); ++it) {
-        if ((*it).jid().compare(j, compareRes))
-            break;
+    const QList<int> list = positions(j, compareRes);
+    return list.isEmpty() ? end() : begin() + list.first();
+}
+
+QList<LiveRoster::Iterator> LiveRoster::findAll(const Jid &j, bool compareRes)
+{
+    QList<Iterator>  ret;
+    const QList<int> list = positions(j, compareRes);
+    for (int n : list)
+        ret += begin() + n;
+    return ret;
+}
+
+LiveRoster &LiveRoster::operator+=(const LiveRosterItem &item)
+{
+    append(item);
+    return *this;
+}
+
+void LiveRoster::append(const LiveRosterItem &item)
+{
+    if (d->indexedSize == size()) {
+        d->index.insert(item.jid().bare(), size());
+        ++d->indexedSize;
     }
-    return it;
+    QList<LiveRosterItem>::append(item);
+}
+
+LiveRoster::Iterator LiveRoster::erase(LiveRoster::Iterator it)
+{
+    d->indexedSize = -1;
+    return QList<LiveRosterItem>::erase(it);
+}
+
+LiveRoster::Iterator LiveRoster::erase(LiveRoster::Iterator begin, LiveRoster::Iterator end)
+{
+    d->indexedSize = -1;
+    return QList<LiveRosterItem>::erase(begin, end);
+}
+
+void LiveRoster::removeAt(int i)
+{
+    d->indexedSize = -1;
+    QList<LiveRosterItem>::removeAt(i);
+}
+
+void LiveRoster::clear()
+{
+    d->indexedSize = -1;
+    d->index.clear();
+    QList<LiveRosterItem>::clear();
 }
 
 void LiveRoster::setGroupsDelimiter(const QString &groupsDelimiter) { d->groupsDelimiter = groupsDelimiter; }
@@ -0,0 +1,353 @@
+/*
+ * filesink.cpp - a file written on a worker thread
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "filesink.h"
+
+#include <QFile>
+#include <QMutex>
+#include <QQueue>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <climits>
+#include <functional>
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// O_DIRECT wants the buffer, the offset and the length aligned to the logical block size. this fits all of them
+#define FILESINK_ALIGN 4096
+// what is collected for one O_DIRECT write
+#define FILESINK_DIRECT_CHUNK (1024 * 1024)
+
+namespace XMPP {
+namespace {
+    class SinkRunnable : public QRunnable {
+    public:
+        SinkRunnable(std::function<void()> &&fn) : fn(std::move(fn)) { }
+        void run() override { fn(); }
+
+    private:
+        std::function<void()> fn;
+    };
+
+    // a pool of our own, a stuck disk must not hold up the users of the global one
+    QThreadPool *sinkPool()
+    {
+        static QThreadPool pool;
+        return &pool;
+    }
+
+    // what the pool thread works with. the queue and the state are under the mutex, the file is touched only by
+    // the thread which has set running, or by the sink when it's not running
+    class SinkWriter : public QObject {
+        Q_OBJECT
+    public:
+        struct Chunk {
+            qint64     pos;
+            QByteArray data;
+        };
+
+        QFile          file;
+        QMutex         mutex;
+        QWaitCondition changed; // a chunk is written or the writer is idle
+        QQueue<Chunk>  queue;
+        qint64         queued  = 0;
+        bool           running = false;
+        QString        error;
+
+        // DirectIO. a contiguous run of data collected until it fills a chunk
+        int    directFd  = -1;
+        char  *buffer    = nullptr;
+        qint64 bufferPos = 0;
+        int    bufferLen = 0;
+
+        ~SinkWriter() override { closeDirect(); }
+
+        void run()
+        {
+            for (;;) {
+                Chunk c;
+                {
+                    QMutexLocker locker(&mutex);
+                    if (queue.isEmpty() || !error.isEmpty()) {
+                        if (error.isEmpty() && !file.flush())
+                            error = file.errorString();
+                        queue.clear();
+                        queued  = 0;
+                        running = false;
+                        changed.wakeAll();
+                        return;
+                    }
+                    c = queue.dequeue();
+                }
+
+                bool ok = directFd != -1 ? writeDirect(c.pos, c.data)
+                                         : writeAt(c.pos, c.data.constData(), c.data.size());
+                {
+                    QMutexLocker locker(&mutex);
+                    queued -= c.data.size();
+                    if (!ok && error.isEmpty())
+                        error = file.errorString();
+                    changed.wakeAll();
+                }
+                emit written(c.data.size());
+            }
+        }
+
+        bool writeAt(qint64 pos, const char *data, qint64 len)
+        {
+            return file.seek(pos) && file.write(data, len) == len;
+        }
+
+        // what is collected but not written yet, through the page cache as it's not a whole chunk
+        bool flushDirect()
+        {
+            if (!bufferLen)
+                return true;
+            int len   = bufferLen;
+            bufferLen = 0;
+            return writeAt(bufferPos, buffer, len);
+        }
+
+        void closeDirect()
+        {
+#ifdef Q_OS_LINUX
+            if (directFd != -1)
+                ::close(directFd);
+            std::free(buffer);
+#endif
+            directFd = -1;
+            buffer   = nullptr;
+        }
+
+        bool writeDirect(qint64 pos, const QByteArray &data)
+        {
+#ifdef Q_OS_LINUX
+            if (bufferLen && pos != bufferPos + bufferLen && !flushDirect())
+                return false;
+
+            const char *p    = data.constData();
+            qint64      left = data.size();
+            while (left > 0) {
+                if (!bufferLen && pos % FILESINK_ALIGN) {
+                    // up to the next aligned offset the usual way
+                    qint64 head = qMin<qint64>(FILESINK_ALIGN - pos % FILESINK_ALIGN, left);
+                    if (!writeAt(pos, p, head))
+                        return false;
+                    pos += head;
+                    p += head;
+                    left -= head;
+                    continue;
+                }
+                if (!bufferLen)
+                    bufferPos = pos;
+                int n = int(qMin<qint64>(FILESINK_DIRECT_CHUNK - bufferLen, left));
+                memcpy(buffer + bufferLen, p, size_t(n));
+                bufferLen += n;
+                pos += n;
+                p += n;
+                left -= n;
+                if (bufferLen == FILESINK_DIRECT_CHUNK && !writeChunk())
+                    return false;
+            }
+            return true;
+#else
+            return writeAt(pos, data.constData(), data.size());
+#endif
+        }
+
+    signals:
+        void written(qint64 bytes);
+
+    private:
+#ifdef Q_OS_LINUX
+        bool writeChunk()
+        {
+            qint64 done = 0;
+            while (done < FILESINK_DIRECT_CHUNK) {
+                ssize_t n = ::pwrite(directFd, buffer + done, size_t(FILESINK_DIRECT_CHUNK - done), bufferPos + done);
+                if (n > 0) {
+                    done += n;
+                    continue;
+                }
+                if (n == -1 && errno == EINTR)
+                    continue;
+                // e.g. the filesystem doesn't do O_DIRECT after all. the rest goes the usual way
+                bool ok   = writeAt(bufferPos + done, buffer + done, FILESINK_DIRECT_CHUNK - done);
+                bufferLen = 0;
+                ::close(directFd);
+                directFd = -1;
+                return ok;
+            }
+            bufferLen = 0;
+            return true;
+        }
+#endif
+    };
+} // namespace
+
+class FileSink::Private {
+public:
+    QString                    fileName;
+    qint64                     preallocate = 0;
+    Options                    options;
+    qint64                     end = 0;
+    QSharedPointer<SinkWriter> writer;
+};
+
+FileSink::FileSink(const QString &fileName, QObject *parent) : QIODevice(parent), d(new Private)
+{
+    d->fileName = fileName;
+}
+
+FileSink::~FileSink() { close(); }
+
+QString FileSink::fileName() const { return d->fileName; }
+
+void FileSink::setPreallocateSize(qint64 size) { d->preallocate = size; }
+
+void FileSink::setOptions(Options options) { d->options = options; }
+
+bool FileSink::open(OpenMode mode)
+{
+    if (isOpen() || !(mode & WriteOnly))
+        return false;
+
+    // like QFile, WriteOnly alone truncates. with Append or ReadWrite what is there stays
+    bool keep   = (mode & Append) || (mode & ReadOnly);
+    auto writer = QSharedPointer<SinkWriter>(new SinkWriter, &QObject::deleteLater);
+    writer->file.setFileName(d->fileName);
+    if (!writer->file.open(keep ? ReadWrite : (WriteOnly | Truncate))) {
+        setErrorString(writer->file.errorString());
+        return false;
+    }
+
+#ifdef Q_OS_LINUX
+    int fd = writer->file.handle();
+    // reserves the blocks only. a filesystem which can't do it is fine as well
+    if (d->preallocate > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, d->preallocate);
+    if (d->options & DirectIO) {
+        void *buf    = nullptr;
+        int   direct = ::open(QFile::encodeName(d->fileName).constData(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (direct != -1 && posix_memalign(&buf, FILESINK_ALIGN, FILESINK_DIRECT_CHUNK) == 0) {
+            writer->directFd = direct;
+            writer->buffer   = static_cast<char *>(buf);
+        } else if (direct != -1) {
+            ::close(direct);
+        }
+    }
+#endif
+
+    connect(writer.data(), &SinkWriter::written, this, &QIODevice::bytesWritten, Qt::QueuedConnection);
+    d->writer = writer;
+    d->end    = keep ? writer->file.size() : 0;
+    QIODevice::open(WriteOnly | Unbuffered);
+    if (mode & Append)
+        QIODevice::seek(d->end);
+    return true;
+}
+
+void FileSink::close()
+{
+    if (!isOpen())
+        return;
+
+    QIODevice::close();
+    auto writer = d->writer;
+    d->writer.reset();
+    writer->disconnect(this);
+
+    QMutexLocker locker(&writer->mutex);
+    while (writer->running)
+        writer->changed.wait(&writer->mutex);
+    bool ok = writer->flushDirect() && writer->file.flush();
+    if (writer->error.isEmpty() && !ok)
+        writer->error = writer->file.errorString();
+    if (!writer->error.isEmpty())
+        setErrorString(writer->error);
+    writer->closeDirect();
+    writer->file.close();
+}
+
+bool FileSink::isSequential() const { return false; }
+
+bool FileSink::seek(qint64 pos) { return QIODevice::seek(pos); }
+
+qint64 FileSink::size() const { return d->end; }
+
+qint64 FileSink::bytesToWrite() const
+{
+    if (!d->writer)
+        return 0;
+    QMutexLocker locker(&d->writer->mutex);
+    return d->writer->queued;
+}
+
+bool FileSink::waitForBytesWritten(int msecs)
+{
+    if (!d->writer)
+        return false;
+    QMutexLocker locker(&d->writer->mutex);
+    if (!d->writer->queued)
+        return false;
+    return d->writer->changed.wait(&d->writer->mutex, msecs < 0 ? ULONG_MAX : ulong(msecs));
+}
+
+qint64 FileSink::readData(char *data, qint64 maxSize)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxSize)
+    return -1;
+}
+
+qint64 FileSink::writeData(const char *data, qint64 maxSize)
+{
+    auto &w = d->writer;
+    bool  start;
+    {
+        QMutexLocker locker(&w->mutex);
+        if (!w->error.isEmpty()) {
+            setErrorString(w->error);
+            return -1;
+        }
+        w->queue.enqueue({ pos(), QByteArray(data, int(maxSize)) });
+        w->queued += maxSize;
+        start      = !w->running;
+        w->running = true;
+    }
+    d->end = qMax(d->end, pos() + maxSize);
+
+    if (start) {
+        QSharedPointer<SinkWriter> writer = w;
+        sinkPool()->start(new SinkRunnable([writer]() { writer->run(); }));
+    }
+    return maxSize;
+}
+} // namespace XMPP
+
+#include "filesink.moc"
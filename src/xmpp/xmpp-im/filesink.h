@@ -0,0 +1,74 @@
+/*
+ * filesink.h - a file written on a worker thread
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_FILESINK_H
+#define XMPP_FILESINK_H
+
+#include <QIODevice>
+
+#include <memory>
+
+namespace XMPP {
+/*
+ * A write only file device for received data. write() only queues the data, it's written on a thread of the
+ * pool, so a slow disk or a network mount doesn't stall the thread of the transfer. bytesToWrite() is what is
+ * queued, bytesWritten() comes when it's on its way to the disk. The reader of the transport is expected to pause
+ * while too much is queued, like the Jingle file transfer does it. A failed write makes the next write() fail.
+ * Seekable, e.g. for the ranges of a striped or a multi-stream transfer.
+ */
+class FileSink : public QIODevice {
+    Q_OBJECT
+public:
+    enum Option {
+        NoOptions = 0,
+        DirectIO  = 1 // linux only. O_DIRECT with aligned buffers, the received data doesn't fill the page cache
+    };
+    Q_DECLARE_FLAGS(Options, Option)
+
+    FileSink(const QString &fileName, QObject *parent = nullptr);
+    ~FileSink() override; // closes it, see close()
+
+    QString fileName() const;
+
+    // before open(). the space for the whole file is reserved at once (linux only), so it's not fragmented and a
+    // full disk is known before the transfer. the size of the file still grows with what is written
+    void setPreallocateSize(qint64 size);
+    void setOptions(Options options);
+
+    bool open(OpenMode mode) override; // WriteOnly, with Truncate or Append if needed
+    void close() override;             // waits for the queue to be written
+    bool isSequential() const override;
+    bool seek(qint64 pos) override;
+    // the last position written or queued. the file may be larger
+    qint64 size() const override;
+    qint64 bytesToWrite() const override;
+    bool   waitForBytesWritten(int msecs) override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+    class Private;
+    std::unique_ptr<Private> d;
+};
+Q_DECLARE_OPERATORS_FOR_FLAGS(FileSink::Options)
+} // namespace XMPP
+
+#endif // XMPP_FILESINK_H
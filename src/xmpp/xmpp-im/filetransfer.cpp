@@ -19,12 +19,14 @@
 
 #include "filetransfer.h"
 
+#include "bandwidthscheduler.h"
 #include "s5b.h"
 #include "xmpp_client.h"
 #include "xmpp_ibb.h"
 #include "xmpp_stream.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QFileDevice>
 #include <QFileInfo>
 #include <QList>
 #include <QPointer>
@@ -34,7 +36,15 @@
 #include <QRandomGenerator>
 #endif
 
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
 #define SENDBUFSIZE 65536
+// the send window doubles up to this while the connection drains it before it is refilled
+#define SENDBUFMAX (4 * 1024 * 1024)
+// the page cache of the data received to a file is dropped every this many bytes
+#define RECVADVISESIZE (8 * 1024 * 1024)
 
 using namespace XMPP;
 
@@ -72,6 +82,11 @@ public:
     Jid                  proxy;
     int                  state;
     bool                 sender;
+    int                  window;
+    QPointer<QIODevice>  output;
+    qint64               advised = 0; // the output file up to here is out of the page cache
+    BandwidthFlow       *flow    = nullptr;
+    int                  weight  = 1;
 };
 
 FileTransfer::FileTransfer(FileTransferManager *m, QObject *parent) : QObject(parent)
@@ -85,11 +100,12 @@ FileTransfer::FileTransfer(FileTransferManager *m, QObject *parent) : QObject(pa
 
 FileTransfer::FileTransfer(const FileTransfer &other) : QObject(other.parent())
 {
-    d     = new Private;
-    *d    = *other.d;
-    d->m  = other.d->m;
-    d->ft = nullptr;
-    d->c  = 0;
+    d       = new Private;
+    *d      = *other.d;
+    d->m    = other.d->m;
+    d->ft   = nullptr;
+    d->c    = 0;
+    d->flow = nullptr;
     reset();
 
     if (d->m->isActive(&other))
@@ -121,6 +137,7 @@ void FileTransfer::reset()
     d->needStream = false;
     d->sent       = 0;
     d->sender     = false;
+    d->window     = SENDBUFSIZE;
 }
 
 void FileTransfer::setProxy(const Jid &proxy) { d->proxy = proxy; }
@@ -144,13 +161,22 @@ void FileTransfer::sendFile(const Jid &to, const QString &fname, qlonglong size,
 int FileTransfer::dataSizeNeeded() const
 {
     quint64 pending = d->c->bytesToWrite();
-    if (pending >= SENDBUFSIZE)
+    if (pending >= quint64(d->window))
         return 0;
     qlonglong left = d->length - (d->sent + pending);
-    int       size = SENDBUFSIZE - pending;
+    int       size = d->window - int(pending);
     if (qlonglong(size) > left)
         size = int(left);
-    return size;
+    if (!d->flow) {
+        auto self = const_cast<FileTransfer *>(this);
+        d->flow   = new BandwidthFlow(d->weight, self);
+        // bytesWritten(0) is the prompt to ask again
+        connect(d->flow, &BandwidthFlow::ready, self, [self]() {
+            if (self->d->state == Active && self->d->sender)
+                emit self->bytesWritten(0);
+        });
+    }
+    return int(qMin(qint64(size), d->flow->available()));
 }
 
 void FileTransfer::writeFileData(const QByteArray &a)
@@ -166,9 +192,18 @@ void FileTransfer::writeFileData(const QByteArray &a)
         block.resize(uint(left));
     } else
         block = a;
+    if (d->flow)
+        d->flow->consume(block.size());
     d->c->write(block);
 }
 
+void FileTransfer::setBandwidthWeight(int weight)
+{
+    d->weight = qMax(1, weight);
+    if (d->flow)
+        d->flow->setWeight(d->weight);
+}
+
 const Thumbnail &FileTransfer::thumbnail() const { return d->thumbnail; }
 
 Jid FileTransfer::peer() const { return d->peer; }
@@ -197,6 +232,12 @@ void FileTransfer::accept(qlonglong offset, qlonglong length)
     d->m->con_accept(this);
 }
 
+void FileTransfer::setOutputDevice(QIODevice *dev)
+{
+    d->output  = dev;
+    d->advised = dev ? dev->pos() : 0;
+}
+
 void FileTransfer::close()
 {
     if (d->state == Idle)
@@ -282,24 +323,59 @@ void FileTransfer::stream_connectionClosed()
 
 void FileTransfer::stream_readyRead()
 {
-    QByteArray a    = d->c->readAll();
-    qlonglong  need = d->length - d->sent;
-    if ((qlonglong)a.size() > need)
-        a.resize((uint)need);
-    d->sent += a.size();
-    //    if(d->sent == d->length) // we close it in stream_connectionClosed. at least for ibb
-    //        reset();             // in other words we wait for another party to close the connection
-    emit readyRead(a);
+    // the chunks as the socket delivered them, no copy into one array
+    const QList<QByteArray> chunks = d->c->takeReadChunks();
+    QPointer<FileTransfer>  self(this);
+    for (QByteArray a : chunks) {
+        qlonglong need = d->length - d->sent;
+        if (need <= 0)
+            break;
+        if (qlonglong(a.size()) > need)
+            a.resize(int(need));
+        d->sent += a.size();
+        //    if(d->sent == d->length) // we close it in stream_connectionClosed. at least for ibb
+        //        reset();             // in other words we wait for another party to close the connection
+        if (d->output) {
+            if (d->output->write(a) != a.size()) {
+                close();
+                emit error(ErrStream);
+                return;
+            }
+            adviseWritten();
+            emit bytesReceived(a.size());
+        } else {
+            emit readyRead(a);
+        }
+        if (!self || !d->c)
+            return;
+    }
 }
 
 void FileTransfer::stream_bytesWritten(qint64 x)
 {
     d->sent += x;
-    if (d->sent == d->length)
+    if (d->sent == d->length) {
         reset();
+    } else if (d->c->bytesToWrite() == 0 && d->window < SENDBUFMAX) {
+        // the connection took everything before it was refilled, so it can take more at once
+        d->window *= 2;
+    }
     emit bytesWritten(x);
 }
 
+void FileTransfer::adviseWritten()
+{
+#ifdef Q_OS_LINUX
+    auto file = qobject_cast<QFileDevice *>(d->output.data());
+    if (!file || file->pos() - d->advised < RECVADVISESIZE)
+        return;
+    // the pages still dirty stay, they go with the next round
+    file->flush();
+    posix_fadvise(file->handle(), d->advised, file->pos() - d->advised, POSIX_FADV_DONTNEED);
+    d->advised = file->pos();
+#endif
+}
+
 void FileTransfer::stream_error(int x)
 {
     reset();
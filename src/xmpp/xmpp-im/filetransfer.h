@@ -24,6 +24,8 @@
 #include "xmpp_task.h"
 #include "xmpp_thumbs.h"
 
+class QIODevice;
+
 namespace XMPP {
 class BSConnection;
 class BytestreamManager;
@@ -60,7 +62,7 @@ public:
     void      sendFile(const Jid &to, const QString &fname, qlonglong size, const QString &desc, Thumbnail &thumb);
     qlonglong offset() const;
     qlonglong length() const;
-    int       dataSizeNeeded() const;
+    int       dataSizeNeeded() const; // limited by the BandwidthScheduler as well
     void      writeFileData(const QByteArray &a);
     const Thumbnail &thumbnail() const;
 
@@ -71,16 +73,21 @@ public:
     QString   description() const;
     bool      rangeSupported() const;
     void      accept(qlonglong offset = 0, qlonglong length = 0);
+    // the received data is written to dev instead of being emitted by readyRead(). not owned
+    void setOutputDevice(QIODevice *dev);
 
     // both
     void          close();              // reject, or stop sending/receiving
     BSConnection *bsConnection() const; // active link
+    // the share of this transfer in the rate of the BandwidthScheduler, default 1
+    void setBandwidthWeight(int weight);
 
 signals:
     void accepted(); // indicates BSConnection has started
     void connected();
     void readyRead(const QByteArray &a);
-    void bytesWritten(qint64);
+    void bytesReceived(qint64); // written to the output device
+    void bytesWritten(qint64); // 0 when the BandwidthScheduler lets the sender go on
     void error(int);
 
 private slots:
@@ -102,6 +109,7 @@ private:
     FileTransfer(const FileTransfer &other);
     void man_waitForAccept(const FTRequest &req, const QString &streamType);
     void takeConnection(BSConnection *c);
+    void adviseWritten();
 };
 
 class FileTransferManager : public QObject {
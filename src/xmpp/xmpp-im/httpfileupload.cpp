@@ -23,17 +23,113 @@
 #include "xmpp_serverinfomanager.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QIODevice>
 #include <QList>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QNetworkRequest>
 #include <QPointer>
+#include <QRegularExpression>
+#include <QUrl>
+
+#include <vector>
+
+// uploads going to the same http host at once
+#define HTTP_UPLOAD_MAX_PUTS_PER_HOST 2
+// new attempts of a put interrupted by a network error
+#define HTTP_UPLOAD_MAX_RETRIES 2
+// chunk for hashing what the put didn't read, e.g. what the server had already
+#define HTTP_UPLOAD_HASH_CHUNK 65536
 
 using namespace XMPP;
 
 static QLatin1String xmlns_v0_2_5("urn:xmpp:http:upload");
 static QLatin1String xmlns_v0_3_1("urn:xmpp:http:upload:0");
 
+//----------------------------------------------------------------------------
+// HashingDevice
+//----------------------------------------------------------------------------
+namespace {
+// the put body. what is read through it for the first time goes to the hashes as well, so the file is read
+// once. positions are relative to where the data starts in the source
+class HashingDevice : public QIODevice {
+public:
+    HashingDevice(QIODevice *source, qint64 start, qint64 size, const QList<Hash::Type> &types, QObject *parent) :
+        QIODevice(parent), source(source), start(start), dataSize(size)
+    {
+        for (auto t : types)
+            hashes.emplace_back(new StreamHash(t));
+        connect(source, &QIODevice::readyRead, this, &QIODevice::readyRead);
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    }
+
+    bool   isSequential() const override { return source->isSequential(); }
+    qint64 size() const override { return dataSize; }
+    qint64 bytesAvailable() const override { return source->bytesAvailable() + QIODevice::bytesAvailable(); }
+
+    bool seek(qint64 pos) override { return QIODevice::seek(pos) && source->seek(start + pos); }
+
+    // with what is left after the last read. empty if the source can't be read again
+    QList<Hash> result()
+    {
+        QList<Hash> ret;
+        if (hashed < dataSize && !catchUp(dataSize))
+            return ret;
+        for (auto &h : hashes)
+            ret += h->final();
+        return ret;
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override
+    {
+        qint64 at = pos();
+        if (at > hashed && !catchUp(at))
+            return -1;
+        qint64 n = source->read(data, qMin(maxlen, dataSize - at));
+        if (n > 0 && at + n > hashed) {
+            add(data + (hashed - at), at + n - hashed);
+            hashed = at + n;
+        }
+        return n;
+    }
+
+    qint64 writeData(const char *, qint64) override { return -1; }
+
+private:
+    QIODevice                                *source;
+    qint64                                    start;
+    qint64                                    dataSize;
+    qint64                                    hashed = 0; // what the hashes have got so far
+    std::vector<std::unique_ptr<StreamHash>> hashes;
+
+    void add(const char *data, qint64 len)
+    {
+        QByteArray chunk = QByteArray::fromRawData(data, int(len));
+        for (auto &h : hashes)
+            h->addData(chunk);
+    }
+
+    // hashes the part up to the position, e.g. skipped by a resumed put, and goes back there
+    bool catchUp(qint64 to)
+    {
+        if (source->isSequential())
+            return false;
+        qint64 back = source->pos();
+        if (!source->seek(start + hashed))
+            return false;
+        while (hashed < to) {
+            QByteArray chunk = source->read(qMin<qint64>(to - hashed, HTTP_UPLOAD_HASH_CHUNK));
+            if (chunk.isEmpty())
+                return false;
+            add(chunk.constData(), chunk.size());
+            hashed += chunk.size();
+        }
+        return source->seek(back);
+    }
+};
+}
+
 //----------------------------------------------------------------------------
 // HttpFileUpload
 //----------------------------------------------------------------------------
@@ -47,6 +143,13 @@ public:
     QString                         fileName;
     QString                         mediaType;
     QList<HttpHost>                 httpHosts;
+    QString                         putHost; // while holding a put slot of the manager
+    QPointer<HttpFileUploadManager> putManager;
+    int                             retries     = 0;
+    qint64                          sourceStart = 0; // position of the data in sourceDevice
+    QList<Hash::Type>               hashTypes;
+    HashingDevice                  *body = nullptr; // reads sourceDevice for the put when hashing
+    QList<Hash>                     hashes;
 
     struct {
         HttpFileUpload::ErrorCode statusCode = HttpFileUpload::ErrorCode::NoError;
@@ -68,10 +171,19 @@ HttpFileUpload::HttpFileUpload(XMPP::Client *client, QIODevice *source, size_t f
     d->mediaType    = mType;
 }
 
-HttpFileUpload::~HttpFileUpload() { qDebug("destroying"); }
+HttpFileUpload::~HttpFileUpload()
+{
+    qDebug("destroying");
+    if (d->putManager)
+        d->putManager->putFinished(this);
+}
 
 void HttpFileUpload::setNetworkAccessManager(QNetworkAccessManager *qnam) { d->qnam = qnam; }
 
+void HttpFileUpload::setHashTypes(const QList<Hash::Type> &types) { d->hashTypes = types; }
+
+const QList<Hash> &HttpFileUpload::hashes() const { return d->hashes; }
+
 void HttpFileUpload::start()
 {
     if (d->state != State::None) // Attempt to start twice?
@@ -80,6 +192,7 @@ void HttpFileUpload::start()
     setState(State::GettingSlot);
 
     d->result.statusCode = HttpFileUpload::ErrorCode::NoError;
+    d->sourceStart       = d->sourceDevice->isSequential() ? 0 : d->sourceDevice->pos();
 
     auto mgr = d->client->httpFileUploadManager();
     if (mgr->discoveryStatus() == HttpFileUploadManager::DiscoNotFound) {
@@ -217,35 +330,101 @@ void HttpFileUpload::tryNextServer()
             }
 
             setState(State::HttpRequest);
-            // time for a http request
-            QNetworkRequest req(d->result.putUrl);
-            for (auto &h : d->result.putHeaders)
-                req.setRawHeader(h.name.toLatin1(), h.value.toLatin1());
-            if (!d->mediaType.isEmpty())
-                req.setHeader(QNetworkRequest::ContentTypeHeader, d->mediaType);
-
-            auto reply = d->qnam->put(req, d->sourceDevice);
-            connect(reply, &QNetworkReply::uploadProgress, this, &HttpFileUpload::progress);
-            connect(reply, &QNetworkReply::finished, this, [this, reply]() {
-                if (reply->error() == QNetworkReply::NoError) {
-                    done(State::Success);
-                } else {
-                    d->result.statusCode   = ErrorCode::HttpFailed;
-                    d->result.statusString = reply->errorString();
-                    qDebug("http upload failed: %s", qPrintable(d->result.statusString));
-                    if (d->httpHosts.isEmpty())
-                        done(State::Error);
-                    else
-                        tryNextServer();
-                }
-                reply->deleteLater();
-            });
+            d->retries = 0;
+            d->client->httpFileUploadManager()->queuePut(this);
         },
         Qt::QueuedConnection);
     jt->request(host.jid, d->fileName, d->fileSize, d->mediaType, host.ver);
     jt->go(true);
 }
 
+void HttpFileUpload::startPut(quint64 offset)
+{
+    if (!d->qnam) {
+        putFailed("Network access manager has gone");
+        return;
+    }
+    if (!d->hashTypes.isEmpty() && !d->body)
+        d->body = new HashingDevice(d->sourceDevice, d->sourceStart, qint64(d->fileSize), d->hashTypes, this);
+    QIODevice *body = d->body ? static_cast<QIODevice *>(d->body) : d->sourceDevice;
+    // from the beginning again if the previous server failed
+    if (!body->isSequential() && !body->seek((d->body ? 0 : d->sourceStart) + qint64(offset))) {
+        putFailed("Can't seek in the source data");
+        return;
+    }
+
+    QNetworkRequest req(d->result.putUrl);
+    for (auto &h : d->result.putHeaders)
+        req.setRawHeader(h.name.toLatin1(), h.value.toLatin1());
+    if (!d->mediaType.isEmpty())
+        req.setHeader(QNetworkRequest::ContentTypeHeader, d->mediaType);
+    req.setHeader(QNetworkRequest::ContentLengthHeader, qint64(d->fileSize - offset));
+    if (offset)
+        req.setRawHeader("Content-Range",
+                         QString("bytes %1-%2/%3").arg(offset).arg(d->fileSize - 1).arg(d->fileSize).toLatin1());
+
+    auto reply = d->qnam->put(req, body);
+    // what the network took, the position of the source is ahead of it
+    connect(reply, &QNetworkReply::uploadProgress, this, [this, offset](qint64 bytesSent, qint64) {
+        emit progress(qint64(offset) + bytesSent, qint64(d->fileSize));
+    });
+    connect(reply, &QNetworkReply::finished, this, [this, reply]() {
+        reply->deleteLater();
+        if (reply->error() == QNetworkReply::NoError) {
+            d->client->httpFileUploadManager()->putFinished(this);
+            if (d->body)
+                d->hashes = d->body->result();
+            done(State::Success);
+            return;
+        }
+        // no http status means the connection broke. maybe the server has the beginning already
+        bool httpError = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).isValid();
+        if (!httpError && d->retries < HTTP_UPLOAD_MAX_RETRIES && !d->sourceDevice->isSequential()) {
+            ++d->retries;
+            resumePut();
+            return;
+        }
+        putFailed(reply->errorString());
+    });
+}
+
+// asks the put url what it has. servers which can resume answer with a Range header
+void HttpFileUpload::resumePut()
+{
+    if (!d->qnam) {
+        putFailed("Network access manager has gone");
+        return;
+    }
+    QNetworkRequest req(d->result.putUrl);
+    for (auto &h : d->result.putHeaders)
+        req.setRawHeader(h.name.toLatin1(), h.value.toLatin1());
+    auto reply = d->qnam->head(req);
+    connect(reply, &QNetworkReply::finished, this, [this, reply]() {
+        reply->deleteLater();
+        static const QRegularExpression re(QLatin1String("^bytes=0-(\\d+)$"));
+        auto    match  = re.match(QString::fromLatin1(reply->rawHeader("Range")).trimmed());
+        quint64 offset = 0;
+        if (reply->error() == QNetworkReply::NoError && match.hasMatch()) {
+            offset = match.captured(1).toULongLong() + 1;
+            if (offset >= d->fileSize)
+                offset = 0;
+        }
+        startPut(offset);
+    });
+}
+
+void HttpFileUpload::putFailed(const QString &reason)
+{
+    d->client->httpFileUploadManager()->putFinished(this);
+    d->result.statusCode   = ErrorCode::HttpFailed;
+    d->result.statusString = reason;
+    qDebug("http upload failed: %s", qPrintable(d->result.statusString));
+    if (d->httpHosts.isEmpty())
+        done(State::Error);
+    else
+        tryNextServer();
+}
+
 bool HttpFileUpload::success() const { return d->state == State::Success; }
 
 HttpFileUpload::ErrorCode HttpFileUpload::statusCode() const { return d->result.statusCode; }
@@ -421,6 +600,10 @@ public:
     int                                 discoStatus = 0;
     QList<HttpFileUpload::HttpHost>     discoHosts;
     std::list<HttpFileUpload::HttpHost> hosts;
+
+    int                                            maxPutsPerHost = HTTP_UPLOAD_MAX_PUTS_PER_HOST;
+    QHash<QString, int>                            putsRunning;
+    QHash<QString, QList<QPointer<HttpFileUpload>>> putsWaiting;
 };
 
 HttpFileUploadManager::HttpFileUploadManager(Client *parent) : QObject(parent), d(new Private) { d->client = parent; }
@@ -431,6 +614,10 @@ int HttpFileUploadManager::discoveryStatus() const { return d->discoStatus; }
 
 void HttpFileUploadManager::setNetworkAccessManager(QNetworkAccessManager *qnam) { d->externalQnam = qnam; }
 
+void HttpFileUploadManager::setMaxPutsPerHost(int count) { d->maxPutsPerHost = qMax(1, count); }
+
+int HttpFileUploadManager::maxPutsPerHost() const { return d->maxPutsPerHost; }
+
 HttpFileUpload *HttpFileUploadManager::upload(const QString &srcFilename, const QString &dstFilename,
                                               const QString &mType)
 {
@@ -459,3 +646,38 @@ void HttpFileUploadManager::setDiscoHosts(const QList<HttpFileUpload::HttpHost>
     d->discoStatus = hosts.size() ? DiscoFound : DiscoNotFound;
     d->discoHosts  = hosts;
 }
+
+void HttpFileUploadManager::queuePut(HttpFileUpload *upload)
+{
+    QString host = QUrl(upload->d->result.putUrl).host();
+    if (d->putsRunning.value(host) >= d->maxPutsPerHost) {
+        d->putsWaiting[host].append(upload);
+        return;
+    }
+    ++d->putsRunning[host];
+    upload->d->putHost    = host;
+    upload->d->putManager = this;
+    upload->startPut(0);
+}
+
+void HttpFileUploadManager::putFinished(HttpFileUpload *upload)
+{
+    QString host = upload->d->putHost;
+    if (host.isEmpty())
+        return;
+    upload->d->putHost.clear();
+    if (--d->putsRunning[host] <= 0)
+        d->putsRunning.remove(host);
+
+    auto it = d->putsWaiting.find(host);
+    while (it != d->putsWaiting.end() && !it->isEmpty()) {
+        QPointer<HttpFileUpload> next = it->takeFirst();
+        if (it->isEmpty())
+            d->putsWaiting.erase(it);
+        if (next) {
+            queuePut(next);
+            return;
+        }
+        it = d->putsWaiting.find(host);
+    }
+}
@@ -21,6 +21,7 @@
 #define XMPP_HTTPFILEUPLOAD_H
 
 #include "xmpp/jid/jid.h"
+#include "xmpp_hash.h"
 #include "xmpp_task.h"
 
 #include <functional>
@@ -95,6 +96,11 @@ public:
      */
     void setNetworkAccessManager(QNetworkAccessManager *qnam);
 
+    // hashes of the data computed while the put reads it, e.g. for the XEP-0300 hashes of a SIMS
+    // reference, instead of reading the file once more for Hash::from(). set before start()
+    void               setHashTypes(const QList<Hash::Type> &types);
+    const QList<Hash> &hashes() const; // when finished with success. empty if a sequential source was read twice
+
     bool           success() const;
     ErrorCode      statusCode() const;
     const QString &statusString() const;
@@ -116,6 +122,9 @@ private:
     void done(State state);
     void tryNextServer();
     void setState(State state);
+    void startPut(quint64 offset);
+    void resumePut();
+    void putFailed(const QString &reason);
 
 private:
     class Private;
@@ -172,6 +181,11 @@ public:
      */
     void setNetworkAccessManager(QNetworkAccessManager *qnam);
 
+    // uploads to the same http host at once, the others wait. 2 by default.
+    // slots are requested for all the uploads at once anyway
+    void setMaxPutsPerHost(int count);
+    int  maxPutsPerHost() const;
+
     /**
      * @brief uploads given file to http server
      * @param srcFilename name of the real file on the filesystem
@@ -197,6 +211,8 @@ private:
     friend class HttpFileUpload;
     const QList<HttpFileUpload::HttpHost> &discoHosts() const;
     void                                   setDiscoHosts(const QList<HttpFileUpload::HttpHost> &hosts);
+    void                                   queuePut(HttpFileUpload *upload);
+    void                                   putFinished(HttpFileUpload *upload);
 
     class Private;
     Private *d;
@@ -21,6 +21,15 @@
 
 namespace XMPP { namespace Jingle {
 
+    static const qint64 DEFAULT_LOW_WATERMARK  = 256 * 1024;
+    static const qint64 DEFAULT_HIGH_WATERMARK = 1024 * 1024;
+
+    Connection::Connection(QObject *parent) :
+        ByteStream(parent), _lowWatermark(DEFAULT_LOW_WATERMARK), _highWatermark(DEFAULT_HIGH_WATERMARK)
+    {
+        connect(this, &QIODevice::bytesWritten, this, [this](qint64 bytes) { _bytesTransferred += quint64(bytes); });
+    }
+
     bool Connection::hasPendingDatagrams() const { return false; }
 
     QNetworkDatagram Connection::readDatagram(qint64 maxSize)
@@ -36,6 +45,10 @@ namespace XMPP { namespace Jingle {
         return false;
     }
 
+    QByteArray Connection::readMessage() { return hasPendingDatagrams() ? readDatagram().data() : QByteArray(); }
+
+    bool Connection::writeMessage(const QByteArray &data) { return writeDatagram(QNetworkDatagram(data)); }
+
     qint64 Connection::writeData(const char *, qint64)
     {
         qCritical("Calling unimplemented function writeData");
@@ -45,6 +58,8 @@ namespace XMPP { namespace Jingle {
     qint64 Connection::readData(char *buf, qint64 maxSize)
     {
         auto sz = readDataInternal(buf, maxSize);
+        if (sz > 0)
+            _bytesTransferred += quint64(sz);
         if (sz != -1 && _readHook) {
             _readHook(buf, sz);
         }
@@ -57,4 +72,29 @@ namespace XMPP { namespace Jingle {
     }
 
     int Connection::component() const { return 0; }
+
+    void Connection::setWriteWatermarks(qint64 low, qint64 high)
+    {
+        _highWatermark = qMax(high, qint64(1));
+        _lowWatermark  = qBound(qint64(0), low, _highWatermark);
+        checkWatermarks();
+    }
+
+    bool Connection::canWrite(qint64 size) const
+    {
+        auto queued = bytesToWrite();
+        return !queued || queued + size <= _highWatermark;
+    }
+
+    void Connection::checkWatermarks()
+    {
+        auto queued = bytesToWrite();
+        if (!_aboveWatermark && queued > _highWatermark) {
+            _aboveWatermark = true;
+            emit highWatermarkReached();
+        } else if (_aboveWatermark && queued <= _lowWatermark) {
+            _aboveWatermark = false;
+            emit lowWatermarkReached();
+        }
+    }
 }}
@@ -38,9 +38,15 @@ namespace XMPP { namespace Jingle {
         using Ptr      = QSharedPointer<Connection>; // will be shared between transport and application
         using ReadHook = std::function<void(char *, qint64)>;
 
+        Connection(QObject *parent = nullptr);
+
         virtual bool              hasPendingDatagrams() const;
         virtual QNetworkDatagram  readDatagram(qint64 maxSize = -1);
         virtual bool              writeDatagram(const QNetworkDatagram &data);
+        // the payloads of a message oriented connection as they are, without a QNetworkDatagram around them.
+        // they go through the datagram functions unless a connection has something better
+        virtual QByteArray        readMessage();
+        virtual bool              writeMessage(const QByteArray &data);
         virtual size_t            blockSize() const;
         virtual int               component() const;
         virtual TransportFeatures features() const = 0;
@@ -50,9 +56,24 @@ namespace XMPP { namespace Jingle {
         inline void setRemote(bool value) { _isRemote = value; }
         inline void setReadHook(ReadHook hook) { _readHook = hook; }
 
+        /**
+         * Limits of the write buffer. highWatermarkReached() is emitted once bytesToWrite() goes above high and
+         * lowWatermarkReached() once it drops back to low. Producers should check canWrite() before each write.
+         */
+        void          setWriteWatermarks(qint64 low, qint64 high);
+        inline qint64 lowWatermark() const { return _lowWatermark; }
+        inline qint64 highWatermark() const { return _highWatermark; }
+        // true if size bytes more fit under the high watermark. an empty buffer takes any size
+        bool canWrite(qint64 size) const;
+
+        // what went through read() and what bytesWritten() told of, e.g. for the admission of Manager
+        inline quint64 bytesTransferred() const { return _bytesTransferred; }
+
     signals:
         void connected();
         void disconnected();
+        void highWatermarkReached();
+        void lowWatermarkReached();
 
     protected:
         qint64 writeData(const char *data, qint64 maxSize);
@@ -61,9 +82,16 @@ namespace XMPP { namespace Jingle {
         // same rules as for QIOdevice::readData. It was just necessary to wrap it.
         virtual qint64 readDataInternal(char *data, qint64 maxSize) = 0;
 
+        // implementations call it every time bytesToWrite() changes
+        void checkWatermarks();
+
         bool     _isRemote = false;
         QString  _id;
         ReadHook _readHook;
+        qint64   _lowWatermark;
+        qint64   _highWatermark;
+        bool     _aboveWatermark   = false;
+        quint64  _bytesTransferred = 0;
     };
 
     using ConnectionAcceptorCallback = std::function<bool(Connection::Ptr)>;
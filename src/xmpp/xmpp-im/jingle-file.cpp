@@ -21,7 +21,11 @@
 
 #include "xmpp_xmlcommon.h"
 
+#include <QDataStream>
 #include <QDomDocument>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
 #include <QSemaphore>
 #include <QThread>
 #include <QTimer>
@@ -174,7 +178,7 @@ File::File(const QDomElement &file)
         } else if (ce.tagName() == THUMBNAIL_TAG) {
             thumbnail = Thumbnail(ce);
         } else if (ce.tagName() == AMPLITUDES_TAG && ce.namespaceURI() == AMPLITUDES_NS) {
-            amplitudes = QByteArray::fromBase64(ce.text().toLatin1());
+            amplitudes = XMLHelper::fromBase64(ce.text());
         }
     }
 
@@ -384,4 +388,167 @@ Hash FileHasher::result()
     return d->result;
 }
 
+QByteArray FileHasher::saveState()
+{
+    QByteArray state;
+    if (d->thread.isRunning())
+        QMetaObject::invokeMethod(
+            this, [this, &state]() { state = d->streamHash.saveState(); }, Qt::BlockingQueuedConnection);
+    return state;
+}
+
+bool FileHasher::restoreState(const QByteArray &state)
+{
+    bool ret = false;
+    if (d->thread.isRunning())
+        QMetaObject::invokeMethod(
+            this, [this, &state, &ret]() { ret = d->streamHash.restoreState(state); }, Qt::BlockingQueuedConnection);
+    return ret;
+}
+
+//----------------------------------------------------------------------------
+// TransferJournal
+//----------------------------------------------------------------------------
+static const quint32 JOURNAL_MAGIC   = 0x69726a31; // irj1
+static const quint32 JOURNAL_VERSION = 1;
+
+class TransferJournal::Private {
+public:
+    QString                     filePath;
+    File                        file;
+    QList<Range>                received;       // sorted and not overlapping
+    quint64                     hashedUpTo = 0; // hasher has seen everything before it
+    std::unique_ptr<FileHasher> hasher;
+
+    void resetHasher()
+    {
+        hasher.reset();
+        hashedUpTo = 0;
+        auto type  = file.hash().type();
+        if (type != Hash::Unknown)
+            hasher.reset(new FileHasher(type));
+    }
+};
+
+TransferJournal::TransferJournal(const QString &filePath, const File &file) : d(new Private)
+{
+    d->filePath = filePath;
+    d->file     = file;
+    d->resetHasher();
+}
+
+TransferJournal::~TransferJournal() { }
+
+QString TransferJournal::journalPath(const QString &filePath) { return filePath + QLatin1String(".journal"); }
+
+bool TransferJournal::load()
+{
+    QFile f(journalPath(d->filePath));
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream in(&f);
+    quint32     magic, version;
+    in >> magic >> version;
+    if (magic != JOURNAL_MAGIC || version != JOURNAL_VERSION)
+        return false;
+
+    QString   name;
+    quint64   size;
+    QDateTime date;
+    quint32   count;
+    in >> name >> size >> date >> count;
+    if (in.status() != QDataStream::Ok || name != d->file.name() || size != d->file.size().value_or(0)
+        || date != d->file.date())
+        return false; // some other file
+
+    QList<Range> received;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        quint64 offset, length;
+        in >> offset >> length;
+        received.append(Range(offset, length));
+    }
+    qint32     hashType;
+    quint64    hashedUpTo;
+    QByteArray hashState;
+    in >> hashType >> hashedUpTo >> hashState;
+    quint64 complete = received.isEmpty() || received.first().offset ? 0 : received.first().length;
+    if (in.status() != QDataStream::Ok || QFileInfo(d->filePath).size() < qint64(complete))
+        return false; // broken journal or the file was truncated
+
+    d->received = received;
+    d->resetHasher();
+    if (d->hasher && hashedUpTo && hashType == d->file.hash().type() && d->hasher->restoreState(hashState))
+        d->hashedUpTo = hashedUpTo;
+    else if (completeUpTo())
+        d->hasher.reset(); // the beginning won't be hashed anymore
+    return true;
+}
+
+bool TransferJournal::save()
+{
+    QSaveFile f(journalPath(d->filePath));
+    if (!f.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream out(&f);
+    out << JOURNAL_MAGIC << JOURNAL_VERSION;
+    out << d->file.name() << quint64(d->file.size().value_or(0)) << d->file.date() << quint32(d->received.size());
+    for (auto const &r : std::as_const(d->received))
+        out << quint64(r.offset) << quint64(r.length);
+
+    QByteArray state = d->hasher && d->hashedUpTo ? d->hasher->saveState() : QByteArray();
+    out << qint32(d->file.hash().type()) << quint64(state.isEmpty() ? 0 : d->hashedUpTo) << state;
+    return out.status() == QDataStream::Ok && f.commit();
+}
+
+void TransferJournal::remove() { QFile::remove(journalPath(d->filePath)); }
+
+void TransferJournal::addData(quint64 offset, const QByteArray &data)
+{
+    if (data.isEmpty())
+        return;
+
+    quint64 start = offset;
+    quint64 end   = offset + quint64(data.size());
+    auto    it    = d->received.begin();
+    while (it != d->received.end() && it->offset + it->length < start)
+        ++it;
+    while (it != d->received.end() && it->offset <= end) {
+        start = qMin(start, quint64(it->offset));
+        end   = qMax(end, quint64(it->offset + it->length));
+        it    = d->received.erase(it);
+    }
+    d->received.insert(it, Range(start, end - start));
+
+    if (d->hasher && offset == d->hashedUpTo) {
+        d->hasher->addData(data);
+        d->hashedUpTo += quint64(data.size());
+    }
+}
+
+QList<Range> TransferJournal::receivedRanges() const { return d->received; }
+
+quint64 TransferJournal::completeUpTo() const
+{
+    if (d->received.isEmpty() || d->received.first().offset)
+        return 0;
+    return d->received.first().length;
+}
+
+File TransferJournal::resumeFile() const
+{
+    File f(d->file);
+    f.setRange(Range(completeUpTo(), 0));
+    return f;
+}
+
+Hash TransferJournal::wholeFileHash()
+{
+    auto size = d->file.size();
+    if (!d->hasher || !size || d->hashedUpTo != *size)
+        return Hash();
+    return d->hasher->result();
+}
+
 }
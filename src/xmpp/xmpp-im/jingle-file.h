@@ -95,6 +95,40 @@ public:
     void addData(const QByteArray &data = QByteArray());
     Hash result();
 
+    // see StreamHash. both wait for the data added so far to be hashed
+    QByteArray saveState();
+    bool       restoreState(const QByteArray &state);
+
+private:
+    class Private;
+    std::unique_ptr<Private> d;
+};
+
+/**
+ * @brief The TransferJournal class remembers what part of an incoming file is already written.
+ *
+ * It's kept next to the file while it's received. When the transfer breaks, the next offer of the same file can
+ * be accepted with resumeFile() and only the missing tail is transferred. If the hash implementation can export
+ * its state the journal also keeps the running hash of the data received from the start of the file, so it
+ * doesn't have to be rehashed to get the hash of the whole file.
+ */
+class TransferJournal {
+public:
+    TransferJournal(const QString &filePath, const File &file);
+    ~TransferJournal();
+
+    static QString journalPath(const QString &filePath);
+
+    bool load(); // restores the state of a previous transfer of the same file, if any
+    bool save();
+    void remove(); // when the file is complete
+
+    void         addData(quint64 offset, const QByteArray &data);
+    QList<Range> receivedRanges() const;
+    quint64      completeUpTo() const; // size of the part received from the start and without gaps
+    File         resumeFile() const;   // the file with a range for the part after completeUpTo()
+    Hash         wholeFileHash();      // valid if the whole file was hashed, possibly across restarts
+
 private:
     class Private;
     std::unique_ptr<Private> d;
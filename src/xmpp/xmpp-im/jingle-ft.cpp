@@ -18,8 +18,11 @@
  */
 
 #include "jingle-ft.h"
+#include "bandwidthscheduler.h"
 #include "jingle-nstransportslist.h"
 #include "jingle-session.h"
+#include "metrics.h"
+#include "stallwatchdog.h"
 
 #include "xmpp_client.h"
 #include "xmpp_hash.h"
@@ -29,9 +32,11 @@
 #include <QRandomGenerator>
 #endif
 #include <QDeadlineTimer>
+#include <QFile>
 #include <QFileInfo>
 #include <QMetaObject>
 #include <QMimeDatabase>
+#include <QtEndian>
 #include <QPointer>
 #include <QSemaphore>
 #include <QThread>
@@ -46,10 +51,23 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
 
     const QString  NS               = QStringLiteral("urn:xmpp:jingle:apps:file-transfer:5");
     constexpr auto FINALIZE_TIMEOUT = 30s;
+    // blocks written from a mapped file to a stream transport grow while the socket keeps draining them
+    constexpr std::size_t MAPPED_BLOCK_MIN = 64 * 1024;
+    constexpr std::size_t MAPPED_BLOCK_MAX = 1024 * 1024;
+    // how much may be received before the transfer journal is saved again
+    constexpr quint64 JOURNAL_SAVE_INTERVAL = 16 * 1024 * 1024;
+    // received data a device with a write queue of its own (e.g. FileSink) may hold before the transport is left
+    // alone, so its flow control slows the sender down. reading goes on with the device's bytesWritten()
+    constexpr qint64 DEVICE_BACKLOG_MAX = 4 * 1024 * 1024;
+    // multi-stream mode. every block starts with its big endian offset from the start of the transfer
+    static const QString STREAMS_NS   = QStringLiteral("urn:psi-im:jingle:ft:streams:0");
+    constexpr int        MAX_STREAMS  = 8;
+    constexpr int        FRAME_HEADER = 8;
 
     // tags
     static const QString CHECKSUM_TAG = QStringLiteral("checksum");
     static const QString RECEIVED_TAG = QStringLiteral("received");
+    static const QString STREAMS_TAG  = QStringLiteral("streams");
 
     class Checksum : public ContentBase {
     public:
@@ -166,14 +184,54 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         QList<Hash>                        incomingChecksum;
         QTimer                            *finalizeTimer = nullptr;
         FileHasher                        *hasher        = nullptr;
+        Hash                               knownChecksum; // of the file we send, if it was hashed before
+        uchar                             *mapped       = nullptr; // the part of the file we send
+        quint64                            mappedOffset = 0;
+        quint64                            mappedSize   = 0;
+        quint64                            mappedPos    = 0;
+        std::size_t                        mappedBlock  = MAPPED_BLOCK_MIN;
+        TransferJournal                   *journal      = nullptr;
+        quint64                            receivedAt   = 0; // file offset of the next incoming byte
+        quint64                            notJournaled = 0; // received since the journal was saved
+        int                                streamsWanted = 1; // see setStreamCount()
+        int                                remoteStreams = 1; // as offered by the remote
+        int                                streamCount   = 1; // negotiated
+        bool                               multiStream   = false;
+        QList<Connection::Ptr>             extraStreams;
+        quint64                            streamPos   = 0; // sent or received in multi-stream mode
+        qint64                             deviceBase  = 0; // position of the receiving device at the start
+        quint64                            hashedPos   = 0; // multi-stream receiver hashes blocks in order
+        QMap<quint64, QByteArray>          unhashed;
+        BandwidthFlow                     *flow            = nullptr; // created with the first block sent
+        int                                bandwidthWeight = 1;
+#ifdef IRIS_METRICS
+        QElapsedTimer transferTimer; // since Active
+        quint64       transferSize = 0;
+#endif
 
         void setState(State s)
         {
             q->_state = s;
             if (s == State::Finished) {
+#ifdef IRIS_METRICS
+                if (lastReason.condition() == Reason::Condition::Success && transferTimer.isValid()) {
+                    IRIS_METRIC_ADD(JingleTransfers, 1);
+                    IRIS_METRIC_RECORD(JingleTransferKiBps,
+                                       transferSize * 1000 / quint64(qMax(qint64(1), transferTimer.elapsed())) / 1024);
+                }
+#endif
+                unmapSource();
+                if (journal) {
+                    if (lastReason.condition() == Reason::Condition::Success)
+                        journal->remove();
+                    else
+                        journal->save();
+                }
                 if (device && closeDeviceOnFinish) {
                     device->close();
                 }
+                for (auto const &stream : std::as_const(extraStreams))
+                    stream->close();
                 if (connection) {
                     connection->close();
                 }
@@ -184,6 +242,14 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
                 q->disconnect(q->transport().data(), &Transport::failed, q, nullptr);
                 // we can still try to send transport updates
             }
+            if (s == State::Active && q->transport()) {
+                auto session = q->pad()->session();
+                session->manager()->rememberPeerTransport(session->peer(), q->transport()->pad()->ns());
+#ifdef IRIS_METRICS
+                transferTimer.start();
+                transferSize = bytesLeft.value_or(0);
+#endif
+            }
             emit q->stateChanged(s);
         }
 
@@ -235,65 +301,134 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         {
             device              = dev;
             closeDeviceOnFinish = closeOnFinish;
+            bool sending        = q->senders() == q->pad()->session()->role();
             if (file.hash().isValid() && file.hash().data().isEmpty() && file.range().hashes.isEmpty()) {
-                // no precomputated hashes
-                hasher = new FileHasher(file.hash().type());
+                // no precomputated hashes. maybe the file was hashed for another offer already
+                auto local = qobject_cast<QFile *>(dev);
+                if (sending && local && !file.range().isValid())
+                    knownChecksum = FileHashJob::cached(local->fileName(), { file.hash().type() }).value(0);
+                if (!knownChecksum.isValid())
+                    hasher = new FileHasher(file.hash().type());
+            }
+            if (multiStream && dev->isSequential()) {
+                handleStreamFail(QString::fromLatin1("multi-stream transfer needs a seekable device"));
+                return;
             }
-            if (q->senders() == q->pad()->session()->role()) {
+            deviceBase = dev->pos();
+            if (sending) {
+                mapSource();
                 writeNextBlockToTransport();
             } else {
+                QObject::connect(dev, &QIODevice::bytesWritten, q, [this, dev]() {
+                    if (device == dev && connection && (!bytesLeft || *bytesLeft > 0)
+                        && dev->bytesToWrite() < DEVICE_BACKLOG_MAX)
+                        readNextBlockFromTransport();
+                });
                 readNextBlockFromTransport();
             }
         }
 
+        // returns true if the checksum of the sent data is going to be sent to the peer
+        bool sendChecksum()
+        {
+            auto hash = knownChecksum.isValid() ? knownChecksum : hasher ? hasher->result() : Hash();
+            if (!hash.isValid())
+                return false;
+            outgoingChecksum << hash;
+            emit q->updated();
+            return true;
+        }
+
+        // regular files sent over stream transports are written straight from a mapping, without reads and copies
+        void mapSource()
+        {
+            auto f = qobject_cast<QFile *>(device);
+            if (!f || f->isSequential() || !(connection->features() & TransportFeature::StreamOriented)
+                || (connection->features() & TransportFeature::MessageOriented))
+                return;
+            quint64 offset = quint64(f->pos());
+            quint64 size   = quint64(f->size()) > offset ? quint64(f->size()) - offset : 0;
+            if (bytesLeft && *bytesLeft < size)
+                size = *bytesLeft;
+            if (!size)
+                return;
+            mapped = f->map(qint64(offset), qint64(size));
+            if (!mapped)
+                return; // e.g. doesn't fit to the address space. go the usual way
+            mappedOffset = offset;
+            mappedSize   = size;
+            mappedPos    = 0;
+        }
+
+        void unmapSource()
+        {
+            if (!mapped)
+                return;
+            if (hasher)
+                hasher->result(); // it may still hash the mapped memory
+            auto f = qobject_cast<QFile *>(device);
+            if (f)
+                f->unmap(mapped);
+            mapped = nullptr;
+        }
+
         inline std::size_t getBlockSize()
         {
             auto sz = connection->blockSize();
-            return sz ? sz : 8192;
+            return sz ? sz : (mapped ? mappedBlock : 8192);
         }
 
         void writeNextBlockToTransport()
         {
+            IRIS_STALL_WATCH(FileTransfer, QStringLiteral("send"));
             if (bytesLeft && *bytesLeft == 0) {
-                if (hasher) {
-                    auto hash = hasher->result();
-                    if (hash.isValid()) {
-                        outgoingChecksum << hash;
-                        emit q->updated();
-                        return;
-                    }
-                }
+                if (sendChecksum())
+                    return;
                 expectReceived();
                 return; // everything is written
             }
             quint64 sz = getBlockSize();
+            if (multiStream)
+                sz -= FRAME_HEADER;
             if (bytesLeft && sz > *bytesLeft) {
                 sz = *bytesLeft;
             }
+            if (!flow) {
+                flow = new BandwidthFlow(bandwidthWeight, q);
+                connect(flow, &BandwidthFlow::ready, q, [this]() { onLowWatermark(); });
+            }
+            qint64 allowed = flow->available();
+            if (!allowed)
+                return; // we will come back on ready
+            sz          = qMin(sz, quint64(allowed));
+            auto stream = multiStream ? leastBusyStream() : connection;
+            if (!stream->canWrite(qint64(sz) + (multiStream ? FRAME_HEADER : 0)))
+                return; // we will come back on lowWatermarkReached
             QByteArray data;
-            if (device->isSequential()) {
-                sz = qMin(sz, quint64(device->bytesAvailable()));
-                if (!sz)
-                    return; // we will come back on readyRead
-            }
-            data.resize(sz);
-            auto readSz = device->read(data.data(), sz);
-            if (readSz < 0) {
-                handleStreamFail(QString::fromLatin1("source device failed"));
-                return;
+            qint64     readSz;
+            if (mapped) {
+                readSz = qint64(qMin(sz, mappedSize - mappedPos));
+                data   = QByteArray::fromRawData(reinterpret_cast<const char *>(mapped) + mappedPos, int(readSz));
+                mappedPos += quint64(readSz);
+            } else {
+                if (device->isSequential()) {
+                    sz = qMin(sz, quint64(device->bytesAvailable()));
+                    if (!sz)
+                        return; // we will come back on readyRead
+                }
+                data.resize(sz);
+                readSz = device->read(data.data(), sz);
+                if (readSz < 0) {
+                    handleStreamFail(QString::fromLatin1("source device failed"));
+                    return;
+                }
+                data.resize(readSz);
             }
-            data.resize(readSz);
             if (readSz == 0) {
                 if (!bytesLeft) {
                     lastReason = Reason(Reason::Condition::Success);
-                    if (hasher) {
-                        auto hash = hasher->result();
-                        if (hash.isValid()) {
-                            outgoingChecksum << hash;
-                            emit q->updated();
-                            return;
-                        }
-                    }
+                    if (sendChecksum())
+                        return;
                     setState(State::Finished);
                 } else {
                     handleStreamFail();
@@ -303,8 +438,17 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
                 hasher->addData(data);
             }
 
-            if (connection->features() & TransportFeature::MessageOriented) {
-                if (!connection->writeDatagram(data)) {
+            if (multiStream) {
+                QByteArray frame(FRAME_HEADER, Qt::Uninitialized);
+                qToBigEndian(streamPos, reinterpret_cast<uchar *>(frame.data()));
+                frame += data;
+                if (!stream->writeMessage(frame)) {
+                    handleStreamFail();
+                    return;
+                }
+                streamPos += quint64(data.size());
+            } else if (connection->features() & TransportFeature::MessageOriented) {
+                if (!connection->writeMessage(data)) {
                     handleStreamFail();
                     return;
                 }
@@ -314,20 +458,154 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
                     return;
                 }
             }
-            emit q->progress(device->pos());
+            flow->consume(data.size() + (multiStream ? FRAME_HEADER : 0));
+            emit q->progress(mapped ? qint64(mappedOffset + mappedPos) : device->pos());
             if (bytesLeft) {
                 *bytesLeft -= data.size();
             }
         }
 
+        // all the streams which can take data now. the primary one goes first
+        QList<Connection::Ptr> openStreams() const
+        {
+            QList<Connection::Ptr> ret;
+            if (connection->isOpen())
+                ret.append(connection);
+            for (auto const &stream : extraStreams) {
+                if (stream->isOpen())
+                    ret.append(stream);
+            }
+            return ret;
+        }
+
+        Connection::Ptr leastBusyStream() const
+        {
+            auto            streams = openStreams();
+            Connection::Ptr ret     = connection;
+            for (auto const &stream : streams) {
+                if (stream->bytesToWrite() < ret->bytesToWrite())
+                    ret = stream;
+            }
+            return ret;
+        }
+
+        void openExtraStreams()
+        {
+            auto transport = q->transport();
+            auto features  = TransportFeature::Reliable | TransportFeature::DataOriented; // order doesn't matter
+            if (transport->isLocal()) {
+                for (int i = 1; i < streamCount; i++) {
+                    auto stream = transport->addChannel(features, q->contentName() + QString::number(i));
+                    if (stream)
+                        addExtraStream(stream);
+                }
+                return;
+            }
+            transport->addAcceptor(features, [this, self = QPointer<Application>(q)](Connection::Ptr stream) {
+                if (!self || extraStreams.size() >= streamCount - 1 || q->state() >= State::Finishing)
+                    return false;
+                addExtraStream(stream);
+                return true;
+            });
+        }
+
+        void addExtraStream(Connection::Ptr stream)
+        {
+            extraStreams.append(stream);
+            connect(stream.data(), &Connection::readyRead, q, [this]() {
+                if (device && amIReceiver())
+                    readNextBlockFromTransport();
+            });
+            connect(stream.data(), &Connection::connected, q, [this]() {
+                if (device && amISender())
+                    writeNextBlockToTransport();
+            });
+            connect(
+                stream.data(), &Connection::bytesWritten, q, [this]() { onBytesWritten(); }, Qt::QueuedConnection);
+            connect(
+                stream.data(), &Connection::lowWatermarkReached, q, [this]() { onLowWatermark(); },
+                Qt::QueuedConnection);
+        }
+
+        void onLowWatermark()
+        {
+            if (device && amISender() && q->state() == State::Active)
+                writeNextBlockToTransport();
+        }
+
+        void onBytesWritten()
+        {
+            if (mapped && !connection->bytesToWrite() && mappedBlock < MAPPED_BLOCK_MAX)
+                mappedBlock *= 2; // the socket is faster than we feed it
+            auto bs      = getBlockSize();
+            auto backlog = multiStream ? leastBusyStream()->bytesToWrite() : connection->bytesToWrite();
+            if (q->pad()->session()->role() == q->senders() && quint64(backlog) < bs) {
+                writeNextBlockToTransport();
+            }
+        }
+
+        void hashInOrder(quint64 pos, const QByteArray &data)
+        {
+            if (pos != hashedPos) {
+                unhashed.insert(pos, data);
+                return;
+            }
+            hasher->addData(data);
+            hashedPos += quint64(data.size());
+            for (auto it = unhashed.begin(); it != unhashed.end() && it.key() == hashedPos; it = unhashed.erase(it)) {
+                hasher->addData(it.value());
+                hashedPos += quint64(it.value().size());
+            }
+        }
+
+        void readMultiStream()
+        {
+            bool haveData = true;
+            while (haveData && (!bytesLeft || *bytesLeft > 0) && device->bytesToWrite() < DEVICE_BACKLOG_MAX) {
+                haveData = false;
+                for (auto const &stream : openStreams()) {
+                    if (!stream->hasPendingDatagrams())
+                        continue;
+                    haveData   = true;
+                    auto frame = stream->readMessage();
+                    if (frame.size() <= FRAME_HEADER) {
+                        handleStreamFail(QString::fromLatin1("broken multi-stream block"));
+                        return;
+                    }
+                    auto pos  = qFromBigEndian<quint64>(reinterpret_cast<const uchar *>(frame.constData()));
+                    auto data = frame.mid(FRAME_HEADER);
+                    if (!device->seek(deviceBase + qint64(pos)) || device->write(data) == -1) {
+                        handleStreamFail();
+                        return;
+                    }
+                    if (hasher)
+                        hashInOrder(pos, data);
+                    if (journal)
+                        journal->addData(receivedAt + pos, data);
+                    streamPos += quint64(data.size());
+                    if (bytesLeft)
+                        *bytesLeft -= qMin(*bytesLeft, quint64(data.size()));
+                }
+            }
+            emit q->progress(receivedAt + streamPos);
+            if (bytesLeft && *bytesLeft == 0) {
+                tryFinalizeIncoming();
+            }
+        }
+
         void readNextBlockFromTransport()
         {
+            IRIS_STALL_WATCH(FileTransfer, QStringLiteral("receive"));
+            if (multiStream) {
+                readMultiStream();
+                return;
+            }
             quint64 bytesAvail;
-            while ((!bytesLeft || *bytesLeft > 0)
+            while ((!bytesLeft || *bytesLeft > 0) && device->bytesToWrite() < DEVICE_BACKLOG_MAX
                    && ((bytesAvail = connection->bytesAvailable()) || (connection->hasPendingDatagrams()))) {
                 QByteArray data;
                 if (connection->features() & TransportFeature::MessageOriented) {
-                    data = connection->readDatagram().data();
+                    data = connection->readMessage();
                 } else {
                     quint64 sz = 65536; // shall we respect transport->blockSize() ?
                     if (bytesLeft && sz > *bytesLeft) {
@@ -350,6 +628,13 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
                     handleStreamFail();
                     return;
                 }
+                if (journal) {
+                    journal->addData(receivedAt, data);
+                    notJournaled += quint64(data.size());
+                    if (notJournaled >= JOURNAL_SAVE_INTERVAL && journal->save())
+                        notJournaled = 0;
+                }
+                receivedAt += quint64(data.size());
                 emit q->progress(device->pos());
                 if (bytesLeft) {
                     *bytesLeft -= data.size();
@@ -371,7 +656,12 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
 
             lastReason = {};
             lastError  = {};
+            // both sides see the same transport, so they come to the same decision
+            multiStream = streamCount > 1 && !streamingMode
+                && (connection->features() & TransportFeature::MessageOriented)
+                && q->transport()->maxSupportedChannelsPerComponent(connection->features()) > 1;
 
+            receivedAt = acceptFile.range().offset;
             if (acceptFile.range().isValid()) {
                 if (acceptFile.range().length) {
                     bytesLeft = acceptFile.range().length;
@@ -422,12 +712,15 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
                                qUtf8Printable(q->pad()->session()->peer().full()));
                         writeLoggingStarted = true;
                     }
-                    auto bs = getBlockSize();
-                    if (q->pad()->session()->role() == q->senders() && quint64(connection->bytesToWrite()) < bs) {
-                        writeNextBlockToTransport();
-                    }
+                    onBytesWritten();
                 },
                 Qt::QueuedConnection);
+            connect(
+                connection.data(), &Connection::lowWatermarkReached, q, [this]() { onLowWatermark(); },
+                Qt::QueuedConnection);
+
+            if (multiStream)
+                openExtraStreams();
 
             if (amIReceiver()) {
                 connect(connection.data(), &Connection::disconnected, q, [this]() { tryFinalizeIncoming(); });
@@ -535,12 +828,31 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         return Application::Ok;
     }
 
+    static int parseStreamCount(const QDomElement &description)
+    {
+        auto el = description.firstChildElement(STREAMS_TAG);
+        if (el.isNull() || el.namespaceURI() != STREAMS_NS)
+            return 1;
+        return qBound(1, el.attribute(QStringLiteral("count")).toInt(), MAX_STREAMS);
+    }
+
+    static void addStreamCount(QDomDocument *doc, QDomElement &description, int count)
+    {
+        if (count < 2)
+            return;
+        auto el = doc->createElementNS(STREAMS_NS, STREAMS_TAG);
+        el.setAttribute(QStringLiteral("count"), count);
+        description.appendChild(el);
+    }
+
     Application::SetDescError Application::setRemoteOffer(const QDomElement &description)
     {
         File f;
         auto ret = parseDescription(description, f);
-        if (ret == Application::Ok)
-            d->file = f;
+        if (ret == Application::Ok) {
+            d->file          = f;
+            d->remoteStreams = parseStreamCount(description);
+        }
         return ret;
     }
 
@@ -549,7 +861,8 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         File f;
         auto ret = parseDescription(description, f);
         if (ret == Application::Ok) {
-            d->acceptFile = f;
+            d->acceptFile  = f;
+            d->streamCount = qMin(parseStreamCount(description), d->streamsWanted);
             setState(State::Accepted);
         }
         return ret;
@@ -565,6 +878,7 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
 
         d->prepareThumbnail(d->file);
         el.appendChild(d->file.toXml(doc));
+        addStreamCount(doc, el, d->streamsWanted);
         return el;
     }
 
@@ -579,6 +893,8 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         auto doc = _pad->doc();
         auto el  = doc->createElementNS(NS, "description");
         el.appendChild(d->acceptFile.toXml(doc));
+        d->streamCount = d->streamingMode ? 1 : qMin(d->remoteStreams, d->streamsWanted);
+        addStreamCount(doc, el, d->streamCount);
         return el;
     }
 
@@ -610,6 +926,17 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
 
     File Application::file() const { return d->file; }
 
+    void Application::setJournal(TransferJournal *journal) { d->journal = journal; }
+
+    void Application::setStreamCount(int count) { d->streamsWanted = qBound(1, count, MAX_STREAMS); }
+
+    void Application::setBandwidthWeight(int weight)
+    {
+        d->bandwidthWeight = qMax(1, weight);
+        if (d->flow)
+            d->flow->setWeight(d->bandwidthWeight);
+    }
+
     File Application::acceptFile() const { return d->acceptFile; }
 
     void Application::setAcceptFile(const File &file) const { d->acceptFile = file; }
@@ -820,6 +1147,37 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         app->setFile(file);
     }
 
+    QList<Application *> Pad::addStripedOffer(const File &file, const QStringList &transports)
+    {
+        auto const  available = _manager->availableTransports();
+        QStringList usable;
+        for (auto const &ns : transports) {
+            if (available.contains(ns) && !usable.contains(ns) && _session->checkPeerCaps(ns))
+                usable.append(ns);
+        }
+        quint64 size    = file.size().value_or(0);
+        int     stripes = int(qMin(quint64(qMax(usable.size(), 1)), qMax(size, quint64(1))));
+
+        QList<Application *> ret;
+        quint64              offset = 0;
+        for (int i = 0; i < stripes; i++) {
+            auto app = static_cast<Application *>(_session->newContent(NS, _session->role()));
+            if (!app)
+                break;
+            File f(file);
+            if (stripes > 1) {
+                quint64 length = i == stripes - 1 ? size - offset : size / quint64(stripes);
+                f.setRange(Range(offset, length));
+                offset += length;
+                static_cast<NSTransportsList *>(app->transportSelector())->prefer(usable[i]);
+            }
+            app->setFile(f);
+            _session->addContent(app);
+            ret.append(app);
+        }
+        return ret;
+    }
+
 } // namespace FileTransfer
 } // namespace Jingle
 } // namespace XMPP
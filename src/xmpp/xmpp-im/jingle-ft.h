@@ -33,6 +33,7 @@ class Thumbnail;
 namespace XMPP { namespace Jingle { namespace FileTransfer {
 
     extern const QString NS;
+    class Application;
     class Manager;
 
     class Pad : public ApplicationManagerPad {
@@ -48,6 +49,16 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         bool                incomingSessionInfo(const QDomElement &el) override;
 
         void addOutgoingOffer(const File &file);
+        /**
+         * @brief addStripedOffer offers the file as several ranges, one content per transport.
+         *
+         * Ranges are sent in parallel, each preferring its own transport from \a transports (the other transports
+         * remain its fallbacks), so the bandwidth of several paths adds up. Transports we don't have or the peer
+         * doesn't support are skipped. The receiver gets a deviceRequested(offset, size) per content and has only
+         * to write each range at its offset. With less than two usable transports a single content is offered.
+         * The file size has to be known. Created contents are added to the session.
+         */
+        QList<Application *> addStripedOffer(const File &file, const QStringList &transports);
 
     private:
         Manager *_manager;
@@ -93,6 +104,31 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
         void            setDevice(QIODevice *dev, bool closeOnFinish = true);
         Connection::Ptr connection() const;
 
+        /**
+         * @brief setJournal records received data to the journal (non-streaming receiving only).
+         *
+         * The journal is saved periodically and when the transfer fails, and removed when it succeeds.
+         * To resume a transfer load the journal and accept the offer with journal->resumeFile().
+         * The journal is not owned and has to outlive the application.
+         */
+        void setJournal(TransferJournal *journal);
+
+        /**
+         * @brief setStreamCount asks to send the file over several streams at once. Both sides have to opt in.
+         *
+         * Used only when the transport has many message oriented channels, like SCTP data channels over ICE.
+         * Every block carries its offset, so a loss on one stream doesn't stall the others. The receiving device
+         * has to be seekable and streaming mode is not supported. Call it before the offer or the answer is made.
+         */
+        void setStreamCount(int count);
+
+        /**
+         * @brief setBandwidthWeight sets the share of this transfer in the rate of the BandwidthScheduler.
+         *
+         * A transfer of weight 2 gets twice the bandwidth of one of weight 1 while both are held back. Default 1.
+         */
+        void setBandwidthWeight(int weight);
+
         // next method are used by Jingle::Session and usually shouldn't be called manually
         XMPP::Jingle::Application::Update evaluateOutgoingUpdate() override;
         OutgoingUpdate                    takeOutgoingUpdate() override;
@@ -111,7 +147,8 @@ namespace XMPP { namespace Jingle { namespace FileTransfer {
     signals:
         void connectionReady(); // streaming mode only
 
-        // if size is not set then it's reamaining part of the file (non-streaming mode only)
+        // if size is not set then it's reamaining part of the file (non-streaming mode only). a FileSink with the
+        // size preallocated keeps the disk writes off this thread
         void deviceRequested(quint64 offset, std::optional<quint64> size);
         void progress(quint64 offset);
 
@@ -61,7 +61,10 @@ namespace XMPP { namespace Jingle { namespace IBB {
             c->setParent(this);
             connection = c;
             connect(c, &IBBConnection::readyRead, this, &Connection::readyRead);
-            connect(c, &IBBConnection::bytesWritten, this, &Connection::bytesWritten);
+            connect(c, &IBBConnection::bytesWritten, this, [this](qint64 bytes) {
+                emit bytesWritten(bytes);
+                checkWatermarks();
+            });
             connect(c, &IBBConnection::connectionClosed, this, &Connection::handleIBBClosed);
             connect(c, &IBBConnection::delayedCloseFinished, this, &Connection::handleIBBClosed);
             connect(c, &IBBConnection::aboutToClose, this, &Connection::aboutToClose);
@@ -106,7 +109,12 @@ namespace XMPP { namespace Jingle { namespace IBB {
         }
 
     protected:
-        qint64 writeData(const char *data, qint64 maxSize) { return connection->write(data, maxSize); }
+        qint64 writeData(const char *data, qint64 maxSize)
+        {
+            auto ret = connection->write(data, maxSize);
+            checkWatermarks();
+            return ret;
+        }
 
         qint64 readDataInternal(char *data, qint64 maxSize)
         {
@@ -24,7 +24,9 @@
 #include "jingle-ice.h"
 
 #include "dtls.h"
+#include "dtlsidentitypool.h"
 #include "ice176.h"
+#include "icewarmpool.h"
 #include "jingle-session.h"
 #include "netnames.h"
 #include "stundisco.h"
@@ -37,8 +39,10 @@
 #include <memory>
 
 #include <QElapsedTimer>
+#include <QHash>
 #include <QNetworkInterface>
 #include <QTimer>
+#include <QtCrypto>
 
 template <class T> constexpr std::add_const_t<T> &as_const(T &t) noexcept { return t; }
 
@@ -66,9 +70,8 @@ namespace XMPP { namespace Jingle { namespace ICE {
         // TODO: remove this?
         // c.rem_addr = QHostAddress(e.attribute("rem-addr"));
         // c.rem_port = e.attribute("rem-port").toInt();
-        c.type = e.attribute("type");
-
-        // TODO tcptype
+        c.type    = e.attribute("type");
+        c.tcptype = e.attribute("tcptype");
 
         return c;
     }
@@ -100,6 +103,8 @@ namespace XMPP { namespace Jingle { namespace ICE {
         // if(c.rem_port != -1)
         //    e.setAttribute("rem-port", QString::number(c.rem_port));
         e.setAttribute("type", c.type);
+        if (!c.tcptype.isEmpty())
+            e.setAttribute("tcptype", c.tcptype);
         return e;
     }
 
@@ -335,6 +340,17 @@ namespace XMPP { namespace Jingle { namespace ICE {
         QString      extHost;
         QHostAddress selfAddr;
 
+        // with multiplexing, every transport draws from this one reserver of the base ports
+        bool                            multiplexPorts = false;
+        QPointer<XMPP::UdpPortReserver> sharedPortReserver;
+
+        // idle transports with the servers' answers, shared by the sessions
+        int                         warmPoolSize = 0;
+        QPointer<XMPP::IceWarmPool> warmPool;
+
+        XMPP::Ice176::AddressPolicy addressPolicy;
+        bool                        iceLite = false;
+
         QString stunBindHost;
         int     stunBindPort;
         QString stunRelayUdpHost;
@@ -348,6 +364,9 @@ namespace XMPP { namespace Jingle { namespace ICE {
 
         XMPP::TurnClient::Proxy stunProxy;
 
+        // the local DTLS certificates, generated ahead of the sessions and shared by them. owned by the manager
+        XMPP::DtlsIdentityPool *dtlsPool = nullptr;
+
         // FIMME it's reuiqred to split transports by direction otherwise we gonna hit conflicts.
         // jid,transport-sid -> transport mapping
         //        QSet<QPair<Jid, QString>>   sids;
@@ -464,7 +483,8 @@ namespace XMPP { namespace Jingle { namespace ICE {
         // QElapsedTimer      lastConnectionStart;
         // size_t             blockSize    = 8192;
         TcpPortDiscoverer *disco        = nullptr;
-        UdpPortReserver   *portReserver = nullptr;
+        UdpPortReserver   *portReserver       = nullptr;
+        bool               sharedPortReserver = false; // owned by the manager then
         Resolver           resolver;
         XMPP::Ice176      *ice = nullptr;
 
@@ -474,15 +494,16 @@ namespace XMPP { namespace Jingle { namespace ICE {
         SCTP::MapElement sctp;
 #endif
 
-        QHostAddress extAddr;
-        QHostAddress stunBindAddr, stunRelayUdpAddr, stunRelayTcpAddr;
-        int          stunBindPort;
-        int          stunRelayUdpPort;
-        int          stunRelayTcpPort;
-        QString      stunRelayUdpUser;
-        QString      stunRelayUdpPass;
-        QString      stunRelayTcpUser;
-        QString      stunRelayTcpPass;
+        QHostAddress     extAddr;
+        QHostAddress     stunBindAddr, stunRelayUdpAddr, stunRelayTcpAddr;
+        int              stunBindPort;
+        int              stunRelayUdpPort;
+        int              stunRelayTcpPort;
+        TurnClient::Mode stunRelayTcpMode = TurnClient::PlainMode;
+        QString          stunRelayUdpUser;
+        QString          stunRelayUdpPass;
+        QString          stunRelayTcpUser;
+        QString          stunRelayTcpPass;
         // QString
 
         // udp stuff
@@ -495,7 +516,7 @@ namespace XMPP { namespace Jingle { namespace ICE {
             if (ice) {
                 ice->disconnect(q);
                 auto stopper = new IceStopper;
-                stopper->start(portReserver, QList<Ice176 *>() << ice);
+                stopper->start(sharedPortReserver ? nullptr : portReserver, QList<Ice176 *>() << ice);
             }
         }
 
@@ -509,6 +530,15 @@ namespace XMPP { namespace Jingle { namespace ICE {
             return c;
         }
 
+        // a ready identity from the pool, otherwise dtls will generate one
+        void setDtlsIdentity(Dtls *dtls)
+        {
+            auto manager  = static_cast<Manager *>(q->pad()->manager())->d.get();
+            auto identity = manager->dtlsPool->identity(q->pad()->session()->me().full());
+            if (!identity.isNull())
+                dtls->setLocalCertificate(identity.cert, identity.pkey, identity.fingerprint);
+        }
+
         void setupDtls(int componentIndex)
         {
             qDebug("Setup DTLS");
@@ -519,6 +549,7 @@ namespace XMPP { namespace Jingle { namespace ICE {
                 = new Dtls(q, q->pad()->session()->me().full(), q->pad()->session()->peer().full());
 
             auto dtls = components[componentIndex].dtls;
+            setDtlsIdentity(dtls);
             if (q->isLocal()) {
                 dtls->initOutgoing();
             } else {
@@ -596,6 +627,7 @@ namespace XMPP { namespace Jingle { namespace ICE {
                                        ExternalService::Ptr stun;
                                        ExternalService::Ptr turnUdp;
                                        ExternalService::Ptr turnTcp;
+                                       ExternalService::Ptr turnTls;
                                        for (auto const &s : std::as_const(services)) {
                                            if (s->type == QLatin1String("stun")
                                                && (s->transport.isEmpty() || s->transport == QLatin1String("udp")))
@@ -605,7 +637,13 @@ namespace XMPP { namespace Jingle { namespace ICE {
                                                    turnTcp = s;
                                                else
                                                    turnUdp = s;
-                                           }
+                                           } else if (s->type == QLatin1String("turns"))
+                                               turnTls = s;
+                                       }
+                                       // there is room for one tcp relay. tls gets through more firewalls
+                                       if (turnTls) {
+                                           turnTcp          = turnTls;
+                                           stunRelayTcpMode = TurnClient::TlsMode;
                                        }
                                        Resolver::ResolveList resList;
                                        if (stun) {
@@ -639,7 +677,7 @@ namespace XMPP { namespace Jingle { namespace ICE {
                                            });
                                        }
                                    },
-                                   5min, { "stun", "turn" });
+                                   5min, { "stun", "turn", "turns" });
                 return;
             }
 
@@ -671,21 +709,28 @@ namespace XMPP { namespace Jingle { namespace ICE {
             if (!stunRelayUdpAddr.isNull() && stunRelayUdpPort > 0 && !stunRelayUdpUser.isEmpty())
                 qDebug("TURN w/ UDP service: %s;%d", qPrintable(stunRelayUdpAddr.toString()), stunRelayUdpPort);
             if (!stunRelayTcpAddr.isNull() && stunRelayTcpPort > 0 && !stunRelayTcpUser.isEmpty())
-                qDebug("TURN w/ TCP service: %s;%d", qPrintable(stunRelayTcpAddr.toString()), stunRelayTcpPort);
+                qDebug("TURN w/ %s service: %s;%d", stunRelayTcpMode == TurnClient::TlsMode ? "TLS" : "TCP",
+                       qPrintable(stunRelayTcpAddr.toString()), stunRelayTcpPort);
 
-            auto listenAddrs = Ice176::availableNetworkAddresses();
+            auto localAddrs = Ice176::availableLocalAddresses(manager->addressPolicy);
 
-            QList<XMPP::Ice176::LocalAddress> localAddrs;
-
-            QStringList strList;
-            for (const QHostAddress &h : as_const(listenAddrs)) {
-                XMPP::Ice176::LocalAddress addr;
-                addr.addr = h;
-                localAddrs += addr;
-                strList += h.toString();
+            QList<QHostAddress> listenAddrs;
+            QStringList         strList;
+            for (const XMPP::Ice176::LocalAddress &la : as_const(localAddrs)) {
+                listenAddrs += la.addr;
+                strList += la.addr.toString();
             }
 
-            if (manager->basePort != -1) {
+            if (manager->basePort != -1 && manager->multiplexPorts) {
+                if (!manager->sharedPortReserver) {
+                    manager->sharedPortReserver = new XMPP::UdpPortReserver(q->pad()->manager());
+                    manager->sharedPortReserver->setMultiplexed(true);
+                    manager->sharedPortReserver->setAddresses(listenAddrs);
+                    manager->sharedPortReserver->setPorts(manager->basePort, 4);
+                }
+                portReserver       = manager->sharedPortReserver;
+                sharedPortReserver = true;
+            } else if (manager->basePort != -1) {
                 portReserver = new XMPP::UdpPortReserver(q);
                 portReserver->setAddresses(listenAddrs);
                 portReserver->setPorts(manager->basePort, 4);
@@ -746,6 +791,18 @@ namespace XMPP { namespace Jingle { namespace ICE {
             ice->setProxy(manager->stunProxy);
             if (portReserver)
                 ice->setPortReserver(portReserver);
+            if (manager->warmPoolSize > 0) {
+                if (!manager->warmPool) {
+                    manager->warmPool = new XMPP::IceWarmPool(q->pad()->manager());
+                    manager->warmPool->setSize(manager->warmPoolSize);
+                }
+                ice->setWarmPool(manager->warmPool);
+            }
+            if (manager->jingleManager)
+                ice->setNatBehaviorCache(manager->jingleManager->natBehaviorCache());
+            // ICE-TCP is there if the application registered an IceTcpServersProducer under "ice"
+            if (auto scope = q->pad().staticCast<Pad>()->discoScope())
+                ice->setTcpPortScope(scope);
 
             // QList<XMPP::Ice176::LocalAddress> localAddrs;
             // XMPP::Ice176::LocalAddress addr;
@@ -792,16 +849,21 @@ namespace XMPP { namespace Jingle { namespace ICE {
                                             stunRelayUdpPass.toUtf8());
             if (!stunRelayTcpAddr.isNull() && !stunRelayTcpUser.isEmpty())
                 ice->setStunRelayTcpService(stunRelayTcpAddr, stunRelayTcpPort, stunRelayTcpUser,
-                                            stunRelayTcpPass.toUtf8());
+                                            stunRelayTcpPass.toUtf8(), stunRelayTcpMode);
             ice->setStunDiscoverer(q->pad()->session()->manager()->client()->stunDiscoManager()->createMonitor());
 
             ice->setComponentCount(components.count());
             ice->setLocalFeatures(Ice176::Trickle);
+            // dtls doesn't care which pair carries it, so start the handshake on the first valid one
+            ice->setEarlyMedia(true);
+            // and it doesn't notice a switch to a backup pair either when the selected one gets slow or lossy
+            ice->setPathMonitoring(2);
 
             setupRemoteICE(*remoteState);
             remoteState->cleanupICE();
 
             auto mode = q->creator() == q->pad()->session()->role() ? XMPP::Ice176::Initiator : XMPP::Ice176::Responder;
+            ice->setLiteMode(mode == XMPP::Ice176::Responder && manager->iceLite);
             ice->start(mode);
         }
 
@@ -976,7 +1038,8 @@ namespace XMPP { namespace Jingle { namespace ICE {
                 }
                 initSctpAssociation(componentIndex);
             }
-            Q_UNUSED(channelFeatures); // TODO
+            if (channelFeatures & TransportFeature::DataOriented)
+                c.sctp->setProfile(SCTP::Profile::Bulk); // ignored if the association is running already
             return c.sctp->newChannel(SCTP::Reliable, true, 0, 256, label);
         }
 #endif
@@ -1157,7 +1220,10 @@ namespace XMPP { namespace Jingle { namespace ICE {
     //----------------------------------------------------------------
     // Manager
     //----------------------------------------------------------------
-    Manager::Manager(QObject *parent) : TransportManager(parent), d(new Private) { }
+    Manager::Manager(QObject *parent) : TransportManager(parent), d(new Private)
+    {
+        d->dtlsPool = new XMPP::DtlsIdentityPool(this);
+    }
 
     Manager::~Manager()
     {
@@ -1180,13 +1246,18 @@ namespace XMPP { namespace Jingle { namespace ICE {
 
     QSharedPointer<XMPP::Jingle::Transport> Manager::newTransport(const TransportManagerPad::Ptr &pad, Origin creator)
     {
+        // the key is generated while the session is negotiated, if there is none yet
+        if (Dtls::isSupported())
+            d->dtlsPool->prepare(pad->session()->me().full());
         return QSharedPointer<Transport>::create(pad, creator).staticCast<XMPP::Jingle::Transport>();
     }
 
     TransportManagerPad *Manager::pad(Session *session) { return new Pad(this, session); }
 
     QStringList Manager::ns() const { return { NS }; }
-    QStringList Manager::discoFeatures() const
+    QStringList Manager::discoFeatures() const { return supportedFeatures(); }
+
+    QStringList Manager::supportedFeatures()
     {
         return { NS, NS_DTLS
 #ifdef JINGLE_SCTP
@@ -1198,6 +1269,19 @@ namespace XMPP { namespace Jingle { namespace ICE {
 
     void Manager::setBasePort(int port) { d->basePort = port; }
 
+    void Manager::setPortMultiplexing(bool enabled) { d->multiplexPorts = enabled; }
+
+    void Manager::setWarmPoolSize(int count)
+    {
+        d->warmPoolSize = count;
+        if (d->warmPool)
+            d->warmPool->setSize(count);
+    }
+
+    void Manager::setAddressPolicy(const XMPP::Ice176::AddressPolicy &policy) { d->addressPolicy = policy; }
+
+    void Manager::setIceLite(bool enabled) { d->iceLite = enabled; }
+
     void Manager::setExternalAddress(const QString &host) { d->extHost = host; }
 
     void Manager::setSelfAddress(const QHostAddress &addr) { d->selfAddr = addr; }
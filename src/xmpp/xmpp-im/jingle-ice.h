@@ -20,6 +20,7 @@
 #ifndef JINGLE_ICE_H
 #define JINGLE_ICE_H
 
+#include "iris/ice176.h"
 #include "iris/tcpportreserver.h"
 #include "iris/xmpp.h"
 #include "jingle-transport.h"
@@ -98,6 +99,8 @@ namespace Jingle { namespace ICE {
 
         QStringList ns() const override;
         QStringList discoFeatures() const override;
+        // the same without a manager, see Client::makeDiscoResult()
+        static QStringList supportedFeatures();
 
         // TODO reimplement closeAll to support old protocols
 
@@ -118,6 +121,18 @@ namespace Jingle { namespace ICE {
         void removeKeyMapping(const QString &key);
 
         void setBasePort(int port);
+        // share the base ports between all the sessions instead of giving each its own. lets one
+        //   process serve many more sessions than it has ports, but no STUN/TURN over those ports
+        void setPortMultiplexing(bool enabled);
+        // keep this many transports per local address with STUN and TURN done, for the next sessions to
+        //   start with their candidates known. 0 (the default) disables it. the pool learns the servers
+        //   from the sessions and doesn't apply to the base ports
+        void setWarmPoolSize(int count);
+        // which local addresses the sessions gather candidates on. see Ice176::availableLocalAddresses()
+        void setAddressPolicy(const XMPP::Ice176::AddressPolicy &policy);
+        // for a server with a public address: the sessions it doesn't initiate run ICE-lite, see
+        //   Ice176::setLiteMode(). host candidates only, so no STUN/TURN for them
+        void setIceLite(bool enabled);
         void setExternalAddress(const QString &host);
         void setSelfAddress(const QHostAddress &addr);
         void setStunBindService(const QString &host, int port);
@@ -18,10 +18,26 @@
  */
 
 #include "jingle-nstransportslist.h"
+#include "jingle-ice.h"
 #include "jingle-session.h"
+#include "jingle.h"
+#include "natbehavior.h"
 
 namespace XMPP { namespace Jingle {
 
+    NSTransportsList::NSTransportsList(Session *session, const QStringList &transports) :
+        _session(session), _transports(transports)
+    {
+        auto const cached = session->manager()->peerTransport(session->peer());
+        if (!cached.isEmpty())
+            prefer(cached);
+
+        // without udp ICE is left with TURN over tcp at best, so it goes after the others
+        auto const nat = session->manager()->natBehaviorCache();
+        if (nat && nat->behavior().isUdpBlocked() && _transports.removeAll(ICE::NS))
+            _transports.prepend(ICE::NS);
+    }
+
     QSharedPointer<Transport> NSTransportsList::getNextTransport() { return getNextNSTransport(); }
 
     QSharedPointer<Transport> NSTransportsList::getAlikeTransport(QSharedPointer<Transport> alike)
@@ -55,6 +71,13 @@ namespace XMPP { namespace Jingle {
         return QSharedPointer<Transport>();
     }
 
+    void NSTransportsList::prefer(const QString &ns)
+    {
+        // the last one is the most preferred
+        if (_transports.removeAll(ns))
+            _transports.append(ns);
+    }
+
     void NSTransportsList::backupTransport(QSharedPointer<Transport> tr) { _transports += tr->pad()->ns(); }
 
     bool NSTransportsList::hasMoreTransports() const { return !_transports.isEmpty(); }
@@ -27,15 +27,16 @@ namespace XMPP { namespace Jingle {
     class Session;
     class NSTransportsList : public TransportSelector {
     public:
-        inline NSTransportsList(Session *session, const QStringList &transports) :
-            _session(session), _transports(transports)
-        {
-        }
+        // the transport which worked with the peer last time (see Manager::peerTransport()) goes first. ICE goes
+        //   last on a network which blocks udp, see Manager::setNatBehaviorCache()
+        NSTransportsList(Session *session, const QStringList &transports);
 
         QSharedPointer<Transport> getNextTransport() override;
         QSharedPointer<Transport> getAlikeTransport(QSharedPointer<Transport> alike) override;
 
         QSharedPointer<Transport> getNextNSTransport(const QString &preferredNS = QString());
+        // makes ns the first one to try. the others are still used as fallback
+        void prefer(const QString &ns);
 
         void backupTransport(QSharedPointer<Transport>) override;
         bool hasMoreTransports() const override;
@@ -28,17 +28,31 @@
 #include "xmpp_client.h"
 #include "xmpp_serverinfomanager.h"
 
+#include <QDeadlineTimer>
 #include <QElapsedTimer>
 #include <QNetworkInterface>
+#include <QTcpSocket>
 #include <QTimer>
 #if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
 #include <QRandomGenerator>
 #endif
 #include <QPointer>
 
+#include <algorithm>
+#include <memory>
+
 namespace XMPP { namespace Jingle { namespace S5B {
     const QString NS(QStringLiteral("urn:xmpp:jingle:transports:s5b:1"));
 
+    // how long proxy discovery results are shared between sessions
+    static const int PROXY_CACHE_TTL     = 10 * 60 * 1000;
+    static const int PROXY_PROBE_TIMEOUT = 5000;
+    // remote candidates probed at once, and how long a probe may take
+    static const int MAX_PARALLEL_PROBES     = 4;
+    static const int CANDIDATE_PROBE_TIMEOUT = 5000;
+    // delay before probing candidates of lower priority when higher ones are still probing
+    static const int PROBE_STAGGER = 200;
+
     static QString makeKey(const QString &sid, const Jid &j1, const Jid &j2)
     {
         auto data = QString::fromLatin1(
@@ -64,9 +78,14 @@ namespace XMPP { namespace Jingle { namespace S5B {
 
             this->client = client;
             this->mode   = mode;
+            // the negotiation is over, it's the file data from now on
+            client->setProfile(BSocket::Bulk);
 
             connect(client, &SocksClient::readyRead, this, &Connection::readyRead);
-            connect(client, &SocksClient::bytesWritten, this, &Connection::bytesWritten);
+            connect(client, &SocksClient::bytesWritten, this, [this](qint64 bytes) {
+                emit bytesWritten(bytes);
+                checkWatermarks();
+            });
             connect(client, &SocksClient::aboutToClose, this, &Connection::aboutToClose);
             setOpenMode(client->openMode());
             emit connected();
@@ -111,9 +130,11 @@ namespace XMPP { namespace Jingle { namespace S5B {
     protected:
         qint64 writeData(const char *data, qint64 maxSize)
         {
-            if (mode == Transport::Tcp)
-                return client->write(data, maxSize);
-            return -1;
+            if (mode != Transport::Tcp)
+                return -1;
+            auto ret = client->write(data, maxSize);
+            checkWatermarks();
+            return ret;
         }
 
         qint64 readDataInternal(char *data, qint64 maxSize)
@@ -234,6 +255,8 @@ namespace XMPP { namespace Jingle { namespace S5B {
         quint32             priority = 0;
         Candidate::Type     type     = Candidate::Direct;
         Candidate::State    state    = Candidate::New;
+        QElapsedTimer       probeStart;
+        int                 rtt = -1;
 
         QSharedPointer<S5BServer> server;
         SocksClient              *socksClient = nullptr;
@@ -253,6 +276,7 @@ namespace XMPP { namespace Jingle { namespace S5B {
         void connectToHost(const QString &key, State successState, QObject *callbackContext,
                            std::function<void(bool)> callback, bool isUdp)
         {
+            probeStart.start();
             QHostAddress ha(host);
             if (!ha.isNull() && ha.protocol() == QAbstractSocket::IPv6Protocol && ha.scopeId().isEmpty() &&
 #if QT_VERSION >= QT_VERSION_CHECK(5, 11, 0)
@@ -274,6 +298,7 @@ namespace XMPP { namespace Jingle { namespace S5B {
 
                             if (socksClient) {
                                 state = successState;
+                                rtt   = int(probeStart.elapsed());
                                 qDebug() << "connected: " << toString() << "socks client (ipv6)" << socksClient;
                                 callback(true);
                                 return;
@@ -291,6 +316,7 @@ namespace XMPP { namespace Jingle { namespace S5B {
                         return;
                     }
                     state = successState;
+                    rtt   = int(probeStart.elapsed());
                     qDebug() << "connected: " << toString() << "socks client" << socksClient;
                     callback(true);
                 });
@@ -499,6 +525,8 @@ namespace XMPP { namespace Jingle { namespace S5B {
 
     quint32 Candidate::priority() const { return d->priority; }
 
+    int Candidate::rtt() const { return d->rtt; }
+
     QDomElement Candidate::toXml(QDomDocument *doc) const
     {
         auto e = doc->createElement(QStringLiteral("candidate"));
@@ -647,15 +675,17 @@ namespace XMPP { namespace Jingle { namespace S5B {
         {
             proxiesInDiscoCount++;
             auto query = new JT_S5B(q->_pad->session()->manager()->client()->rootTask());
-            connect(query, &JT_S5B::finished, q, [this, query, cid]() {
+            connect(query, &JT_S5B::finished, q, [this, query, cid, j]() {
+                auto sh = query->proxyInfo();
+                if (query->success() && !sh.host().isEmpty() && sh.port()) // good for other sessions anyway
+                    static_cast<Manager *>(q->_pad->manager())->setProxyInfo(j, sh.host(), quint16(sh.port()));
                 if (!proxyDiscoveryInProgress) {
                     return;
                 }
                 bool candidateUpdated = false;
                 auto it               = localCandidates.find(cid);
                 if (it != localCandidates.end() && it->second.state() == Candidate::Probing) {
-                    auto &c  = it->second;
-                    auto  sh = query->proxyInfo();
+                    auto &c = it->second;
                     if (query->success() && !sh.host().isEmpty() && sh.port()) {
                         // it can be discarded by this moment (e.g. got success on a higher priority
                         // candidate). so we have to check.
@@ -683,10 +713,41 @@ namespace XMPP { namespace Jingle { namespace S5B {
             query->go(true);
         }
 
+        // proxies recently discovered by another session. no need to query them again
+        void useKnownProxies(const QList<Manager::ProxyInfo> &known, const Jid &userProxy)
+        {
+            bool    userProxyFound = !userProxy.isValid();
+            quint16 userPref       = quint16(known.size() + 1);
+            quint16 localPref      = quint16(known.size()); // the fastest is the most preferred
+            for (auto const &p : known) {
+                bool isUserProxy = !userProxyFound && p.jid == userProxy;
+                userProxyFound   = userProxyFound || isUserProxy;
+                Candidate c(q, p.jid, generateCid(), isUserProxy ? userPref : localPref--);
+                c.setHost(p.host);
+                c.setPort(p.port);
+                c.setState(Candidate::New);
+                qDebug("new local candidate: %s (rtt=%d)", qPrintable(c.toString()), p.rtt);
+                localCandidates.emplace(c.cid(), c);
+                pendingActions |= Private::NewCandidate;
+            }
+            if (!userProxyFound) {
+                Candidate c(q, userProxy, generateCid(), userPref);
+                qDebug("new local candidate: %s", qPrintable(c.toString()));
+                localCandidates.emplace(c.cid(), c);
+                proxyDiscoveryInProgress = true;
+                queryS5BProxy(userProxy, c.cid());
+            }
+        }
+
         void discoS5BProxy()
         {
             auto m     = static_cast<Manager *>(q->_pad->manager());
             Jid  proxy = m->userProxy();
+            auto known = m->knownProxies();
+            if (!known.isEmpty()) {
+                useKnownProxies(known, proxy);
+                return;
+            }
             if (proxy.isValid()) {
                 Candidate c(q, proxy, generateCid());
                 if (!isDup(c)) {
@@ -707,8 +768,12 @@ namespace XMPP { namespace Jingle { namespace S5B {
                     // about proxy
                     return;
                 }
-                auto m         = static_cast<Manager *>(q->_pad->manager());
-                Jid  userProxy = m->userProxy();
+                auto       m         = static_cast<Manager *>(q->_pad->manager());
+                Jid        userProxy = m->userProxy();
+                QList<Jid> discovered;
+                for (const auto &i : items)
+                    discovered.append(i.jid());
+                m->setProxiesDiscovered(discovered);
 
                 bool userProxyFound = !userProxy.isValid();
                 for (const auto &i : items) {
@@ -757,6 +822,7 @@ namespace XMPP { namespace Jingle { namespace S5B {
             */
 
             qDebug("tryConnectToRemoteCandidate()");
+            int probingCount = 0;
             for (auto &[cid, c] : remoteCandidates) {
                 if (c.state() == Candidate::New) {
                     if (c.priority() > maxNewPrio) {
@@ -767,15 +833,22 @@ namespace XMPP { namespace Jingle { namespace S5B {
                         maxNew.append(c);
                     }
                 }
-                if (c.state() == Candidate::Probing && c.priority() > maxProbingPrio) {
-                    maxProbing     = c;
-                    maxProbingPrio = c.priority();
+                if (c.state() == Candidate::Probing) {
+                    probingCount++;
+                    if (c.priority() > maxProbingPrio) {
+                        maxProbing     = c;
+                        maxProbingPrio = c.priority();
+                    }
                 }
             }
             if (maxNew.isEmpty()) {
                 qDebug("  tryConnectToRemoteCandidate() no maxNew candidates");
                 return; // nowhere to connect
             }
+            if (probingCount >= MAX_PARALLEL_PROBES) {
+                qDebug("  tryConnectToRemoteCandidate() too many probes in progress. let's wait");
+                return; // a finished or timed out probe brings us back here
+            }
 
             // check if we have to hang on for a little if a higher priority candidate is Probing
             if (maxProbing) {
@@ -784,7 +857,7 @@ namespace XMPP { namespace Jingle { namespace S5B {
                         qDebug("  tryConnectToRemoteCandidate() timer is already active. let's wait");
                         return; // we will come back here soon
                     }
-                    qint64 msToFuture = 200 - lastConnectionStart.elapsed();
+                    qint64 msToFuture = PROBE_STAGGER - lastConnectionStart.elapsed();
                     if (msToFuture > 0) { // seems like we have to rescheduler for future
                         probingTimer.start(int(msToFuture));
                         qDebug("  tryConnectToRemoteCandidate() too early. timer started. let's wait");
@@ -792,10 +865,12 @@ namespace XMPP { namespace Jingle { namespace S5B {
                     }
                 }
             }
-            probingTimer.start(200); // for the next candidate if any
+            probingTimer.start(PROBE_STAGGER); // for the next candidate if any
 
             // now we have to connect to maxNew candidates
             for (auto &mnc : maxNew) {
+                if (probingCount++ >= MAX_PARALLEL_PROBES)
+                    break; // the rest will wait for a free slot
                 lastConnectionStart.start();
                 QString key = mnc.type() == Candidate::Proxy ? dstaddr : directAddr;
                 mnc.setState(Candidate::Probing);
@@ -823,8 +898,20 @@ namespace XMPP { namespace Jingle { namespace S5B {
                             updateMinimalPriorityOnConnected();
                         }
                         checkAndFinishNegotiation();
+                        if (!success)
+                            tryConnectToRemoteCandidate(); // the slot is free now
                     },
                     mode == Transport::Udp);
+                // unreachable LAN addresses are often just silently dropped. don't wait for the OS to give up
+                QTimer::singleShot(CANDIDATE_PROBE_TIMEOUT, q, [this, mnc]() mutable {
+                    if (mnc.state() != Candidate::Probing)
+                        return;
+                    qDebug("probing timed out: %s", qPrintable(mnc.toString()));
+                    mnc.deleteSocksClient();
+                    mnc.setState(Candidate::Discarded);
+                    checkAndFinishNegotiation();
+                    tryConnectToRemoteCandidate();
+                });
             }
         }
 
@@ -1119,66 +1206,19 @@ namespace XMPP { namespace Jingle { namespace S5B {
             bool        hasNewCandidates = false;
             const auto &servers          = disco->takeServers();
             for (const auto &serv : servers) {
-                auto s5bserv = serv.staticCast<S5BServer>();
-                s5bserv->registerKey(directAddr);
+                auto      s5bserv = serv.staticCast<S5BServer>();
                 Candidate c(q, serv, generateCid());
                 if (c.isValid() && !isDup(c) && c.priority()) {
-                    QObject::connect(s5bserv.data(), &S5BServer::incomingConnection, q,
-                                     [this, c](SocksClient *sc, const QString &key) mutable {
-                                         if (!connection->client && key == directAddr
-                                             && (c.state() == Candidate::Pending || c.state() == Candidate::Unacked)) {
-                                             c.incomingConnection(sc);
-                                             c.server().data()->disconnect(q); // drop this connection.
-                                             if (mode == Transport::Udp)
-                                                 sc->grantUDPAssociate("", 0);
-                                             else
-                                                 sc->grantConnect();
-                                             return;
-                                         }
-                                         qDebug("Reject incoming socks5 connection with key %s (%s)", qPrintable(key),
-                                                connection->client ? "already has connection" : "key mismatch");
-                                         sc->requestDeny();
-                                         sc->deleteLater();
-                                     });
-                    QObject::connect(
-                        s5bserv.data(), &S5BServer::incomingUdp, q,
-                        [this, c](bool isInit, const QHostAddress &addr, int sourcePort, const QString &key,
-                                  const QByteArray &data) {
-                            if (mode != Transport::Mode::Udp || !connection->client) {
-                                return false;
-                            }
-
-                            if (isInit) {
-                                // TODO probably we could create a Connection here and put all the params inside
-                                if (udpInitialized)
-                                    return false; // only init once
-
-                                // lock on to this sender
-                                udpAddress     = addr;
-                                udpPort        = quint16(sourcePort);
-                                udpInitialized = true;
-
-                                // reply that initialization was successful
-                                q->_pad->session()->manager()->client()->s5bManager()->jtPush()->sendUDPSuccess(
-                                    q->_pad->session()->peer(), key); // TODO fix ->->->
-                                return true;
-                            }
-
-                            // not initialized yet?  something went wrong
-                            if (!udpInitialized)
-                                return false;
-
-                            // must come from same source as when initialized
-                            if (addr != udpAddress || sourcePort != udpPort)
-                                return false;
-
-                            connection->enqueueIncomingUDP(data); // man_udpReady
-                            return true;
-                        });
+                    // by cid, the server must not keep the candidate alive (it unregisters the key when it dies)
+                    s5bserv->registerKey(
+                        directAddr, q, [this, cid = c.cid()](SocksClient *sc) { incomingConnection(cid, sc); },
+                        udpHandler());
                     localCandidates.emplace(c.cid(), c);
                     qDebug("new local candidate: %s", qPrintable(c.toString()));
                     pendingActions |= NewCandidate;
                     hasNewCandidates = true;
+                } else {
+                    s5bserv->registerKey(directAddr);
                 }
             }
             if (hasNewCandidates) {
@@ -1186,6 +1226,69 @@ namespace XMPP { namespace Jingle { namespace S5B {
             }
         }
 
+        void incomingConnection(const QString &cid, SocksClient *sc)
+        {
+            auto it = localCandidates.find(cid);
+            if (it == localCandidates.end()) {
+                sc->requestDeny();
+                return;
+            }
+            auto &c = it->second;
+            if (!connection->client && (c.state() == Candidate::Pending || c.state() == Candidate::Unacked)) {
+                c.incomingConnection(sc);
+                // no more connections on this server, the datagrams still come
+                c.server().staticCast<S5BServer>()->registerKey(
+                    directAddr, q, [](SocksClient *sc) { sc->requestDeny(); }, udpHandler());
+                if (mode == Transport::Udp)
+                    sc->grantUDPAssociate("", 0);
+                else
+                    sc->grantConnect();
+                return;
+            }
+            qDebug("Reject incoming socks5 connection with key %s (already has connection)", qPrintable(directAddr));
+            sc->requestDeny();
+        }
+
+        S5BServer::UdpHandler udpHandler()
+        {
+            return [this](bool isInit, const QHostAddress &addr, int sourcePort, const QByteArray &data) {
+                incomingUdp(isInit, addr, sourcePort, data);
+            };
+        }
+
+        void incomingUdp(bool isInit, const QHostAddress &addr, int sourcePort, const QByteArray &data)
+        {
+            if (mode != Transport::Mode::Udp || !connection->client) {
+                return;
+            }
+
+            if (isInit) {
+                // TODO probably we could create a Connection here and put all the params inside
+                if (udpInitialized)
+                    return; // only init once
+
+                // lock on to this sender
+                udpAddress     = addr;
+                udpPort        = quint16(sourcePort);
+                udpInitialized = true;
+
+                // reply that initialization was successful
+                q->_pad->session()->manager()->client()->s5bManager()->jtPush()->sendUDPSuccess(
+                    q->_pad->session()->peer(), directAddr); // TODO fix ->->->
+                return;
+            }
+
+            // not initialized yet?  something went wrong
+            if (!udpInitialized)
+                return;
+
+            // must come from same source as when initialized
+            if (addr != udpAddress || sourcePort != udpPort)
+                return;
+
+            connection->enqueueIncomingUDP(data); // man_udpReady
+        }
+
         void handleConnected(Candidate &connCand)
         {
             connection->setSocksClient(connCand.takeSocksClient(), mode);
@@ -1585,14 +1688,18 @@ namespace XMPP { namespace Jingle { namespace S5B {
             }
         } else if (d->pendingActions & Private::CandidateUsed) {
             d->pendingActions &= ~Private::CandidateUsed;
-            // we should have the only remote candidate in Pending state.
-            // all other has to be discarded by priority check
+            // lower priority candidates are discarded by priority check. of the same priority ones the fastest wins
+            Candidate c;
             for (auto &it : d->remoteCandidates) {
-                auto &c = it.second;
-                if (c.state() != Candidate::Pending) {
+                auto &rc = it.second;
+                if (rc.state() != Candidate::Pending) {
                     continue;
                 }
-                qDebug("sending candidate-used: cid=%s", qPrintable(c.cid()));
+                if (!c || rc.priority() > c.priority() || (rc.priority() == c.priority() && rc.rtt() < c.rtt()))
+                    c = rc;
+            }
+            if (c) {
+                qDebug("sending candidate-used: cid=%s rtt=%d", qPrintable(c.cid()), c.rtt());
                 auto el = tel.appendChild(doc->createElement(QStringLiteral("candidate-used"))).toElement();
                 el.setAttribute(QStringLiteral("cid"), c.cid());
                 c.setState(Candidate::Unacked);
@@ -1605,7 +1712,6 @@ namespace XMPP { namespace Jingle { namespace S5B {
                     }
                     d->checkAndFinishNegotiation();
                 });
-                break;
             }
             if (std::get<0>(upd).isNull()) {
                 qWarning("Got CandidateUsed pending action but no pending candidates");
@@ -1705,6 +1811,14 @@ namespace XMPP { namespace Jingle { namespace S5B {
         QSet<QPair<Jid, QString>>   sids;
         QHash<QString, Transport *> key2transport;
         Jid                         proxy;
+        QList<Manager::ProxyInfo>   proxies; // discovered ones and the user's one
+        QDeadlineTimer              proxiesExpire { 0 };
+
+        Manager::ProxyInfo *findProxy(const Jid &jid)
+        {
+            auto it = std::find_if(proxies.begin(), proxies.end(), [&jid](auto const &p) { return p.jid == jid; });
+            return it == proxies.end() ? nullptr : &(*it);
+        }
     };
 
     Manager::Manager(QObject *parent) : TransportManager(parent), d(new Private) { }
@@ -1784,6 +1898,61 @@ namespace XMPP { namespace Jingle { namespace S5B {
 
     void Manager::setUserProxy(const Jid &jid) { d->proxy = jid; }
 
+    QList<Manager::ProxyInfo> Manager::knownProxies() const
+    {
+        if (d->proxiesExpire.hasExpired())
+            return {};
+        QList<ProxyInfo> ret;
+        for (auto const &p : std::as_const(d->proxies)) {
+            if (!p.host.isEmpty())
+                ret.append(p);
+        }
+        std::stable_sort(ret.begin(), ret.end(), [](auto const &a, auto const &b) {
+            return a.rtt != -1 && (b.rtt == -1 || a.rtt < b.rtt); // unmeasured go last
+        });
+        return ret;
+    }
+
+    void Manager::setProxiesDiscovered(const QList<Jid> &proxies)
+    {
+        QList<ProxyInfo> list;
+        for (auto const &jid : proxies) {
+            auto p = d->findProxy(jid);
+            list.append(p ? *p : ProxyInfo { jid, {}, 0, -1 });
+        }
+        d->proxies = list;
+        d->proxiesExpire.setRemainingTime(PROXY_CACHE_TTL);
+    }
+
+    void Manager::setProxyInfo(const Jid &jid, const QString &host, quint16 port)
+    {
+        auto p = d->findProxy(jid);
+        if (!p) {
+            d->proxies.append(ProxyInfo { jid, {}, 0, -1 });
+            p = &d->proxies.last();
+        }
+        if (p->host == host && p->port == port && p->rtt != -1)
+            return;
+        p->host = host;
+        p->port = port;
+        p->rtt  = -1;
+
+        // plain TCP connect is what every session pays before the SOCKS negotiation. it also warms up DNS
+        auto sock  = new QTcpSocket(this);
+        auto timer = std::make_shared<QElapsedTimer>();
+        connect(sock, &QTcpSocket::connected, this, [this, sock, timer, jid]() {
+            auto p = d->findProxy(jid);
+            if (p)
+                p->rtt = int(timer->elapsed());
+            sock->abort();
+            sock->deleteLater();
+        });
+        connect(sock, &QTcpSocket::errorOccurred, this, [sock]() { sock->deleteLater(); });
+        QTimer::singleShot(PROXY_PROBE_TIMEOUT, sock, [sock]() { sock->deleteLater(); });
+        timer->start();
+        sock->connectToHost(host, port);
+    }
+
     //----------------------------------------------------------------
     // Pad
     //----------------------------------------------------------------
@@ -102,6 +102,7 @@ namespace Jingle { namespace S5B {
         void               setState(State s);
         static const char *stateText(State s);
         quint32            priority() const;
+        int                rtt() const; // msecs it took to connect and negotiate SOCKS. -1 if not connected
 
         QDomElement toXml(QDomDocument *doc) const;
         QString     toString() const;
@@ -201,6 +202,22 @@ namespace Jingle { namespace S5B {
         Jid  userProxy() const;
         void setUserProxy(const Jid &jid);
 
+        struct ProxyInfo {
+            Jid     jid;
+            QString host;
+            quint16 port = 0;
+            int     rtt  = -1; // msecs to connect to it. -1 if unknown
+        };
+
+        /**
+         * @brief knownProxies returns proxies from a recent discovery done by any session, the fastest first.
+         *        Empty if the discovery has to be done (again).
+         */
+        QList<ProxyInfo> knownProxies() const;
+        void             setProxiesDiscovered(const QList<Jid> &proxies);
+        // remembers the streamhost of the proxy and measures how fast we can connect to it
+        void setProxyInfo(const Jid &jid, const QString &host, quint16 port);
+
         /**
          * @brief addKeyMapping sets mapping between key/socks hostname used for direct connection and transport.
          *        The key is sha1(sid, initiator full jid, responder full jid)
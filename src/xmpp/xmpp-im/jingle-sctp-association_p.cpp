@@ -21,6 +21,9 @@
 #include "jingle-sctp.h"
 #include "jingle-webrtc-datachannel_p.h"
 
+#include <QPointer>
+#include <QThread>
+
 #define SCTP_DEBUG(msg, ...) qDebug("jingle-sctp: " msg, ##__VA_ARGS__)
 
 namespace XMPP { namespace Jingle { namespace SCTP {
@@ -28,24 +31,58 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     static constexpr int MAX_STREAMS          = 65535; // let's change when we need something but webrtc dc.
     static constexpr int MAX_MESSAGE_SIZE     = 262144;
     static constexpr int MAX_SEND_BUFFER_SIZE = 262144;
+    static constexpr int MAX_RECV_BUFFER_SIZE = 131072; // the usrsctp default
+
+    // the receive buffer is the receiver window, so with 2MiB a 100ms RTT path still carries some 20MB/s
+    static constexpr int BULK_SEND_BUFFER_SIZE = 1048576;
+    static constexpr int BULK_RECV_BUFFER_SIZE = 2097152;
 
     std::weak_ptr<Keeper> Keeper::instance;
+    bool                  Keeper::useWorkerThread = false;
 
     Keeper::Keeper()
     {
-        qDebug("init usrsctp");
-        DepUsrSCTP::ClassInit();
+        qDebug("init usrsctp%s", useWorkerThread ? " on a worker thread" : "");
+        context = new QObject();
+        if (useWorkerThread) {
+            thread = new QThread();
+            thread->setObjectName(QStringLiteral("usrsctp"));
+            context->moveToThread(thread);
+            thread->start();
+        }
+        run([]() { DepUsrSCTP::ClassInit(); }, true);
     }
 
     Keeper::~Keeper()
     {
         qDebug("deinit usrsctp");
-        DepUsrSCTP::ClassDestroy();
+        run([]() { DepUsrSCTP::ClassDestroy(); }, true);
+        if (thread) {
+            thread->quit();
+            thread->wait();
+            delete context;
+            delete thread;
+        } else if (context->thread() == QThread::currentThread()) {
+            delete context;
+        } else {
+            context->deleteLater();
+        }
+    }
+
+    void Keeper::run(std::function<void()> &&f, bool wait) const
+    {
+        if (QThread::currentThread() == context->thread()) {
+            f();
+            return;
+        }
+        QMetaObject::invokeMethod(context, std::move(f), wait ? Qt::BlockingQueuedConnection : Qt::QueuedConnection);
     }
 
     Keeper::Ptr Keeper::use()
     {
-        auto i = instance.lock();
+        static std::mutex           mutex; // associations of clients on different threads
+        std::lock_guard<std::mutex> lock(mutex);
+        auto                        i = instance.lock();
         if (!i) {
             i        = std::make_shared<Keeper>();
             instance = i;
@@ -53,9 +90,27 @@ namespace XMPP { namespace Jingle { namespace SCTP {
         return i;
     }
 
-    AssociationPrivate::AssociationPrivate(Association *q) :
-        q(q), keeper(Keeper::use()), assoc(this, MAX_STREAMS, MAX_STREAMS, MAX_MESSAGE_SIZE, MAX_SEND_BUFFER_SIZE, true)
+    AssociationPrivate::AssociationPrivate(Association *q) : q(q), keeper(Keeper::use())
+    {
+        std::exception_ptr error;
+        keeper->run(
+            [this, &error]() {
+                try {
+                    assoc = std::make_unique<RTC::SctpAssociation>(this, MAX_STREAMS, MAX_STREAMS, MAX_MESSAGE_SIZE,
+                                                                   MAX_SEND_BUFFER_SIZE, true);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            },
+            true);
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    AssociationPrivate::~AssociationPrivate()
     {
+        // whatever was posted to the usrsctp thread before runs first, so it still finds us alive
+        keeper->run([this]() { assoc.reset(); }, true);
     }
 
     void AssociationPrivate::OnSctpAssociationConnecting(RTC::SctpAssociation *)
@@ -66,9 +121,14 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     void AssociationPrivate::OnSctpAssociationConnected(RTC::SctpAssociation *)
     {
         qDebug("jignle-sctp: on connected");
-        for (auto &channel : channels) {
-            channel.staticCast<WebRTCDataChannel>()->connect();
-        }
+        toMain([this]() {
+            associationConnected = true;
+            for (auto &channel : channels) {
+                auto c = channel.staticCast<WebRTCDataChannel>();
+                if (c->dcepState == WebRTCDataChannel::NoDcep) // not opened by the remote side
+                    c->connect();
+            }
+        });
     }
 
     void AssociationPrivate::OnSctpAssociationFailed(RTC::SctpAssociation *) { qDebug("jignle-sctp: on failed"); }
@@ -78,23 +138,30 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     void AssociationPrivate::OnSctpAssociationSendData(RTC::SctpAssociation *, const uint8_t *data, size_t len)
     {
         // qDebug("jignle-sctp: on outgoing data");
-        QByteArray bytes((char *)data, int(len));
-        QMetaObject::invokeMethod(this, "onOutgoingData", Q_ARG(QByteArray, bytes));
+        if (!outgoingPackets.push(QByteArray((char *)data, int(len)))) {
+            SCTP_DEBUG("outgoing ring is full. dropping a packet");
+            return;
+        }
+        if (!keeper->thread) {
+            emit q->readyReadOutgoing();
+        } else if (!outgoingScheduled.exchange(true)) {
+            QMetaObject::invokeMethod(this, &AssociationPrivate::emitReadyReadOutgoing, Qt::QueuedConnection);
+        }
     }
 
     void AssociationPrivate::OnSctpAssociationMessageReceived(RTC::SctpAssociation *, uint16_t streamId, uint32_t ppid,
                                                               const uint8_t *msg, size_t len)
     {
         // qDebug("jignle-sctp: on incoming data");
+        // the one copy out of the usrsctp buffer. from here on the message is shared up to the reader
         QByteArray bytes((char *)msg, int(len));
-        QMetaObject::invokeMethod(this, "onIncomingData", Q_ARG(QByteArray, bytes), Q_ARG(quint16, streamId),
-                                  Q_ARG(quint32, ppid));
+        toMain([this, bytes = std::move(bytes), streamId, ppid]() { onIncomingData(bytes, streamId, ppid); });
     }
 
     /**
      * @brief AssociationPrivate::OnSctpAssociationBufferedAmount
      * @param sctpAssociation
-     * @param len - number of bytes currently buffered in usrsctp. not more than MAX_SEND_BUFFER_SIZE
+     * @param len - number of bytes currently buffered in usrsctp. not more than the send buffer size
      */
     void AssociationPrivate::OnSctpAssociationBufferedAmount(RTC::SctpAssociation *sctpAssociation, size_t len)
     {
@@ -152,8 +219,44 @@ namespace XMPP { namespace Jingle { namespace SCTP {
         }
     }
 
+    void AssociationPrivate::setProfile(Profile profile)
+    {
+        if (this->profile == profile)
+            return;
+        if (transportConnected) {
+            qWarning("jingle-sctp: the profile can't be changed once the association is started");
+            return;
+        }
+        this->profile = profile;
+        bool bulk     = profile == Profile::Bulk;
+        keeper->run([this, bulk]() {
+            if (bulk)
+                assoc->SetBufferSizes(BULK_SEND_BUFFER_SIZE, BULK_RECV_BUFFER_SIZE);
+            else
+                assoc->SetBufferSizes(MAX_SEND_BUFFER_SIZE, MAX_RECV_BUFFER_SIZE);
+            assoc->SetInterleaving(bulk);
+        });
+    }
+
+    void AssociationPrivate::setMtu(int mtu)
+    {
+        keeper->run([this, mtu]() { assoc->SetMtu(size_t(mtu)); });
+    }
+
     bool AssociationPrivate::write(const QByteArray &data, quint16 streamId, quint32 ppid, Reliability reliable,
                                    bool ordered, quint32 reliability)
+    {
+        if (!keeper->thread)
+            return sendMessage(data, streamId, ppid, reliable, ordered, reliability);
+        // the result would come too late for the caller anyway. it's for control messages only
+        keeper->run([this, data, streamId, ppid, reliable, ordered, reliability]() {
+            sendMessage(data, streamId, ppid, reliable, ordered, reliability);
+        });
+        return true;
+    }
+
+    bool AssociationPrivate::sendMessage(const QByteArray &data, quint16 streamId, quint32 ppid, Reliability reliable,
+                                         bool ordered, quint32 reliability)
     {
         // qDebug("jignle-sctp: write %d bytes on stream %u with ppid %u", data.size(), streamId, ppid);
         RTC::DataConsumer consumer;
@@ -161,8 +264,8 @@ namespace XMPP { namespace Jingle { namespace SCTP {
         consumer.sctpParameters.ordered           = ordered; // ordered=true also enables reliability
         consumer.sctpParameters.maxPacketLifeTime = reliable == PartialTimers ? reliability : 0;
         consumer.sctpParameters.maxRetransmits    = reliable == PartialRexmit ? reliability : 0;
-        bool success;
-        assoc.SendSctpMessage(&consumer, ppid, reinterpret_cast<const uint8_t *>(data.data()), data.size(),
+        bool success = false;
+        assoc->SendSctpMessage(&consumer, ppid, reinterpret_cast<const uint8_t *>(data.data()), data.size(),
                               new std::function<void(bool)>([&success](bool cb_success) { success = cb_success; }));
         return success;
     }
@@ -174,10 +277,16 @@ namespace XMPP { namespace Jingle { namespace SCTP {
 
         dumpingOutogingBuffer = true;
         // keep going while we can fit the buffer
-        while (outgoingMessageQueue.size()) {
-
-            auto const &[connection, message] = outgoingMessageQueue.first();
-            if (int(MAX_SEND_BUFFER_SIZE - assoc.GetSctpBufferedAmount()) < message.data.size())
+        for (;;) {
+            QualifiedOutgoingMessage item;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (outgoingMessageQueue.empty())
+                    break;
+                item = outgoingMessageQueue.front(); // only this thread takes from the queue
+            }
+            auto const &[connection, message] = item;
+            if (int(assoc->GetSctpSendBufferSize() - assoc->GetSctpBufferedAmount()) < message.data.size())
                 break;
 
             bool        ordered  = !(message.channelType & 0x80);
@@ -186,16 +295,22 @@ namespace XMPP { namespace Jingle { namespace SCTP {
                 : (message.channelType & 0x3) == 2 ? PartialTimers
                                                    : Reliable;
 
-            if (write(message.data, message.streamId, PPID_BINARY, reliable, ordered, message.reliability)) {
-                int sz = message.data.size();
-                connection.staticCast<WebRTCDataChannel>()->onMessageWritten(sz);
-            } else if (assoc.isSendBufferFull())
+            if (sendMessage(message.data, message.streamId, PPID_BINARY, reliable, ordered, message.reliability)) {
+                toMain([connection = connection, sz = int(message.data.size())]() {
+                    if (auto channel = connection.lock())
+                        channel->onMessageWritten(sz);
+                });
+            } else if (assoc->isSendBufferFull())
                 break;
             else {
                 qWarning("unexpected sctp write error");
-                connection.staticCast<WebRTCDataChannel>()->onError(QAbstractSocket::SocketResourceError);
+                toMain([connection = connection]() {
+                    if (auto channel = connection.lock())
+                        channel->onError(QAbstractSocket::SocketResourceError);
+                });
             }
-            outgoingMessageQueue.removeFirst();
+            std::lock_guard<std::mutex> lock(mutex);
+            outgoingMessageQueue.pop_front();
         }
         dumpingOutogingBuffer = false;
     }
@@ -203,9 +318,57 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     void AssociationPrivate::close(quint16 streamId)
     {
         qDebug("jignle-sctp: close");
-        RTC::DataProducer producer;
-        producer.sctpParameters.streamId = streamId;
-        assoc.DataProducerClosed(&producer);
+        keeper->run([this, streamId]() {
+            RTC::DataProducer producer;
+            producer.sctpParameters.streamId = streamId;
+            assoc->DataProducerClosed(&producer);
+        });
+    }
+
+    void AssociationPrivate::writeIncoming(const QByteArray &data)
+    {
+        if (!keeper->thread) {
+            assoc->ProcessSctpData(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+            return;
+        }
+        if (!incomingPackets.push(QByteArray(data))) {
+            SCTP_DEBUG("incoming ring is full. dropping a packet");
+            return;
+        }
+        if (!incomingScheduled.exchange(true))
+            keeper->run([this]() { processIncomingPackets(); });
+    }
+
+    void AssociationPrivate::processIncomingPackets()
+    {
+        incomingScheduled = false; // before draining, so what comes meanwhile schedules one more run
+        QByteArray data;
+        while (incomingPackets.pop(data))
+            assoc->ProcessSctpData(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    }
+
+    QByteArray AssociationPrivate::readOutgoing()
+    {
+        QByteArray data;
+        outgoingPackets.pop(data);
+        return data;
+    }
+
+    void AssociationPrivate::emitReadyReadOutgoing()
+    {
+        outgoingScheduled = false;
+        QPointer<AssociationPrivate> self(this);
+        // one signal per datagram, as if they were delivered one by one
+        for (auto n = outgoingPackets.size(); self && n; --n)
+            emit q->readyReadOutgoing();
+    }
+
+    void AssociationPrivate::toMain(std::function<void()> &&f)
+    {
+        if (!keeper->thread)
+            f();
+        else
+            QMetaObject::invokeMethod(this, std::move(f), Qt::QueuedConnection);
     }
 
     quint16 AssociationPrivate::takeNextStreamId()
@@ -238,7 +401,9 @@ namespace XMPP { namespace Jingle { namespace SCTP {
             channel->setStreamId(id);
             channels.insert(id, channel);
             channelsLeft--;
-            qWarning("TODO negotiate datachannel itself");
+            // an association which is up already takes the channel with a single DCEP round trip
+            if (associationConnected)
+                channel->connect();
         } else {
             pendingLocalChannels.enqueue(channel);
         }
@@ -278,12 +443,13 @@ namespace XMPP { namespace Jingle { namespace SCTP {
                 channelsLeft--;
             }
         }
-        assoc.TransportConnected();
+        keeper->run([this]() { assoc->TransportConnected(); });
     }
 
     void AssociationPrivate::onTransportError(QAbstractSocket::SocketError error)
     {
-        transportConnected = false;
+        transportConnected   = false;
+        associationConnected = false;
         for (auto &c : channels) {
             c.staticCast<WebRTCDataChannel>()->onError(error);
         }
@@ -291,18 +457,13 @@ namespace XMPP { namespace Jingle { namespace SCTP {
 
     void AssociationPrivate::onTransportClosed()
     {
-        transportConnected = false;
+        transportConnected   = false;
+        associationConnected = false;
         for (auto &c : channels) {
             c.staticCast<WebRTCDataChannel>()->onDisconnected(WebRTCDataChannel::TransportClosed);
         }
     }
 
-    void AssociationPrivate::onOutgoingData(const QByteArray &data)
-    {
-        outgoingPacketsQueue.enqueue(data);
-        emit q->readyReadOutgoing();
-    }
-
     void AssociationPrivate::onIncomingData(const QByteArray &data, quint16 streamId, quint32 ppid)
     {
         auto it = channels.find(streamId);
@@ -334,8 +495,11 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     {
         auto dc = channel.staticCast<WebRTCDataChannel>();
         dc->setOutgoingCallback([this, weakDc = dc.toWeakRef()](const WebRTCDataChannel::OutgoingDatagram &dg) {
-            outgoingMessageQueue.enqueue({ weakDc.lock(), dg });
-            procesOutgoingMessageQueue();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                outgoingMessageQueue.push_back({ weakDc, dg });
+            }
+            keeper->run([this]() { procesOutgoingMessageQueue(); });
         });
     }
 
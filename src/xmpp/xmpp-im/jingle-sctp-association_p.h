@@ -29,42 +29,98 @@
 #include <QHash>
 #include <QQueue>
 
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <mutex>
+#include <utility>
+
+class QThread;
 
 namespace XMPP { namespace Jingle { namespace SCTP {
 
+    // One producer thread, one consumer thread, no locks. Full means the packet is dropped, like a congested
+    // link would do, and SCTP retransmits it later.
+    template <typename T, size_t Size> class SpscRing {
+    public:
+        bool push(T &&item)
+        {
+            auto t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == Size)
+                return false;
+            slots[t % Size] = std::move(item);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &item)
+        {
+            auto h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+            item = std::exchange(slots[h % Size], T());
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+    private:
+        std::array<T, Size> slots;
+        alignas(64) std::atomic<size_t> head { 0 };
+        alignas(64) std::atomic<size_t> tail { 0 };
+    };
+
+    // usrsctp is global. it lives either on the main thread or on its own one, shared by all the associations
     struct Keeper {
         using Ptr = std::shared_ptr<Keeper>;
 
         static std::weak_ptr<Keeper> instance;
+        static bool                  useWorkerThread;
+
+        QThread *thread  = nullptr; // null if usrsctp is driven by the thread which started it
+        QObject *context = nullptr; // lives in the usrsctp thread, all the calls go there
+
         Keeper();
         ~Keeper();
         static Ptr use();
+
+        // runs f on the usrsctp thread. directly if it's the current one
+        void run(std::function<void()> &&f, bool wait = false) const;
     };
 
     class Association;
     class AssociationPrivate : public QObject, RTC::SctpAssociation::Listener {
         Q_OBJECT
     public:
-        using QualifiedOutgoingMessage = std::pair<Connection::Ptr, WebRTCDataChannel::OutgoingDatagram>;
-
-        Association                     *q;
-        Keeper::Ptr                      keeper;
-        QQueue<QByteArray>               outgoingPacketsQueue; // ready to be sent over dtls
-        QQueue<QualifiedOutgoingMessage> outgoingMessageQueue; // ready to be processed by sctp stack
-        std::mutex                       mutex;
-        QHash<quint16, Connection::Ptr>  channels; // streamId -> WebRTCDataChannel
-        QQueue<Connection::Ptr>          pendingChannels;
-        QQueue<Connection::Ptr>          pendingLocalChannels;
-        RTC::SctpAssociation             assoc;
+        using QualifiedOutgoingMessage
+            = std::pair<QWeakPointer<WebRTCDataChannel>, WebRTCDataChannel::OutgoingDatagram>;
+        using PacketRing = SpscRing<QByteArray, 1024>;
+
+        Association                          *q;
+        Keeper::Ptr                           keeper;
+        PacketRing                            outgoingPackets; // ready to be sent over dtls
+        PacketRing                            incomingPackets; // from dtls, for the usrsctp thread
+        std::atomic_bool                      outgoingScheduled { false };
+        std::atomic_bool                      incomingScheduled { false };
+        std::deque<QualifiedOutgoingMessage>  outgoingMessageQueue; // ready to be processed by sctp stack
+        std::mutex                            mutex;                // guards outgoingMessageQueue
+        QHash<quint16, Connection::Ptr>       channels;             // streamId -> WebRTCDataChannel
+        QQueue<Connection::Ptr>               pendingChannels;
+        QQueue<Connection::Ptr>               pendingLocalChannels;
+        std::unique_ptr<RTC::SctpAssociation> assoc; // touched only on the usrsctp thread
 
         bool    dumpingOutogingBuffer = false;
         bool    transportConnected    = false;
+        bool    associationConnected  = false; // channels opened from now on send DATA_CHANNEL_OPEN at once
         bool    useOddStreamId        = false;
+        Profile profile               = Profile::Default;
         quint16 nextStreamId          = 0;
         quint16 channelsLeft          = 32768;
 
         AssociationPrivate(Association *q);
+        ~AssociationPrivate();
 
         void OnSctpAssociationConnecting(RTC::SctpAssociation *) override;
         void OnSctpAssociationConnected(RTC::SctpAssociation *) override;
@@ -78,8 +134,12 @@ namespace XMPP { namespace Jingle { namespace SCTP {
 
         void            handleIncomingDataChannelOpen(const QByteArray &data, quint16 streamId);
         void            setIdSelector(IdSelector selector);
+        void            setProfile(Profile profile);
+        void            setMtu(int mtu);
         bool            write(const QByteArray &data, quint16 streamId, quint32 ppid, Reliability reliable = Reliable,
                               bool ordered = true, quint32 reliability = 0);
+        void            writeIncoming(const QByteArray &data);
+        QByteArray      readOutgoing();
         void            close(quint16 streamId);
         quint16         takeNextStreamId();
         Connection::Ptr newChannel(Reliability reliable, bool ordered, quint32 reliability, quint16 priority,
@@ -92,13 +152,18 @@ namespace XMPP { namespace Jingle { namespace SCTP {
         void onTransportClosed();
 
     private Q_SLOTS:
-        void onOutgoingData(const QByteArray &data);
         void onIncomingData(const QByteArray &data, quint16 streamId, quint32 ppid);
         void onStreamClosed(quint16 streamId);
 
     private:
         void connectChannelSignals(Connection::Ptr channel);
         void procesOutgoingMessageQueue();
+        bool sendMessage(const QByteArray &data, quint16 streamId, quint32 ppid, Reliability reliable, bool ordered,
+                         quint32 reliability);
+        void processIncomingPackets();
+        void emitReadyReadOutgoing();
+        // runs f on the thread of this object. directly if it's the current one
+        void toMain(std::function<void()> &&f);
     };
 
 }}}
@@ -107,20 +107,25 @@ namespace XMPP { namespace Jingle { namespace SCTP {
 
     void Association::setIdSelector(IdSelector selector) { d->setIdSelector(selector); }
 
+    void Association::setProfile(Profile profile) { d->setProfile(profile); }
+
+    void Association::setMtu(int mtu) { d->setMtu(mtu); }
+
+    void Association::setWorkerThreadEnabled(bool enabled) { Keeper::useWorkerThread = enabled; }
+
     QByteArray Association::readOutgoing()
     {
         // SCTP_DEBUG("read outgoing");
-        std::lock_guard<std::mutex> lock(d->mutex);
-        return d->outgoingPacketsQueue.isEmpty() ? QByteArray() : d->outgoingPacketsQueue.dequeue();
+        return d->readOutgoing();
     }
 
     void Association::writeIncoming(const QByteArray &data)
     {
         // SCTP_DEBUG("write incoming");
-        d->assoc.ProcessSctpData(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        d->writeIncoming(data);
     }
 
-    int Association::pendingOutgoingDatagrams() const { return d->outgoingPacketsQueue.size(); }
+    int Association::pendingOutgoingDatagrams() const { return int(d->outgoingPackets.size()); }
 
     int Association::pendingChannels() const { return d->pendingChannels.size(); }
 
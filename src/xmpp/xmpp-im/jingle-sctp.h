@@ -34,6 +34,7 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     enum class Protocol { None, WebRTCDataChannel };
     enum Reliability { Reliable, PartialRexmit, PartialTimers };
     enum class IdSelector { Odd, Even };
+    enum class Profile { Default, Bulk };
 
     struct MapElement {
         Protocol protocol = Protocol::None;
@@ -74,6 +75,18 @@ namespace XMPP { namespace Jingle { namespace SCTP {
         Association(QObject *parent);
         ~Association();
 
+        // Run usrsctp and all the associations on a dedicated thread instead of the main one. Takes effect
+        // when the stack is initialized next time, i.e. when there are no associations at the moment.
+        static void setWorkerThreadEnabled(bool enabled);
+
+        // Bulk trades memory for the throughput of large messages: bigger socket buffers and, if the peer supports
+        // RFC 8260 I-DATA, interleaving so small messages of other channels don't wait behind a large one.
+        // Has to be set before onTransportConnected().
+        void setProfile(Profile profile);
+        // The size of the SCTP packets handed to DTLS. The default 1200 fits any DTLS-over-ICE path, TURN and IPv6
+        // included, so raise it only for a pair known to carry more. Can be changed at any time.
+        void setMtu(int mtu);
+
         void                   setIdSelector(IdSelector selector);
         QByteArray             readOutgoing();
         void                   writeIncoming(const QByteArray &data);
@@ -26,6 +26,7 @@
 #include "xmpp_task.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QElapsedTimer>
 #include <QPointer>
 #include <QTimer>
 
@@ -91,7 +92,7 @@ namespace XMPP { namespace Jingle {
         Reason                                             terminateReason;
         QMap<QString, QWeakPointer<ApplicationManagerPad>> applicationPads;
         QMap<QString, QWeakPointer<TransportManagerPad>>   transportPads;
-        QMap<ContentKey, Application *>                    contentList;
+        QList<Application *>                               contentList; // a handful at most, scanned
         QSet<Application *>                                signalingContent;
         QHash<QString, QStringList>                        groups;
 
@@ -100,6 +101,8 @@ namespace XMPP { namespace Jingle {
 
         // session level updates. session-info for example or some rejected apps
         QHash<Action, OutgoingUpdate> outgoingUpdates;
+        // when the last transport-info was sent, the trickled candidates are coalesced after it
+        QElapsedTimer lastTransportInfo;
 
         QString sid;
         Jid     origFrom;   // "from" attr of IQ.
@@ -119,7 +122,7 @@ namespace XMPP { namespace Jingle {
                     c->setState(State::Finished);
                 }
             }
-            auto vals = contentList.values();
+            auto vals = std::move(contentList);
             contentList.clear();
             while (vals.size()) {
                 vals.takeLast()->deleteLater();
@@ -214,7 +217,7 @@ namespace XMPP { namespace Jingle {
             }
             lastError = {};
             if (!stepTimer.isActive()) {
-                stepTimer.start();
+                stepTimer.start(0);
             }
         }
 
@@ -323,7 +326,18 @@ namespace XMPP { namespace Jingle {
 
             QList<AckHndl> acceptApps;
             if (updates.size()) {
-                auto       upd  = updates.begin().key(); // NOTE maybe some actions have more priority than others
+                auto upd = updates.begin().key(); // NOTE maybe some actions have more priority than others
+                if (upd.action == Action::TransportInfo) {
+                    // more candidates are likely on the way, let them catch up with this one
+                    qint64 wait = lastTransportInfo.isValid()
+                        ? manager->transportInfoCoalescing() - lastTransportInfo.elapsed()
+                        : 0;
+                    if (wait > 0) {
+                        stepTimer.start(int(wait));
+                        return;
+                    }
+                    lastTransportInfo.start();
+                }
                 auto const apps = updates.values(upd);
                 for (auto app : apps) {
                     QList<QDomElement> xml;
@@ -470,9 +484,19 @@ namespace XMPP { namespace Jingle {
             return TransportResult { false, Reason::NoReason, QSharedPointer<Transport>() };
         }
 
-        void addAndInitContent(Origin creator, Application *content)
+        Application *findContent(const QString &name, Origin creator) const
         {
-            contentList.insert(ContentKey { content->contentName(), creator }, content);
+            for (auto c : contentList) {
+                if (c->creator() == creator && c->contentName() == name)
+                    return c;
+            }
+            return nullptr;
+        }
+
+        void addAndInitContent(Application *content)
+        {
+            if (!contentList.contains(content))
+                contentList.append(content);
             if (state != State::Created && content->evaluateOutgoingUpdate().action != Action::NoAction) {
                 signalingContent.insert(content);
             }
@@ -483,12 +507,7 @@ namespace XMPP { namespace Jingle {
             QObject::connect(content, &Application::destroyed, q, [this, content]() {
                 signalingContent.remove(content);
                 initialIncomingUnacceptedContent.removeOne(content);
-                for (auto it = contentList.begin(); it != contentList.end(); ++it) { // optimize for large lists?
-                    if (it.value() == content) {
-                        contentList.erase(it);
-                        break;
-                    }
-                }
+                contentList.removeOne(content);
             });
         }
 
@@ -699,7 +718,9 @@ namespace XMPP { namespace Jingle {
                                            OutgoingUpdate { rejects, [this, rejects](bool) {
                                                                for (auto &r : rejects) {
                                                                    ContentBase c(r);
-                                                                   delete contentList.take(ContentKey { c.name, role });
+                                                                   auto app = findContent(c.name, role);
+                                                                   contentList.removeOne(app);
+                                                                   delete app;
                                                                }
                                                                if (contentList.isEmpty()) {
                                                                    // the other party has to generate session-terminate
@@ -738,9 +759,8 @@ namespace XMPP { namespace Jingle {
             }
 
             if (apps.size()) {
-                Origin remoteRole = negateOrigin(role);
                 for (auto app : std::as_const(apps)) {
-                    addAndInitContent(remoteRole, app); // TODO check conflicts
+                    addAndInitContent(app); // TODO check conflicts
                 }
                 QTimer::singleShot(0, q, [this]() { emit q->newContentReceived(); });
             }
@@ -761,7 +781,7 @@ namespace XMPP { namespace Jingle {
                                                     XMPP::Stanza::Error::ErrorCond::BadRequest);
                     return false;
                 }
-                Application *app = contentList.value(ContentKey { cb.name, cb.creator });
+                Application *app = findContent(cb.name, cb.creator);
                 if (app) {
                     toRemove.insert(app);
                 }
@@ -772,7 +792,7 @@ namespace XMPP { namespace Jingle {
 
             for (auto app : toRemove) {
                 app->incomingRemove(reason);
-                contentList.remove(ContentKey { app->contentName(), app->creator() });
+                contentList.removeOne(app);
                 delete app;
             }
 
@@ -858,7 +878,7 @@ namespace XMPP { namespace Jingle {
                                                     XMPP::Stanza::Error::ErrorCond::BadRequest);
                     return false;
                 }
-                Application *app = contentList.value(ContentKey { cb.name, cb.creator });
+                Application *app = findContent(cb.name, cb.creator);
                 if (!app || (app->creator() == role && app->state() <= State::Unacked)) {
                     qDebug("not existing app or inaporpriate app state");
                     lastError = XMPP::Stanza::Error(XMPP::Stanza::Error::ErrorType::Cancel,
@@ -942,7 +962,7 @@ namespace XMPP { namespace Jingle {
                     return false;
                 }
 
-                Application *app = contentList.value(ContentKey { cb.name, cb.creator });
+                Application *app = findContent(cb.name, cb.creator);
                 if (!app || !app->transport() || app->transport()->creator() != role
                     || app->transport()->state() != State::Pending || transportNS != app->transport()->pad()->ns()) {
                     // ignore out of order
@@ -1078,13 +1098,13 @@ namespace XMPP { namespace Jingle {
 
     Application *Session::content(const QString &contentName, Origin creator)
     {
-        return d->contentList.value(ContentKey { contentName, creator });
+        return d->findContent(contentName, creator);
     }
 
     void Session::addContent(Application *content)
     {
         Q_ASSERT(d->state < State::Finishing);
-        d->addAndInitContent(d->role, content);
+        d->addAndInitContent(content);
         if (d->state >= State::ApprovedToSend) {
             // If we add content to already initiated session then we are gonna
             // send it immediatelly. So start prepare
@@ -1092,7 +1112,7 @@ namespace XMPP { namespace Jingle {
         }
     }
 
-    const QMap<ContentKey, Application *> &Session::contentList() const { return d->contentList; }
+    const QList<Application *> &Session::contentList() const { return d->contentList; }
 
     void Session::setGrouping(const QString &groupType, const QStringList &group)
     {
@@ -1228,7 +1248,7 @@ namespace XMPP { namespace Jingle {
             d->initialIncomingUnacceptedContent = apps;
             for (auto app : std::as_const(apps)) {
                 app->markInitialApplication(true);
-                d->addAndInitContent(Origin::Initiator, app);
+                d->addAndInitContent(app);
             }
             d->planStep();
             return true;
@@ -59,10 +59,10 @@ namespace XMPP { namespace Jingle {
         // make new local content but do not add it to session yet
         Application *newContent(const QString &ns, Origin senders = Origin::Both);
         // get registered content if any
-        Application                           *content(const QString &contentName, Origin creator);
-        void                                   addContent(Application *content);
-        const QMap<ContentKey, Application *> &contentList() const;
-        void                                   setGrouping(const QString &groupType, const QStringList &group);
+        Application                 *content(const QString &contentName, Origin creator);
+        void                         addContent(Application *content);
+        const QList<Application *> &contentList() const; // in the order they were added
+        void                         setGrouping(const QString &groupType, const QStringList &group);
 
         ApplicationManagerPad::Ptr applicationPad(const QString &ns);
         TransportManagerPad::Ptr   transportPad(const QString &ns);
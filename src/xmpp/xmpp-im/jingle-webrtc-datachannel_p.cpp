@@ -108,54 +108,59 @@ namespace XMPP { namespace Jingle { namespace SCTP {
 
     void WebRTCDataChannel::setOutgoingCallback(OutgoingCallback &&callback) { outgoingCallback = std::move(callback); }
 
-    bool WebRTCDataChannel::hasPendingDatagrams() const { return datagrams.size() > 0; }
+    bool WebRTCDataChannel::hasPendingDatagrams() const { return !messages.isEmpty(); }
 
     QNetworkDatagram WebRTCDataChannel::readDatagram(qint64 maxSize)
     {
         Q_UNUSED(maxSize) // TODO or not?
-        if (datagrams.size()) {
-            auto dg = datagrams.takeFirst();
-            _bytesAvailable -= dg.data().size();
-            return dg;
+        return messages.isEmpty() ? QNetworkDatagram() : QNetworkDatagram(readMessage());
+    }
+
+    bool WebRTCDataChannel::writeDatagram(const QNetworkDatagram &data) { return writeMessage(data.data()); }
+
+    QByteArray WebRTCDataChannel::readMessage()
+    {
+        if (messages.isEmpty())
+            return {};
+        QByteArray message = messages.dequeue();
+        if (headOffset) {
+            // a stream read took the beginning already
+            message    = message.mid(headOffset);
+            headOffset = 0;
         }
-        return {};
+        _bytesAvailable -= message.size();
+        return message;
     }
 
-    bool WebRTCDataChannel::writeDatagram(const QNetworkDatagram &data)
+    bool WebRTCDataChannel::writeMessage(const QByteArray &data)
     {
         Q_ASSERT(bool(outgoingCallback));
-        outgoingBufSize += data.data().size();
-        outgoingCallback({ quint16(streamId), channelType, PPID_BINARY, reliability, data.data() });
+        outgoingBufSize += data.size();
+        outgoingCallback({ quint16(streamId), channelType, PPID_BINARY, reliability, data });
+        checkWatermarks();
         return true;
     }
 
-    qint64 WebRTCDataChannel::bytesAvailable() const
-    {
-        return tail.size() + _bytesAvailable + Connection::bytesAvailable();
-    }
+    qint64 WebRTCDataChannel::bytesAvailable() const { return _bytesAvailable + Connection::bytesAvailable(); }
 
     qint64 WebRTCDataChannel::bytesToWrite() const { return outgoingBufSize + Connection::bytesToWrite(); }
 
     qint64 WebRTCDataChannel::readDataInternal(char *buf, qint64 sz)
     {
+        // straight from the queued messages, a partly read one stays where it is
         qint64 actualSz = 0;
-        do {
-            if (tail.isEmpty() && !datagrams.isEmpty()) {
-                tail = datagrams.takeFirst().data();
-            }
-            auto dataSz = std::min(sz, qint64(tail.size()));
-            std::memcpy(buf + actualSz, tail.data(), dataSz);
-            if (dataSz == qint64(tail.size())) {
-                tail.clear();
-            } else {
-                tail.remove(0, dataSz);
-                if (!tail.isEmpty()) {
-                    break;
-                }
-            }
+        while (sz > 0 && !messages.isEmpty()) {
+            const QByteArray &head   = messages.head();
+            auto              dataSz = std::min(sz, qint64(head.size() - headOffset));
+            std::memcpy(buf + actualSz, head.constData() + headOffset, size_t(dataSz));
             actualSz += dataSz;
             sz -= dataSz;
-        } while (sz > 0 && !datagrams.isEmpty());
+            headOffset += dataSz;
+            if (headOffset == head.size()) {
+                messages.dequeue();
+                headOffset = 0;
+            }
+        }
         _bytesAvailable -= actualSz;
         // qDebug("read %lld bytes. more %lld is available", actualSz, _bytesAvailable);
         return actualSz;
@@ -207,7 +212,7 @@ namespace XMPP { namespace Jingle { namespace SCTP {
             return;
         }
         // check other PPIDs.
-        datagrams.append(QNetworkDatagram { data });
+        messages.enqueue(data);
         _bytesAvailable += data.size();
         // qDebug("datachannel readyread");
         emit readyRead();
@@ -217,5 +222,6 @@ namespace XMPP { namespace Jingle { namespace SCTP {
     {
         outgoingBufSize -= size;
         emit bytesWritten(size);
+        checkWatermarks();
     }
 }}}
@@ -21,6 +21,8 @@
 
 #include "jingle-connection.h"
 
+#include <QQueue>
+
 namespace XMPP { namespace Jingle { namespace SCTP {
 
     enum : quint32 {
@@ -51,9 +53,9 @@ namespace XMPP { namespace Jingle { namespace SCTP {
 
         AssociationPrivate *association;
 
-        QList<QNetworkDatagram> datagrams;
-        quint64                 _bytesAvailable = 0;
-        QByteArray              tail;
+        QQueue<QByteArray> messages;            // as they came from the association, shared with it
+        qsizetype          headOffset      = 0; // read from the first message already, by the stream read
+        quint64            _bytesAvailable = 0;
 
         DisconnectReason disconnectReason = ChannelClosed;
         std::size_t      outgoingBufSize  = 0;
@@ -79,6 +81,8 @@ namespace XMPP { namespace Jingle { namespace SCTP {
         bool              hasPendingDatagrams() const override;
         QNetworkDatagram  readDatagram(qint64 maxSize = -1) override;
         bool              writeDatagram(const QNetworkDatagram &data) override;
+        QByteArray        readMessage() override;
+        bool              writeMessage(const QByteArray &data) override;
         qint64            bytesAvailable() const override;
         qint64            readDataInternal(char *buf, qint64 sz) override;
         qint64            bytesToWrite() const override;
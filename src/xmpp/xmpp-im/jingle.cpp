@@ -21,6 +21,7 @@
 
 #include "jingle-application.h"
 #include "jingle-session.h"
+#include "natbehavior.h"
 #include "xmpp-im/xmpp_hash.h"
 #include "xmpp/jid/jid.h"
 #include "xmpp_client.h"
@@ -31,15 +32,27 @@
 #include <QDateTime>
 #include <QDebug>
 #include <QDomElement>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QMap>
 #include <QPointer>
 #include <QTimer>
+#include <climits>
 #include <functional>
 #if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
 #include <QRandomGenerator>
 #endif
 #include <QCoreApplication>
 
+// msecs to hold trickled candidates back after a transport-info, see Manager::setTransportInfoCoalescing()
+#define JINGLE_TRANSPORT_INFO_COALESCING 30
+// secs a working transport is remembered for a peer, see Manager::setPeerCacheTimeout()
+#define JINGLE_PEER_CACHE_TIMEOUT 600
+// secs an incoming session may wait for its admission by default, see Manager::setAdmissionQueue()
+#define JINGLE_ADMISSION_TIMEOUT 60
+// msecs between the checks of the admission queue and the bandwidth samples
+#define JINGLE_ADMISSION_TICK 1000
+
 namespace XMPP { namespace Jingle {
     const QString NS(QStringLiteral("urn:xmpp:jingle:1"));
     const QString ERROR_NS(QStringLiteral("urn:xmpp:jingle:errors:1"));
@@ -544,15 +557,166 @@ namespace XMPP { namespace Jingle {
         std::function<bool(const Jid &)>              remoteJidCecker;
 
         // when set/valid any incoming session initiate will be replied with redirection error
-        Jid                                   redirectionJid;
-        std::optional<XMPP::Stanza::Error>    lastError;
-        QHash<QPair<Jid, QString>, Session *> sessions;
-        int                                   maxSessions = -1; // no limit
+        Jid                                redirectionJid;
+        std::optional<XMPP::Stanza::Error> lastError;
+        QMultiHash<QString, Session *>     sessions;         // by sid only, the peer is compared after the lookup
+        int                                maxSessions = -1; // no limit
+
+        int transportInfoCoalescing = JINGLE_TRANSPORT_INFO_COALESCING;
+
+        struct PeerCache {
+            QString       transportNs;
+            QElapsedTimer age;
+        };
+        QHash<QString, PeerCache> peerCache; // by bare jid
+        int                       peerCacheTimeout = JINGLE_PEER_CACHE_TIMEOUT;
+
+        QPointer<NatBehaviorCache> natCache;
+
+        // incoming sessions waiting for their incomingSession(), see setAdmissionQueue()
+        struct Waiting {
+            QPointer<Session> session;
+            QElapsedTimer     age;
+        };
+        QHash<QString, QList<Waiting>> waiting;      // by bare jid of the peer
+        QStringList                    waitingPeers; // the next one to admit first
+        int                            waitingCount       = 0;
+        int                            admissionQueueSize = 0;
+        int                            admissionTimeout   = JINGLE_ADMISSION_TIMEOUT;
+        qint64                         admissionBandwidth = 0;
+        qint64                         transferRate       = 0; // bytes/s of all the sessions, the last sample
+        QHash<Session *, quint64>      transferred;            // by the connections of a session, the last sample
+        QElapsedTimer                  sampleAge;
+        QTimer                         admissionTimer;
 
         void setupSession(Session *s)
         {
-            QObject::connect(s, &Session::terminated, manager,
-                             [this, s]() { sessions.remove(qMakePair(s->peer(), s->sid())); });
+            QObject::connect(s, &Session::terminated, manager, [this, s]() {
+                sessions.remove(s->sid(), s);
+                transferred.remove(s);
+                if (!forgetWaiting(s))
+                    admit(admissionBandwidth > 0 ? 1 : INT_MAX); // there may be room now
+            });
+        }
+
+        int activeSessions() const { return int(sessions.size()) - waitingCount; }
+
+        bool hasRoom() const
+        {
+            return (maxSessions <= 0 || activeSessions() < maxSessions)
+                && (admissionBandwidth <= 0 || transferRate < admissionBandwidth);
+        }
+
+        void enqueue(Session *s)
+        {
+            const QString peer = s->peer().bare();
+            auto         &list = waiting[peer];
+            if (list.isEmpty())
+                waitingPeers.append(peer);
+            list.append({ s, QElapsedTimer() });
+            list.last().age.start();
+            ++waitingCount;
+            updateAdmissionTimer();
+        }
+
+        // true if s was waiting
+        bool forgetWaiting(Session *s)
+        {
+            const QString peer = s->peer().bare();
+            auto          it   = waiting.find(peer);
+            if (it == waiting.end())
+                return false;
+            auto w = std::find_if(it->begin(), it->end(), [s](const Waiting &w) { return w.session == s; });
+            if (w == it->end())
+                return false;
+            it->erase(w);
+            --waitingCount;
+            if (it->isEmpty()) {
+                waiting.erase(it);
+                waitingPeers.removeOne(peer);
+            }
+            return true;
+        }
+
+        // up to count sessions, one of each peer in turn
+        void admit(int count)
+        {
+            while (count > 0 && waitingCount && hasRoom()) {
+                const QString peer = waitingPeers.takeFirst();
+                auto          it   = waiting.find(peer);
+                Waiting       w    = it->takeFirst();
+                --waitingCount;
+                if (it->isEmpty())
+                    waiting.erase(it);
+                else
+                    waitingPeers.append(peer);
+                if (!w.session)
+                    continue;
+                --count;
+                QTimer::singleShot(0, manager, [this, s = w.session]() {
+                    if (s)
+                        emit manager->incomingSession(s);
+                });
+            }
+            updateAdmissionTimer();
+        }
+
+        void sampleTransferRate()
+        {
+            qint64 elapsed = sampleAge.isValid() ? sampleAge.restart() : 0;
+            if (!sampleAge.isValid())
+                sampleAge.start();
+
+            quint64                   delta = 0;
+            QHash<Session *, quint64> now;
+            for (Session *s : std::as_const(sessions)) {
+                quint64 bytes = 0;
+                for (Application *app : s->contentList()) {
+                    auto transport = app->transport();
+                    if (!transport)
+                        continue;
+                    for (const auto &c : transport->channels())
+                        bytes += c->bytesTransferred();
+                }
+                // a connection which is gone takes its bytes along
+                quint64 before = transferred.value(s);
+                if (bytes > before)
+                    delta += bytes - before;
+                now.insert(s, bytes);
+            }
+            transferred  = now;
+            transferRate = elapsed > 0 ? qint64(delta * 1000 / quint64(elapsed)) : 0;
+        }
+
+        void admissionTick()
+        {
+            if (admissionBandwidth > 0)
+                sampleTransferRate();
+
+            QList<QPointer<Session>> expired;
+            const qint64             timeout = qint64(admissionTimeout) * 1000;
+            for (auto const &list : std::as_const(waiting)) {
+                for (auto const &w : list) {
+                    if (w.session && w.age.hasExpired(timeout))
+                        expired.append(w.session);
+                }
+            }
+            for (auto const &s : std::as_const(expired)) {
+                if (s && forgetWaiting(s))
+                    s->terminate(Reason::Busy, QStringLiteral("Too many sessions at the moment"));
+            }
+
+            admit(admissionBandwidth > 0 ? 1 : INT_MAX);
+        }
+
+        void updateAdmissionTimer()
+        {
+            // the bandwidth is sampled all the time, so it's known when the next session comes
+            bool needed = waitingCount > 0 || admissionBandwidth > 0;
+            if (needed && !admissionTimer.isActive())
+                admissionTimer.start();
+            else if (!needed)
+                admissionTimer.stop();
         }
     };
 
@@ -561,6 +725,8 @@ namespace XMPP { namespace Jingle {
         d->client  = client;
         d->manager = this;
         d->pushTask.reset(new JTPush(client->rootTask()));
+        d->admissionTimer.setInterval(JINGLE_ADMISSION_TICK);
+        connect(&d->admissionTimer, &QTimer::timeout, this, [this]() { d->admissionTick(); });
         /*
         static bool mtReg = false;
         if (!mtReg) {
@@ -591,6 +757,73 @@ namespace XMPP { namespace Jingle {
 
     const Jid &Manager::redirectionJid() const { return d->redirectionJid; }
 
+    void Manager::setTransportInfoCoalescing(int msecs) { d->transportInfoCoalescing = qMax(0, msecs); }
+
+    int Manager::transportInfoCoalescing() const { return d->transportInfoCoalescing; }
+
+    void Manager::setPeerCacheTimeout(int secs)
+    {
+        d->peerCacheTimeout = qMax(0, secs);
+        if (!d->peerCacheTimeout)
+            d->peerCache.clear();
+    }
+
+    int Manager::peerCacheTimeout() const { return d->peerCacheTimeout; }
+
+    void Manager::rememberPeerTransport(const Jid &peer, const QString &ns)
+    {
+        if (!d->peerCacheTimeout)
+            return;
+        // drop the expired ones while we are here, so the cache doesn't grow with every peer ever seen
+        const qint64 timeout = qint64(d->peerCacheTimeout) * 1000;
+        for (auto it = d->peerCache.begin(); it != d->peerCache.end();) {
+            if (it->age.hasExpired(timeout))
+                it = d->peerCache.erase(it);
+            else
+                ++it;
+        }
+        auto &entry       = d->peerCache[peer.bare()];
+        entry.transportNs = ns;
+        entry.age.start();
+    }
+
+    QString Manager::peerTransport(const Jid &peer) const
+    {
+        auto it = d->peerCache.constFind(peer.bare());
+        if (it == d->peerCache.constEnd() || it->age.hasExpired(qint64(d->peerCacheTimeout) * 1000))
+            return QString();
+        return it->transportNs;
+    }
+
+    void Manager::setNatBehaviorCache(NatBehaviorCache *cache) { d->natCache = cache; }
+
+    NatBehaviorCache *Manager::natBehaviorCache() const { return d->natCache; }
+
+    void Manager::setMaxSessions(int max)
+    {
+        d->maxSessions = max;
+        d->admit(INT_MAX);
+    }
+
+    int Manager::maxSessions() const { return d->maxSessions; }
+
+    void Manager::setAdmissionQueue(int size, int timeout)
+    {
+        d->admissionQueueSize = qMax(0, size);
+        d->admissionTimeout   = qMax(1, timeout);
+    }
+
+    void Manager::setAdmissionBandwidth(qint64 bytesPerSecond)
+    {
+        d->admissionBandwidth = qMax(qint64(0), bytesPerSecond);
+        if (!d->admissionBandwidth)
+            d->transferRate = 0;
+        d->sampleAge.invalidate();
+        d->updateAdmissionTimer();
+    }
+
+    int Manager::waitingSessions() const { return d->waitingCount; }
+
     void Manager::registerApplication(ApplicationManager *app)
     {
         auto const &nss = app->ns();
@@ -647,13 +880,36 @@ namespace XMPP { namespace Jingle {
 
     Session *Manager::session(const Jid &remoteJid, const QString &sid)
     {
-        return d->sessions.value(qMakePair(remoteJid, sid));
+        for (auto it = d->sessions.constFind(sid); it != d->sessions.constEnd() && it.key() == sid; ++it) {
+            if ((*it)->peer() == remoteJid)
+                return *it;
+        }
+        return nullptr;
+    }
+
+    QList<Session *> Manager::sessions() const { return d->sessions.values(); }
+
+    qint64 Manager::memoryUsage() const
+    {
+        qint64 bytes = 0;
+        for (Session *s : std::as_const(d->sessions)) {
+            for (Application *app : s->contentList()) {
+                auto transport = app->transport();
+                if (!transport)
+                    continue;
+                for (const auto &c : transport->channels())
+                    bytes += c->bytesAvailable() + c->bytesToWrite();
+            }
+        }
+        return bytes;
     }
 
     void Manager::detachSession(Session *s)
     {
         s->disconnect(this);
-        d->sessions.remove(qMakePair(s->peer(), s->sid()));
+        d->sessions.remove(s->sid(), s);
+        d->transferred.remove(s);
+        d->forgetWaiting(s);
     }
 
     void Manager::setRemoteJidChecker(std::function<bool(const Jid &)> checker) { d->remoteJidCecker = checker; }
@@ -696,22 +952,26 @@ namespace XMPP { namespace Jingle {
 
     Session *Manager::incomingSessionInitiate(const Jid &from, const Jingle &jingle, const QDomElement &jingleEl)
     {
-        if (d->maxSessions > 0 && d->sessions.size() == d->maxSessions) {
+        // the ones waiting already go first
+        bool wait = d->waitingCount > 0 || !d->hasRoom();
+        if (wait && d->waitingCount >= d->admissionQueueSize) {
             d->lastError = XMPP::Stanza::Error(XMPP::Stanza::Error::ErrorType::Wait,
                                                XMPP::Stanza::Error::ErrorCond::ResourceConstraint);
             return nullptr;
         }
-        auto key = qMakePair(from, jingle.sid());
-        auto s   = new Session(this, from, Origin::Responder);
+        auto s = new Session(this, from, Origin::Responder);
         if (s->incomingInitiate(jingle, jingleEl)) { // if parsed well
-            d->sessions.insert(key, s);
+            d->sessions.insert(jingle.sid(), s);
             d->setupSession(s);
             // emit incomingSession makes sense when there are no unsolved conflicts in content descriptions /
             // transports
             // QTimer::singleShot(0,[s, this](){ emit incomingSession(s); });
             // QMetaObject::invokeMethod(this, "incomingSession", Qt::QueuedConnection, Q_ARG(Session *, s));
             if (!s->contentList().empty()) {
-                QTimer::singleShot(0, this, [s, this]() { emit incomingSession(s); });
+                if (wait)
+                    d->enqueue(s);
+                else
+                    QTimer::singleShot(0, this, [s, this]() { emit incomingSession(s); });
             }
             return s;
         }
@@ -732,15 +992,14 @@ namespace XMPP { namespace Jingle {
     QString Manager::registerSession(Session *session)
     {
         QString id;
-        auto    peer = session->peer();
         do {
 #if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
             id = QString("%1").arg(QRandomGenerator::global()->generate(), 6, 32, QChar('0'));
 #else
             id = QString("%1").arg(quint32(qrand()), 6, 32, QChar('0'));
 #endif
-        } while (d->sessions.contains(qMakePair(peer, id)));
-        d->sessions.insert(qMakePair(peer, id), session);
+        } while (d->sessions.contains(id)); // unique for all peers, so ours never need the peer check
+        d->sessions.insert(id, session);
         return id;
     }
 
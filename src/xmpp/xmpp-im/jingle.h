@@ -34,6 +34,7 @@ class QDomElement;
 
 namespace XMPP {
 class Client;
+class NatBehaviorCache;
 class Task;
 
 namespace Jingle {
@@ -351,6 +352,34 @@ namespace Jingle {
         void       setRedirection(const Jid &to);
         const Jid &redirectionJid() const;
 
+        // Trickled candidates: transport-info updates which come within msecs after the last one was sent are
+        // packed, across contents, into the next one. The first one is never delayed. 0 sends each one at once
+        void setTransportInfoCoalescing(int msecs);
+        int  transportInfoCoalescing() const;
+
+        // Repeat peers: the transport which got a session of a bare jid connected is tried first by the next
+        // sessions with it, until secs have passed since. 0 disables the cache
+        void    setPeerCacheTimeout(int secs);
+        int     peerCacheTimeout() const;
+        void    rememberPeerTransport(const Jid &peer, const QString &ns);
+        QString peerTransport(const Jid &peer) const; // empty if nothing is cached or it's expired
+
+        // What the local network lets through, probed by the first ICE session on it. The transports which can't
+        // work there are tried last, and ICE leaves out the candidates which can't. Not owned by the manager
+        void              setNatBehaviorCache(NatBehaviorCache *cache);
+        NatBehaviorCache *natBehaviorCache() const;
+
+        // Admission of incoming sessions: beyond max sessions, or while the sessions transfer more than
+        // bytesPerSecond, a new one is acknowledged but waits in a queue for its incomingSession(), so its
+        // transports aren't negotiated yet. It comes once there is room, round robin between the peers and one
+        // per second when the bandwidth is what limits. Those waiting for longer than timeout secs are
+        // terminated as busy. Without a queue, the default, or with a full one the session-initiate is rejected
+        void setMaxSessions(int max); // < 0, the default, for no limit
+        int  maxSessions() const;
+        void setAdmissionQueue(int size, int timeout);
+        void setAdmissionBandwidth(qint64 bytesPerSecond); // 0, the default, for no limit
+        int  waitingSessions() const;
+
         void                   registerApplication(ApplicationManager *app);
         void                   unregisterApp(const QString &ns);
         bool                   isRegisteredApplication(const QString &ns);
@@ -380,6 +409,10 @@ namespace Jingle {
         const std::optional<XMPP::Stanza::Error> &lastError() const;
 
         void detachSession(Session *s); // disconnect the session from manager
+
+        QList<Session *> sessions() const;
+        // approximate heap bytes buffered by the connections of the sessions' transports
+        qint64 memoryUsage() const;
     signals:
         void incomingSession(Session *);
 
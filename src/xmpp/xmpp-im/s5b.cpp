@@ -311,6 +311,14 @@ qint64 S5BConnection::bytesAvailable() const
         return 0;
 }
 
+QList<QByteArray> S5BConnection::takeReadChunks()
+{
+    QList<QByteArray> ret = ByteStream::takeReadChunks();
+    if (d->sc)
+        ret += d->sc->takeReadChunks();
+    return ret;
+}
+
 qint64 S5BConnection::bytesToWrite() const
 {
     if (d->state == Active)
@@ -1093,20 +1101,12 @@ void S5BManager::Item::doOutgoing()
     if (!haveHost(in_hosts, self)) {
         for (auto &c : disco->takeServers()) {
             auto server = c.staticCast<S5BServer>();
-            server->registerKey(key);
+            server->registerKey(
+                key, this, [this](SocksClient *c) { m->srv_incomingReady(c, key); },
+                [this](bool isInit, const QHostAddress &addr, int sourcePort, const QByteArray &data) {
+                    m->srv_incomingUDP(isInit, addr, sourcePort, key, data);
+                });
             relatedServers.append(server);
-            connect(server.data(), &S5BServer::incomingConnection, this, [this](SocksClient *c, const QString &key) {
-                if (key == this->key) {
-                    m->srv_incomingReady(c, key);
-                }
-            });
-            connect(server.data(), &S5BServer::incomingUdp, this,
-                    [this](bool isInit, const QHostAddress &addr, int sourcePort, const QString &key,
-                           const QByteArray &data) {
-                        if (key == this->key) {
-                            m->srv_incomingUDP(isInit, addr, sourcePort, key, data);
-                        }
-                    });
             StreamHost h;
             h.setJid(self);
             h.setHost(c->publishHost());
@@ -1194,6 +1194,7 @@ void S5BManager::Item::setIncomingClient(SocksClient *sc)
     connect(sc, SIGNAL(error(int)), SLOT(sc_error(int)));
 
     sc->setParent(nullptr); // avoid deleting it by SocksServer destructor
+    sc->setProfile(BSocket::Bulk);
     client        = sc;
     allowIncoming = false;
 }
@@ -1626,6 +1627,7 @@ public:
         QObject(nullptr), client(new SocksClient), client_udp(nullptr), host(_host), key(_key), udp(_udp), udp_tries(0),
         jid(self)
     {
+        client->setProfile(BSocket::Bulk);
         connect(client, SIGNAL(connected()), SLOT(sc_connected()));
         connect(client, SIGNAL(error(int)), SLOT(sc_error(int)));
         connect(&t, SIGNAL(timeout()), SLOT(trySendUDP()));
@@ -2185,8 +2187,15 @@ private slots:
 // S5BServer
 //----------------------------------------------------------------------------
 struct S5BServer::Private {
-    SocksServer   serv;
-    QSet<QString> keys;
+    struct Handlers {
+        bool              withHandlers = false;
+        QPointer<QObject> context;
+        ConnectionHandler onConnection;
+        UdpHandler        onUdp;
+    };
+
+    SocksServer              serv;
+    QHash<QString, Handlers> keys;
 };
 
 S5BServer::S5BServer(QTcpServer *serverSocket) : TcpPortServer(serverSocket), d(new Private)
@@ -2212,6 +2221,21 @@ S5BServer::S5BServer(QTcpServer *serverSocket) : TcpPortServer(serverSocket), d(
             QString key    = inConn->host;
             delete inConn;
 
+            // straight to the owner of the key, there may be many transfers waiting on this server
+            auto it = d->keys.constFind(key);
+            if (it != d->keys.constEnd() && it->withHandlers) {
+                if (it->context) {
+                    auto onConnection = it->onConnection; // it may unregister
+                    onConnection(c);
+                } else {
+                    c->requestDeny();
+                }
+                if (!c->isOpen()) {
+                    delete c;
+                }
+                return;
+            }
+
             emit incomingConnection(c, key);
             if (!c->isOpen()) {
                 delete c;
@@ -2223,6 +2247,14 @@ S5BServer::S5BServer(QTcpServer *serverSocket) : TcpPortServer(serverSocket), d(
                 if (port != 0 && port != 1)
                     return;
                 bool isInit = port == 1;
+                auto it     = d->keys.constFind(host);
+                if (it != d->keys.constEnd() && it->withHandlers) {
+                    if (it->context && it->onUdp) {
+                        auto onUdp = it->onUdp;
+                        onUdp(isInit, addr, sourcePort, data);
+                    }
+                    return;
+                }
                 emit incomingUdp(isInit, addr, sourcePort, host, data);
             });
 }
@@ -2241,7 +2273,13 @@ bool S5BServer::isActive() const { return d->serv.isActive(); }
 
 bool S5BServer::hasKey(const QString &key) { return d->keys.contains(key); }
 
-void S5BServer::registerKey(const QString &key) { d->keys.insert(key); }
+void S5BServer::registerKey(const QString &key) { d->keys.insert(key, {}); }
+
+void S5BServer::registerKey(const QString &key, QObject *context, ConnectionHandler &&onConnection,
+                            UdpHandler &&onUdp)
+{
+    d->keys.insert(key, { true, context, std::move(onConnection), std::move(onUdp) });
+}
 
 void S5BServer::unregisterKey(const QString &key) { d->keys.remove(key); }
 } // namespace XMPP
@@ -31,6 +31,8 @@
 #include <QList>
 #include <QObject>
 
+#include <functional>
+
 class SocksClient;
 class SocksUDP;
 
@@ -87,8 +89,9 @@ public:
     Mode               mode() const;
     int                state() const;
 
-    qint64 bytesAvailable() const;
-    qint64 bytesToWrite() const;
+    qint64            bytesAvailable() const;
+    qint64            bytesToWrite() const;
+    QList<QByteArray> takeReadChunks(); // those of the socks client, without copying
 
     void        writeDatagram(const S5BDatagram &);
     S5BDatagram readDatagram();
@@ -242,10 +245,18 @@ public:
     S5BServer(QTcpServer *serverSocket);
     ~S5BServer();
 
+    using ConnectionHandler = std::function<void(SocksClient *c)>;
+    using UdpHandler = std::function<void(bool isInit, const QHostAddress &addr, int sourcePort, const QByteArray &data)>;
+
     void writeUDP(const QHostAddress &addr, quint16 port, const QByteArray &data);
     bool isActive() const;
     bool hasKey(const QString &key);
+    // the connections and datagrams of a key without handlers are emitted with the signals below
     void registerKey(const QString &key);
+    // the connections for key go to onConnection only, which grants them and takes them or denies them, the
+    // denied ones are deleted afterwards (as with incomingConnection). it is not called once context is deleted
+    void registerKey(const QString &key, QObject *context, ConnectionHandler &&onConnection,
+                     UdpHandler &&onUdp = UdpHandler());
     void unregisterKey(const QString &key);
 
 signals:
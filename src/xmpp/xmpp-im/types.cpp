@@ -26,6 +26,8 @@
 #include "xmpp_reference.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QList>
 #include <QMap>
 
@@ -620,6 +622,72 @@ QDomElement MUCDestroy::toXml(QDomDocument &d) const
     return destroy;
 }
 
+//----------------------------------------------------------------------------
+// MUCOccupants
+//----------------------------------------------------------------------------
+void MUCOccupants::update(const QString &nick, bool available, const MUCItem &item)
+{
+    auto it = byNick_.find(nick);
+    if (!available) {
+        if (it != byNick_.end()) {
+            unlinkJid(it.value());
+            byNick_.erase(it);
+        }
+        return;
+    }
+
+    if (it == byNick_.end()) {
+        it       = byNick_.insert(nick, MUCOccupant());
+        it->nick = nick;
+    } else if (!item.jid().isEmpty() && !it->jid.compare(item.jid())) {
+        unlinkJid(it.value());
+        it->jid = Jid();
+    }
+    // a presence without an item (e.g. a status change in some rooms) keeps what we knew
+    if (item.affiliation() != MUCItem::UnknownAffiliation)
+        it->affiliation = item.affiliation();
+    if (item.role() != MUCItem::UnknownRole)
+        it->role = item.role();
+    if (!item.jid().isEmpty() && it->jid.isEmpty()) {
+        it->jid = item.jid();
+        byJid_.insert(item.jid().bare(), nick);
+    }
+}
+
+void MUCOccupants::clear()
+{
+    byNick_.clear();
+    byJid_.clear();
+}
+
+int MUCOccupants::count() const { return int(byNick_.size()); }
+
+bool MUCOccupants::contains(const QString &nick) const { return byNick_.contains(nick); }
+
+const MUCOccupant *MUCOccupants::occupant(const QString &nick) const
+{
+    auto it = byNick_.constFind(nick);
+    return it == byNick_.constEnd() ? nullptr : &it.value();
+}
+
+QStringList MUCOccupants::nicks(const Jid &jid) const
+{
+    QStringList ret;
+    for (auto it = byJid_.constFind(jid.bare()); it != byJid_.constEnd() && it.key() == jid.bare(); ++it) {
+        if (jid.resource().isEmpty() || byNick_.value(it.value()).jid.resource() == jid.resource())
+            ret += it.value();
+    }
+    return ret;
+}
+
+QList<MUCOccupant> MUCOccupants::occupants() const { return byNick_.values(); }
+
+void MUCOccupants::unlinkJid(const MUCOccupant &o)
+{
+    if (!o.jid.isEmpty())
+        byJid_.remove(o.jid.bare(), o.nick);
+}
+
 //----------------------------------------------------------------------------
 // HTMLElement
 //----------------------------------------------------------------------------
@@ -698,8 +766,32 @@ void HTMLElement::filterOutUnwantedRecursive(QDomElement &el, bool strict)
 //----------------------------------------------------------------------------
 // Message
 //----------------------------------------------------------------------------
+namespace {
+// groups of extensions which are decoded together when parsing on demand
+enum MessagePart {
+    MsgPubSub = 0x01,
+    MsgBoB    = 0x02,
+    MsgHtml   = 0x04,
+    MsgDelay  = 0x08,
+    MsgForm   = 0x10, // data forms, http auth, ibb
+    MsgMUC    = 0x20,
+    MsgRefs   = 0x40, // references, corrections, reactions, retractions
+    MsgRest   = 0x80,
+    MsgAll    = 0xff
+};
+}
+
 class Message::Private : public QSharedData {
 public:
+    // the parts in pending are still in root
+    Private *decoded(int parts)
+    {
+        if (pending & parts)
+            decode(pending & parts);
+        return this;
+    }
+    void decode(int parts);
+
     Jid           to, from;
     QString       id, lang;
     Message::Type type = Message::Type::Normal;
@@ -753,6 +845,16 @@ public:
     QList<Reference>         references;         // XEP-0385 and XEP-0372
     Message::Reactions       reactions;          // XEP-0444
     QString                  retraction;         // XEP-0424
+
+    // on demand parsing
+    QDomElement root;
+    int         pending      = 0;
+    bool        useTzOffset  = false;
+    int         tzOffset     = 0;
+    qint64      receivedTime = 0; // msecs since epoch, the timestamp if there is no delay
+
+    // the document of the stanza, if it has one of its own. the decoded pubsub items and sxe are still there
+    QSharedPointer<QDomDocument> rootDoc;
 };
 
 #define MessageD() (d ? d : (d = new Private))
@@ -875,7 +977,7 @@ HTMLElement Message::html(const QString &lang) const
 //!
 //! Returns true if there is at least one xhtml-im body
 //! in the message.
-bool Message::containsHTML() const { return d && !(d->htmlElements.isEmpty()); }
+bool Message::containsHTML() const { return d && !(d->decoded(MsgHtml)->htmlElements.isEmpty()); }
 
 QString Message::thread() const { return d ? d->thread : QString(); }
 
@@ -940,7 +1042,10 @@ void Message::setBody(const QString &s, const QString &lang)
 //! \param s - body node
 //! \param lang - body language
 //! \note The body should be in xhtml.
-void Message::setHTML(const HTMLElement &e, const QString &lang) { MessageD()->htmlElements[lang] = e; }
+void Message::setHTML(const HTMLElement &e, const QString &lang)
+{
+    MessageD()->decoded(MsgHtml)->htmlElements[lang] = e;
+}
 
 void Message::setThread(const QString &s, bool send)
 {
@@ -951,57 +1056,57 @@ void Message::setThread(const QString &s, bool send)
 
 void Message::setError(const Stanza::Error &err) { MessageD()->error = err; }
 
-QString Message::pubsubNode() const { return d ? d->pubsubNode : QString(); }
+QString Message::pubsubNode() const { return d ? d->decoded(MsgPubSub)->pubsubNode : QString(); }
 
-QList<PubSubItem> Message::pubsubItems() const { return d ? d->pubsubItems : QList<PubSubItem>(); }
+QList<PubSubItem> Message::pubsubItems() const { return d ? d->decoded(MsgPubSub)->pubsubItems : QList<PubSubItem>(); }
 
 QList<PubSubRetraction> Message::pubsubRetractions() const
 {
-    return d ? d->pubsubRetractions : QList<PubSubRetraction>();
+    return d ? d->decoded(MsgPubSub)->pubsubRetractions : QList<PubSubRetraction>();
 }
 
-QDateTime Message::timeStamp() const { return d ? d->timeStamp : QDateTime(); }
+QDateTime Message::timeStamp() const { return d ? d->decoded(MsgDelay)->timeStamp : QDateTime(); }
 
 void Message::setTimeStamp(const QDateTime &ts, bool send)
 {
-    MessageD()->timeStampSend = send;
-    d->timeStamp              = ts;
+    MessageD()->decoded(MsgDelay)->timeStampSend = send;
+    d->timeStamp                                 = ts;
 }
 
 //! \brief Return list of urls attached to message.
-UrlList Message::urlList() const { return d ? d->urlList : UrlList(); }
+UrlList Message::urlList() const { return d ? d->decoded(MsgRest)->urlList : UrlList(); }
 
 //! \brief Add Url to the url list.
 //!
 //! \param url - url to append
-void Message::urlAdd(const Url &u) { MessageD()->urlList += u; }
+void Message::urlAdd(const Url &u) { MessageD()->decoded(MsgRest)->urlList += u; }
 
 //! \brief clear out the url list.
 void Message::urlsClear()
 {
     if (d) {
-        d->urlList.clear();
+        d->decoded(MsgRest)->urlList.clear();
     }
 }
 
 //! \brief Set urls to send
 //!
 //! \param urlList - list of urls to send
-void Message::setUrlList(const UrlList &list) { MessageD()->urlList = list; }
+void Message::setUrlList(const UrlList &list) { MessageD()->decoded(MsgRest)->urlList = list; }
 
 //! \brief Return list of addresses attached to message.
-AddressList Message::addresses() const { return d ? d->addressList : AddressList(); }
+AddressList Message::addresses() const { return d ? d->decoded(MsgRest)->addressList : AddressList(); }
 
 //! \brief Add Address to the address list.
 //!
 //! \param address - address to append
-void Message::addAddress(const Address &a) { MessageD()->addressList += a; }
+void Message::addAddress(const Address &a) { MessageD()->decoded(MsgRest)->addressList += a; }
 
 //! \brief clear out the address list.
 void Message::clearAddresses()
 {
     if (d) {
-        d->addressList.clear();
+        d->decoded(MsgRest)->addressList.clear();
     }
 }
 
@@ -1011,7 +1116,7 @@ AddressList Message::findAddresses(Address::Type t) const
         return AddressList();
     }
     AddressList matches;
-    for (const Address &a : std::as_const(d->addressList)) {
+    for (const Address &a : std::as_const(d->decoded(MsgRest)->addressList)) {
         if (a.type() == t)
             matches.append(a);
     }
@@ -1021,66 +1126,75 @@ AddressList Message::findAddresses(Address::Type t) const
 //! \brief Set addresses to send
 //!
 //! \param list - list of addresses to send
-void Message::setAddresses(const AddressList &list) { MessageD()->addressList = list; }
+void Message::setAddresses(const AddressList &list) { MessageD()->decoded(MsgRest)->addressList = list; }
 
-RosterExchangeItems Message::rosterExchangeItems() const { return d ? d->rosterExchangeItems : RosterExchangeItems(); }
+RosterExchangeItems Message::rosterExchangeItems() const
+{
+    return d ? d->decoded(MsgRest)->rosterExchangeItems : RosterExchangeItems();
+}
 
-void Message::setRosterExchangeItems(const RosterExchangeItems &items) { MessageD()->rosterExchangeItems = items; }
+void Message::setRosterExchangeItems(const RosterExchangeItems &items)
+{
+    MessageD()->decoded(MsgRest)->rosterExchangeItems = items;
+}
 
-QString Message::eventId() const { return d ? d->eventId : QString(); }
+QString Message::eventId() const { return d ? d->decoded(MsgRest)->eventId : QString(); }
 
-void Message::setEventId(const QString &id) { MessageD()->eventId = id; }
+void Message::setEventId(const QString &id) { MessageD()->decoded(MsgRest)->eventId = id; }
 
-bool Message::containsEvents() const { return d && !d->eventList.isEmpty(); }
+bool Message::containsEvents() const { return d && !d->decoded(MsgRest)->eventList.isEmpty(); }
 
-bool Message::containsEvent(MsgEvent e) const { return d && d->eventList.contains(e); }
+bool Message::containsEvent(MsgEvent e) const { return d && d->decoded(MsgRest)->eventList.contains(e); }
 
 void Message::addEvent(MsgEvent e)
 {
-    if (!MessageD()->eventList.contains(e)) {
+    if (!MessageD()->decoded(MsgRest)->eventList.contains(e)) {
         if (e == CancelEvent || containsEvent(CancelEvent))
             d->eventList.clear(); // Reset list
         d->eventList += e;
     }
 }
 
-ChatState Message::chatState() const { return d ? d->chatState : StateNone; }
+ChatState Message::chatState() const { return d ? d->decoded(MsgRest)->chatState : StateNone; }
 
-void Message::setChatState(ChatState state) { MessageD()->chatState = state; }
+void Message::setChatState(ChatState state) { MessageD()->decoded(MsgRest)->chatState = state; }
 
-MessageReceipt Message::messageReceipt() const { return d ? d->messageReceipt : ReceiptNone; }
+MessageReceipt Message::messageReceipt() const { return d ? d->decoded(MsgRest)->messageReceipt : ReceiptNone; }
 
-void Message::setMessageReceipt(MessageReceipt messageReceipt) { MessageD()->messageReceipt = messageReceipt; }
+void Message::setMessageReceipt(MessageReceipt messageReceipt)
+{
+    MessageD()->decoded(MsgRest)->messageReceipt = messageReceipt;
+}
 
-QString Message::messageReceiptId() const { return d ? d->messageReceiptId : QString(); }
+QString Message::messageReceiptId() const { return d ? d->decoded(MsgRest)->messageReceiptId : QString(); }
 
-void Message::setMessageReceiptId(const QString &s) { MessageD()->messageReceiptId = s; }
+void Message::setMessageReceiptId(const QString &s) { MessageD()->decoded(MsgRest)->messageReceiptId = s; }
 
-QString Message::xsigned() const { return d ? d->xsigned : QString(); }
+QString Message::xsigned() const { return d ? d->decoded(MsgRest)->xsigned : QString(); }
 
-void Message::setXSigned(const QString &s) { MessageD()->xsigned = s; }
+void Message::setXSigned(const QString &s) { MessageD()->decoded(MsgRest)->xsigned = s; }
 
-QString Message::xencrypted() const { return d ? d->xencrypted : QString(); }
+QString Message::xencrypted() const { return d ? d->decoded(MsgRest)->xencrypted : QString(); }
 
-void Message::setXEncrypted(const QString &s) { MessageD()->xencrypted = s; }
+void Message::setXEncrypted(const QString &s) { MessageD()->decoded(MsgRest)->xencrypted = s; }
 
-QList<int> Message::getMUCStatuses() const { return d ? d->mucStatuses : QList<int>(); }
+QList<int> Message::getMUCStatuses() const { return d ? d->decoded(MsgMUC)->mucStatuses : QList<int>(); }
 
-void Message::addMUCStatus(int i) { MessageD()->mucStatuses += i; }
+void Message::addMUCStatus(int i) { MessageD()->decoded(MsgMUC)->mucStatuses += i; }
 
-void Message::addMUCInvite(const MUCInvite &i) { MessageD()->mucInvites += i; }
+void Message::addMUCInvite(const MUCInvite &i) { MessageD()->decoded(MsgMUC)->mucInvites += i; }
 
-QList<MUCInvite> Message::mucInvites() const { return d ? d->mucInvites : QList<MUCInvite>(); }
+QList<MUCInvite> Message::mucInvites() const { return d ? d->decoded(MsgMUC)->mucInvites : QList<MUCInvite>(); }
 
-void Message::setMUCDecline(const MUCDecline &de) { MessageD()->mucDecline = de; }
+void Message::setMUCDecline(const MUCDecline &de) { MessageD()->decoded(MsgMUC)->mucDecline = de; }
 
-MUCDecline Message::mucDecline() const { return d ? d->mucDecline : MUCDecline(); }
+MUCDecline Message::mucDecline() const { return d ? d->decoded(MsgMUC)->mucDecline : MUCDecline(); }
 
-QString Message::mucPassword() const { return d ? d->mucPassword : QString(); }
+QString Message::mucPassword() const { return d ? d->decoded(MsgMUC)->mucPassword : QString(); }
 
-void Message::setMUCPassword(const QString &p) { MessageD()->mucPassword = p; }
+void Message::setMUCPassword(const QString &p) { MessageD()->decoded(MsgMUC)->mucPassword = p; }
 
-bool Message::hasMUCUser() const { return d && d->hasMUCUser; }
+bool Message::hasMUCUser() const { return d && d->decoded(MsgMUC)->hasMUCUser; }
 
 Message::StanzaId Message::stanzaId() const { return d ? d->stanzaId : StanzaId(); }
 
@@ -1094,45 +1208,54 @@ QString Message::encryptionProtocol() const { return d ? d->encryptionProtocol :
 
 void Message::setEncryptionProtocol(const QString &protocol) { MessageD()->encryptionProtocol = protocol; }
 
-QList<Reference> Message::references() const { return d ? d->references : QList<Reference>(); }
+QList<Reference> Message::references() const { return d ? d->decoded(MsgRefs)->references : QList<Reference>(); }
 
-void Message::addReference(const Reference &r) { MessageD()->references.append(r); }
+void Message::addReference(const Reference &r) { MessageD()->decoded(MsgRefs)->references.append(r); }
 
-void Message::setReferences(const QList<Reference> &r) { MessageD()->references = r; }
+void Message::setReferences(const QList<Reference> &r) { MessageD()->decoded(MsgRefs)->references = r; }
 
-void Message::setReactions(const XMPP::Message::Reactions &reactions) { MessageD()->reactions = reactions; }
+void Message::setReactions(const XMPP::Message::Reactions &reactions)
+{
+    MessageD()->decoded(MsgRefs)->reactions = reactions;
+}
 
-XMPP::Message::Reactions Message::reactions() const { return d ? d->reactions : Reactions {}; }
+XMPP::Message::Reactions Message::reactions() const { return d ? d->decoded(MsgRefs)->reactions : Reactions {}; }
 
-void Message::setRetraction(const QString &retractedMessageId) { MessageD()->retraction = retractedMessageId; }
+void Message::setRetraction(const QString &retractedMessageId)
+{
+    MessageD()->decoded(MsgRefs)->retraction = retractedMessageId;
+}
 
-QString Message::retraction() const { return d ? d->retraction : QString {}; }
+QString Message::retraction() const { return d ? d->decoded(MsgRefs)->retraction : QString {}; }
 
-QString Message::invite() const { return d ? d->invite : QString(); }
+QString Message::invite() const { return d ? d->decoded(MsgMUC)->invite : QString(); }
 
-void Message::setInvite(const QString &s) { MessageD()->invite = s; }
+void Message::setInvite(const QString &s) { MessageD()->decoded(MsgMUC)->invite = s; }
 
-QString Message::nick() const { return d ? d->nick : QString(); }
+QString Message::nick() const { return d ? d->decoded(MsgRest)->nick : QString(); }
 
-void Message::setNick(const QString &n) { MessageD()->nick = n; }
+void Message::setNick(const QString &n) { MessageD()->decoded(MsgRest)->nick = n; }
 
-void Message::setHttpAuthRequest(const HttpAuthRequest &req) { MessageD()->httpAuthRequest = req; }
+void Message::setHttpAuthRequest(const HttpAuthRequest &req) { MessageD()->decoded(MsgForm)->httpAuthRequest = req; }
 
-HttpAuthRequest Message::httpAuthRequest() const { return d ? d->httpAuthRequest : HttpAuthRequest(); }
+HttpAuthRequest Message::httpAuthRequest() const
+{
+    return d ? d->decoded(MsgForm)->httpAuthRequest : HttpAuthRequest();
+}
 
-void Message::setForm(const XData &form) { MessageD()->xdata = form; }
+void Message::setForm(const XData &form) { MessageD()->decoded(MsgForm)->xdata = form; }
 
-XData Message::getForm() const { return d ? d->xdata : XData(); }
+XData Message::getForm() const { return d ? d->decoded(MsgForm)->xdata : XData(); }
 
-QDomElement Message::sxe() const { return d ? d->sxe : QDomElement(); }
+QDomElement Message::sxe() const { return d ? d->decoded(MsgRest)->sxe : QDomElement(); }
 
-void Message::setSxe(const QDomElement &e) { MessageD()->sxe = e; }
+void Message::setSxe(const QDomElement &e) { MessageD()->decoded(MsgRest)->sxe = e; }
 
-void Message::addBoBData(const BoBData &bob) { MessageD()->bobDataList.append(bob); }
+void Message::addBoBData(const BoBData &bob) { MessageD()->decoded(MsgBoB)->bobDataList.append(bob); }
 
-QList<BoBData> Message::bobDataList() const { return d ? d->bobDataList : QList<BoBData>(); }
+QList<BoBData> Message::bobDataList() const { return d ? d->decoded(MsgBoB)->bobDataList : QList<BoBData>(); }
 
-IBBData Message::ibbData() const { return d ? d->ibbData : IBBData(); }
+IBBData Message::ibbData() const { return d ? d->decoded(MsgForm)->ibbData : IBBData(); }
 
 void Message::setDisabledCarbons(bool disabled) { MessageD()->isDisabledCarbons = disabled; }
 
@@ -1146,17 +1269,17 @@ void Message::setForwardedFrom(const Jid &jid) { MessageD()->forwardedFrom = jid
 
 Jid Message::forwardedFrom() const { return d ? d->forwardedFrom : Jid(); }
 
-bool Message::spooled() const { return d && d->spooled; }
+bool Message::spooled() const { return d && d->decoded(MsgDelay)->spooled; }
 
-void Message::setSpooled(bool b) { MessageD()->spooled = b; }
+void Message::setSpooled(bool b) { MessageD()->decoded(MsgDelay)->spooled = b; }
 
 bool Message::wasEncrypted() const { return d && d->wasEncrypted; }
 
 void Message::setWasEncrypted(bool b) { MessageD()->wasEncrypted = b; }
 
-QString Message::replaceId() const { return d ? d->replaceId : QString(); }
+QString Message::replaceId() const { return d ? d->decoded(MsgRefs)->replaceId : QString(); }
 
-void Message::setReplaceId(const QString &id) { MessageD()->replaceId = id; }
+void Message::setReplaceId(const QString &id) { MessageD()->decoded(MsgRefs)->replaceId = id; }
 
 void Message::setProcessingHints(const ProcessingHints &hints) { MessageD()->processingHints = hints; }
 
@@ -1167,6 +1290,7 @@ Stanza Message::toStanza(Stream *stream) const
     if (!d) {
         return Stanza();
     }
+    d->decoded(MsgAll);
 
     Stanza s = stream->createStanza(Stanza::Message, d->to, typeStr());
     if (!d->from.isEmpty())
@@ -1216,7 +1340,7 @@ Stanza Message::toStanza(Stream *stream) const
     // timestamp
     if (d->timeStampSend && !d->timeStamp.isNull()) {
         QDomElement e = s.createElement("urn:xmpp:delay", "delay");
-        e.setAttribute("stamp", d->timeStamp.toUTC().toString(Qt::ISODate) + "Z");
+        e.setAttribute("stamp", msecs2stamp(d->timeStamp.toMSecsSinceEpoch()));
         s.appendChild(e);
 
         e = s.createElement("jabber:x:delay", "x");
@@ -1485,8 +1609,11 @@ bool Message::fromStanza(const Stanza &s) { return fromStanza(s, false, 0); }
   Else, \a timeZoneOffset is ignored and Qt is used to do the conversion (new style).
 
   This function exists to make transition between old and new style easier.
+
+  With \a onDemand only the addressing, type, subject, body, thread, error, hints and ids are parsed right away.
+  The message keeps the stanza then and every other extension is decoded when it's accessed for the first time.
   */
-bool Message::fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOffset)
+bool Message::fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOffset, bool onDemand)
 {
     if (s.kind() != Stanza::Message)
         return false;
@@ -1510,17 +1637,10 @@ bool Message::fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOf
         setType(Type::Normal); // everything unknown is normal by rfc6121
     }
 
-    d->subject.clear();
-    d->body.clear();
-    d->htmlElements.clear();
-    d->thread = QString();
-
     QDomElement root = s.element();
 
-    XDomNodeList nl = root.childNodes();
-    int          n;
-    bool         hasBodyOrThread = false;
-    bool         hasSubject      = false;
+    bool hasBodyOrThread = false;
+    bool hasSubject      = false;
     for (QDomElement e = root.firstChildElement(); !e.isNull(); e = e.nextSiblingElement()) {
         if (e.namespaceURI() == s.baseNS()) {
             if (e.tagName() == QLatin1String("subject")) {
@@ -1539,28 +1659,6 @@ bool Message::fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOf
                 hasBodyOrThread = true;
                 d->thread       = e.text();
             }
-        } else if (e.tagName() == QLatin1String("event")
-                   && e.namespaceURI() == QLatin1String("http://jabber.org/protocol/pubsub#event")) {
-            for (QDomNode enode = e.firstChild(); !enode.isNull(); enode = enode.nextSibling()) {
-                QDomElement eel = enode.toElement();
-                if (eel.tagName() == QLatin1String("items")) {
-                    d->pubsubNode = eel.attribute("node");
-                    for (QDomNode inode = eel.firstChild(); !inode.isNull(); inode = inode.nextSibling()) {
-                        QDomElement o = inode.toElement();
-                        if (o.tagName() == QLatin1String("item")) {
-                            for (QDomNode j = o.firstChild(); !j.isNull(); j = j.nextSibling()) {
-                                QDomElement item = j.toElement();
-                                if (!item.isNull()) {
-                                    d->pubsubItems += PubSubItem(o.attribute("id"), item);
-                                }
-                            }
-                        }
-                        if (o.tagName() == "retract") {
-                            d->pubsubRetractions += PubSubRetraction(o.attribute("id"));
-                        }
-                    }
-                }
-            }
         } else if (e.tagName() == QLatin1String("no-permanent-store")
                    && e.namespaceURI() == QLatin1String("urn:xmpp:hints")) {
             d->processingHints |= NoPermanentStore;
@@ -1576,10 +1674,6 @@ bool Message::fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOf
             d->stanzaId.id = e.attribute(QStringLiteral("id"));
             d->stanzaId.by = Jid(e.attribute(QStringLiteral("by")));
         }
-
-        else {
-            // printf("extension element: [%s]\n", e.tagName().latin1());
-        }
     }
 
     d->pureSubject = hasSubject && !hasBodyOrThread; // this is somewhat important for muc
@@ -1587,258 +1681,299 @@ bool Message::fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOf
     if (s.type() == "error")
         d->error = s.error();
 
+    d->root         = root;
+    d->rootDoc      = s.sharedDocument();
+    d->pending      = MsgAll;
+    d->useTzOffset  = useTimeZoneOffset;
+    d->tzOffset     = timeZoneOffset;
+    d->receivedTime = QDateTime::currentMSecsSinceEpoch();
+    if (!onDemand)
+        d->decode(MsgAll);
+    return true;
+}
+
+void Message::Private::decode(int parts)
+{
+    pending &= ~parts;
+
+    XDomNodeList nl;
+    int          n;
+    QDomElement  t;
+
+    if (parts & MsgPubSub) {
+        QDomElement e = root.firstChildElement(QLatin1String("event"));
+        for (; !e.isNull(); e = e.nextSiblingElement(QLatin1String("event"))) {
+            if (e.namespaceURI() == QLatin1String("http://jabber.org/protocol/pubsub#event"))
+                break;
+        }
+        for (QDomNode enode = e.firstChild(); !enode.isNull(); enode = enode.nextSibling()) {
+            QDomElement eel = enode.toElement();
+            if (eel.tagName() == QLatin1String("items")) {
+                pubsubNode = eel.attribute("node");
+                for (QDomNode inode = eel.firstChild(); !inode.isNull(); inode = inode.nextSibling()) {
+                    QDomElement o = inode.toElement();
+                    if (o.tagName() == QLatin1String("item")) {
+                        for (QDomNode j = o.firstChild(); !j.isNull(); j = j.nextSibling()) {
+                            QDomElement item = j.toElement();
+                            if (!item.isNull()) {
+                                pubsubItems += PubSubItem(o.attribute("id"), item);
+                            }
+                        }
+                    }
+                    if (o.tagName() == "retract") {
+                        pubsubRetractions += PubSubRetraction(o.attribute("id"));
+                    }
+                }
+            }
+        }
+    }
+
     // Bits of Binary XEP-0231
-    nl = childElementsByTagNameNS(root, "urn:xmpp:bob", "data");
-    for (n = 0; n < nl.count(); ++n) {
-        addBoBData(BoBData(nl.item(n).toElement()));
+    if (parts & MsgBoB) {
+        nl = childElementsByTagNameNS(root, "urn:xmpp:bob", "data");
+        for (n = 0; n < nl.count(); ++n) {
+            bobDataList.append(BoBData(nl.item(n).toElement()));
+        }
     }
 
     // xhtml-im
-    nl = childElementsByTagNameNS(root, "http://jabber.org/protocol/xhtml-im", "html");
-    if (nl.count()) {
-        nl = nl.item(0).childNodes();
-        for (n = 0; n < nl.count(); ++n) {
-            QDomElement e = nl.item(n).toElement();
-            if (e.tagName() == "body" && e.namespaceURI() == "http://www.w3.org/1999/xhtml") {
-                QString lang = e.attributeNS(NS_XML, "lang", "");
-                if (lang.isEmpty() || !(lang = XMLHelper::sanitizedLang(lang)).isEmpty()) {
-                    d->htmlElements[lang] = e;
-                    d->htmlElements[lang].filterOutUnwanted(false); // just clear iframes and javascript event handlers
+    if (parts & MsgHtml) {
+        nl = childElementsByTagNameNS(root, "http://jabber.org/protocol/xhtml-im", "html");
+        if (nl.count()) {
+            nl = nl.item(0).childNodes();
+            for (n = 0; n < nl.count(); ++n) {
+                QDomElement e = nl.item(n).toElement();
+                if (e.tagName() == "body" && e.namespaceURI() == "http://www.w3.org/1999/xhtml") {
+                    QString lang = e.attributeNS(NS_XML, "lang", "");
+                    if (lang.isEmpty() || !(lang = XMLHelper::sanitizedLang(lang)).isEmpty()) {
+                        htmlElements[lang] = e;
+                        htmlElements[lang].filterOutUnwanted(false); // just clear iframes and javascript event handlers
+                    }
                 }
             }
         }
     }
 
     // timestamp
-    QDomElement t = childElementsByTagNameNS(root, "urn:xmpp:delay", "delay").item(0).toElement();
-    QDateTime   stamp;
-    if (!t.isNull()) {
-        stamp = QDateTime::fromString(t.attribute("stamp").left(19), Qt::ISODate);
-    } else {
-        t = childElementsByTagNameNS(root, "jabber:x:delay", "x").item(0).toElement();
-        if (!t.isNull()) {
-            stamp = stamp2TS(t.attribute("stamp"));
-        }
-    }
-    if (!stamp.isNull()) {
-        if (useTimeZoneOffset) {
-            d->timeStamp = stamp.addSecs(timeZoneOffset * 3600);
+    if (parts & MsgDelay) {
+        t = childElementsByTagNameNS(root, "urn:xmpp:delay", "delay").item(0).toElement();
+        if (t.isNull())
+            t = childElementsByTagNameNS(root, "jabber:x:delay", "x").item(0).toElement();
+        qint64 stamp;
+        if (!t.isNull() && stamp2msecs(t.attribute("stamp"), &stamp)) {
+            if (useTzOffset) {
+                // the wall clock of the given zone, in local time spec
+                QDateTime dt = QDateTime::fromMSecsSinceEpoch(stamp + qint64(tzOffset) * 3600000, Qt::UTC);
+                timeStamp    = QDateTime(dt.date(), dt.time());
+            } else {
+                timeStamp = QDateTime::fromMSecsSinceEpoch(stamp);
+            }
+            timeStampSend = true;
+            spooled       = true;
         } else {
-            stamp.setTimeSpec(Qt::UTC);
-            d->timeStamp = stamp.toLocalTime();
+            timeStamp     = QDateTime::fromMSecsSinceEpoch(receivedTime);
+            timeStampSend = false;
+            spooled       = false;
         }
-        d->timeStampSend = true;
-        d->spooled       = true;
-    } else {
-        d->timeStamp     = QDateTime::currentDateTime();
-        d->timeStampSend = false;
-        d->spooled       = false;
-    }
-
-    // urls
-    d->urlList.clear();
-    nl = childElementsByTagNameNS(root, "jabber:x:oob", "x");
-    for (n = 0; n < nl.count(); ++n) {
-        QDomElement t = nl.item(n).toElement();
-        Url         u;
-        u.setUrl(t.elementsByTagName("url").item(0).toElement().text());
-        u.setDesc(t.elementsByTagName("desc").item(0).toElement().text());
-        d->urlList += u;
     }
 
-    // events
-    d->eventList.clear();
-    nl = childElementsByTagNameNS(root, "jabber:x:event", "x");
-    if (nl.count()) {
-        nl = nl.item(0).childNodes();
+    if (parts & MsgRest) {
+        // urls
+        nl = childElementsByTagNameNS(root, "jabber:x:oob", "x");
         for (n = 0; n < nl.count(); ++n) {
-            QString evtag = nl.item(n).toElement().tagName();
-            if (evtag == "id") {
-                d->eventId = nl.item(n).toElement().text();
-            } else if (evtag == "displayed")
-                d->eventList += DisplayedEvent;
-            else if (evtag == "composing")
-                d->eventList += ComposingEvent;
-            else if (evtag == "delivered")
-                d->eventList += DeliveredEvent;
+            QDomElement t = nl.item(n).toElement();
+            Url         u;
+            u.setUrl(t.elementsByTagName("url").item(0).toElement().text());
+            u.setDesc(t.elementsByTagName("desc").item(0).toElement().text());
+            urlList += u;
         }
-        if (d->eventList.isEmpty())
-            d->eventList += CancelEvent;
-    }
 
-    // Chat states
-    QString chatStateNS = "http://jabber.org/protocol/chatstates";
-    t                   = childElementsByTagNameNS(root, chatStateNS, "active").item(0).toElement();
-    if (!t.isNull())
-        d->chatState = StateActive;
-    t = childElementsByTagNameNS(root, chatStateNS, "composing").item(0).toElement();
-    if (!t.isNull())
-        d->chatState = StateComposing;
-    t = childElementsByTagNameNS(root, chatStateNS, "paused").item(0).toElement();
-    if (!t.isNull())
-        d->chatState = StatePaused;
-    t = childElementsByTagNameNS(root, chatStateNS, "inactive").item(0).toElement();
-    if (!t.isNull())
-        d->chatState = StateInactive;
-    t = childElementsByTagNameNS(root, chatStateNS, "gone").item(0).toElement();
-    if (!t.isNull())
-        d->chatState = StateGone;
-
-    // message receipts
-    QString messageReceiptNS = "urn:xmpp:receipts";
-    t                        = childElementsByTagNameNS(root, messageReceiptNS, "request").item(0).toElement();
-    if (!t.isNull()) {
-        d->messageReceipt = ReceiptRequest;
-        d->messageReceiptId.clear();
-    }
-    t = childElementsByTagNameNS(root, messageReceiptNS, "received").item(0).toElement();
-    if (!t.isNull()) {
-        d->messageReceipt   = ReceiptReceived;
-        d->messageReceiptId = t.attribute("id");
-        if (d->messageReceiptId.isEmpty())
-            d->messageReceiptId = id();
-    }
-
-    // xsigned
-    t = childElementsByTagNameNS(root, "jabber:x:signed", "x").item(0).toElement();
-    if (!t.isNull())
-        d->xsigned = t.text();
-    else
-        d->xsigned = QString();
+        // events
+        nl = childElementsByTagNameNS(root, "jabber:x:event", "x");
+        if (nl.count()) {
+            nl = nl.item(0).childNodes();
+            for (n = 0; n < nl.count(); ++n) {
+                QString evtag = nl.item(n).toElement().tagName();
+                if (evtag == "id") {
+                    eventId = nl.item(n).toElement().text();
+                } else if (evtag == "displayed")
+                    eventList += DisplayedEvent;
+                else if (evtag == "composing")
+                    eventList += ComposingEvent;
+                else if (evtag == "delivered")
+                    eventList += DeliveredEvent;
+            }
+            if (eventList.isEmpty())
+                eventList += CancelEvent;
+        }
 
-    // xencrypted
-    t = childElementsByTagNameNS(root, "jabber:x:encrypted", "x").item(0).toElement();
-    if (!t.isNull())
-        d->xencrypted = t.text();
-    else
-        d->xencrypted = QString();
+        // Chat states
+        QString chatStateNS = "http://jabber.org/protocol/chatstates";
+        t                   = childElementsByTagNameNS(root, chatStateNS, "active").item(0).toElement();
+        if (!t.isNull())
+            chatState = StateActive;
+        t = childElementsByTagNameNS(root, chatStateNS, "composing").item(0).toElement();
+        if (!t.isNull())
+            chatState = StateComposing;
+        t = childElementsByTagNameNS(root, chatStateNS, "paused").item(0).toElement();
+        if (!t.isNull())
+            chatState = StatePaused;
+        t = childElementsByTagNameNS(root, chatStateNS, "inactive").item(0).toElement();
+        if (!t.isNull())
+            chatState = StateInactive;
+        t = childElementsByTagNameNS(root, chatStateNS, "gone").item(0).toElement();
+        if (!t.isNull())
+            chatState = StateGone;
+
+        // message receipts
+        QString messageReceiptNS = "urn:xmpp:receipts";
+        t                        = childElementsByTagNameNS(root, messageReceiptNS, "request").item(0).toElement();
+        if (!t.isNull()) {
+            messageReceipt = ReceiptRequest;
+            messageReceiptId.clear();
+        }
+        t = childElementsByTagNameNS(root, messageReceiptNS, "received").item(0).toElement();
+        if (!t.isNull()) {
+            messageReceipt   = ReceiptReceived;
+            messageReceiptId = t.attribute("id");
+            if (messageReceiptId.isEmpty())
+                messageReceiptId = id;
+        }
 
-    // addresses
-    d->addressList.clear();
-    nl = childElementsByTagNameNS(root, "http://jabber.org/protocol/address", "addresses");
-    if (nl.count()) {
-        QDomElement t = nl.item(0).toElement();
-        nl            = t.elementsByTagName("address");
-        for (n = 0; n < nl.count(); ++n) {
-            d->addressList += Address(nl.item(n).toElement());
+        // xsigned
+        t = childElementsByTagNameNS(root, "jabber:x:signed", "x").item(0).toElement();
+        if (!t.isNull())
+            xsigned = t.text();
+
+        // xencrypted
+        t = childElementsByTagNameNS(root, "jabber:x:encrypted", "x").item(0).toElement();
+        if (!t.isNull())
+            xencrypted = t.text();
+
+        // addresses
+        nl = childElementsByTagNameNS(root, "http://jabber.org/protocol/address", "addresses");
+        if (nl.count()) {
+            QDomElement t = nl.item(0).toElement();
+            nl            = t.elementsByTagName("address");
+            for (n = 0; n < nl.count(); ++n) {
+                addressList += Address(nl.item(n).toElement());
+            }
         }
-    }
 
-    // roster item exchange
-    d->rosterExchangeItems.clear();
-    nl = childElementsByTagNameNS(root, "http://jabber.org/protocol/rosterx", "x");
-    if (nl.count()) {
-        QDomElement t = nl.item(0).toElement();
-        nl            = t.elementsByTagName("item");
-        for (n = 0; n < nl.count(); ++n) {
-            RosterExchangeItem it = RosterExchangeItem(nl.item(n).toElement());
-            if (!it.isNull())
-                d->rosterExchangeItems += it;
+        // roster item exchange
+        nl = childElementsByTagNameNS(root, "http://jabber.org/protocol/rosterx", "x");
+        if (nl.count()) {
+            QDomElement t = nl.item(0).toElement();
+            nl            = t.elementsByTagName("item");
+            for (n = 0; n < nl.count(); ++n) {
+                RosterExchangeItem it = RosterExchangeItem(nl.item(n).toElement());
+                if (!it.isNull())
+                    rosterExchangeItems += it;
+            }
         }
-    }
 
-    // invite
-    t = childElementsByTagNameNS(root, "jabber:x:conference", "x").item(0).toElement();
-    if (!t.isNull())
-        d->invite = t.attribute("jid");
-    else
-        d->invite = QString();
+        // nick
+        t = childElementsByTagNameNS(root, "http://jabber.org/protocol/nick", "nick").item(0).toElement();
+        if (!t.isNull())
+            nick = t.text();
 
-    // nick
-    t = childElementsByTagNameNS(root, "http://jabber.org/protocol/nick", "nick").item(0).toElement();
-    if (!t.isNull())
-        d->nick = t.text();
-    else
-        d->nick = QString();
+        // sxe
+        sxe = childElementsByTagNameNS(root, "http://jabber.org/protocol/sxe", "sxe").item(0).toElement();
+    }
 
-    // sxe
-    t = childElementsByTagNameNS(root, "http://jabber.org/protocol/sxe", "sxe").item(0).toElement();
-    if (!t.isNull())
-        d->sxe = t;
-    else
-        d->sxe = QDomElement();
-
-    t = childElementsByTagNameNS(root, "http://jabber.org/protocol/muc#user", "x").item(0).toElement();
-    if (!t.isNull()) {
-        d->hasMUCUser = true;
-        for (QDomNode muc_n = t.firstChild(); !muc_n.isNull(); muc_n = muc_n.nextSibling()) {
-            QDomElement muc_e = muc_n.toElement();
-            if (muc_e.isNull())
-                continue;
-            if (muc_e.tagName() == "status") {
-                addMUCStatus(muc_e.attribute("code").toInt());
-            } else if (muc_e.tagName() == "invite") {
-                MUCInvite inv(muc_e);
-                if (!inv.isNull())
-                    addMUCInvite(inv);
-            } else if (muc_e.tagName() == "decline") {
-                setMUCDecline(MUCDecline(muc_e));
-            } else if (muc_e.tagName() == "password") {
-                setMUCPassword(muc_e.text());
+    if (parts & MsgMUC) {
+        // invite
+        t = childElementsByTagNameNS(root, "jabber:x:conference", "x").item(0).toElement();
+        if (!t.isNull())
+            invite = t.attribute("jid");
+
+        t = childElementsByTagNameNS(root, "http://jabber.org/protocol/muc#user", "x").item(0).toElement();
+        if (!t.isNull()) {
+            hasMUCUser = true;
+            for (QDomNode muc_n = t.firstChild(); !muc_n.isNull(); muc_n = muc_n.nextSibling()) {
+                QDomElement muc_e = muc_n.toElement();
+                if (muc_e.isNull())
+                    continue;
+                if (muc_e.tagName() == "status") {
+                    mucStatuses += muc_e.attribute("code").toInt();
+                } else if (muc_e.tagName() == "invite") {
+                    MUCInvite inv(muc_e);
+                    if (!inv.isNull())
+                        mucInvites += inv;
+                } else if (muc_e.tagName() == "decline") {
+                    mucDecline = MUCDecline(muc_e);
+                } else if (muc_e.tagName() == "password") {
+                    mucPassword = muc_e.text();
+                }
             }
         }
     }
 
-    // http auth
-    t = childElementsByTagNameNS(root, "http://jabber.org/protocol/http-auth", "confirm").item(0).toElement();
-    if (!t.isNull()) {
-        d->httpAuthRequest = HttpAuthRequest(t);
-    } else {
-        d->httpAuthRequest = HttpAuthRequest();
-    }
+    if (parts & MsgForm) {
+        // http auth
+        t = childElementsByTagNameNS(root, "http://jabber.org/protocol/http-auth", "confirm").item(0).toElement();
+        if (!t.isNull()) {
+            httpAuthRequest = HttpAuthRequest(t);
+        }
 
-    QDomElement captcha   = childElementsByTagNameNS(root, "urn:xmpp:captcha", "captcha").item(0).toElement();
-    QDomElement xdataRoot = root;
-    if (!captcha.isNull()) {
-        xdataRoot = captcha;
-    }
+        QDomElement captcha   = childElementsByTagNameNS(root, "urn:xmpp:captcha", "captcha").item(0).toElement();
+        QDomElement xdataRoot = root;
+        if (!captcha.isNull()) {
+            xdataRoot = captcha;
+        }
 
-    // data form
-    t = childElementsByTagNameNS(xdataRoot, "jabber:x:data", "x").item(0).toElement();
-    if (!t.isNull()) {
-        d->xdata.fromXml(t);
-    }
+        // data form
+        t = childElementsByTagNameNS(xdataRoot, "jabber:x:data", "x").item(0).toElement();
+        if (!t.isNull()) {
+            xdata.fromXml(t);
+        }
 
-    t = childElementsByTagNameNS(root, IBBManager::ns(), "data").item(0).toElement();
-    if (!t.isNull()) {
-        d->ibbData.fromXml(t);
-    }
-    t = childElementsByTagNameNS(root, "urn:xmpp:message-correct:0", "replace").item(0).toElement();
-    if (!t.isNull()) {
-        d->replaceId = t.attribute("id");
+        t = childElementsByTagNameNS(root, IBBManager::ns(), "data").item(0).toElement();
+        if (!t.isNull()) {
+            ibbData.fromXml(t);
+        }
     }
 
-    // XEP-0385 SIMS and XEP-0372 Reference
-    auto references = childElementsByTagNameNS(root, REFERENCE_NS, QString::fromLatin1("reference"));
-    for (int i = 0; i < references.size(); i++) {
-        Reference r;
-        if (r.fromXml(references.at(i).toElement())) {
-            d->references.append(r);
+    if (parts & MsgRefs) {
+        t = childElementsByTagNameNS(root, "urn:xmpp:message-correct:0", "replace").item(0).toElement();
+        if (!t.isNull()) {
+            replaceId = t.attribute("id");
         }
-    }
 
-    // XEP-0444 message reactions
-    auto reactions
-        = childElementsByTagNameNS(root, "urn:xmpp:reactions:0", QStringLiteral("reactions")).item(0).toElement();
-    if (!reactions.isNull()) {
-        d->reactions.targetId = reactions.attribute(QLatin1String("id"));
-        if (!d->reactions.targetId.isEmpty()) {
-            auto reactionTag = QStringLiteral("reaction");
-            auto reaction    = reactions.firstChildElement(reactionTag);
-            while (!reaction.isNull()) {
-                d->reactions.reactions.insert(reaction.text().trimmed());
-                reaction = reaction.nextSiblingElement(reactionTag);
+        // XEP-0385 SIMS and XEP-0372 Reference
+        auto refs = childElementsByTagNameNS(root, REFERENCE_NS, QString::fromLatin1("reference"));
+        for (int i = 0; i < refs.size(); i++) {
+            Reference r;
+            if (r.fromXml(refs.at(i).toElement())) {
+                references.append(r);
             }
-            d->reactions.reactions.squeeze();
         }
+
+        // XEP-0444 message reactions
+        auto reactionsEl
+            = childElementsByTagNameNS(root, "urn:xmpp:reactions:0", QStringLiteral("reactions")).item(0).toElement();
+        if (!reactionsEl.isNull()) {
+            reactions.targetId = reactionsEl.attribute(QLatin1String("id"));
+            if (!reactions.targetId.isEmpty()) {
+                auto reactionTag = QStringLiteral("reaction");
+                auto reaction    = reactionsEl.firstChildElement(reactionTag);
+                while (!reaction.isNull()) {
+                    reactions.reactions.insert(reaction.text().trimmed());
+                    reaction = reaction.nextSiblingElement(reactionTag);
+                }
+                reactions.reactions.squeeze();
+            }
+        }
+
+        // XEP-0424 message retraction
+        retraction = childElementsByTagNameNS(root, "urn:xmpp:message-retract:1", QStringLiteral("retract"))
+                         .item(0)
+                         .toElement()
+                         .attribute(QLatin1String("id"));
     }
 
-    // XEP-0424 message retraction
-    d->retraction = childElementsByTagNameNS(root, "urn:xmpp:message-retract:1", QStringLiteral("retract"))
-                        .item(0)
-                        .toElement()
-                        .attribute(QLatin1String("id"));
-    return true;
+    if (!pending)
+        root = QDomElement(); // all in, the document may go
 }
 
 /*!
@@ -2422,48 +2557,153 @@ ResourceList::ResourceList() : QList<Resource>() { }
 
 ResourceList::~ResourceList() { }
 
-ResourceList::Iterator ResourceList::find(const QString &_find)
+// a few resources are faster to scan than to hash
+#define RESOURCELIST_INDEX_THRESHOLD 8
+
+int ResourceList::position(const QString &name) const
 {
-    for (ResourceList::Iterator it = begin(); it != end(); ++it) {
-        if ((*it).name() == _find)
-            return it;
+    if (size() < RESOURCELIST_INDEX_THRESHOLD) {
+        for (int n = 0; n < size(); ++n) {
+            if (at(n).name() == name)
+                return n;
+        }
+        return -1;
     }
 
-    return end();
+    if (v_indexedSize != size())
+        rebuildIndex();
+    int n = v_index.value(name, -1);
+    if (n != -1 && at(n).name() != name) {
+        // the list was modified behind our back
+        rebuildIndex();
+        n = v_index.value(name, -1);
+    }
+    return n;
 }
 
-ResourceList::Iterator ResourceList::priority()
+void ResourceList::rebuildIndex() const
 {
-    ResourceList::Iterator highest = end();
+    v_index.clear();
+    // backwards, so the first of duplicates wins like with a scan
+    for (int n = size() - 1; n >= 0; --n)
+        v_index.insert(at(n).name(), n);
+    v_indexedSize = size();
+}
+
+ResourceList &ResourceList::operator+=(const Resource &r)
+{
+    append(r);
+    return *this;
+}
 
-    for (ResourceList::Iterator it = begin(); it != end(); ++it) {
-        if (highest == end() || (*it).priority() > (*highest).priority())
-            highest = it;
+void ResourceList::append(const Resource &r)
+{
+    if (v_indexedSize == size()) {
+        if (!v_index.contains(r.name()))
+            v_index.insert(r.name(), size());
+        ++v_indexedSize;
     }
+    bool known = v_highestSize == size();
+    QList<Resource>::append(r);
+    v_highestSize = known ? int(size()) : -1;
+    noteSeen(int(size()) - 1);
+}
 
-    return highest;
+ResourceList::Iterator ResourceList::erase(ResourceList::Iterator it)
+{
+    v_indexedSize = -1;
+    v_highestSize = -1;
+    v_seen.remove(it->name());
+    return QList<Resource>::erase(it);
 }
 
-ResourceList::ConstIterator ResourceList::find(const QString &_find) const
+ResourceList::Iterator ResourceList::erase(ResourceList::Iterator begin, ResourceList::Iterator end)
 {
-    for (ResourceList::ConstIterator it = begin(); it != end(); ++it) {
-        if ((*it).name() == _find)
-            return it;
-    }
+    v_indexedSize = -1;
+    v_highestSize = -1;
+    for (auto it = begin; it != end; ++it)
+        v_seen.remove(it->name());
+    return QList<Resource>::erase(begin, end);
+}
 
-    return end();
+void ResourceList::removeAt(int i)
+{
+    v_indexedSize = -1;
+    v_highestSize = -1;
+    v_seen.remove(at(i).name());
+    QList<Resource>::removeAt(i);
 }
 
-ResourceList::ConstIterator ResourceList::priority() const
+void ResourceList::clear()
 {
-    ResourceList::ConstIterator highest = end();
+    v_indexedSize = -1;
+    v_highestSize = -1;
+    v_index.clear();
+    v_seen.clear();
+    QList<Resource>::clear();
+}
+
+void ResourceList::setStatus(ResourceList::Iterator it, const Status &s)
+{
+    int n = int(it - begin());
+    if (n == v_highest && s.priority() < it->priority())
+        v_highestSize = -1; // one of the others may be higher now
+    it->setStatus(s);
+    noteSeen(n);
+}
 
-    for (ResourceList::ConstIterator it = begin(); it != end(); ++it) {
-        if (highest == end() || (*it).priority() > (*highest).priority())
-            highest = it;
+// the newest presence goes first among its priority, so comparing with the highest one is enough
+void ResourceList::noteSeen(int n)
+{
+    v_seen[at(n).name()] = ++v_clock;
+    if (v_highestSize != size() || v_highest == n)
+        return;
+    if (at(n).priority() >= at(v_highest).priority())
+        v_highest = n;
+}
+
+int ResourceList::highest() const
+{
+    if (v_highestSize == size())
+        return v_highest;
+
+    // after a removal or a lower priority of the highest one. these are rare next to the other updates
+    v_highest      = -1;
+    quint64 latest = 0;
+    for (int n = 0; n < size(); ++n) {
+        quint64 seen = v_seen.value(at(n).name());
+        int     p    = at(n).priority();
+        if (v_highest == -1 || p > at(v_highest).priority() || (p == at(v_highest).priority() && seen > latest)) {
+            v_highest = n;
+            latest    = seen;
+        }
     }
+    v_highestSize = size();
+    return v_highest;
+}
+
+ResourceList::Iterator ResourceList::find(const QString &_find)
+{
+    int n = position(_find);
+    return n == -1 ? end() : begin() + n;
+}
+
+ResourceList::Iterator ResourceList::priority()
+{
+    int n = highest();
+    return n == -1 ? end() : begin() + n;
+}
+
+ResourceList::ConstIterator ResourceList::find(const QString &_find) const
+{
+    int n = position(_find);
+    return n == -1 ? end() : begin() + n;
+}
 
-    return highest;
+ResourceList::ConstIterator ResourceList::priority() const
+{
+    int n = highest();
+    return n == -1 ? end() : begin() + n;
 }
 
 //---------------------------------------------------------------------------
@@ -2587,6 +2827,7 @@ bool RosterItem::fromXml(const QDomElement &item)
 class Roster::Private {
 public:
     QString groupsDelimiter;
+    QString version;
 };
 
 Roster::Roster() : QList<RosterItem>(), d(new Roster::Private) { }
@@ -2596,12 +2837,14 @@ Roster::~Roster() { delete d; }
 Roster::Roster(const Roster &other) : QList<RosterItem>(other), d(new Roster::Private)
 {
     d->groupsDelimiter = other.d->groupsDelimiter;
+    d->version         = other.d->version;
 }
 
 Roster &Roster::operator=(const Roster &other)
 {
     QList<RosterItem>::operator=(other);
     d->groupsDelimiter = other.d->groupsDelimiter;
+    d->version         = other.d->version;
     return *this;
 }
 
@@ -2629,6 +2872,109 @@ void Roster::setGroupsDelimiter(const QString &groupsDelimiter) { d->groupsDelim
 
 QString Roster::groupsDelimiter() const { return d->groupsDelimiter; }
 
+void Roster::setVersion(const QString &version) { d->version = version; }
+
+QString Roster::version() const { return d->version; }
+
+//---------------------------------------------------------------------------
+// RosterStore
+//---------------------------------------------------------------------------
+class RosterStore::Private {
+public:
+    Roster roster;
+    bool   loaded = false;
+};
+
+RosterStore::RosterStore() : d(new Private) { }
+
+RosterStore::~RosterStore() { delete d; }
+
+Roster RosterStore::roster() const
+{
+    load();
+    return d->roster;
+}
+
+void RosterStore::setRoster(const Roster &r)
+{
+    d->loaded = true;
+    d->roster = r;
+    save();
+}
+
+void RosterStore::applyPush(const Roster &r)
+{
+    load();
+    for (const RosterItem &item : r) {
+        Roster::Iterator it = d->roster.find(item.jid());
+        if (item.subscription().type() == Subscription::Remove) {
+            if (it != d->roster.end())
+                d->roster.erase(it);
+            continue;
+        }
+        RosterItem stored(item);
+        stored.setIsPush(false);
+        if (it != d->roster.end())
+            *it = stored;
+        else
+            d->roster += stored;
+    }
+    // without a version the server doesn't do versioning (anymore), next time we ask for everything
+    d->roster.setVersion(r.version());
+    save();
+}
+
+void RosterStore::clear()
+{
+    d->loaded = true;
+    d->roster = Roster();
+    save();
+}
+
+void RosterStore::saveData(const QByteArray &data) { Q_UNUSED(data) }
+
+QByteArray RosterStore::loadData() { return QByteArray(); }
+
+void RosterStore::load() const
+{
+    if (d->loaded)
+        return;
+    d->loaded = true;
+
+    QByteArray data = const_cast<RosterStore *>(this)->loadData();
+    if (data.isEmpty())
+        return;
+
+    QDomDocument doc;
+    if (!doc.setContent(data)) {
+        qWarning("RosterStore: Cannot parse stored roster");
+        return;
+    }
+    QDomElement root = doc.documentElement();
+    if (root.tagName() != QLatin1String("roster"))
+        return;
+
+    for (QDomElement i = root.firstChildElement(QLatin1String("item")); !i.isNull();
+         i = i.nextSiblingElement(QLatin1String("item"))) {
+        RosterItem item;
+        if (item.fromXml(i))
+            d->roster += item;
+    }
+    d->roster.setVersion(root.attribute(QLatin1String("ver")));
+}
+
+void RosterStore::save()
+{
+    QDomDocument doc;
+    QDomElement  root = doc.createElement(QLatin1String("roster"));
+    root.setAttribute(QLatin1String("ver"), d->roster.version());
+    doc.appendChild(root);
+    for (const RosterItem &item : std::as_const(d->roster))
+        root.appendChild(item.toXml(&doc));
+
+    saveData(doc.toString().toUtf8());
+}
+
 //---------------------------------------------------------------------------
 // FormField
 //---------------------------------------------------------------------------
@@ -2839,6 +3185,204 @@ PubSubRetraction::PubSubRetraction(const QString &id) : id_(id) { }
 
 const QString &PubSubRetraction::id() const { return id_; }
 
+//---------------------------------------------------------------------------
+// PEPCache
+//---------------------------------------------------------------------------
+#define PEP_CACHE_MAGIC 0x49504531
+
+class PEPCache::Private {
+public:
+    struct Entry {
+        QByteArray payload; // serialized
+        QByteArray tag;
+    };
+
+    QHash<QString, QHash<QString, Entry>> nodes; // by owner.bare() + ' ' + node. there are no spaces in jids
+    bool                                  loaded = false;
+
+    static QString key(const Jid &owner, const QString &node) { return owner.bare() + QLatin1Char(' ') + node; }
+
+    static QByteArray serialize(const QDomElement &payload)
+    {
+        QDomDocument doc;
+        doc.appendChild(doc.importNode(payload, true));
+        return doc.toByteArray(-1);
+    }
+
+    bool update(const QString &key, const PubSubItem &item)
+    {
+        QByteArray data = serialize(item.payload());
+        QByteArray tag  = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+        Entry     &e    = nodes[key][item.id()];
+        if (e.tag == tag)
+            return false;
+        e.payload = data;
+        e.tag     = tag;
+        return true;
+    }
+
+    bool retract(const QString &key, const QString &id)
+    {
+        auto it = nodes.find(key);
+        if (it == nodes.end() || !it->remove(id))
+            return false;
+        if (it->isEmpty())
+            nodes.erase(it);
+        return true;
+    }
+
+    const Entry *entry(const QString &key, const QString &id) const
+    {
+        auto it = nodes.constFind(key);
+        if (it == nodes.constEnd())
+            return nullptr;
+        auto eit = it->constFind(id);
+        return eit == it->constEnd() ? nullptr : &*eit;
+    }
+};
+
+PEPCache::PEPCache() : d(new Private) { }
+
+PEPCache::~PEPCache() { delete d; }
+
+bool PEPCache::update(const Jid &owner, const QString &node, const PubSubItem &item)
+{
+    load();
+    if (!d->update(Private::key(owner, node), item))
+        return false;
+    save();
+    return true;
+}
+
+bool PEPCache::retract(const Jid &owner, const QString &node, const QString &id)
+{
+    load();
+    if (!d->retract(Private::key(owner, node), id))
+        return false;
+    save();
+    return true;
+}
+
+bool PEPCache::apply(const Message &m)
+{
+    load();
+    const QString key     = Private::key(m.from(), m.pubsubNode());
+    bool          changed = false;
+    for (const PubSubItem &item : m.pubsubItems())
+        changed |= d->update(key, item);
+    for (const PubSubRetraction &r : m.pubsubRetractions())
+        changed |= d->retract(key, r.id());
+    if (changed)
+        save();
+    return changed;
+}
+
+QStringList PEPCache::items(const Jid &owner, const QString &node) const
+{
+    load();
+    return d->nodes.value(Private::key(owner, node)).keys();
+}
+
+bool PEPCache::contains(const Jid &owner, const QString &node, const QString &id) const
+{
+    load();
+    return d->entry(Private::key(owner, node), id) != nullptr;
+}
+
+QByteArray PEPCache::tag(const Jid &owner, const QString &node, const QString &id) const
+{
+    load();
+    auto e = d->entry(Private::key(owner, node), id);
+    return e ? e->tag : QByteArray();
+}
+
+QDomElement PEPCache::payload(const Jid &owner, const QString &node, const QString &id) const
+{
+    load();
+    auto         e = d->entry(Private::key(owner, node), id);
+    QDomDocument doc;
+    if (!e || !doc.setContent(e->payload, true))
+        return QDomElement();
+    return doc.documentElement();
+}
+
+void PEPCache::clear(const Jid &owner)
+{
+    load();
+    const QString prefix  = owner.bare() + QLatin1Char(' ');
+    bool          changed = false;
+    for (auto it = d->nodes.begin(); it != d->nodes.end();) {
+        if (it.key().startsWith(prefix)) {
+            it      = d->nodes.erase(it);
+            changed = true;
+        } else {
+            ++it;
+        }
+    }
+    if (changed)
+        save();
+}
+
+void PEPCache::clear()
+{
+    d->loaded = true;
+    d->nodes.clear();
+    save();
+}
+
+void PEPCache::saveData(const QByteArray &data) { Q_UNUSED(data) }
+
+QByteArray PEPCache::loadData() { return QByteArray(); }
+
+void PEPCache::load() const
+{
+    if (d->loaded)
+        return;
+    d->loaded = true;
+
+    QByteArray data = const_cast<PEPCache *>(this)->loadData();
+    if (data.isEmpty())
+        return;
+
+    QDataStream ds(data);
+    ds.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0, count = 0;
+    ds >> magic >> count;
+    if (magic != PEP_CACHE_MAGIC)
+        return;
+    for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; ++i) {
+        QString key;
+        quint32 items = 0;
+        ds >> key >> items;
+        auto &node = d->nodes[key];
+        for (quint32 j = 0; j < items && ds.status() == QDataStream::Ok; ++j) {
+            QString        id;
+            Private::Entry e;
+            ds >> id >> e.payload;
+            e.tag    = QCryptographicHash::hash(e.payload, QCryptographicHash::Sha1);
+            node[id] = e;
+        }
+    }
+    if (ds.status() != QDataStream::Ok) {
+        qWarning("PEPCache: Cannot read stored items");
+        d->nodes.clear();
+    }
+}
+
+void PEPCache::save()
+{
+    QByteArray  data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_0);
+    ds << quint32(PEP_CACHE_MAGIC) << quint32(d->nodes.size());
+    for (auto it = d->nodes.constBegin(); it != d->nodes.constEnd(); ++it) {
+        ds << it.key() << quint32(it->size());
+        for (auto eit = it->constBegin(); eit != it->constEnd(); ++eit)
+            ds << eit.key() << eit->payload;
+    }
+    saveData(data);
+}
+
 // =========================================
 //            CaptchaChallenge
 // =========================================
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp/xmpp-im/xmpp_hash.h"
+#include "qttestutil/qttestutil.h"
+
+#include <QBuffer>
+#include <QObject>
+#include <QtCrypto>
+#include <QtTest/QtTest>
+
+using namespace XMPP;
+
+// Measures Hash::compute() for each of the XEP-0300 algorithms, on a stanza sized input and on a file chunk.
+class HashBenchmark : public QObject {
+    Q_OBJECT
+
+private:
+    static void addAlgorithms()
+    {
+        QTest::addColumn<int>("type");
+        QTest::addColumn<int>("size");
+        const struct {
+            const char *name;
+            Hash::Type  type;
+        } algos[] = { { "sha-1", Hash::Sha1 },
+                      { "sha-256", Hash::Sha256 },
+                      { "sha-512", Hash::Sha512 },
+                      { "sha3-256", Hash::Sha3_256 },
+                      { "sha3-512", Hash::Sha3_512 },
+                      { "blake2b-256", Hash::Blake2b256 },
+                      { "blake2b-512", Hash::Blake2b512 } };
+        for (auto const &a : algos) {
+            QTest::newRow(qPrintable(QString("%1 1KiB").arg(a.name))) << int(a.type) << 1024;
+            QTest::newRow(qPrintable(QString("%1 1MiB").arg(a.name))) << int(a.type) << 1024 * 1024;
+        }
+    }
+
+private slots:
+    void benchmarkCompute_data() { addAlgorithms(); }
+    void benchmarkCompute()
+    {
+        QFETCH(int, type);
+        QFETCH(int, size);
+        const QByteArray data(size, 'x');
+        Hash             h(Hash::Type(type));
+        if (!h.compute(data))
+            QSKIP("not supported by this build.");
+        QBENCHMARK
+        {
+            h.compute(data);
+        }
+    }
+
+    void benchmarkComputeDevice_data() { addAlgorithms(); }
+    void benchmarkComputeDevice()
+    {
+        QFETCH(int, type);
+        QFETCH(int, size);
+        QByteArray data(size, 'x');
+        QBuffer    buf(&data);
+        buf.open(QIODevice::ReadOnly);
+        Hash h(Hash::Type(type));
+        if (!h.compute(&buf))
+            QSKIP("not supported by this build.");
+        QBENCHMARK
+        {
+            buf.seek(0);
+            h.compute(&buf);
+        }
+    }
+
+private:
+    QCA::Initializer initializer;
+};
+
+QTTESTUTIL_REGISTER_TEST(HashBenchmark);
+#include "hashbenchmark.moc"
@@ -24,7 +24,15 @@
 #include "xmpp_xmlcommon.h"
 
 #include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
 #include <QFile>
+#include <QSaveFile>
+
+// memory budget of BoBDiskCache by default
+#define BOB_CACHE_MEMORY (4 * 1024 * 1024)
+#define BOB_CACHE_MAGIC 0x49424231
 
 using namespace XMPP;
 
@@ -92,7 +100,7 @@ void BoBData::fromXml(const QDomElement &data)
     setCid(data.attribute("cid"));
     d->maxAge = data.attribute("max-age").toUInt();
     d->type   = data.attribute("type");
-    d->data   = QByteArray::fromBase64(data.text().replace("\n", "").toLatin1());
+    d->data   = XMLHelper::fromBase64(data.text());
 }
 
 QDomElement BoBData::toXml(QDomDocument *doc) const
@@ -101,7 +109,7 @@ QDomElement BoBData::toXml(QDomDocument *doc) const
     data.setAttribute("cid", cid());
     data.setAttribute("max-age", d->maxAge);
     data.setAttribute("type", d->type);
-    data.appendChild(doc->createTextNode(QString::fromLatin1(d->data.toBase64())));
+    data.appendChild(doc->createTextNode(XMLHelper::toBase64(d->data)));
     return data;
 }
 
@@ -110,6 +118,113 @@ QDomElement BoBData::toXml(QDomDocument *doc) const
 // ---------------------------------------------------------
 BoBCache::BoBCache(QObject *parent) : QObject(parent) { }
 
+// ---------------------------------------------------------
+// BoBDiskCache
+// ---------------------------------------------------------
+BoBDiskCache::BoBDiskCache(const QString &dir, QObject *parent) : BoBCache(parent), _dir(dir), _memory(BOB_CACHE_MEMORY)
+{
+    QDir().mkpath(_dir);
+    removeExpired();
+}
+
+void BoBDiskCache::setMemoryLimit(qint64 bytes) { _memory.setMaxCost(bytes); }
+
+qint64 BoBDiskCache::memoryLimit() const { return _memory.maxCost(); }
+
+void BoBDiskCache::put(const BoBData &bd)
+{
+    if (bd.isNull())
+        return;
+
+    qint64 now   = QDateTime::currentMSecsSinceEpoch();
+    auto   entry = new Entry { bd.type(), bd.maxAge() ? now + qint64(bd.maxAge()) * 1000 : 0, bd.data() };
+
+    QSaveFile f(fileName(bd.hash()));
+    if (f.open(QIODevice::WriteOnly)) {
+        QDataStream ds(&f);
+        ds.setVersion(QDataStream::Qt_5_0);
+        ds << quint32(BOB_CACHE_MAGIC) << entry->type << entry->expires << entry->data;
+        if (!f.commit())
+            qWarning("BoBDiskCache: can't write %s", qPrintable(f.fileName()));
+    }
+
+    // dropped right away if it is bigger than the whole budget, it is on the disk then
+    _memory.insert(bd.hash(), entry, entry->data.size());
+}
+
+BoBData BoBDiskCache::get(const Hash &hash)
+{
+    Entry *entry = _memory.object(hash);
+    bool   own   = false; // not in memory and too big for it
+    if (!entry) {
+        entry = load(hash);
+        if (!entry)
+            return BoBData();
+        if (entry->data.size() > _memory.maxCost())
+            own = true;
+        else
+            _memory.insert(hash, entry, entry->data.size());
+    }
+
+    BoBData bd;
+    qint64  now = QDateTime::currentMSecsSinceEpoch();
+    if (!entry->expires || entry->expires > now) {
+        bd.setHash(hash);
+        bd.setType(entry->type);
+        bd.setData(entry->data);
+        bd.setMaxAge(entry->expires ? uint((entry->expires - now + 999) / 1000) : 0);
+    }
+    if (own)
+        delete entry;
+    if (bd.isNull())
+        remove(hash); // expired
+    return bd;
+}
+
+void BoBDiskCache::remove(const Hash &hash)
+{
+    _memory.remove(hash);
+    QFile::remove(fileName(hash));
+}
+
+void BoBDiskCache::removeExpired()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (const QString &name : QDir(_dir).entryList(QDir::Files)) {
+        Hash hash = Hash::from(QStringView { name });
+        if (!hash.isValid())
+            continue;
+        Entry *entry = _memory.object(hash);
+        bool   own   = !entry;
+        if (own)
+            entry = load(hash);
+        if (!entry || (entry->expires && entry->expires <= now))
+            remove(hash);
+        if (own)
+            delete entry;
+    }
+}
+
+QString BoBDiskCache::fileName(const Hash &hash) const { return _dir + QLatin1Char('/') + hash.toString(); }
+
+BoBDiskCache::Entry *BoBDiskCache::load(const Hash &hash) const
+{
+    QFile f(fileName(hash));
+    if (!f.open(QIODevice::ReadOnly))
+        return nullptr;
+
+    QDataStream ds(&f);
+    ds.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0;
+    auto    entry = new Entry;
+    ds >> magic >> entry->type >> entry->expires >> entry->data;
+    if (magic != BOB_CACHE_MAGIC || ds.status() != QDataStream::Ok) {
+        delete entry;
+        return nullptr;
+    }
+    return entry;
+}
+
 //------------------------------------------------------------------------------
 // BoBManager
 //------------------------------------------------------------------------------
@@ -22,6 +22,7 @@
 #include "xmpp/jid/jid.h"
 #include "xmpp_hash.h"
 
+#include <QCache>
 #include <QDomElement>
 #include <QFile>
 #include <QHash>
@@ -77,6 +78,40 @@ public:
     virtual BoBData get(const Hash &)    = 0;
 };
 
+/*
+ * A BoBCache with a memory budget. Everything put is written to a directory as well, one file per hash,
+ * so data evicted from memory (least recently used first) is read back from there. Data expires after its
+ * max-age, 0 means it never does.
+ */
+class BoBDiskCache : public BoBCache {
+    Q_OBJECT
+
+public:
+    BoBDiskCache(const QString &dir, QObject *parent = nullptr);
+
+    void   setMemoryLimit(qint64 bytes);
+    qint64 memoryLimit() const;
+
+    void    put(const BoBData &) override;
+    BoBData get(const Hash &) override;
+
+    void remove(const Hash &);
+    void removeExpired(); // from the disk too. done on construction
+
+private:
+    struct Entry {
+        QString    type;
+        qint64     expires; // msecs since epoch, 0 for never
+        QByteArray data;
+    };
+
+    QString fileName(const Hash &) const;
+    Entry  *load(const Hash &) const;
+
+    QString             _dir;
+    QCache<Hash, Entry> _memory; // cost is the data size
+};
+
 class BoBManager : public QObject {
     Q_OBJECT
 
@@ -32,9 +32,23 @@
 #include "xmpp_xmlcommon.h"
 
 #include <QCoreApplication>
+#include <QDataStream>
 #include <QDebug>
 #include <QDomElement>
 #include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QTimer>
+
+// "ICR1". the binary store: the magic, then (node, record) pairs written by QDataStream
+#define CAPS_STORE_MAGIC 0x49435231
+// the store is rewritten on load if at least this many records are dead (expired or repeated)
+#define CAPS_STORE_COMPACT_MIN 64
+// disco#info requests of a CapsManager: a token bucket of this size, refilled with this many per second
+#define CAPS_DISCO_BURST 10
+#define CAPS_DISCO_RATE 5
+// jids asked about a node before we give up on it (they answer with something not matching the hash)
+#define CAPS_DISCO_MAX_TRIES 3
 
 namespace XMPP {
 QDomElement CapsInfo::toXml(QDomDocument *doc) const
@@ -55,6 +69,57 @@ CapsInfo CapsInfo::fromXml(const QDomElement &caps)
     return CapsInfo(item, lastSeen);
 }
 
+// record: last seen as msecs since epoch, then the disco#info result as compact xml
+static QByteArray encodeCapsInfo(const CapsInfo &info)
+{
+    QDomDocument doc;
+    doc.appendChild(info.disco().toDiscoInfoResult(&doc));
+
+    QByteArray  record;
+    QDataStream out(&record, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << qint64(info.lastSeen().toMSecsSinceEpoch()) << doc.toByteArray(-1);
+    return record;
+}
+
+static QDateTime capsRecordLastSeen(const QByteArray &record)
+{
+    QDataStream in(record);
+    in.setVersion(QDataStream::Qt_5_0);
+    qint64 msecs = 0;
+    in >> msecs;
+    return in.status() == QDataStream::Ok ? QDateTime::fromMSecsSinceEpoch(msecs) : QDateTime();
+}
+
+// the forms of the disco result aren't counted, they are rare in caps
+static qint64 capsInfoBytes(const CapsInfo &info)
+{
+    qint64 bytes = qint64(sizeof(CapsInfo));
+    for (const QString &f : info.disco().features().list())
+        bytes += qint64(sizeof(QString)) + f.size() * 2;
+    for (const auto &i : info.disco().identities())
+        bytes += qint64(sizeof(DiscoItem::Identity))
+            + (i.category.size() + i.type.size() + i.lang.size() + i.name.size()) * 2;
+    return bytes;
+}
+
+static CapsInfo decodeCapsInfo(const QByteArray &record)
+{
+    QDataStream in(record);
+    in.setVersion(QDataStream::Qt_5_0);
+    qint64     msecs = 0;
+    QByteArray xml;
+    in >> msecs >> xml;
+
+    QDomDocument doc;
+    if (in.status() != QDataStream::Ok || !doc.setContent(xml))
+        return CapsInfo();
+    DiscoItem item = DiscoItem::fromDiscoInfoResult(doc.documentElement());
+    if (item.features().isEmpty())
+        return CapsInfo();
+    return CapsInfo(item, QDateTime::fromMSecsSinceEpoch(msecs));
+}
+
 // -----------------------------------------------------------------------------
 
 /**
@@ -62,6 +127,7 @@ CapsInfo CapsInfo::fromXml(const QDomElement &caps)
  * \brief A singleton class managing the capabilities of clients.
  */
 CapsRegistry *CapsRegistry::instance_ = nullptr;
+Q_GLOBAL_STATIC(QMutex, caps_instance_mutex)
 
 /**
  * \brief Default constructor.
@@ -70,31 +136,47 @@ CapsRegistry::CapsRegistry(QObject *parent) : QObject(parent) { }
 
 CapsRegistry *CapsRegistry::instance()
 {
+    QMutexLocker locker(caps_instance_mutex());
     if (!instance_) {
-        instance_ = new CapsRegistry(qApp);
+        instance_ = new CapsRegistry;
+        // the first one to ask may be a client on a worker thread
+        if (qApp) {
+            instance_->moveToThread(qApp->thread());
+            instance_->setParent(qApp);
+        }
     }
     return instance_;
 }
 
-void CapsRegistry::setInstance(CapsRegistry *instance) { instance_ = instance; }
+void CapsRegistry::setInstance(CapsRegistry *instance)
+{
+    QMutexLocker locker(caps_instance_mutex());
+    instance_ = instance;
+}
 
 /**
- * \brief Convert all capabilities info to XML.
+ * \brief Writes all capabilities info, compacting the store.
  */
 void CapsRegistry::save()
 {
-    // Generate XML
-    QDomDocument doc;
-    QDomElement  capabilities = doc.createElement("capabilities");
-    doc.appendChild(capabilities);
-    QHash<QString, CapsInfo>::ConstIterator i = capsInfo_.constBegin();
-    for (; i != capsInfo_.constEnd(); i++) {
-        QDomElement info = i.value().toXml(&doc);
-        info.setAttribute("node", i.key());
-        capabilities.appendChild(info);
-    }
+    QMutexLocker locker(&mutex_);
+    saveLocked();
+}
 
-    saveData(doc.toString().toUtf8());
+void CapsRegistry::saveLocked()
+{
+    QByteArray  data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << quint32(CAPS_STORE_MAGIC);
+    for (auto it = capsInfo_.constBegin(); it != capsInfo_.constEnd(); ++it)
+        out << it.key() << encodeCapsInfo(it.value());
+    // still as they were loaded, no need to decode them
+    for (auto it = stored_.constBegin(); it != stored_.constEnd(); ++it)
+        out << it.key() << it.value();
+
+    saveData(data);
+    storeValid_ = true;
 }
 
 void CapsRegistry::saveData(const QByteArray &data)
@@ -105,16 +187,74 @@ void CapsRegistry::saveData(const QByteArray &data)
 
 QByteArray CapsRegistry::loadData() { return QByteArray(); }
 
+void CapsRegistry::appendData(const QByteArray &data) { Q_UNUSED(data) }
+
+static bool isValidCapsNode(const QString &node)
+{
+    int sep = node.indexOf('#');
+    return sep > 0 && sep + 1 < node.length();
+}
+
 /**
- * \brief Sets the file to save the capabilities info to
+ * \brief Loads the capabilities info saved before
+ *
+ * Only the index of the store is read, the disco items are decoded on first use.
+ * The store of older versions (xml) is converted.
  */
 void CapsRegistry::load()
 {
-    QByteArray data = loadData();
+    QMutexLocker locker(&mutex_);
+    QByteArray   data = loadData();
     if (data.isEmpty()) {
         return;
     }
 
+    // keep unseen info for last 3 month. adjust if required
+    QDateTime validTime = QDateTime::currentDateTime().addMonths(-3);
+
+    if (data.startsWith('<')) {
+        loadXml(data, validTime);
+        saveLocked();
+        return;
+    }
+
+    QDataStream in(data);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0;
+    in >> magic;
+    if (magic != CAPS_STORE_MAGIC) {
+        qWarning("capsregistry.cpp: Unknown store format");
+        return;
+    }
+
+    int dead = 0;
+    while (!in.atEnd()) {
+        QString    node;
+        QByteArray record;
+        in >> node >> record;
+        if (in.status() != QDataStream::Ok) {
+            // most likely an append which didn't finish. what we have so far is fine
+            qWarning("capsregistry.cpp: Truncated store");
+            ++dead;
+            break;
+        }
+        if (!isValidCapsNode(node) || capsRecordLastSeen(record) <= validTime) {
+            ++dead;
+            continue;
+        }
+        if (stored_.contains(node) || capsInfo_.contains(node))
+            ++dead;
+        capsInfo_.remove(node);
+        stored_.insert(node, record);
+    }
+
+    storeValid_ = true;
+    if (dead >= CAPS_STORE_COMPACT_MIN || dead > stored_.size())
+        saveLocked();
+}
+
+void CapsRegistry::loadXml(const QByteArray &data, const QDateTime &validTime)
+{
     // Load settings
     QDomDocument doc;
 
@@ -129,8 +269,6 @@ void CapsRegistry::load()
         return;
     }
 
-    // keep unseen info for last 3 month. adjust if required
-    QDateTime validTime = QDateTime::currentDateTime().addMonths(-3);
     for (QDomNode n = caps.firstChild(); !n.isNull(); n = n.nextSibling()) {
         QDomElement i = n.toElement();
         if (i.isNull()) {
@@ -140,11 +278,10 @@ void CapsRegistry::load()
 
         if (i.tagName() == "info") {
             QString node = i.attribute("node");
-            int     sep  = node.indexOf('#');
-            if (sep > 0 && sep + 1 < node.length()) {
+            if (isValidCapsNode(node)) {
                 CapsInfo info = CapsInfo::fromXml(i);
                 if (info.isValid() && info.lastSeen() > validTime) {
-                    capsInfo_[node] = CapsInfo::fromXml(i);
+                    capsInfo_[node] = info;
                 }
                 // qDebug() << QString("Read %1 %2").arg(node).arg(ver);
             } else {
@@ -162,22 +299,77 @@ void CapsRegistry::load()
 void CapsRegistry::registerCaps(const CapsSpec &spec, const DiscoItem &item)
 {
     QString dnode = spec.flatten();
-    if (!isRegistered(dnode)) {
+    {
+        QMutexLocker locker(&mutex_);
+        if (capsInfo_.contains(dnode) || stored_.contains(dnode))
+            return;
         CapsInfo info(item);
         capsInfo_[dnode] = info;
-        emit registered(spec);
+        if (storeValid_) {
+            QByteArray  data;
+            QDataStream out(&data, QIODevice::WriteOnly);
+            out.setVersion(QDataStream::Qt_5_0);
+            out << dnode << encodeCapsInfo(info);
+            appendData(data);
+        } else {
+            saveLocked(); // nothing to append to yet
+        }
     }
+    emit registered(spec);
 }
 
 /**
  * \brief Checks if capabilities have been registered.
  */
-bool CapsRegistry::isRegistered(const QString &spec) const { return capsInfo_.contains(spec); }
+bool CapsRegistry::isRegistered(const QString &spec) const
+{
+    QMutexLocker locker(&mutex_);
+    return capsInfo_.contains(spec) || stored_.contains(spec);
+}
+
+// the decoded info, null if there is none
+const CapsInfo *CapsRegistry::info(const QString &spec) const
+{
+    auto it = capsInfo_.constFind(spec);
+    if (it == capsInfo_.constEnd()) {
+        auto sit = stored_.find(spec);
+        if (sit == stored_.end())
+            return nullptr;
+        it = capsInfo_.insert(spec, decodeCapsInfo(sit.value()));
+        stored_.erase(sit);
+    }
+    return &it.value();
+}
 
 DiscoItem CapsRegistry::disco(const QString &spec) const
 {
-    CapsInfo ci = capsInfo_.value(spec);
-    return ci.disco();
+    QMutexLocker    locker(&mutex_);
+    const CapsInfo *ci = info(spec);
+    return ci ? ci->disco() : DiscoItem();
+}
+
+Features CapsRegistry::features(const QString &spec) const
+{
+    QMutexLocker    locker(&mutex_);
+    const CapsInfo *ci = info(spec);
+    return ci ? ci->disco().features() : Features();
+}
+
+qint64 CapsRegistry::memoryUsage(const QStringList &specs) const
+{
+    QMutexLocker locker(&mutex_);
+    qint64       bytes = 0;
+    for (const QString &spec : specs) {
+        auto it = capsInfo_.constFind(spec);
+        if (it != capsInfo_.constEnd()) {
+            bytes += spec.size() * 2 + capsInfoBytes(it.value());
+            continue;
+        }
+        auto sit = stored_.constFind(spec);
+        if (sit != stored_.constEnd())
+            bytes += spec.size() * 2 + sit.value().capacity();
+    }
+    return bytes;
 }
 
 /*--------------------------------------------------------------
@@ -201,7 +393,13 @@ DiscoItem CapsRegistry::disco(const QString &spec) const
 /**
  * \brief Default constructor.
  */
-CapsManager::CapsManager(Client *client) : QObject(client), client_(client), isEnabled_(true) { }
+CapsManager::CapsManager(Client *client) :
+    QObject(client), client_(client), isEnabled_(true), discoTimer_(new QTimer(this)), discoTokens_(CAPS_DISCO_BURST)
+{
+    discoTimer_->setSingleShot(true);
+    connect(discoTimer_, &QTimer::timeout, this, &CapsManager::sendQueuedDiscos);
+    discoClock_.start();
+}
 
 CapsManager::~CapsManager() { }
 
@@ -248,16 +446,9 @@ void CapsManager::updateCaps(const Jid &jid, const CapsSpec &c)
             emit capsChanged(jid);
 
             // Register new caps and check if we need to discover features
-            if (isEnabled()) {
-                if (!CapsRegistry::instance()->isRegistered(fullNode) && capsJids_[fullNode].count() == 1) {
-                    // qDebug() << QString("caps.cpp: Sending disco request to %1,
-                    // node=%2").arg(QString(jid.full()).replace('%',"%%")).arg(node + "#" + s.extensions());
-                    JT_DiscoInfo *disco = new JT_DiscoInfo(client_->rootTask());
-                    disco->setAllowCache(false);
-                    connect(disco, SIGNAL(finished()), SLOT(discoFinished()));
-                    disco->get(jid, fullNode);
-                    disco->go(true);
-                }
+            if (isEnabled() && !CapsRegistry::instance()->isRegistered(fullNode)) {
+                queueDisco(fullNode);
+                sendQueuedDiscos();
             }
         } else {
             // Remove all caps specifications
@@ -265,7 +456,7 @@ void CapsManager::updateCaps(const Jid &jid, const CapsSpec &c)
                               .arg(QString(jid.full()).replace('%', "%%"), fullNode, c.version());
             capsSpecs_.remove(jid.full());
         }
-    } else {
+    } else if (!capsJids_[fullNode].contains(jid.full())) {
         // Add to the list of jids
         capsJids_[fullNode].push_back(jid.full());
     }
@@ -298,7 +489,65 @@ void CapsManager::disableCaps(const Jid &jid)
 void CapsManager::discoFinished()
 {
     JT_DiscoInfo *task = static_cast<JT_DiscoInfo *>(sender());
-    updateDisco(task->jid(), task->item());
+    QString       node = task->node();
+    discoInFlight_.remove(node);
+    if (task->success())
+        updateDisco(task->jid(), task->item());
+
+    if (CapsRegistry::instance()->isRegistered(node))
+        discoTried_.remove(node);
+    else
+        queueDisco(node); // maybe somebody else answers better
+    sendQueuedDiscos();
+}
+
+void CapsManager::queueDisco(const QString &node)
+{
+    if (discoInFlight_.contains(node) || discoQueue_.contains(node)
+        || discoTried_.value(node).size() >= CAPS_DISCO_MAX_TRIES)
+        return;
+    discoQueue_.append(node);
+}
+
+void CapsManager::sendQueuedDiscos()
+{
+    discoTokens_ = qMin<double>(CAPS_DISCO_BURST, discoTokens_ + discoClock_.restart() * CAPS_DISCO_RATE / 1000.);
+    while (!discoQueue_.isEmpty() && discoTokens_ >= 1) {
+        QString node = discoQueue_.takeFirst();
+        if (CapsRegistry::instance()->isRegistered(node)) {
+            discoTried_.remove(node);
+            continue;
+        }
+
+        QStringList &tried = discoTried_[node];
+        QString      jid;
+        for (const QString &candidate : std::as_const(capsJids_[node])) {
+            if (!tried.contains(candidate)) {
+                jid = candidate;
+                break;
+            }
+        }
+        if (jid.isEmpty())
+            continue; // the next jid with this node will queue it again
+
+        // all the jids waiting for the node learn about it at once. the registry may have been replaced since
+        // the last time, so make sure we listen to the current one
+        connect(CapsRegistry::instance(), &CapsRegistry::registered, this, &CapsManager::capsRegistered,
+                Qt::UniqueConnection);
+
+        tried += jid;
+        discoTokens_ -= 1;
+        discoInFlight_ += node;
+        // qDebug() << QString("caps.cpp: Sending disco request to %1, node=%2").arg(jid, node);
+        JT_DiscoInfo *disco = new JT_DiscoInfo(client_->rootTask());
+        disco->setAllowCache(false);
+        connect(disco, SIGNAL(finished()), SLOT(discoFinished()));
+        disco->get(Jid(jid), node);
+        disco->go(true);
+    }
+
+    if (!discoQueue_.isEmpty() && !discoTimer_->isActive())
+        discoTimer_->start(int((1 - discoTokens_) * 1000 / CAPS_DISCO_RATE) + 1);
 }
 
 void CapsManager::updateDisco(const Jid &jid, const DiscoItem &item)
@@ -348,7 +597,14 @@ XMPP::DiscoItem CapsManager::disco(const Jid &jid) const
 /**
  * \brief Requests the list of features of a given JID.
  */
-XMPP::Features CapsManager::features(const Jid &jid) const { return disco(jid).features(); }
+XMPP::Features CapsManager::features(const Jid &jid) const
+{
+    // all the jids with the same caps share the features of the registry, no need to copy the whole item
+    auto it = capsSpecs_.constFind(jid.full());
+    if (it == capsSpecs_.constEnd())
+        return Features();
+    return CapsRegistry::instance()->features(it.value().flatten());
+}
 
 /**
  * \brief Returns the client name of a given jid.
@@ -440,4 +696,20 @@ QString CapsManager::osVersion(const Jid &jid) const
 }
 
 CapsSpec CapsManager::capsSpec(const Jid &jid) const { return capsSpecs_.value(jid.full()); }
+
+qint64 CapsManager::memoryUsage() const
+{
+    qint64      bytes = 0;
+    QStringList nodes;
+    for (auto it = capsSpecs_.constBegin(); it != capsSpecs_.constEnd(); ++it)
+        bytes += qint64(sizeof(CapsSpec)) + (it.key().size() + it->node().size() + it->version().size()) * 2;
+    for (auto it = capsJids_.constBegin(); it != capsJids_.constEnd(); ++it) {
+        bytes += it.key().size() * 2;
+        for (const QString &j : it.value())
+            bytes += qint64(sizeof(QString)) + j.size() * 2;
+        if (!it.value().isEmpty())
+            nodes += it.key();
+    }
+    return bytes + CapsRegistry::instance()->memoryUsage(nodes);
+}
 } // namespace XMPP
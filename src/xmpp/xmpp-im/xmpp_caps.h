@@ -23,7 +23,13 @@
 #include "xmpp_features.h"
 #include "xmpp_status.h"
 
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
 #include <QPointer>
+#include <QSet>
+
+class QTimer;
 
 namespace XMPP {
 class CapsInfo {
@@ -56,6 +62,9 @@ public:
     void      registerCaps(const CapsSpec &, const XMPP::DiscoItem &item);
     bool      isRegistered(const QString &) const;
     DiscoItem disco(const QString &) const;
+    Features  features(const QString &) const;
+    // approximate heap bytes of the entries of the given specs, see CapsSpec::flatten()
+    qint64    memoryUsage(const QStringList &specs) const;
 
 signals:
     void registered(const XMPP::CapsSpec &);
@@ -67,10 +76,21 @@ public slots:
 protected:
     virtual void       saveData(const QByteArray &data); // reimplmenet these two functions
     virtual QByteArray loadData();                       // to have permanent cache
+    // optional. appends a record to what saveData() wrote, so a new registration doesn't need save()
+    virtual void       appendData(const QByteArray &data);
 
 private:
-    static CapsRegistry     *instance_;
-    QHash<QString, CapsInfo> capsInfo_;
+    void            loadXml(const QByteArray &data, const QDateTime &validTime);
+    void            saveLocked();
+    const CapsInfo *info(const QString &spec) const;
+
+    static CapsRegistry               *instance_;
+    // clients on several threads share the registry. the data functions are called with it locked
+    mutable QMutex                     mutex_;
+    mutable QHash<QString, CapsInfo>   capsInfo_;
+    // loaded but not decoded yet. most nodes in the cache are never asked for during a session
+    mutable QHash<QString, QByteArray> stored_;
+    bool                               storeValid_ = false; // the store has our header, records can be appended
 };
 
 class CapsManager : public QObject {
@@ -96,6 +116,10 @@ public:
     QString        osVersion(const Jid &jid) const;
     CapsSpec       capsSpec(const Jid &jid) const;
 
+    // approximate heap bytes of what we know about the jids and the registry entries of their nodes. the
+    // entries are shared by the clients of the process, each client counts the ones it uses itself
+    qint64 memoryUsage() const;
+
 signals:
     /**
      * This signal is emitted when the feature list of a given JID have changed.
@@ -107,10 +131,22 @@ protected slots:
     void capsRegistered(const CapsSpec &);
 
 private:
+    void queueDisco(const QString &node);
+    void sendQueuedDiscos();
+
     Client                       *client_;
     bool                          isEnabled_;
     QMap<QString, CapsSpec>       capsSpecs_;
     QMap<QString, QList<QString>> capsJids_;
+
+    // one disco#info per node at a time, rate limited. the jids of a node are asked one by one until
+    // one of them answers with what matches the hash
+    QStringList                 discoQueue_;
+    QSet<QString>               discoInFlight_;
+    QHash<QString, QStringList> discoTried_; // node -> jids asked
+    QTimer                     *discoTimer_;
+    QElapsedTimer               discoClock_;
+    double                      discoTokens_;
 };
 } // namespace XMPP
 
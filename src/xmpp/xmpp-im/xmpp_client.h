@@ -19,6 +19,7 @@
 #ifndef XMPP_CLIENT_H
 #define XMPP_CLIENT_H
 
+#include "iris/xmpp_stanza.h"
 #include "xmpp/jid/jid.h"
 #include "xmpp_discoitem.h"
 #include "xmpp_status.h"
@@ -27,6 +28,8 @@
 #include <QObject>
 #include <QStringList>
 
+#include <functional>
+
 class ByteStream;
 class QDomDocument;
 class QDomElement;
@@ -36,20 +39,27 @@ class QString;
 namespace XMPP {
 class BSConnection;
 class CapsManager;
+class ClientHost;
 class ClientStream;
+class ContentSink;
 class EncryptionHandler;
 class Features;
 class FileTransferManager;
 class HttpFileUploadManager;
 class IBBManager;
+class IqCall;
 class JidLinkManager;
 class LiveRoster;
 class LiveRosterItem;
 class Message;
+class MessageIdIndex;
+class NamePrefetcher;
+class PEPCache;
 class Resource;
 class ResourceList;
 class Roster;
 class RosterItem;
+class RosterStore;
 class S5BManager;
 class ServerInfoManager;
 class Stream;
@@ -92,9 +102,22 @@ public:
     const ResourceList &resourceList() const;
     bool                isSessionRequired() const;
 
-    void send(const QDomElement &);
+    // the priority class is inferred from the stanza unless given, see ClientStream::write()
+    void send(const QDomElement &, Stanza::Priority priority = Stanza::Priority::Auto);
+    // goes to the stream as is, unless somebody wants to see the outgoing stanzas as trees
+    void send(const Stanza::Builder &, Stanza::Priority priority = Stanza::Priority::Auto);
     void send(const QString &);
+    // the same message or presence to each of the jids, its own "to" doesn't matter. it's a single stanza to the
+    // XEP-0033 service of the server when there is one, the jids being bcc addresses, otherwise the children are
+    // serialized once and only "to" differs between the copies
+    void sendToMany(const QDomElement &, const QList<Jid> &recipients);
     void clearSendQueue();
+    // sends a get or set iq and gives what a coroutine co_awaits for the reply, see IqCall. timeout in secs,
+    // -1 for taskTimeout(), 0 for none
+    IqCall iq(const QDomElement &request, int timeout = -1);
+    // not owned. given to this and every later stream, see ClientStream::addContentSink()
+    void addContentSink(const QString &ns, const QString &localName, ContentSink *sink);
+    void removeContentSink(ContentSink *sink);
 
     QString host() const;
     QString user() const;
@@ -105,15 +128,74 @@ public:
     void                   setNetworkAccessManager(QNetworkAccessManager *qnam);
     QNetworkAccessManager *networkAccessManager() const;
 
+    // set by ClientHost::addClient()
+    void        setClientHost(ClientHost *host);
+    ClientHost *clientHost() const;
+
+    // not owned. with a store the roster is requested versioned (XEP-0237), if the server can do it
+    void         setRosterStore(RosterStore *store);
+    RosterStore *rosterStore() const;
+    // puts the stored roster into the live one, e.g. to show it before login. rosterRequest() does it
+    // itself if the live roster is empty
+    void         restoreRoster();
+    // not owned. with a cache pubsub events which don't change anything are not emitted by messageReceived()
+    void         setPEPCache(PEPCache *cache);
+    PEPCache    *pepCache() const;
+
+    // not owned. with an index incoming messages which are known by their XEP-0359 ids are dropped unparsed
+    void            setMessageIdIndex(MessageIdIndex *index);
+    MessageIdIndex *messageIdIndex() const;
+
     void rosterRequest(bool withGroupsDelimiter = true);
+    // -1 (default) disables batching. otherwise presences are collected for this many msecs (0 is one
+    // event loop turn), applied together and reported by presenceBatch() instead of resourceAvailable(),
+    // resourceUnavailable() and groupChatPresence(). joins, leaves and errors are reported as usual
+    void setPresenceBatching(int msecs);
+    int  presenceBatching() const;
+    // -1 (default) sends the queueMessage() ones right away. otherwise they wait up to this many msecs, see there
+    void setOutgoingCoalescing(int msecs);
+    int  outgoingCoalescing() const;
     void sendMessage(Message &);
+    // see sendToMany() above. a copy per jid through sendMessage() when encrypting, as that is done per recipient
+    void sendMessageToMany(const Message &, const QList<Jid> &recipients);
+    // for a message with nothing but a chat state and/or a delivery receipt. a newer chat state to the same jid
+    // replaces it, and both may go with the next sendMessage() to that jid if it has room for them
+    void queueMessage(const Message &);
     void sendSubscription(const Jid &, const QString &, const QString &nick = QString());
     void setPresence(const Status &);
+    // the children of an available presence with s, caps included. kept for the next presences while neither
+    // s nor the caps change, as the same status usually goes to the server and to every groupchat
+    QByteArray presenceContent(const Status &s);
 
     void          debug(const QString &);
     QString       genUniqueId();
     Task         *rootTask();
     QDomDocument *doc() const;
+    // the document of the stanza being dispatched if it has one of its own, see ClientStream::setBatchDocuments().
+    // a task keeping an element of it for later keeps this too
+    QSharedPointer<QDomDocument> stanzaDocument() const;
+
+    // the timeout in secs of the tasks created from now on, unless they set their own. 0 for none. default 120
+    void setTaskTimeout(int secs);
+    int  taskTimeout() const;
+    // per task class: how many were started, finished, timed out and are still running, then the oldest of
+    // the tasks waiting for an iq reply
+    QString taskReport(int oldest = 10) const;
+
+    // Approximate heap bytes held for this client. Nothing is tracked, the parts are walked when asked, so
+    // this costs nothing unless called and may be called any time from the client's thread
+    struct MemoryUsage {
+        qint64 roster    = 0; // the items and their resources
+        qint64 resources = 0; // of our own account
+        qint64 caps      = 0; // see CapsManager::memoryUsage()
+        qint64 smQueue   = 0; // stanzas waiting for an ack
+        qint64 buffers   = 0; // of the socket, the security layers and the send queues
+        qint64 parser    = 0; // input not parsed yet and output not written yet
+        qint64 jingle    = 0; // buffered by the transports of the Jingle sessions
+
+        inline qint64 total() const { return roster + resources + caps + smQueue + buffers + parser + jingle; }
+    };
+    MemoryUsage memoryUsage() const;
 
     QString  OSName() const;
     QString  OSVersion() const;
@@ -142,6 +224,10 @@ public:
     DiscoItem       makeDiscoResult(const QString &node = QString()) const;
     void            setCapsOptimizationAllowed(bool allowed);
     bool            capsOptimizationAllowed() const;
+    // look up the hosts of contacts and services right after login, so the connections to them start faster
+    void            setNamePrefetchEnabled(bool enabled);
+    bool            namePrefetchEnabled() const;
+    NamePrefetcher *namePrefetcher() const; // e.g. for bookmarked conference services. null if not enabled
 
     void                      setTcpPortReserver(TcpPortReserver *portReserver);
     TcpPortReserver          *tcpPortReserver() const;
@@ -171,6 +257,37 @@ public:
     void    groupChatLeave(const QString &host, const QString &room, const QString &statusStr = QString());
     void    groupChatLeaveAll(const QString &statusStr = QString());
     QString groupChatNick(const QString &host, const QString &room) const;
+    // kept up to date from the presences of the room. nullptr if we are not in it
+    const MUCOccupants *groupChatOccupants(const QString &host, const QString &room) const;
+    // off by default. when on, the last message of every room is remembered, and a join without since or seconds
+    // asks only for the history after it. should the last one seen come again with it, it is dropped
+    void      setGroupChatHistoryTracking(bool enabled);
+    bool      groupChatHistoryTracking() const;
+    QDateTime groupChatLastSeen(const QString &host, const QString &room) const;
+    QString   groupChatLastStanzaId(const QString &host, const QString &room) const; // for a MAM query of the room
+    // e.g. what was saved at the previous run
+    void setGroupChatLastSeen(const QString &host, const QString &room, const QDateTime &ts,
+                              const QString &stanzaId = QString());
+
+    // make-before-break, e.g. on a network change. next is a new stream set up like the current one, likely
+    //   going through the new network. it takes over the session by stream management resumption while the
+    //   current one still works, see ClientStream::takeOver(). streamHandedOver() comes when the client works
+    //   with next, streamHandoverFailed() if it keeps the current one. false if there is nothing to resume
+    bool handoverStream(ClientStream *next);
+    bool isHandingOver() const;
+    // with a factory of such streams, a handover starts by itself when a network interface comes or goes. the
+    //   factory may return nullptr. an empty one stops that
+    void setStreamFactory(std::function<ClientStream *()> factory);
+
+    // paced joins, e.g. for the bookmarks after login. the rooms are joined by priority, higher first and in the
+    //   order queued otherwise, at most groupChatJoinWindow() of them at a time. a room keeps its slot until our
+    //   own presence or an error comes from it, or for 30 secs. false if the room is joined or queued already
+    bool groupChatQueueJoin(const QString &host, const QString &room, const QString &nick, int priority = 0,
+                            const QString &password = QString(), int maxchars = -1, int maxstanzas = -1,
+                            int seconds = -1, const QDateTime &since = QDateTime(), const Status & = Status());
+    void setGroupChatJoinWindow(int rooms); // 3 by default
+    int  groupChatJoinWindow() const;
+    int  groupChatJoinsPending() const; // queued, not sent yet
 
 signals:
     void activated();
@@ -194,6 +311,10 @@ signals:
     void groupChatLeft(const Jid &);
     void groupChatPresence(const Jid &, const Status &);
     void groupChatError(const Jid &, int, const QString &);
+    // the last presence of every jid since the previous batch, in the order they came first
+    void presenceBatch(const QList<QPair<XMPP::Jid, XMPP::Status>> &presences);
+    void streamHandedOver(XMPP::ClientStream *old); // not used anymore, it may be deleted
+    void streamHandoverFailed(XMPP::ClientStream *next);
 
     void incomingJidLink();
 
@@ -228,17 +349,40 @@ private slots:
 public:
     class GroupChat;
 
+protected:
+    void connectNotify(const QMetaMethod &signal) override;
+
 private:
     void cleanup();
+    void setupStream(ClientStream *s);
+    void attachStream(ClientStream *s);
+    void watchInterface(const QString &id);
+    bool isOutgoingXmlObserved() const;
+    void connectStreamXmlSignals();
     void distribute(const QDomElement &);
     void importRoster(const Roster &);
     void importRosterItem(const RosterItem &);
+    void startRosterGet();
+    bool isBatchablePresence(const Jid &, const Status &) const;
+    bool isGroupChatJoinDone(const Jid &, const Status &) const;
+    void groupChatJoinNext();
+    void flushPresenceBatch();
+    void flushOutgoing();
+    void takeOutgoing(Message &);
+    void applyPresence(const Jid &, const Status &);
     void updateSelfPresence(const Jid &, const Status &);
     void updatePresence(LiveRosterItem *, const Jid &, const Status &);
     void handleIncoming(BSConnection *);
 
     void sendAckRequest();
 
+    // task bookkeeping for taskReport()
+    friend class Task;
+    void taskStarted(Task *);
+    void taskWaiting(Task *);
+    void taskDone(Task *, bool timedOut);
+    void taskDestroyed(Task *);
+
     class ClientPrivate;
     ClientPrivate *d;
 };
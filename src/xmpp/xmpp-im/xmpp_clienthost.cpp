@@ -0,0 +1,162 @@
+/*
+ * xmpp_clienthost.cpp - what many clients in one process share
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp_clienthost.h"
+
+#include "xmpp/xmpp-core/timerwheel.h"
+#include "xmpp_client.h"
+#include "xmpp_serverinfomanager.h"
+
+#include <QHash>
+#include <QThread>
+#include <QVector>
+
+using namespace XMPP;
+
+namespace {
+// the services of the server of one client, kept by the host for all the clients of the domain
+class SharedServerInfoStore : public ServerInfoStore {
+public:
+    SharedServerInfoStore(Client *client, QHash<QString, QByteArray> *data) : client_(client), data_(data) { }
+
+protected:
+    void       saveData(const QByteArray &data) override { data_->insert(client_->jid().domain(), data); }
+    QByteArray loadData() override { return data_->value(client_->jid().domain()); }
+
+private:
+    Client                     *client_;
+    QHash<QString, QByteArray> *data_;
+};
+}
+
+class ClientHost::Private {
+public:
+    TimerWheel                              *wheel = nullptr;
+    QNetworkAccessManager                   *qnam  = nullptr;
+    QHash<Client *, SharedServerInfoStore *> clients;
+    QHash<QString, QByteArray>               serverInfo; // by domain
+};
+
+ClientHost::ClientHost(QObject *parent) : QObject(parent), d(new Private)
+{
+    d->wheel = new TimerWheel(TIMERWHEEL_GRANULARITY, this);
+}
+
+ClientHost::~ClientHost()
+{
+    const auto clients = d->clients.keys();
+    for (Client *c : clients)
+        removeClient(c);
+    delete d;
+}
+
+void ClientHost::addClient(Client *client)
+{
+    if (d->clients.contains(client))
+        return;
+    auto store = new SharedServerInfoStore(client, &d->serverInfo);
+    d->clients.insert(client, store);
+    client->serverInfoManager()->setStore(store);
+    if (d->qnam && !client->networkAccessManager())
+        client->setNetworkAccessManager(d->qnam);
+    client->setClientHost(this);
+    connect(client, &QObject::destroyed, this, [this, client]() { delete d->clients.take(client); });
+}
+
+void ClientHost::removeClient(Client *client)
+{
+    auto it = d->clients.find(client);
+    if (it == d->clients.end())
+        return;
+    disconnect(client, &QObject::destroyed, this, nullptr);
+    client->setClientHost(nullptr);
+    client->serverInfoManager()->setStore(nullptr);
+    delete it.value();
+    d->clients.erase(it);
+}
+
+QList<Client *> ClientHost::clients() const { return d->clients.keys(); }
+
+TimerWheel *ClientHost::timerWheel() const { return d->wheel; }
+
+void ClientHost::setNetworkAccessManager(QNetworkAccessManager *qnam) { d->qnam = qnam; }
+
+QNetworkAccessManager *ClientHost::networkAccessManager() const { return d->qnam; }
+
+//----------------------------------------------------------------------------
+// ClientWorkerPool
+//----------------------------------------------------------------------------
+class ClientWorkerPool::Private {
+public:
+    struct Worker {
+        QThread         *thread;
+        QList<Client *> clients;
+    };
+    QVector<Worker> workers;
+};
+
+ClientWorkerPool::ClientWorkerPool(int threads, QObject *parent) : QObject(parent), d(new Private)
+{
+    if (threads <= 0)
+        threads = qMax(1, QThread::idealThreadCount());
+    for (int n = 0; n < threads; ++n) {
+        auto thread = new QThread;
+        thread->setObjectName(QStringLiteral("xmpp-%1").arg(n));
+        thread->start();
+        d->workers.append({ thread, {} });
+    }
+}
+
+ClientWorkerPool::~ClientWorkerPool()
+{
+    for (auto &w : d->workers) {
+        for (Client *c : std::as_const(w.clients)) {
+            disconnect(c, &QObject::destroyed, this, nullptr);
+            QMetaObject::invokeMethod(c, [c]() { delete c; }, Qt::BlockingQueuedConnection);
+        }
+        w.thread->quit();
+    }
+    for (auto &w : d->workers) {
+        w.thread->wait();
+        delete w.thread;
+    }
+    delete d;
+}
+
+int ClientWorkerPool::threadCount() const { return d->workers.size(); }
+
+int ClientWorkerPool::clientCount(int thread) const { return d->workers.value(thread).clients.size(); }
+
+QThread *ClientWorkerPool::assign(Client *client)
+{
+    if (client->parent() || client->thread() != QThread::currentThread())
+        return nullptr;
+
+    int best = 0;
+    for (int n = 1; n < d->workers.size(); ++n) {
+        if (d->workers[n].clients.size() < d->workers[best].clients.size())
+            best = n;
+    }
+    Private::Worker &w = d->workers[best];
+    client->moveToThread(w.thread);
+    w.clients.append(client);
+    // queued to our thread, the lists are touched there only
+    connect(client, &QObject::destroyed, this, [this, client, best]() { d->workers[best].clients.removeOne(client); });
+    return w.thread;
+}
@@ -0,0 +1,88 @@
+/*
+ * xmpp_clienthost.h - what many clients in one process share
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_CLIENTHOST_H
+#define XMPP_CLIENTHOST_H
+
+#include <QList>
+#include <QObject>
+
+class QNetworkAccessManager;
+class QThread;
+
+namespace XMPP {
+class Client;
+class TimerWheel;
+
+/*
+ * For processes running a lot of Client instances. The clients added here keep the keepalives of their
+ * streams on one TimerWheel, use one network access manager, and the ones on the same domain share what
+ * their ServerInfoManager knows about the services of the server, so it's asked once.
+ * Caps (CapsRegistry) and DNS (NameManager) are process wide already.
+ */
+class ClientHost : public QObject {
+    Q_OBJECT
+public:
+    ClientHost(QObject *parent = nullptr);
+    ~ClientHost();
+
+    // until removeClient() or the client is destroyed. both are fine while it is connected
+    void            addClient(Client *client);
+    void            removeClient(Client *client);
+    QList<Client *> clients() const;
+
+    TimerWheel *timerWheel() const;
+
+    // given to the clients added afterwards. not owned
+    void                   setNetworkAccessManager(QNetworkAccessManager *qnam);
+    QNetworkAccessManager *networkAccessManager() const;
+
+private:
+    class Private;
+    Private *d;
+};
+
+/*
+ * Worker threads with an event loop each, to spread many clients over the cores. assign() moves a client,
+ * with everything it owns, to the thread with the fewest clients. From then on the client is used from its
+ * thread only (queued signals, QMetaObject::invokeMethod()), and the stream and connector for it are created
+ * there too. The shared parts (CapsRegistry, NameManager, jid caches, usrsctp) are safe to use from any thread.
+ * A ClientHost is per thread, as its wheel is.
+ */
+class ClientWorkerPool : public QObject {
+    Q_OBJECT
+public:
+    ClientWorkerPool(int threads = 0, QObject *parent = nullptr); // 0 for one per core
+    // the clients left are deleted in their threads, then the threads stop
+    ~ClientWorkerPool();
+
+    int threadCount() const;
+    int clientCount(int thread) const;
+
+    // call from the thread of the client before it connects. it must have no parent. the thread it went to,
+    // null if it couldn't be moved
+    QThread *assign(Client *client);
+
+private:
+    class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // XMPP_CLIENTHOST_H
@@ -0,0 +1,189 @@
+/*
+ * xmpp_discocrawler.cpp - walks a tree of disco items
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp_discocrawler.h"
+
+#include "xmpp_client.h"
+#include "xmpp_discoinfotask.h"
+#include "xmpp_subsets.h"
+#include "xmpp_tasks.h"
+
+#include <QPointer>
+#include <QQueue>
+#include <QSet>
+
+#include <memory>
+
+#define DISCO_CRAWLER_MAX_QUERIES 5
+// items asked at once, if the entity can page them (XEP-0059)
+#define DISCO_CRAWLER_PAGE 100
+
+using namespace XMPP;
+
+class DiscoCrawler::Private {
+public:
+    enum JobKind { ItemsJob, InfoJob };
+
+    struct Job {
+        JobKind                               kind;
+        DiscoItem                             item;
+        int                                   depth;
+        std::shared_ptr<SubsetsClientManager> rsm; // the next page of the items
+    };
+
+    DiscoCrawler     *q;
+    Client           *client;
+    int               maxQueries = DISCO_CRAWLER_MAX_QUERIES;
+    int               maxDepth   = 1;
+    bool              withInfo   = true;
+    bool              active     = false;
+    int               running    = 0;
+    QQueue<Job>       jobs;
+    QSet<QString>     seen;       // jid and node
+    QPointer<QObject> generation; // the tasks of a stopped crawl report to nobody
+
+    Private(DiscoCrawler *q, Client *client) : q(q), client(client) { }
+
+    void run()
+    {
+        while (running < maxQueries && !jobs.isEmpty())
+            startJob(jobs.dequeue());
+        if (!running && jobs.isEmpty() && active) {
+            active = false;
+            emit q->finished();
+        }
+    }
+
+    void startJob(Job job)
+    {
+        ++running;
+        QObject *ctx = generation;
+        if (job.kind == InfoJob) {
+            auto t = new DiscoInfoTask(client->rootTask());
+            t->setAllowCache(job.item.node().isEmpty()); // caps know nothing about nodes
+            t->get(job.item.jid(), job.item.node());
+            QObject::connect(t, &Task::finished, ctx, [this, t, job]() { infoFinished(t, job); });
+            t->go(true);
+            return;
+        }
+
+        if (!job.rsm) {
+            job.rsm = std::make_shared<SubsetsClientManager>();
+            job.rsm->setMax(DISCO_CRAWLER_PAGE);
+            job.rsm->getFirst();
+        }
+        auto t = new JT_DiscoItems(client->rootTask());
+        t->get(job.item.jid(), job.item.node());
+        t->includeSubsetQuery(*job.rsm);
+        QObject::connect(t, &Task::finished, ctx, [this, t, job]() { itemsFinished(t, job); });
+        t->go(true);
+    }
+
+    void infoFinished(DiscoInfoTask *t, const Job &job)
+    {
+        --running;
+        DiscoItem item = job.item;
+        if (t->success()) {
+            item.setIdentities(t->item().identities());
+            item.setFeatures(t->item().features());
+            if (item.name().isEmpty() && !item.identities().isEmpty())
+                item.setName(item.identities().first().name);
+        }
+        found(item, job.depth);
+    }
+
+    void itemsFinished(JT_DiscoItems *t, Job job)
+    {
+        --running;
+        if (t->success()) {
+            QPointer<QObject> alive(generation);
+            const DiscoList  &items = t->items();
+            for (const DiscoItem &item : items) {
+                if (seen.contains(key(item)))
+                    continue;
+                seen.insert(key(item));
+                if (withInfo)
+                    jobs.enqueue({ InfoJob, item, job.depth + 1, nullptr });
+                else
+                    found(item, job.depth + 1);
+                if (!alive)
+                    return; // stopped from a slot
+            }
+            // the same job for the next page, if the entity has more
+            if (!items.isEmpty() && t->extractSubsetInfo(*job.rsm) && job.rsm->isValid() && !job.rsm->isLast()) {
+                job.rsm->getNext();
+                jobs.enqueue(job);
+            }
+        }
+        run();
+    }
+
+    void found(const DiscoItem &item, int depth)
+    {
+        QPointer<QObject> alive(generation);
+        emit q->itemFound(item, depth);
+        if (!alive)
+            return; // stopped or deleted
+        if (depth < maxDepth)
+            jobs.enqueue({ ItemsJob, item, depth, nullptr });
+        if (withInfo)
+            run();
+    }
+
+    static QString key(const DiscoItem &item) { return item.jid().full() + QLatin1Char(' ') + item.node(); }
+};
+
+DiscoCrawler::DiscoCrawler(Client *client, QObject *parent) : QObject(parent), d(new Private(this, client)) { }
+
+DiscoCrawler::~DiscoCrawler()
+{
+    delete d->generation;
+    delete d;
+}
+
+void DiscoCrawler::setMaxQueries(int count) { d->maxQueries = qMax(1, count); }
+
+void DiscoCrawler::setDepth(int depth) { d->maxDepth = qMax(1, depth); }
+
+void DiscoCrawler::setWithInfo(bool withInfo) { d->withInfo = withInfo; }
+
+void DiscoCrawler::start(const Jid &jid, const QString &node)
+{
+    stop();
+    d->generation = new QObject(this);
+    d->active     = true;
+
+    DiscoItem root;
+    root.setJid(jid);
+    root.setNode(node);
+    d->seen.insert(Private::key(root));
+    d->jobs.enqueue({ Private::ItemsJob, root, 0, nullptr });
+    d->run();
+}
+
+void DiscoCrawler::stop()
+{
+    delete d->generation; // the tasks in flight finish on their own
+    d->active  = false;
+    d->running = 0;
+    d->jobs.clear();
+    d->seen.clear();
+}
+
+bool DiscoCrawler::isActive() const { return d->active; }
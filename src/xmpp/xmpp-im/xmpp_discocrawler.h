@@ -0,0 +1,63 @@
+/*
+ * xmpp_discocrawler.h - walks a tree of disco items
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_DISCOCRAWLER_H
+#define XMPP_DISCOCRAWLER_H
+
+#include "xmpp_discoitem.h"
+
+#include <QObject>
+
+namespace XMPP {
+class Client;
+
+/*
+ * Browses a disco tree (XEP-0030) breadth first, e.g. a room directory or the services of a server. The items
+ * of the root are asked, then the info and the items of each of them down to depth levels. At most
+ * setMaxQueries() requests are in flight, long item lists are fetched page by page (XEP-0059) and every
+ * jid/node pair is asked once. Each item is reported as soon as it is complete.
+ */
+class DiscoCrawler : public QObject {
+    Q_OBJECT
+public:
+    DiscoCrawler(Client *client, QObject *parent = nullptr);
+    ~DiscoCrawler();
+
+    void setMaxQueries(int count); // default 5
+    void setDepth(int depth);      // levels below the root. default 1
+    // ask disco#info of every item, the cached caps are used when possible. default true. without it the items
+    // are reported as listed by their parents
+    void setWithInfo(bool withInfo);
+
+    void start(const Jid &jid, const QString &node = QString());
+    void stop();
+    bool isActive() const;
+
+signals:
+    // depth is 1 for the items of the root
+    void itemFound(const XMPP::DiscoItem &item, int depth);
+    void finished();
+
+private:
+    class Private;
+    Private *d;
+};
+} // namespace XMPP
+
+#endif // XMPP_DISCOCRAWLER_H
@@ -20,13 +20,35 @@
 #ifndef PSI_XMPP_ENCRYPTIONHANDLER_H
 #define PSI_XMPP_ENCRYPTIONHANDLER_H
 
+#include <functional>
+
 class QDomElement;
 
 namespace XMPP {
 class EncryptionHandler {
 public:
+    // called with the result of an asynchronous decryption. processed and a null element drops the message,
+    // not processed delivers it as it came
+    using DecryptCallback = std::function<void(bool processed, const QDomElement &result)>;
+
+    // true if the element was processed. it's nulled to drop the message
     virtual bool decryptMessageElement(QDomElement &) = 0;
+    // nulling the element means the handler sends it on its own, e.g. once the encryption is done
     virtual bool encryptMessageElement(QDomElement &) = 0;
+
+    /*
+     * Takes an incoming message for decryption off the receive path, e.g. to a worker pool, so the stream goes
+     * on meanwhile. Returns false if it doesn't, then decryptMessageElement() is called. Otherwise done must be
+     * called exactly once, from any thread. The element itself shouldn't be touched outside the thread of the
+     * client. Messages of the same sender are delivered in the order they came, whichever way they were
+     * decrypted.
+     */
+    virtual bool decryptMessageElementAsync(const QDomElement &element, const DecryptCallback &done)
+    {
+        (void)element;
+        (void)done;
+        return false;
+    }
 };
 } // namespace XMPP
 
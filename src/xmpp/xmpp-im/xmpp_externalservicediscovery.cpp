@@ -24,6 +24,11 @@
 #include "xmpp_serverinfomanager.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QTimer>
+
+// restricted credentials are asked again this long before they expire
+#define EXTDISCO_CREDS_REFRESH_AHEAD std::chrono::minutes(2)
+
 namespace XMPP {
 
 JT_ExternalServiceDiscovery::JT_ExternalServiceDiscovery(Task *parent) : Task(parent) { }
@@ -201,6 +206,14 @@ bool ExternalService::needsNewCreds(std::chrono::minutes minTtl) const
 
 ExternalServiceDiscovery::ExternalServiceDiscovery(Client *client) : client_(client)
 {
+    refreshTimer_ = new QTimer(this);
+    refreshTimer_->setSingleShot(true);
+    connect(refreshTimer_, &QTimer::timeout, this, &ExternalServiceDiscovery::refreshCredentials);
+    connect(client, &Client::disconnected, this, [this]() {
+        refreshTimer_->stop();
+        refreshIds_.clear();
+    });
+
     JT_PushExternalService *push = new JT_PushExternalService(client->rootTask());
     connect(push, &JT_PushExternalService::received, this, [this](const ExternalServiceList &services) {
         ExternalServiceList deleted;
@@ -286,7 +299,7 @@ void ExternalServiceDiscovery::services(QObject *ctx, ServicesCallback &&callbac
         if (types.isEmpty() || types.size() > 1) {
             currentTask = new JT_ExternalServiceDiscovery(client_->rootTask());
             connect(currentTask, &Task::finished, ctx, [this, types, cb = std::move(callback)]() {
-                services_   = currentTask->services();
+                setServices(currentTask->services());
                 currentTask = nullptr; // it will self-delete anyway
                 cb(cachedServices(types));
             });
@@ -359,18 +372,96 @@ void ExternalServiceDiscovery::credentials(QObject *ctx, ServicesCallback &&call
                 cache.password = service->password;
                 cache.expires  = service->expires;
                 ret << *cachedServiceIt;
+                if (cache.restricted)
+                    refreshIds_.insert({ cache.host, cache.type, cache.port });
             } else {
                 qDebug("credentials request returned creds not previously cached service. adding to "
                        "the result as is.");
                 ret << service;
             }
         }
+        scheduleRefresh();
         cb(ret);
     });
     task->getCredentials(ids);
     task->go(true);
 }
 
+ExternalServiceList ExternalServiceDiscovery::cachedCredentials(const QSet<ExternalServiceId> &ids,
+                                                                std::chrono::minutes           minTtl)
+{
+    ExternalServiceList ret;
+    for (auto const &id : ids) {
+        auto cachedServiceIt = findCachedService(id);
+        if (cachedServiceIt == services_.end())
+            return {};
+        auto const &s = **cachedServiceIt;
+        if (s.username.isEmpty() || s.password.isEmpty()
+            || !(s.expires.isForever() || s.expires.remainingTimeAsDuration() > minTtl))
+            return {};
+        ret << *cachedServiceIt;
+    }
+    return ret;
+}
+
+void ExternalServiceDiscovery::setServices(const ExternalServiceList &services)
+{
+    // a new list doesn't have the restricted credentials, keep the ones we have
+    for (auto const &service : services) {
+        if (!service->restricted || !service->username.isEmpty())
+            continue;
+        auto cachedServiceIt = findCachedService({ service->host, service->type, service->port });
+        if (cachedServiceIt != services_.end() && !(*cachedServiceIt)->password.isEmpty()) {
+            service->username = (*cachedServiceIt)->username;
+            service->password = (*cachedServiceIt)->password;
+            service->expires  = (*cachedServiceIt)->expires;
+        }
+    }
+    services_ = services;
+    scheduleRefresh();
+}
+
+void ExternalServiceDiscovery::scheduleRefresh()
+{
+    using namespace std::chrono;
+    milliseconds next = milliseconds::max();
+    for (auto it = refreshIds_.begin(); it != refreshIds_.end();) {
+        auto cachedServiceIt = findCachedService(*it);
+        if (cachedServiceIt == services_.end() || (*cachedServiceIt)->password.isEmpty()
+            || (*cachedServiceIt)->expires.isForever()) {
+            it = refreshIds_.erase(it);
+            continue;
+        }
+        auto left = duration_cast<milliseconds>((*cachedServiceIt)->expires.remainingTimeAsDuration());
+        if (left <= EXTDISCO_CREDS_REFRESH_AHEAD) {
+            it = refreshIds_.erase(it); // the server doesn't give them for longer. ask when needed
+            continue;
+        }
+        next = std::min(next, left - duration_cast<milliseconds>(EXTDISCO_CREDS_REFRESH_AHEAD));
+        ++it;
+    }
+    if (next == milliseconds::max())
+        refreshTimer_->stop();
+    else
+        refreshTimer_->start(next);
+}
+
+void ExternalServiceDiscovery::refreshCredentials()
+{
+    QSet<ExternalServiceId> due;
+    auto                    soon = EXTDISCO_CREDS_REFRESH_AHEAD + std::chrono::minutes(1);
+    for (auto const &id : std::as_const(refreshIds_)) {
+        auto cachedServiceIt = findCachedService(id);
+        if (cachedServiceIt != services_.end() && (*cachedServiceIt)->expires.remainingTimeAsDuration() <= soon)
+            due.insert(id);
+    }
+    if (due.isEmpty()) {
+        scheduleRefresh();
+        return;
+    }
+    credentials(this, [](const ExternalServiceList &) { }, due, std::chrono::duration_cast<std::chrono::minutes>(soon));
+}
+
 ExternalServiceList::iterator ExternalServiceDiscovery::findCachedService(const ExternalServiceId &id)
 {
     return std::find_if(services_.begin(), services_.end(), [&id](auto const &s) {
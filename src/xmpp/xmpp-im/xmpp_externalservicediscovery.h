@@ -31,6 +31,8 @@
 #include <QSet>
 #include <QVector>
 
+class QTimer;
+
 #include <chrono>
 #include <functional>
 #include <memory>
@@ -128,14 +130,14 @@ public:
      * @param ids           - identifier of services
      * @param minTtl        - if service expires in less than minTtl it will be re-requested
      *
-     * The credentials won't be cached since it's assumed if crdentials are returned with services request then
-     * the creds are constant values until the service is expired.
-     * Otherwise `restricted` flag has to be set and the credentials are requested when they are really needed.
-     * Most likely with `restricted` flag those are going to be temporal credentials. Even so the caller may cache them
-     * on its own risk.
+     * Credentials of `restricted` services are cached until they expire. Once asked for, they are refreshed in
+     * the background shortly before that, so the callback is usually called right away.
      */
     void credentials(QObject *ctx, ServicesCallback &&callback, const QSet<ExternalServiceId> &ids,
                      std::chrono::minutes minTtl = std::chrono::minutes(1));
+    // what credentials() would return without asking the server. empty if some are missing or expire too soon
+    ExternalServiceList cachedCredentials(const QSet<ExternalServiceId> &ids,
+                                          std::chrono::minutes           minTtl = std::chrono::minutes(1));
 signals:
     // server push signals only
     void serviceAdded(const ExternalServiceList &);
@@ -144,10 +146,15 @@ signals:
 
 private:
     ExternalServiceList::iterator findCachedService(const ExternalServiceId &id = {});
+    void                          setServices(const ExternalServiceList &services);
+    void                          scheduleRefresh();
+    void                          refreshCredentials();
 
     Client                               *client_;
     QPointer<JT_ExternalServiceDiscovery> currentTask = nullptr; // for all services (no type)
     ExternalServiceList                   services_;
+    QSet<ExternalServiceId>               refreshIds_; // restricted services whose credentials were asked for
+    QTimer                               *refreshTimer_ = nullptr;
 };
 
 } // namespace XMPP
@@ -19,218 +19,263 @@
 
 #include "xmpp_features.h"
 
-#include "jingle-ft.h"
-#include "jingle.h"
-
 #include <QCoreApplication>
+#include <QHash>
 #include <QMap>
 #include <QString>
 #include <QStringList>
+#include <QtAlgorithms>
 
 using namespace XMPP;
 
-Features::Features() { }
-
-Features::Features(const QStringList &l) { setList(l); }
-
-Features::Features(const QSet<QString> &s) { setList(s); }
+#define FID_MULTICAST "http://jabber.org/protocol/address"
+#define FID_AHCOMMAND "http://jabber.org/protocol/commands"
+#define FID_REGISTER "jabber:iq:register"
+#define FID_SEARCH "jabber:iq:search"
+#define FID_GROUPCHAT "http://jabber.org/protocol/muc"
+#define FID_VOICE "http://www.google.com/xmpp/protocol/voice/v1"
+#define FID_GATEWAY "jabber:iq:gateway"
+#define FID_QUERYVERSION "jabber:iq:version"
+#define FID_DISCO "http://jabber.org/protocol/disco"
+#define FID_CHATSTATE "http://jabber.org/protocol/chatstates"
+#define FID_VCARD "vcard-temp"
+#define FID_VCARD4 "urn:ietf:params:xml:ns:vcard-4.0"
+#define FID_MESSAGECARBONS "urn:xmpp:carbons:2"
+#define FID_JINGLEICEUDP "urn:xmpp:jingle:transports:ice-udp:1"
+#define FID_JINGLEICE "urn:xmpp:jingle:transports:ice:0"
+#define NS_CAPS "http://jabber.org/protocol/caps"
+#define NS_CAPS_OPTIMIZE "http://jabber.org/protocol/caps#optimize"
+#define NS_DIRECT_MUC_INVITE "jabber:x:conference"
+#define FID_AVATAR_TO_VCARD_CONVERSION "urn:xmpp:pep-vcard-conversion:0"
 
-Features::Features(const QString &str)
-{
-    QSet<QString> l;
-    l << str;
+// custom Psi actions
+#define FID_ADD "psi:add"
 
-    setList(l);
-}
+namespace {
+// The namespaces asked for on hot paths get a bit in Features instead of a place in its string set.
+// The order is the one of knownFeatures.
+enum KnownFeature {
+    KF_Multicast,
+    KF_AHCommand,
+    KF_Register,
+    KF_Search,
+    KF_Groupchat,
+    KF_Voice,
+    KF_Gateway,
+    KF_QueryVersion,
+    KF_Disco,
+    KF_DiscoInfo,
+    KF_DiscoItems,
+    KF_ChatState,
+    KF_VCard,
+    KF_VCard4,
+    KF_MessageCarbons,
+    KF_JingleFT,
+    KF_JingleIceUdp,
+    KF_JingleIce,
+    KF_Caps,
+    KF_CapsOptimize,
+    KF_DirectMucInvite,
+    KF_AvatarConversion,
+    KF_Add
+};
 
-Features::~Features() { }
+const char *const knownFeatures[] = {
+    FID_MULTICAST,
+    FID_AHCOMMAND,
+    FID_REGISTER,
+    FID_SEARCH,
+    FID_GROUPCHAT,
+    FID_VOICE,
+    FID_GATEWAY,
+    FID_QUERYVERSION,
+    FID_DISCO,
+    "http://jabber.org/protocol/disco#info",
+    "http://jabber.org/protocol/disco#items",
+    FID_CHATSTATE,
+    FID_VCARD,
+    FID_VCARD4,
+    FID_MESSAGECARBONS,
+    "urn:xmpp:jingle:apps:file-transfer:5", // Jingle::FileTransfer::NS, which may not be constructed yet
+    FID_JINGLEICEUDP,
+    FID_JINGLEICE,
+    NS_CAPS,
+    NS_CAPS_OPTIMIZE,
+    NS_DIRECT_MUC_INVITE,
+    FID_AVATAR_TO_VCARD_CONVERSION,
+    FID_ADD,
+    // no has*() for these, but they are looked up for every file transfer (Hash::fastestHash)
+    "urn:xmpp:hash-function-text-names:blake2b-512",
+    "urn:xmpp:hash-function-text-names:blake2b-256",
+    "urn:xmpp:hash-function-text-names:sha-1",
+    "urn:xmpp:hash-function-text-names:sha-512",
+    "urn:xmpp:hash-function-text-names:sha-256",
+    "urn:xmpp:hash-function-text-names:sha3-512",
+    "urn:xmpp:hash-function-text-names:sha3-256",
+    // and these are common enough to be worth a bit
+    "urn:xmpp:receipts",
+    "urn:xmpp:chat-markers:0",
+    "urn:xmpp:message-correct:0",
+    "urn:xmpp:jingle:1",
+    "urn:xmpp:jingle:apps:rtp:1",
+    "urn:xmpp:jingle:apps:rtp:audio",
+    "urn:xmpp:jingle:apps:rtp:video",
+    "urn:xmpp:jingle:transports:s5b:1",
+    "urn:xmpp:jingle:transports:ibb:1",
+    "urn:xmpp:bob",
+    "urn:xmpp:ping",
+    "urn:xmpp:time",
+    "urn:xmpp:avatar:metadata+notify",
+    "http://jabber.org/protocol/nick+notify",
+    "http://jabber.org/protocol/mood+notify",
+    "http://jabber.org/protocol/tune+notify",
+    "http://jabber.org/protocol/activity+notify",
+    "http://jabber.org/protocol/geoloc+notify",
+    "http://jabber.org/protocol/xhtml-im",
+    "http://jabber.org/protocol/bytestreams",
+    "http://jabber.org/protocol/ibb",
+    "http://jabber.org/protocol/si",
+    "http://jabber.org/protocol/si/profile/file-transfer",
+    "http://jabber.org/protocol/muc#user",
+    "jabber:x:data",
+    "eu.siacs.conversations.axolotl.devicelist+notify",
+};
+static_assert(sizeof(knownFeatures) / sizeof(knownFeatures[0]) <= 64, "Features has 64 bits");
 
-QStringList Features::list() const
+const QHash<QString, int> &knownFeatureIds()
 {
-#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
-    return QStringList(_list.begin(), _list.end());
-#else
-    return _list.toList();
-#endif
+    static const QHash<QString, int> ids = []() {
+        QHash<QString, int> h;
+        for (int n = 0; n < int(sizeof(knownFeatures) / sizeof(knownFeatures[0])); ++n)
+            h.insert(QLatin1String(knownFeatures[n]), n);
+        return h;
+    }();
+    return ids;
 }
 
-void Features::setList(const QStringList &l)
-{
-#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
-    _list = QSet<QString>(l.begin(), l.end());
-#else
-    _list = QSet<QString>::fromList(l);
-#endif
+inline quint64 bit(int id) { return quint64(1) << id; }
 }
 
-void Features::setList(const QSet<QString> &l) { _list = l; }
+Features::Features() { }
 
-void Features::addFeature(const QString &s) { _list += s; }
+Features::Features(const QStringList &l) { setList(l); }
 
-bool Features::test(const QStringList &ns) const
-{
-#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
-    auto ss = QSet<QString>(ns.begin(), ns.end());
-#else
-    auto ss = QSet<QString>::fromList(ns);
-#endif
-    return _list.contains(ss);
-}
+Features::Features(const QSet<QString> &s) { setList(s); }
 
-bool Features::test(const QSet<QString> &ns) const { return _list.contains(ns); }
+Features::Features(const QString &str) { addFeature(str); }
 
-bool Features::test(const QString &ns) const { return _list.contains(ns); }
+Features::~Features() { }
 
-#define FID_MULTICAST "http://jabber.org/protocol/address"
-bool Features::hasMulticast() const
+QStringList Features::list() const
 {
-    QSet<QString> ns;
-    ns << FID_MULTICAST;
-
-    return test(ns);
+    QStringList l;
+    l.reserve(count());
+    for (int n = 0; n < 64; ++n) {
+        if (_bits & bit(n))
+            l += QLatin1String(knownFeatures[n]);
+    }
+    for (const QString &s : _list)
+        l += s;
+    return l;
 }
 
-#define FID_AHCOMMAND "http://jabber.org/protocol/commands"
-bool Features::hasCommand() const
+void Features::setList(const QStringList &l)
 {
-    QSet<QString> ns;
-    ns << FID_AHCOMMAND;
-
-    return test(ns);
+    _bits = 0;
+    _list.clear();
+    for (const QString &s : l)
+        addFeature(s);
 }
 
-#define FID_REGISTER "jabber:iq:register"
-bool Features::hasRegister() const
+void Features::setList(const QSet<QString> &l)
 {
-    QSet<QString> ns;
-    ns << FID_REGISTER;
-
-    return test(ns);
+    _bits = 0;
+    _list.clear();
+    for (const QString &s : l)
+        addFeature(s);
 }
 
-#define FID_SEARCH "jabber:iq:search"
-bool Features::hasSearch() const
+void Features::addFeature(const QString &s)
 {
-    QSet<QString> ns;
-    ns << FID_SEARCH;
-
-    return test(ns);
+    int id = internedId(s);
+    if (id >= 0)
+        _bits |= bit(id);
+    else
+        _list += s;
 }
 
-#define FID_GROUPCHAT "http://jabber.org/protocol/muc"
-bool Features::hasGroupchat() const
-{
-    QSet<QString> ns;
-    ns << FID_GROUPCHAT;
+int Features::count() const { return int(qPopulationCount(_bits)) + int(_list.size()); }
 
-    return test(ns);
-}
+int Features::internedId(const QString &feature) { return knownFeatureIds().value(feature, -1); }
 
-#define FID_VOICE "http://www.google.com/xmpp/protocol/voice/v1"
-bool Features::hasVoice() const
+bool Features::test(const QStringList &ns) const
 {
-    QSet<QString> ns;
-    ns << FID_VOICE;
-
-    return test(ns);
+    for (const QString &s : ns) {
+        if (!test(s))
+            return false;
+    }
+    return true;
 }
 
-#define FID_GATEWAY "jabber:iq:gateway"
-bool Features::hasGateway() const
+bool Features::test(const QSet<QString> &ns) const
 {
-    QSet<QString> ns;
-    ns << FID_GATEWAY;
-
-    return test(ns);
+    for (const QString &s : ns) {
+        if (!test(s))
+            return false;
+    }
+    return true;
 }
 
-#define FID_QUERYVERSION "jabber:iq:version"
-bool Features::hasVersion() const
+bool Features::test(const QString &ns) const
 {
-    QSet<QString> ns;
-    ns << FID_QUERYVERSION;
-
-    return test(ns);
+    int id = internedId(ns);
+    return id >= 0 ? testInterned(id) : _list.contains(ns);
 }
 
-#define FID_DISCO "http://jabber.org/protocol/disco"
-bool Features::hasDisco() const
-{
-    QSet<QString> ns;
-    ns << FID_DISCO;
-    ns << "http://jabber.org/protocol/disco#info";
-    ns << "http://jabber.org/protocol/disco#items";
+bool Features::hasMulticast() const { return testInterned(KF_Multicast); }
 
-    return test(ns);
-}
+bool Features::hasCommand() const { return testInterned(KF_AHCommand); }
 
-#define FID_CHATSTATE "http://jabber.org/protocol/chatstates"
-bool Features::hasChatState() const
-{
-    QSet<QString> ns;
-    ns << FID_CHATSTATE;
+bool Features::hasRegister() const { return testInterned(KF_Register); }
 
-    return test(ns);
-}
+bool Features::hasSearch() const { return testInterned(KF_Search); }
 
-#define FID_VCARD "vcard-temp"
-bool Features::hasVCard() const
-{
-    QSet<QString> ns;
-    ns << FID_VCARD;
+bool Features::hasGroupchat() const { return testInterned(KF_Groupchat); }
 
-    return test(ns);
-}
+bool Features::hasVoice() const { return testInterned(KF_Voice); }
 
-#define FID_VCARD4 "urn:ietf:params:xml:ns:vcard-4.0"
-bool Features::hasVCard4() const
-{
-    QSet<QString> ns;
-    ns << FID_VCARD4;
+bool Features::hasGateway() const { return testInterned(KF_Gateway); }
 
-    return test(ns);
-}
+bool Features::hasVersion() const { return testInterned(KF_QueryVersion); }
 
-#define FID_MESSAGECARBONS "urn:xmpp:carbons:2"
-bool Features::hasMessageCarbons() const
+bool Features::hasDisco() const
 {
-    QStringList ns;
-    ns << FID_MESSAGECARBONS;
-
-    return test(ns);
+    const quint64 mask = bit(KF_Disco) | bit(KF_DiscoInfo) | bit(KF_DiscoItems);
+    return (_bits & mask) == mask;
 }
 
-bool Features::hasJingleFT() const
-{
-    QStringList ns;
-    ns << Jingle::FileTransfer::NS;
+bool Features::hasChatState() const { return testInterned(KF_ChatState); }
 
-    return test(ns);
-}
+bool Features::hasVCard() const { return testInterned(KF_VCard); }
 
-#define FID_JINGLEICEUDP "urn:xmpp:jingle:transports:ice-udp:1"
-bool Features::hasJingleIceUdp() const { return test(QStringList() << QLatin1String(FID_JINGLEICEUDP)); }
+bool Features::hasVCard4() const { return testInterned(KF_VCard4); }
 
-#define FID_JINGLEICE "urn:xmpp:jingle:transports:ice:0"
-bool Features::hasJingleIce() const { return test(QStringList() << QLatin1String(FID_JINGLEICE)); }
+bool Features::hasMessageCarbons() const { return testInterned(KF_MessageCarbons); }
 
-#define NS_CAPS "http://jabber.org/protocol/caps"
-bool Features::hasCaps() const { return test(QStringList() << QLatin1String(NS_CAPS)); }
+bool Features::hasJingleFT() const { return testInterned(KF_JingleFT); }
 
-#define NS_CAPS_OPTIMIZE "http://jabber.org/protocol/caps#optimize"
-bool Features::hasCapsOptimize() const { return test(QStringList() << QLatin1String(NS_CAPS_OPTIMIZE)); }
+bool Features::hasJingleIceUdp() const { return testInterned(KF_JingleIceUdp); }
 
-#define NS_DIRECT_MUC_INVITE "jabber:x:conference"
-bool Features::hasDirectMucInvite() const { return test(QStringList() << QLatin1String(NS_DIRECT_MUC_INVITE)); }
+bool Features::hasJingleIce() const { return testInterned(KF_JingleIce); }
 
-#define FID_AVATAR_TO_VCARD_CONVERSION "urn:xmpp:pep-vcard-conversion:0"
-bool Features::hasAvatarConversion() const
-{
-    return test(QStringList() << QLatin1String(FID_AVATAR_TO_VCARD_CONVERSION));
-}
+bool Features::hasCaps() const { return testInterned(KF_Caps); }
+
+bool Features::hasCapsOptimize() const { return testInterned(KF_CapsOptimize); }
+
+bool Features::hasDirectMucInvite() const { return testInterned(KF_DirectMucInvite); }
+
+bool Features::hasAvatarConversion() const { return testInterned(KF_AvatarConversion); }
 
-// custom Psi actions
-#define FID_ADD "psi:add"
 
 class Features::FeatureName : public QObject {
     Q_OBJECT
@@ -281,7 +326,7 @@ static Features::FeatureName *featureName = nullptr;
 
 long Features::id() const
 {
-    if (_list.count() > 1)
+    if (count() > 1)
         return FID_Invalid;
     else if (hasRegister())
         return FID_Register;
@@ -297,7 +342,7 @@ long Features::id() const
         return FID_VCard;
     else if (hasCommand())
         return FID_AHCommand;
-    else if (test(QStringList(FID_ADD)))
+    else if (testInterned(KF_Add))
         return FID_Add;
     else if (hasVersion())
         return FID_QueryVersion;
@@ -321,7 +366,7 @@ QString Features::feature(long id)
 
 Features &Features::operator<<(const QString &feature)
 {
-    _list << feature;
+    addFeature(feature);
     return *this;
 }
 
@@ -40,7 +40,8 @@ public:
     void        addFeature(const QString &);
 
     // features
-    inline bool isEmpty() const { return _list.isEmpty(); }
+    inline bool isEmpty() const { return !_bits && _list.isEmpty(); }
+    int         count() const;
 
     bool hasRegister() const;
     bool hasSearch() const;
@@ -98,6 +99,11 @@ public:
     bool        test(const QStringList &) const;
     bool        test(const QSet<QString> &) const;
 
+    // the common namespaces are bits rather than strings. a hot path may look the id up once and then
+    // just test the bit. -1 if the namespace doesn't have one
+    static int  internedId(const QString &feature);
+    inline bool testInterned(int id) const { return id >= 0 && (_bits >> id) & 1; }
+
     QString        name() const;
     static QString name(long id);
     static QString name(const QString &feature);
@@ -107,9 +113,10 @@ public:
     static QString feature(long id);
 
     Features   &operator<<(const QString &feature);
-    inline bool operator==(const Features &other) const { return _list == other._list; }
+    inline bool operator==(const Features &other) const { return _bits == other._bits && _list == other._list; }
     Features   &operator+=(const Features &other)
     {
+        _bits |= other._bits;
         _list += other._list;
         return *this;
     }
@@ -117,7 +124,8 @@ public:
     class FeatureName;
 
 private:
-    QSet<QString> _list;
+    quint64       _bits = 0; // see internedId()
+    QSet<QString> _list;     // all the others
 };
 } // namespace XMPP
 
@@ -22,12 +22,27 @@
 #include "xmpp_features.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QCache>
 #include <QCryptographicHash>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QFileInfo>
+#include <QMutex>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
 #include <qca.h>
 
+#include <algorithm>
 #include <array>
+#include <limits>
+#include <functional>
 #include <variant>
+#include <vector>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
 
 namespace XMPP {
 
@@ -42,7 +57,7 @@ struct HashDesc {
     const char *const *synonims = nullptr;
 };
 
-// hash types in priority order mostly by speed
+// hash types in priority order mostly by speed. fastestHash() measures it instead, see speedOrder()
 static const std::array hashTypes {
     HashDesc { "blake2b-512", Hash::Type::Blake2b512 },
     HashDesc { "blake2b-256", Hash::Type::Blake2b256 },
@@ -138,7 +153,7 @@ Hash::Hash(const QDomElement &el)
     QString algo = el.attribute(QLatin1String("algo"));
     v_type       = parseType(QStringView { algo });
     if (v_type != Unknown && el.tagName() == QLatin1String("hash")) {
-        v_data = QByteArray::fromBase64(el.text().toLatin1());
+        v_data = XMLHelper::fromBase64(el.text());
         if (v_data.isEmpty()) {
             v_type = Type::Unknown;
         }
@@ -260,7 +275,7 @@ QDomElement Hash::toXml(QDomDocument *doc) const
         auto el = doc->createElementNS(HASH_NS, QLatin1String(v_data.isEmpty() ? "hash-used" : "hash"));
         el.setAttribute(QLatin1String("algo"), stype);
         if (!v_data.isEmpty()) {
-            XMLHelper::setTagText(el, v_data.toBase64());
+            XMLHelper::setTagText(el, XMLHelper::toBase64(v_data));
         }
         return el;
     }
@@ -293,11 +308,8 @@ Hash Hash::from(XMPP::Hash::Type t, QIODevice *dev)
 
 Hash Hash::from(Hash::Type t, const QFileInfo &file)
 {
-    if (file.isReadable()) {
-        QFile f(file.filePath());
-        f.open(QIODevice::ReadOnly);
-        return from(t, &f);
-    }
+    if (file.isReadable())
+        return FileHashJob::compute(file.filePath(), { t }).value(0);
     return Hash();
 }
 
@@ -317,12 +329,52 @@ Hash Hash::from(const QStringView &str)
     return hash;
 }
 
+// bytes hashed with every type to rank them for fastestHash()
+#define HASH_CALIBRATION_SIZE (128 * 1024)
+
+// indices into hashTypes, the fastest on this machine first. the order of hashTypes is only a guess, e.g. sha-256
+// with the SHA extensions of the CPU beats the portable BLAKE2b code. types we can't compute go last, and so does
+// sha-1 since XEP-0300 says it SHOULD NOT be used
+static const std::array<std::size_t, hashTypes.size()> &speedOrder()
+{
+    static const auto order = []() {
+        std::array<std::size_t, hashTypes.size()> a;
+        std::array<qint64, hashTypes.size()>      nsecs;
+        const QByteArray                          data(HASH_CALIBRATION_SIZE, 'x');
+        for (std::size_t n = 0; n < hashTypes.size(); ++n) {
+            a[n]     = n;
+            nsecs[n] = std::numeric_limits<qint64>::max();
+            if (hashTypes[n].hashType == Hash::Type::Sha1)
+                continue;
+            // the better of two runs, the first one may pay for loading a QCA provider
+            for (int run = 0; run < 2; ++run) {
+                Hash          h(hashTypes[n].hashType);
+                QElapsedTimer timer;
+                timer.start();
+                if (!h.compute(data))
+                    break;
+                nsecs[n] = qMin(nsecs[n], timer.nsecsElapsed());
+            }
+        }
+        std::stable_sort(a.begin(), a.end(), [&nsecs](std::size_t x, std::size_t y) { return nsecs[x] < nsecs[y]; });
+        return a;
+    }();
+    return order;
+}
+
 Hash Hash::fastestHash(const Features &features)
 {
-    for (auto const &h : hashTypes) {
-        auto feature = QString(QLatin1String("urn:xmpp:hash-function-text-names:")) + QLatin1String(h.text);
-        if (features.test(feature)) {
-            return Hash(h.hashType);
+    // all of them have a bit, see xmpp_features.cpp
+    static const auto ids = []() {
+        std::array<int, hashTypes.size()> a;
+        for (std::size_t n = 0; n < hashTypes.size(); ++n)
+            a[n] = Features::internedId(QLatin1String("urn:xmpp:hash-function-text-names:")
+                                        + QLatin1String(hashTypes[n].text));
+        return a;
+    }();
+    for (auto n : speedOrder()) {
+        if (features.testInterned(ids[n])) {
+            return Hash(hashTypes[n].hashType);
         }
     }
     return {};
@@ -404,4 +456,280 @@ Hash StreamHash::final()
 
 void StreamHash::restart() { d.reset(new StreamHashPrivate(d->type)); }
 
+QByteArray StreamHash::saveState() const
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (auto blake = std::get_if<Blake2Hash>(&d->hasher))
+        return blake->saveState();
+#endif
+    return QByteArray();
+}
+
+bool StreamHash::restoreState(const QByteArray &state)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (auto blake = std::get_if<Blake2Hash>(&d->hasher))
+        return blake->restoreState(state);
+#else
+    Q_UNUSED(state)
+#endif
+    return false;
+}
+
+//----------------------------------------------------------------------------
+// FileHashJob
+//----------------------------------------------------------------------------
+// how much of the file is mapped at once. keeps the address space usage sane on 32 bits
+#define HASH_MAP_WINDOW (64 * 1024 * 1024)
+// how much is fed to the hashers between checks for cancellation
+#define HASH_CHUNK (1024 * 1024)
+
+// hashes one window with one of the algorithms after the first
+class HashRunnable : public QRunnable {
+public:
+    HashRunnable(std::function<void()> &&fn) : fn(std::move(fn)) { }
+    void run() override { fn(); }
+
+private:
+    std::function<void()> fn;
+};
+
+// a pool of our own, the jobs waiting for these workers run on the global one
+static QThreadPool *hashPool()
+{
+    static QThreadPool pool;
+    return &pool;
+}
+
+class FileHashCache {
+public:
+    struct Entry {
+        qint64      size;
+        QDateTime   mtime;
+        QList<Hash> hashes;
+    };
+
+    static QList<Hash> lookup(const QFileInfo &fi, const QList<Hash::Type> &types)
+    {
+        auto        &c = instance();
+        QMutexLocker locker(&c.mutex);
+        Entry       *e = c.cache.object(fi.absoluteFilePath());
+        if (!e || e->size != fi.size() || e->mtime != fi.lastModified())
+            return {};
+        QList<Hash> ret;
+        for (auto t : types) {
+            auto it = std::find_if(e->hashes.cbegin(), e->hashes.cend(), [t](const Hash &h) { return h.type() == t; });
+            if (it == e->hashes.cend())
+                return {};
+            ret.append(*it);
+        }
+        return ret;
+    }
+
+    static void store(const QFileInfo &fi, const QList<Hash> &hashes)
+    {
+        auto        &c = instance();
+        QMutexLocker locker(&c.mutex);
+        Entry       *e = c.cache.object(fi.absoluteFilePath());
+        if (!e || e->size != fi.size() || e->mtime != fi.lastModified()) {
+            e = new Entry { fi.size(), fi.lastModified(), hashes };
+            c.cache.insert(fi.absoluteFilePath(), e);
+            return;
+        }
+        for (auto const &h : hashes) {
+            auto it = std::find_if(e->hashes.begin(), e->hashes.end(),
+                                   [&h](const Hash &other) { return h.type() == other.type(); });
+            if (it == e->hashes.end())
+                e->hashes.append(h);
+            else
+                *it = h;
+        }
+    }
+
+private:
+    QMutex                 mutex;
+    QCache<QString, Entry> cache { 256 };
+
+    static FileHashCache &instance()
+    {
+        static FileHashCache c;
+        return c;
+    }
+};
+
+class FileHashJob::Private {
+public:
+    QString           path;
+    QList<Hash::Type> types;
+    QList<Hash>       result;
+    bool              started  = false;
+    bool              finished = false;
+    std::atomic_bool  canceled { false };
+    QMutex            mutex; // guards q and result while the worker is running
+    FileHashJob      *q = nullptr;
+};
+
+FileHashJob::FileHashJob(const QString &path, const QList<Hash::Type> &types, QObject *parent) :
+    QObject(parent), d(std::make_shared<Private>())
+{
+    d->path  = path;
+    d->types = types;
+    d->q     = this;
+}
+
+FileHashJob::~FileHashJob()
+{
+    d->canceled = true;
+    QMutexLocker locker(&d->mutex);
+    d->q = nullptr;
+}
+
+void FileHashJob::start()
+{
+    if (d->started)
+        return;
+    d->started = true;
+
+    class Runnable : public QRunnable {
+    public:
+        std::shared_ptr<FileHashJob::Private> d;
+
+        void run() override
+        {
+            auto         hashes = FileHashJob::compute(d->path, d->types, &d->canceled);
+            QMutexLocker locker(&d->mutex);
+            if (!d->q)
+                return; // job was deleted meanwhile
+            d->result = hashes;
+            // posted events of a deleted object are discarded, so the job pointer is safe to use in there
+            auto job = d->q;
+            QMetaObject::invokeMethod(
+                job,
+                [job]() {
+                    job->d->finished = true;
+                    emit job->finished();
+                },
+                Qt::QueuedConnection);
+        }
+    };
+
+    auto cached = FileHashJob::cached(d->path, d->types);
+    if (!cached.isEmpty()) {
+        d->result = cached;
+        QMetaObject::invokeMethod(
+            this,
+            [this]() {
+                d->finished = true;
+                emit finished();
+            },
+            Qt::QueuedConnection);
+        return;
+    }
+
+    auto r = new Runnable;
+    r->d   = d;
+    QThreadPool::globalInstance()->start(r);
+}
+
+bool FileHashJob::isFinished() const { return d->finished; }
+
+QList<Hash> FileHashJob::result() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->result;
+}
+
+QList<Hash> FileHashJob::cached(const QString &path, const QList<Hash::Type> &types)
+{
+    return FileHashCache::lookup(QFileInfo(path), types);
+}
+
+QList<Hash> FileHashJob::compute(const QString &path, const QList<Hash::Type> &types, const std::atomic_bool *canceled)
+{
+    QFileInfo fi(path);
+    auto      ret = FileHashCache::lookup(fi, types);
+    if (!ret.isEmpty() || types.isEmpty())
+        return ret;
+
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        qDebug("failed to open %s for hashing", qPrintable(path));
+        return {};
+    }
+
+    std::vector<std::unique_ptr<StreamHash>> hashers;
+    hashers.reserve(types.size());
+    for (auto t : types)
+        hashers.emplace_back(std::make_unique<StreamHash>(t));
+
+    auto feed = [canceled](StreamHash &h, const char *data, qint64 size) {
+        for (qint64 off = 0; off < size; off += HASH_CHUNK) {
+            if (canceled && *canceled)
+                return false;
+            int len = int(qMin(qint64(HASH_CHUNK), size - off));
+            if (!h.addData(QByteArray::fromRawData(data + off, len)))
+                return false;
+        }
+        return true;
+    };
+    // every algorithm gets a thread of its own, so a multi-hash offer takes as long as its slowest hash
+    auto feedAll = [&hashers, &feed](const char *data, qint64 size) {
+        std::atomic_bool ok { true };
+        QSemaphore       done;
+        for (std::size_t n = 1; n < hashers.size(); ++n) {
+            auto h = hashers[n].get();
+            hashPool()->start(new HashRunnable([&feed, &ok, &done, h, data, size]() {
+                if (!feed(*h, data, size))
+                    ok = false;
+                done.release();
+            }));
+        }
+        if (!feed(*hashers[0], data, size))
+            ok = false;
+        done.acquire(int(hashers.size()) - 1);
+        return bool(ok);
+    };
+
+    const qint64 size = f.size();
+    qint64       pos  = 0;
+    bool         ok   = true;
+    uchar       *mem  = size ? f.map(0, qMin(qint64(HASH_MAP_WINDOW), size)) : nullptr;
+    while (ok && mem) {
+        qint64 len  = qMin(qint64(HASH_MAP_WINDOW), size - pos);
+        qint64 next = pos + len;
+        // the next window is mapped ahead, so the kernel can read it from the disk while this one is hashed
+        uchar *ahead = next < size ? f.map(next, qMin(qint64(HASH_MAP_WINDOW), size - next)) : nullptr;
+#ifdef Q_OS_UNIX
+        if (ahead)
+            posix_madvise(ahead, size_t(qMin(qint64(HASH_MAP_WINDOW), size - next)), POSIX_MADV_WILLNEED);
+#endif
+        ok = feedAll(reinterpret_cast<const char *>(mem), len);
+        f.unmap(mem);
+        pos = next;
+        mem = ahead; // null if the rest isn't mappable, then it's read
+    }
+    if (mem)
+        f.unmap(mem);
+    if (ok && pos < size) {
+        f.seek(pos);
+        QByteArray buf(HASH_CHUNK, Qt::Uninitialized);
+        qint64     rd;
+        while (ok && (rd = f.read(buf.data(), buf.size())) > 0)
+            ok = feedAll(buf.constData(), rd);
+        ok = ok && rd == 0;
+    }
+    if (!ok)
+        return {};
+
+    for (auto &h : hashers) {
+        ret.append(h->final());
+        if (!ret.last().isValid())
+            return {};
+    }
+    // the file could have been modified while we were reading it
+    if (QFileInfo(path).lastModified() == fi.lastModified())
+        FileHashCache::store(fi, ret);
+    return ret;
+}
+
 } // namespace XMPP
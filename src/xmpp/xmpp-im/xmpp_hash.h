@@ -20,8 +20,11 @@
 #define XMPP_HASH_H
 
 #include <QHash>
+#include <QList>
+#include <QObject>
 #include <QString>
 
+#include <atomic>
 #include <memory>
 
 class QDomElement;
@@ -94,11 +97,46 @@ public:
     Hash final();
     void restart();
 
+    // intermediate state to continue hashing later, e.g. after a restart of the application.
+    // empty if the backend can't export it (only the bundled blake2 can)
+    QByteArray saveState() const;
+    bool       restoreState(const QByteArray &state);
+
 private:
     friend class StreamHashPrivate;
     std::unique_ptr<StreamHashPrivate> d;
 };
 
+/**
+ * Hashes a file on the global thread pool. The file is mapped window by window and all the requested algorithms
+ * are updated in the same pass, each on a thread of its own, so a multi-hash offer reads it only once and takes as
+ * long as its slowest hash. Results are remembered by path, size and modification time. Deleting the job cancels
+ * the computation.
+ */
+class FileHashJob : public QObject {
+    Q_OBJECT
+public:
+    FileHashJob(const QString &path, const QList<Hash::Type> &types, QObject *parent = nullptr);
+    ~FileHashJob();
+
+    void        start(); // finished() is always emitted asynchronously, even if the result was cached
+    bool        isFinished() const;
+    QList<Hash> result() const; // in the order of requested types. empty on failure
+
+    // returns hashes only if all of them are known for the current state of the file
+    static QList<Hash> cached(const QString &path, const QList<Hash::Type> &types);
+    // the same as the job but synchronous. consults the cache first
+    static QList<Hash> compute(const QString &path, const QList<Hash::Type> &types,
+                               const std::atomic_bool *canceled = nullptr);
+
+signals:
+    void finished();
+
+private:
+    class Private;
+    std::shared_ptr<Private> d;
+};
+
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
 Q_DECL_PURE_FUNCTION inline uint qHash(const Hash &hash, uint seed = 0) Q_DECL_NOTHROW
 #else
@@ -19,6 +19,7 @@
 
 #include "xmpp_ibb.h"
 
+#include "xmpp/xmpp-core/parser.h"
 #include "xmpp_client.h"
 #include "xmpp_stream.h"
 #include "xmpp_xmlcommon.h"
@@ -27,6 +28,11 @@
 #include <QtCrypto>
 
 #define IBB_PACKET_DELAY 0
+// a chunk the peer asked us to send later (error type wait) is sent again after that many msecs
+#define IBB_RETRY_DELAY 1000
+#define IBB_MAX_RETRIES 3
+// payloads decoded while parsed which are still waiting for their stanza. there is one at a time normally
+#define IBB_MAX_STREAMED 8
 
 using namespace XMPP;
 
@@ -41,6 +47,12 @@ class IBBConnection::Private {
 public:
     Private() = default;
 
+    struct Chunk {
+        JT_IBB    *task;
+        quint16    seq;
+        QByteArray data;
+    };
+
     int         state = 0;
     quint16     seq   = 0;
     Jid         peer;
@@ -50,10 +62,16 @@ public:
     QString     iq_id;
     QString     stanza;
 
-    int blockSize = IBBConnection::PacketSize;
+    int blockSize  = IBBConnection::PacketSize;
+    int windowSize = IBBConnection::WindowSize;
     // QByteArray recvBuf, sendBuf;
     bool closePending, closing;
 
+    QList<Chunk> inflight;        // data sent and not acknowledged yet, oldest first
+    QList<Chunk> resend;          // data to send again, before anything new
+    int          retries = 0;     // resends in a row without an acknowledgement in between
+    bool         backoff = false; // waiting to resend
+
     int id; // connection id
 };
 
@@ -79,9 +97,15 @@ void IBBConnection::resetConnection(bool clear)
     d->closePending = false;
     d->closing      = false;
     d->seq          = 0;
+    d->retries      = 0;
+    d->backoff      = false;
 
     delete d->j;
     d->j = nullptr;
+    for (const auto &c : std::as_const(d->inflight))
+        delete c.task;
+    d->inflight.clear();
+    d->resend.clear();
 
     clearWriteBuffer();
     if (clear)
@@ -104,6 +128,10 @@ IBBConnection::~IBBConnection()
 
 void IBBConnection::setPacketSize(int blockSize) { d->blockSize = blockSize; }
 
+void IBBConnection::setWindowSize(int chunks) { d->windowSize = qMax(1, chunks); }
+
+int IBBConnection::windowSize() const { return d->windowSize; }
+
 void IBBConnection::connectToJid(const Jid &peer, const QString &sid)
 {
     close();
@@ -160,7 +188,7 @@ void IBBConnection::close()
         trySend();
 
         // if there is data pending to be written, then pend the closing
-        if (bytesToWrite() > 0 || d->closing) {
+        if (bytesToWrite() > 0 || !d->inflight.isEmpty() || !d->resend.isEmpty() || d->closing) {
             return;
         }
     }
@@ -266,35 +294,87 @@ void IBBConnection::ibb_finished()
     }
 }
 
-void IBBConnection::trySend()
+void IBBConnection::ibb_dataFinished()
 {
-    // if we already have an active task, then don't do anything
-    if (d->j)
+    JT_IBB *j = static_cast<JT_IBB *>(sender());
+    int     n = 0;
+    while (n < d->inflight.size() && d->inflight[n].task != j)
+        ++n;
+    if (n == d->inflight.size())
         return;
+    Private::Chunk c = d->inflight.takeAt(n);
 
-    QByteArray a = takeWrite(d->blockSize);
+    if (j->success()) {
+        d->retries = 0;
+        if (bytesToWrite() || !d->resend.isEmpty() || d->closePending)
+            QTimer::singleShot(IBB_PACKET_DELAY, this, SLOT(trySend()));
+        emit bytesWritten(c.data.size()); // will delete this connection if no bytes left.
+        return;
+    }
 
-    if (a.isEmpty()) {
-        if (!d->closePending)
-            return; // null operation?
-        d->closePending = false;
-        d->closing      = true;
+    if (j->error().type == Stanza::Error::ErrorType::Wait && ++d->retries <= IBB_MAX_RETRIES) {
+        // the peer didn't take it and so refuses whatever came after it. send all that again, in order
 #ifdef IBB_DEBUG
-        qDebug("IBBConnection[%d]: closing", d->id);
+        qDebug("IBBConnection[%d]: resending from seq %d", d->id, c.seq);
 #endif
-    } else {
+        c.task = nullptr;
+        d->resend.prepend(c);
+        while (d->inflight.size() > n) {
+            Private::Chunk later = d->inflight.takeLast();
+            delete later.task;
+            later.task = nullptr;
+            d->resend.insert(1, later);
+        }
+        d->backoff = true;
+        QTimer::singleShot(IBB_RETRY_DELAY, this, [this]() {
+            d->backoff = false;
+            trySend();
+        });
+        return;
+    }
+
+    resetConnection(true);
+    setError(ErrData);
+}
+
+void IBBConnection::trySend()
+{
+    // if we already have an active request or close task, then don't do anything
+    if (d->j || d->backoff)
+        return;
+
+    // keep up to windowSize chunks in flight. the peer gets them in order anyway
+    while (d->inflight.size() < d->windowSize) {
+        Private::Chunk c;
+        if (!d->resend.isEmpty()) {
+            c = d->resend.takeFirst();
+        } else {
+            c.data = takeWrite(d->blockSize);
+            if (c.data.isEmpty())
+                break;
+            c.seq = d->seq++;
+        }
 #ifdef IBB_DEBUG
-        qDebug("IBBConnection[%d]: sending [%d] bytes (%d bytes left)", d->id, a.size(), bytesToWrite());
+        qDebug("IBBConnection[%d]: sending [%d] bytes (%d bytes left)", d->id, c.data.size(), bytesToWrite());
 #endif
+        c.task = new JT_IBB(d->m->client()->rootTask());
+        connect(c.task, SIGNAL(finished()), SLOT(ibb_dataFinished()));
+        c.task->sendData(d->peer, IBBData(d->sid, c.seq, c.data));
+        d->inflight.append(c);
+        c.task->go(true);
     }
 
+    if (!d->closePending || !d->inflight.isEmpty() || bytesToWrite())
+        return;
+
+    d->closePending = false;
+    d->closing      = true;
+#ifdef IBB_DEBUG
+    qDebug("IBBConnection[%d]: closing", d->id);
+#endif
     d->j = new JT_IBB(d->m->client()->rootTask());
     connect(d->j, SIGNAL(finished()), SLOT(ibb_finished()));
-    if (d->closing) {
-        d->j->close(d->peer, d->sid);
-    } else {
-        d->j->sendData(d->peer, IBBData(d->sid, d->seq++, a));
-    }
+    d->j->close(d->peer, d->sid);
     d->j->go(true);
 }
 
@@ -305,13 +385,13 @@ IBBData &IBBData::fromXml(const QDomElement &e)
 {
     sid  = e.attribute("sid");
     seq  = quint16(e.attribute("seq").toInt());
-    data = QByteArray::fromBase64(e.text().toUtf8());
+    data = XMLHelper::fromBase64(e.text());
     return *this;
 }
 
 QDomElement IBBData::toXml(QDomDocument *doc) const
 {
-    QDomElement query = textTagNS(doc, IBB_NS, "data", QString::fromLatin1(data.toBase64())).toElement();
+    QDomElement query = textTagNS(doc, IBB_NS, "data", XMLHelper::toBase64(data)).toElement();
     query.setAttribute("seq", QString::number(seq));
     query.setAttribute("sid", sid);
     return query;
@@ -320,20 +400,74 @@ QDomElement IBBData::toXml(QDomDocument *doc) const
 //----------------------------------------------------------------------------
 // IBBManager
 //----------------------------------------------------------------------------
+// the <data/> of the open streams is decoded by the parser right away, so the stanza doesn't keep the base64
+// text. it comes with an empty <data/>, takeIncomingData() puts the payload back
+class IBBManager::Sink : public ContentSink {
+public:
+    IBBManager                       *manager;
+    QList<QPair<QString, QByteArray>> streamed; // by key(), the oldest first
+    QString                           current;
+    QByteArray                        buffer;
+
+    Sink(IBBManager *manager) : manager(manager) { }
+
+    static QString key(const Jid &from, const QString &sid, quint16 seq)
+    {
+        return from.full() + QLatin1Char(' ') + sid + QLatin1Char(' ') + QString::number(seq);
+    }
+
+    QByteArray take(const Jid &from, const IBBData &data)
+    {
+        QString k = key(from, data.sid, data.seq);
+        for (int i = 0; i < streamed.size(); ++i)
+            if (streamed[i].first == k)
+                return streamed.takeAt(i).second;
+        return QByteArray();
+    }
+
+    bool begin(const CompactElement &stanza, const QXmlStreamAttributes &attrs) override
+    {
+        if (stanza.nodes().back().parent != 0)
+            return false; // not a child of the stanza
+        Jid     from(stanza.attribute(u"from").toString());
+        QString sid = attrs.value(QLatin1String("sid")).toString();
+        if (!manager->findConnection(sid, from))
+            return false;
+        current = key(from, sid, quint16(attrs.value(QLatin1String("seq")).toInt()));
+        buffer.clear();
+        return true;
+    }
+
+    void data(const QByteArray &decoded) override { buffer += decoded; }
+
+    void end(bool ok) override
+    {
+        if (!ok) {
+            buffer.clear();
+            return;
+        }
+        if (streamed.size() >= IBB_MAX_STREAMED)
+            streamed.removeFirst();
+        streamed.append({ current, std::exchange(buffer, QByteArray()) });
+    }
+};
+
 class IBBManager::Private {
 public:
-    Private() = default;
+    Private(IBBManager *q) : sink(q) { }
 
     Client           *client = nullptr;
     IBBConnectionList activeConns;
     IBBConnectionList incomingConns;
     JT_IBB           *ibb = nullptr;
+    Sink              sink;
 };
 
 IBBManager::IBBManager(Client *parent) : BytestreamManager(parent)
 {
-    d         = new Private;
+    d         = new Private(this);
     d->client = parent;
+    d->client->addContentSink(QLatin1String(IBB_NS), QLatin1String("data"), &d->sink);
 
     d->ibb = new JT_IBB(d->client->rootTask(), true);
     connect(d->ibb, SIGNAL(incomingRequest(Jid, QString, QString, int, QString)),
@@ -345,6 +479,7 @@ IBBManager::IBBManager(Client *parent) : BytestreamManager(parent)
 
 IBBManager::~IBBManager()
 {
+    d->client->removeContentSink(&d->sink);
     qDeleteAll(d->incomingConns);
     d->incomingConns.clear();
     delete d->ibb;
@@ -384,6 +519,12 @@ void IBBManager::takeIncomingData(const Jid &from, const QString &id, const IBBD
         if (sKind == Stanza::IQ) {
             d->ibb->respondAck(from, id);
         }
+        if (data.data.isEmpty()) {
+            IBBData streamed = data;
+            streamed.data    = d->sink.take(from, data);
+            c->takeIncomingData(streamed);
+            return;
+        }
         c->takeIncomingData(data);
     }
 }
@@ -495,7 +636,10 @@ void JT_IBB::respondError(const Jid &to, const QString &id, Stanza::Error::Error
     send(iq);
 }
 
-void JT_IBB::respondAck(const Jid &to, const QString &id) { send(createIQ(doc(), "result", to.full(), id)); }
+void JT_IBB::respondAck(const Jid &to, const QString &id)
+{
+    send(Stanza::Builder(Stanza::IQ, to.full(), QStringLiteral("result"), id));
+}
 
 void JT_IBB::onGo() { send(d->iq); }
 
@@ -50,6 +50,7 @@ class IBBConnection final : public BSConnection {
     Q_OBJECT
 public:
     static const int PacketSize = 4096;
+    static const int WindowSize = 4; // data chunks sent ahead of the acknowledgements
 
     enum { ErrRequest, ErrData };
     enum { Idle, Requesting, WaitingForAccept, Active };
@@ -57,6 +58,8 @@ public:
     ~IBBConnection();
 
     void setPacketSize(int blockSize = IBBConnection::PacketSize);
+    void setWindowSize(int chunks = IBBConnection::WindowSize);
+    int  windowSize() const;
     void connectToJid(const Jid &peer, const QString &sid);
     void accept();
     void close();
@@ -76,6 +79,7 @@ signals:
 
 private slots:
     void ibb_finished();
+    void ibb_dataFinished();
     void trySend();
 
 private:
@@ -117,6 +121,7 @@ private slots:
 
 private:
     class Private;
+    class Sink;
     Private *d;
 
     friend class IBBConnection;
@@ -0,0 +1,183 @@
+/*
+ * xmpp_iqcall.cpp - iq requests awaited by coroutines
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp_iqcall.h"
+
+#include "xmpp_client.h"
+
+#include <QHash>
+#include <QTimer>
+
+#include <utility>
+
+namespace XMPP {
+class IqCall::Private {
+public:
+    QString                 id;
+    Jid                     to;
+    IqReply                 reply;
+    bool                    finished = false;
+    std::coroutine_handle<> waiter;
+
+    // the caller holds a reference, the coroutine may drop the last IqCall
+    void finish(IqReply::Status status, const QDomElement &e = QDomElement(), const QString &baseNS = QString(),
+                const QSharedPointer<QDomDocument> &doc = {})
+    {
+        if (finished)
+            return;
+        finished       = true;
+        reply.status   = status;
+        reply.element  = e;
+        reply.document = doc;
+        if (status == IqReply::Error) {
+            QDomElement tag = e.firstChildElement(QStringLiteral("error"));
+            if (!tag.isNull())
+                reply.error.fromXml(tag, baseNS);
+        }
+        if (auto h = std::exchange(waiter, {}))
+            h.resume();
+    }
+};
+
+IqCall::IqCall(std::shared_ptr<Private> d) : d(std::move(d)) { }
+
+IqCall &IqCall::operator=(IqCall &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        d = std::move(other.d);
+    }
+    return *this;
+}
+
+IqCall::~IqCall() { release(); }
+
+void IqCall::release()
+{
+    if (!d)
+        return;
+    // the frame of the awaiting coroutine, if any, is what goes away here
+    d->waiter = {};
+    if (!d->finished) {
+        d->finished     = true;
+        d->reply.status = IqReply::Cancelled;
+    }
+    d.reset();
+}
+
+QString IqCall::id() const { return d ? d->id : QString(); }
+
+bool IqCall::isFinished() const { return !d || d->finished; }
+
+void IqCall::cancel()
+{
+    if (auto keep = d)
+        keep->finish(IqReply::Cancelled);
+}
+
+void IqCall::await_suspend(std::coroutine_handle<> handle) { d->waiter = handle; }
+
+IqReply IqCall::await_resume() const { return d ? d->reply : IqReply(); }
+
+//----------------------------------------------------------------------------
+// IqCallTable
+//----------------------------------------------------------------------------
+class IqCallTable::Private {
+public:
+    Client                                          *client;
+    QHash<QString, std::shared_ptr<IqCall::Private>> calls; // by id. the cancelled ones stay until answered
+
+    // like Task::iqVerify(): the reply comes from whom the request went to. the server and our own account may
+    // leave "from" out or give our bare jid or domain
+    bool fromPeer(const QDomElement &x, const Jid &to) const
+    {
+        Jid from(x.attribute(QStringLiteral("from")));
+        Jid local  = client->jid();
+        Jid server = client->host();
+        if (from.isEmpty() || from.compare(local, false) || from.compare(local.domain(), false))
+            return to.isEmpty() || to.compare(local, false) || to.compare(server);
+        return from.compare(to);
+    }
+};
+
+IqCallTable::IqCallTable(Client *client) : d(new Private) { d->client = client; }
+
+IqCallTable::~IqCallTable() { finishAll(IqReply::Disconnected); }
+
+IqCall IqCallTable::start(const QDomElement &iq, int timeout)
+{
+    auto c = std::make_shared<IqCall::Private>();
+    c->id  = iq.attribute(QStringLiteral("id"));
+    c->to  = Jid(iq.attribute(QStringLiteral("to")));
+    if (!d->client->hasStream()) {
+        c->finish(IqReply::Disconnected);
+        return IqCall(c);
+    }
+
+    QDomElement request = iq;
+    if (c->id.isEmpty()) {
+        c->id = d->client->genUniqueId();
+        request.setAttribute(QStringLiteral("id"), c->id);
+    }
+    d->calls.insert(c->id, c);
+
+    if (timeout < 0)
+        timeout = d->client->taskTimeout();
+    if (timeout > 0) {
+        std::weak_ptr<IqCall::Private> weak = c;
+        QTimer::singleShot(timeout * 1000, d->client, [this, weak]() {
+            auto c = weak.lock();
+            if (!c || c->finished)
+                return;
+            if (d->calls.value(c->id) == c)
+                d->calls.remove(c->id);
+            c->finish(IqReply::Timeout);
+        });
+    }
+
+    d->client->send(request);
+    return IqCall(c);
+}
+
+bool IqCallTable::take(const QDomElement &x, const QSharedPointer<QDomDocument> &doc)
+{
+    if (d->calls.isEmpty() || x.tagName() != QLatin1String("iq"))
+        return false;
+    QString type  = x.attribute(QStringLiteral("type"));
+    bool    error = type == QLatin1String("error");
+    if (!error && type != QLatin1String("result"))
+        return false;
+
+    auto it = d->calls.find(x.attribute(QStringLiteral("id")));
+    if (it == d->calls.end() || !d->fromPeer(x, it.value()->to))
+        return false;
+    auto c = it.value();
+    d->calls.erase(it);
+    c->finish(error ? IqReply::Error : IqReply::Result, x, d->client->streamBaseNS(), doc);
+    return true;
+}
+
+void IqCallTable::finishAll(IqReply::Status status)
+{
+    // a coroutine going on may start new calls
+    auto calls = std::exchange(d->calls, {});
+    for (auto const &c : std::as_const(calls))
+        c->finish(status);
+}
+} // namespace XMPP
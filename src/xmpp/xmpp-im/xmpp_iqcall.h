@@ -0,0 +1,118 @@
+/*
+ * xmpp_iqcall.h - iq requests awaited by coroutines
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_IQCALL_H
+#define XMPP_IQCALL_H
+
+#include "iris/xmpp_stanza.h"
+
+#include <QDomElement>
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+namespace XMPP {
+class Client;
+
+class IqReply {
+public:
+    enum Status { Result, Error, Timeout, Disconnected, Cancelled };
+
+    Status                       status = Cancelled;
+    QDomElement                  element;  // the result or the error iq, null otherwise
+    QSharedPointer<QDomDocument> document; // where element is, if it's not Client::doc()
+    Stanza::Error                error;    // for Error
+
+    bool isResult() const { return status == Result; }
+};
+
+/*
+ * A get or set iq sent by Client::iq(), to be awaited in a coroutine:
+ *
+ *     XMPP::Coroutine fetch(XMPP::Client *client, QDomElement request)
+ *     {
+ *         XMPP::IqReply reply = co_await client->iq(request);
+ *         ...
+ *     }
+ *
+ * The reply is handed to the coroutine by the dispatch of the client, before any task sees it. There is no
+ * Task, signal or timer object per request, just this handle and the state it shares with the client. Calls
+ * may be started one after another and awaited later, they are in flight together. One coroutine at a time
+ * awaits a call, awaiting a finished one gives its reply at once. Dropping an unfinished call cancels it, the
+ * reply is ignored when it comes.
+ */
+class IqCall {
+public:
+    class Private; // shared with IqCallTable
+
+    IqCall(IqCall &&other) noexcept = default;
+    IqCall &operator=(IqCall &&other) noexcept;
+    ~IqCall();
+
+    QString id() const;
+    bool    isFinished() const;
+    // the awaiting coroutine goes on with Cancelled
+    void cancel();
+
+    bool    await_ready() const noexcept { return isFinished(); }
+    void    await_suspend(std::coroutine_handle<> handle);
+    IqReply await_resume() const;
+
+private:
+    friend class IqCallTable;
+    IqCall(std::shared_ptr<Private> d);
+    void release();
+
+    std::shared_ptr<Private> d;
+};
+
+// the return type of a coroutine awaiting calls. it runs at once up to the first co_await and its frame is gone
+// when it returns, nobody waits for it. an exception leaving it terminates, like one leaving a slot does
+class Coroutine {
+public:
+    struct promise_type {
+        Coroutine          get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void               return_void() noexcept { }
+        void               unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+// the calls of a client waiting for their replies. Client's own, see Client::iq()
+class IqCallTable {
+public:
+    IqCallTable(Client *client);
+    ~IqCallTable();
+
+    // timeout in secs, 0 for none, -1 for the task timeout of the client. an id is set if the iq has none
+    IqCall start(const QDomElement &iq, int timeout);
+    // true if x is the reply to one of the calls. doc stays with it, see Client::stanzaDocument()
+    bool take(const QDomElement &x, const QSharedPointer<QDomDocument> &doc = {});
+    // all of them at once, e.g. Disconnected
+    void finishAll(IqReply::Status status);
+
+private:
+    class Private;
+    std::unique_ptr<Private> d;
+};
+} // namespace XMPP
+
+#endif // XMPP_IQCALL_H
@@ -34,9 +34,18 @@ public:
 
     LiveRoster &operator=(const LiveRoster &other);
 
-    void                      flagAllForDelete();
-    LiveRoster::Iterator      find(const Jid &, bool compareRes = true);
-    LiveRoster::ConstIterator find(const Jid &, bool compareRes = true) const;
+    void                        flagAllForDelete();
+    LiveRoster::Iterator        find(const Jid &, bool compareRes = true);
+    LiveRoster::ConstIterator   find(const Jid &, bool compareRes = true) const;
+    QList<LiveRoster::Iterator> findAll(const Jid &, bool compareRes = true);
+
+    // these keep the jid index in sync. other modifications are detected on lookup when the size changes
+    LiveRoster          &operator+=(const LiveRosterItem &item);
+    void                 append(const LiveRosterItem &item);
+    LiveRoster::Iterator erase(LiveRoster::Iterator it);
+    LiveRoster::Iterator erase(LiveRoster::Iterator begin, LiveRoster::Iterator end);
+    void                 removeAt(int i);
+    void                 clear();
 
     void    setGroupsDelimiter(const QString &groupsDelimiter);
     QString groupsDelimiter() const;
@@ -44,6 +53,8 @@ public:
 private:
     class Private;
     Private *d;
+
+    QList<int> positions(const Jid &, bool compareRes) const;
 };
 } // namespace XMPP
 
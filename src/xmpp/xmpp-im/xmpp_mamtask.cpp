@@ -19,39 +19,154 @@
 
 #include "xmpp_mamtask.h"
 
-using namespace XMLHelper;
+#include "xmpp_client.h"
+#include "xmpp_subsets.h"
+#include "xmpp_tasks.h"
+#include "xmpp_xdata.h"
+#include "xmpp_xmlcommon.h"
+
+#include <QHash>
+#include <QPointer>
+
+#include <optional>
+
+// slices per query in flight, so a slice with few messages doesn't leave a query slot idle for long
+#define MAM_SLICES_PER_QUERY 4
+// a slice is never shorter than this (msecs), the timestamps of some archives have a resolution of seconds
+#define MAM_MIN_SLICE 60000
+
 using namespace XMPP;
 
+static QString mamTimestamp(const QDateTime &dt) { return msecs2stamp(dt.toMSecsSinceEpoch(), true); }
+
+//----------------------------------------------------------------------------
+// MAMCursorStore
+//----------------------------------------------------------------------------
+class MAMCursorStore::Private {
+public:
+    QHash<QString, Cursor> cursors; // by bare jid of the archive
+    bool                   loaded = false;
+};
+
+MAMCursorStore::MAMCursorStore() : d(new Private) { }
+
+MAMCursorStore::~MAMCursorStore() { delete d; }
+
+MAMCursorStore::Cursor MAMCursorStore::cursor(const Jid &archive) const
+{
+    load();
+    return d->cursors.value(archive.bare());
+}
+
+void MAMCursorStore::setCursor(const Jid &archive, const Cursor &cursor)
+{
+    load();
+    d->cursors.insert(archive.bare(), cursor);
+    save();
+}
+
+void MAMCursorStore::clear(const Jid &archive)
+{
+    load();
+    if (d->cursors.remove(archive.bare()))
+        save();
+}
+
+void MAMCursorStore::saveData(const QByteArray &data) { Q_UNUSED(data) }
+
+QByteArray MAMCursorStore::loadData() { return QByteArray(); }
+
+void MAMCursorStore::load() const
+{
+    if (d->loaded)
+        return;
+    d->loaded = true;
+
+    QByteArray data = const_cast<MAMCursorStore *>(this)->loadData();
+    if (data.isEmpty())
+        return;
+
+    QDomDocument doc;
+    if (!doc.setContent(data)) {
+        qWarning("MAMCursorStore: Cannot parse stored cursors");
+        return;
+    }
+    QDomElement root = doc.documentElement();
+    if (root.tagName() != QLatin1String("cursors"))
+        return;
+
+    for (QDomElement c = root.firstChildElement(QLatin1String("cursor")); !c.isNull();
+         c = c.nextSiblingElement(QLatin1String("cursor"))) {
+        Cursor cursor;
+        qint64 stamp;
+        cursor.id = c.attribute(QLatin1String("id"));
+        if (stamp2msecs(c.attribute(QLatin1String("stamp")), &stamp))
+            cursor.timeStamp = QDateTime::fromMSecsSinceEpoch(stamp);
+        if (!cursor.isNull())
+            d->cursors.insert(c.attribute(QLatin1String("archive")), cursor);
+    }
+}
+
+void MAMCursorStore::save()
+{
+    QDomDocument doc;
+    QDomElement  root = doc.createElement(QLatin1String("cursors"));
+    doc.appendChild(root);
+    for (auto it = d->cursors.cbegin(); it != d->cursors.cend(); ++it) {
+        QDomElement c = doc.createElement(QLatin1String("cursor"));
+        c.setAttribute(QLatin1String("archive"), it.key());
+        c.setAttribute(QLatin1String("id"), it->id);
+        if (it->timeStamp.isValid())
+            c.setAttribute(QLatin1String("stamp"), mamTimestamp(it->timeStamp));
+        root.appendChild(c);
+    }
+
+    saveData(doc.toString().toUtf8());
+}
+
+//----------------------------------------------------------------------------
+// MAMTask
+//----------------------------------------------------------------------------
 class MAMTask::Private {
 public:
-    int mamPageSize; // TODO: this is the max page size for MAM request. Should be made into a config option
-    int       mamMaxMessages; // maximum mam pages total, also should be config
-    int                messagesFetched;
-    bool flipPages;
-    bool backwards;
-    bool      allowMUCArchives;
-    bool               metadataFetched;
-    Jid       j;
-    QString firstID;
-    QString lastID;
-    QString lastArchiveID;
-    QDateTime from;
-    QDateTime to;
-    QList<QDomElement> archive;
-
-    void  getPage(MAMTask* t);
-    void  getArchiveMetadata(MAMTask* t);
-    XData makeMAMFilter();
+    Jid                archive;
+    Jid                with;
+    QDateTime          from;
+    QDateTime          to;
+    bool               allowMUCArchives = true;
+    bool               flipPages        = true;
+    bool               backwards        = true;
+    int                mamPageSize      = 10;
+    int                mamMaxMessages   = 100;
+    int                messagesFetched  = 0;
+    bool               started          = false;
+    bool               inFlight         = false; // a page was requested and its <fin/> didn't come yet
+    bool               paused           = false;
+    bool               complete         = false;
+    QString            firstID;
+    QString            lastID;
+    QString            afterID; // for the first page
+    QList<QDomElement> page;
+    int                pageResults = 0; // with the dropped ones
+    MessageIdIndex    *index       = nullptr;
+
+    std::optional<XDataTemplate> filter; // the same for every page
+
+    void  getPage(MAMTask *t);
+    XData makeMAMFilter() const;
 };
 
-XData MAMTask::Private::makeMAMFilter() {
+XData MAMTask::Private::makeMAMFilter() const
+{
     XData::FieldList fl;
 
-    XData::Field with;
-    with.setType(XData::Field::Field_JidSingle);
-    with.setVar(QLatin1String("with"));
-    with.setValue(QStringList(j.bare()));
-    fl.append(with);
+    if (!with.isEmpty()) {
+        XData::Field f;
+        f.setType(XData::Field::Field_JidSingle);
+        f.setVar(QLatin1String("with"));
+        f.setValue(QStringList(with.bare()));
+        fl.append(f);
+    }
 
     XData::Field includeGroupchat;
     includeGroupchat.setType(XData::Field::Field_Boolean);
@@ -63,8 +178,7 @@ XData MAMTask::Private::makeMAMFilter() {
         XData::Field start;
         start.setType(XData::Field::Field_TextSingle);
         start.setVar(QLatin1String("start"));
-        from.setTimeSpec(Qt::UTC);
-        start.setValue(QStringList(from.toString()));
+        start.setValue(QStringList(mamTimestamp(from)));
         fl.append(start);
     }
 
@@ -72,13 +186,10 @@ XData MAMTask::Private::makeMAMFilter() {
         XData::Field end;
         end.setType(XData::Field::Field_TextSingle);
         end.setVar(QLatin1String("end"));
-        to.setTimeSpec(Qt::UTC);
-        end.setValue(QStringList(to.toString()));
+        end.setValue(QStringList(mamTimestamp(to)));
         fl.append(end);
     }
 
-    // TODO: ID filters?
-
     XData x;
     x.setType(XData::Data_Submit);
     x.setFields(fl);
@@ -87,143 +198,484 @@ XData MAMTask::Private::makeMAMFilter() {
     return x;
 }
 
-// TODO: use iris rsm implementation
-/*
-void MAMTask::Private::getPage(MAMTask* t)
-{
-    QDomElement iq = createIQ(t->doc(), "set", QString(), t->id());
-
-    QDomElement query = t->doc()->createElementNS(XMPP_MAM_NAMESPACE, "query");
-
-    XData            x = makeMAMFilter();
-
-    QDomElement rsmSet = t->doc()->createElementNS("http://jabber.org/protocol/rsm", "set");
-    rsmSet.appendChild(textTag(t->doc(), "max", QString::number(mamMaxMessages)));
-
-    if(flipPages) rsmSet.appendChild(emptyTag(t->doc(), "flip-page"));
-    if(backwards) {
-        if(lastArchiveID.isNull()) {
-            rsmSet.appendChild(emptyTag(t->doc(), "before"));
-        } else {
-            rsmSet.appendChild(textTag(t->doc(), "before", lastArchiveID));
-        }
-    } else {
-        if(!lastArchiveID.isNull()) {
-            rsmSet.appendChild(textTag(t->doc(), "after", lastArchiveID));
-        }
-    }
-
-    query.appendChild(x.toXml(t->doc()));
-    query.appendChild(rsmSet);
-    iq.appendChild(query);
-    t->send(iq);
-}
-*/
-
-
-void MAMTask::Private::getPage(MAMTask* t)
+void MAMTask::Private::getPage(MAMTask *t)
 {
-    QDomElement iq = createIQ(t->doc(), QLatin1String("set"), QLatin1String(), t->id());
-    QDomElement query = t->doc()->createElementNS(XMPP_MAM_NAMESPACE, QLatin1String("query"));
-    XData            x = makeMAMFilter();
+    QDomElement iq    = createIQ(t->doc(), QStringLiteral("set"), archive.full(), t->id());
+    QDomElement query = t->doc()->createElementNS(XMPP_MAM_NAMESPACE, QStringLiteral("query"));
+    query.setAttribute(QStringLiteral("queryid"), t->id());
 
     SubsetsClientManager rsm;
-    rsm.setMax(mamMaxMessages);
-
-    if(flipPages) query.appendChild(emptyTag(t->doc(), QLatin1String("flip-page")));
-
-    if(lastArchiveID.isNull()) {
-        if(backwards) {
+    int                  max = mamPageSize;
+    if (mamMaxMessages > 0)
+        max = qMin(max, mamMaxMessages - messagesFetched);
+    rsm.setMax(max);
+
+    if (!started && !afterID.isEmpty()) {
+        rsm.setLastID(afterID);
+        rsm.getNext();
+    } else if (!started) {
+        if (backwards)
             rsm.getLast();
-        } else {
+        else
             rsm.getFirst();
-        }
+    } else if (backwards) {
+        rsm.setFirstID(firstID);
+        rsm.getPrevious();
     } else {
-        if(backwards) {
-            rsm.setFirstID(lastArchiveID);
-            rsm.getPrevious();
-        } else {
-            rsm.setLastID(lastArchiveID);
-            rsm.getNext();
-        }
+        rsm.setLastID(lastID);
+        rsm.getNext();
     }
 
-    query.appendChild(x.toXml(t->doc()));
+    if (!filter)
+        filter = XDataTemplate(makeMAMFilter());
+    query.appendChild(filter->toXml(t->doc()));
     query.appendChild(rsm.makeQueryElement(t->doc()));
+    if (flipPages)
+        query.appendChild(t->doc()->createElementNS(XMPP_MAM_NAMESPACE, QStringLiteral("flip-page")));
     iq.appendChild(query);
+
+    started  = true;
+    inFlight = true;
     t->send(iq);
 }
 
-
-void MAMTask::Private::getArchiveMetadata(MAMTask* t) {
-    // Craft a query to get the first and last messages in an archive
-    QDomElement iq = createIQ(t->doc(), QLatin1String("get"), QLatin1String(), t->id());
-    QDomElement metadata = emptyTag(t->doc(), QLatin1String("metadata"));
-    metadata.setAttribute(QLatin1String("xmlns"), XMPP_MAM_NAMESPACE);
-    iq.appendChild(metadata);
-    iq.appendChild(makeMAMFilter().toXml(t->doc()));
-
-    t->send(iq);
+MAMTask::MAMTask(Task *parent) : Task(parent)
+{
+    d = new Private;
+    // the results come as messages, let them find us without asking every task
+    registerPush(QStringLiteral("message"), XMPP_MAM_NAMESPACE);
 }
 
-MAMTask::MAMTask(Task *parent) : Task(parent) { d = new Private; }
 MAMTask::~MAMTask() { delete d; }
 
-const QList<QDomElement> &MAMTask::archive() const { return d->archive; }
+void MAMTask::setArchive(const Jid &archive) { d->archive = archive; }
 
-void MAMTask::get(const Jid &j, const QDateTime &from = {}, const QDateTime &to = {},
-                  const bool allowMUCArchives = true, int mamPageSize = 10, int mamMaxMessages = 100, bool flipPages = true, bool backwards = true)
-{
-    d->archive         = {};
-    d->messagesFetched = 0;
-    d->metadataFetched = false;
+void MAMTask::setMessageIdIndex(MessageIdIndex *index) { d->index = index; }
+
+void MAMTask::setAfterId(const QString &id) { d->afterID = id; }
 
-    d->j                = j;
+void MAMTask::get(const Jid &with, const QDateTime &from, const QDateTime &to, bool allowMUCArchives,
+                  int mamPageSize, int mamMaxMessages, bool flipPages, bool backwards)
+{
+    d->with             = with;
     d->from             = from;
     d->to               = to;
     d->allowMUCArchives = allowMUCArchives;
-    d->mamPageSize = mamPageSize;
-    d->mamMaxMessages   = mamMaxMessages;
-    d->flipPages = flipPages;
-    d->backwards = backwards;
+    d->mamPageSize      = qMax(1, mamPageSize);
+    d->mamMaxMessages   = qMax(0, mamMaxMessages);
+    d->flipPages        = flipPages;
+    d->backwards        = backwards;
+    d->messagesFetched  = 0;
+    d->started          = false;
+    d->complete         = false;
+    d->page.clear();
 }
 
-void MAMTask::onGo() {
-    d->getArchiveMetadata(this);
+void MAMTask::pause() { d->paused = true; }
+
+void MAMTask::resume()
+{
+    if (!d->paused)
+        return;
+    d->paused = false;
+    if (d->started && !d->inFlight)
+        d->getPage(this);
 }
 
+bool MAMTask::isPaused() const { return d->paused; }
+
+int MAMTask::messagesFetched() const { return d->messagesFetched; }
+
+bool MAMTask::isComplete() const { return d->complete; }
+
+void MAMTask::onGo() { d->getPage(this); }
+
 bool MAMTask::take(const QDomElement &x)
 {
-    if(d->metadataFetched) {
-        if(iqVerify(x, QString(), id())) return false;
+    if (x.tagName() == QLatin1String("message")) {
+        // only the results of our query, everything else is for the other tasks
+        QDomElement result = x.firstChildElement(QStringLiteral("result"));
+        if (result.isNull() || result.namespaceURI() != XMPP_MAM_NAMESPACE
+            || result.attribute(QStringLiteral("queryid")) != id())
+            return false;
+
+        Jid from(x.attribute(QStringLiteral("from")));
+        if (d->archive.isEmpty() ? !(from.isEmpty() || from.compare(client()->jid(), false))
+                                 : !from.compare(d->archive, false))
+            return false;
+
+        ++d->pageResults;
+        if (!d->index || d->index->insertResult(result, d->archive.isEmpty() ? client()->jid() : d->archive)) {
+            // the page outlives its stanzas, a document of a batch would go with them
+            if (client()->stanzaDocument())
+                result = client()->doc()->importNode(result, true).toElement();
+            d->page += result;
+        }
+        return true;
+    }
+
+    if (!d->inFlight || !iqVerify(x, d->archive, id()))
+        return false;
+
+    d->inFlight = false;
+    if (x.attribute(QStringLiteral("type")) != QLatin1String("result")) {
+        d->page.clear();
+        d->pageResults = 0;
+        setError(x);
+        return true;
+    }
+
+    QDomElement fin   = x.firstChildElement(QStringLiteral("fin"));
+    QDomElement set   = SubsetsClientManager::findElement(fin, true);
+    QString     first = tagContent(set.firstChildElement(QStringLiteral("first")));
+    QString     last  = tagContent(set.firstChildElement(QStringLiteral("last")));
+    if (!first.isEmpty())
+        d->firstID = first;
+    if (!last.isEmpty())
+        d->lastID = last;
+
+    QList<QDomElement> results = std::move(d->page);
+    int                count   = d->pageResults;
+    d->page.clear();
+    d->pageResults = 0;
+    d->messagesFetched += count;
+
+    QString complete = fin.attribute(QStringLiteral("complete"));
+    // a page without results or cursor can't lead anywhere, whatever the server says
+    d->complete = complete == QLatin1String("true") || complete == QLatin1String("1") || count == 0
+        || first.isEmpty();
+    bool done = d->complete || (d->mamMaxMessages > 0 && d->messagesFetched >= d->mamMaxMessages);
+
+    QPointer<MAMTask> self(this);
+    emit page(results);
+    if (!self)
+        return true;
+
+    if (done)
+        setSuccess();
+    else if (!d->paused)
+        d->getPage(this);
+
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MAMSync
+//----------------------------------------------------------------------------
+namespace {
+// asks for the first and the last message of an archive
+class MAMMetadataTask : public Task {
+public:
+    Jid       archive;
+    QDateTime start;
+    QDateTime end;
 
-        // TODO: only save messages directed at the correct resource?
-        d->archive.append(x);
-        d->lastArchiveID = x.attribute(QLatin1String("id"));
-        d->messagesFetched = d->messagesFetched + 1;
+    MAMMetadataTask(Task *parent, const Jid &archive) : Task(parent), archive(archive) { }
+
+    void onGo() override
+    {
+        QDomElement iq = createIQ(doc(), QStringLiteral("get"), archive.full(), id());
+        iq.appendChild(doc()->createElementNS(XMPP_MAM_NAMESPACE, QStringLiteral("metadata")));
+        send(iq);
+    }
 
-        // Check if we are done
-        if (x.attribute(QLatin1String("id")) == d->lastID || d->messagesFetched >= d->mamMaxMessages) {
+    bool take(const QDomElement &x) override
+    {
+        if (!iqVerify(x, archive, id()))
+            return false;
+
+        if (x.attribute(QStringLiteral("type")) == QLatin1String("result")) {
+            QDomElement m = x.firstChildElement(QStringLiteral("metadata"));
+            QString     s = m.firstChildElement(QStringLiteral("start")).attribute(QStringLiteral("timestamp"));
+            QString     e = m.firstChildElement(QStringLiteral("end")).attribute(QStringLiteral("timestamp"));
+            start         = QDateTime::fromString(s, Qt::ISODate);
+            end           = QDateTime::fromString(e, Qt::ISODate);
             setSuccess();
-        } else if (d->messagesFetched % d->mamPageSize == 0) { 
-            d->getPage(this);
+        } else {
+            setError(x);
         }
-        // TODO: handle server not sending all MAM stuff gracefully (such as handling 0 messagesFetched)
-    } else {
-        if(!iqVerify(x, QString(), id())) return false;
+        return true;
+    }
+};
+}
 
-        if(x.elementsByTagName(QLatin1String("start")).at(0).isNull() || x.elementsByTagName(QLatin1String("end")).at(0).isNull() ) return false;
+class MAMSync::Private {
+public:
+    struct Slice {
+        QDateTime          from;
+        QDateTime          to;
+        QPointer<MAMTask>  task;
+        QList<QDomElement> buffered; // fetched before it was this slice's turn
+        bool               done = false;
+    };
+
+    MAMSync                  *q;
+    Client                   *client;
+    int                       maxQueries  = 3;
+    int                       pageSize    = 50;
+    int                       maxBuffered = 1000;
+    Jid                       archive;
+    Jid                       with;
+    bool                      allowMUCArchives = true;
+    QList<Slice>              slices;
+    int                       head     = 0; // the oldest slice not delivered completely
+    int                       next     = 0; // the next slice to start
+    int                       running  = 0;
+    int                       buffered = 0;
+    int                       fetched  = 0;
+    bool                      active   = false;
+    bool                      success  = false;
+    QPointer<MAMMetadataTask> metadata;
+    MessageIdIndex           *index    = nullptr;
+    MAMCursorStore           *cursors  = nullptr;
+    bool                      tracking = false; // syncNewer(), the cursor follows what is emitted
+    QString                   afterID;          // the cursor, for the first slice
+
+    Private(MAMSync *q, Client *client) : q(q), client(client) { }
+
+    void split(const QDateTime &from, const QDateTime &to)
+    {
+        slices.clear();
+        if (!from.isValid() || !to.isValid() || from.msecsTo(to) < 2 * MAM_MIN_SLICE) {
+            slices.append({ from, to, {}, {}, false });
+            return;
+        }
 
-        if(d->backwards) {
-            d->lastID = x.elementsByTagName(QLatin1String("start")).at(0).toElement().attribute(QLatin1String("id"));
-            d->firstID = x.elementsByTagName(QLatin1String("end")).at(0).toElement().attribute(QLatin1String("id"));
-        } else {
-            d->firstID = x.elementsByTagName(QLatin1String("start")).at(0).toElement().attribute(QLatin1String("id"));
-            d->lastID = x.elementsByTagName(QLatin1String("end")).at(0).toElement().attribute(QLatin1String("id"));
+        qint64 span  = from.msecsTo(to);
+        qint64 count = qMin<qint64>(maxQueries * MAM_SLICES_PER_QUERY, span / MAM_MIN_SLICE);
+        qint64 step  = span / count;
+        for (qint64 n = 0; n < count; ++n) {
+            QDateTime sliceTo = n + 1 == count ? to : from.addMSecs((n + 1) * step - 1); // the end is inclusive
+            slices.append({ from.addMSecs(n * step), sliceTo, {}, {}, false });
         }
-        d->getPage(this);
-        d->metadataFetched = true;
     }
 
-    return true;
+    void startSlices()
+    {
+        while (running < maxQueries && next < slices.size() && (next == head || buffered < maxBuffered))
+            startSlice(next++);
+    }
+
+    void startSlice(int index)
+    {
+        Slice   &s = slices[index];
+        MAMTask *t = new MAMTask(client->rootTask());
+        t->setArchive(archive);
+        t->setMessageIdIndex(this->index);
+        if (index == 0)
+            t->setAfterId(afterID);
+        t->get(with, s.from, s.to, allowMUCArchives, pageSize, 0, false, false);
+        QObject::connect(t, &MAMTask::page, q, [this, index](const QList<QDomElement> &results) {
+            pageReceived(index, results);
+        });
+        QObject::connect(t, &Task::finished, q, [this, index, t]() { sliceFinished(index, t); });
+        s.task = t;
+        ++running;
+        t->go(true);
+    }
+
+    void pageReceived(int index, const QList<QDomElement> &results)
+    {
+        fetched += results.size();
+        if (index == head) {
+            if (!results.isEmpty())
+                deliver(results);
+            return;
+        }
+
+        slices[index].buffered += results;
+        buffered += results.size();
+        if (buffered >= maxBuffered) {
+            for (int n = head + 1; n < next; ++n) {
+                if (slices[n].task)
+                    slices[n].task->pause();
+            }
+        }
+    }
+
+    void sliceFinished(int index, MAMTask *t)
+    {
+        --running;
+        slices[index].task = nullptr;
+        if (!t->success()) {
+            // the cursor may be gone from the archive meanwhile, then the stamp has to do
+            if (index == 0 && !afterID.isEmpty() && t->messagesFetched() == 0) {
+                afterID.clear();
+                startSlice(0);
+                return;
+            }
+            finish(false);
+            return;
+        }
+
+        slices[index].done = true;
+        if (index == head && !advance())
+            return;
+        startSlices();
+        if (head == slices.size())
+            finish(true);
+    }
+
+    // moves the head over the completed slices, delivering what they have buffered. false if we are gone
+    bool advance()
+    {
+        QPointer<MAMSync> self(q);
+        while (head < slices.size() && slices[head].done) {
+            ++head;
+            if (head == slices.size())
+                break;
+
+            Slice             &s       = slices[head];
+            QList<QDomElement> results = std::move(s.buffered);
+            s.buffered.clear();
+            buffered -= results.size();
+            if (!results.isEmpty()) {
+                deliver(results);
+                if (!self || !active)
+                    return false;
+            }
+        }
+
+        for (int n = head; n < next; ++n) {
+            if (slices[n].task && (n == head || buffered < maxBuffered))
+                slices[n].task->resume();
+        }
+        return true;
+    }
+
+    // they are the next ones in order. the cursor moves once they are taken care of
+    void deliver(const QList<QDomElement> &results)
+    {
+        MAMCursorStore        *store = tracking ? cursors : nullptr;
+        MAMCursorStore::Cursor cursor;
+        Jid                    of = archive;
+        if (store) {
+            const QDomElement &last = results.last();
+            QDomElement        delay
+                = last.firstChildElement(QStringLiteral("forwarded")).firstChildElement(QStringLiteral("delay"));
+            qint64 stamp;
+            cursor.id = last.attribute(QStringLiteral("id"));
+            if (stamp2msecs(delay.attribute(QStringLiteral("stamp")), &stamp))
+                cursor.timeStamp = QDateTime::fromMSecsSinceEpoch(stamp);
+        }
+
+        emit q->messages(results);
+        if (store && !cursor.isNull())
+            store->setCursor(of, cursor);
+    }
+
+    void begin(const QDateTime &from, const QDateTime &to)
+    {
+        active  = true;
+        success = false;
+        fetched = 0;
+
+        if (from.isValid() && to.isValid()) {
+            split(from, to);
+            startSlices();
+            return;
+        }
+
+        auto t   = new MAMMetadataTask(client->rootTask(), archive);
+        metadata = t;
+        QObject::connect(t, &Task::finished, q, [this, t, from, to]() {
+            metadata = nullptr;
+            if (t->success() && !t->start.isValid()) {
+                finish(true); // the archive is empty
+                return;
+            }
+            // without metadata support the range stays open and is fetched by one query
+            QDateTime start = from.isValid() ? from : t->start;
+            QDateTime end   = to.isValid() ? to : t->end;
+            if (t->success() && !to.isValid())
+                end = end.addSecs(1); // timestamps may be truncated
+            split(start, end);
+            startSlices();
+        });
+        t->go(true);
+    }
+
+    void cancel()
+    {
+        for (Slice &s : slices) {
+            if (s.task) {
+                s.task->disconnect(q);
+                s.task->safeDelete();
+            }
+        }
+        if (metadata) {
+            metadata->disconnect(q);
+            metadata->safeDelete();
+        }
+        slices.clear();
+        head = next = running = buffered = 0;
+    }
+
+    void finish(bool ok)
+    {
+        cancel();
+        active  = false;
+        success = ok;
+        emit q->finished();
+    }
+};
+
+MAMSync::MAMSync(Client *client, QObject *parent) : QObject(parent), d(new Private(this, client)) { }
+
+MAMSync::~MAMSync()
+{
+    d->cancel();
+    delete d;
+}
+
+void MAMSync::setMaxQueries(int count) { d->maxQueries = qMax(1, count); }
+
+void MAMSync::setPageSize(int size) { d->pageSize = qMax(1, size); }
+
+void MAMSync::setMaxBuffered(int count) { d->maxBuffered = qMax(0, count); }
+
+void MAMSync::setMessageIdIndex(MessageIdIndex *index) { d->index = index; }
+
+void MAMSync::setCursorStore(MAMCursorStore *store) { d->cursors = store; }
+
+void MAMSync::start(const Jid &archive, const Jid &with, const QDateTime &from, const QDateTime &to,
+                    bool allowMUCArchives)
+{
+    d->cancel();
+    d->archive          = archive;
+    d->with             = with;
+    d->allowMUCArchives = allowMUCArchives;
+    d->tracking         = false;
+    d->afterID.clear();
+    d->begin(from, to);
 }
+
+void MAMSync::syncNewer(const Jid &archive, bool allowMUCArchives)
+{
+    MAMCursorStore::Cursor cursor;
+    if (d->cursors)
+        cursor = d->cursors->cursor(archive);
+
+    d->cancel();
+    d->archive          = archive;
+    d->with             = Jid();
+    d->allowMUCArchives = allowMUCArchives;
+    d->tracking         = true;
+    d->afterID          = cursor.id;
+    // the stamp lets the range be sliced, the id makes the first slice start exactly after the cursor
+    d->begin(cursor.timeStamp, QDateTime());
+}
+
+void MAMSync::stop()
+{
+    if (!d->active)
+        return;
+    d->cancel();
+    d->active = false;
+}
+
+bool MAMSync::isActive() const { return d->active; }
+
+bool MAMSync::success() const { return d->success; }
+
+int MAMSync::messagesFetched() const { return d->fetched; }
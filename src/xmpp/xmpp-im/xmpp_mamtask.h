@@ -20,37 +20,128 @@
 #ifndef XMPP_MAM_TASK_H
 #define XMPP_MAM_TASK_H
 
-#include "xmpp_subsets.h"
-#include "xmpp_task.h"
-#include "xmpp_xdata.h"
-#include "xmpp_xmlcommon.h"
 #include "xmpp/jid/jid.h"
+#include "xmpp_task.h"
 
 #include <QDateTime>
+#include <QDomElement>
+#include <QList>
+#include <QObject>
 
 #define XMPP_MAM_NAMESPACE QLatin1String("urn:xmpp:mam:2")
 
-class QDomElement;
-class QString;
-
 namespace XMPP {
-class Jid;
+class Client;
+class MessageIdIndex;
+
+/*
+ * Where the last sync of each archive ended: the archive id of the newest result delivered and its stamp, see
+ * MAMSync::syncNewer(). Kept in memory, reimplement saveData() and loadData() to make it persistent.
+ */
+class MAMCursorStore {
+public:
+    struct Cursor {
+        QString   id;
+        QDateTime timeStamp;
+
+        bool isNull() const { return id.isEmpty(); }
+    };
+
+    MAMCursorStore();
+    virtual ~MAMCursorStore();
 
+    Cursor cursor(const Jid &archive) const;
+    void   setCursor(const Jid &archive, const Cursor &cursor);
+    void   clear(const Jid &archive);
+
+protected:
+    virtual void       saveData(const QByteArray &data);
+    virtual QByteArray loadData();
+
+private:
+    class Private;
+    Private *d = nullptr;
+
+    void load() const;
+    void save();
+};
+
+/*
+ * One archive query, fetched page by page. Every page is emitted as soon as its <fin/> arrives and is not
+ * kept afterwards, so the memory used doesn't grow with the size of the archive.
+ */
 class MAMTask : public Task {
     Q_OBJECT
 public:
     MAMTask(Task *);
     ~MAMTask();
 
-    const QList<QDomElement> &archive() const;
+    // the archive to query, e.g. a room. our own one if not set
+    void setArchive(const Jid &archive);
+    // not owned. results already in the index are dropped, the others are added to it
+    void setMessageIdIndex(MessageIdIndex *index);
+    // the first page starts right after this archive id. forward only, get() with backwards false
+    void setAfterId(const QString &id);
 
-    void get(const Jid &j, const QDateTime &from = QDateTime(), const QDateTime &to = QDateTime(),
-             const bool allowMUCArchives = true, int mamPageSize = 10, int mamMaxMessages = 100, bool flipPages = true,
+    // with is the conversation partner to filter by (may be empty). mamMaxMessages is the total, 0 for all
+    void get(const Jid &with, const QDateTime &from = QDateTime(), const QDateTime &to = QDateTime(),
+             bool allowMUCArchives = true, int mamPageSize = 10, int mamMaxMessages = 100, bool flipPages = true,
              bool backwards = true);
 
+    // flow control. a paused task finishes the page in flight but doesn't request the next one
+    void pause();
+    void resume();
+    bool isPaused() const;
+
+    int  messagesFetched() const;
+    bool isComplete() const; // the server has nothing more in the range. false if mamMaxMessages was reached
+
     void onGo();
     bool take(const QDomElement &);
 
+signals:
+    // the <result/> elements of one page in the order the server sent them
+    void page(const QList<QDomElement> &results);
+
+private:
+    class Private;
+    Private *d;
+};
+
+/*
+ * Syncs a time range of an archive with several queries in flight. The range is cut into disjoint slices,
+ * each one fetched by its own MAMTask, and the results are emitted oldest first as soon as they are next in
+ * order. Slices which get ahead are buffered up to setMaxBuffered() messages, then they wait for the
+ * older ones to catch up.
+ */
+class MAMSync : public QObject {
+    Q_OBJECT
+public:
+    MAMSync(Client *client, QObject *parent = nullptr);
+    ~MAMSync();
+
+    void setMaxQueries(int count); // in flight at once. default 3
+    void setPageSize(int size);    // default 50
+    void setMaxBuffered(int count);
+    void setMessageIdIndex(MessageIdIndex *index); // see MAMTask
+    void setCursorStore(MAMCursorStore *store);    // not owned, see syncNewer()
+
+    // without from and to the bounds of the archive are asked first
+    void start(const Jid &archive, const Jid &with, const QDateTime &from = QDateTime(),
+               const QDateTime &to = QDateTime(), bool allowMUCArchives = true);
+    // what the archive got after its cursor in the store, the whole archive if it has none. the cursor follows
+    // the results as they are emitted, so a sync stopped midway goes on from there the next time
+    void syncNewer(const Jid &archive, bool allowMUCArchives = true);
+    void stop();
+
+    bool isActive() const;
+    bool success() const;
+    int  messagesFetched() const;
+
+signals:
+    void messages(const QList<QDomElement> &results);
+    void finished();
+
 private:
     class Private;
     Private *d;
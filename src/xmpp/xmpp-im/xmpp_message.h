@@ -246,7 +246,7 @@ public:
     Stanza toStanza(Stream *stream) const;
     bool   fromStanza(const Stanza &s);
     bool   fromStanza(const Stanza &s, int tzoffset);
-    bool   fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOffset);
+    bool   fromStanza(const Stanza &s, bool useTimeZoneOffset, int timeZoneOffset, bool onDemand = false);
 
 private:
     class Private;
@@ -23,7 +23,10 @@
 #include "xmpp/jid/jid.h"
 
 #include <QDomElement>
+#include <QHash>
+#include <QList>
 #include <QString>
+#include <QStringList>
 
 namespace XMPP {
 class MUCItem {
@@ -133,6 +136,39 @@ private:
     Jid     jid_;
     QString reason_;
 };
+
+// what is kept of an occupant. the x-muc-user item is only parsed once, when its presence comes
+struct MUCOccupant {
+    QString              nick;
+    Jid                  jid; // real jid, if the room tells it
+    MUCItem::Affiliation affiliation = MUCItem::UnknownAffiliation;
+    MUCItem::Role        role        = MUCItem::UnknownRole;
+};
+
+/*
+ * The occupants of one room, by nick and by real jid. Both lookups are constant time, so it's fine for
+ * rooms with thousands of occupants.
+ */
+class MUCOccupants {
+public:
+    // from a presence of room@host/nick. item is the x-muc-user item, if there was one
+    void update(const QString &nick, bool available, const MUCItem &item = MUCItem());
+    void clear();
+
+    int  count() const;
+    bool contains(const QString &nick) const;
+    // nullptr if there is no such occupant. valid until the next update()
+    const MUCOccupant *occupant(const QString &nick) const;
+    // nicks used by a real jid. a bare jid matches all its resources
+    QStringList        nicks(const Jid &jid) const;
+    QList<MUCOccupant> occupants() const;
+
+private:
+    void unlinkJid(const MUCOccupant &o);
+
+    QHash<QString, MUCOccupant>  byNick_;
+    QMultiHash<QString, QString> byJid_; // bare real jid -> nick
+};
 } // namespace XMPP
 
 #endif // XMPP_MUC_H
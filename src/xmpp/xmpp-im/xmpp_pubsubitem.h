@@ -19,10 +19,15 @@
 #ifndef XMPP_PUBSUBITEM_H
 #define XMPP_PUBSUBITEM_H
 
+#include "xmpp/jid/jid.h"
+
 #include <QDomElement>
 #include <QString>
+#include <QStringList>
 
 namespace XMPP {
+class Message;
+
 class PubSubItem {
 public:
     PubSubItem();
@@ -34,6 +39,44 @@ private:
     QString     id_;
     QDomElement payload_;
 };
+
+/*
+ * The last known PEP items by owner, node and item id, so the ones sent again with every +notify (e.g. after
+ * a reconnect) can be told from real changes. Payloads are kept serialized and parsed only when asked for.
+ * Reimplement saveData() and loadData() to keep it between sessions.
+ */
+class PEPCache {
+public:
+    PEPCache();
+    virtual ~PEPCache();
+
+    // false if the item is known with the same payload
+    bool update(const Jid &owner, const QString &node, const PubSubItem &item);
+    // false if the item isn't known
+    bool retract(const Jid &owner, const QString &node, const QString &id);
+    // the items and retractions of a pubsub event. false if nothing has changed then
+    bool apply(const Message &m);
+
+    QStringList items(const Jid &owner, const QString &node) const;
+    bool        contains(const Jid &owner, const QString &node, const QString &id) const;
+    // sha1 of the serialized payload. empty if the item isn't known
+    QByteArray  tag(const Jid &owner, const QString &node, const QString &id) const;
+    // parsed from the stored copy on each call
+    QDomElement payload(const Jid &owner, const QString &node, const QString &id) const;
+    void        clear(const Jid &owner);
+    void        clear();
+
+protected:
+    virtual void       saveData(const QByteArray &data);
+    virtual QByteArray loadData();
+
+private:
+    class Private;
+    Private *d = nullptr;
+
+    void load() const;
+    void save();
+};
 } // namespace XMPP
 
 #endif // XMPP_PUBSUBITEM_H
@@ -21,9 +21,9 @@
 
 #include "xmpp_resource.h"
 
+#include <QHash>
 #include <QList>
-
-class QString;
+#include <QString>
 
 namespace XMPP {
 class ResourceList : public QList<Resource> {
@@ -32,10 +32,36 @@ public:
     ~ResourceList();
 
     ResourceList::Iterator find(const QString &);
-    ResourceList::Iterator priority();
+    ResourceList::Iterator priority(); // the highest one, of those the one with the latest presence
 
     ResourceList::ConstIterator find(const QString &) const;
     ResourceList::ConstIterator priority() const;
+
+    // use this rather than setting it through the iterator, priority() doesn't scan for every presence and won't
+    // notice a status changed behind the list's back until the size changes
+    void setStatus(ResourceList::Iterator it, const Status &s);
+
+    // these keep the name index in sync. other modifications are detected on lookup when the size changes
+    ResourceList          &operator+=(const Resource &r);
+    void                   append(const Resource &r);
+    ResourceList::Iterator erase(ResourceList::Iterator it);
+    ResourceList::Iterator erase(ResourceList::Iterator begin, ResourceList::Iterator end);
+    void                   removeAt(int i);
+    void                   clear();
+
+private:
+    int  position(const QString &name) const;
+    void rebuildIndex() const;
+    int  highest() const;
+    void noteSeen(int n);
+
+    mutable QHash<QString, int> v_index; // name -> position, only for lists long enough to be worth it
+    mutable int                 v_indexedSize = -1;
+
+    QHash<QString, quint64> v_seen;             // name -> order of its last presence, breaking the priority ties
+    quint64                 v_clock       = 0;  // last of v_seen
+    mutable int             v_highest     = -1; // position of priority(), -1 for unknown
+    mutable int             v_highestSize = -1; // size() back then
 };
 } // namespace XMPP
 
@@ -43,10 +43,41 @@ public:
     void    setGroupsDelimiter(const QString &groupsDelimiter);
     QString groupsDelimiter() const;
 
+    // XEP-0237. the ver attribute of the result or push this came with
+    void    setVersion(const QString &version);
+    QString version() const;
+
 private:
     class Private;
     Private *d = nullptr;
 };
+
+/*
+ * Keeps the last known roster and its version between sessions, so a server with roster versioning (XEP-0237)
+ * sends only what has changed since. Reimplement saveData() and loadData() to make it persistent.
+ * Client keeps it up to date with the roster results and pushes.
+ */
+class RosterStore {
+public:
+    RosterStore();
+    virtual ~RosterStore();
+
+    Roster roster() const; // roster().version() is what to ask the server with
+    void   setRoster(const Roster &r);
+    void   applyPush(const Roster &r);
+    void   clear();
+
+protected:
+    virtual void       saveData(const QByteArray &data);
+    virtual QByteArray loadData();
+
+private:
+    class Private;
+    Private *d = nullptr;
+
+    void load() const;
+    void save();
+};
 } // namespace XMPP
 
 #endif // XMPP_ROSTER_H
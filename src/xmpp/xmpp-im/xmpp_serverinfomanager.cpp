@@ -23,7 +23,18 @@
 #include "xmpp_client.h"
 #include "xmpp_tasks.h"
 
+#include <QDomDocument>
+
+// disco#info requests to services at once
+#define SERVICES_MAX_INFO_QUERIES 5
+
 namespace XMPP {
+ServerInfoStore::~ServerInfoStore() { }
+
+void ServerInfoStore::saveData(const QByteArray &data) { Q_UNUSED(data) }
+
+QByteArray ServerInfoStore::loadData() { return QByteArray(); }
+
 ServerInfoManager::ServerInfoManager(Client *client) : QObject(client), _client(client), _canMessageCarbons(false)
 {
     deinitialize();
@@ -71,8 +82,19 @@ const QString &ServerInfoManager::multicastService() const { return _multicastSe
 
 bool ServerInfoManager::canMessageCarbons() const { return _canMessageCarbons; }
 
+QStringList ServerInfoManager::services() const { return _servicesInfo.keys(); }
+
+void ServerInfoManager::setStore(ServerInfoStore *store) { _store = store; }
+
 void ServerInfoManager::queryServicesList()
 {
+    if (loadServices()) {
+        _servicesListState = ST_Ready;
+        emit servicesChanged();
+        checkPendingServiceQueries();
+        return;
+    }
+
     _servicesListState = ST_InProgress;
     auto jtitems       = new JT_DiscoItems(_client->rootTask());
     connect(
@@ -84,9 +106,11 @@ void ServerInfoManager::queryServicesList()
                 for (const auto &item : jtitems->items()) {
                     _servicesInfo.insert(item.jid().full(), { ST_NotQueried, item, QMap<QString, QVariant>() });
                 }
+                saveServices();
             } else {
                 _servicesListState = ST_Failed;
             }
+            emit servicesChanged();
             checkPendingServiceQueries();
         },
         Qt::QueuedConnection);
@@ -189,15 +213,19 @@ void ServerInfoManager::checkPendingServiceQueries()
             // if we a here then service info state is either not-queried or in-progress
             Q_ASSERT(si->state == ST_NotQueried || si->state == ST_InProgress);
             hasInProgress = true;
-            if (si->state == ST_NotQueried) { // if not queried then let's query
+            // if not queried then let's query. the rest waits for a free slot
+            if (si->state == ST_NotQueried && _infoQueries < SERVICES_MAX_INFO_QUERIES) {
                 si->state   = ST_InProgress;
                 auto jtinfo = new JT_DiscoInfo(_client->rootTask());
+                ++_infoQueries;
                 connect(jtinfo, &DiscoInfoTask::finished, this, [this, jtinfo]() {
-                    auto si = _servicesInfo.find(jtinfo->jid().full());
+                    _infoQueries = qMax(0, _infoQueries - 1);
+                    auto si      = _servicesInfo.find(jtinfo->jid().full());
                     if (si != _servicesInfo.end()) {
                         if (jtinfo->success()) {
                             si.value().state = ST_Ready;
                             si.value().item  = jtinfo->item();
+                            saveServices();
                         } else {
                             si.value().state = ST_Failed;
                         }
@@ -239,9 +267,64 @@ void ServerInfoManager::appendQuery(ServiceInfoQuery *q)
     }
     if (_servicesListState == ST_NotQueried || _servicesListState == ST_Failed) {
         queryServicesList();
-    } else { // ready
-        checkPendingServiceQueries();
+    } else { // ready. maybe everything is known already, but the caller has to connect first
+        QMetaObject::invokeMethod(this, &ServerInfoManager::checkPendingServiceQueries, Qt::QueuedConnection);
+    }
+}
+
+bool ServerInfoManager::loadServices()
+{
+    const QString ver = _client->serverCaps().version();
+    if (!_store || ver.isEmpty())
+        return false;
+
+    QDomDocument doc;
+    if (!doc.setContent(_store->loadData(), true))
+        return false;
+    QDomElement root = doc.documentElement();
+    if (root.tagName() != QLatin1String("services") || root.attribute(QLatin1String("ver")) != ver
+        || root.attribute(QLatin1String("domain")) != _client->jid().domain())
+        return false;
+
+    _servicesInfo.clear();
+    for (QDomElement e = root.firstChildElement(QLatin1String("service")); !e.isNull();
+         e = e.nextSiblingElement(QLatin1String("service"))) {
+        QDomElement info = e.firstChildElement(QLatin1String("query"));
+        ServiceInfo si { ST_NotQueried, info.isNull() ? DiscoItem() : DiscoItem::fromDiscoInfoResult(info), {} };
+        if (!info.isNull())
+            si.state = ST_Ready;
+        si.item.setJid(Jid(e.attribute(QLatin1String("jid"))));
+        si.item.setNode(e.attribute(QLatin1String("node")));
+        si.item.setName(e.attribute(QLatin1String("name")));
+        _servicesInfo.insert(si.item.jid().full(), si);
+    }
+    return true;
+}
+
+void ServerInfoManager::saveServices()
+{
+    const QString ver = _client->serverCaps().version();
+    if (!_store || ver.isEmpty())
+        return;
+
+    QDomDocument doc;
+    QDomElement  root = doc.createElement(QLatin1String("services"));
+    root.setAttribute(QLatin1String("domain"), _client->jid().domain());
+    root.setAttribute(QLatin1String("ver"), ver);
+    doc.appendChild(root);
+    for (auto it = _servicesInfo.cbegin(); it != _servicesInfo.cend(); ++it) {
+        const ServiceInfo &si = it.value();
+        QDomElement        e  = doc.createElement(QLatin1String("service"));
+        e.setAttribute(QLatin1String("jid"), it.key());
+        if (!si.item.node().isEmpty())
+            e.setAttribute(QLatin1String("node"), si.item.node());
+        if (!si.item.name().isEmpty())
+            e.setAttribute(QLatin1String("name"), si.item.name());
+        if (si.state == ST_Ready) // failed ones are asked again next time
+            e.appendChild(si.item.toDiscoInfoResult(&doc));
+        root.appendChild(e);
     }
+    _store->saveData(doc.toString(-1).toUtf8());
 }
 
 ServiceInfoQuery *ServerInfoManager::queryServiceInfo(const QString &category, const QString &type,
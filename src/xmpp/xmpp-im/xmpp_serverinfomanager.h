@@ -68,6 +68,20 @@ signals:
     void finished(const QList<DiscoItem> &item);
 };
 
+/*
+ * Where ServerInfoManager keeps the services of the server between sessions. It is used as long as the caps
+ * version of the server stays the same.
+ */
+class ServerInfoStore {
+public:
+    virtual ~ServerInfoStore();
+
+protected:
+    friend class ServerInfoManager;
+    virtual void       saveData(const QByteArray &data);
+    virtual QByteArray loadData();
+};
+
 class ServerInfoManager : public QObject {
     Q_OBJECT
 public:
@@ -113,6 +127,10 @@ public:
                                        ServiceInfoQuery::Options options);
     void              setServiceMeta(const Jid &service, const QString &key, const QVariant &value);
     QVariant          serviceMeta(const Jid &service, const QString &key);
+    // jids of the items of the server disco. servicesChanged() tells when they are known
+    QStringList       services() const;
+    // not owned. with a store the services and their disco#info are asked only when the server caps change
+    void              setStore(ServerInfoStore *store);
 
 signals:
     void featuresChanged();
@@ -130,6 +148,8 @@ private:
     void checkPendingServiceQueries();
     void appendQuery(ServiceInfoQuery *q);
     void finish(ServiceInfoQuery *q, const QList<DiscoItem> &items = {});
+    bool loadServices();
+    void saveServices();
 
 private:
     XMPP::Client              *_client = nullptr;
@@ -143,6 +163,8 @@ private:
     ServicesState                 _servicesListState = ST_NotQueried;
     QMap<QString, ServiceInfo>
         _servicesInfo; // all the diso#info requests for services of this server jid=>(state,info)
+    int              _infoQueries = 0; // disco#info in flight
+    ServerInfoStore *_store       = nullptr;
 
     bool _featuresRequested    = false;
     bool _hasPEP               = false;
@@ -164,7 +164,11 @@ bool SubsetsClientManager::isLast() const { return d->result.last; }
 
 int SubsetsClientManager::count() const { return d->result.count; }
 
+int SubsetsClientManager::firstIndex() const { return d->result.index; }
+
 void SubsetsClientManager::setMax(int max) { d->query.max = max; }
+
+void SubsetsClientManager::setIndex(int index) { d->query.index = index; }
 void SubsetsClientManager::setFirstID(const QString& a) { d->result.firstId = a; }
 void SubsetsClientManager::setLastID(const QString& a) { d->result.lastId = a; }
 
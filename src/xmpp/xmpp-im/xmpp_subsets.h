@@ -21,6 +21,11 @@
 #define XMPP_SUBSETS_H
 
 #include <QDomDocument>
+#include <QList>
+
+#include <functional>
+#include <map>
+#include <memory>
 
 namespace XMPP {
 class SubsetsClientManager {
@@ -33,7 +38,9 @@ public:
     bool isFirst() const;
     bool isLast() const;
     int  count() const;
+    int  firstIndex() const; // of the first item of the last result, -1 if not told
     void setMax(int max);
+    void setIndex(int index); // for getByIndex()
     void setFirstID(const QString&);
     void setLastID(const QString&);
 
@@ -52,6 +59,178 @@ private:
     class Private;
     Private *d;
 };
+
+/*
+ * Walks a result set page by page for whatever the request callback sends with the query it's given, e.g. a
+ * JT_DiscoItems with includeSubsetQuery() and extractSubsetInfo(). The next page is asked as soon as one
+ * arrives, so it's on its way while the current one is consumed, until setMaxBuffered() items wait to be
+ * taken. If the first reply tells the index of its first item and the count, the rest is asked by index with
+ * up to setParallel() requests at once. Either way the pages come out of takePage() in order.
+ */
+template <typename T> class SubsetsPager {
+public:
+    // to be called once with the reply, after giving its set element to rsm.updateFromElement()
+    using Done    = std::function<void(bool ok, const QList<T> &items)>;
+    using Request = std::function<void(SubsetsClientManager &rsm, const Done &done)>;
+
+    SubsetsPager(const Request &request) : s(std::make_shared<State>()) { s->request = request; }
+
+    void setPageSize(int max) { s->pageSize = qMax(max, 1); } // default 50
+    // default 500. the pages in flight count as full ones
+    void setMaxBuffered(int items) { s->maxBuffered = qMax(items, 1); }
+    void setParallel(int count) { s->parallel = qMax(count, 1); } // default 1
+    // a page can be taken or it's finished. may come from within start() and takePage()
+    void setReadyCallback(const std::function<void()> &ready) { s->ready = ready; }
+
+    void start()
+    {
+        stop();
+        s->started = true;
+        s->rsm.reset();
+        s->rsm.setMax(s->pageSize);
+        s->rsm.getFirst();
+        issue(s, std::shared_ptr<SubsetsClientManager>());
+    }
+
+    // the replies still on their way are ignored
+    void stop()
+    {
+        auto old       = s;
+        s              = std::make_shared<State>();
+        s->request     = old->request;
+        s->ready       = old->ready;
+        s->pageSize    = old->pageSize;
+        s->maxBuffered = old->maxBuffered;
+        s->parallel    = old->parallel;
+    }
+
+    bool hasPage() const
+    {
+        auto it = s->pages.find(s->taken);
+        return it != s->pages.end() && it->second.arrived;
+    }
+
+    QList<T> takePage()
+    {
+        if (!hasPage())
+            return QList<T>();
+        auto     it    = s->pages.find(s->taken);
+        QList<T> items = it->second.items;
+        s->pages.erase(it);
+        s->buffered -= int(items.size());
+        ++s->taken;
+        pump(s);
+        return items;
+    }
+
+    // everything was taken, or a request failed
+    bool isFinished() const { return s->started && (s->failed || (s->complete && s->pages.empty())); }
+    bool isError() const { return s->failed; }
+    int  received() const { return s->received; } // items so far
+    int  count() const { return s->count; }       // as the server told, -1 if it didn't
+
+private:
+    struct Page {
+        QList<T> items;
+        bool     arrived = false;
+    };
+
+    struct State {
+        Request               request;
+        std::function<void()> ready;
+        int                   pageSize    = 50;
+        int                   maxBuffered = 500;
+        int                   parallel    = 1;
+        SubsetsClientManager  rsm;          // for after= of the next page
+        std::map<int, Page>   pages;        // by sequence, not taken yet. the ones in flight too
+        int                   issued   = 0; // sequence of the next request
+        int                   taken    = 0; // of the next page for takePage()
+        int                   inFlight = 0;
+        int                   buffered = 0; // items arrived and not taken
+        int                   received = 0;
+        int                   count    = -1;
+        int                   index    = -1; // of the next page, when asking by index
+        bool                  started  = false;
+        bool                  complete = false; // nothing more to ask
+        bool                  failed   = false;
+    };
+
+    std::shared_ptr<State> s;
+
+    static bool canIssue(const std::shared_ptr<State> &st)
+    {
+        if (!st->started || st->complete || st->failed)
+            return false;
+        if (st->buffered + st->inFlight * st->pageSize >= st->maxBuffered)
+            return false;
+        return st->index == -1 ? st->inFlight == 0 : st->inFlight < st->parallel;
+    }
+
+    static void pump(const std::shared_ptr<State> &st)
+    {
+        while (canIssue(st)) {
+            if (st->index == -1) {
+                st->rsm.getNext();
+                issue(st, std::shared_ptr<SubsetsClientManager>());
+            } else {
+                auto rsm = std::make_shared<SubsetsClientManager>();
+                rsm->setMax(st->pageSize);
+                rsm->setIndex(st->index);
+                rsm->getByIndex();
+                st->index += st->pageSize;
+                if (st->count != -1 && st->index >= st->count)
+                    st->complete = true;
+                issue(st, rsm);
+            }
+        }
+    }
+
+    // without own rsm it's the next one of the chain in st->rsm
+    static void issue(const std::shared_ptr<State> &st, std::shared_ptr<SubsetsClientManager> own)
+    {
+        int seq = st->issued++;
+        st->pages[seq];
+        ++st->inFlight;
+        std::weak_ptr<State> weak = st;
+        st->request(own ? *own : st->rsm, [weak, own, seq](bool ok, const QList<T> &items) {
+            if (auto st = weak.lock())
+                arrived(st, own ? *own : st->rsm, seq, ok, items);
+        });
+    }
+
+    static void arrived(const std::shared_ptr<State> &st, const SubsetsClientManager &rsm, int seq, bool ok,
+                        const QList<T> &items)
+    {
+        auto it = st->pages.find(seq);
+        if (it == st->pages.end() || it->second.arrived)
+            return;
+        --st->inFlight;
+        if (!ok) {
+            st->failed = true;
+            st->pages.clear();
+        } else {
+            it->second.items   = items;
+            it->second.arrived = true;
+            st->buffered += int(items.size());
+            st->received += int(items.size());
+            if (seq == 0) {
+                st->count = rsm.count();
+                if (st->parallel > 1 && st->count != -1 && rsm.firstIndex() != -1 && !rsm.isLast()) {
+                    st->index    = rsm.firstIndex() + int(items.size());
+                    st->complete = st->index >= st->count;
+                }
+            }
+            if (items.isEmpty() || (st->index == -1 && (!rsm.isValid() || rsm.isLast())))
+                st->complete = true;
+            pump(st);
+        }
+
+        // the pages after a missing one wait for it
+        auto next = st->pages.find(st->taken);
+        if (st->ready && (st->failed || (next != st->pages.end() && next->second.arrived) || st->pages.empty()))
+            st->ready();
+    }
+};
 } // namespace XMPP
 
 #endif // XMPP_SUBSETS_H
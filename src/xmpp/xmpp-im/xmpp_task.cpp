@@ -18,14 +18,17 @@
 
 #include "xmpp_task.h"
 
+#include "metrics.h"
+#include "stallwatchdog.h"
 #include "xmpp_client.h"
 #include "xmpp_stanza.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QHash>
+#include <QPointer>
+#include <QStringList>
 #include <QTimer>
 
-#define DEFAULT_TIMEOUT 120
-
 using namespace XMPP;
 
 class Task::TaskPrivate {
@@ -42,15 +45,26 @@ public:
     bool                deleteme   = false;
     bool                autoDelete = false;
     bool                done       = false;
+    bool                timedOut   = false;
     int                 timeout    = 0;
+
+    // dispatch index of the child tasks. see Task::take()
+    QHash<QString, QPointer<Task>>                      pendingIq;    // id of sent get/set -> child
+    QMultiHash<QPair<QString, QString>, QPointer<Task>> pushHandlers; // (tag, child ns) -> child
+    QStringList                                         sentIds;      // our own entries in parent's pendingIq
+
+#ifdef IRIS_METRICS
+    QElapsedTimer lifetime;
+#endif
 };
 
 Task::Task(Task *parent) : QObject(parent)
 {
     init();
 
-    d->client = parent->client();
-    d->id     = client()->genUniqueId();
+    d->client  = parent->client();
+    d->id      = client()->genUniqueId();
+    d->timeout = d->client->taskTimeout();
     connect(d->client, SIGNAL(disconnected()), SLOT(clientDisconnected()));
 }
 
@@ -58,11 +72,19 @@ Task::Task(Client *parent, bool) : QObject(nullptr)
 {
     init();
 
-    d->client = parent;
+    d->client  = parent;
+    d->timeout = parent->taskTimeout();
     connect(d->client, SIGNAL(disconnected()), SLOT(clientDisconnected()));
 }
 
-Task::~Task() { delete d; }
+Task::~Task()
+{
+    IRIS_METRIC_ADD(TasksDestroyed, 1);
+    IRIS_METRIC_RECORD(TaskLifetimeMsecs, d->lifetime.elapsed());
+    if (parent())
+        d->client->taskDestroyed(this);
+    delete d;
+}
 
 void Task::init()
 {
@@ -72,7 +94,10 @@ void Task::init()
     d->deleteme   = false;
     d->autoDelete = false;
     d->done       = false;
-    d->timeout    = DEFAULT_TIMEOUT;
+#ifdef IRIS_METRICS
+    d->lifetime.start();
+#endif
+    IRIS_METRIC_ADD(TasksCreated, 1);
 }
 
 Task *Task::parent() const { return (Task *)QObject::parent(); }
@@ -105,6 +130,8 @@ void Task::go(bool autoDelete)
             deleteLater();
         }
     } else {
+        if (parent())
+            client()->taskStarted(this);
         onGo();
         if (d->timeout) {
             QTimer::singleShot(d->timeout * 1000, this, SLOT(timeoutFinished()));
@@ -114,6 +141,43 @@ void Task::go(bool autoDelete)
 
 bool Task::take(const QDomElement &x)
 {
+    // Try the children which most likely want the stanza first: the one that sent the request this is a
+    // reply to, and those registered for this kind of push. The tasks still verify the stanza themselves
+    // (sender, namespace etc.), so if nobody of them takes it we fall back to asking everybody.
+    QList<Task *> tried;
+    QString       tagName = x.tagName();
+    // the class is taken before, the task may be gone after
+    auto offer = [&x](Task *t) {
+        const char *name = t->metaObject()->className();
+        IRIS_STALL_WATCH(Task, QString::fromLatin1(name) + ' ' + x.tagName());
+        return t->take(x);
+    };
+    if (tagName == QLatin1String("iq") && !d->pendingIq.isEmpty()) {
+        QString type = x.attribute(QStringLiteral("type"));
+        if (type == QLatin1String("result") || type == QLatin1String("error")) {
+            QPointer<Task> t = d->pendingIq.value(x.attribute(QStringLiteral("id")));
+            if (t && t->parent() == this) {
+                if (offer(t))
+                    return true;
+                tried += t;
+            }
+        }
+    }
+    if (!d->pushHandlers.isEmpty()) {
+        const QList<QPair<QString, QString>> keys { { tagName, QString() },
+                                                    { tagName, x.firstChildElement().namespaceURI() } };
+        for (const auto &key : keys) {
+            const auto handlers = d->pushHandlers.values(key);
+            for (const QPointer<Task> &t : handlers) {
+                if (!t || t->parent() != this || tried.contains(t))
+                    continue;
+                if (offer(t))
+                    return true;
+                tried += t;
+            }
+        }
+    }
+
     const QObjectList p = children();
 
     // pass along the xml
@@ -123,7 +187,9 @@ bool Task::take(const QDomElement &x)
             continue;
 
         t = static_cast<Task *>(obj);
-        if (t->take(x)) // don't check for done here. it will hurt server tasks
+        if (tried.contains(t))
+            continue;
+        if (offer(t)) // don't check for done here. it will hurt server tasks
             return true;
     }
 
@@ -166,7 +232,33 @@ void Task::onTimeout()
     }
 }
 
-void Task::send(const QDomElement &x) { client()->send(x); }
+void Task::send(const QDomElement &x)
+{
+    // remember whom to give the reply to
+    if (parent() && x.tagName() == QLatin1String("iq")) {
+        QString type = x.attribute(QStringLiteral("type"));
+        QString id   = x.attribute(QStringLiteral("id"));
+        if (!id.isEmpty() && (type == QLatin1String("get") || type == QLatin1String("set"))) {
+            parent()->d->pendingIq.insert(id, this);
+            d->sentIds += id;
+            client()->taskWaiting(this);
+        }
+    }
+    client()->send(x);
+}
+
+void Task::send(const Stanza::Builder &b)
+{
+    if (parent() && b.isStanza() && b.kind() == Stanza::IQ) {
+        QString type = b.type();
+        if (!b.id().isEmpty() && (type == QLatin1String("get") || type == QLatin1String("set"))) {
+            parent()->d->pendingIq.insert(b.id(), this);
+            d->sentIds += b.id();
+            client()->taskWaiting(this);
+        }
+    }
+    client()->send(b);
+}
 
 void Task::setSuccess(int code, const QString &str)
 {
@@ -215,6 +307,17 @@ void Task::done()
     if (d->autoDelete)
         d->deleteme = true;
 
+    // no more replies expected
+    if (parent()) {
+        for (const QString &id : std::as_const(d->sentIds)) {
+            if (parent()->d->pendingIq.value(id) == this)
+                parent()->d->pendingIq.remove(id);
+        }
+    }
+    d->sentIds.clear();
+    if (parent())
+        client()->taskDone(this, d->timedOut);
+
     d->insig = true;
     emit finished();
     d->insig = false;
@@ -227,8 +330,11 @@ void Task::clientDisconnected() { onDisconnect(); }
 
 void Task::timeoutFinished()
 {
-    if (!d->done)
-        onTimeout();
+    if (d->done)
+        return;
+    d->timedOut = true;
+    debug(QString("no reply within %1 s, giving up").arg(d->timeout));
+    onTimeout();
 }
 
 void Task::debug(const char *fmt, ...)
@@ -242,6 +348,21 @@ void Task::debug(const char *fmt, ...)
 
 void Task::debug(const QString &str) { client()->debug(QString("%1: ").arg(metaObject()->className()) + str); }
 
+/**
+ * \brief registers this task as a handler of pushes
+ *
+ * Long-lived tasks (roster pushes, incoming messages, server side handlers) may call this to be offered the
+ * matching stanzas before the other children of the parent task. take() is still called for other stanzas too,
+ * so the task must keep checking what it gets.
+ * \param tagName the stanza tag, e.g. "iq" or "message"
+ * \param xmlns the namespace of the first child element of the stanza. empty matches any stanza with \a tagName
+ */
+void Task::registerPush(const QString &tagName, const QString &xmlns)
+{
+    if (parent())
+        parent()->d->pushHandlers.insert(qMakePair(tagName, xmlns), this);
+}
+
 /**
  * \brief verifiys a stanza is a IQ reply for this task
  *
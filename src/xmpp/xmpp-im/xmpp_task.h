@@ -65,12 +65,14 @@ protected:
     virtual void onDisconnect();
     virtual void onTimeout();
     void         send(const QDomElement &);
+    void         send(const Stanza::Builder &);
     void         setSuccess(int code = 0, const QString &str = "");
     void         setError(const QDomElement &);
     void         setError(int code = 0, const QString &str = "");
     void         debug(const char *, ...);
     void         debug(const QString &);
     bool         iqVerify(const QDomElement &x, const Jid &to, const QString &id, const QString &xmlns = "");
+    void         registerPush(const QString &tagName, const QString &xmlns = QString());
     QString      encryptionProtocol(const QDomElement &) const;
 
 private slots:
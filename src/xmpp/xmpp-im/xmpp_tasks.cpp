@@ -28,9 +28,16 @@
 #include "xmpp_vcard.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QHash>
 #include <QList>
+#include <QMutex>
+#include <QPointer>
 #include <QRegularExpression>
+#include <QSet>
 #include <QTimer>
+#include <QVarLengthArray>
+
+#include <memory>
 
 using namespace XMPP;
 
@@ -72,6 +79,7 @@ static QString lineDecode(const QString &str)
 static Roster xmlReadRoster(const QDomElement &q, bool push)
 {
     Roster r;
+    r.setVersion(q.attribute("ver"));
 
     for (QDomNode n = q.firstChild(); !n.isNull(); n = n.nextSibling()) {
         QDomElement i = n.toElement();
@@ -347,6 +355,8 @@ public:
     Roster             roster;
     QString            groupsDelimiter;
     QList<QDomElement> itemList;
+    bool               versioned = false;
+    bool               unchanged = false;
 };
 
 JT_Roster::JT_Roster(Task *parent) : Task(parent)
@@ -366,6 +376,13 @@ void JT_Roster::get()
     iq.appendChild(query);
 }
 
+void JT_Roster::get(const QString &version)
+{
+    get();
+    iq.firstChildElement(QStringLiteral("query")).setAttribute(QStringLiteral("ver"), version);
+    d->versioned = true;
+}
+
 void JT_Roster::set(const Jid &jid, const QString &name, const QStringList &groups)
 {
     type = Set;
@@ -447,6 +464,8 @@ const Roster &JT_Roster::roster() const { return d->roster; }
 
 QString JT_Roster::groupsDelimiter() const { return d->groupsDelimiter; }
 
+bool JT_Roster::isUnchanged() const { return d->unchanged; }
+
 QString JT_Roster::toString() const
 {
     if (type != Set)
@@ -490,7 +509,10 @@ bool JT_Roster::take(const QDomElement &x)
     if (type == Get) {
         if (x.attribute("type") == "result") {
             QDomElement q = queryTag(x);
-            d->roster     = xmlReadRoster(q, false);
+            if (q.isNull() && d->versioned)
+                d->unchanged = true; // an empty result
+            else
+                d->roster = xmlReadRoster(q, false);
             setSuccess();
         } else {
             setError(x);
@@ -528,7 +550,10 @@ bool JT_Roster::take(const QDomElement &x)
 //----------------------------------------------------------------------------
 // JT_PushRoster
 //----------------------------------------------------------------------------
-JT_PushRoster::JT_PushRoster(Task *parent) : Task(parent) { }
+JT_PushRoster::JT_PushRoster(Task *parent) : Task(parent)
+{
+    registerPush(QStringLiteral("iq"), QStringLiteral("jabber:iq:roster"));
+}
 
 JT_PushRoster::~JT_PushRoster() { }
 
@@ -542,7 +567,7 @@ bool JT_PushRoster::take(const QDomElement &e)
         return false;
 
     emit roster(xmlReadRoster(queryTag(e), true));
-    send(createIQ(doc(), "result", e.attribute("from"), e.attribute("id")));
+    send(Stanza::Builder(Stanza::IQ, e.attribute("from"), QStringLiteral("result"), e.attribute("id")));
 
     return true;
 }
@@ -554,94 +579,52 @@ JT_Presence::JT_Presence(Task *parent) : Task(parent) { }
 
 JT_Presence::~JT_Presence() { }
 
-void JT_Presence::pres(const Status &s)
+void JT_Presence::pres(const Status &s) { pres(Jid(), s); }
+
+void JT_Presence::pres(const Jid &to, const Status &s)
 {
     type = 0;
 
-    tag = doc()->createElement("presence");
     if (!s.isAvailable()) {
-        tag.setAttribute("type", "unavailable");
+        stanza.emplace(Stanza::Presence, to.full(), QStringLiteral("unavailable"));
         if (!s.status().isEmpty())
-            tag.appendChild(textTag(doc(), "status", s.status()));
+            stanza->textElement(QLatin1String("status"), s.status());
     } else {
-        if (s.isInvisible())
-            tag.setAttribute("type", "invisible");
-
-        if (!s.show().isEmpty())
-            tag.appendChild(textTag(doc(), "show", s.show()));
-        if (!s.status().isEmpty())
-            tag.appendChild(textTag(doc(), "status", s.status()));
-
-        tag.appendChild(textTag(doc(), "priority", QString("%1").arg(s.priority())));
-
-        if (!s.keyID().isEmpty()) {
-            QDomElement x = textTagNS(doc(), "http://jabber.org/protocol/e2e", "x", s.keyID());
-            tag.appendChild(x);
-        }
-        if (!s.xsigned().isEmpty()) {
-            QDomElement x = textTagNS(doc(), "jabber:x:signed", "x", s.xsigned());
-            tag.appendChild(x);
-        }
-
-        if (client()->capsManager()->isEnabled() && !client()->capsOptimizationAllowed()) {
-            CapsSpec cs = client()->caps();
-            if (cs.isValid()) {
-                tag.appendChild(cs.toXml(doc()));
-            }
-        }
+        stanza.emplace(Stanza::Presence, to.full(), s.isInvisible() ? QStringLiteral("invisible") : QString());
+        stanza->appendContent(client()->presenceContent(s));
 
         if (s.isMUC()) {
-            QDomElement m = doc()->createElementNS("http://jabber.org/protocol/muc", "x");
+            stanza->open(QLatin1String("x"), QLatin1String("http://jabber.org/protocol/muc"));
             if (!s.mucPassword().isEmpty()) {
-                m.appendChild(textTag(doc(), "password", s.mucPassword()));
+                stanza->textElement(QLatin1String("password"), s.mucPassword());
             }
             if (s.hasMUCHistory()) {
-                QDomElement h = doc()->createElement("history");
+                stanza->open(QLatin1String("history"));
                 if (s.mucHistoryMaxChars() >= 0)
-                    h.setAttribute("maxchars", s.mucHistoryMaxChars());
+                    stanza->attribute(QLatin1String("maxchars"), QString::number(s.mucHistoryMaxChars()));
                 if (s.mucHistoryMaxStanzas() >= 0)
-                    h.setAttribute("maxstanzas", s.mucHistoryMaxStanzas());
+                    stanza->attribute(QLatin1String("maxstanzas"), QString::number(s.mucHistoryMaxStanzas()));
                 if (s.mucHistorySeconds() >= 0)
-                    h.setAttribute("seconds", s.mucHistorySeconds());
+                    stanza->attribute(QLatin1String("seconds"), QString::number(s.mucHistorySeconds()));
                 if (!s.mucHistorySince().isNull())
-                    h.setAttribute("since", s.mucHistorySince().toUTC().addSecs(1).toString(Qt::ISODate));
-                m.appendChild(h);
+                    stanza->attribute(QLatin1String("since"),
+                                      s.mucHistorySince().toUTC().addSecs(1).toString(Qt::ISODate));
+                stanza->close();
             }
-            tag.appendChild(m);
-        }
-
-        if (s.photoHash().has_value()) {
-            QDomElement m = doc()->createElementNS("vcard-temp:x:update", "x");
-            m.appendChild(textTag(doc(), "photo", QString::fromLatin1(s.photoHash()->toHex())));
-            tag.appendChild(m);
-        }
-
-        // bits of binary
-        const auto &bdlist = s.bobDataList();
-        for (const BoBData &bd : bdlist) {
-            tag.appendChild(bd.toXml(doc()));
+            stanza->close();
         }
     }
 }
 
-void JT_Presence::pres(const Jid &to, const Status &s)
-{
-    pres(s);
-    tag.setAttribute("to", to.full());
-}
-
 void JT_Presence::sub(const Jid &to, const QString &subType, const QString &nick)
 {
     type = 1;
 
-    tag = doc()->createElement("presence");
-    tag.setAttribute("to", to.full());
-    tag.setAttribute("type", subType);
+    stanza.emplace(Stanza::Presence, to.full(), subType);
     if (!nick.isEmpty()
         && (subType == QLatin1String("subscribe") || subType == QLatin1String("subscribed")
             || subType == QLatin1String("unsubscribe") || subType == QLatin1String("unsubscribed"))) {
-        QDomElement nick_tag = textTagNS(doc(), "http://jabber.org/protocol/nick", "nick", nick);
-        tag.appendChild(nick_tag);
+        stanza->textElement(QLatin1String("nick"), nick, QLatin1String("http://jabber.org/protocol/nick"));
     }
 }
 
@@ -649,41 +632,171 @@ void JT_Presence::probe(const Jid &to)
 {
     type = 2;
 
-    tag = doc()->createElement("presence");
-    tag.setAttribute("to", to.full());
-    tag.setAttribute("type", "probe");
+    stanza.emplace(Stanza::Presence, to.full(), QStringLiteral("probe"));
 }
 
 void JT_Presence::onGo()
 {
-    send(tag);
+    if (stanza)
+        send(*stanza);
     setSuccess();
 }
 
 //----------------------------------------------------------------------------
 // JT_PushPresence
 //----------------------------------------------------------------------------
+namespace {
+class PresenceChildHandlers {
+public:
+    using Key = QPair<QString, QString>; // namespace, local name
+
+    class Entry {
+    public:
+        JT_PushPresence::ChildHandler handler;
+        JT_PushPresence::ChildMode    mode;
+    };
+
+    QList<Entry>    entries;
+    QHash<Key, int> byChild;    // into entries, so one pass can tell which ones ran already
+    QSet<QString>   namespaces; // to skip the children nobody handles without building a key
+
+    PresenceChildHandlers();
+
+    void add(const QString &ns, const QString &localName, const JT_PushPresence::ChildHandler &handler,
+             JT_PushPresence::ChildMode mode)
+    {
+        Key  key(ns, localName);
+        auto it = byChild.constFind(key);
+        if (it != byChild.constEnd()) {
+            entries[*it] = { handler, mode };
+            return;
+        }
+        byChild.insert(key, int(entries.size()));
+        entries += Entry { handler, mode };
+        namespaces += ns;
+    }
+};
+
+PresenceChildHandlers &presenceChildHandlers()
+{
+    static PresenceChildHandlers handlers;
+    return handlers;
+}
+
+PresenceChildHandlers::PresenceChildHandlers()
+{
+    using Context = JT_PushPresence::Context;
+
+    add(QString(), QStringLiteral("status"),
+        [](const QDomElement &i, Context &c) { c.status.setStatus(tagContent(i)); }, JT_PushPresence::FirstChild);
+    add(QString(), QStringLiteral("show"), [](const QDomElement &i, Context &c) { c.status.setShow(tagContent(i)); },
+        JT_PushPresence::FirstChild);
+    add(
+        QString(), QStringLiteral("priority"),
+        [](const QDomElement &i, Context &c) { c.status.setPriority(tagContent(i).toInt()); },
+        JT_PushPresence::FirstChild);
+
+    // the first delay found counts, whichever of the two it is
+    auto delay = [](const QDomElement &i, Context &c) {
+        qint64 msecs;
+        if (!c.stamp.isValid() && stamp2msecs(i.attribute("stamp"), &msecs)) {
+            QDateTime dt = QDateTime::fromMSecsSinceEpoch(msecs, Qt::UTC);
+            c.stamp      = QDateTime(dt.date(), dt.time()); // converted when done
+        }
+    };
+    add(QStringLiteral("jabber:x:delay"), QStringLiteral("x"), delay, JT_PushPresence::EveryChild);
+    add(QStringLiteral("urn:xmpp:delay"), QStringLiteral("delay"), delay, JT_PushPresence::EveryChild);
+
+    add(
+        QStringLiteral("gabber:x:music:info"), QStringLiteral("x"),
+        [](const QDomElement &i, Context &c) {
+            QString title, state;
+            for (QDomElement t = i.firstChildElement(); !t.isNull(); t = t.nextSiblingElement()) {
+                if (title.isNull() && t.tagName() == QLatin1String("title"))
+                    title = tagContent(t);
+                else if (state.isNull() && t.tagName() == QLatin1String("state"))
+                    state = tagContent(t);
+            }
+            if (!title.isEmpty() && state == QLatin1String("playing"))
+                c.status.setSongTitle(title);
+        },
+        JT_PushPresence::EveryChild);
+    add(
+        QStringLiteral("jabber:x:signed"), QStringLiteral("x"),
+        [](const QDomElement &i, Context &c) { c.status.setXSigned(tagContent(i)); }, JT_PushPresence::EveryChild);
+    add(
+        QStringLiteral("http://jabber.org/protocol/e2e"), QStringLiteral("x"),
+        [](const QDomElement &i, Context &c) { c.status.setKeyID(tagContent(i)); }, JT_PushPresence::EveryChild);
+    add(
+        QStringLiteral(NS_CAPS), QStringLiteral("c"),
+        [](const QDomElement &i, Context &c) {
+            c.status.setCaps(CapsSpec::fromXml(i));
+            if (!c.presence.hasAttribute("type") && c.status.caps().isValid())
+                c.task->client()->capsManager()->updateCaps(c.from, c.status.caps());
+        },
+        JT_PushPresence::EveryChild);
+    add(
+        QStringLiteral("vcard-temp:x:update"), QStringLiteral("x"),
+        [](const QDomElement &i, Context &c) {
+            QDomElement t = i.firstChildElement("photo");
+            if (!t.isNull()) // if hash is empty this may mean photo removal
+                c.status.setPhotoHash(QByteArray::fromHex(tagContent(t).toLatin1()));
+            // else vcard.photoHash() returns false and that's mean user is not yet ready to advertise his image
+        },
+        JT_PushPresence::EveryChild);
+    add(
+        QStringLiteral("http://jabber.org/protocol/muc#user"), QStringLiteral("x"),
+        [](const QDomElement &i, Context &c) {
+            for (QDomElement muc_e = i.firstChildElement(); !muc_e.isNull(); muc_e = muc_e.nextSiblingElement()) {
+                if (muc_e.tagName() == "item")
+                    c.status.setMUCItem(MUCItem(muc_e));
+                else if (muc_e.tagName() == "status")
+                    c.status.addMUCStatus(muc_e.attribute("code").toInt());
+                else if (muc_e.tagName() == "destroy")
+                    c.status.setMUCDestroy(MUCDestroy(muc_e));
+            }
+        },
+        JT_PushPresence::EveryChild);
+    add(
+        QStringLiteral("urn:xmpp:bob"), QStringLiteral("data"),
+        [](const QDomElement &i, Context &c) {
+            BoBData bd(i);
+            c.task->client()->bobManager()->append(bd);
+            c.status.addBoBData(bd);
+        },
+        JT_PushPresence::EveryChild);
+}
+} // namespace
+
 JT_PushPresence::JT_PushPresence(Task *parent) : Task(parent) { }
 
 JT_PushPresence::~JT_PushPresence() { }
 
+void JT_PushPresence::registerChildHandler(const QString &ns, const QString &localName, const ChildHandler &handler,
+                                           ChildMode mode)
+{
+    presenceChildHandlers().add(ns, localName, handler, mode);
+}
+
 bool JT_PushPresence::take(const QDomElement &e)
 {
     if (e.tagName() != "presence")
         return false;
 
-    Jid    j(e.attribute("from"));
-    Status p;
+    Context c;
+    c.task     = this;
+    c.presence = e;
+    c.from     = Jid(e.attribute("from"));
 
     if (e.hasAttribute("type")) {
         QString type = e.attribute("type");
         if (type == "unavailable") {
-            p.setIsAvailable(false);
+            c.status.setIsAvailable(false);
         } else if (type == "error") {
             QString str  = "";
             int     code = 0;
             getErrorFromElement(e, client()->stream().baseNS(), &code, &str);
-            p.setError(code, str);
+            c.status.setError(code, str);
         } else if (type == QLatin1String("subscribe") || type == QLatin1String("subscribed")
                    || type == QLatin1String("unsubscribe") || type == QLatin1String("unsubscribed")) {
             QString     nick;
@@ -691,94 +804,45 @@ bool JT_PushPresence::take(const QDomElement &e)
             if (!tag.isNull() && tag.namespaceURI() == "http://jabber.org/protocol/nick") {
                 nick = tagContent(tag);
             }
-            emit subscription(j, type, nick);
+            emit subscription(c.from, type, nick);
             return true;
         }
     }
 
-    QDomElement tag;
-
-    tag = e.firstChildElement("status");
-    if (!tag.isNull())
-        p.setStatus(tagContent(tag));
-    tag = e.firstChildElement("show");
-    if (!tag.isNull())
-        p.setShow(tagContent(tag));
-    tag = e.firstChildElement("priority");
-    if (!tag.isNull())
-        p.setPriority(tagContent(tag).toInt());
-
-    QDateTime stamp;
-
-    for (QDomNode n = e.firstChild(); !n.isNull(); n = n.nextSibling()) {
-        QDomElement i = n.toElement();
-        if (i.isNull())
+    // one pass over the children
+    const PresenceChildHandlers &handlers = presenceChildHandlers();
+    const QString                baseNS   = e.namespaceURI();
+    QVarLengthArray<int, 16>     ran; // the FirstChild ones
+    for (QDomElement i = e.firstChildElement(); !i.isNull(); i = i.nextSiblingElement()) {
+        QString ns = i.namespaceURI();
+        if (ns == baseNS)
+            ns = QString();
+        else if (!handlers.namespaces.contains(ns))
             continue;
 
-        if (i.tagName() == "x" && i.namespaceURI() == "jabber:x:delay") {
-            if (i.hasAttribute("stamp") && !stamp.isValid()) {
-                stamp = stamp2TS(i.attribute("stamp"));
-            }
-        } else if (i.tagName() == "delay" && i.namespaceURI() == "urn:xmpp:delay") {
-            if (i.hasAttribute("stamp") && !stamp.isValid()) {
-                stamp = QDateTime::fromString(i.attribute("stamp").left(19), Qt::ISODate);
-            }
-        } else if (i.tagName() == "x" && i.namespaceURI() == "gabber:x:music:info") {
-            QDomElement t;
-            QString     title, state;
-
-            t = i.firstChildElement("title");
-            if (!t.isNull())
-                title = tagContent(t);
-            t = i.firstChildElement("state");
-            if (!t.isNull())
-                state = tagContent(t);
-
-            if (!title.isEmpty() && state == "playing")
-                p.setSongTitle(title);
-        } else if (i.tagName() == "x" && i.namespaceURI() == "jabber:x:signed") {
-            p.setXSigned(tagContent(i));
-        } else if (i.tagName() == "x" && i.namespaceURI() == "http://jabber.org/protocol/e2e") {
-            p.setKeyID(tagContent(i));
-        } else if (i.tagName() == "c" && i.namespaceURI() == NS_CAPS) {
-            p.setCaps(CapsSpec::fromXml(i));
-            if (!e.hasAttribute("type") && p.caps().isValid()) {
-                client()->capsManager()->updateCaps(j, p.caps());
-            }
-        } else if (i.tagName() == "x" && i.namespaceURI() == "vcard-temp:x:update") {
-            QDomElement t;
-            t = i.firstChildElement("photo");
-            if (!t.isNull())
-                p.setPhotoHash(
-                    QByteArray::fromHex(tagContent(t).toLatin1())); // if hash is empty this may mean photo removal
-            // else vcard.photoHash() returns false and that's mean user is not yet ready to advertise his image
-        } else if (i.tagName() == "x" && i.namespaceURI() == "http://jabber.org/protocol/muc#user") {
-            for (QDomElement muc_e = i.firstChildElement(); !muc_e.isNull(); muc_e = muc_e.nextSiblingElement()) {
-                if (muc_e.tagName() == "item")
-                    p.setMUCItem(MUCItem(muc_e));
-                else if (muc_e.tagName() == "status")
-                    p.addMUCStatus(muc_e.attribute("code").toInt());
-                else if (muc_e.tagName() == "destroy")
-                    p.setMUCDestroy(MUCDestroy(muc_e));
-            }
-        } else if (i.tagName() == "data" && i.namespaceURI() == "urn:xmpp:bob") {
-            BoBData bd(i);
-            client()->bobManager()->append(bd);
-            p.addBoBData(bd);
+        auto it = handlers.byChild.constFind({ ns, i.localName().isNull() ? i.tagName() : i.localName() });
+        if (it == handlers.byChild.constEnd())
+            continue;
+        const auto &entry = handlers.entries[*it];
+        if (entry.mode == FirstChild) {
+            if (std::find(ran.begin(), ran.end(), *it) != ran.end())
+                continue;
+            ran.append(*it);
         }
+        entry.handler(i, c);
     }
 
-    if (stamp.isValid()) {
+    if (c.stamp.isValid()) {
         if (client()->manualTimeZoneOffset()) {
-            stamp = stamp.addSecs(client()->timeZoneOffset() * 3600);
+            c.stamp = c.stamp.addSecs(client()->timeZoneOffset() * 3600);
         } else {
-            stamp.setTimeSpec(Qt::UTC);
-            stamp = stamp.toLocalTime();
+            c.stamp.setTimeSpec(Qt::UTC);
+            c.stamp = c.stamp.toLocalTime();
         }
-        p.setTimeStamp(stamp);
+        c.status.setTimeStamp(c.stamp);
     }
 
-    emit presence(j, p);
+    emit presence(c.from, c.status);
 
     return true;
 }
@@ -819,35 +883,181 @@ void JT_Message::onGo()
 //----------------------------------------------------------------------------
 // JT_PushMessage
 //----------------------------------------------------------------------------
+//----------------------------------------------------------------------------
+// MessageIdIndex
+//----------------------------------------------------------------------------
+static QStringList messageIdKeys(const QDomElement &message)
+{
+    QStringList keys;
+    const Jid   from(message.attribute(QStringLiteral("from")));
+    const Jid   to(message.attribute(QStringLiteral("to")));
+    for (QDomElement e = message.firstChildElement(); !e.isNull(); e = e.nextSiblingElement()) {
+        if (e.namespaceURI() != QLatin1String("urn:xmpp:sid:0"))
+            continue;
+        const QString id = e.attribute(QStringLiteral("id"));
+        if (id.isEmpty())
+            continue;
+        if (e.tagName() == QLatin1String("origin-id")) {
+            keys += QLatin1String("o ") + from.bare() + QLatin1Char(' ') + id;
+        } else if (e.tagName() == QLatin1String("stanza-id")) {
+            // anybody else's would be spoofed
+            const Jid by(e.attribute(QStringLiteral("by")));
+            if (by.compare(from, false) || by.compare(to, false))
+                keys += QLatin1String("s ") + by.bare() + QLatin1Char(' ') + id;
+        }
+    }
+    return keys;
+}
+
+MessageIdIndex::MessageIdIndex(int capacity) : capacity_(capacity) { }
+
+void MessageIdIndex::setCapacity(int capacity)
+{
+    capacity_ = capacity;
+    while (order_.size() > capacity_)
+        known_.remove(order_.dequeue());
+}
+
+int MessageIdIndex::capacity() const { return capacity_; }
+
+bool MessageIdIndex::insert(const QDomElement &message) { return insertKeys(messageIdKeys(message)); }
+
+bool MessageIdIndex::insertResult(const QDomElement &result, const Jid &archive)
+{
+    QStringList keys = messageIdKeys(
+        result.firstChildElement(QStringLiteral("forwarded")).firstChildElement(QStringLiteral("message")));
+    const QString id = result.attribute(QStringLiteral("id"));
+    if (!id.isEmpty())
+        keys += QLatin1String("s ") + archive.bare() + QLatin1Char(' ') + id;
+    return insertKeys(keys);
+}
+
+void MessageIdIndex::clear()
+{
+    known_.clear();
+    order_.clear();
+}
+
+bool MessageIdIndex::insertKeys(const QStringList &keys)
+{
+    for (const QString &key : keys) {
+        if (known_.contains(key))
+            return false;
+    }
+    for (const QString &key : keys) {
+        known_.insert(key);
+        order_.enqueue(key);
+    }
+    while (order_.size() > capacity_)
+        known_.remove(order_.dequeue());
+    return true;
+}
+
 class JT_PushMessage::Private {
 public:
-    EncryptionHandler *m_encryptionHandler;
+    struct Pending {
+        QDomElement                  original;
+        QDomElement                  element; // as it's delivered, null to drop the message
+        QSharedPointer<QDomDocument> doc;     // of original, see Client::stanzaDocument()
+        bool                         ready = false;
+    };
+
+    // shared with the callbacks of asynchronous decryption, which may outlive the task and run in other threads
+    struct Shared {
+        QMutex          mutex;
+        JT_PushMessage *q = nullptr;
+    };
+
+    EncryptionHandler                               *m_encryptionHandler;
+    std::shared_ptr<Shared>                          shared = std::make_shared<Shared>();
+    QHash<QString, QQueue<std::shared_ptr<Pending>>> pending; // by sender. only there while something is decrypted
 };
 
 JT_PushMessage::JT_PushMessage(Task *parent, EncryptionHandler *encryptionHandler) : Task(parent)
 {
     d                      = new Private;
     d->m_encryptionHandler = encryptionHandler;
+    d->shared->q           = this;
 }
 
-JT_PushMessage::~JT_PushMessage() { delete d; }
+JT_PushMessage::~JT_PushMessage()
+{
+    {
+        QMutexLocker locker(&d->shared->mutex);
+        d->shared->q = nullptr;
+    }
+    delete d;
+}
 
 bool JT_PushMessage::take(const QDomElement &e)
 {
     if (e.tagName() != "message")
         return false;
 
-    QDomElement e1 = e;
+    if (!d->m_encryptionHandler)
+        return deliver(e, e, client()->stanzaDocument());
+
+    const QString from  = e.attribute(QLatin1String("from"));
+    auto          entry = std::make_shared<Private::Pending>();
+    entry->original     = e;
+    entry->doc          = client()->stanzaDocument();
+
+    auto shared = d->shared;
+    auto done   = [shared, entry, from](bool processed, const QDomElement &result) {
+        QMutexLocker locker(&shared->mutex);
+        if (!shared->q)
+            return;
+        // posted events of a deleted object are discarded, so the task pointer is safe to use in there
+        auto task = shared->q;
+        QMetaObject::invokeMethod(
+            task,
+            [task, entry, from, processed, result]() {
+                entry->element = processed ? result : entry->original;
+                entry->ready   = true;
+                task->flush(from);
+            },
+            Qt::QueuedConnection);
+    };
+    if (d->m_encryptionHandler->decryptMessageElementAsync(e, done)) {
+        d->pending[from].enqueue(entry);
+        return true;
+    }
 
-    if (d->m_encryptionHandler) {
-        if (d->m_encryptionHandler->decryptMessageElement(e1)) {
-            if (e1.isNull()) {
-                // The message was processed, but has to be discarded for some reason
+    QDomElement e1 = e;
+    if (d->m_encryptionHandler->decryptMessageElement(e1)) {
+        if (e1.isNull()) {
+            // The message was processed, but has to be discarded for some reason
+            if (!d->pending.contains(from))
                 return true;
-            }
         }
     }
 
+    auto it = d->pending.find(from);
+    if (it == d->pending.end())
+        return deliver(e, e1, entry->doc);
+    // an earlier message of the sender is still being decrypted
+    entry->element = e1;
+    entry->ready   = true;
+    it->enqueue(entry);
+    return true;
+}
+
+void JT_PushMessage::flush(const QString &from)
+{
+    QPointer<JT_PushMessage> self(this);
+    for (auto it = d->pending.find(from); it != d->pending.end() && it->head()->ready; it = d->pending.find(from)) {
+        auto entry = it->dequeue();
+        if (it->isEmpty())
+            d->pending.erase(it);
+        if (!entry->element.isNull())
+            deliver(entry->original, entry->element, entry->doc);
+        if (!self)
+            return;
+    }
+}
+
+bool JT_PushMessage::deliver(const QDomElement &e, const QDomElement &e1, const QSharedPointer<QDomDocument> &doc)
+{
     QDomElement        forward;
     Message::CarbonDir cd = Message::NoCarbon;
 
@@ -880,7 +1090,12 @@ bool JT_PushMessage::take(const QDomElement &e)
         }
     }
 
-    Stanza s = client()->stream().createStanza(addCorrectNS(forward.isNull() ? e1 : forward));
+    // a copy we already had by carbons or from the archive
+    MessageIdIndex *index = client()->messageIdIndex();
+    if (index && !index->insert(forward.isNull() ? e1 : forward))
+        return true;
+
+    Stanza s = client()->stream().createStanza(addCorrectNS(forward.isNull() ? e1 : forward), doc);
     if (s.isNull()) {
         // printf("take: bad stanza??\n");
         return false;
@@ -1561,7 +1776,10 @@ bool JT_DiscoPublish::take(const QDomElement &x)
 // ---------------------------------------------------------
 // JT_BoBServer
 // ---------------------------------------------------------
-JT_BoBServer::JT_BoBServer(Task *parent) : Task(parent) { }
+JT_BoBServer::JT_BoBServer(Task *parent) : Task(parent)
+{
+    registerPush(QStringLiteral("iq"), QStringLiteral("urn:xmpp:bob"));
+}
 
 bool JT_BoBServer::take(const QDomElement &e)
 {
@@ -1658,7 +1876,10 @@ BoBData &JT_BitsOfBinary::data() { return d->data; }
  * \brief Answers XMPP Pings
  */
 
-JT_PongServer::JT_PongServer(Task *parent) : Task(parent) { }
+JT_PongServer::JT_PongServer(Task *parent) : Task(parent)
+{
+    registerPush(QStringLiteral("iq"), QStringLiteral("urn:xmpp:ping"));
+}
 
 bool JT_PongServer::take(const QDomElement &e)
 {
@@ -1667,8 +1888,7 @@ bool JT_PongServer::take(const QDomElement &e)
 
     QDomElement ping = e.firstChildElement("ping");
     if (!e.isNull() && ping.namespaceURI() == "urn:xmpp:ping") {
-        QDomElement iq = createIQ(doc(), "result", e.attribute("from"), e.attribute("id"));
-        send(iq);
+        send(Stanza::Builder(Stanza::IQ, e.attribute("from"), QStringLiteral("result"), e.attribute("id")));
         return true;
     }
     return false;
@@ -24,18 +24,26 @@
 #include "xmpp_encryptionhandler.h"
 #include "xmpp_form.h"
 #include "xmpp_message.h"
+#include "xmpp_status.h"
 #include "xmpp_subsets.h"
 #include "xmpp_vcard.h"
 
 #include <QList>
+#include <QQueue>
+#include <QSet>
 #include <QString>
 #include <QtXml>
 
+#include <functional>
+#include <optional>
+
+// messages remembered by MessageIdIndex by default
+#define MESSAGE_ID_INDEX_SIZE 2000
+
 namespace XMPP {
 class BoBData;
 class CaptchaChallenge;
 class Roster;
-class Status;
 
 class JT_Register : public Task {
     Q_OBJECT
@@ -94,6 +102,8 @@ public:
     ~JT_Roster();
 
     void get();
+    // XEP-0237. version is the one of the stored roster, empty if there is none
+    void get(const QString &version);
     void set(const Jid &, const QString &name, const QStringList &groups);
     void remove(const Jid &);
 
@@ -103,6 +113,8 @@ public:
 
     const Roster &roster() const;
     QString       groupsDelimiter() const;
+    // versioned get only: the stored roster is current, the changes (if any) follow as pushes
+    bool          isUnchanged() const;
 
     QString toString() const;
     bool    fromString(const QString &);
@@ -151,8 +163,8 @@ public:
     void onGo();
 
 private:
-    QDomElement tag;
-    int         type = -1;
+    std::optional<Stanza::Builder> stanza;
+    int                            type = -1;
 
     class Private;
     Private *d = nullptr;
@@ -161,9 +173,27 @@ private:
 class JT_PushPresence : public Task {
     Q_OBJECT
 public:
+    // the presence being taken, as the child handlers see it
+    class Context {
+    public:
+        JT_PushPresence *task;
+        QDomElement      presence;
+        Jid              from;
+        Status           status;
+        QDateTime        stamp; // of the delay, UTC. made local when all the children are done
+    };
+    using ChildHandler = std::function<void(const QDomElement &child, Context &context)>;
+    enum ChildMode { EveryChild, FirstChild };
+
     JT_PushPresence(Task *parent);
     ~JT_PushPresence();
 
+    // the children are dispatched in one pass by namespace and local name, an empty ns stands for the stanza's
+    //   own one (status, show, priority). a handler replaces the one registered before for the same child.
+    //   register from the thread the clients run in, before they take presences
+    static void registerChildHandler(const QString &ns, const QString &localName, const ChildHandler &handler,
+                                     ChildMode mode = EveryChild);
+
     bool take(const QDomElement &);
 
 signals:
@@ -197,6 +227,32 @@ private:
     Private *d = nullptr;
 };
 
+/*
+ * The XEP-0359 ids of the messages seen lately, so the copies coming by carbons and by a MAM catch-up (or
+ * twice by either) are recognized from the raw stanza, before they are parsed. A message is known if any of
+ * its ids is: the origin-id with the sender, and a stanza-id by one of the parties (the own account or a room).
+ */
+class MessageIdIndex {
+public:
+    MessageIdIndex(int capacity = MESSAGE_ID_INDEX_SIZE);
+
+    void setCapacity(int capacity); // the oldest ones are forgotten first
+    int  capacity() const;
+
+    // false if the message is known. otherwise it is remembered now. messages without ids are always new
+    bool insert(const QDomElement &message);
+    // the same for a MAM <result/> from the archive
+    bool insertResult(const QDomElement &result, const Jid &archive);
+    void clear();
+
+private:
+    bool insertKeys(const QStringList &keys);
+
+    QSet<QString>   known_;
+    QQueue<QString> order_; // oldest first
+    int             capacity_;
+};
+
 class JT_PushMessage : public Task {
     Q_OBJECT
 public:
@@ -211,6 +267,10 @@ signals:
 private:
     class Private;
     Private *d = nullptr;
+
+    // as it came and decrypted. doc is where e is, see Client::stanzaDocument()
+    bool deliver(const QDomElement &e, const QDomElement &e1, const QSharedPointer<QDomDocument> &doc);
+    void flush(const QString &from); // delivers the decrypted head of the sender's queue
 };
 
 class JT_VCard : public Task {
@@ -22,16 +22,24 @@
 #include "xmpp_xmlcommon.h"
 
 #include <QBuffer>
+#include <QCryptographicHash>
 #include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QImage> // needed for image format recognition
 #include <QImageReader>
 #include <QImageWriter>
+#include <QSaveFile>
 #include <QtCrypto>
 #include <QtDebug>
 #include <qdom.h>
 
 using namespace XMLHelper;
 
+// base64 chars hashed at once by base64Sha1(). has to be a multiple of 4
+#define VCARD_HASH_CHUNK 4096
+
 //----------------------------------------------------------------------------
 // vCard
 //----------------------------------------------------------------------------
@@ -70,21 +78,29 @@ QString image2type(const QByteArray &ba)
     return openedImage2type(&buf);
 }
 
-namespace XMPP {
-// Long lines of encoded binary data SHOULD BE folded to 75 characters using the folding method defined in [MIME-DIR].
-static QString foldString(const QString &s)
+// SHA-1 of what base64 text decodes to, without the decoded data in memory all at once
+static QByteArray base64Sha1(const QString &text)
 {
-    QString ret;
-
-    for (int i = 0; i < (int)s.length(); i++) {
-        if (!(i % 75))
-            ret += '\n';
-        ret += s[i];
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    QString            chunk;
+    chunk.reserve(VCARD_HASH_CHUNK);
+    for (QChar c : text) {
+        if (c == QLatin1Char('='))
+            break;
+        if (!(c.isLetterOrNumber() && c.unicode() < 128) && c != QLatin1Char('+') && c != QLatin1Char('/'))
+            continue; // folding
+        chunk += c;
+        if (chunk.size() == VCARD_HASH_CHUNK) {
+            hash.addData(fromBase64(chunk));
+            chunk.clear();
+        }
     }
-
-    return ret;
+    hash.addData(fromBase64(chunk));
+    return hash.result();
 }
 
+namespace XMPP {
+// Long lines of encoded binary data SHOULD BE folded to 75 characters using the folding method defined in [MIME-DIR].
 class VCardPrivate : public QSharedData {
 public:
     VCardPrivate();
@@ -99,8 +115,14 @@ public:
     QString familyName, givenName, middleName, prefixName, suffixName;
     QString nickName;
 
-    QByteArray photo;
-    QString    photoURI;
+    // BINVAL stays encoded until the photo is asked for
+    mutable QByteArray photo;
+    mutable QString    photoBase64;
+    mutable QByteArray photoHash;
+    QString            photoType;
+    QString            photoURI;
+
+    const QByteArray &decodedPhoto() const;
 
     QString            bday;
     VCard::AddressList addressList;
@@ -143,18 +165,27 @@ VCardPrivate::VCardPrivate() { privacyClass = VCard::pcNone; }
 
 VCardPrivate::~VCardPrivate() { }
 
+const QByteArray &VCardPrivate::decodedPhoto() const
+{
+    if (!photoBase64.isEmpty()) {
+        photo = fromBase64(photoBase64);
+        photoBase64.clear();
+    }
+    return photo;
+}
+
 bool VCardPrivate::isEmpty() const
 {
     return !(!version.isEmpty() || !fullName.isEmpty() || !familyName.isEmpty() || !givenName.isEmpty()
              || !middleName.isEmpty() || !prefixName.isEmpty() || !suffixName.isEmpty() || !nickName.isEmpty()
-             || !photo.isEmpty() || !photoURI.isEmpty() || !bday.isEmpty() || !addressList.isEmpty()
-             || !labelList.isEmpty() || !phoneList.isEmpty() || !emailList.isEmpty() || !jid.isEmpty()
-             || !mailer.isEmpty() || !timezone.isEmpty() || !geo.lat.isEmpty() || !geo.lon.isEmpty() || !title.isEmpty()
-             || !role.isEmpty() || !logo.isEmpty() || !logoURI.isEmpty() || (agent && !agent->isEmpty())
-             || !agentURI.isEmpty() || !org.name.isEmpty() || !org.unit.isEmpty() || !categories.isEmpty()
-             || !note.isEmpty() || !prodId.isEmpty() || !rev.isEmpty() || !sortString.isEmpty() || !sound.isEmpty()
-             || !soundURI.isEmpty() || !soundPhonetic.isEmpty() || !uid.isEmpty() || !url.isEmpty() || !desc.isEmpty()
-             || (privacyClass != VCard::pcNone) || !key.isEmpty());
+             || !photo.isEmpty() || !photoBase64.isEmpty() || !photoURI.isEmpty() || !bday.isEmpty()
+             || !addressList.isEmpty() || !labelList.isEmpty() || !phoneList.isEmpty() || !emailList.isEmpty()
+             || !jid.isEmpty() || !mailer.isEmpty() || !timezone.isEmpty() || !geo.lat.isEmpty() || !geo.lon.isEmpty()
+             || !title.isEmpty() || !role.isEmpty() || !logo.isEmpty() || !logoURI.isEmpty()
+             || (agent && !agent->isEmpty()) || !agentURI.isEmpty() || !org.name.isEmpty() || !org.unit.isEmpty()
+             || !categories.isEmpty() || !note.isEmpty() || !prodId.isEmpty() || !rev.isEmpty() || !sortString.isEmpty()
+             || !sound.isEmpty() || !soundURI.isEmpty() || !soundPhonetic.isEmpty() || !uid.isEmpty() || !url.isEmpty()
+             || !desc.isEmpty() || (privacyClass != VCard::pcNone) || !key.isEmpty());
 }
 
 VCard::VCard() { }
@@ -199,12 +230,16 @@ QDomElement VCard::toXml(QDomDocument *doc) const
     if (!d->nickName.isEmpty())
         v.appendChild(textTag(doc, "NICKNAME", d->nickName));
 
-    if (!d->photo.isEmpty() || !d->photoURI.isEmpty()) {
+    if (!d->photo.isEmpty() || !d->photoBase64.isEmpty() || !d->photoURI.isEmpty()) {
         QDomElement w = doc->createElement("PHOTO");
 
-        if (!d->photo.isEmpty()) {
+        if (!d->photoBase64.isEmpty() && !d->photoType.isEmpty()) {
+            // as it came, no need to decode and fold it again
+            w.appendChild(textTag(doc, "TYPE", d->photoType));
+            w.appendChild(textTag(doc, "BINVAL", d->photoBase64));
+        } else if (!d->decodedPhoto().isEmpty()) {
             w.appendChild(textTag(doc, "TYPE", image2type(d->photo)));
-            w.appendChild(textTag(doc, "BINVAL", foldString(QCA::Base64().arrayToString(d->photo))));
+            w.appendChild(textTag(doc, "BINVAL", toBase64(d->photo, 75)));
         } else if (!d->photoURI.isEmpty())
             w.appendChild(textTag(doc, "EXTVAL", d->photoURI));
 
@@ -368,7 +403,7 @@ QDomElement VCard::toXml(QDomDocument *doc) const
 
         if (!d->logo.isEmpty()) {
             w.appendChild(textTag(doc, "TYPE", image2type(d->logo)));
-            w.appendChild(textTag(doc, "BINVAL", foldString(QCA::Base64().arrayToString(d->logo))));
+            w.appendChild(textTag(doc, "BINVAL", toBase64(d->logo, 75)));
         } else if (!d->logoURI.isEmpty())
             w.appendChild(textTag(doc, "EXTVAL", d->logoURI));
 
@@ -422,7 +457,7 @@ QDomElement VCard::toXml(QDomDocument *doc) const
         QDomElement w = doc->createElement("SOUND");
 
         if (!d->sound.isEmpty())
-            w.appendChild(textTag(doc, "BINVAL", foldString(QCA::Base64().arrayToString(d->sound))));
+            w.appendChild(textTag(doc, "BINVAL", toBase64(d->sound, 75)));
         else if (!d->soundURI.isEmpty())
             w.appendChild(textTag(doc, "EXTVAL", d->soundURI));
         else if (!d->soundPhonetic.isEmpty())
@@ -495,9 +530,9 @@ VCard VCard::fromXml(const QDomElement &q)
         } else if (tag == "NICKNAME")
             v.d->nickName = i.text().trimmed();
         else if (tag == "PHOTO") {
-            static QRegularExpression newlines("[\r\n]+");
-            v.d->photo    = QCA::Base64().stringToArray(subTagText(i, "BINVAL").replace(newlines, "")).toByteArray();
-            v.d->photoURI = subTagText(i, "EXTVAL");
+            v.d->photoBase64 = subTagText(i, "BINVAL");
+            v.d->photoType   = subTagText(i, "TYPE").trimmed();
+            v.d->photoURI    = subTagText(i, "EXTVAL");
         } else if (tag == "BDAY")
             v.d->bday = i.text().trimmed();
         else if (tag == "ADR") {
@@ -631,7 +666,7 @@ VCard VCard::fromXml(const QDomElement &q)
         else if (tag == "ROLE")
             v.d->role = i.text().trimmed();
         else if (tag == "LOGO") {
-            v.d->logo    = QCA::Base64().stringToArray(subTagText(i, "BINVAL").replace("\n", "")).toByteArray();
+            v.d->logo    = fromBase64(subTagText(i, "BINVAL"));
             v.d->logoURI = subTagText(i, "EXTVAL");
         } else if (tag == "AGENT") {
             e = i.firstChildElement("VCARD");
@@ -676,7 +711,7 @@ VCard VCard::fromXml(const QDomElement &q)
         else if (tag == "SORT-STRING")
             v.d->sortString = i.text().trimmed();
         else if (tag == "SOUND") {
-            v.d->sound         = QCA::Base64().stringToArray(subTagText(i, "BINVAL").replace("\n", "")).toByteArray();
+            v.d->sound         = fromBase64(subTagText(i, "BINVAL"));
             v.d->soundURI      = subTagText(i, "EXTVAL");
             v.d->soundPhonetic = subTagText(i, "PHONETIC");
         } else if (tag == "UID")
@@ -771,9 +806,26 @@ const QString &VCard::nickName() const { return d->nickName; }
 
 void VCard::setNickName(const QString &n) { d->nickName = n; }
 
-const QByteArray &VCard::photo() const { return d->photo; }
+const QByteArray &VCard::photo() const { return d->decodedPhoto(); }
+
+void VCard::setPhoto(const QByteArray &i)
+{
+    d->photo = i;
+    d->photoBase64.clear();
+    d->photoHash.clear();
+    d->photoType.clear();
+}
 
-void VCard::setPhoto(const QByteArray &i) { d->photo = i; }
+bool VCard::hasPhoto() const { return !d->photo.isEmpty() || !d->photoBase64.isEmpty(); }
+
+QByteArray VCard::photoHash() const
+{
+    if (d->photoHash.isEmpty() && hasPhoto()) {
+        d->photoHash = d->photoBase64.isEmpty() ? QCryptographicHash::hash(d->photo, QCryptographicHash::Sha1)
+                                                : base64Sha1(d->photoBase64);
+    }
+    return d->photoHash;
+}
 
 const QString &VCard::photoURI() const { return d->photoURI; }
 
@@ -909,4 +961,62 @@ void VCard::setPrivacyClass(const VCard::PrivacyClass &c) { d->privacyClass = c;
 const QByteArray &VCard::key() const { return d->key; }
 
 void VCard::setKey(const QByteArray &k) { d->key = k; }
+
+//----------------------------------------------------------------------------
+// AvatarCache
+//----------------------------------------------------------------------------
+AvatarCache::AvatarCache(const QString &dir) : dir_(dir) { }
+
+const QString &AvatarCache::dir() const { return dir_; }
+
+bool AvatarCache::contains(const QByteArray &hash) const
+{
+    return !hash.isEmpty() && QFileInfo::exists(fileName(hash));
+}
+
+QByteArray AvatarCache::photo(const QByteArray &hash) const
+{
+    if (hash.isEmpty())
+        return QByteArray();
+    QFile f(fileName(hash));
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return f.readAll();
+}
+
+bool AvatarCache::store(const QByteArray &hash, const QByteArray &photo)
+{
+    if (photo.isEmpty() || QCryptographicHash::hash(photo, QCryptographicHash::Sha1) != hash)
+        return false;
+    if (contains(hash))
+        return true;
+
+    QDir().mkpath(dir_);
+    QSaveFile f(fileName(hash));
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("AvatarCache: can't write %s", qPrintable(f.fileName()));
+        return false;
+    }
+    f.write(photo);
+    return f.commit();
+}
+
+QByteArray AvatarCache::store(const VCard &vcard)
+{
+    QByteArray hash = vcard.photoHash();
+    if (hash.isEmpty() || contains(hash))
+        return hash;
+    return store(hash, vcard.photo()) ? hash : QByteArray();
+}
+
+void AvatarCache::remove(const QByteArray &hash)
+{
+    if (!hash.isEmpty())
+        QFile::remove(fileName(hash));
+}
+
+QString AvatarCache::fileName(const QByteArray &hash) const
+{
+    return dir_ + QLatin1Char('/') + QString::fromLatin1(hash.toHex());
+}
 } // namespace XMPP
@@ -259,6 +259,30 @@ public:
 private:
     QSharedDataPointer<VCardPrivate> d;
 };
+
+/*
+ * Photos by their XEP-0153 hash, one file per photo in a directory. If the hash in a presence is known
+ * already, there is no need to fetch the vCard.
+ */
+class AvatarCache {
+public:
+    AvatarCache(const QString &dir);
+
+    const QString &dir() const;
+
+    bool       contains(const QByteArray &hash) const;
+    QByteArray photo(const QByteArray &hash) const; // empty if not there
+    // false if the photo doesn't match the hash or can't be written
+    bool store(const QByteArray &hash, const QByteArray &photo);
+    // the photo of a vCard. returns its hash, empty if there is no photo or it can't be written
+    QByteArray store(const VCard &vcard);
+    void       remove(const QByteArray &hash);
+
+private:
+    QString fileName(const QByteArray &hash) const;
+
+    QString dir_;
+};
 } // namespace XMPP
 
 QString openedImage2type(QIODevice *dev);
@@ -20,6 +20,7 @@
 #include "xmpp_vcard4.h"
 
 #include "xmpp_vcard.h"
+#include "xmpp_xmlcommon.h"
 
 #include <QDomDocument>
 #include <QDomElement>
@@ -455,7 +456,7 @@ UriValue::UriValue(const QString &uri)
         QRegularExpressionMatch   match = re.match(uri);
         if (match.hasMatch()) {
             mediaType = match.captured(1);
-            data      = QByteArray::fromBase64(match.captured(2).trimmed().toUtf8());
+            data      = XMLHelper::fromBase64(match.captured(2));
         }
     } else {
         url = QUrl(uri);
@@ -467,7 +468,7 @@ UriValue::UriValue(const QByteArray &data, const QString &mime) : data(data), me
 QString UriValue::toString() const
 {
     if (!mediaType.isEmpty()) {
-        return QString(QLatin1String("data:%1;base64,%2")).arg(mediaType, QString(data.toBase64()));
+        return QLatin1String("data:") + mediaType + QLatin1String(";base64,") + XMLHelper::toBase64(data);
     } else {
         return url.toString();
     }
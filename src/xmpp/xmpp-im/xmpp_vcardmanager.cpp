@@ -0,0 +1,212 @@
+/*
+ * xmpp_vcardmanager.cpp - vCard fetches shared by jid and kept by photo hash
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp_vcardmanager.h"
+
+#include "xmpp_client.h"
+#include "xmpp_tasks.h"
+
+#include <QDataStream>
+#include <QDomDocument>
+#include <QHash>
+#include <QPointer>
+
+#define VCARD_MANAGER_MAGIC 0x49564331
+
+using namespace XMPP;
+
+class VCardManager::Private {
+public:
+    struct Entry {
+        QByteArray xml;  // serialized vcard-temp
+        QByteArray hash; // of the photo
+        bool       outdated = false;
+    };
+
+    VCardManager                      *q;
+    Client                            *client;
+    QHash<QString, Entry>              cards; // by the jid as asked for, full for muc occupants
+    QHash<QString, QPointer<JT_VCard>> tasks;
+    bool                               loaded = false;
+
+    Private(VCardManager *_q, Client *_client) : q(_q), client(_client) { }
+
+    // a contact's card is kept by the bare jid, an occupant's by the full one
+    Entry *find(const Jid &jid)
+    {
+        auto it = cards.find(jid.full());
+        if (it == cards.end() && !jid.resource().isEmpty())
+            it = cards.find(jid.bare());
+        return it == cards.end() ? nullptr : &*it;
+    }
+
+    void presence(const Jid &jid, const Status &s)
+    {
+        if (!s.photoHash().has_value())
+            return;
+        q->load();
+        Entry *e = find(jid);
+        if (!e || e->hash == *s.photoHash())
+            return;
+
+        e->outdated = true;
+        q->save();
+        q->fetch(cards.contains(jid.full()) ? jid : Jid(jid.bare()));
+    }
+};
+
+VCardManager::VCardManager(Client *client) : QObject(client), d(new Private(this, client))
+{
+    connect(client, &Client::resourceAvailable, this,
+            [this](const Jid &j, const Resource &r) { d->presence(j, r.status()); });
+    connect(client, &Client::presenceBatch, this, [this](const QList<QPair<Jid, Status>> &presences) {
+        for (const auto &p : presences)
+            d->presence(p.first, p.second);
+    });
+}
+
+VCardManager::~VCardManager() { delete d; }
+
+bool VCardManager::fetch(const Jid &jid, bool force)
+{
+    load();
+    const QString key = jid.full();
+    if (d->tasks.value(key))
+        return true;
+    auto it = d->cards.constFind(key);
+    if (!force && it != d->cards.constEnd() && !it->outdated)
+        return false;
+
+    auto t = new JT_VCard(d->client->rootTask());
+    connect(t, &Task::finished, this, [this, t, jid, key]() {
+        d->tasks.remove(key);
+        if (t->success()) {
+            QDomDocument doc;
+            doc.appendChild(t->vcard().toXml(&doc));
+            Private::Entry &e = d->cards[key];
+            e.xml             = doc.toByteArray(-1);
+            e.hash            = t->vcard().photoHash();
+            e.outdated        = false;
+            save();
+        }
+        emit fetched(jid, t->success());
+    });
+    d->tasks.insert(key, t);
+    t->get(jid);
+    t->go(true);
+    return true;
+}
+
+bool VCardManager::isFetching(const Jid &jid) const { return d->tasks.value(jid.full()); }
+
+bool VCardManager::contains(const Jid &jid) const
+{
+    load();
+    return d->cards.contains(jid.full());
+}
+
+bool VCardManager::isOutdated(const Jid &jid) const
+{
+    load();
+    auto it = d->cards.constFind(jid.full());
+    return it != d->cards.constEnd() && it->outdated;
+}
+
+QByteArray VCardManager::photoHash(const Jid &jid) const
+{
+    load();
+    return d->cards.value(jid.full()).hash;
+}
+
+VCard VCardManager::vcard(const Jid &jid) const
+{
+    load();
+    auto         it = d->cards.constFind(jid.full());
+    QDomDocument doc;
+    if (it == d->cards.constEnd() || !doc.setContent(it->xml, true))
+        return VCard();
+    return VCard::fromXml(doc.documentElement());
+}
+
+VCard4::VCard VCardManager::vcard4(const Jid &jid) const
+{
+    VCard temp = vcard(jid);
+    if (!temp)
+        return VCard4::VCard();
+    VCard4::VCard card;
+    card.fromVCardTemp(temp);
+    return card;
+}
+
+void VCardManager::remove(const Jid &jid)
+{
+    load();
+    if (d->cards.remove(jid.full()))
+        save();
+}
+
+void VCardManager::clear()
+{
+    d->loaded = true;
+    d->cards.clear();
+    save();
+}
+
+void VCardManager::saveData(const QByteArray &data) { Q_UNUSED(data) }
+
+QByteArray VCardManager::loadData() { return QByteArray(); }
+
+void VCardManager::load() const
+{
+    if (d->loaded)
+        return;
+    d->loaded = true;
+
+    QByteArray data = const_cast<VCardManager *>(this)->loadData();
+    if (data.isEmpty())
+        return;
+
+    QDataStream ds(data);
+    ds.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0, count = 0;
+    ds >> magic >> count;
+    if (magic != VCARD_MANAGER_MAGIC)
+        return;
+    for (quint32 i = 0; i < count && ds.status() == QDataStream::Ok; ++i) {
+        QString        key;
+        Private::Entry e;
+        ds >> key >> e.xml >> e.hash >> e.outdated;
+        d->cards.insert(key, e);
+    }
+    if (ds.status() != QDataStream::Ok) {
+        qWarning("VCardManager: Cannot read stored vCards");
+        d->cards.clear();
+    }
+}
+
+void VCardManager::save()
+{
+    QByteArray  data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_0);
+    ds << quint32(VCARD_MANAGER_MAGIC) << quint32(d->cards.size());
+    for (auto it = d->cards.constBegin(); it != d->cards.constEnd(); ++it)
+        ds << it.key() << it->xml << it->hash << it->outdated;
+    saveData(data);
+}
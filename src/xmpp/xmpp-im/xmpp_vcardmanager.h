@@ -0,0 +1,73 @@
+/*
+ * xmpp_vcardmanager.h - vCard fetches shared by jid and kept by photo hash
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef XMPP_VCARDMANAGER_H
+#define XMPP_VCARDMANAGER_H
+
+#include "xmpp/jid/jid.h"
+#include "xmpp_vcard.h"
+#include "xmpp_vcard4.h"
+
+#include <QObject>
+
+namespace XMPP {
+class Client;
+
+/*
+ * Fetches vcard-temp cards with JT_VCard. However many ask for the same jid at once, one request goes out and
+ * all of them get its fetched(). The cards are kept with the hash of their photo, and a presence advertising
+ * another hash (XEP-0153) fetches the card again, while the same hash costs nothing. Cards are kept serialized
+ * and parsed when asked for. Reimplement saveData() and loadData() to keep them between sessions.
+ */
+class VCardManager : public QObject {
+    Q_OBJECT
+public:
+    VCardManager(Client *client);
+    ~VCardManager();
+
+    // false if a current card is there already, see vcard(). otherwise fetched() comes later
+    bool fetch(const Jid &jid, bool force = false);
+    bool isFetching(const Jid &jid) const;
+
+    bool          contains(const Jid &jid) const;
+    bool          isOutdated(const Jid &jid) const; // a presence had another photo since
+    QByteArray    photoHash(const Jid &jid) const;  // of the stored card. empty without a photo
+    VCard         vcard(const Jid &jid) const;
+    VCard4::VCard vcard4(const Jid &jid) const; // the same, converted
+    void          remove(const Jid &jid);
+    void          clear();
+
+signals:
+    // the stored card is updated already on success
+    void fetched(const XMPP::Jid &jid, bool success);
+
+protected:
+    virtual void       saveData(const QByteArray &data);
+    virtual QByteArray loadData();
+
+private:
+    class Private;
+    Private *d;
+
+    void load() const;
+    void save();
+};
+} // namespace XMPP
+
+#endif // XMPP_VCARDMANAGER_H
@@ -22,6 +22,7 @@
 #include "xmpp/jid/jid.h"
 #include "xmpp_xmlcommon.h"
 
+#include <QDomDocument>
 #include <QList>
 #include <QRegularExpression>
 #include <QSharedDataPointer>
@@ -488,3 +489,88 @@ bool XData::isValid() const
     }
     return true;
 }
+
+//----------------------------------------------------------------------------
+// XDataTemplate
+//----------------------------------------------------------------------------
+XDataTemplate::XDataTemplate(const XData &form, bool submitForm)
+{
+    QDomDocument doc;
+    x_ = form.toXml(&doc, submitForm);
+    doc.appendChild(x_); // the element keeps the document
+}
+
+QDomElement XDataTemplate::toXml(QDomDocument *doc, const QHash<QString, QStringList> &values) const
+{
+    QDomElement x = doc->importNode(x_, true).toElement();
+    for (QDomElement f = x.firstChildElement(QStringLiteral("field")); !f.isNull();) {
+        QDomElement next = f.nextSiblingElement(QStringLiteral("field"));
+        auto        it   = values.constFind(f.attribute(QStringLiteral("var")));
+        if (it != values.constEnd()) {
+            for (QDomElement v = f.firstChildElement(QStringLiteral("value")); !v.isNull();
+                 v = f.firstChildElement(QStringLiteral("value")))
+                f.removeChild(v);
+            for (const QString &value : *it)
+                f.appendChild(textTag(doc, "value", value));
+        }
+        if (f.firstChildElement(QStringLiteral("value")).isNull())
+            x.removeChild(f);
+        f = next;
+    }
+    return x;
+}
+
+//----------------------------------------------------------------------------
+// XDataReader
+//----------------------------------------------------------------------------
+XDataReader::XDataReader(const QDomElement &x) :
+    x_(x.namespaceURI() == QLatin1String("jabber:x:data") ? x : QDomElement())
+{
+}
+
+bool XDataReader::isNull() const { return x_.isNull(); }
+
+XData::Type XDataReader::type() const
+{
+    if (x_.isNull())
+        return XData::Data_Invalid;
+    QString type = x_.attribute(QStringLiteral("type"));
+    if (type == QLatin1String("result"))
+        return XData::Data_Result;
+    if (type == QLatin1String("submit"))
+        return XData::Data_Submit;
+    if (type == QLatin1String("cancel"))
+        return XData::Data_Cancel;
+    return XData::Data_Form;
+}
+
+QString XDataReader::formType() const { return value(QStringLiteral("FORM_TYPE")).value(0); }
+
+bool XDataReader::hasField(const QString &var) const { return !findField(var).isNull(); }
+
+QStringList XDataReader::value(const QString &var) const
+{
+    QStringList ret;
+    QDomElement f = findField(var);
+    for (QDomElement v = f.firstChildElement(QStringLiteral("value")); !v.isNull();
+         v = v.nextSiblingElement(QStringLiteral("value")))
+        ret.append(v.text());
+    return ret;
+}
+
+XData::Field XDataReader::field(const QString &var) const
+{
+    XData::Field f;
+    f.fromXml(findField(var));
+    return f;
+}
+
+QDomElement XDataReader::findField(const QString &var) const
+{
+    for (QDomElement f = x_.firstChildElement(QStringLiteral("field")); !f.isNull();
+         f = f.nextSiblingElement(QStringLiteral("field"))) {
+        if (f.attribute(QStringLiteral("var")) == var)
+            return f;
+    }
+    return QDomElement();
+}
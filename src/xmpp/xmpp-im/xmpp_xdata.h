@@ -20,6 +20,7 @@
 #ifndef XMPP_XDATA_H
 #define XMPP_XDATA_H
 
+#include <QDomElement>
 #include <QHash>
 #include <QList>
 #include <QMap>
@@ -29,7 +30,6 @@
 #include <QStringList>
 
 class QDomDocument;
-class QDomElement;
 
 namespace XMPP {
 class XData {
@@ -168,6 +168,41 @@ private:
     };
     QSharedDataPointer<Private> d;
 };
+
+/*
+ * A form sent again and again, e.g. a query filter. The element is built once, toXml() copies it with the
+ * values of some fields replaced. Fields left without a value are not sent.
+ */
+class XDataTemplate {
+public:
+    XDataTemplate(const XData &form, bool submitForm = true);
+
+    QDomElement toXml(QDomDocument *doc, const QHash<QString, QStringList> &values = {}) const;
+
+private:
+    QDomElement x_;
+};
+
+/*
+ * Looks up single fields of a received form right in its element, for when only a few of them matter.
+ */
+class XDataReader {
+public:
+    XDataReader(const QDomElement &x);
+
+    bool        isNull() const; // not a form
+    XData::Type type() const;
+    QString     formType() const;
+
+    bool         hasField(const QString &var) const;
+    QStringList  value(const QString &var) const;
+    XData::Field field(const QString &var) const;
+
+private:
+    QDomElement findField(const QString &var) const;
+
+    QDomElement x_;
+};
 }; // namespace XMPP
 
 #endif // XMPP_XDATA_H
@@ -29,6 +29,8 @@
 #include <QString>
 #include <QStringList>
 
+#include <array>
+
 //----------------------------------------------------------------------------
 // XDomNodeList
 //----------------------------------------------------------------------------
@@ -60,31 +62,162 @@ bool XDomNodeList::operator==(const XDomNodeList &a) const { return (list == a.l
 
 void XDomNodeList::append(const QDomNode &i) { list += i; }
 
-// YYYYMMDDThh:mm:ss
-QDateTime stamp2TS(const QString &ts)
+// the value of the n digits at p, -1 if there is something else
+static int stampDigits(const QChar *p, int n)
 {
-    if (ts.length() != 17)
-        return QDateTime();
+    int v = 0;
+    for (int i = 0; i < n; ++i) {
+        ushort c = p[i].unicode();
+        if (c < '0' || c > '9')
+            return -1;
+        v = v * 10 + (c - '0');
+    }
+    return v;
+}
 
-    int year  = QStringView { ts }.mid(0, 4).toInt();
-    int month = QStringView { ts }.mid(4, 2).toInt();
-    int day   = QStringView { ts }.mid(6, 2).toInt();
+static void stampPut(char *&p, int v, int n)
+{
+    for (int i = n - 1; i >= 0; --i, v /= 10)
+        p[i] = char('0' + v % 10);
+    p += n;
+}
 
-    int hour = QStringView { ts }.mid(9, 2).toInt();
-    int min  = QStringView { ts }.mid(12, 2).toInt();
-    int sec  = QStringView { ts }.mid(15, 2).toInt();
+static bool isLeapYear(int y) { return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0; }
 
-    QDate xd;
-    xd.setDate(year, month, day);
-    if (!xd.isValid())
-        return QDateTime();
+// days since 1970-01-01 of a date of the proleptic gregorian calendar and back (H. Hinnant's algorithms)
+static qint64 daysFromCivil(int y, int m, int d)
+{
+    y -= m <= 2;
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return qint64(era) * 146097 + doe - 719468;
+}
+
+static void civilFromDays(qint64 z, int *y, int *m, int *d)
+{
+    z += 719468;
+    const qint64 era = (z >= 0 ? z : z - 146096) / 146097;
+    const int    doe = int(z - era * 146097);
+    const int    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const int    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const int    mp  = (5 * doy + 2) / 153;
+    *d               = doy - (153 * mp + 2) / 5 + 1;
+    *m               = mp < 10 ? mp + 3 : mp - 9;
+    *y               = int(yoe + era * 400) + (*m <= 2);
+}
+
+/**
+    \brief Parses a timestamp into msecs since the epoch, without going through QDateTime
+
+    Takes XEP-0082 date-times (CCYY-MM-DDThh:mm:ss[.sss][TZD], in UTC if the zone is missing) and the legacy
+    XEP-0091 ones (CCYYMMDDThh:mm:ss, always UTC).
+*/
+bool stamp2msecs(const QString &ts, qint64 *msecs)
+{
+    const QChar *p   = ts.constData();
+    const int    len = int(ts.size());
+    int          year, month, day, at;
+    if (len >= 19 && p[4] == '-' && p[7] == '-' && p[10] == 'T') {
+        year  = stampDigits(p, 4);
+        month = stampDigits(p + 5, 2);
+        day   = stampDigits(p + 8, 2);
+        at    = 11;
+    } else if (len == 17 && p[8] == 'T') {
+        year  = stampDigits(p, 4);
+        month = stampDigits(p + 4, 2);
+        day   = stampDigits(p + 6, 2);
+        at    = 9;
+    } else {
+        return false;
+    }
+    if (p[at + 2] != ':' || p[at + 5] != ':')
+        return false;
+    int hour = stampDigits(p + at, 2);
+    int min  = stampDigits(p + at + 3, 2);
+    int sec  = stampDigits(p + at + 6, 2);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0
+        || sec > 59)
+        return false;
+    static const int monthDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (day > monthDays[month - 1] + (month == 2 && isLeapYear(year)))
+        return false;
+    at += 8;
+
+    int ms = 0;
+    if (at < len && p[at] == '.') {
+        int n = 0;
+        for (++at; at < len && p[at] >= '0' && p[at] <= '9'; ++at, ++n) {
+            if (n < 3) // finer than msecs is dropped
+                ms = ms * 10 + (p[at].unicode() - '0');
+        }
+        if (!n)
+            return false;
+        for (; n < 3; ++n)
+            ms *= 10;
+    }
+
+    int offset = 0; // secs east of UTC
+    if (at < len && !(p[at] == 'Z' && at + 1 == len)) {
+        if ((p[at] != '+' && p[at] != '-') || at + 6 != len || p[at + 3] != ':')
+            return false;
+        int oh = stampDigits(p + at + 1, 2);
+        int om = stampDigits(p + at + 4, 2);
+        if (oh < 0 || oh > 23 || om < 0 || om > 59)
+            return false;
+        offset = (oh * 60 + om) * 60 * (p[at] == '-' ? -1 : 1);
+    }
+
+    *msecs = (daysFromCivil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec - offset) * 1000 + ms;
+    return true;
+}
+
+/**
+    \brief Formats msecs since the epoch as an XEP-0082 date-time in UTC, e.g. 2026-04-01T12:00:00Z
+*/
+QString msecs2stamp(qint64 msecs, bool withMsecs)
+{
+    qint64 days = msecs / 86400000;
+    int    rest = int(msecs % 86400000);
+    if (rest < 0) {
+        rest += 86400000;
+        --days;
+    }
+    int year, month, day;
+    civilFromDays(days, &year, &month, &day);
+
+    char  buf[24];
+    char *p = buf;
+    stampPut(p, year, 4);
+    *p++ = '-';
+    stampPut(p, month, 2);
+    *p++ = '-';
+    stampPut(p, day, 2);
+    *p++ = 'T';
+    stampPut(p, rest / 3600000, 2);
+    *p++ = ':';
+    stampPut(p, rest / 60000 % 60, 2);
+    *p++ = ':';
+    stampPut(p, rest / 1000 % 60, 2);
+    if (withMsecs) {
+        *p++ = '.';
+        stampPut(p, rest % 1000, 3);
+    }
+    *p++ = 'Z';
+    return QString::fromLatin1(buf, int(p - buf));
+}
 
-    QTime xt;
-    xt.setHMS(hour, min, sec);
-    if (!xt.isValid())
+// YYYYMMDDThh:mm:ss
+QDateTime stamp2TS(const QString &ts)
+{
+    qint64 msecs;
+    if (ts.length() != 17 || !stamp2msecs(ts, &msecs))
         return QDateTime();
 
-    return QDateTime(xd, xt);
+    // in the time spec of the caller, like it always was
+    QDateTime dt = QDateTime::fromMSecsSinceEpoch(msecs, Qt::UTC);
+    return QDateTime(dt.date(), dt.time());
 }
 
 bool stamp2TS(const QString &ts, QDateTime *d)
@@ -223,57 +356,79 @@ void getErrorFromElement(const QDomElement &e, const QString &baseNS, int *code,
         *str = err.toString();
 }
 
-QDomElement addCorrectNS(const QDomElement &e)
+// true if every element of the tree has its namespace set properly, so there is nothing to correct
+static bool hasCorrectNS(const QDomElement &e)
 {
-    int x;
-
-    // grab child nodes
-    /*QDomDocumentFragment frag = e.ownerDocument().createDocumentFragment();
-    QDomNodeList nl = e.childNodes();
-    for(x = 0; x < nl.count(); ++x)
-        frag.appendChild(nl.item(x).cloneNode());*/
+    static QString xmlns = QStringLiteral("xmlns");
+    if (e.namespaceURI().isEmpty() || e.hasAttribute(xmlns))
+        return false;
+    for (QDomElement c = e.firstChildElement(); !c.isNull(); c = c.nextSiblingElement())
+        if (!hasCorrectNS(c))
+            return false;
+    return true;
+}
 
-    // find from this to parent closest node with xmlns/namespaceURI
-    QDomNode       n     = e;
+// parentNS is the namespace e inherits from its parent
+static QDomElement correctNS(const QDomElement &e, const QString &parentNS)
+{
     static QString xmlns = QStringLiteral("xmlns");
-    while (!n.isNull() && !n.toElement().hasAttribute(xmlns) && n.toElement().namespaceURI().isEmpty())
-        n = n.parentNode();
-    QString ns;
-    if (n.isNull() || !n.toElement().hasAttribute(xmlns)) { // if not found or it's namespaceURI
-        if (n.toElement().namespaceURI().isEmpty()) { // if nothing found, then use default jabber:client namespace
-            ns = "jabber:client";
-        } else {
-            ns = n.toElement().namespaceURI();
-        }
-    } else { // if found node with xmlns
-        ns = n.toElement().attribute(xmlns);
-    }
-    // at this point `ns` is either detected namespace of `e` or jabber:client
-    // make a new node
+
+    // an "xmlns" attribute wins over namespaceURI, like it does for the children
+    QString ns = e.hasAttribute(xmlns) ? e.attribute(xmlns) : e.namespaceURI();
+    if (ns.isEmpty())
+        ns = parentNS;
+
     QDomElement i = e.ownerDocument().createElementNS(ns, e.tagName());
 
     // copy attributes
     QDomNamedNodeMap al = e.attributes();
-    for (x = 0; x < al.count(); ++x) {
+    for (int x = 0; x < al.count(); ++x) {
         QDomAttr a = al.item(x).toAttr();
         if (a.name() != xmlns)
             i.setAttributeNodeNS(a.cloneNode().toAttr());
     }
 
-    // copy children
+    // copy children. the correct subtrees (usually all but the few made with createElement()) in one go
     QDomNodeList nl = e.childNodes();
-    for (x = 0; x < nl.count(); ++x) {
+    for (int x = 0; x < nl.count(); ++x) {
         QDomNode n = nl.item(x);
-        if (n.isElement())
-            i.appendChild(addCorrectNS(n.toElement()));
+        if (n.isElement() && !hasCorrectNS(n.toElement()))
+            i.appendChild(correctNS(n.toElement(), ns));
         else
             i.appendChild(n.cloneNode());
     }
-
-    // i.appendChild(frag);
     return i;
 }
 
+/**
+    \brief Gives every element of the tree a proper namespaceURI
+
+    Elements made without a namespace, or with the namespace set by an "xmlns" attribute, get the one
+    in effect for them, jabber:client if there is none.
+    If the tree is correct already (the common case for the stanzas we send) \a e itself is returned,
+    otherwise a corrected copy.
+*/
+QDomElement addCorrectNS(const QDomElement &e)
+{
+    if (hasCorrectNS(e))
+        return e;
+
+    // find from the parent of this to the root the closest node with xmlns/namespaceURI
+    static QString xmlns = QStringLiteral("xmlns");
+    QDomNode       n     = e.parentNode();
+    while (!n.isNull() && !n.toElement().hasAttribute(xmlns) && n.toElement().namespaceURI().isEmpty())
+        n = n.parentNode();
+    QString ns;
+    if (n.isNull()) // if nothing found, then use default jabber:client namespace
+        ns = QStringLiteral("jabber:client");
+    else if (n.toElement().hasAttribute(xmlns))
+        ns = n.toElement().attribute(xmlns);
+    else
+        ns = n.toElement().namespaceURI();
+
+    return correctNS(e, ns);
+}
+
 //----------------------------------------------------------------------------
 // XMLHelper
 //----------------------------------------------------------------------------
@@ -500,7 +655,113 @@ QDomElement textTagNS(QDomDocument *doc, const QString &ns, const QString &name,
 
 QDomElement textTagNS(QDomDocument *doc, const QString &ns, const QString &name, const QByteArray &content)
 {
-    return ::textTagNS(doc, ns, name, QString::fromLatin1(content.toBase64()));
+    return ::textTagNS(doc, ns, name, toBase64(content));
+}
+
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+QString toBase64(const QByteArray &data, int lineLength)
+{
+    int size = int((data.size() + 2) / 3 * 4);
+    if (lineLength > 0)
+        size += (size + lineLength - 1) / lineLength;
+    QString out(size, Qt::Uninitialized);
+
+    QChar       *o    = out.data();
+    const uchar *p    = reinterpret_cast<const uchar *>(data.constData());
+    const uchar *end  = p + data.size();
+    int          line = 0;
+    auto         put  = [&](char c) {
+        if (lineLength > 0 && line-- == 0) { // like vCard folding does it, a newline before each line
+            *o++ = QLatin1Char('\n');
+            line = lineLength - 1;
+        }
+        *o++ = QLatin1Char(c);
+    };
+    for (; end - p >= 3; p += 3) {
+        uint v = uint(p[0]) << 16 | uint(p[1]) << 8 | uint(p[2]);
+        put(base64Alphabet[v >> 18]);
+        put(base64Alphabet[(v >> 12) & 0x3f]);
+        put(base64Alphabet[(v >> 6) & 0x3f]);
+        put(base64Alphabet[v & 0x3f]);
+    }
+    if (end - p == 1) {
+        uint v = uint(p[0]) << 16;
+        put(base64Alphabet[v >> 18]);
+        put(base64Alphabet[(v >> 12) & 0x3f]);
+        put('=');
+        put('=');
+    } else if (end - p == 2) {
+        uint v = uint(p[0]) << 16 | uint(p[1]) << 8;
+        put(base64Alphabet[v >> 18]);
+        put(base64Alphabet[(v >> 12) & 0x3f]);
+        put(base64Alphabet[(v >> 6) & 0x3f]);
+        put('=');
+    }
+    return out;
+}
+
+QByteArray fromBase64(const QString &text)
+{
+    static const auto table = []() {
+        std::array<qint8, 128> t;
+        t.fill(-1);
+        for (int n = 0; n < 64; ++n)
+            t[size_t(base64Alphabet[n])] = qint8(n);
+        return t;
+    }();
+    auto dec = [](ushort c) { return c < 128 ? int(table[c]) : -1; };
+
+    QByteArray out;
+    out.resize(int(text.size() / 4 * 3 + 3));
+    char         *o = out.data();
+    const ushort *s = text.utf16();
+    const ushort *e = s + text.size();
+    uint          quad = 0;
+    int           n    = 0; // valid chars in quad
+
+    while (s < e) {
+        if (n == 0) {
+            // the common case, whole groups without line breaks or padding in between
+            while (e - s >= 4) {
+                int a = dec(s[0]), b = dec(s[1]), c = dec(s[2]), d = dec(s[3]);
+                if ((a | b | c | d) < 0)
+                    break;
+                uint v = uint(a) << 18 | uint(b) << 12 | uint(c) << 6 | uint(d);
+                o[0]   = char(v >> 16);
+                o[1]   = char(v >> 8);
+                o[2]   = char(v);
+                o += 3;
+                s += 4;
+            }
+            if (s == e)
+                break;
+        }
+        ushort c = *s++;
+        int    v = dec(c);
+        if (v < 0) {
+            if (c == '=')
+                break;
+            continue; // whitespace and whatever else isn't base64
+        }
+        quad = quad << 6 | uint(v);
+        if (++n == 4) {
+            o[0] = char(quad >> 16);
+            o[1] = char(quad >> 8);
+            o[2] = char(quad);
+            o += 3;
+            n    = 0;
+            quad = 0;
+        }
+    }
+    if (n == 2) {
+        *o++ = char(quad >> 4);
+    } else if (n == 3) {
+        *o++ = char(quad >> 10);
+        *o++ = char(quad >> 2);
+    }
+    out.resize(int(o - out.constData()));
+    return out;
 }
 
 } // namespace XMLHelper
@@ -56,6 +56,8 @@ private:
 QDateTime    stamp2TS(const QString &ts);
 bool         stamp2TS(const QString &ts, QDateTime *d);
 QString      TS2stamp(const QDateTime &d);
+bool         stamp2msecs(const QString &ts, qint64 *msecs);
+QString      msecs2stamp(qint64 msecs, bool withMsecs = false);
 QDomElement  textTag(QDomDocument *doc, const QString &name, const QString &content);
 QDomElement  textTagNS(QDomDocument *doc, const QString &ns, const QString &name, const QString &content);
 QString      tagContent(const QDomElement &e);
@@ -96,6 +98,10 @@ void xmlToStringList(const QDomElement &e, const QString &name, QStringList *v);
 void setBoolAttribute(QDomElement e, const QString &name, bool b);
 void readBoolAttribute(QDomElement e, const QString &name, bool *v);
 
+// base64 straight from/to the UTF-16 of text nodes. lineLength > 0 puts a newline before every line of it
+QString    toBase64(const QByteArray &data, int lineLength = 0);
+QByteArray fromBase64(const QString &text);
+
 // QString tagContent(const QDomElement &e); // obsolete;
 QString sanitizedLang(const QString &lang);
 
@@ -3,86 +3,75 @@
 #include "common.h"
 #include "zlib.h"
 
-#include <QIODevice>
-#include <QObject>
 #include <QtDebug>
 
-ZLibCompressor::ZLibCompressor(QIODevice *device, int compression) : device_(device)
+ZLibCompressor::ZLibCompressor(int compression) : level_(compression), levelChanged_(false)
 {
     zlib_stream_ = (z_stream *)malloc(sizeof(z_stream));
     initZStream(zlib_stream_);
     int result = deflateInit(zlib_stream_, compression);
     Q_ASSERT(result == Z_OK);
     Q_UNUSED(result);
-    connect(device, SIGNAL(aboutToClose()), this, SLOT(flush()));
-    flushed_ = false;
 }
 
 ZLibCompressor::~ZLibCompressor()
 {
-    flush();
+    // nobody reads what Z_FINISH would produce at this point, so just release the state
+    int result = deflateEnd(zlib_stream_);
+    if (result != Z_OK && result != Z_DATA_ERROR)
+        qWarning() << QString("compressor.c: deflateEnd failed (%1)").arg(result);
     free(zlib_stream_);
 }
 
-void ZLibCompressor::flush()
+void ZLibCompressor::setLevel(int level)
 {
-    if (flushed_)
+    if (level == level_)
         return;
-
-    // Flush
-    write(QByteArray(), true);
-    int result = deflateEnd(zlib_stream_);
-    if (result != Z_OK)
-        qWarning() << QString("compressor.c: deflateEnd failed (%1)").arg(result);
-
-    flushed_ = true;
+    level_        = level;
+    levelChanged_ = true;
 }
 
-int ZLibCompressor::write(const QByteArray &input) { return write(input, false); }
+int ZLibCompressor::level() const { return level_; }
 
-int ZLibCompressor::write(const QByteArray &input, bool flush)
+int ZLibCompressor::write(const QByteArray &input, QByteArray &output)
 {
     int result;
+
+    // Everything written so far was sync-flushed, so deflateBound() plus the flush marker and a possible
+    // block switch caused by deflateParams() is enough for a single pass in practice.
+    int output_position = int(output.size());
+    int room            = int(deflateBound(zlib_stream_, uLong(input.size()))) + 16;
+    output.resize(output_position + room);
+    zlib_stream_->avail_out = uInt(room);
+    zlib_stream_->next_out  = (Bytef *)(output.data() + output_position);
+
+    // switch the level before handing over the input, or zlib would compress it with the old one
+    if (levelChanged_) {
+        zlib_stream_->avail_in = 0;
+        result                 = deflateParams(zlib_stream_, level_, Z_DEFAULT_STRATEGY);
+        if (result != Z_OK && result != Z_BUF_ERROR)
+            qWarning() << QString("compressor.cpp: deflateParams failed (%1)").arg(result);
+        levelChanged_ = false;
+    }
     zlib_stream_->avail_in = uInt(input.size());
     zlib_stream_->next_in  = (Bytef *)input.data();
-    QByteArray output;
 
-    // Write the data
-    int output_position = 0;
     do {
-        output.resize(output_position + CHUNK_SIZE);
-        zlib_stream_->avail_out = CHUNK_SIZE;
-        zlib_stream_->next_out  = (Bytef *)(output.data() + output_position);
-        result                  = deflate(zlib_stream_, (flush ? Z_FINISH : Z_NO_FLUSH));
+        if (zlib_stream_->avail_out == 0) {
+            output.resize(output.size() + CHUNK_SIZE);
+            zlib_stream_->avail_out = CHUNK_SIZE;
+            zlib_stream_->next_out  = (Bytef *)(output.data() + output.size() - CHUNK_SIZE);
+        }
+        result = deflate(zlib_stream_, Z_SYNC_FLUSH);
         if (result == Z_STREAM_ERROR) {
             qWarning() << QString("compressor.cpp: Error ('%1')").arg(zlib_stream_->msg);
+            output.resize(output_position);
             return result;
         }
-        output_position += CHUNK_SIZE;
     } while (zlib_stream_->avail_out == 0);
     if (zlib_stream_->avail_in != 0) {
         qWarning("ZLibCompressor: avail_in != 0");
     }
-    output_position -= zlib_stream_->avail_out;
-
-    // Flush the data
-    if (!flush) {
-        do {
-            output.resize(output_position + CHUNK_SIZE);
-            zlib_stream_->avail_out = CHUNK_SIZE;
-            zlib_stream_->next_out  = (Bytef *)(output.data() + output_position);
-            result                  = deflate(zlib_stream_, Z_SYNC_FLUSH);
-            if (result == Z_STREAM_ERROR) {
-                qWarning() << QString("compressor.cpp: Error ('%1')").arg(zlib_stream_->msg);
-                return result;
-            }
-            output_position += CHUNK_SIZE;
-        } while (zlib_stream_->avail_out == 0);
-        output_position -= zlib_stream_->avail_out;
-    }
-    output.resize(output_position);
-
-    // Write the compressed data
-    device_->write(output);
+    output.resize(output.size() - int(zlib_stream_->avail_out));
     return 0;
 }
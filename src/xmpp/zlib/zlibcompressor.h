@@ -3,29 +3,24 @@
 
 #include "zlib.h"
 
-#include <QObject>
-
-class QIODevice;
-
-class ZLibCompressor : public QObject {
-    Q_OBJECT
+#include <QByteArray>
 
+class ZLibCompressor {
 public:
-    ZLibCompressor(QIODevice *device, int compression = Z_DEFAULT_COMPRESSION);
+    ZLibCompressor(int compression = Z_DEFAULT_COMPRESSION);
     ~ZLibCompressor();
 
-    int write(const QByteArray &);
-
-protected slots:
-    void flush();
+    // compresses and sync-flushes input, appending the result to output
+    int write(const QByteArray &input, QByteArray &output);
 
-protected:
-    int write(const QByteArray &, bool flush);
+    // takes effect with the next write()
+    void setLevel(int level);
+    int  level() const;
 
 private:
-    QIODevice *device_;
-    z_stream  *zlib_stream_;
-    bool       flushed_;
+    z_stream *zlib_stream_;
+    int       level_;
+    bool      levelChanged_;
 };
 
 #endif // ZLIBCOMPRESSOR_H
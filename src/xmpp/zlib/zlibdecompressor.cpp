@@ -3,89 +3,59 @@
 #include "xmpp/zlib/common.h"
 #include "zlib.h"
 
-#include <QIODevice>
-#include <QObject>
 #include <QtDebug>
 
-ZLibDecompressor::ZLibDecompressor(QIODevice *device) : device_(device)
+ZLibDecompressor::ZLibDecompressor()
 {
     zlib_stream_ = (z_stream *)malloc(sizeof(z_stream));
     initZStream(zlib_stream_);
     int result = inflateInit2(zlib_stream_, 15 + 32);
     Q_ASSERT(result == Z_OK);
     Q_UNUSED(result);
-    connect(device, SIGNAL(aboutToClose()), this, SLOT(flush()));
-    flushed_ = false;
 }
 
 ZLibDecompressor::~ZLibDecompressor()
 {
-    flush();
-    free(zlib_stream_);
-}
-
-void ZLibDecompressor::flush()
-{
-    if (flushed_)
-        return;
-
-    // Flush
-    write(QByteArray(), true);
     int result = inflateEnd(zlib_stream_);
     if (result != Z_OK)
         qWarning() << QString("compressor.c: inflateEnd failed (%1)").arg(result);
-
-    flushed_ = true;
+    free(zlib_stream_);
 }
 
-qint64 ZLibDecompressor::write(const QByteArray &input) { return write(input, false); }
-
-qint64 ZLibDecompressor::write(const QByteArray &input, bool flush)
+int ZLibDecompressor::write(const QByteArray &input, QByteArray &output)
 {
     int result;
     zlib_stream_->avail_in = uInt(input.size());
     zlib_stream_->next_in  = (Bytef *)input.data();
-    QByteArray output;
 
-    // Write the data
-    int output_position = 0;
-    do {
-        output.resize(output_position + CHUNK_SIZE);
-        zlib_stream_->avail_out = CHUNK_SIZE;
-        zlib_stream_->next_out  = (Bytef *)(output.data() + output_position);
-        result                  = inflate(zlib_stream_, (flush ? Z_FINISH : Z_NO_FLUSH));
-        if (result == Z_STREAM_ERROR) {
+    // XML usually inflates to a few times its compressed size. Start from there and double the room
+    // when it isn't enough, instead of growing a small chunk at a time.
+    int output_position = int(output.size());
+    int room            = qMax(CHUNK_SIZE, int(input.size()) * 4);
+    output.resize(output_position + room);
+    zlib_stream_->avail_out = uInt(room);
+    zlib_stream_->next_out  = (Bytef *)(output.data() + output_position);
+
+    for (;;) {
+        result = inflate(zlib_stream_, Z_SYNC_FLUSH);
+        if (result == Z_STREAM_ERROR || result == Z_DATA_ERROR || result == Z_NEED_DICT || result == Z_MEM_ERROR) {
             qWarning() << QString("compressor.cpp: Error ('%1')").arg(zlib_stream_->msg);
-            return result;
+            output.resize(output_position);
+            return Z_STREAM_ERROR;
         }
-        output_position += CHUNK_SIZE;
-    } while (zlib_stream_->avail_out == 0);
-    // Q_ASSERT(zlib_stream_->avail_in == 0);
+        if (zlib_stream_->avail_out != 0 || (zlib_stream_->avail_in == 0 && result == Z_BUF_ERROR))
+            break;
+        int used = int(output.size());
+        output.resize(used * 2);
+        zlib_stream_->avail_out = uInt(output.size() - used);
+        zlib_stream_->next_out  = (Bytef *)(output.data() + used);
+    }
     if (zlib_stream_->avail_in != 0) {
         qWarning() << "ZLibDecompressor: Unexpected state: avail_in=" << zlib_stream_->avail_in
                    << ",avail_out=" << zlib_stream_->avail_out << ",result=" << result;
+        output.resize(output_position);
         return Z_STREAM_ERROR; // FIXME: Should probably return 'result'
     }
-    output_position -= zlib_stream_->avail_out;
-
-    // Flush the data
-    if (!flush) {
-        do {
-            output.resize(output_position + CHUNK_SIZE);
-            zlib_stream_->avail_out = CHUNK_SIZE;
-            zlib_stream_->next_out  = (Bytef *)(output.data() + output_position);
-            result                  = inflate(zlib_stream_, Z_SYNC_FLUSH);
-            if (result == Z_STREAM_ERROR) {
-                qWarning() << QString("compressor.cpp: Error ('%1')").arg(zlib_stream_->msg);
-                return result;
-            }
-            output_position += CHUNK_SIZE;
-        } while (zlib_stream_->avail_out == 0);
-        output_position -= zlib_stream_->avail_out;
-    }
-    output.resize(output_position);
-
-    // Write the compressed data
-    device_->write(output);
+    output.resize(output.size() - int(zlib_stream_->avail_out));
     return 0;
 }
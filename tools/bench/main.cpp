@@ -0,0 +1,472 @@
+/*
+ * iris_bench - replays stanza corpora through the XMPP stream pipeline
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp/xmpp-core/parser.h"
+#include "xmpp/xmpp-core/protocol.h"
+#include "xmpp/xmpp-core/xmlprotocol.h"
+#include "xmpp/xmpp-im/xmpp_xmlcommon.h"
+
+#include <iris/metrics.h>
+#include <iris/streamrecorder.h>
+#include <iris/xmpp_client.h>
+#include <iris/xmpp_jid.h>
+#include <iris/xmpp_task.h>
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+// Every allocation of the process goes through here, so we can tell how many a stanza costs.
+static std::atomic<quint64> allocations { 0 };
+
+void *operator new(std::size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+using namespace XMPP;
+
+static const char *streamOpen = "<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+                                "xmlns:stream='http://etherx.jabber.org/streams' from='example.com' id='bench' "
+                                "version='1.0'>";
+
+// network reads rarely deliver more than this at once
+static const int chunkSize = 4096;
+
+struct Corpus {
+    QString    name;
+    QByteArray data; // concatenated stanzas, without the stream wrapper
+};
+
+//----------------------------------------------------------------------------
+// Synthetic corpora, used when no recorded ones are given
+//----------------------------------------------------------------------------
+static Corpus presenceFlood(int count)
+{
+    Corpus c { "presence-flood", {} };
+    for (int n = 0; n < count; ++n) {
+        c.data += QString("<presence from='contact%1@example.com/mobile-%2' to='me@example.com/bench'>"
+                          "<show>away</show><status>Out for lunch &amp; coffee</status><priority>5</priority>"
+                          "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='https://psi-im.org' "
+                          "ver='q07IKJEyjvHSyhy//CH0CxmKi8w='/></presence>")
+                      .arg(n)
+                      .arg(n % 7)
+                      .toUtf8();
+    }
+    return c;
+}
+
+static Corpus mucHistory(int count)
+{
+    Corpus c { "muc-history", {} };
+    for (int n = 0; n < count; ++n) {
+        c.data += QString("<message from='room@conference.example.com/nick%1' to='me@example.com/bench' "
+                          "type='groupchat' id='hist%2'><body>Message number %2 of the history, with some "
+                          "text to make it look real &lt;3</body><delay xmlns='urn:xmpp:delay' "
+                          "from='room@conference.example.com' stamp='2024-05-01T12:%3:00Z'/></message>")
+                      .arg(n % 40)
+                      .arg(n)
+                      .arg(n % 60, 2, 10, QChar('0'))
+                      .toUtf8();
+    }
+    return c;
+}
+
+static Corpus largeVCards(int count)
+{
+    Corpus     c { "large-vcard", {} };
+    QByteArray photo = QByteArray(24 * 1024, '\x5a').toBase64();
+    for (int n = 0; n < count; ++n) {
+        c.data += QString("<iq from='contact%1@example.com' to='me@example.com/bench' type='result' id='vc%1'>"
+                          "<vCard xmlns='vcard-temp'><FN>Contact %1</FN><NICKNAME>c%1</NICKNAME>"
+                          "<PHOTO><TYPE>image/png</TYPE><BINVAL>")
+                      .arg(n)
+                      .toUtf8();
+        c.data += photo;
+        c.data += "</BINVAL></PHOTO></vCard></iq>";
+    }
+    return c;
+}
+
+static Corpus pubsubItems(int count)
+{
+    Corpus c { "pubsub-items", {} };
+    for (int n = 0; n < count; ++n) {
+        c.data += QString("<message from='pubsub.example.com' to='me@example.com/bench' id='ps%1'>"
+                          "<event xmlns='http://jabber.org/protocol/pubsub#event'><items node='urn:xmpp:microblog:0'>"
+                          "<item id='item%1'><entry xmlns='http://www.w3.org/2005/Atom'><title>Post %1</title>"
+                          "<published>2024-05-01T12:00:00Z</published><content type='text'>Some content for "
+                          "post %1</content></entry></item></items></event></message>")
+                      .arg(n)
+                      .toUtf8();
+    }
+    return c;
+}
+
+//----------------------------------------------------------------------------
+// XmlProtocol driven just far enough to get stanzas in and out
+//----------------------------------------------------------------------------
+class BenchProtocol : public XmlProtocol {
+public:
+    int  received = 0;
+    bool echo     = false;
+
+    void start() { startConnect(); }
+    int  write(const QDomElement &e) { return writeElement(e, 0, true); }
+
+    // pumps the state machine until it needs more data, returns number of bytes it wants to send
+    int pump()
+    {
+        int out = 0;
+        while (processStep()) {
+            if (event == ESend)
+                out += takeOutgoingData().size();
+        }
+        return out + takeOutgoingData().size();
+    }
+
+protected:
+    QDomElement docElement() override
+    {
+        QDomElement e = doc.createElementNS(NS_ETHERX, "stream:stream");
+        e.setAttribute("xmlns", NS_CLIENT);
+        return e;
+    }
+    void handleDocOpen(const Parser::Event &) override { }
+    bool handleError() override { return false; }
+    bool handleCloseFinished() override { return true; }
+    bool stepAdvancesParser() const override { return true; }
+    bool stepRequiresElement() const override { return true; }
+    bool doStep(const QDomElement &e) override
+    {
+        ++received;
+        if (echo) {
+            writeElement(e, 0, true);
+            event = ESend;
+        } else {
+            event = ECustom;
+        }
+        return true;
+    }
+
+private:
+    QDomDocument doc;
+};
+
+//----------------------------------------------------------------------------
+// Stages
+//----------------------------------------------------------------------------
+struct Result {
+    qint64  nsecs  = 0;
+    int     count  = 0;
+    qint64  bytes  = 0;
+    quint64 allocs = 0;
+};
+
+static Result measure(const std::function<void(Result &)> &f)
+{
+    Result        r;
+    QElapsedTimer t;
+    quint64       a = allocations;
+    t.start();
+    f(r);
+    r.nsecs  = t.nsecsElapsed();
+    r.allocs = allocations - a;
+    return r;
+}
+
+static void stageParser(const Corpus &c, Result &r)
+{
+    Parser       p;
+    QDomDocument doc;
+    p.setCompactMode(true);
+    p.appendData(streamOpen);
+    p.readNext();
+    for (int at = 0; at < c.data.size(); at += chunkSize) {
+        p.appendData(c.data.mid(at, chunkSize));
+        for (Parser::Event e = p.readNext(); !e.isNull(); e = p.readNext()) {
+            if (e.type() != Parser::Event::Element)
+                continue;
+            // materialize like XmlProtocol does, nobody can use a stanza which is not in a QDomDocument
+            if (e.isCompact())
+                e.compactElement().toDomElement(doc);
+            ++r.count;
+        }
+    }
+    r.bytes = c.data.size();
+}
+
+static void stageProtocol(const Corpus &c, Result &r, bool echo)
+{
+    BenchProtocol proto;
+    proto.echo = echo;
+    proto.start();
+    proto.pump();
+    proto.addIncomingData(streamOpen);
+    proto.pump();
+    for (int at = 0; at < c.data.size(); at += chunkSize) {
+        proto.addIncomingData(c.data.mid(at, chunkSize));
+        r.bytes += proto.pump();
+    }
+    r.count = proto.received;
+    if (!echo)
+        r.bytes = c.data.size();
+}
+
+static QList<QDomElement> parseAll(const Corpus &c, QDomDocument &doc)
+{
+    QList<QDomElement> list;
+    Parser             p;
+    p.appendData(streamOpen);
+    p.appendData(c.data);
+    for (Parser::Event e = p.readNext(); !e.isNull(); e = p.readNext()) {
+        if (e.type() == Parser::Event::Element)
+            list += doc.importNode(e.element(), true).toElement();
+    }
+    return list;
+}
+
+static void stageSerializer(const QList<QDomElement> &stanzas, Result &r)
+{
+    BenchProtocol proto;
+    proto.start();
+    proto.pump();
+    proto.addIncomingData(streamOpen);
+    proto.pump();
+    for (const QDomElement &e : stanzas) {
+        r.bytes += proto.write(e);
+        proto.takeOutgoingData();
+    }
+    r.count = int(stanzas.size());
+}
+
+static void stageDispatch(Client &client, const QList<QDomElement> &stanzas, Result &r)
+{
+    // what Client::distribute() does, minus the error replies which need a stream
+    for (const QDomElement &e : stanzas) {
+        if (e.hasAttribute(QStringLiteral("from")) && !Jid(e.attribute(QStringLiteral("from"))).isValid())
+            continue;
+        client.rootTask()->take(e);
+    }
+    r.count = int(stanzas.size());
+}
+
+// XEP-0082 stamps as found in <delay/> of MAM results and offline messages, some with msecs and offsets
+static QStringList delayStamps(int count)
+{
+    QStringList list;
+    for (int n = 0; n < count; ++n) {
+        QString s = QString("2024-%1-%2T%3:%4:%5")
+                        .arg(n % 12 + 1, 2, 10, QChar('0'))
+                        .arg(n % 28 + 1, 2, 10, QChar('0'))
+                        .arg(n % 24, 2, 10, QChar('0'))
+                        .arg(n % 60, 2, 10, QChar('0'))
+                        .arg(n * 7 % 60, 2, 10, QChar('0'));
+        if (n % 3 == 1)
+            s += QString(".%1").arg(n % 1000, 3, 10, QChar('0'));
+        s += n % 5 == 4 ? QString("+02:00") : QString("Z");
+        list += s;
+    }
+    return list;
+}
+
+static void stageStampParse(const QStringList &stamps, Result &r)
+{
+    qint64 sum = 0;
+    for (const QString &s : stamps) {
+        qint64 msecs;
+        if (stamp2msecs(s, &msecs))
+            sum += msecs;
+        r.bytes += s.size();
+    }
+    r.count = sum ? int(stamps.size()) : 0;
+}
+
+// what the stamps cost before, for comparison
+static void stageStampQDateTime(const QStringList &stamps, Result &r)
+{
+    qint64 sum = 0;
+    for (const QString &s : stamps) {
+        sum += QDateTime::fromString(s, Qt::ISODateWithMs).toMSecsSinceEpoch();
+        r.bytes += s.size();
+    }
+    r.count = sum ? int(stamps.size()) : 0;
+}
+
+static void stageStampFormat(const QStringList &stamps, Result &r)
+{
+    for (int n = 0; n < stamps.size(); ++n)
+        r.bytes += msecs2stamp(qint64(n) * 1000003, n % 3 == 1).size();
+    r.count = int(stamps.size());
+}
+
+static void report(const QString &corpus, const char *stage, const Result &r)
+{
+    double secs = r.nsecs / 1e9;
+    std::printf("%-18s %-12s %8d %12.0f %10.2f %10.1f\n", qPrintable(corpus), stage, r.count,
+                secs > 0 ? r.count / secs : 0., secs > 0 ? r.bytes / secs / (1024 * 1024) : 0.,
+                r.count ? double(r.allocs) / r.count : 0.);
+}
+
+static Result best(const std::function<void(Result &)> &f, int iterations)
+{
+    Result b;
+    for (int n = 0; n < iterations; ++n) {
+        Result r = measure(f);
+        if (n == 0 || r.nsecs < b.nsecs)
+            b = r;
+    }
+    return b;
+}
+
+// a recorded session through the ClientStream and the Client, with the event loop in between
+static int replay(const QString &fileName, bool realTime)
+{
+    StreamReplayer replayer;
+    if (!replayer.load(fileName)) {
+        std::fprintf(stderr, "can't replay %s: %s\n", qPrintable(fileName), qPrintable(replayer.errorString()));
+        return 1;
+    }
+    replayer.setRealTime(realTime);
+
+    Client        client;
+    QElapsedTimer timer;
+    quint64       allocs = allocations;
+    QObject::connect(&replayer, &StreamReplayer::finished, QCoreApplication::instance(), &QCoreApplication::quit);
+    timer.start();
+    replayer.start(&client);
+    QCoreApplication::exec();
+
+    double secs  = timer.nsecsElapsed() / 1e9;
+    qint64 bytes = replayer.incomingBytes();
+    std::printf("%s: %lld bytes in %.3f s, %.2f MiB/s, %.1f allocs/KiB\n", qPrintable(QFileInfo(fileName).fileName()),
+                qlonglong(bytes), secs, secs > 0 ? bytes / secs / (1024 * 1024) : 0.,
+                bytes ? double(allocations - allocs) * 1024 / bytes : 0.);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    int         iterations = 5;
+    bool        metrics    = false;
+    bool        realTime   = false;
+    QString     replayFile;
+    QStringList files;
+    QStringList args = app.arguments().mid(1);
+    for (int n = 0; n < args.count(); ++n) {
+        if (args[n] == "-n" && n + 1 < args.count()) {
+            iterations = qMax(1, args[++n].toInt());
+        } else if (args[n] == "--metrics") {
+            metrics = true;
+        } else if (args[n] == "--replay" && n + 1 < args.count()) {
+            replayFile = args[++n];
+        } else if (args[n] == "--realtime") {
+            realTime = true;
+        } else if (args[n] == "-h" || args[n] == "--help") {
+            std::printf("usage: iris_bench [-n iterations] [--metrics] [corpus.xml ...]\n"
+                        "       iris_bench --replay recording [--realtime] [--metrics]\n\n"
+                        "A corpus file contains a sequence of stanzas as they appear on the wire, without the\n"
+                        "stream header, or it's a recording of a session, see StreamRecorder. Without files,\n"
+                        "synthetic corpora are generated.\n"
+                        "--replay feeds a recording through the whole client stack, as fast as possible or with\n"
+                        "the recorded timing with --realtime.\n"
+                        "--metrics dumps the library metrics at the end (built with IRIS_ENABLE_METRICS).\n");
+            return 0;
+        } else {
+            files += args[n];
+        }
+    }
+
+    if (!replayFile.isEmpty()) {
+        int ret = replay(replayFile, realTime);
+        if (metrics)
+            std::printf("\n%s", XMPP::Metrics::toPrometheus().constData());
+        return ret;
+    }
+
+    QList<Corpus> corpora;
+    for (const QString &fn : std::as_const(files)) {
+        // what the server sent in a recorded session
+        QList<StreamRecorder::Chunk> chunks;
+        if (StreamRecorder::load(fn, nullptr, &chunks)) {
+            Corpus c { QFileInfo(fn).fileName(), {} };
+            for (auto const &chunk : std::as_const(chunks)) {
+                if (chunk.direction == StreamRecorder::Incoming)
+                    c.data += chunk.data;
+            }
+            corpora += c;
+            continue;
+        }
+
+        QFile f(fn);
+        if (!f.open(QIODevice::ReadOnly)) {
+            std::fprintf(stderr, "can't open %s\n", qPrintable(fn));
+            return 1;
+        }
+        corpora += Corpus { QFileInfo(fn).fileName(), f.readAll() };
+    }
+    if (corpora.isEmpty())
+        corpora = { presenceFlood(10000), mucHistory(5000), largeVCards(200), pubsubItems(5000) };
+
+    Client client;
+    client.start("example.com", "me", "", "bench");
+
+    std::printf("%-18s %-12s %8s %12s %10s %10s\n", "corpus", "stage", "stanzas", "stanzas/s", "MiB/s",
+                "allocs/st");
+    for (const Corpus &c : std::as_const(corpora)) {
+        report(c.name, "parser", best([&](Result &r) { stageParser(c, r); }, iterations));
+        report(c.name, "xmlprotocol", best([&](Result &r) { stageProtocol(c, r, false); }, iterations));
+        report(c.name, "echo", best([&](Result &r) { stageProtocol(c, r, true); }, iterations));
+
+        QDomDocument       doc;
+        QList<QDomElement> stanzas = parseAll(c, doc);
+        report(c.name, "serializer", best([&](Result &r) { stageSerializer(stanzas, r); }, iterations));
+        report(c.name, "dispatch", best([&](Result &r) { stageDispatch(client, stanzas, r); }, iterations));
+    }
+
+    const QStringList stamps = delayStamps(100000);
+    report("xep-0082", "stamp-parse", best([&](Result &r) { stageStampParse(stamps, r); }, iterations));
+    report("xep-0082", "qdatetime", best([&](Result &r) { stageStampQDateTime(stamps, r); }, iterations));
+    report("xep-0082", "stamp-format", best([&](Result &r) { stageStampFormat(stamps, r); }, iterations));
+
+    if (metrics) {
+        if (!XMPP::Metrics::isEnabled())
+            std::fprintf(stderr, "the library is built without IRIS_ENABLE_METRICS\n");
+        std::printf("\n%s", XMPP::Metrics::toPrometheus().constData());
+    }
+    return 0;
+}
@@ -17,10 +17,13 @@
  */
 
 #include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QNetworkAddressEntry>
+#include <QNetworkDatagram>
 #include <QNetworkInterface>
 #include <QTimer>
 #include <QUdpSocket>
+#include <QtEndian>
 
 #include <QtCrypto>
 #ifdef QCA_STATIC
@@ -34,7 +37,21 @@ Q_IMPORT_PLUGIN(qca_ossl)
 #include <iris/netnames.h>
 #include <iris/processquit.h>
 #include <iris/udpportreserver.h>
+#ifdef JINGLE_SCTP
+#include "xmpp/xmpp-im/jingle-sctp.h"
+#endif
+
+#include <algorithm>
 #include <stdio.h>
+#include <vector>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+// type, sequence number and the sender's clock in usecs. what the responder echoes back
+#define BENCH_HEADER_SIZE 13
+// how long to wait for the last echoes once sending has stopped
+#define BENCH_DRAIN_MSECS 1000
 
 // scope values: 0 = local, 1 = link-local, 2 = private, 3 = public
 static int getAddressScope(const QHostAddress &a)
@@ -201,6 +218,36 @@ static XMPP::Ice176::Candidate line_to_candidate(const QString &in)
     return out;
 }
 
+// position p (0-100) of the sorted values. -1 if there are none
+static qint64 percentile(std::vector<qint64> &values, int p)
+{
+    if (values.empty())
+        return -1;
+    auto at = values.begin() + (values.size() - 1) * size_t(p) / 100;
+    std::nth_element(values.begin(), at, values.end());
+    return *at;
+}
+
+// user + system time of the process. -1 where we can't tell
+static qint64 cpuUsecs()
+{
+#ifdef Q_OS_UNIX
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        return (qint64(ru.ru_utime.tv_sec) + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+    return -1;
+}
+
+static QByteArray benchPacket(char type, quint32 seq, qint64 usecs, int size = BENCH_HEADER_SIZE)
+{
+    QByteArray buf(qMax(size, BENCH_HEADER_SIZE), 0);
+    buf[0] = type;
+    qToBigEndian(seq, buf.data() + 1);
+    qToBigEndian(usecs, buf.data() + 5);
+    return buf;
+}
+
 class IceOffer {
 public:
     QString                        user, pass;
@@ -444,6 +491,12 @@ public:
     bool            opt_ipv6_only      = false;
     bool            opt_relay_udp_only = false;
     bool            opt_relay_tcp_only = false;
+    bool            opt_dtls           = true;
+    bool            opt_bench          = false;
+    int             opt_benchSize      = 1000;
+    int             opt_benchRate      = 1000; // datagrams per second
+    int             opt_benchDuration  = 10;   // seconds
+    bool            opt_benchSctp      = false;
 
     XMPP::NameResolver                dns;
     QHostAddress                      stunAddr;
@@ -457,6 +510,31 @@ public:
     IceBlockReader                   *reader  = nullptr;
     EnterPrompt                      *prompt  = nullptr;
     IceOffer                          inOffer;
+#ifdef JINGLE_SCTP
+    XMPP::Jingle::SCTP::Association *sctp = nullptr;
+    XMPP::Jingle::Connection::Ptr    sctpChannel;
+#endif
+
+    // benchmark. the initiator sends, the responder echoes the header of every datagram back
+    QElapsedTimer       phaseClock; // since start_ice()
+    qint64              checksStartedAt = 0;
+    qint64              gatheringMsecs  = -1;
+    qint64              iceMsecs        = -1;
+    qint64              dtlsMsecs       = -1;
+    qint64              sctpMsecs       = -1;
+    QElapsedTimer       benchClock;
+    QTimer             *benchTimer     = nullptr;
+    bool                benchConnected = false;
+    bool                benchReported  = false;
+    qint64              benchStarted   = 0; // usecs of benchClock
+    qint64              benchStopped   = 0;
+    qint64              cpuStarted     = -1;
+    quint32             benchSent      = 0;
+    quint32             benchAcked     = 0;
+    qint64              peerReceived   = -1; // as told by the responder at the end
+    quint32             benchReceived  = 0;  // responder
+    qint64              benchBytesIn   = 0;
+    std::vector<qint64> latencies; // usecs, half the round trip
 
     App() : portReserver(this) { }
 
@@ -509,6 +587,7 @@ public slots:
 public:
     void start_ice()
     {
+        phaseClock.start();
         ice = new XMPP::Ice176(this);
         connect(ice, SIGNAL(started()), SLOT(ice_started()));
         connect(ice, SIGNAL(stopped()), SLOT(ice_stopped()));
@@ -527,9 +606,15 @@ public:
         connect(ice, &XMPP::Ice176::iceFinished, this,
                 []() { printf("ICE negotiation has finished and media stream is active now!\n"); });
 
-        // set up local ports for forwarding
+        // set up local ports for forwarding. the benchmark generates its own traffic
         for (int n = 0; n < opt_channels; ++n) {
             Channel chan;
+            chan.ready = false;
+            if (opt_bench) {
+                chan.sock6 = chan.sock4 = nullptr;
+                channels += chan;
+                continue;
+            }
 
             int port   = opt_localBase + 32 + n;
             chan.sock6 = setupSocket(QHostAddress::LocalHostIPv6, port);
@@ -541,8 +626,6 @@ public:
                 return;
             }
 
-            chan.ready = false;
-
             channels += chan;
         }
 
@@ -657,7 +740,7 @@ public:
         else
             ice->start(XMPP::Ice176::Responder);
 
-        if (QCA::isSupported("dtls")) {
+        if (opt_dtls && QCA::isSupported("dtls")) {
             start_dtls();
         }
     }
@@ -668,6 +751,10 @@ Q_SIGNALS:
 private:
     void proxyNet2App(int componentIndex, const QByteArray &buf)
     {
+        if (opt_bench) {
+            bench_datagram(buf);
+            return;
+        }
         if (channels[componentIndex].sock6)
             channels[componentIndex].sock6->writeDatagram(buf, QHostAddress::LocalHostIPv6,
                                                           opt_localBase + componentIndex);
@@ -681,18 +768,30 @@ private:
         dtls.reserve(opt_channels);
         for (int componentIndex = 0; componentIndex < opt_channels; componentIndex++) {
             dtls.append(new XMPP::Dtls(this));
-            dtls[componentIndex]->generateCertificate();
-            auto h = dtls[componentIndex]->fingerprint();
+            // generates the certificate. the roles are settled once the peer's block is in
+            dtls[componentIndex]->initOutgoing();
+            auto h = dtls[componentIndex]->localFingerprint().hash;
             printf("fingerprint[%d]:%s:%s\n", componentIndex, qPrintable(h.stringType()), h.data().toHex(':').data());
             connect(dtls[componentIndex], &XMPP::Dtls::readyRead, this,
                     [this, dtls = dtls[componentIndex], componentIndex]() {
-                        proxyNet2App(componentIndex, dtls->readDatagram());
+                        auto buf = dtls->readDatagram();
+#ifdef JINGLE_SCTP
+                        if (sctp && componentIndex == 0) {
+                            sctp->writeIncoming(buf);
+                            return;
+                        }
+#endif
+                        proxyNet2App(componentIndex, buf);
                     });
             connect(dtls[componentIndex], &XMPP::Dtls::readyReadOutgoing, this,
                     [this, dtls = dtls[componentIndex], componentIndex]() {
                         ice->writeDatagram(componentIndex, dtls->readOutgoingDatagram());
                     });
-            connect(dtls[componentIndex], &XMPP::Dtls::connected, this, []() { printf("DTLS connected\n"); });
+            connect(dtls[componentIndex], &XMPP::Dtls::connected, this, [this, componentIndex]() {
+                printf("DTLS connected\n");
+                if (componentIndex == 0)
+                    dtls_connected();
+            });
             connect(dtls[componentIndex], &XMPP::Dtls::closed, this, []() { printf("DTLS closed\n"); });
             connect(dtls[componentIndex], &XMPP::Dtls::errorOccurred, this,
                     [](QAbstractSocket::SocketError err) { printf("DTLS error: %d\n", int(err)); });
@@ -727,6 +826,8 @@ private Q_SLOTS:
 
     void ice_started()
     {
+        if (opt_bench)
+            return;
         if (channels.count() > 1) {
             printf("Local ports: %d-%d\n", opt_localBase, opt_localBase + channels.count() - 1);
             printf("Tunnel ports: %d-%d\n", opt_localBase + 32, opt_localBase + 32 + channels.count() - 1);
@@ -746,6 +847,10 @@ private Q_SLOTS:
 
     void ice_localGatheringComplete()
     {
+        gatheringMsecs = phaseClock.elapsed();
+        if (opt_bench)
+            printf("Gathering took %lld ms.\n", gatheringMsecs);
+
         IceOffer out;
         out.user       = ice->localUfrag();
         out.pass       = ice->localPassword();
@@ -830,6 +935,7 @@ private Q_SLOTS:
         ice->setPeerUfrag(inOffer.user);
         ice->setPeerPassword(inOffer.pass);
         ice->addRemoteCandidates(inOffer.candidates);
+        checksStartedAt = phaseClock.elapsed();
         ice->startChecks();
     }
 
@@ -880,15 +986,209 @@ private Q_SLOTS:
 
     void ice_readToSendMedia()
     {
+        iceMsecs = phaseClock.elapsed() - checksStartedAt;
         printf("ICE ready to send media.\n");
+        if (opt_bench)
+            printf("ICE connect took %lld ms.\n", iceMsecs);
+
+        // both blocks offered actpass, so the initiator takes the server role and the responder the client one
         for (int i = 0; i < dtls.size(); i++) {
-            dtls[i]->setRemoteFingerprint(inOffer.dtlsFingerprint[i]);
-            if (opt_mode == 0)
-                dtls[i]->startClient();
-            else
-                dtls[i]->startServer();
+            if (opt_mode == 0) {
+                dtls[i]->setRemoteFingerprint({ inOffer.dtlsFingerprint[i], XMPP::Dtls::Active }); // starts the server
+            } else {
+                dtls[i]->setRemoteFingerprint({ inOffer.dtlsFingerprint[i], XMPP::Dtls::Passive });
+                dtls[i]->onRemoteAcceptedFingerprint(); // starts the client
+            }
+        }
+
+        if (opt_bench && dtls.isEmpty())
+            bench_connected();
+    }
+
+    void dtls_connected()
+    {
+        dtlsMsecs = phaseClock.elapsed() - checksStartedAt;
+        if (opt_bench)
+            printf("DTLS connect took %lld ms.\n", dtlsMsecs);
+        if (!opt_benchSctp) {
+            if (opt_bench)
+                bench_connected();
+            return;
+        }
+#ifdef JINGLE_SCTP
+        using namespace XMPP::Jingle;
+
+        sctp = new SCTP::Association(this);
+        connect(sctp, &SCTP::Association::readyReadOutgoing, this,
+                [this]() { dtls[0]->writeDatagram(sctp->readOutgoing()); });
+        connect(sctp, &SCTP::Association::newIncomingChannel, this,
+                [this]() { sctp_channelReady(sctp->nextChannel()); });
+        sctp->setIdSelector(opt_mode == 0 ? SCTP::IdSelector::Odd : SCTP::IdSelector::Even); // we are the dtls server
+        sctp->onTransportConnected();
+        if (opt_mode == 0) {
+            // unordered and never retransmitted, so loss and latency are those of the path, not of sctp recovery
+            auto channel = sctp->newChannel(SCTP::PartialRexmit, false, 0, 256, QLatin1String("bench"));
+            connect(channel.data(), &Connection::connected, this, [this, channel]() { sctp_channelReady(channel); });
+        }
+#endif
+    }
+
+#ifdef JINGLE_SCTP
+    void sctp_channelReady(XMPP::Jingle::Connection::Ptr channel)
+    {
+        if (sctpChannel)
+            return;
+        sctpChannel = channel;
+        sctpMsecs   = phaseClock.elapsed() - checksStartedAt;
+        printf("SCTP channel open after %lld ms.\n", sctpMsecs);
+        connect(channel.data(), &XMPP::Jingle::Connection::readyRead, this, [this]() {
+            while (sctpChannel->hasPendingDatagrams())
+                bench_datagram(sctpChannel->readDatagram().data());
+        });
+        bench_connected();
+    }
+#endif
+
+    void bench_write(const QByteArray &buf)
+    {
+#ifdef JINGLE_SCTP
+        if (sctpChannel) {
+            sctpChannel->writeDatagram(QNetworkDatagram(buf));
+            return;
+        }
+#endif
+        if (!dtls.isEmpty())
+            dtls[0]->writeDatagram(buf);
+        else
+            ice->writeDatagram(0, buf);
+    }
+
+    qint64 benchUsecs() const { return benchClock.nsecsElapsed() / 1000; }
+
+    void bench_connected()
+    {
+        if (benchConnected)
+            return;
+        benchConnected = true;
+        benchClock.start();
+        if (opt_mode != 0) {
+            printf("Waiting for the benchmark datagrams...\n");
+            return;
+        }
+
+        printf("Sending %d byte datagrams at %d/s for %d s...\n", opt_benchSize, opt_benchRate, opt_benchDuration);
+        cpuStarted = cpuUsecs();
+        benchTimer = new QTimer(this);
+        benchTimer->setTimerType(Qt::PreciseTimer);
+        connect(benchTimer, &QTimer::timeout, this, &App::bench_send);
+        benchTimer->start(1);
+        benchStarted = benchUsecs();
+    }
+
+    // paced by the clock, not the timer, so late ticks send a burst instead of lowering the rate
+    void bench_send()
+    {
+        qint64 now = benchUsecs();
+        if (now - benchStarted >= qint64(opt_benchDuration) * 1000000) {
+            benchTimer->stop();
+            benchStopped = now;
+            QTimer::singleShot(BENCH_DRAIN_MSECS, this, [this]() {
+                for (int n = 0; n < 3; ++n) // the end marker may get lost like any other one
+                    bench_write(benchPacket('E', benchSent, 0));
+                QTimer::singleShot(BENCH_DRAIN_MSECS, this, &App::bench_report);
+            });
+            return;
+        }
+
+        auto due = quint32((now - benchStarted) * opt_benchRate / 1000000);
+        while (benchSent < due)
+            bench_write(benchPacket('D', benchSent++, benchUsecs(), opt_benchSize));
+    }
+
+    void bench_datagram(const QByteArray &buf)
+    {
+        if (buf.size() < BENCH_HEADER_SIZE)
+            return;
+        char    type  = buf[0];
+        quint32 seq   = qFromBigEndian<quint32>(buf.constData() + 1);
+        qint64  usecs = qFromBigEndian<qint64>(buf.constData() + 5);
+
+        switch (type) {
+        case 'D': // responder
+            ++benchReceived;
+            benchBytesIn += buf.size();
+            bench_write(buf.left(BENCH_HEADER_SIZE).replace(0, 1, "A"));
+            break;
+        case 'E':
+            bench_write(benchPacket('R', benchReceived, benchBytesIn));
+            if (!benchReported) {
+                benchReported = true;
+                printf("Received %u of %u datagrams, %lld bytes.\n", benchReceived, seq, benchBytesIn);
+                QTimer::singleShot(BENCH_DRAIN_MSECS, this, &App::do_quit); // answer the other end markers first
+            }
+            break;
+        case 'A': // initiator
+            ++benchAcked;
+            latencies.push_back((benchUsecs() - usecs) / 2);
+            break;
+        case 'R':
+            peerReceived = seq;
+            bench_report();
+            break;
+        default:
+            break;
         }
     }
+
+    QString selectedPath() const
+    {
+        auto const selected = ice->selectedCandidates();
+        if (selected.isEmpty())
+            return QLatin1String("unknown");
+        for (auto const &c : localCandidates) {
+            if (c.component == selected[0].componentId && c.ip == selected[0].ip && c.port == selected[0].port)
+                return QString("%1 %2;%3").arg(c.type, c.ip.toString(), QString::number(c.port));
+        }
+        return QString("%1;%2").arg(selected[0].ip.toString(), QString::number(selected[0].port));
+    }
+
+    void bench_report()
+    {
+        if (benchReported)
+            return;
+        benchReported = true;
+
+        double secs  = double(benchStopped - benchStarted) / 1000000;
+        double sent  = double(benchSent) * opt_benchSize;
+        double acked = double(benchAcked) * opt_benchSize;
+        qint64 cpu   = cpuUsecs();
+
+        printf("\n");
+        printf("Path:            %s%s%s\n", qPrintable(selectedPath()), dtls.isEmpty() ? "" : ", dtls",
+               sctpMsecs >= 0 ? ", sctp" : "");
+        printf("Gathering:       %lld ms\n", gatheringMsecs);
+        printf("Connect:         ice %lld ms", iceMsecs);
+        if (dtlsMsecs >= 0)
+            printf(", dtls %lld ms", dtlsMsecs);
+        if (sctpMsecs >= 0)
+            printf(", sctp %lld ms", sctpMsecs);
+        printf(" (since the checks started)\n");
+        printf("Sent:            %u datagrams, %.2f Mbit/s\n", benchSent, secs > 0 ? sent * 8 / secs / 1e6 : 0);
+        printf("Echoed:          %u datagrams, %.2f Mbit/s\n", benchAcked, secs > 0 ? acked * 8 / secs / 1e6 : 0);
+        if (peerReceived >= 0)
+            printf("Loss:            %.2f%% one-way, %.2f%% round trip\n",
+                   benchSent ? 100.0 * (benchSent - qMin(peerReceived, qint64(benchSent))) / benchSent : 0,
+                   benchSent ? 100.0 * (benchSent - benchAcked) / benchSent : 0);
+        else
+            printf("Loss:            %.2f%% round trip (no report from the responder)\n",
+                   benchSent ? 100.0 * (benchSent - benchAcked) / benchSent : 0);
+        printf("Latency:         p50 %.2f ms, p99 %.2f ms (half the round trip)\n",
+               percentile(latencies, 50) / 1000.0, percentile(latencies, 99) / 1000.0);
+        if (cpu >= 0 && cpuStarted >= 0 && sent > 0)
+            printf("CPU:             %.2f ms per MB sent\n", double(cpu - cpuStarted) / 1000 / (sent / 1e6));
+
+        do_quit();
+    }
 };
 
 void usage()
@@ -896,6 +1196,7 @@ void usage()
     printf("icetunnel: create a peer-to-peer UDP tunnel based on ICE\n");
     printf("usage: icetunnel initiator (options)\n");
     printf("       icetunnel responder (options)\n");
+    printf("       icetunnel bench initiator|responder (options)\n");
     printf("\n");
     printf(" --localbase=[n]     local base port (default=60000)\n");
     printf(" --icebase=[n]       ICE base port (default=0 (None))\n");
@@ -908,6 +1209,13 @@ void usage()
     printf(" --ipv6-only         only use IPv6 network interface addresses\n");
     printf(" --relay-udp-only    only offer UDP relay candidate\n");
     printf(" --relay-tcp-only    only offer TCP relay candidate\n");
+    printf(" --no-dtls           send plain datagrams even if DTLS is supported\n");
+    printf("\n");
+    printf("bench: the initiator sends datagrams over the first channel, the responder echoes their headers\n");
+    printf(" --bench-size=[n]     datagram size in bytes (default=1000)\n");
+    printf(" --bench-rate=[n]     datagrams per second (default=1000)\n");
+    printf(" --bench-duration=[n] seconds to send for (default=10)\n");
+    printf(" --bench-sctp         send over an unreliable, unordered SCTP data channel\n");
     printf("\n");
 }
 
@@ -931,6 +1239,10 @@ int main(int argc, char **argv)
     bool                 relay_udp_only = false;
     bool                 relay_tcp_only = false;
     bool                 enable_dtls    = true;
+    int                  benchSize      = 1000;
+    int                  benchRate      = 1000;
+    int                  benchDuration  = 10;
+    bool                 benchSctp      = false;
 
     for (int n = 0; n < args.count(); ++n) {
         QString s = args[n];
@@ -985,6 +1297,28 @@ int main(int argc, char **argv)
             relay_tcp_only = true;
         else if (var == "dtls")
             enable_dtls = true;
+        else if (var == "no-dtls")
+            enable_dtls = false;
+        else if (var == "bench-size") {
+            benchSize = val.toInt();
+            if (benchSize < BENCH_HEADER_SIZE || benchSize > 65000) {
+                fprintf(stderr, "Datagram size must be between %d-65000.\n", BENCH_HEADER_SIZE);
+                return 1;
+            }
+        } else if (var == "bench-rate") {
+            benchRate = val.toInt();
+            if (benchRate < 1) {
+                fprintf(stderr, "Datagram rate must be positive.\n");
+                return 1;
+            }
+        } else if (var == "bench-duration") {
+            benchDuration = val.toInt();
+            if (benchDuration < 1) {
+                fprintf(stderr, "Duration must be positive.\n");
+                return 1;
+            }
+        } else if (var == "bench-sctp")
+            benchSctp = true;
         else
             known = false;
 
@@ -1007,6 +1341,26 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    bool bench = args[0] == "bench";
+    if (bench)
+        args.removeFirst();
+    if (args.isEmpty()) {
+        usage();
+        return 1;
+    }
+
+    if (benchSctp) {
+#ifdef JINGLE_SCTP
+        if (!enable_dtls) {
+            fprintf(stderr, "Cannot use --bench-sctp with --no-dtls.\n");
+            return 1;
+        }
+#else
+        fprintf(stderr, "Built without SCTP support.\n");
+        return 1;
+#endif
+    }
+
     int mode = -1;
     if (args[0] == "initiator")
         mode = 0;
@@ -1027,7 +1381,7 @@ int main(int argc, char **argv)
     app.opt_mode           = mode;
     app.opt_localBase      = localBase;
     app.opt_iceBase        = iceBase;
-    app.opt_channels       = channels;
+    app.opt_channels       = bench ? 1 : channels;
     app.opt_stunHost       = stunHost;
     app.opt_stunPort       = stunPort;
     app.opt_stunType       = stunType;
@@ -1036,6 +1390,12 @@ int main(int argc, char **argv)
     app.opt_ipv6_only      = ipv6_only;
     app.opt_relay_udp_only = relay_udp_only;
     app.opt_relay_tcp_only = relay_tcp_only;
+    app.opt_dtls           = enable_dtls;
+    app.opt_bench          = bench;
+    app.opt_benchSize      = benchSize;
+    app.opt_benchRate      = benchRate;
+    app.opt_benchDuration  = benchDuration;
+    app.opt_benchSctp      = benchSctp;
 
     QObject::connect(&app, SIGNAL(quit()), &qapp, SLOT(quit()));
     QTimer::singleShot(0, &app, SLOT(start()));
@@ -0,0 +1,1024 @@
+/*
+ * iris-loadgen - runs many XMPP clients with a scripted workload against a test server
+ * Copyright (C) 2026  Psi IM Team
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "xmpp/xmpp-im/filetransfer.h"
+#include "xmpp/xmpp-im/jingle-file.h"
+#include "xmpp/xmpp-im/jingle-ft.h"
+#include "xmpp/xmpp-im/jingle-session.h"
+#include "xmpp/xmpp-im/s5b.h"
+#include "xmpp/xmpp-im/xmpp_caps.h"
+#include "xmpp/xmpp-im/xmpp_discoinfotask.h"
+#include "xmpp/xmpp-im/xmpp_xmlcommon.h"
+
+#include <iris/metrics.h>
+#include <iris/xmpp.h>
+#include <iris/xmpp_client.h>
+#include <iris/xmpp_clienthost.h>
+#include <iris/xmpp_mamtask.h>
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QPointer>
+#include <QThread>
+#include <QTimer>
+#include <QtCrypto>
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <vector>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef QCA_STATIC
+#include <QtPlugin>
+Q_IMPORT_PLUGIN(qca_ossl)
+#endif
+
+using namespace XMPP;
+
+#define LOADGEN_RESOURCE "loadgen"
+// a step which doesn't progress for this long counts as failed and the script goes on
+#define LOADGEN_STEP_TIMEOUT 60000
+// between the attempts to reach a transfer peer which isn't online yet
+#define LOADGEN_PEER_RETRY 1000
+
+// user + system time of the process. -1 where we can't tell
+static qint64 cpuUsecs()
+{
+#ifdef Q_OS_UNIX
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        return (qint64(ru.ru_utime.tv_sec) + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+    return -1;
+}
+
+// resident set size. -1 where we can't tell
+static qint64 rssBytes()
+{
+#ifdef Q_OS_UNIX
+    QFile f(QStringLiteral("/proc/self/statm"));
+    if (f.open(QIODevice::ReadOnly)) {
+        auto fields = f.readAll().split(' ');
+        if (fields.size() > 1)
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return -1;
+}
+
+// position p (0-100) of the sorted values
+static qint64 percentile(std::vector<qint64> &values, int p)
+{
+    auto at = values.begin() + (values.size() - 1) * size_t(p) / 100;
+    std::nth_element(values.begin(), at, values.end());
+    return *at;
+}
+
+//----------------------------------------------------------------------------
+// Stats
+//----------------------------------------------------------------------------
+// what all the accounts measured, by kind. filled from the worker threads
+class Stats {
+public:
+    struct Series {
+        std::vector<qint64> usecs;
+        qint64              bytes    = 0; // transfers only
+        int                 failures = 0;
+    };
+
+    void record(const char *kind, qint64 usecs, qint64 bytes = 0)
+    {
+        QMutexLocker locker(&mutex);
+        auto        &s = series[kind];
+        s.usecs.push_back(usecs);
+        s.bytes += bytes;
+    }
+
+    void fail(const char *kind)
+    {
+        QMutexLocker locker(&mutex);
+        ++series[kind].failures;
+    }
+
+    void print()
+    {
+        QMutexLocker locker(&mutex);
+        printf("%-10s %8s %8s %10s %10s %10s %12s\n", "kind", "ok", "failed", "p50 ms", "p99 ms", "max ms", "KiB/s");
+        for (auto &it : series) {
+            auto &s = it.second;
+            if (s.usecs.empty()) {
+                printf("%-10s %8d %8d\n", it.first.constData(), 0, s.failures);
+                continue;
+            }
+            qint64 total = 0;
+            for (auto v : s.usecs)
+                total += v;
+            double p50 = percentile(s.usecs, 50) / 1000.0;
+            double p99 = percentile(s.usecs, 99) / 1000.0;
+            double max = *std::max_element(s.usecs.begin(), s.usecs.end()) / 1000.0;
+            printf("%-10s %8d %8d %10.2f %10.2f %10.2f", it.first.constData(), int(s.usecs.size()), s.failures, p50,
+                   p99, max);
+            if (s.bytes && total)
+                printf(" %12.1f", double(s.bytes) / 1024 / (double(total) / 1000000));
+            printf("\n");
+        }
+    }
+
+private:
+    QMutex                       mutex;
+    std::map<QByteArray, Series> series; // ordered for the report
+};
+
+//----------------------------------------------------------------------------
+// Script
+//----------------------------------------------------------------------------
+/*
+One step per line, run in order by every account once it is logged in. '#' starts a comment.
+In the arguments %i is replaced with the index of the account, %n with its node and %d with its domain.
+
+  wait <msecs>
+  ping <count>               iq round trips to the server (XEP-0199)
+  message <count>            messages to our own full jid, the round trip through the server
+  presence <count> <msecs>   presence updates, timed until the server reflects each of them back to us
+  muc <room@service> [nick]  join a room, timed until our own presence comes back
+  mam <count>                fetch up to count messages from our own archive
+  ibb <bytes>                file transfer (XEP-0096 over IBB) with the paired account
+  jingle <bytes>             Jingle file transfer with the paired account
+
+Accounts are paired 0-1, 2-3 and so on. In a transfer step the even one sends and the odd one waits for it.
+*/
+struct Step {
+    QString     command;
+    QStringList args;
+};
+
+static const char *builtinWorkload(const QString &name)
+{
+    if (name == "login")
+        return "wait 1000\n";
+    if (name == "chat")
+        return "ping 50\nmessage 50\n";
+    if (name == "presence")
+        return "presence 100 100\n";
+    if (name == "muc")
+        return "muc loadgen@conference.%d\nwait 5000\n";
+    if (name == "ibb")
+        return "ibb 1048576\n";
+    if (name == "jingle")
+        return "jingle 1048576\n";
+    if (name == "mam")
+        return "message 20\nmam 100\n";
+    return nullptr;
+}
+
+static QList<Step> parseScript(const QString &text, QString *error)
+{
+    static const QHash<QString, QPair<int, int>> commands // minimum and maximum number of arguments
+        = { { "wait", { 1, 1 } },     { "ping", { 1, 1 } }, { "message", { 1, 1 } }, { "presence", { 2, 2 } },
+            { "muc", { 1, 2 } },      { "mam", { 1, 1 } },  { "ibb", { 1, 1 } },     { "jingle", { 1, 1 } } };
+
+    QList<Step> steps;
+    const auto  lines = text.split('\n');
+    for (int n = 0; n < lines.size(); ++n) {
+        auto line = lines[n].section('#', 0, 0).simplified();
+        if (line.isEmpty())
+            continue;
+        auto words = line.split(' ');
+        Step step { words.takeFirst(), words };
+        auto it = commands.constFind(step.command);
+        if (it == commands.constEnd()) {
+            *error = QString("line %1: unknown step '%2'").arg(n + 1).arg(step.command);
+            return {};
+        }
+        if (step.args.size() < it->first || step.args.size() > it->second) {
+            *error = QString("line %1: wrong number of arguments for '%2'").arg(n + 1).arg(step.command);
+            return {};
+        }
+        if (step.command != "muc") {
+            for (auto const &a : std::as_const(step.args)) {
+                bool ok;
+                if (a.toLongLong(&ok) < 0 || !ok) {
+                    *error = QString("line %1: '%2' is not a number").arg(n + 1).arg(a);
+                    return {};
+                }
+            }
+        }
+        steps += step;
+    }
+    return steps;
+}
+
+//----------------------------------------------------------------------------
+// NullDevice
+//----------------------------------------------------------------------------
+// reads size zero bytes, drops whatever is written
+class NullDevice : public QIODevice {
+    Q_OBJECT
+public:
+    NullDevice(qint64 size, QObject *parent) : QIODevice(parent), left(size) { open(QIODevice::ReadWrite); }
+
+    bool   isSequential() const override { return true; }
+    qint64 bytesAvailable() const override { return left + QIODevice::bytesAvailable(); }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        qint64 size = qMin(maxSize, left);
+        memset(data, 0, size_t(size));
+        left -= size;
+        return size ? size : -1;
+    }
+
+    qint64 writeData(const char *, qint64 maxSize) override { return maxSize; }
+
+private:
+    qint64 left;
+};
+
+//----------------------------------------------------------------------------
+// PingTask
+//----------------------------------------------------------------------------
+class PingTask : public Task {
+    Q_OBJECT
+public:
+    PingTask(Task *parent) : Task(parent) { }
+
+    void ping(const Jid &to)
+    {
+        this->to = to;
+        iq       = createIQ(doc(), "get", to.full(), id());
+        iq.appendChild(doc()->createElementNS("urn:xmpp:ping", "ping"));
+    }
+
+    void onGo() { send(iq); }
+
+    bool take(const QDomElement &x)
+    {
+        if (!iqVerify(x, to, id()))
+            return false;
+
+        if (x.attribute("type") == "result")
+            setSuccess();
+        else
+            setError(x);
+        return true;
+    }
+
+private:
+    Jid         to;
+    QDomElement iq;
+};
+
+//----------------------------------------------------------------------------
+// Account
+//----------------------------------------------------------------------------
+struct Options {
+    QString     host; // to connect to instead of the one of the jid
+    int         port     = 0;
+    bool        insecure = false; // accept any certificate and plain auth
+    QList<Step> script;
+};
+
+// one client running the script. lives in the thread of its client
+class Account : public QObject {
+    Q_OBJECT
+public:
+    Account(int index, const Jid &jid, const Jid &pair, const QString &password, const Options &options,
+            Stats *stats) :
+        index(index), jid(jid), pair(pair), password(password), options(options), stats(stats)
+    {
+        client = new Client;
+        client->setClientName(QStringLiteral("iris-loadgen"));
+        client->setFileTransferEnabled(true);
+        // the workload is about IBB, S5B would connect directly or through a proxy
+        client->fileTransferManager()->setDisabled(S5BManager::ns());
+
+        stepTimer = new QTimer(this);
+        stepTimer->setSingleShot(true);
+        stepTimer->setInterval(LOADGEN_STEP_TIMEOUT);
+        connect(stepTimer, &QTimer::timeout, this, [this]() {
+            stats->fail(stepKind());
+            nextStep();
+        });
+    }
+
+    // in the thread of the client
+    ~Account()
+    {
+        delete client; // it refers to the stream
+        delete stream;
+        delete tls; // and this the tls handler
+        delete connector;
+    }
+
+    Client *xmppClient() const { return client; }
+
+public slots:
+    void start()
+    {
+        connector = new AdvancedConnector;
+        if (!options.host.isEmpty())
+            connector->setOptHostPort(options.host, quint16(options.port));
+        if (QCA::isSupported("tls")) {
+            tls        = new QCA::TLS;
+            tlsHandler = new QCATLSHandler(tls);
+            tlsHandler->setXMPPCertCheck(true);
+            tls->setTrustedCertificates(QCA::systemStore());
+            connect(tlsHandler, &QCATLSHandler::tlsHandshaken, this, &Account::tls_handshaken);
+        }
+        stream = new ClientStream(connector, tlsHandler);
+        stream->setAllowPlain(options.insecure ? ClientStream::AllowPlain : ClientStream::AllowPlainOverTLS);
+        connect(stream, &ClientStream::needAuthParams, this, &Account::cs_needAuthParams);
+        connect(stream, &ClientStream::authenticated, this, &Account::cs_authenticated);
+        connect(stream, &ClientStream::warning, stream, &ClientStream::continueAfterWarning);
+        connect(stream, &ClientStream::error, this, &Account::cs_error);
+
+        connect(client, &Client::rosterRequestFinished, this, &Account::client_rosterRequestFinished);
+        connect(client, &Client::messageReceived, this, &Account::client_messageReceived);
+        connect(client, &Client::resourceAvailable, this, &Account::client_resourceAvailable);
+        connect(client, &Client::groupChatJoined, this, &Account::client_groupChatJoined);
+        connect(client, &Client::groupChatError, this, &Account::client_groupChatError);
+        connect(client->fileTransferManager(), &FileTransferManager::incomingReady, this,
+                &Account::ftman_incomingReady);
+        auto const &script = options.script;
+        if (std::any_of(script.begin(), script.end(), [](auto const &s) { return s.command == "jingle"; }))
+            connect(client->jingleManager(), &Jingle::Manager::incomingSession, this,
+                    &Account::jingle_incomingSession);
+
+        clock.start();
+        client->connectToServer(stream, jid);
+    }
+
+signals:
+    void online(int index);
+    void finished(int index, bool ok);
+
+private slots:
+    void tls_handshaken()
+    {
+        if (!options.insecure
+            && (tls->peerIdentityResult() != QCA::TLS::Valid || !tlsHandler->certMatchesHostname())) {
+            fprintf(stderr, "%s: invalid certificate, use --insecure to accept it\n", qPrintable(jid.full()));
+            fail("connect");
+            return;
+        }
+        tlsHandler->continueAfterHandshake();
+    }
+
+    void cs_needAuthParams(bool user, bool pass, bool realm)
+    {
+        if (user)
+            stream->setUsername(jid.node());
+        if (pass)
+            stream->setPassword(password);
+        if (realm)
+            stream->setRealm(jid.domain());
+        stream->continueAfterParams();
+    }
+
+    void cs_authenticated()
+    {
+        stats->record("connect", clock.nsecsElapsed() / 1000);
+        authenticated = true;
+        client->start(jid.domain(), jid.node(), password, jid.resource());
+        clock.start();
+        client->rosterRequest();
+    }
+
+    void cs_error(int err)
+    {
+        if (done)
+            return;
+        fprintf(stderr, "%s: stream error %d\n", qPrintable(jid.full()), err);
+        fail(authenticated ? "stream" : "connect");
+    }
+
+    void client_rosterRequestFinished(bool success)
+    {
+        if (!success) {
+            fail("roster");
+            return;
+        }
+        stats->record("roster", clock.nsecsElapsed() / 1000);
+        client->setPresence(Status());
+        emit online(index);
+        step = -1;
+        nextStep();
+    }
+
+    void client_messageReceived(const Message &m)
+    {
+        if (stepCommand() == "message" && m.id() == pendingId)
+            roundTrip();
+    }
+
+    void client_resourceAvailable(const Jid &j, const Resource &r)
+    {
+        if (stepCommand() == "presence" && j.compare(client->jid()) && r.status().status() == pendingId)
+            roundTrip();
+    }
+
+    void client_groupChatJoined(const Jid &room)
+    {
+        if (stepCommand() == "muc" && room.compare(Jid(pendingId), false)) {
+            stats->record("muc", clock.nsecsElapsed() / 1000);
+            nextStep();
+        }
+    }
+
+    void client_groupChatError(const Jid &room, int, const QString &)
+    {
+        if (stepCommand() == "muc" && room.compare(Jid(pendingId), false)) {
+            stats->fail("muc");
+            nextStep();
+        }
+    }
+
+    // incoming transfers are accepted whenever they come, the ibb and jingle steps of the receiver just wait
+    // for them
+    void ftman_incomingReady()
+    {
+        auto ft = client->fileTransferManager()->takeIncoming();
+        if (!ft)
+            return;
+        ft->setParent(this);
+        auto received = std::make_shared<qint64>(0);
+        connect(ft, &FileTransfer::readyRead, this, [this, ft, received](const QByteArray &a) {
+            *received += a.size();
+            if (*received >= ft->fileSize()) {
+                ft->deleteLater();
+                transferReceived();
+            }
+        });
+        connect(ft, &FileTransfer::error, ft, &QObject::deleteLater);
+        ft->accept();
+    }
+
+    void jingle_incomingSession(Jingle::Session *session)
+    {
+        for (auto content : session->contentList()) {
+            if (content->pad()->ns() != Jingle::FileTransfer::NS)
+                continue;
+            auto app = static_cast<Jingle::FileTransfer::Application *>(content);
+            connect(app, &Jingle::FileTransfer::Application::deviceRequested, this,
+                    [app](quint64, std::optional<quint64>) { app->setDevice(new NullDevice(0, app), false); });
+            connect(app, &Jingle::Application::stateChanged, this, [this, app](Jingle::State state) {
+                if (state == Jingle::State::Finished && app->lastReason().condition() == Jingle::Reason::Success)
+                    transferReceived();
+            });
+        }
+        session->accept();
+    }
+
+private:
+    const Step *currentStep() const
+    {
+        return step >= 0 && step < options.script.size() ? &options.script[step] : nullptr;
+    }
+
+    QString stepCommand() const
+    {
+        auto s = currentStep();
+        return s ? s->command : QString();
+    }
+
+    const char *stepKind() const
+    {
+        static const QHash<QString, const char *> kinds
+            = { { "ping", "ping" }, { "message", "message" }, { "presence", "presence" }, { "muc", "muc" },
+                { "mam", "mam" },   { "ibb", "ibb" },         { "jingle", "jingle" } };
+        return kinds.value(stepCommand(), "wait");
+    }
+
+    qint64 arg(int n) const { return currentStep()->args.value(n).toLongLong(); }
+
+    QString expand(QString s) const
+    {
+        return s.replace("%i", QString::number(index)).replace("%n", jid.node()).replace("%d", jid.domain());
+    }
+
+    void fail(const char *kind)
+    {
+        stats->fail(kind);
+        finish(false);
+    }
+
+    void finish(bool ok)
+    {
+        if (done)
+            return;
+        done = true;
+        stepTimer->stop();
+        ++serial;
+        if (client->isActive())
+            client->groupChatLeaveAll();
+        client->close();
+        emit finished(index, ok);
+    }
+
+    void nextStep()
+    {
+        ++serial; // late answers of the previous step are dropped
+        ++step;
+        stepTimer->start();
+        auto s = currentStep();
+        if (!s) {
+            finish(true);
+            return;
+        }
+
+        clock.start();
+        remaining = int(arg(0));
+        if (s->command == "wait") {
+            QTimer::singleShot(int(arg(0)), this, guarded([this]() { nextStep(); }));
+        } else if (s->command == "ping" || s->command == "message" || s->command == "presence") {
+            roundTrip(true);
+        } else if (s->command == "muc") {
+            Jid room(expand(s->args[0]));
+            pendingId = room.bare();
+            client->groupChatJoin(room.domain(), room.node(),
+                                  s->args.size() > 1 ? expand(s->args[1]) : jid.node() + QString::number(index));
+        } else if (s->command == "mam") {
+            auto task = new MAMTask(client->rootTask());
+            connect(task, &Task::finished, this, guarded([this, task]() {
+                        if (task->success())
+                            stats->record("mam", clock.nsecsElapsed() / 1000);
+                        else
+                            stats->fail("mam");
+                        nextStep();
+                    }));
+            task->get(Jid(), QDateTime(), QDateTime(), false, 50, remaining);
+            task->go(true);
+        } else if (s->command == "ibb" || s->command == "jingle") {
+            transferStep();
+        }
+    }
+
+    // wraps a callback of a step to do nothing once the step is over
+    template <typename F> std::function<void()> guarded(F f)
+    {
+        return [this, f, serial = serial]() {
+            if (serial == this->serial)
+                f();
+        };
+    }
+
+    // ping, message and presence: one request at a time, the next one goes when the answer is in
+    void roundTrip(bool first = false)
+    {
+        auto command = stepCommand();
+        if (!first) {
+            stats->record(stepKind(), clock.nsecsElapsed() / 1000);
+            stepTimer->start();
+        }
+        if (remaining-- <= 0) {
+            nextStep();
+            return;
+        }
+        if (command == "presence" && !first) {
+            QTimer::singleShot(int(arg(1)), this, guarded([this]() { sendRequest(); }));
+            return;
+        }
+        sendRequest();
+    }
+
+    void sendRequest()
+    {
+        auto command = stepCommand();
+        pendingId    = QString("lg%1-%2").arg(index).arg(++requests);
+        clock.start();
+        if (command == "ping") {
+            auto task = new PingTask(client->rootTask());
+            connect(task, &Task::finished, this, guarded([this, task]() {
+                        if (task->success()) {
+                            roundTrip();
+                        } else {
+                            stats->fail("ping");
+                            nextStep();
+                        }
+                    }));
+            task->ping(Jid(jid.domain()));
+            task->go(true);
+        } else if (command == "message") {
+            Message m(client->jid());
+            m.setId(pendingId);
+            m.setType(Message::Type::Chat);
+            m.setBody(QStringLiteral("iris-loadgen"));
+            client->sendMessage(m);
+        } else if (command == "presence") {
+            Status s;
+            s.setStatus(pendingId);
+            client->setPresence(s);
+        }
+    }
+
+    void transferStep()
+    {
+        if (pair.isEmpty()) { // the odd one out
+            nextStep();
+            return;
+        }
+        if (index % 2) {
+            if (transfersReceived > transfersConsumed) {
+                ++transfersConsumed;
+                nextStep();
+            }
+            return; // the step timer fails it if nothing comes
+        }
+        if (stepCommand() == "ibb")
+            sendIbb();
+        else
+            discoPeer();
+    }
+
+    void transferReceived()
+    {
+        ++transfersReceived;
+        auto command = stepCommand();
+        if ((command == "ibb" || command == "jingle") && index % 2 && transfersReceived > transfersConsumed) {
+            ++transfersConsumed;
+            nextStep();
+        }
+    }
+
+    void retryTransfer(std::function<void()> &&retry)
+    {
+        // the peer may still be logging in. the step timer ends it if it never comes
+        QTimer::singleShot(LOADGEN_PEER_RETRY, this, guarded(std::move(retry)));
+    }
+
+    void sendIbb()
+    {
+        qint64 size = arg(0);
+        auto   ft   = client->fileTransferManager()->createTransfer();
+        ft->setParent(this);
+        auto sent = std::make_shared<qint64>(0);
+        auto pump = [ft]() {
+            while (int n = ft->dataSizeNeeded())
+                ft->writeFileData(QByteArray(n, 0));
+        };
+        connect(ft, &FileTransfer::connected, ft, pump);
+        connect(ft, &FileTransfer::bytesWritten, this, [this, ft, sent, size, pump, s = serial](qint64 x) {
+            *sent += x;
+            if (*sent < size) {
+                pump();
+                return;
+            }
+            ft->deleteLater();
+            if (s == serial) {
+                stats->record("ibb", clock.nsecsElapsed() / 1000, size);
+                nextStep();
+            }
+        });
+        connect(ft, &FileTransfer::error, this, [this, ft, s = serial](int) {
+            ft->deleteLater();
+            if (s == serial)
+                retryTransfer([this]() { sendIbb(); });
+        });
+        Thumbnail thumb;
+        ft->sendFile(pair, QStringLiteral("loadgen.bin"), size, QString(), thumb);
+    }
+
+    // Jingle picks the transports by the features of the peer, which we don't get from presence as the
+    // accounts aren't subscribed to each other
+    void discoPeer()
+    {
+        auto task = new DiscoInfoTask(client->rootTask());
+        connect(task, &Task::finished, this, guarded([this, task]() {
+                    if (!task->success()) {
+                        retryTransfer([this]() { discoPeer(); });
+                        return;
+                    }
+                    client->capsManager()->updateDisco(pair, task->item());
+                    sendJingle();
+                }));
+        task->get(pair);
+        task->go(true);
+    }
+
+    void sendJingle()
+    {
+        qint64 size    = arg(0);
+        auto   session = client->jingleManager()->newSession(pair);
+        auto   app     = static_cast<Jingle::FileTransfer::Application *>(
+            session->newContent(Jingle::FileTransfer::NS, session->role()));
+        if (!app) {
+            stats->fail("jingle");
+            nextStep();
+            return;
+        }
+        Jingle::FileTransfer::File file;
+        file.setName(QStringLiteral("loadgen.bin"));
+        file.setSize(quint64(size));
+        app->setFile(file);
+        connect(app, &Jingle::FileTransfer::Application::deviceRequested, this,
+                [app](quint64, std::optional<quint64> bytes) {
+                    app->setDevice(new NullDevice(qint64(bytes.value_or(0)), app), false);
+                });
+        connect(app, &Jingle::Application::stateChanged, this, guarded([this, app, size]() {
+                    if (app->state() != Jingle::State::Finished)
+                        return;
+                    if (app->lastReason().condition() == Jingle::Reason::Success)
+                        stats->record("jingle", clock.nsecsElapsed() / 1000, size);
+                    else
+                        stats->fail("jingle");
+                    nextStep();
+                }));
+        session->addContent(app);
+        session->initiate();
+    }
+
+    int     index;
+    Jid     jid;
+    Jid     pair; // empty for the last one of an odd number of accounts
+    QString password;
+    Options options;
+    Stats  *stats;
+
+    Client            *client     = nullptr;
+    AdvancedConnector *connector  = nullptr;
+    QCA::TLS          *tls        = nullptr;
+    QCATLSHandler     *tlsHandler = nullptr;
+    ClientStream      *stream     = nullptr;
+
+    QElapsedTimer clock; // of the request or step in flight
+    QTimer       *stepTimer;
+    QString       pendingId; // of the request in flight, the room of a join
+    int           step              = -1;
+    int           serial            = 0; // of the current step
+    int           remaining         = 0;
+    int           requests          = 0;
+    int           transfersReceived = 0;
+    int           transfersConsumed = 0;
+    bool          authenticated     = false;
+    bool          done              = false;
+};
+
+//----------------------------------------------------------------------------
+// LoadGen
+//----------------------------------------------------------------------------
+class LoadGen : public QObject {
+    Q_OBJECT
+public:
+    int     accounts = 1;
+    int     first    = 1;
+    int     ramp     = 10; // logins per second
+    int     threads  = 0;
+    QString jidTemplate;
+    QString password;
+    Options options;
+
+    ~LoadGen()
+    {
+        for (auto a : std::as_const(list)) {
+            if (a->thread() == thread())
+                delete a;
+            else
+                QMetaObject::invokeMethod(a, [a]() { delete a; }, Qt::BlockingQueuedConnection);
+        }
+        delete pool;
+    }
+
+public slots:
+    void start()
+    {
+        if (threads > 0)
+            pool = new ClientWorkerPool(threads, this);
+        else
+            host = new ClientHost(this);
+
+        rssStarted = rssBytes();
+        cpuStarted = cpuUsecs();
+        Metrics::reset();
+        wall.start();
+
+        printf("Logging in %d accounts, %d per second...\n", accounts, ramp);
+        auto timer = new QTimer(this);
+        connect(timer, &QTimer::timeout, this, [this, timer]() {
+            if (list.size() == accounts) {
+                timer->stop();
+                return;
+            }
+            startAccount(list.size());
+        });
+        timer->start(qMax(1, 1000 / ramp));
+    }
+
+signals:
+    void quit();
+
+private:
+    Jid accountJid(int n) const
+    {
+        Jid j(QString(jidTemplate).replace("%1", QString::number(first + n)));
+        return j.withResource(QStringLiteral(LOADGEN_RESOURCE));
+    }
+
+    void startAccount(int n)
+    {
+        Jid pair = (n % 2 == 0 && n + 1 == accounts) ? Jid() : accountJid(n ^ 1);
+        auto a = new Account(n, accountJid(n), pair, QString(password).replace("%1", QString::number(first + n)),
+                             options, &stats);
+        list += a;
+        connect(a, &Account::online, this, &LoadGen::account_online);
+        connect(a, &Account::finished, this, &LoadGen::account_finished);
+
+        if (pool) {
+            a->moveToThread(pool->assign(a->xmppClient()));
+        } else {
+            host->addClient(a->xmppClient());
+        }
+        QMetaObject::invokeMethod(a, "start", Qt::QueuedConnection);
+    }
+
+    void account_online()
+    {
+        if (++online + finished_ == accounts)
+            sampleMemory();
+    }
+
+    void account_finished(int, bool ok)
+    {
+        if (!ok)
+            ++failed;
+        ++finished_;
+        if (rssOnline < 0 && online + finished_ >= accounts)
+            sampleMemory();
+        if (finished_ < accounts)
+            return;
+
+        report();
+        emit quit();
+    }
+
+    // all the accounts are either logged in or failed now
+    void sampleMemory()
+    {
+        if (rssOnline < 0)
+            rssOnline = rssBytes();
+    }
+
+    void report()
+    {
+        qint64 cpu = cpuUsecs();
+
+        printf("\n%d accounts, %d failed, %.1f s\n\n", accounts, failed, wall.elapsed() / 1000.0);
+        stats.print();
+        printf("\n");
+        if (rssStarted >= 0 && rssOnline >= 0 && online > 0)
+            printf("Memory per account: %.1f KiB\n", double(rssOnline - rssStarted) / 1024 / online);
+        if (Metrics::isEnabled()) {
+            quint64 stanzas = Metrics::counter(Metrics::StanzasParsed) + Metrics::counter(Metrics::StanzasSerialized);
+            if (stanzas && cpu >= 0 && cpuStarted >= 0)
+                printf("CPU per stanza: %.1f us (%llu stanzas)\n", double(cpu - cpuStarted) / stanzas,
+                       (unsigned long long)stanzas);
+        } else {
+            printf("CPU per stanza: needs a library built with IRIS_ENABLE_METRICS\n");
+        }
+        if (cpu >= 0 && cpuStarted >= 0)
+            printf("CPU: %.1f s\n", double(cpu - cpuStarted) / 1000000);
+    }
+
+    QList<Account *>  list;
+    ClientWorkerPool *pool = nullptr;
+    ClientHost       *host = nullptr;
+    Stats             stats;
+    QElapsedTimer     wall;
+    qint64            rssStarted = -1;
+    qint64            rssOnline  = -1;
+    qint64            cpuStarted = -1;
+    int               online     = 0;
+    int               finished_  = 0;
+    int               failed     = 0;
+};
+
+void usage()
+{
+    printf("iris-loadgen: log in many accounts and run a workload on each\n");
+    printf("usage: iris-loadgen --jid=[template] --password=[template] (options)\n");
+    printf("\n");
+    printf(" --jid=[template]      account jid, %%1 is replaced with the account number, e.g. load%%1@example.com\n");
+    printf(" --password=[template] password, %%1 as above\n");
+    printf(" --accounts=[n]        number of accounts (default=1)\n");
+    printf(" --first=[n]           number of the first account (default=1)\n");
+    printf(" --ramp=[n]            logins per second (default=10)\n");
+    printf(" --threads=[n]         run the clients on n worker threads (default=0, the main thread)\n");
+    printf(" --host=[host]         server to connect to instead of the one of the jid\n");
+    printf(" --port=[n]            port of --host (default=5222)\n");
+    printf(" --insecure            accept any certificate and plain authentication\n");
+    printf(" --workload=[name]     login, chat, presence, muc, ibb, jingle or mam (default=chat)\n");
+    printf(" --script=[file]       run the steps of the file instead, see the top of main.cpp\n");
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    QCA::Initializer qcaInit;
+    QCoreApplication qapp(argc, argv);
+
+    LoadGen     app;
+    QString     workload = QStringLiteral("chat");
+    QString     scriptFile;
+    QStringList args = qapp.arguments();
+    args.removeFirst();
+
+    for (const QString &s : std::as_const(args)) {
+        if (!s.startsWith("--")) {
+            usage();
+            return 1;
+        }
+        int     x   = s.indexOf('=');
+        QString var = x != -1 ? s.mid(2, x - 2) : s.mid(2);
+        QString val = x != -1 ? s.mid(x + 1) : QString();
+
+        if (var == "jid")
+            app.jidTemplate = val;
+        else if (var == "password")
+            app.password = val;
+        else if (var == "accounts")
+            app.accounts = val.toInt();
+        else if (var == "first")
+            app.first = val.toInt();
+        else if (var == "ramp")
+            app.ramp = val.toInt();
+        else if (var == "threads")
+            app.threads = val.toInt();
+        else if (var == "host")
+            app.options.host = val;
+        else if (var == "port")
+            app.options.port = val.toInt();
+        else if (var == "insecure")
+            app.options.insecure = true;
+        else if (var == "workload")
+            workload = val;
+        else if (var == "script")
+            scriptFile = val;
+        else {
+            fprintf(stderr, "Unknown option '%s'.\n", qPrintable(var));
+            return 1;
+        }
+    }
+
+    if (app.jidTemplate.isEmpty() || !Jid(QString(app.jidTemplate).replace("%1", "1")).isValid()) {
+        usage();
+        return 1;
+    }
+    if (app.accounts < 1 || app.ramp < 1 || app.threads < 0) {
+        fprintf(stderr, "--accounts and --ramp must be positive, --threads not negative.\n");
+        return 1;
+    }
+    if (!app.options.host.isEmpty() && app.options.port <= 0)
+        app.options.port = 5222;
+
+    QString script;
+    if (!scriptFile.isEmpty()) {
+        QFile f(scriptFile);
+        if (!f.open(QIODevice::ReadOnly)) {
+            fprintf(stderr, "Unable to read %s.\n", qPrintable(scriptFile));
+            return 1;
+        }
+        script = QString::fromUtf8(f.readAll());
+    } else if (auto builtin = builtinWorkload(workload)) {
+        script = QString::fromLatin1(builtin);
+    } else {
+        fprintf(stderr, "Unknown workload '%s'.\n", qPrintable(workload));
+        return 1;
+    }
+
+    QString error;
+    app.options.script = parseScript(script, &error);
+    if (!error.isEmpty()) {
+        fprintf(stderr, "%s\n", qPrintable(error));
+        return 1;
+    }
+
+    QObject::connect(&app, &LoadGen::quit, &qapp, &QCoreApplication::quit, Qt::QueuedConnection);
+    QTimer::singleShot(0, &app, &LoadGen::start);
+    qapp.exec();
+
+    return 0;
+}
+
+#include "main.moc"
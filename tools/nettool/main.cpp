@@ -16,6 +16,9 @@
  *
  */
 
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSet>
 #include <QtCrypto>
 #include <iris/addressresolver.h>
 #include <iris/netavailability.h>
@@ -27,10 +30,16 @@
 #include <iris/stunmessage.h>
 #include <iris/stuntransaction.h>
 #include <iris/turnclient.h>
+#include <algorithm>
+#include <memory>
 #include <stdio.h>
+#include <vector>
 
 using namespace XMPP;
 
+// a lookup answered this fast never left the process, it came from one of the resolver caches
+#define BENCH_CACHE_HIT_USECS 1000
+
 static QString prompt(const QString &s)
 {
     printf("* %s ", qPrintable(s));
@@ -807,6 +816,247 @@ private slots:
     void turn_debugLine(const QString &line) { printf("%s\n", qPrintable(line)); }
 };
 
+// position p (0-100) of the sorted values
+static qint64 percentile(std::vector<qint64> &values, int p)
+{
+    if (values.empty())
+        return 0;
+    auto at = values.begin() + (values.size() - 1) * size_t(p) / 100;
+    std::nth_element(values.begin(), at, values.end());
+    return *at;
+}
+
+// resolves a list of names a number of times with a few lookups in flight. the first round is cold, the later
+// ones show how much the caches and the coalescing of identical queries take off
+class DnsBench : public QObject {
+    Q_OBJECT
+public:
+    struct Lookup {
+        QByteArray       name;
+        NameRecord::Type type = NameRecord::A;
+        QString          service; // a SRV lookup through ServiceResolver if set
+        QString          transport;
+    };
+
+    QList<Lookup> lookups;
+    int           concurrency = 10;
+    int           rounds      = 2;
+
+public slots:
+    void start()
+    {
+        connect(ProcessQuit::instance(), SIGNAL(quit()), SIGNAL(quit()));
+        startRound();
+    }
+
+signals:
+    void quit();
+
+private:
+    int                 round    = 0;
+    int                 next     = 0;
+    int                 inFlight = 0;
+    int                 failures = 0;
+    int                 hits     = 0;
+    std::vector<qint64> usecs;
+    QElapsedTimer       roundTimer;
+
+    void startRound()
+    {
+        ++round;
+        next     = 0;
+        failures = 0;
+        hits     = 0;
+        usecs.clear();
+        roundTimer.start();
+        startNext();
+    }
+
+    void startNext()
+    {
+        while (inFlight < concurrency && next < lookups.size()) {
+            const Lookup &l = lookups[next++];
+            ++inFlight;
+            auto timer = std::make_shared<QElapsedTimer>();
+            timer->start();
+            if (l.service.isEmpty()) {
+                auto dns = new NameResolver(this);
+                connect(dns, &NameResolver::resultsReady, this, [this, dns, timer](const QList<NameRecord> &) {
+                    dns->deleteLater();
+                    finished(true, timer->nsecsElapsed() / 1000);
+                });
+                connect(dns, &NameResolver::error, this, [this, dns, timer](NameResolver::Error) {
+                    dns->deleteLater();
+                    finished(false, timer->nsecsElapsed() / 1000);
+                });
+                dns->start(l.name, l.type);
+            } else {
+                // the first address is enough, it needs the SRV records and one host lookup
+                auto dns = new ServiceResolver(this);
+                connect(dns, &ServiceResolver::resultReady, this, [this, dns, timer]() {
+                    dns->disconnect(this);
+                    dns->stop();
+                    dns->deleteLater();
+                    finished(true, timer->nsecsElapsed() / 1000);
+                });
+                connect(dns, &ServiceResolver::error, this, [this, dns, timer](ServiceResolver::Error) {
+                    dns->disconnect(this);
+                    dns->deleteLater();
+                    finished(false, timer->nsecsElapsed() / 1000);
+                });
+                dns->start({ l.service }, l.transport, QString::fromLatin1(l.name));
+            }
+        }
+    }
+
+    void finished(bool ok, qint64 elapsed)
+    {
+        --inFlight;
+        if (ok) {
+            usecs.push_back(elapsed);
+            if (elapsed < BENCH_CACHE_HIT_USECS)
+                ++hits;
+        } else {
+            ++failures;
+        }
+
+        if (next < lookups.size()) {
+            startNext();
+            return;
+        }
+        if (inFlight)
+            return;
+
+        qint64 total = roundTimer.elapsed();
+        int    count = lookups.size();
+        printf("round %d: %d lookups in %lld ms (%.1f/s), %d failed, %d cache hits (%.1f%%)", round, count,
+               total, total ? count * 1000.0 / total : 0.0, failures, hits, count ? hits * 100.0 / count : 0.0);
+        if (!usecs.empty())
+            printf(", latency p50 %.2f ms, p99 %.2f ms", percentile(usecs, 50) / 1000.0,
+                   percentile(usecs, 99) / 1000.0);
+        printf("\n");
+
+        if (round < rounds)
+            startRound();
+        else
+            emit quit();
+    }
+};
+
+// fires binding requests at a STUN server through one transaction pool with a number of them in flight
+class StunBench : public QObject {
+    Q_OBJECT
+public:
+    bool         debug       = false;
+    QHostAddress addr;
+    int          port        = 3478;
+    int          count       = 1000;
+    int          concurrency = 50;
+
+    ~StunBench()
+    {
+        // make sure transactions are always deleted before the pool
+        qDeleteAll(bindings);
+    }
+
+public slots:
+    void start()
+    {
+        connect(ProcessQuit::instance(), SIGNAL(quit()), SIGNAL(quit()));
+
+        sock = new QUdpSocket(this);
+        connect(sock, &QUdpSocket::readyRead, this, &StunBench::sock_readyRead);
+        if (!sock->bind(0)) {
+            printf("Error binding to local port.\n");
+            emit quit();
+            return;
+        }
+
+        pool = StunTransactionPool::Ptr::create(StunTransaction::Udp);
+        if (debug) {
+            pool->setDebugLevel(StunTransactionPool::DL_Info);
+            connect(pool.data(), &StunTransactionPool::debugLine, this,
+                    [](const QString &line) { printf("%s\n", qPrintable(line)); });
+        }
+        connect(pool.data(), &StunTransactionPool::outgoingMessage, this,
+                [this](const QByteArray &packet, const TransportAddress &) {
+                    sock->writeDatagram(packet, addr, quint16(port));
+                });
+
+        timer.start();
+        startNext();
+    }
+
+signals:
+    void quit();
+
+private:
+    QUdpSocket              *sock = nullptr;
+    StunTransactionPool::Ptr pool;
+    QSet<StunBinding *>      bindings;
+    int                      started  = 0;
+    int                      failures = 0;
+    int                      timeouts = 0;
+    std::vector<qint64>      usecs;
+    QElapsedTimer            timer;
+
+    void sock_readyRead()
+    {
+        while (sock->hasPendingDatagrams()) {
+            QByteArray   buf(sock->pendingDatagramSize(), 0);
+            QHostAddress from;
+            quint16      fromPort;
+
+            sock->readDatagram(buf.data(), buf.size(), &from, &fromPort);
+            if (from == addr && fromPort == port)
+                pool->writeIncomingMessage(buf);
+        }
+    }
+
+    void startNext()
+    {
+        while (bindings.size() < concurrency && started < count) {
+            ++started;
+            auto binding = new StunBinding(pool.data());
+            auto rtt     = std::make_shared<QElapsedTimer>();
+            bindings += binding;
+            connect(binding, &StunBinding::success, this, [this, binding, rtt]() {
+                usecs.push_back(rtt->nsecsElapsed() / 1000);
+                finished(binding);
+            });
+            connect(binding, &StunBinding::error, this, [this, binding](StunBinding::Error e) {
+                ++failures;
+                if (e == StunBinding::ErrorTimeout)
+                    ++timeouts;
+                finished(binding);
+            });
+            rtt->start();
+            binding->start();
+        }
+    }
+
+    void finished(StunBinding *binding)
+    {
+        bindings.remove(binding);
+        binding->deleteLater();
+        if (started < count) {
+            startNext();
+            return;
+        }
+        if (!bindings.isEmpty())
+            return;
+
+        qint64 total = timer.elapsed();
+        printf("%d transactions in %lld ms (%.1f/s), %d failed (%d timed out)", count, total,
+               total ? count * 1000.0 / total : 0.0, failures, timeouts);
+        if (!usecs.empty())
+            printf(", rtt p50 %.2f ms, p99 %.2f ms", percentile(usecs, 50) / 1000.0,
+                   percentile(usecs, 99) / 1000.0);
+        printf("\n");
+        emit quit();
+    }
+};
+
 void usage()
 {
     printf("nettool: simple testing utility\n");
@@ -824,6 +1074,8 @@ void usage()
     printf(" pserv [inst] [type] [port] (attr) (-a [rec])      publish service instance\n");
     printf(" stun [addr](;port) (local port)                   STUN binding\n");
     printf(" turn [mode] [relayaddr](;port) [peeraddr](;port)  TURN UDP echo test\n");
+    printf(" dnsbench [file] (concurrency) (rounds)            time the lookups of a list of names\n");
+    printf(" stunbench [addr](;port) (count) (concurrency)     STUN binding throughput\n");
     printf("\n");
     printf("record types: a aaaa ptr srv mx txt hinfo null\n");
     printf("service types: _service._proto format (e.g. \"_xmpp-client._tcp\")\n");
@@ -831,6 +1083,7 @@ void usage()
     printf("rname -r: for null type, dump raw record data to stdout\n");
     printf("pserv -a: add extra record.  format: null:filename.dat\n");
     printf("turn modes: udp tcp tcp-tls\n");
+    printf("dnsbench: one name per line, followed by a record type or a service type for SRV\n");
     printf("\n");
 }
 
@@ -1155,6 +1408,95 @@ int main(int argc, char **argv)
         QObject::connect(&a, SIGNAL(quit()), &qapp, SLOT(quit()));
         QTimer::singleShot(0, &a, SLOT(start()));
         qapp.exec();
+    } else if (args[0] == "dnsbench") {
+        if (args.count() < 2) {
+            usage();
+            return 1;
+        }
+
+        QFile f(args[1]);
+        if (!f.open(QIODevice::ReadOnly)) {
+            printf("Error: unable to open %s\n", qPrintable(args[1]));
+            return 1;
+        }
+
+        DnsBench a;
+        while (!f.atEnd()) {
+            QString line = QString::fromUtf8(f.readLine()).simplified();
+            if (line.isEmpty() || line.startsWith('#'))
+                continue;
+            QStringList      words = line.split(' ');
+            DnsBench::Lookup l;
+            l.name = words[0].toLatin1();
+            if (words.count() >= 2 && words[1].startsWith('_')) {
+                // _service._proto
+                QStringList parts = words[1].split('.');
+                if (parts.count() != 2 || !parts[1].startsWith('_')) {
+                    printf("Error: bad service type %s\n", qPrintable(words[1]));
+                    return 1;
+                }
+                l.service   = parts[0].mid(1);
+                l.transport = parts[1].mid(1);
+            } else if (words.count() >= 2) {
+                int x = str2rtype(words[1]);
+                if (x == -1) {
+                    printf("Error: bad record type %s\n", qPrintable(words[1]));
+                    return 1;
+                }
+                l.type = NameRecord::Type(x);
+            }
+            a.lookups += l;
+        }
+        if (a.lookups.isEmpty()) {
+            printf("Error: no names in %s\n", qPrintable(args[1]));
+            return 1;
+        }
+
+        if (args.count() >= 3)
+            a.concurrency = qMax(1, args[2].toInt());
+        if (args.count() >= 4)
+            a.rounds = qMax(1, args[3].toInt());
+
+        QObject::connect(&a, SIGNAL(quit()), &qapp, SLOT(quit()));
+        QTimer::singleShot(0, &a, SLOT(start()));
+        qapp.exec();
+    } else if (args[0] == "stunbench") {
+        if (args.count() < 2) {
+            usage();
+            return 1;
+        }
+
+        QString addrstr, portstr;
+        int     x = args[1].indexOf(';');
+        if (x != -1) {
+            addrstr = args[1].mid(0, x);
+            portstr = args[1].mid(x + 1);
+        } else
+            addrstr = args[1];
+
+        QHostAddress addr = QHostAddress(addrstr);
+        if (addr.isNull()) {
+            printf("Error: addr must be an IP address\n");
+            return 1;
+        }
+
+        if (!QCA::isSupported("hmac(sha1)")) {
+            printf("Error: Need hmac(sha1) support to use STUN.\n");
+            return 1;
+        }
+
+        StunBench a;
+        a.debug = debug;
+        a.addr  = addr;
+        if (!portstr.isEmpty())
+            a.port = portstr.toInt();
+        if (args.count() >= 3)
+            a.count = qMax(1, args[2].toInt());
+        if (args.count() >= 4)
+            a.concurrency = qMax(1, args[3].toInt());
+        QObject::connect(&a, SIGNAL(quit()), &qapp, SLOT(quit()));
+        QTimer::singleShot(0, &a, SLOT(start()));
+        qapp.exec();
     } else {
         usage();
         return 1;